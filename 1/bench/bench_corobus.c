@@ -0,0 +1,706 @@
+/*
+ * Stress benchmarks of the message bus channels at different
+ * depths.
+ *
+ * Full channel: the channel is kept full, and each message is
+ * received from the head and a new one is sent to the tail, with
+ * no coroutine switches. Shows the cost of the queue itself, which
+ * must not depend on the depth.
+ *
+ * Producer/consumer: two coroutines pass messages through the
+ * channel with the blocking send and recv, each of them running
+ * until the channel is full or empty.
+ *
+ * Batches: same with send_v/recv_v by many messages at once, which
+ * wrap around the end of the ring. Batches bigger than the depth
+ * are sent by parts.
+ *
+ * Ping-pong: two coroutines bounce one message through a pair of
+ * channels of depth 1, so each round trip is two switches. Shows
+ * the latency of a send to a waiting receiver.
+ *
+ * Fan-out: one sender spreads the messages over many channels in
+ * turn, each with its own receiver.
+ *
+ * Fan-in: many senders push the messages into one channel with a
+ * single receiver.
+ *
+ * Contention: many senders and receivers on one small channel.
+ * Besides the time, shows how many times the coroutines were
+ * suspended per message.
+ *
+ * Open and close: a channel is opened and closed again and again
+ * while many others are open, and its slot is the last one.
+ *
+ * Messages: 32 byte messages go through a channel of depth 1000,
+ * either stored in the channel by value, or allocated separately
+ * with their indexes in a side table sent instead. The latter is
+ * how the bigger messages had to be sent with unsigned channels.
+ *
+ * Broadcast: one coroutine broadcasts to many channels of depth
+ * 10, each with its own receiver. Either unsigned messages, or
+ * 256 byte shared ones.
+ *
+ * Threads: producer and consumer coroutines in pairs of worker
+ * threads pass messages through one thread-safe channel.
+ *
+ * Build with 'make bench'.
+ */
+#include "corobus.h"
+#include "libcoro.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum {
+	BENCH_RUN_COUNT = 5,
+	BENCH_MSG_COUNT = 2000000,
+	BENCH_BATCH_MAX = 256,
+	BENCH_PINGPONG_COUNT = 1000000,
+	BENCH_FAN_DEPTH = 100,
+	BENCH_OPEN_COUNT = 1000000,
+	BENCH_CONTENTION_DEPTH = 10,
+	BENCH_MSG_DEPTH = 1000,
+	BENCH_BROADCAST_COUNT = 100000,
+	BENCH_BROADCAST_DEPTH = 10,
+	BENCH_SHARED_SIZE = 256,
+	BENCH_MPMC_COUNT = 1000000,
+	BENCH_MPMC_DEPTH = 1024,
+};
+
+static const size_t bench_depths[] = {10, 1000, 100000};
+static const unsigned bench_batch_sizes[] = {8, 64, 256};
+static const int bench_channel_counts[] = {1, 100, 10000};
+static const int bench_fan_counts[] = {1, 10, 100};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_double(const void *l, const void *r)
+{
+	double a = *(const double *)l;
+	double b = *(const double *)r;
+	return a < b ? -1 : a > b;
+}
+
+static void
+bench_print(const char *title, size_t param, double *times)
+{
+	qsort(times, BENCH_RUN_COUNT, sizeof(times[0]), bench_cmp_double);
+	printf("%s %zu\n", title, param);
+	printf("    min: %.2lf\n", times[0]);
+	printf("    med: %.2lf\n", times[BENCH_RUN_COUNT / 2]);
+	printf("    max: %.2lf\n", times[BENCH_RUN_COUNT - 1]);
+}
+
+static void
+bench_check(bool ok)
+{
+	if (!ok) {
+		printf("Error: bus operation failed: %d\n", coro_bus_errno());
+		exit(-1);
+	}
+}
+
+static double
+bench_full_channel(size_t depth)
+{
+	struct coro_bus *bus = coro_bus_new();
+	int ch = coro_bus_channel_open(bus, depth);
+	for (size_t i = 0; i < depth; ++i)
+		bench_check(coro_bus_try_send(bus, ch, i) == 0);
+	unsigned data;
+	uint64_t start = bench_now_ns();
+	for (unsigned i = 0; i < BENCH_MSG_COUNT; ++i) {
+		bench_check(coro_bus_try_recv(bus, ch, &data) == 0);
+		bench_check(coro_bus_try_send(bus, ch, i) == 0);
+	}
+	uint64_t duration = bench_now_ns() - start;
+	coro_bus_channel_close(bus, ch);
+	coro_bus_delete(bus);
+	return (double)duration / BENCH_MSG_COUNT;
+}
+
+struct bench_pair_ctx {
+	struct coro_bus *bus;
+	int channel;
+	unsigned batch;
+};
+
+static void *
+bench_producer_f(void *arg)
+{
+	struct bench_pair_ctx *ctx = arg;
+	unsigned data[BENCH_BATCH_MAX] = {0};
+	unsigned sent = 0;
+	while (sent < BENCH_MSG_COUNT) {
+		int rc;
+		if (ctx->batch == 1) {
+			rc = coro_bus_send(ctx->bus, ctx->channel, sent) == 0 ?
+				1 : -1;
+		} else {
+			unsigned count = BENCH_MSG_COUNT - sent;
+			if (count > ctx->batch)
+				count = ctx->batch;
+			rc = coro_bus_send_v(ctx->bus, ctx->channel, data,
+				count);
+		}
+		bench_check(rc > 0);
+		sent += rc;
+	}
+	return NULL;
+}
+
+static void *
+bench_consumer_f(void *arg)
+{
+	struct bench_pair_ctx *ctx = arg;
+	unsigned data[BENCH_BATCH_MAX];
+	unsigned received = 0;
+	while (received < BENCH_MSG_COUNT) {
+		int rc;
+		if (ctx->batch == 1) {
+			rc = coro_bus_recv(ctx->bus, ctx->channel, data) == 0 ?
+				1 : -1;
+		} else {
+			rc = coro_bus_recv_v(ctx->bus, ctx->channel, data,
+				ctx->batch);
+		}
+		bench_check(rc > 0);
+		received += rc;
+	}
+	return NULL;
+}
+
+static double
+bench_pair(size_t depth, unsigned batch)
+{
+	struct bench_pair_ctx ctx;
+	ctx.bus = coro_bus_new();
+	ctx.channel = coro_bus_channel_open(ctx.bus, depth);
+	ctx.batch = batch;
+	uint64_t start = bench_now_ns();
+	struct coro *producer = coro_new(bench_producer_f, &ctx);
+	struct coro *consumer = coro_new(bench_consumer_f, &ctx);
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start;
+	coro_join(producer);
+	coro_join(consumer);
+	coro_bus_channel_close(ctx.bus, ctx.channel);
+	coro_bus_delete(ctx.bus);
+	return (double)duration / BENCH_MSG_COUNT;
+}
+
+struct bench_pingpong_ctx {
+	struct coro_bus *bus;
+	int ping;
+	int pong;
+};
+
+static void *
+bench_pinger_f(void *arg)
+{
+	struct bench_pingpong_ctx *ctx = arg;
+	unsigned data;
+	for (unsigned i = 0; i < BENCH_PINGPONG_COUNT; ++i) {
+		bench_check(coro_bus_send(ctx->bus, ctx->ping, i) == 0);
+		bench_check(coro_bus_recv(ctx->bus, ctx->pong, &data) == 0);
+		bench_check(data == i);
+	}
+	return NULL;
+}
+
+static void *
+bench_ponger_f(void *arg)
+{
+	struct bench_pingpong_ctx *ctx = arg;
+	unsigned data;
+	for (unsigned i = 0; i < BENCH_PINGPONG_COUNT; ++i) {
+		bench_check(coro_bus_recv(ctx->bus, ctx->ping, &data) == 0);
+		bench_check(coro_bus_send(ctx->bus, ctx->pong, data) == 0);
+	}
+	return NULL;
+}
+
+/** Nanoseconds per round trip. */
+static double
+bench_pingpong(void)
+{
+	struct bench_pingpong_ctx ctx;
+	ctx.bus = coro_bus_new();
+	ctx.ping = coro_bus_channel_open(ctx.bus, 1);
+	ctx.pong = coro_bus_channel_open(ctx.bus, 1);
+	uint64_t start = bench_now_ns();
+	struct coro *pinger = coro_new(bench_pinger_f, &ctx);
+	struct coro *ponger = coro_new(bench_ponger_f, &ctx);
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start;
+	coro_join(pinger);
+	coro_join(ponger);
+	coro_bus_channel_close(ctx.bus, ctx.ping);
+	coro_bus_channel_close(ctx.bus, ctx.pong);
+	coro_bus_delete(ctx.bus);
+	return (double)duration / BENCH_PINGPONG_COUNT;
+}
+
+struct bench_fan_ctx {
+	struct coro_bus *bus;
+	/** Channels of the fan-out, or the only one of the fan-in. */
+	int *channels;
+	int channel_count;
+	/** Messages for each coroutine on the "many" side. */
+	unsigned count;
+};
+
+static void *
+bench_fan_out_sender_f(void *arg)
+{
+	struct bench_fan_ctx *ctx = arg;
+	unsigned total = ctx->count * ctx->channel_count;
+	for (unsigned i = 0; i < total; ++i) {
+		int ch = ctx->channels[i % ctx->channel_count];
+		bench_check(coro_bus_send(ctx->bus, ch, i) == 0);
+	}
+	return NULL;
+}
+
+struct bench_fan_receiver_ctx {
+	struct bench_fan_ctx *fan;
+	int channel;
+};
+
+static void *
+bench_fan_out_receiver_f(void *arg)
+{
+	struct bench_fan_receiver_ctx *ctx = arg;
+	unsigned data;
+	for (unsigned i = 0; i < ctx->fan->count; ++i) {
+		bench_check(coro_bus_recv(ctx->fan->bus, ctx->channel,
+			&data) == 0);
+	}
+	return NULL;
+}
+
+static void *
+bench_fan_in_sender_f(void *arg)
+{
+	struct bench_fan_ctx *ctx = arg;
+	for (unsigned i = 0; i < ctx->count; ++i)
+		bench_check(coro_bus_send(ctx->bus, ctx->channels[0], i) == 0);
+	return NULL;
+}
+
+static void *
+bench_fan_in_receiver_f(void *arg)
+{
+	struct bench_fan_ctx *ctx = arg;
+	unsigned total = ctx->count * ctx->channel_count;
+	unsigned data;
+	for (unsigned i = 0; i < total; ++i)
+		bench_check(coro_bus_recv(ctx->bus, ctx->channels[0], &data) == 0);
+	return NULL;
+}
+
+/**
+ * One sender to @a count receivers, each on its own channel, or
+ * @a count senders to one receiver. Nanoseconds per message.
+ */
+static double
+bench_fan(int count, bool is_out)
+{
+	struct bench_fan_ctx ctx;
+	ctx.bus = coro_bus_new();
+	ctx.channel_count = count;
+	ctx.count = BENCH_MSG_COUNT / count;
+	int channel_count = is_out ? count : 1;
+	ctx.channels = malloc(sizeof(ctx.channels[0]) * channel_count);
+	for (int i = 0; i < channel_count; ++i)
+		ctx.channels[i] = coro_bus_channel_open(ctx.bus, BENCH_FAN_DEPTH);
+	struct bench_fan_receiver_ctx *receivers =
+		malloc(sizeof(receivers[0]) * count);
+	struct coro **coros = malloc(sizeof(coros[0]) * (count + 1));
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < count; ++i) {
+		if (is_out) {
+			receivers[i].fan = &ctx;
+			receivers[i].channel = ctx.channels[i];
+			coros[i] = coro_new(bench_fan_out_receiver_f,
+				&receivers[i]);
+		} else {
+			coros[i] = coro_new(bench_fan_in_sender_f, &ctx);
+		}
+	}
+	coros[count] = coro_new(is_out ? bench_fan_out_sender_f :
+		bench_fan_in_receiver_f, &ctx);
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start;
+	for (int i = 0; i <= count; ++i)
+		coro_join(coros[i]);
+	for (int i = 0; i < channel_count; ++i)
+		coro_bus_channel_close(ctx.bus, ctx.channels[i]);
+	free(coros);
+	free(receivers);
+	free(ctx.channels);
+	coro_bus_delete(ctx.bus);
+	return (double)duration / (ctx.count * count);
+}
+
+struct bench_contention_ctx {
+	struct coro_bus *bus;
+	int channel;
+	unsigned count;
+};
+
+static void *
+bench_contention_sender_f(void *arg)
+{
+	struct bench_contention_ctx *ctx = arg;
+	for (unsigned i = 0; i < ctx->count; ++i)
+		bench_check(coro_bus_send(ctx->bus, ctx->channel, i) == 0);
+	return NULL;
+}
+
+static void *
+bench_contention_receiver_f(void *arg)
+{
+	struct bench_contention_ctx *ctx = arg;
+	unsigned data;
+	for (unsigned i = 0; i < ctx->count; ++i)
+		bench_check(coro_bus_recv(ctx->bus, ctx->channel, &data) == 0);
+	return NULL;
+}
+
+static double
+bench_contention(int pair_count, double *suspends)
+{
+	struct bench_contention_ctx ctx;
+	ctx.bus = coro_bus_new();
+	ctx.channel = coro_bus_channel_open(ctx.bus, BENCH_CONTENTION_DEPTH);
+	ctx.count = BENCH_MSG_COUNT / pair_count;
+	struct coro **coros = malloc(sizeof(coros[0]) * pair_count * 2);
+	struct coro_sched_stats stats;
+	struct coro_stats before, after;
+	coro_sched_stats_ex(&stats, &before);
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < pair_count; ++i) {
+		coros[2 * i] = coro_new(bench_contention_sender_f, &ctx);
+		coros[2 * i + 1] = coro_new(bench_contention_receiver_f, &ctx);
+	}
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start;
+	coro_sched_stats_ex(&stats, &after);
+	for (int i = 0; i < pair_count * 2; ++i)
+		coro_join(coros[i]);
+	free(coros);
+	coro_bus_channel_close(ctx.bus, ctx.channel);
+	coro_bus_delete(ctx.bus);
+	unsigned total = ctx.count * pair_count;
+	*suspends = (double)(after.suspend_count - before.suspend_count) /
+		total;
+	return (double)duration / total;
+}
+
+static double
+bench_open_close(int channel_count)
+{
+	struct coro_bus *bus = coro_bus_new();
+	int *channels = malloc(sizeof(channels[0]) * channel_count);
+	for (int i = 0; i < channel_count; ++i)
+		channels[i] = coro_bus_channel_open(bus, 1);
+	/* The only free slot is the last one. */
+	coro_bus_channel_close(bus, channels[channel_count - 1]);
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < BENCH_OPEN_COUNT; ++i)
+		coro_bus_channel_close(bus, coro_bus_channel_open(bus, 1));
+	uint64_t duration = bench_now_ns() - start;
+	for (int i = 0; i < channel_count - 1; ++i)
+		coro_bus_channel_close(bus, channels[i]);
+	free(channels);
+	coro_bus_delete(bus);
+	return (double)duration / BENCH_OPEN_COUNT;
+}
+
+struct bench_msg {
+	uint64_t id;
+	uint64_t payload[3];
+};
+
+static double
+bench_messages(bool is_inline)
+{
+	struct coro_bus *bus = coro_bus_new();
+	int ch;
+	struct bench_msg **table = NULL;
+	if (is_inline) {
+		ch = coro_bus_channel_open_ex(bus, BENCH_MSG_DEPTH,
+			sizeof(struct bench_msg));
+	} else {
+		ch = coro_bus_channel_open(bus, BENCH_MSG_DEPTH);
+		table = malloc(sizeof(table[0]) * BENCH_MSG_DEPTH);
+		for (int i = 0; i < BENCH_MSG_DEPTH; ++i)
+			table[i] = malloc(sizeof(*table[i]));
+	}
+	struct bench_msg msg = {0, {1, 2, 3}};
+	uint64_t sum = 0;
+	uint64_t start = bench_now_ns();
+	for (unsigned i = 0; i < BENCH_MSG_COUNT; i += BENCH_MSG_DEPTH) {
+		for (unsigned j = 0; j < BENCH_MSG_DEPTH; ++j) {
+			msg.id = i + j;
+			if (is_inline) {
+				bench_check(coro_bus_try_send_msg(bus, ch,
+					&msg) == 0);
+			} else {
+				*table[j] = msg;
+				bench_check(coro_bus_try_send(bus, ch, j) == 0);
+			}
+		}
+		for (unsigned j = 0; j < BENCH_MSG_DEPTH; ++j) {
+			if (is_inline) {
+				bench_check(coro_bus_try_recv_msg(bus, ch,
+					&msg) == 0);
+				sum += msg.id;
+			} else {
+				unsigned idx;
+				bench_check(coro_bus_try_recv(bus, ch, &idx) == 0);
+				sum += table[idx]->id;
+			}
+		}
+	}
+	uint64_t duration = bench_now_ns() - start;
+	bench_check(sum > 0);
+	if (table != NULL) {
+		for (int i = 0; i < BENCH_MSG_DEPTH; ++i)
+			free(table[i]);
+		free(table);
+	}
+	coro_bus_channel_close(bus, ch);
+	coro_bus_delete(bus);
+	return (double)duration / BENCH_MSG_COUNT;
+}
+
+struct bench_broadcast_ctx {
+	struct coro_bus *bus;
+	int channel;
+	bool is_shared;
+};
+
+static void *
+bench_broadcaster_f(void *arg)
+{
+	struct bench_broadcast_ctx *ctx = arg;
+	char msg[BENCH_SHARED_SIZE] = {0};
+	for (unsigned i = 0; i < BENCH_BROADCAST_COUNT; ++i) {
+		if (ctx->is_shared) {
+			bench_check(coro_bus_broadcast_shared(ctx->bus, msg,
+				sizeof(msg)) == 0);
+		} else {
+			bench_check(coro_bus_broadcast(ctx->bus, i) == 0);
+		}
+	}
+	return NULL;
+}
+
+static void *
+bench_subscriber_f(void *arg)
+{
+	struct bench_broadcast_ctx *ctx = arg;
+	for (unsigned i = 0; i < BENCH_BROADCAST_COUNT; ++i) {
+		if (ctx->is_shared) {
+			const void *msg;
+			bench_check(coro_bus_recv_msg(ctx->bus, ctx->channel,
+				&msg) == 0);
+			coro_bus_shared_unref(msg);
+		} else {
+			unsigned data;
+			bench_check(coro_bus_recv(ctx->bus, ctx->channel,
+				&data) == 0);
+		}
+	}
+	return NULL;
+}
+
+static double
+bench_broadcast(int channel_count, bool is_shared)
+{
+	struct coro_bus *bus = coro_bus_new();
+	struct bench_broadcast_ctx *ctxs =
+		malloc(sizeof(ctxs[0]) * (channel_count + 1));
+	struct coro **coros = malloc(sizeof(coros[0]) * (channel_count + 1));
+	for (int i = 0; i <= channel_count; ++i) {
+		ctxs[i].bus = bus;
+		ctxs[i].is_shared = is_shared;
+		if (i == channel_count) {
+			ctxs[i].channel = -1;
+		} else if (is_shared) {
+			ctxs[i].channel = coro_bus_channel_open_shared(bus,
+				BENCH_BROADCAST_DEPTH);
+		} else {
+			ctxs[i].channel = coro_bus_channel_open(bus,
+				BENCH_BROADCAST_DEPTH);
+		}
+	}
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < channel_count; ++i)
+		coros[i] = coro_new(bench_subscriber_f, &ctxs[i]);
+	coros[channel_count] = coro_new(bench_broadcaster_f,
+		&ctxs[channel_count]);
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start;
+	for (int i = 0; i <= channel_count; ++i)
+		coro_join(coros[i]);
+	for (int i = 0; i < channel_count; ++i)
+		coro_bus_channel_close(bus, ctxs[i].channel);
+	free(coros);
+	free(ctxs);
+	coro_bus_delete(bus);
+	return (double)duration / BENCH_BROADCAST_COUNT;
+}
+
+struct bench_mpmc_ctx {
+	struct coro_mpmc *q;
+	unsigned count;
+};
+
+static void *
+bench_mpmc_producer_f(void *arg)
+{
+	struct bench_mpmc_ctx *ctx = arg;
+	for (unsigned i = 0; i < ctx->count; ++i)
+		bench_check(coro_mpmc_send(ctx->q, &i) == 0);
+	return NULL;
+}
+
+static void *
+bench_mpmc_consumer_f(void *arg)
+{
+	struct bench_mpmc_ctx *ctx = arg;
+	unsigned data;
+	for (unsigned i = 0; i < ctx->count; ++i)
+		bench_check(coro_mpmc_recv(ctx->q, &data) == 0);
+	return NULL;
+}
+
+/** Millions of messages per second through the thread-safe channel. */
+static double
+bench_mpmc(int pair_count)
+{
+	struct bench_mpmc_ctx ctx;
+	ctx.q = coro_mpmc_new(BENCH_MPMC_DEPTH, sizeof(unsigned));
+	ctx.count = BENCH_MPMC_COUNT / pair_count;
+	struct coro *coros[2 * 8];
+	assert(pair_count <= 8);
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < 2 * pair_count; ++i) {
+		coros[i] = coro_new_on(i, i % 2 == 0 ? bench_mpmc_producer_f :
+			bench_mpmc_consumer_f, &ctx, NULL);
+	}
+	for (int i = 0; i < 2 * pair_count; ++i)
+		coro_join(coros[i]);
+	uint64_t duration = bench_now_ns() - start;
+	coro_mpmc_delete(ctx.q);
+	return (double)ctx.count * pair_count * 1000 / duration;
+}
+
+int
+main(void)
+{
+	double times[BENCH_RUN_COUNT];
+	size_t depth_count = sizeof(bench_depths) / sizeof(bench_depths[0]);
+	coro_sched_init();
+	for (size_t i = 0; i < depth_count; ++i) {
+		size_t depth = bench_depths[i];
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			times[run_i] = bench_full_channel(depth);
+		bench_print("Full channel, ns per recv and send, depth", depth,
+			times);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			times[run_i] = bench_pair(depth, 1);
+		bench_print("Producer/consumer, ns per message, depth", depth,
+			times);
+		for (size_t j = 0; j < sizeof(bench_batch_sizes) /
+		     sizeof(bench_batch_sizes[0]); ++j) {
+			unsigned batch = bench_batch_sizes[j];
+			for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+				times[run_i] = bench_pair(depth, batch);
+			printf("Producer/consumer, batches of %u, ", batch);
+			bench_print("ns per message, depth", depth, times);
+		}
+	}
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+		times[run_i] = bench_pingpong();
+	bench_print("Ping-pong, ns per round trip, depth", 1, times);
+	for (size_t i = 0; i < sizeof(bench_fan_counts) /
+	     sizeof(bench_fan_counts[0]); ++i) {
+		int count = bench_fan_counts[i];
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			times[run_i] = bench_fan(count, true);
+		bench_print("Fan-out, ns per message, receivers", count, times);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			times[run_i] = bench_fan(count, false);
+		bench_print("Fan-in, ns per message, senders", count, times);
+	}
+	double suspends[BENCH_RUN_COUNT];
+	static const int pair_counts[] = {1, 10, 100};
+	for (size_t i = 0; i < sizeof(pair_counts) / sizeof(pair_counts[0]);
+	     ++i) {
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+			times[run_i] = bench_contention(pair_counts[i],
+				&suspends[run_i]);
+		}
+		bench_print("Contention, ns per message, sender/receiver pairs",
+			pair_counts[i], times);
+		bench_print("Contention, suspensions per message, "
+			"sender/receiver pairs", pair_counts[i], suspends);
+	}
+	size_t count_count = sizeof(bench_channel_counts) /
+		sizeof(bench_channel_counts[0]);
+	for (size_t i = 0; i < count_count; ++i) {
+		int count = bench_channel_counts[i];
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			times[run_i] = bench_open_close(count);
+		bench_print("Open and close, ns per pair, channels", count,
+			times);
+	}
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+		times[run_i] = bench_messages(true);
+	bench_print("Messages by value, ns per message, size",
+		sizeof(struct bench_msg), times);
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+		times[run_i] = bench_messages(false);
+	bench_print("Messages in a side table, ns per message, size",
+		sizeof(struct bench_msg), times);
+	static const int broadcast_counts[] = {10, 100, 1000};
+	for (size_t i = 0; i < sizeof(broadcast_counts) /
+	     sizeof(broadcast_counts[0]); ++i) {
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			times[run_i] = bench_broadcast(broadcast_counts[i], false);
+		bench_print("Broadcast, ns per message, channels",
+			broadcast_counts[i], times);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			times[run_i] = bench_broadcast(broadcast_counts[i], true);
+		bench_print("Shared broadcast, ns per message, channels",
+			broadcast_counts[i], times);
+	}
+	static const int thread_pair_counts[] = {1, 2, 4, 8};
+	for (size_t i = 0; i < sizeof(thread_pair_counts) /
+	     sizeof(thread_pair_counts[0]); ++i) {
+		int pair_count = thread_pair_counts[i];
+		coro_workers_start(2 * pair_count);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			times[run_i] = bench_mpmc(pair_count);
+		coro_workers_stop();
+		bench_print("Threads, millions of messages per second, "
+			"thread pairs", pair_count, times);
+	}
+	coro_sched_destroy();
+	return 0;
+}
@@ -0,0 +1,402 @@
+/*
+ * Microbenchmarks of the coroutine engine.
+ *
+ * Context switch: two coroutines yield to each other in a loop.
+ * Each round of the scheduler makes 3 switches: scheduler ->
+ * coro 1 -> coro 2 -> scheduler.
+ *
+ * Creation: a fresh engine spawns many coroutines with an empty
+ * pool, so each of them gets a new stack.
+ *
+ * Short tasks: a fresh engine runs many trivial coroutines, from
+ * creation to join. Regular ones created one by one, and lazy ones
+ * created in a batch, which share a few stacks.
+ *
+ * Tasks: stackless tasks against coroutines. Many waiters are woken
+ * up again and again by a driver, and a trivial one is spawned and
+ * joined right away many times.
+ *
+ * Fan-out/fan-in: a coroutine on one worker thread spawns many
+ * children doing a bit of work with a few yields, and joins them.
+ * The other workers can only get the children by stealing. Run
+ * with a growing number of workers.
+ *
+ * Wakeup latency: many bulk coroutines do a bit of work and yield,
+ * one of them periodically wakes up a consumer, which measures
+ * how long it took to get running. Run with the consumer of the
+ * normal and of the high priority.
+ *
+ * Build it for each backend to compare them, see 'make bench'.
+ */
+#include "libcoro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum {
+	BENCH_RUN_COUNT = 5,
+	BENCH_ROUND_COUNT = 5000000,
+	BENCH_SPAWN_COUNT = 10000,
+	BENCH_FAN_COUNT = 10000,
+	BENCH_FAN_YIELD_COUNT = 4,
+	BENCH_FAN_WORK = 2000,
+	BENCH_FAN_MAX_WORKERS = 4,
+	BENCH_WAKE_WAITER_COUNT = 1000,
+	BENCH_WAKE_ROUND_COUNT = 1000,
+	BENCH_CYCLE_COUNT = 1000000,
+	BENCH_LAT_BULK_COUNT = 1000,
+	BENCH_LAT_WORK = 200,
+	BENCH_LAT_SAMPLE_COUNT = 2000,
+	BENCH_LAT_PERIOD = 100,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_double(const void *l, const void *r)
+{
+	double a = *(const double *)l;
+	double b = *(const double *)r;
+	return a < b ? -1 : a > b;
+}
+
+static void
+bench_print(const char *title, const char *name, double *times)
+{
+	qsort(times, BENCH_RUN_COUNT, sizeof(times[0]), bench_cmp_double);
+	printf("%s, %s backend\n", title, name);
+	printf("    min: %.2lf\n", times[0]);
+	printf("    med: %.2lf\n", times[BENCH_RUN_COUNT / 2]);
+	printf("    max: %.2lf\n", times[BENCH_RUN_COUNT - 1]);
+}
+
+static void *
+bench_empty_f(void *arg)
+{
+	return arg;
+}
+
+static void *
+bench_yield_f(void *arg)
+{
+	int count = *(int *)arg;
+	for (int i = 0; i < count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+static void
+bench_switch(const char *name)
+{
+	int round_count = BENCH_ROUND_COUNT;
+	double times[BENCH_RUN_COUNT];
+
+	coro_sched_init();
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+		struct coro *c1 = coro_new(bench_yield_f, &round_count);
+		struct coro *c2 = coro_new(bench_yield_f, &round_count);
+		uint64_t start = bench_now_ns();
+		coro_sched_run();
+		uint64_t duration = bench_now_ns() - start;
+		coro_join(c1);
+		coro_join(c2);
+		times[run_i] = (double)duration / round_count / 3;
+	}
+	coro_sched_destroy();
+	bench_print("Context switch, ns per switch", name, times);
+}
+
+static void
+bench_spawn(const char *name)
+{
+	static struct coro *coros[BENCH_SPAWN_COUNT];
+	double times[BENCH_RUN_COUNT];
+
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+		coro_sched_init();
+		uint64_t start = bench_now_ns();
+		for (int i = 0; i < BENCH_SPAWN_COUNT; ++i)
+			coros[i] = coro_new(bench_empty_f, NULL);
+		uint64_t duration = bench_now_ns() - start;
+		coro_sched_run();
+		for (int i = 0; i < BENCH_SPAWN_COUNT; ++i)
+			coro_join(coros[i]);
+		coro_sched_destroy();
+		times[run_i] = (double)duration / BENCH_SPAWN_COUNT;
+	}
+	bench_print("Creation of a new coroutine, ns per coro_new", name,
+		times);
+}
+
+static void
+bench_short_tasks(const char *name, bool is_lazy)
+{
+	static struct coro *coros[BENCH_SPAWN_COUNT];
+	double times[BENCH_RUN_COUNT];
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.is_lazy = is_lazy;
+
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+		coro_sched_init();
+		uint64_t start = bench_now_ns();
+		if (is_lazy) {
+			coro_spawn_many(bench_empty_f, NULL, BENCH_SPAWN_COUNT,
+				&attr, coros);
+		} else {
+			for (int i = 0; i < BENCH_SPAWN_COUNT; ++i)
+				coros[i] = coro_new(bench_empty_f, NULL);
+		}
+		coro_sched_run();
+		for (int i = 0; i < BENCH_SPAWN_COUNT; ++i)
+			coro_join(coros[i]);
+		uint64_t duration = bench_now_ns() - start;
+		coro_sched_destroy();
+		times[run_i] = (double)duration / BENCH_SPAWN_COUNT;
+	}
+	bench_print(is_lazy ? "Short tasks, lazy batch, ns per task" :
+		"Short tasks, one by one, ns per task", name, times);
+}
+
+static bool bench_wake_is_stopped;
+
+static void *
+bench_wake_waiter_f(void *arg)
+{
+	(void)arg;
+	while (!bench_wake_is_stopped)
+		coro_suspend();
+	return NULL;
+}
+
+static bool
+bench_wake_waiter_step(struct coro *task, void *state)
+{
+	(void)task;
+	(void)state;
+	return bench_wake_is_stopped;
+}
+
+static bool
+bench_empty_step(struct coro *task, void *state)
+{
+	(void)task;
+	(void)state;
+	return true;
+}
+
+struct bench_tasks_ctx {
+	bool is_task;
+	double wake_times[BENCH_RUN_COUNT];
+	double cycle_times[BENCH_RUN_COUNT];
+};
+
+static void *
+bench_tasks_f(void *arg)
+{
+	static struct coro *coros[BENCH_WAKE_WAITER_COUNT];
+	struct bench_tasks_ctx *ctx = arg;
+	bool is_task = ctx->is_task;
+
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+		bench_wake_is_stopped = false;
+		for (int i = 0; i < BENCH_WAKE_WAITER_COUNT; ++i) {
+			coros[i] = is_task ?
+				coro_task_new(bench_wake_waiter_step, NULL, 0,
+					NULL) :
+				coro_new(bench_wake_waiter_f, NULL);
+		}
+		coro_yield();
+		uint64_t start = bench_now_ns();
+		for (int r = 0; r < BENCH_WAKE_ROUND_COUNT; ++r) {
+			for (int i = 0; i < BENCH_WAKE_WAITER_COUNT; ++i)
+				coro_wakeup(coros[i]);
+			coro_yield();
+		}
+		uint64_t duration = bench_now_ns() - start;
+		bench_wake_is_stopped = true;
+		for (int i = 0; i < BENCH_WAKE_WAITER_COUNT; ++i) {
+			coro_wakeup(coros[i]);
+			coro_join(coros[i]);
+		}
+		ctx->wake_times[run_i] = (double)duration /
+			(BENCH_WAKE_WAITER_COUNT * BENCH_WAKE_ROUND_COUNT);
+	}
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+		uint64_t start = bench_now_ns();
+		for (int i = 0; i < BENCH_CYCLE_COUNT; ++i) {
+			struct coro *c = is_task ?
+				coro_task_new(bench_empty_step, NULL, 0, NULL) :
+				coro_new(bench_empty_f, NULL);
+			coro_join(c);
+		}
+		uint64_t duration = bench_now_ns() - start;
+		ctx->cycle_times[run_i] = (double)duration / BENCH_CYCLE_COUNT;
+	}
+	return NULL;
+}
+
+static void
+bench_tasks(const char *name, bool is_task)
+{
+	struct bench_tasks_ctx ctx;
+	ctx.is_task = is_task;
+	coro_sched_init();
+	struct coro *c = coro_new(bench_tasks_f, &ctx);
+	coro_sched_run();
+	coro_join(c);
+	coro_sched_destroy();
+	bench_print(is_task ? "Wakeup and run, tasks, ns per wakeup" :
+		"Wakeup and run, coroutines, ns per wakeup", name,
+		ctx.wake_times);
+	bench_print(is_task ? "Spawn and join, tasks, ns per task" :
+		"Spawn and join, coroutines, ns per coroutine", name,
+		ctx.cycle_times);
+}
+
+static void *
+bench_fan_child_f(void *arg)
+{
+	(void)arg;
+	volatile uint64_t sum = 0;
+	for (int i = 0; i < BENCH_FAN_YIELD_COUNT; ++i) {
+		for (int j = 0; j < BENCH_FAN_WORK; ++j)
+			sum += j;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+bench_fan_root_f(void *arg)
+{
+	(void)arg;
+	static struct coro *coros[BENCH_FAN_COUNT];
+	for (int i = 0; i < BENCH_FAN_COUNT; ++i)
+		coros[i] = coro_new(bench_fan_child_f, NULL);
+	for (int i = 0; i < BENCH_FAN_COUNT; ++i)
+		coro_join(coros[i]);
+	return NULL;
+}
+
+static void
+bench_fan_out(const char *name)
+{
+	double times[BENCH_RUN_COUNT];
+	char title[128];
+
+	coro_sched_init();
+	for (int workers = 1; workers <= BENCH_FAN_MAX_WORKERS; workers *= 2) {
+		coro_workers_start(workers);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+			uint64_t start = bench_now_ns();
+			struct coro *root = coro_new_on(0, bench_fan_root_f,
+				NULL, NULL);
+			coro_join(root);
+			uint64_t duration = bench_now_ns() - start;
+			times[run_i] = (double)duration / BENCH_FAN_COUNT;
+		}
+		coro_workers_stop();
+		snprintf(title, sizeof(title), "Fan-out/fan-in, ns per child, "
+			"%d workers", workers);
+		bench_print(title, name, times);
+	}
+	coro_sched_destroy();
+}
+
+static struct {
+	struct coro *consumer;
+	bool is_consumer_waiting;
+	bool is_stopped;
+	uint64_t wakeup_ts;
+	double samples[BENCH_LAT_SAMPLE_COUNT];
+} bench_lat;
+
+static void *
+bench_lat_bulk_f(void *arg)
+{
+	bool is_producer = arg != NULL;
+	volatile uint64_t sum = 0;
+	for (int i = 0; !bench_lat.is_stopped; ++i) {
+		for (int j = 0; j < BENCH_LAT_WORK; ++j)
+			sum += j;
+		if (is_producer && i % BENCH_LAT_PERIOD == 0 &&
+		    bench_lat.is_consumer_waiting) {
+			bench_lat.is_consumer_waiting = false;
+			bench_lat.wakeup_ts = bench_now_ns();
+			coro_wakeup(bench_lat.consumer);
+		}
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+bench_lat_consumer_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < BENCH_LAT_SAMPLE_COUNT; ++i) {
+		bench_lat.is_consumer_waiting = true;
+		coro_suspend();
+		bench_lat.samples[i] =
+			(double)(bench_now_ns() - bench_lat.wakeup_ts) / 1000;
+	}
+	bench_lat.is_stopped = true;
+	return NULL;
+}
+
+static void
+bench_wakeup_latency(const char *name, int prio, const char *prio_name)
+{
+	static struct coro *coros[BENCH_LAT_BULK_COUNT];
+
+	coro_sched_init();
+	memset(&bench_lat, 0, sizeof(bench_lat));
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.priority = prio;
+	bench_lat.consumer = coro_new_ex(bench_lat_consumer_f, NULL, &attr);
+	for (int i = 0; i < BENCH_LAT_BULK_COUNT; ++i) {
+		coros[i] = coro_new(bench_lat_bulk_f,
+			i == BENCH_LAT_BULK_COUNT / 2 ? &bench_lat : NULL);
+	}
+	coro_sched_run();
+	coro_join(bench_lat.consumer);
+	for (int i = 0; i < BENCH_LAT_BULK_COUNT; ++i)
+		coro_join(coros[i]);
+	coro_sched_destroy();
+
+	double *s = bench_lat.samples;
+	int count = BENCH_LAT_SAMPLE_COUNT;
+	qsort(s, count, sizeof(s[0]), bench_cmp_double);
+	printf("Wakeup latency under %d busy coroutines, us, %s priority, "
+		"%s backend\n", BENCH_LAT_BULK_COUNT, prio_name, name);
+	printf("    p50: %.2lf\n", s[count / 2]);
+	printf("    p99: %.2lf\n", s[count * 99 / 100]);
+	printf("    max: %.2lf\n", s[count - 1]);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *name = argc > 1 ? argv[1] : "default";
+	bench_switch(name);
+	bench_spawn(name);
+	bench_short_tasks(name, false);
+	bench_short_tasks(name, true);
+	bench_tasks(name, false);
+	bench_tasks(name, true);
+	bench_fan_out(name);
+	bench_wakeup_latency(name, CORO_PRIO_NORMAL, "normal");
+	bench_wakeup_latency(name, CORO_PRIO_HIGH, "high");
+	return 0;
+}
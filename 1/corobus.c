@@ -1,66 +1,525 @@
+/* O_TMPFILE and fallocate() for the spill files. */
+#define _GNU_SOURCE
 #include "corobus.h"
 
 #include "libcoro.h"
 #include "rlist.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
-struct data_vector {
-	unsigned *data;
-	size_t size;
+/**
+ * Message queue of a channel. A ring buffer of a power of 2
+ * capacity, so the positions are wrapped with a mask and a pop
+ * never moves the other messages. The messages are stored right
+ * in the ring, whatever their size is.
+ */
+struct data_ring {
+	char *data;
+	/** Size of one message in bytes. */
+	size_t elem_size;
+	/** Power of 2, not less than the channel's size limit. */
 	size_t capacity;
+	/** Position of the first message. */
+	size_t head;
+	/** Number of messages. */
+	size_t size;
 };
 
-#if 0 /* Uncomment this if want to use */
+static void
+data_ring_create(struct data_ring *ring, size_t size_limit, size_t elem_size)
+{
+	size_t capacity = 1;
+	while (capacity < size_limit)
+		capacity <<= 1;
+	ring->data = malloc(elem_size * capacity);
+	ring->elem_size = elem_size;
+	ring->capacity = capacity;
+	ring->head = 0;
+	ring->size = 0;
+}
 
-/** Append @a count messages in @a data to the end of the vector. */
 static void
-data_vector_append_many(struct data_vector *vector,
-	const unsigned *data, size_t count)
+data_ring_destroy(struct data_ring *ring)
 {
-	if (vector->size + count > vector->capacity) {
-		if (vector->capacity == 0)
-			vector->capacity = 4;
-		else
-			vector->capacity *= 2;
-		if (vector->capacity < vector->size + count)
-			vector->capacity = vector->size + count;
-		vector->data = realloc(vector->data,
-			sizeof(vector->data[0]) * vector->capacity);
+	free(ring->data);
+}
+
+/** Place of the next message after the last one. */
+static void *
+data_ring_tail(struct data_ring *ring)
+{
+	assert(ring->size < ring->capacity);
+	size_t tail = (ring->head + ring->size) & (ring->capacity - 1);
+	return ring->data + tail * ring->elem_size;
+}
+
+/** Append @a count messages in @a data to the end of the ring. */
+static void
+data_ring_push_many(struct data_ring *ring, const void *data, size_t count)
+{
+	assert(ring->size + count <= ring->capacity);
+	size_t elem_size = ring->elem_size;
+	size_t tail = (ring->head + ring->size) & (ring->capacity - 1);
+	size_t first = ring->capacity - tail;
+	ring->size += count;
+	if (count <= first) {
+		memcpy(ring->data + tail * elem_size, data, elem_size * count);
+		return;
 	}
-	memcpy(&vector->data[vector->size], data, sizeof(data[0]) * count);
-	vector->size += count;
+	memcpy(ring->data + tail * elem_size, data, elem_size * first);
+	memcpy(ring->data, (const char *)data + first * elem_size,
+		elem_size * (count - first));
 }
 
-/** Append a single message to the vector. */
+/** Pop @a count of messages into @a data from the head of the ring. */
 static void
-data_vector_append(struct data_vector *vector, unsigned data)
+data_ring_pop_many(struct data_ring *ring, void *data, size_t count)
 {
-	data_vector_append_many(vector, &data, 1);
+	assert(count <= ring->size);
+	size_t elem_size = ring->elem_size;
+	size_t first = ring->capacity - ring->head;
+	if (count <= first) {
+		memcpy(data, ring->data + ring->head * elem_size,
+			elem_size * count);
+	} else {
+		memcpy(data, ring->data + ring->head * elem_size,
+			elem_size * first);
+		memcpy((char *)data + first * elem_size, ring->data,
+			elem_size * (count - first));
+	}
+	ring->head = (ring->head + count) & (ring->capacity - 1);
+	ring->size -= count;
 }
 
-/** Pop @a count of messages into @a data from the head of the vector. */
+enum {
+	/** Size of a segment of an elastic channel, with the header. */
+	DATA_CHUNK_SIZE = 4096,
+	/** How many free segments a bus keeps for reuse. */
+	DATA_CHUNK_POOL_MAX = 64,
+};
+
+/**
+ * A segment of the messages above the soft limit of an elastic
+ * channel. The messages are taken from the head and added to the
+ * tail, and the segment is freed when it is used up.
+ */
+struct data_chunk {
+	struct data_chunk *next;
+	/** Position of the first message. */
+	size_t head;
+	/** Position after the last message. */
+	size_t tail;
+	max_align_t data[];
+};
+
+/**
+ * Free segments of DATA_CHUNK_SIZE, shared by the channels of a
+ * bus. So a burst doesn't allocate memory each time.
+ */
+struct data_chunk_pool {
+	struct data_chunk *free;
+	int count;
+};
+
 static void
-data_vector_pop_first_many(struct data_vector *vector, unsigned *data, size_t count)
+data_chunk_pool_destroy(struct data_chunk_pool *pool)
 {
-	assert(count <= vector->size);
-	memcpy(data, vector->data, sizeof(data[0]) * count);
-	vector->size -= count;
-	memmove(vector->data, &vector->data[count], vector->size * sizeof(vector->data[0]));
+	while (pool->free != NULL) {
+		struct data_chunk *chunk = pool->free;
+		pool->free = chunk->next;
+		free(chunk);
+	}
 }
 
-/** Pop a single message from the head of the vector. */
-static unsigned
-data_vector_pop_first(struct data_vector *vector)
+/**
+ * Message queue in a list of segments. Grows and shrinks by whole
+ * segments, never moving the messages.
+ */
+struct data_chunks {
+	struct data_chunk *first;
+	struct data_chunk *last;
+	struct data_chunk_pool *pool;
+	size_t elem_size;
+	/** Number of messages in one segment. */
+	size_t chunk_capacity;
+	/** Number of messages. */
+	size_t size;
+};
+
+static void
+data_chunks_create(struct data_chunks *chunks, struct data_chunk_pool *pool,
+	size_t elem_size)
 {
-	unsigned data = 0;
-	data_vector_pop_first_many(vector, &data, 1);
-	return data;
+	chunks->first = NULL;
+	chunks->last = NULL;
+	chunks->pool = pool;
+	chunks->elem_size = elem_size;
+	size_t space = DATA_CHUNK_SIZE - sizeof(struct data_chunk);
+	chunks->chunk_capacity = elem_size <= space ? space / elem_size : 1;
+	chunks->size = 0;
 }
 
-#endif
+/** A segment is pooled only if it is of the standard size. */
+static bool
+data_chunks_is_pooled(const struct data_chunks *chunks)
+{
+	return sizeof(struct data_chunk) + chunks->elem_size <=
+		DATA_CHUNK_SIZE;
+}
+
+static void
+data_chunks_free_chunk(struct data_chunks *chunks, struct data_chunk *chunk)
+{
+	struct data_chunk_pool *pool = chunks->pool;
+	if (!data_chunks_is_pooled(chunks) ||
+	    pool->count >= DATA_CHUNK_POOL_MAX) {
+		free(chunk);
+		return;
+	}
+	chunk->next = pool->free;
+	pool->free = chunk;
+	++pool->count;
+}
+
+static void
+data_chunks_destroy(struct data_chunks *chunks)
+{
+	while (chunks->first != NULL) {
+		struct data_chunk *chunk = chunks->first;
+		chunks->first = chunk->next;
+		data_chunks_free_chunk(chunks, chunk);
+	}
+}
+
+/** Make sure the last segment has space, and return it. */
+static struct data_chunk *
+data_chunks_last_with_space(struct data_chunks *chunks)
+{
+	struct data_chunk *chunk = chunks->last;
+	if (chunk != NULL && chunk->tail < chunks->chunk_capacity)
+		return chunk;
+	struct data_chunk_pool *pool = chunks->pool;
+	if (data_chunks_is_pooled(chunks) && pool->free != NULL) {
+		chunk = pool->free;
+		pool->free = chunk->next;
+		--pool->count;
+	} else {
+		size_t size = DATA_CHUNK_SIZE;
+		if (!data_chunks_is_pooled(chunks))
+			size = sizeof(*chunk) + chunks->elem_size;
+		chunk = malloc(size);
+	}
+	chunk->next = NULL;
+	chunk->head = 0;
+	chunk->tail = 0;
+	if (chunks->last != NULL)
+		chunks->last->next = chunk;
+	else
+		chunks->first = chunk;
+	chunks->last = chunk;
+	return chunk;
+}
+
+/** Place of the next message after the last one. */
+static void *
+data_chunks_tail(struct data_chunks *chunks)
+{
+	struct data_chunk *chunk = data_chunks_last_with_space(chunks);
+	return (char *)chunk->data + chunk->tail * chunks->elem_size;
+}
+
+/** Account the message filled in data_chunks_tail(). */
+static void
+data_chunks_commit(struct data_chunks *chunks)
+{
+	++chunks->last->tail;
+	++chunks->size;
+}
+
+static void
+data_chunks_push_many(struct data_chunks *chunks, const void *data,
+	size_t count)
+{
+	size_t elem_size = chunks->elem_size;
+	chunks->size += count;
+	while (count > 0) {
+		struct data_chunk *chunk = data_chunks_last_with_space(chunks);
+		size_t n = chunks->chunk_capacity - chunk->tail;
+		if (n > count)
+			n = count;
+		memcpy((char *)chunk->data + chunk->tail * elem_size, data,
+			elem_size * n);
+		chunk->tail += n;
+		data = (const char *)data + n * elem_size;
+		count -= n;
+	}
+}
+
+/** The first messages, not more than @a count, in one segment. */
+static const void *
+data_chunks_head(struct data_chunks *chunks, size_t *count)
+{
+	struct data_chunk *chunk = chunks->first;
+	assert(chunk != NULL && chunk->head < chunk->tail);
+	if (*count > chunk->tail - chunk->head)
+		*count = chunk->tail - chunk->head;
+	return (const char *)chunk->data + chunk->head * chunks->elem_size;
+}
+
+/** Drop the first @a count messages got by data_chunks_head(). */
+static void
+data_chunks_drop_head(struct data_chunks *chunks, size_t count)
+{
+	struct data_chunk *chunk = chunks->first;
+	chunk->head += count;
+	chunks->size -= count;
+	if (chunk->head < chunk->tail)
+		return;
+	chunks->first = chunk->next;
+	if (chunks->first == NULL)
+		chunks->last = NULL;
+	data_chunks_free_chunk(chunks, chunk);
+}
+
+enum {
+	/** Full segments written to a spill file at once. */
+	DATA_SPILL_BATCH = 16,
+	/** Size of the buffer the spilled messages are read into. */
+	DATA_SPILL_READ_SIZE = 64 * 1024,
+	/** The read part of a spill file is freed by this much. */
+	DATA_SPILL_PUNCH_SIZE = 256 * 1024,
+};
+
+/**
+ * Messages of a spilling channel which are not in memory. The
+ * segments above the soft limit are written to the end of an
+ * unlinked file in batches, and are read back from its start, so
+ * the file is a queue of the messages, older than the segments
+ * still in memory. The read part of the file is given back to the
+ * file system as the reader goes, and the file is truncated when it
+ * is empty.
+ */
+struct data_spill {
+	int fd;
+	size_t elem_size;
+	/** The oldest messages, read from the file. */
+	char *read_buf;
+	/** Capacity of the buffer, in messages. */
+	size_t read_capacity;
+	/** Position of the first message in the buffer. */
+	size_t read_head;
+	/** Position after the last message in the buffer. */
+	size_t read_tail;
+	/** Offset of the first message in the file. */
+	off_t read_pos;
+	/** Offset after the last message in the file. */
+	off_t write_pos;
+	/** Everything before it is already freed in the file. */
+	off_t punch_pos;
+	/** The segments are written when there are this many messages. */
+	size_t flush_size;
+	/** Number of messages in the file and the buffer. */
+	size_t size;
+	/** Number of the messages written to the file, in total. */
+	uint64_t spill_count;
+	/** Number of the failed writes. */
+	uint64_t error_count;
+};
+
+/**
+ * Create an unlinked file in @a dir. Where O_TMPFILE is not
+ * supported, the file gets a name and is unlinked right away.
+ */
+static int
+data_spill_open_file(const char *dir)
+{
+	int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd >= 0)
+		return fd;
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/corobus-XXXXXX", dir) >=
+	    (int)sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = mkostemp(path, O_CLOEXEC);
+	if (fd >= 0)
+		unlink(path);
+	return fd;
+}
+
+static int
+data_spill_create(struct data_spill *spill, const struct data_chunks *chunks,
+	const char *dir)
+{
+	spill->fd = data_spill_open_file(dir);
+	if (spill->fd < 0)
+		return -1;
+	spill->elem_size = chunks->elem_size;
+	spill->read_capacity = DATA_SPILL_READ_SIZE / chunks->elem_size;
+	if (spill->read_capacity == 0)
+		spill->read_capacity = 1;
+	spill->read_buf = malloc(spill->read_capacity * chunks->elem_size);
+	spill->read_head = 0;
+	spill->read_tail = 0;
+	spill->read_pos = 0;
+	spill->write_pos = 0;
+	spill->punch_pos = 0;
+	/* The last segment is being filled and is never written. */
+	spill->flush_size = (DATA_SPILL_BATCH + 1) * chunks->chunk_capacity;
+	spill->size = 0;
+	spill->spill_count = 0;
+	spill->error_count = 0;
+	return 0;
+}
+
+static void
+data_spill_destroy(struct data_spill *spill)
+{
+	close(spill->fd);
+	free(spill->read_buf);
+}
+
+/**
+ * Write a batch of the full segments of @a chunks to the end of the
+ * file. They are all newer than the messages in the file.
+ */
+static bool
+data_spill_write_batch(struct data_spill *spill, struct data_chunks *chunks)
+{
+	size_t elem_size = spill->elem_size;
+	struct iovec iov[DATA_SPILL_BATCH];
+	int count = 0;
+	size_t bytes = 0;
+	for (struct data_chunk *chunk = chunks->first;
+	     chunk != chunks->last && count < DATA_SPILL_BATCH;
+	     chunk = chunk->next) {
+		iov[count].iov_base = (char *)chunk->data +
+			chunk->head * elem_size;
+		iov[count].iov_len = (chunk->tail - chunk->head) * elem_size;
+		bytes += iov[count].iov_len;
+		++count;
+	}
+	ssize_t rc;
+	do {
+		rc = pwritev(spill->fd, iov, count, spill->write_pos);
+	} while (rc < 0 && errno == EINTR);
+	/* A partial write is overwritten by the next one. */
+	if (rc != (ssize_t)bytes) {
+		++spill->error_count;
+		return false;
+	}
+	spill->write_pos += bytes;
+	spill->size += bytes / elem_size;
+	spill->spill_count += bytes / elem_size;
+	for (int i = 0; i < count; ++i) {
+		struct data_chunk *chunk = chunks->first;
+		data_chunks_drop_head(chunks, chunk->tail - chunk->head);
+	}
+	return true;
+}
+
+/**
+ * Write the full segments of @a chunks to the file while there are
+ * enough of them. When a write fails, they just stay in memory, and
+ * the next flush tries again.
+ */
+static void
+data_spill_flush(struct data_spill *spill, struct data_chunks *chunks)
+{
+	while (chunks->size >= spill->flush_size) {
+		if (!data_spill_write_batch(spill, chunks))
+			return;
+	}
+}
+
+/** Give the read part of the file back to the file system. */
+static void
+data_spill_punch(struct data_spill *spill)
+{
+	if (spill->read_pos == spill->write_pos) {
+		/* Nobody else looks at the file, it is fine to fail. */
+		(void)ftruncate(spill->fd, 0);
+		spill->read_pos = 0;
+		spill->write_pos = 0;
+		spill->punch_pos = 0;
+		return;
+	}
+	off_t end = spill->read_pos - spill->read_pos % DATA_SPILL_PUNCH_SIZE;
+	if (end <= spill->punch_pos)
+		return;
+	(void)fallocate(spill->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		spill->punch_pos, end - spill->punch_pos);
+	spill->punch_pos = end;
+}
+
+/** Read the next messages from the file into the empty buffer. */
+static void
+data_spill_load(struct data_spill *spill)
+{
+	assert(spill->read_head == spill->read_tail);
+	size_t elem_size = spill->elem_size;
+	size_t count = (spill->write_pos - spill->read_pos) / elem_size;
+	if (count > spill->read_capacity)
+		count = spill->read_capacity;
+	size_t bytes = count * elem_size;
+	size_t done = 0;
+	while (done < bytes) {
+		ssize_t rc = pread(spill->fd, spill->read_buf + done,
+			bytes - done, spill->read_pos + done);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		/*
+		 * The messages can't be skipped, the order would be
+		 * broken silently.
+		 */
+		if (rc <= 0)
+			abort();
+		done += rc;
+	}
+	spill->read_pos += bytes;
+	spill->read_head = 0;
+	spill->read_tail = count;
+	data_spill_punch(spill);
+}
+
+/**
+ * The first messages of the file, not more than @a count, or NULL
+ * if there are none.
+ */
+static const void *
+data_spill_head(struct data_spill *spill, size_t *count)
+{
+	if (spill->size == 0)
+		return NULL;
+	if (spill->read_head == spill->read_tail)
+		data_spill_load(spill);
+	size_t n = spill->read_tail - spill->read_head;
+	if (*count > n)
+		*count = n;
+	return spill->read_buf + spill->read_head * spill->elem_size;
+}
+
+/** Drop the first @a count messages got by data_spill_head(). */
+static void
+data_spill_drop_head(struct data_spill *spill, size_t count)
+{
+	assert(count <= spill->read_tail - spill->read_head);
+	spill->read_head += count;
+	spill->size -= count;
+}
 
 /**
  * One coroutine waiting to be woken up in a list of other
@@ -69,6 +528,21 @@ data_vector_pop_first(struct data_vector *vector)
 struct wakeup_entry {
 	struct rlist base;
 	struct coro *coro;
+	/**
+	 * Messages of a waiting sender, or the buffer of a waiting
+	 * receiver. The other side copies them right in, so the
+	 * operation is already complete when the waiter is woken up.
+	 * NULL for a waiter which only wants to retry, like a
+	 * broadcast.
+	 */
+	union {
+		const char *send_data;
+		char *recv_data;
+	};
+	/** Number of the messages, or capacity of the buffer. */
+	unsigned count;
+	/** How many messages were handed off. */
+	unsigned done;
 };
 
 /** A queue of suspended coros waiting to be woken up. */
@@ -76,260 +550,1663 @@ struct wakeup_queue {
 	struct rlist coros;
 };
 
-#if 0 /* Uncomment this if want to use */
+/** Suspend the current coroutine in the queue with the given entry. */
+static void
+wakeup_queue_suspend_entry(struct wakeup_queue *queue,
+	struct wakeup_entry *entry)
+{
+	entry->coro = coro_this();
+	entry->done = 0;
+	rlist_add_tail_entry(&queue->coros, entry, base);
+	coro_suspend();
+	rlist_del_entry(entry, base);
+}
 
 /** Suspend the current coroutine until it is woken up. */
 static void
 wakeup_queue_suspend_this(struct wakeup_queue *queue)
 {
 	struct wakeup_entry entry;
-	entry.coro = coro_this();
-	rlist_add_tail_entry(&queue->coros, &entry, base);
-	coro_suspend();
-	rlist_del_entry(&entry, base);
+	entry.send_data = NULL;
+	entry.count = 0;
+	wakeup_queue_suspend_entry(queue, &entry);
 }
 
-/** Wakeup the first coroutine in the queue. */
+/** Remove the entry from its queue and wake it up. */
 static void
-wakeup_queue_wakeup_first(struct wakeup_queue *queue)
+wakeup_entry_complete(struct wakeup_entry *entry)
 {
-	if (rlist_empty(&queue->coros))
-		return;
-	struct wakeup_entry *entry = rlist_first_entry(&queue->coros,
-		struct wakeup_entry, base);
+	rlist_del_entry(entry, base);
 	coro_wakeup(entry->coro);
 }
 
-#endif
+/**
+ * Wakeup all the coroutines and empty the queue, so it can be
+ * freed before they run.
+ */
+static void
+wakeup_queue_wakeup_all(struct wakeup_queue *queue)
+{
+	while (!rlist_empty(&queue->coros)) {
+		struct wakeup_entry *entry = rlist_first_entry(&queue->coros,
+			struct wakeup_entry, base);
+		rlist_del_entry(entry, base);
+		coro_wakeup(entry->coro);
+	}
+}
+
+/**
+ * A priority lane of a channel, above lane 0 which is the channel's
+ * own ring and send queue. Of the same size limit as lane 0, with
+ * its own space, so the other lanes never take it.
+ */
+struct coro_bus_lane {
+	struct data_ring data;
+	/** Coroutines waiting until the lane is not full. */
+	struct wakeup_queue send_queue;
+};
 
 struct coro_bus_channel {
+	/** Bus of the channel. */
+	struct coro_bus *bus;
 	/** Channel max capacity. */
 	size_t size_limit;
+	/**
+	 * Capacity of the ring. The same as the size limit, except
+	 * in the elastic channels.
+	 */
+	size_t soft_limit;
 	/** Coroutines waiting until the channel is not full. */
 	struct wakeup_queue send_queue;
 	/** Coroutines waiting until the channel is not empty. */
 	struct wakeup_queue recv_queue;
 	/** Message queue. */
-	struct data_vector data;
+	struct data_ring data;
+	/**
+	 * Messages above the soft limit, newer than the ones in the
+	 * ring. Not empty only if the ring is full.
+	 */
+	struct data_chunks overflow;
+	/**
+	 * Messages between the ring and the segments, in a file. NULL
+	 * if the channel doesn't spill.
+	 */
+	struct data_spill *spill;
+	/**
+	 * Lanes 1 and up of a priority channel, the highest last. NULL
+	 * in the other channels, which have only lane 0.
+	 */
+	struct coro_bus_lane *lanes;
+	/** Number of the lanes, lane 0 included. */
+	unsigned lane_count;
+	/** Number of the messages in the lanes above 0. */
+	size_t lanes_size;
+	/** Called when the size goes above the soft limit and back. */
+	coro_bus_backpressure_f backpressure_cb;
+	void *backpressure_arg;
+	/**
+	 * The message after the last one is being filled in place,
+	 * see coro_bus_send_reserve().
+	 */
+	bool is_reserved;
+	/**
+	 * The messages are references to shared messages, see
+	 * coro_bus_broadcast_shared().
+	 */
+	bool is_shared;
+	/** Counters, the sizes are filled only when returned. */
+	struct coro_bus_channel_stats stats;
+};
+
+/**
+ * Place of a channel in the bus. A free slot is in the free list,
+ * so a descriptor is allocated in O(1). The generation grows each
+ * time the slot's channel is closed. A blocked operation checks it
+ * when woken up, because the descriptor could be reused for another
+ * channel while it was waiting.
+ */
+struct coro_bus_slot {
+	struct coro_bus_channel *channel;
+	unsigned generation;
+	/** Next free slot, or -1. */
+	int next_free;
 };
 
 struct coro_bus {
-	struct coro_bus_channel **channels;
+	struct coro_bus_slot *slots;
+	/** Number of the used slots, free or not. */
+	int slot_count;
+	int slot_capacity;
+	/** Last freed slot, it is reused first. Or -1. */
+	int free_head;
+	/** Number of the open channels. */
 	int channel_count;
+	/**
+	 * Number of the full channels. A broadcast can proceed only
+	 * when it is 0, and this is checked without looking at the
+	 * channels.
+	 */
+	int full_count;
+	/** Number of the open channels of unsigned messages. */
+	int unsigned_count;
+	/** Number of the open channels of shared messages. */
+	int shared_count;
+	/** Coroutines waiting until no channel is full. */
+	struct wakeup_queue broadcast_queue;
+	/** Segments for the elastic channels. */
+	struct data_chunk_pool chunk_pool;
 };
 
-static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
+/**
+ * A message broadcast to many channels in one copy. The channels
+ * keep references to its data.
+ */
+struct coro_bus_shared {
+	/** Number of the channels and receivers having the message. */
+	unsigned ref_count;
+	/** The message itself. */
+	max_align_t data[];
+};
 
-enum coro_bus_error_code
-coro_bus_errno(void)
+static void
+coro_bus_shared_unref_impl(const void *msg)
 {
-	return global_error;
+	struct coro_bus_shared *shared = (struct coro_bus_shared *)
+		((const char *)msg - offsetof(struct coro_bus_shared, data));
+	assert(shared->ref_count > 0);
+	if (--shared->ref_count == 0)
+		free(shared);
 }
 
-void
-coro_bus_errno_set(enum coro_bus_error_code err)
+/** Number of the messages above the soft limit. */
+static size_t
+coro_bus_channel_overflow_size(const struct coro_bus_channel *ch)
 {
-	global_error = err;
+	size_t size = ch->overflow.size;
+	if (ch->spill != NULL)
+		size += ch->spill->size;
+	return size;
 }
 
-struct coro_bus *
-coro_bus_new(void)
+/**
+ * Number of the messages in lane 0, which are all of them in the
+ * channels without priority lanes. The space and the backpressure
+ * are of lane 0.
+ */
+static size_t
+coro_bus_channel_size(const struct coro_bus_channel *ch)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return NULL;
+	return ch->data.size + coro_bus_channel_overflow_size(ch);
 }
 
-void
-coro_bus_delete(struct coro_bus *bus)
+/** Number of the messages in all the lanes. */
+static size_t
+coro_bus_channel_total_size(const struct coro_bus_channel *ch)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
+	return coro_bus_channel_size(ch) + ch->lanes_size;
 }
 
-int
-coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
+/**
+ * The oldest messages above the soft limit, not more than @a count,
+ * in one piece. They are in the spill file, if there are any there.
+ */
+static const void *
+coro_bus_channel_overflow_head(struct coro_bus_channel *ch, size_t *count)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)size_limit;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	/*
-	 * One of the tests will force you to reuse the channel
-	 * descriptors. It means, that if your maximal channel
-	 * descriptor is N, and you have any free descriptor in
-	 * the range 0-N, then you should open the new channel on
-	 * that old descriptor.
-	 *
-	 * A more precise instruction - check if any of the
-	 * bus->channels[i] with i = 0 -> bus->channel_count is
-	 * free (== NULL). If yes - reuse the slot. Don't grow the
-	 * bus->channels array, when have space in it.
-	 */
-	return -1;
+	if (ch->spill != NULL) {
+		const void *head = data_spill_head(ch->spill, count);
+		if (head != NULL)
+			return head;
+	}
+	return data_chunks_head(&ch->overflow, count);
 }
 
-void
-coro_bus_channel_close(struct coro_bus *bus, int channel)
+/** Drop the messages got by coro_bus_channel_overflow_head(). */
+static void
+coro_bus_channel_overflow_drop_head(struct coro_bus_channel *ch,
+	size_t count)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	/*
-	 * Be very attentive here. What happens, if the channel is
-	 * closed while there are coroutines waiting on it? For
-	 * example, the channel was empty, and some coros were
-	 * waiting on its recv_queue.
-	 *
-	 * If you wakeup those coroutines and just delete the
-	 * channel right away, then those waiting coroutines might
-	 * on wakeup try to reference invalid memory.
-	 *
-	 * Can happen, for example, if you use an intrusive list
-	 * (rlist), delete the list itself (by deleting the
-	 * channel), and then the coroutines on wakeup would try
-	 * to remove themselves from the already destroyed list.
-	 *
-	 * Think how you could address that. Remove all the
-	 * waiters from the list before freeing it? Yield this
-	 * coroutine after waking up the waiters but before
-	 * freeing the channel, so the waiters could safely leave?
-	 */
+	if (ch->spill != NULL && ch->spill->size > 0)
+		data_spill_drop_head(ch->spill, count);
+	else
+		data_chunks_drop_head(&ch->overflow, count);
 }
 
-int
-coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
+static bool
+coro_bus_channel_is_full(const struct coro_bus_channel *ch)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	/*
-	 * Try sending in a loop, until success. If error, then
-	 * check which one is that. If 'wouldblock', then suspend
-	 * this coroutine and try again when woken up.
-	 *
-	 * If see the channel has space, then wakeup the first
-	 * coro in the send-queue. That is needed so when there is
-	 * enough space for many messages, and many coroutines are
-	 * waiting, they would then wake each other up one by one
-	 * as lone as there is still space.
-	 */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_channel_size(ch) >= ch->size_limit;
 }
 
-int
-coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
+/** Tell the owner if the size has crossed the soft limit. */
+static void
+coro_bus_channel_check_backpressure(struct coro_bus_channel *ch,
+	size_t old_size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	/*
-	 * Append data if has space. Otherwise 'wouldblock' error.
-	 * Wakeup the first coro in the recv-queue! To let it know
-	 * there is data.
-	 */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	if (ch->backpressure_cb == NULL)
+		return;
+	size_t size = coro_bus_channel_size(ch);
+	bool was_on = old_size > ch->soft_limit;
+	bool is_on = size > ch->soft_limit;
+	if (was_on != is_on)
+		ch->backpressure_cb(ch->bus, ch->stats.channel, is_on,
+			ch->backpressure_arg);
 }
 
-int
-coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+/** Account the message or the messages just added to the channel. */
+static void
+coro_bus_channel_on_push(struct coro_bus_channel *ch, size_t old_size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	if (ch->spill != NULL)
+		data_spill_flush(ch->spill, &ch->overflow);
+	size_t size = coro_bus_channel_size(ch);
+	ch->stats.send_count += size - old_size;
+	if (size + ch->lanes_size > ch->stats.size_max)
+		ch->stats.size_max = size + ch->lanes_size;
+	if (coro_bus_channel_is_full(ch))
+		++ch->bus->full_count;
+	coro_bus_channel_check_backpressure(ch, old_size);
 }
 
-int
-coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
+/**
+ * Account the channel which has just stopped being full. The
+ * broadcasts are woken up when the last full channel is gone.
+ */
+static void
+coro_bus_channel_on_not_full(struct coro_bus_channel *ch)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	struct coro_bus *bus = ch->bus;
+	assert(bus->full_count > 0);
+	if (--bus->full_count == 0)
+		wakeup_queue_wakeup_all(&bus->broadcast_queue);
 }
 
+/**
+ * Append the messages to the channel and account it if it is full.
+ * The ones which don't fit the ring go to the segments.
+ */
+static void
+coro_bus_channel_push(struct coro_bus_channel *ch, const void *data,
+	size_t count)
+{
+	size_t old_size = coro_bus_channel_size(ch);
+	size_t n = ch->soft_limit - ch->data.size;
+	if (n > count)
+		n = count;
+	data_ring_push_many(&ch->data, data, n);
+	size_t elem_size = ch->data.elem_size;
+	for (size_t left = count - n; left > 0; left -= n) {
+		n = left;
+		/* A big batch is spilled by parts, not copied at once. */
+		if (ch->spill != NULL && n > ch->spill->flush_size)
+			n = ch->spill->flush_size;
+		data_chunks_push_many(&ch->overflow,
+			(const char *)data + (count - left) * elem_size, n);
+		if (ch->spill != NULL)
+			data_spill_flush(ch->spill, &ch->overflow);
+	}
+	coro_bus_channel_on_push(ch, old_size);
+}
 
-#if NEED_BROADCAST
+/** Append the messages to a lane above 0, there is space for them. */
+static void
+coro_bus_lane_push(struct coro_bus_channel *ch, unsigned lane,
+	const void *data, size_t count)
+{
+	assert(lane > 0 && lane < ch->lane_count);
+	data_ring_push_many(&ch->lanes[lane - 1].data, data, count);
+	ch->lanes_size += count;
+	ch->stats.send_count += count;
+	size_t size = coro_bus_channel_total_size(ch);
+	if (size > ch->stats.size_max)
+		ch->stats.size_max = size;
+}
 
-int
-coro_bus_broadcast(struct coro_bus *bus, unsigned data)
+/**
+ * Pop the messages from the channel, the higher lanes first, and
+ * account it if lane 0 was full. The ring is refilled from the
+ * segments.
+ */
+static void
+coro_bus_channel_pop(struct coro_bus_channel *ch, void *data, size_t count)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	size_t elem_size = ch->data.elem_size;
+	for (unsigned i = ch->lane_count - 1; i > 0 && ch->lanes_size > 0 &&
+	     count > 0; --i) {
+		struct data_ring *ring = &ch->lanes[i - 1].data;
+		size_t n = ring->size;
+		if (n > count)
+			n = count;
+		data_ring_pop_many(ring, data, n);
+		ch->lanes_size -= n;
+		ch->stats.recv_count += n;
+		data = (char *)data + n * elem_size;
+		count -= n;
+	}
+	size_t old_size = coro_bus_channel_size(ch);
+	bool was_full = coro_bus_channel_is_full(ch);
+	size_t n = ch->data.size;
+	if (n > count)
+		n = count;
+	data_ring_pop_many(&ch->data, data, n);
+	for (size_t left = count - n; left > 0; left -= n) {
+		n = left;
+		const void *head = coro_bus_channel_overflow_head(ch, &n);
+		memcpy((char *)data + (count - left) * elem_size, head,
+			elem_size * n);
+		coro_bus_channel_overflow_drop_head(ch, n);
+	}
+	while (coro_bus_channel_overflow_size(ch) > 0 &&
+	       ch->data.size < ch->soft_limit) {
+		size_t refill = ch->soft_limit - ch->data.size;
+		const void *head = coro_bus_channel_overflow_head(ch, &refill);
+		data_ring_push_many(&ch->data, head, refill);
+		coro_bus_channel_overflow_drop_head(ch, refill);
+	}
+	ch->stats.recv_count += count;
+	if (was_full && count > 0)
+		coro_bus_channel_on_not_full(ch);
+	coro_bus_channel_check_backpressure(ch, old_size);
 }
 
-int
-coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
+/** Free the channel with its messages. Nobody can wait on it. */
+static void
+coro_bus_channel_delete(struct coro_bus_channel *ch)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	assert(rlist_empty(&ch->send_queue.coros));
+	assert(rlist_empty(&ch->recv_queue.coros));
+	while (ch->is_shared && ch->data.size > 0) {
+		const void *msg;
+		data_ring_pop_many(&ch->data, &msg, 1);
+		coro_bus_shared_unref_impl(msg);
+	}
+	for (unsigned i = 1; i < ch->lane_count; ++i) {
+		assert(rlist_empty(&ch->lanes[i - 1].send_queue.coros));
+		data_ring_destroy(&ch->lanes[i - 1].data);
+	}
+	free(ch->lanes);
+	if (ch->spill != NULL) {
+		data_spill_destroy(ch->spill);
+		free(ch->spill);
+	}
+	data_chunks_destroy(&ch->overflow);
+	data_ring_destroy(&ch->data);
+	free(ch);
 }
 
-#endif
+/** Per thread, the thread-safe channels can be used in many. */
+static __thread enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
 
-#if NEED_BATCH
+enum coro_bus_error_code
+coro_bus_errno(void)
+{
+	return global_error;
+}
 
-int
-coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+void
+coro_bus_errno_set(enum coro_bus_error_code err)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)count;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	global_error = err;
 }
 
-int
-coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+/** Monotonic time in nanoseconds. */
+static uint64_t
+coro_bus_now_ns(void)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)count;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-int
-coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+/** Monotonic time in seconds, for the timeouts. */
+static double
+coro_bus_now(void)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)capacity;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_now_ns() / 1000000000.0;
 }
 
-int
-coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+struct coro_bus *
+coro_bus_new(void)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)capacity;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	struct coro_bus *bus = malloc(sizeof(*bus));
+	bus->slots = NULL;
+	bus->slot_count = 0;
+	bus->slot_capacity = 0;
+	bus->free_head = -1;
+	bus->channel_count = 0;
+	bus->full_count = 0;
+	bus->unsigned_count = 0;
+	bus->shared_count = 0;
+	rlist_create(&bus->broadcast_queue.coros);
+	bus->chunk_pool.free = NULL;
+	bus->chunk_pool.count = 0;
+	return bus;
+}
+
+void
+coro_bus_delete(struct coro_bus *bus)
+{
+	for (int i = 0; i < bus->slot_count; ++i) {
+		struct coro_bus_channel *ch = bus->slots[i].channel;
+		if (ch != NULL)
+			coro_bus_channel_delete(ch);
+	}
+	assert(rlist_empty(&bus->broadcast_queue.coros));
+	data_chunk_pool_destroy(&bus->chunk_pool);
+	free(bus->slots);
+	free(bus);
+}
+
+int
+coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
+{
+	return coro_bus_channel_open_ex(bus, size_limit, sizeof(unsigned));
+}
+
+/**
+ * Open a channel of the given message size, shared or not. The
+ * messages above the soft limit are kept in segments.
+ */
+static int
+coro_bus_channel_open_impl(struct coro_bus *bus, size_t soft_limit,
+	size_t size_limit, size_t elem_size, bool is_shared)
+{
+	assert(elem_size > 0);
+	assert(soft_limit <= size_limit);
+	int channel = bus->free_head;
+	if (channel >= 0) {
+		bus->free_head = bus->slots[channel].next_free;
+	} else {
+		if (bus->slot_count == bus->slot_capacity) {
+			bus->slot_capacity = bus->slot_capacity == 0 ? 4 :
+				bus->slot_capacity * 2;
+			bus->slots = realloc(bus->slots,
+				sizeof(bus->slots[0]) * bus->slot_capacity);
+		}
+		channel = bus->slot_count++;
+		bus->slots[channel].generation = 0;
+	}
+	bus->slots[channel].next_free = -1;
+	++bus->channel_count;
+	struct coro_bus_channel *ch = malloc(sizeof(*ch));
+	ch->size_limit = size_limit;
+	ch->soft_limit = soft_limit;
+	rlist_create(&ch->send_queue.coros);
+	rlist_create(&ch->recv_queue.coros);
+	data_ring_create(&ch->data, soft_limit, elem_size);
+	data_chunks_create(&ch->overflow, &bus->chunk_pool, elem_size);
+	ch->spill = NULL;
+	ch->lanes = NULL;
+	ch->lane_count = 1;
+	ch->lanes_size = 0;
+	ch->backpressure_cb = NULL;
+	ch->backpressure_arg = NULL;
+	ch->is_reserved = false;
+	ch->is_shared = is_shared;
+	ch->bus = bus;
+	memset(&ch->stats, 0, sizeof(ch->stats));
+	ch->stats.channel = channel;
+	if (is_shared)
+		++bus->shared_count;
+	else if (elem_size == sizeof(unsigned))
+		++bus->unsigned_count;
+	if (coro_bus_channel_is_full(ch))
+		++bus->full_count;
+	bus->slots[channel].channel = ch;
+	return channel;
+}
+
+int
+coro_bus_channel_open_ex(struct coro_bus *bus, size_t size_limit,
+	size_t elem_size)
+{
+	return coro_bus_channel_open_impl(bus, size_limit, size_limit,
+		elem_size, false);
+}
+
+int
+coro_bus_channel_open_elastic(struct coro_bus *bus, size_t soft_limit,
+	size_t hard_limit, size_t elem_size)
+{
+	return coro_bus_channel_open_impl(bus, soft_limit, hard_limit,
+		elem_size, false);
+}
+
+int
+coro_bus_channel_open_spill(struct coro_bus *bus, size_t mem_limit,
+	size_t elem_size, const char *dir)
+{
+	if (dir == NULL)
+		dir = "/tmp";
+	int channel = coro_bus_channel_open_impl(bus, mem_limit, SIZE_MAX,
+		elem_size, false);
+	struct coro_bus_channel *ch = bus->slots[channel].channel;
+	struct data_spill *spill = malloc(sizeof(*spill));
+	if (data_spill_create(spill, &ch->overflow, dir) != 0) {
+		int err = errno;
+		free(spill);
+		coro_bus_channel_close(bus, channel);
+		errno = err;
+		coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+		return -1;
+	}
+	ch->spill = spill;
+	return channel;
+}
+
+int
+coro_bus_channel_open_prio(struct coro_bus *bus, size_t lane_limit,
+	unsigned lane_count, size_t elem_size)
+{
+	assert(lane_count > 0);
+	int channel = coro_bus_channel_open_impl(bus, lane_limit, lane_limit,
+		elem_size, false);
+	struct coro_bus_channel *ch = bus->slots[channel].channel;
+	if (lane_count == 1)
+		return channel;
+	ch->lanes = malloc(sizeof(ch->lanes[0]) * (lane_count - 1));
+	for (unsigned i = 1; i < lane_count; ++i) {
+		data_ring_create(&ch->lanes[i - 1].data, lane_limit, elem_size);
+		rlist_create(&ch->lanes[i - 1].send_queue.coros);
+	}
+	ch->lane_count = lane_count;
+	return channel;
+}
+
+void
+coro_bus_channel_set_backpressure(struct coro_bus *bus, int channel,
+	coro_bus_backpressure_f cb, void *arg)
+{
+	assert(channel >= 0 && channel < bus->slot_count);
+	struct coro_bus_channel *ch = bus->slots[channel].channel;
+	assert(ch != NULL);
+	ch->backpressure_cb = cb;
+	ch->backpressure_arg = arg;
+}
+
+void
+coro_bus_channel_close(struct coro_bus *bus, int channel)
+{
+	assert(channel >= 0 && channel < bus->slot_count);
+	struct coro_bus_slot *slot = &bus->slots[channel];
+	struct coro_bus_channel *ch = slot->channel;
+	assert(ch != NULL);
+	slot->channel = NULL;
+	++slot->generation;
+	slot->next_free = bus->free_head;
+	bus->free_head = channel;
+	--bus->channel_count;
+	/*
+	 * The waiters are unlinked right here, so they never touch
+	 * the freed queues. When woken up they see that the channel
+	 * is gone.
+	 */
+	wakeup_queue_wakeup_all(&ch->send_queue);
+	wakeup_queue_wakeup_all(&ch->recv_queue);
+	for (unsigned i = 1; i < ch->lane_count; ++i)
+		wakeup_queue_wakeup_all(&ch->lanes[i - 1].send_queue);
+	if (ch->is_shared)
+		--bus->shared_count;
+	else if (ch->data.elem_size == sizeof(unsigned))
+		--bus->unsigned_count;
+	if (coro_bus_channel_is_full(ch))
+		coro_bus_channel_on_not_full(ch);
+	coro_bus_channel_delete(ch);
+}
+
+/** Find the channel by its descriptor, or set the error. */
+static struct coro_bus_channel *
+coro_bus_channel_get(struct coro_bus *bus, int channel)
+{
+	if (channel < 0 || channel >= bus->slot_count ||
+	    bus->slots[channel].channel == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return NULL;
+	}
+	return bus->slots[channel].channel;
+}
+
+/**
+ * Same as coro_bus_channel_get(), but also checks the message
+ * size, unless it is 0. A channel of shared messages is of no
+ * size, they are not just pointers.
+ */
+static struct coro_bus_channel *
+coro_bus_channel_get_sized(struct coro_bus *bus, int channel,
+	size_t elem_size)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	if (ch != NULL && elem_size != 0 &&
+	    (ch->data.elem_size != elem_size || ch->is_shared)) {
+		coro_bus_errno_set(CORO_BUS_ERR_WRONG_SIZE);
+		return NULL;
+	}
+	return ch;
+}
+
+/**
+ * Same as coro_bus_channel_get_sized(), but for sending. The
+ * shared messages are sent only by coro_bus_broadcast_shared().
+ */
+static struct coro_bus_channel *
+coro_bus_channel_get_for_send(struct coro_bus *bus, int channel,
+	size_t elem_size)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_get_sized(bus, channel,
+		elem_size);
+	if (ch != NULL && ch->is_shared) {
+		coro_bus_errno_set(CORO_BUS_ERR_WRONG_SIZE);
+		return NULL;
+	}
+	return ch;
+}
+
+/**
+ * Check that the channel seen before a wait is still there, and
+ * was not replaced by a new one with the same descriptor.
+ */
+static bool
+coro_bus_channel_is_same(struct coro_bus *bus, int channel,
+	unsigned generation)
+{
+	if (bus->slots[channel].generation != generation) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return false;
+	}
+	return true;
+}
+
+/** Queue of the senders waiting for space in the lane. */
+static struct wakeup_queue *
+coro_bus_channel_send_queue(struct coro_bus_channel *ch, unsigned lane)
+{
+	return lane == 0 ? &ch->send_queue : &ch->lanes[lane - 1].send_queue;
+}
+
+/**
+ * Suspend a sender or a receiver in the channel. A sender waits in
+ * the queue of its lane. The wait is accounted in the channel's
+ * stats, if the channel is still there.
+ * @retval true The channel is the same.
+ * @retval false The channel is gone, the error is set.
+ */
+static bool
+coro_bus_channel_wait(struct coro_bus *bus, int channel, unsigned generation,
+	struct wakeup_entry *entry, bool is_send, unsigned lane)
+{
+	struct coro_bus_channel *ch = bus->slots[channel].channel;
+	uint64_t start = coro_bus_now_ns();
+	wakeup_queue_suspend_entry(is_send ?
+		coro_bus_channel_send_queue(ch, lane) : &ch->recv_queue,
+		entry);
+	if (!coro_bus_channel_is_same(bus, channel, generation))
+		return false;
+	uint64_t wait = coro_bus_now_ns() - start;
+	if (is_send) {
+		++ch->stats.send_wait_count;
+		ch->stats.send_wait_ns += wait;
+	} else {
+		++ch->stats.recv_wait_count;
+		ch->stats.recv_wait_ns += wait;
+	}
+	return true;
+}
+
+/**
+ * Same as coro_bus_channel_serve_senders(), for a lane above 0.
+ * Its senders always have messages.
+ */
+static void
+coro_bus_lane_serve_senders(struct coro_bus_channel *ch, unsigned lane)
+{
+	struct coro_bus_lane *l = &ch->lanes[lane - 1];
+	struct rlist *queue = &l->send_queue.coros;
+	size_t elem_size = ch->data.elem_size;
+	while (!rlist_empty(queue) && l->data.size < ch->size_limit) {
+		struct wakeup_entry *entry = rlist_first_entry(queue,
+			struct wakeup_entry, base);
+		size_t n = entry->count - entry->done;
+		if (n > ch->size_limit - l->data.size)
+			n = ch->size_limit - l->data.size;
+		coro_bus_lane_push(ch, lane,
+			entry->send_data + entry->done * elem_size, n);
+		entry->done += n;
+		if (entry->done < entry->count) {
+			coro_wakeup(entry->coro);
+			break;
+		}
+		wakeup_entry_complete(entry);
+	}
+}
+
+/**
+ * Move the messages of the waiting senders into the free space of
+ * the channel, in their order. A sender is complete when all its
+ * messages are taken. If only some are, it is woken up but stays
+ * first in the queue, and takes more space until it runs. A waiter
+ * without messages is just woken up while there is space.
+ */
+static void
+coro_bus_channel_serve_senders(struct coro_bus_channel *ch)
+{
+	assert(!ch->is_reserved);
+	for (unsigned i = ch->lane_count - 1; i > 0; --i)
+		coro_bus_lane_serve_senders(ch, i);
+	struct rlist *queue = &ch->send_queue.coros;
+	size_t elem_size = ch->data.elem_size;
+	while (!rlist_empty(queue)) {
+		size_t space = ch->size_limit - coro_bus_channel_size(ch);
+		if (space == 0)
+			break;
+		struct wakeup_entry *entry = rlist_first_entry(queue,
+			struct wakeup_entry, base);
+		if (entry->send_data != NULL) {
+			size_t n = entry->count - entry->done;
+			if (n > space)
+				n = space;
+			coro_bus_channel_push(ch,
+				entry->send_data + entry->done * elem_size, n);
+			entry->done += n;
+			if (entry->done < entry->count) {
+				coro_wakeup(entry->coro);
+				break;
+			}
+		}
+		wakeup_entry_complete(entry);
+	}
+}
+
+/**
+ * Move the messages into the buffers of the waiting receivers, as
+ * if they went through the channel. The receivers wait only on an
+ * empty channel, so the order is kept. Same as with the senders, a
+ * receiver with space left in the buffer is woken up but stays
+ * first in the queue until it runs.
+ */
+static void
+coro_bus_channel_serve_receivers(struct coro_bus_channel *ch)
+{
+	struct rlist *queue = &ch->recv_queue.coros;
+	size_t elem_size = ch->data.elem_size;
+	while (coro_bus_channel_total_size(ch) > 0 && !rlist_empty(queue)) {
+		struct wakeup_entry *entry = rlist_first_entry(queue,
+			struct wakeup_entry, base);
+		if (entry->recv_data != NULL) {
+			size_t n = entry->count - entry->done;
+			if (n > coro_bus_channel_total_size(ch))
+				n = coro_bus_channel_total_size(ch);
+			coro_bus_channel_pop(ch,
+				entry->recv_data + entry->done * elem_size, n);
+			entry->done += n;
+			if (entry->done < entry->count) {
+				coro_wakeup(entry->coro);
+				break;
+			}
+		}
+		wakeup_entry_complete(entry);
+	}
+}
+
+/**
+ * Put as many of the messages as the channel fits. The waiting
+ * receivers get them right away.
+ * @return Number of the sent messages, or -1 if none fit.
+ */
+static int
+coro_bus_channel_try_send_v(struct coro_bus_channel *ch, const void *data,
+	unsigned count)
+{
+	assert(!ch->is_reserved);
+	size_t space = ch->size_limit - coro_bus_channel_size(ch);
+	if (space == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	if (count > space)
+		count = space;
+	coro_bus_channel_push(ch, data, count);
+	coro_bus_channel_serve_receivers(ch);
+	return count;
+}
+
+/**
+ * Same as coro_bus_channel_try_send_v(), but into the given lane.
+ * Only its own space is taken.
+ */
+static int
+coro_bus_channel_try_send_lane(struct coro_bus_channel *ch, unsigned lane,
+	const void *data, unsigned count)
+{
+	if (lane == 0)
+		return coro_bus_channel_try_send_v(ch, data, count);
+	size_t space = ch->size_limit - ch->lanes[lane - 1].data.size;
+	if (space == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	if (count > space)
+		count = space;
+	coro_bus_lane_push(ch, lane, data, count);
+	coro_bus_channel_serve_receivers(ch);
+	return count;
+}
+
+/**
+ * Take as many messages as there are and fit, the higher lanes
+ * first. The freed space is filled by the waiting senders right
+ * away.
+ * @return Number of the received messages, or -1 if none.
+ */
+static int
+coro_bus_channel_try_recv_v(struct coro_bus_channel *ch, void *data,
+	unsigned capacity)
+{
+	size_t size = coro_bus_channel_total_size(ch);
+	if (size == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	if (capacity > size)
+		capacity = size;
+	coro_bus_channel_pop(ch, data, capacity);
+	coro_bus_channel_serve_senders(ch);
+	return capacity;
+}
+
+/** Lane of the priority, the ones above the highest go there. */
+static unsigned
+coro_bus_channel_lane(const struct coro_bus_channel *ch, unsigned prio)
+{
+	return prio < ch->lane_count ? prio : ch->lane_count - 1;
+}
+
+/**
+ * Send as many messages as fit, waiting for space in a full lane of
+ * the priority. The messages must be of @a elem_size, unless it is
+ * 0.
+ */
+static int
+coro_bus_do_send_v(struct coro_bus *bus, int channel, unsigned prio,
+	const void *data, unsigned count, size_t elem_size)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_get_for_send(bus,
+		channel, elem_size);
+	if (ch == NULL)
+		return -1;
+	unsigned lane = coro_bus_channel_lane(ch, prio);
+	unsigned generation = bus->slots[channel].generation;
+	struct wakeup_entry entry;
+	entry.send_data = data;
+	entry.count = count;
+	while (true) {
+		int rc = coro_bus_channel_try_send_lane(ch, lane, data, count);
+		if (rc >= 0)
+			return rc;
+		bool is_same = coro_bus_channel_wait(bus, channel, generation,
+			&entry, true, lane);
+		/* Taken by a receiver, even if closed afterwards. */
+		if (entry.done > 0)
+			return entry.done;
+		if (!is_same)
+			return -1;
+	}
+}
+
+static int
+coro_bus_do_try_send_v(struct coro_bus *bus, int channel, unsigned prio,
+	const void *data, unsigned count, size_t elem_size)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_get_for_send(bus,
+		channel, elem_size);
+	if (ch == NULL)
+		return -1;
+	return coro_bus_channel_try_send_lane(ch,
+		coro_bus_channel_lane(ch, prio), data, count);
+}
+
+/** Take as many messages as there are, waiting in an empty channel. */
+static int
+coro_bus_do_recv_v(struct coro_bus *bus, int channel, void *data,
+	unsigned capacity, size_t elem_size)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_get_sized(bus, channel,
+		elem_size);
+	if (ch == NULL)
+		return -1;
+	unsigned generation = bus->slots[channel].generation;
+	struct wakeup_entry entry;
+	entry.recv_data = data;
+	entry.count = capacity;
+	while (true) {
+		int rc = coro_bus_channel_try_recv_v(ch, data, capacity);
+		if (rc >= 0)
+			return rc;
+		bool is_same = coro_bus_channel_wait(bus, channel, generation,
+			&entry, false, 0);
+		if (entry.done > 0)
+			return entry.done;
+		if (!is_same)
+			return -1;
+	}
+}
+
+static int
+coro_bus_do_try_recv_v(struct coro_bus *bus, int channel, void *data,
+	unsigned capacity, size_t elem_size)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_get_sized(bus, channel,
+		elem_size);
+	if (ch == NULL)
+		return -1;
+	return coro_bus_channel_try_recv_v(ch, data, capacity);
+}
+
+int
+coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	return coro_bus_do_send_v(bus, channel, 0, &data, 1,
+		sizeof(data)) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	return coro_bus_do_try_send_v(bus, channel, 0, &data, 1,
+		sizeof(data)) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	return coro_bus_do_recv_v(bus, channel, data, 1,
+		sizeof(*data)) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	return coro_bus_do_try_recv_v(bus, channel, data, 1,
+		sizeof(*data)) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_send_msg(struct coro_bus *bus, int channel, const void *msg)
+{
+	return coro_bus_do_send_v(bus, channel, 0, msg, 1, 0) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_try_send_msg(struct coro_bus *bus, int channel, const void *msg)
+{
+	return coro_bus_do_try_send_v(bus, channel, 0, msg, 1, 0) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_send_prio(struct coro_bus *bus, int channel, unsigned prio,
+	const void *msg)
+{
+	return coro_bus_do_send_v(bus, channel, prio, msg, 1, 0) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_try_send_prio(struct coro_bus *bus, int channel, unsigned prio,
+	const void *msg)
+{
+	return coro_bus_do_try_send_v(bus, channel, prio, msg, 1, 0) < 0 ?
+		-1 : 0;
+}
+
+int
+coro_bus_recv_msg(struct coro_bus *bus, int channel, void *msg)
+{
+	return coro_bus_do_recv_v(bus, channel, msg, 1, 0) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_try_recv_msg(struct coro_bus *bus, int channel, void *msg)
+{
+	return coro_bus_do_try_recv_v(bus, channel, msg, 1, 0) < 0 ? -1 : 0;
+}
+
+/** Take the place for the next message, if there is space. */
+static void *
+coro_bus_channel_try_reserve(struct coro_bus_channel *ch)
+{
+	assert(!ch->is_reserved);
+	if (coro_bus_channel_is_full(ch)) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return NULL;
+	}
+	ch->is_reserved = true;
+	if (ch->data.size < ch->soft_limit)
+		return data_ring_tail(&ch->data);
+	return data_chunks_tail(&ch->overflow);
+}
+
+void *
+coro_bus_send_reserve(struct coro_bus *bus, int channel)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_get_for_send(bus,
+		channel, 0);
+	if (ch == NULL)
+		return NULL;
+	unsigned generation = bus->slots[channel].generation;
+	struct wakeup_entry entry;
+	entry.send_data = NULL;
+	entry.count = 0;
+	while (true) {
+		void *msg = coro_bus_channel_try_reserve(ch);
+		if (msg != NULL)
+			return msg;
+		if (!coro_bus_channel_wait(bus, channel, generation, &entry,
+					   true, 0))
+			return NULL;
+	}
+}
+
+void *
+coro_bus_try_send_reserve(struct coro_bus *bus, int channel)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_get_for_send(bus,
+		channel, 0);
+	if (ch == NULL)
+		return NULL;
+	return coro_bus_channel_try_reserve(ch);
+}
+
+int
+coro_bus_send_commit(struct coro_bus *bus, int channel)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	if (ch == NULL)
+		return -1;
+	assert(ch->is_reserved);
+	ch->is_reserved = false;
+	size_t old_size = coro_bus_channel_size(ch);
+	/* Nothing has changed since the reservation. */
+	if (ch->data.size < ch->soft_limit)
+		++ch->data.size;
+	else
+		data_chunks_commit(&ch->overflow);
+	coro_bus_channel_on_push(ch, old_size);
+	coro_bus_channel_serve_receivers(ch);
+	return 0;
+}
+
+int
+coro_bus_channel_stats(struct coro_bus *bus, int channel,
+	struct coro_bus_channel_stats *stats)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	if (ch == NULL)
+		return -1;
+	*stats = ch->stats;
+	stats->size = coro_bus_channel_total_size(ch);
+	stats->soft_limit = ch->soft_limit;
+	stats->size_limit = ch->size_limit;
+	stats->elem_size = ch->data.elem_size;
+	if (ch->spill != NULL) {
+		stats->spill_size = ch->spill->size;
+		stats->spill_count = ch->spill->spill_count;
+		stats->spill_error_count = ch->spill->error_count;
+	}
+	return 0;
+}
+
+int
+coro_bus_channel_next(struct coro_bus *bus, int channel)
+{
+	for (int i = channel < 0 ? 0 : channel + 1; i < bus->slot_count; ++i) {
+		if (bus->slots[i].channel != NULL)
+			return i;
+	}
+	return -1;
+}
+
+/** Waiter of coro_bus_select() on one of the channels. */
+struct coro_bus_select_wait {
+	struct wakeup_entry entry;
+	struct coro_bus_channel *ch;
+	unsigned generation;
+};
+
+enum {
+	/** Number of the operations in a select with no allocations. */
+	CORO_BUS_SELECT_STACK_OPS = 8,
+};
+
+/** Do the operation if it doesn't need to wait. */
+static int
+coro_bus_op_try(struct coro_bus_channel *ch, const struct coro_bus_op *op)
+{
+	if (op->type == CORO_BUS_OP_SEND)
+		return coro_bus_channel_try_send_v(ch, op->send_data, 1);
+	assert(op->type == CORO_BUS_OP_RECV);
+	return coro_bus_channel_try_recv_v(ch, op->recv_data, 1);
+}
+
+int
+coro_bus_select(struct coro_bus *bus, const struct coro_bus_op *ops,
+	int count, double timeout)
+{
+	/* A zero deadline is already in the past. */
+	double deadline = timeout > 0 ? coro_bus_now() + timeout : timeout;
+	struct coro_bus_select_wait waits_buf[CORO_BUS_SELECT_STACK_OPS];
+	struct coro_bus_select_wait *waits = waits_buf;
+	if (count > CORO_BUS_SELECT_STACK_OPS)
+		waits = malloc(sizeof(waits[0]) * count);
+	int rc = -1;
+	for (int i = 0; i < count; ++i) {
+		if (ops[i].type == CORO_BUS_OP_SEND) {
+			waits[i].ch = coro_bus_channel_get_for_send(bus,
+				ops[i].channel, 0);
+		} else {
+			waits[i].ch = coro_bus_channel_get(bus, ops[i].channel);
+		}
+		if (waits[i].ch == NULL)
+			goto out;
+		waits[i].generation = bus->slots[ops[i].channel].generation;
+	}
+	while (true) {
+		for (int i = 0; i < count; ++i) {
+			if (coro_bus_op_try(waits[i].ch, &ops[i]) >= 0) {
+				rc = i;
+				goto out;
+			}
+		}
+		double left = -1;
+		if (deadline >= 0) {
+			left = deadline - coro_bus_now();
+			if (left <= 0) {
+				coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+				goto out;
+			}
+		}
+		/*
+		 * The waiters are plain, so all the channels are just tried
+		 * again after a wakeup, and no message is taken by the
+		 * operations which are not done.
+		 */
+		for (int i = 0; i < count; ++i) {
+			struct wakeup_entry *entry = &waits[i].entry;
+			entry->coro = coro_this();
+			entry->send_data = NULL;
+			entry->count = 0;
+			entry->done = 0;
+			struct wakeup_queue *queue = ops[i].type == CORO_BUS_OP_SEND ?
+				&waits[i].ch->send_queue : &waits[i].ch->recv_queue;
+			rlist_add_tail_entry(&queue->coros, entry, base);
+		}
+		if (left < 0)
+			coro_suspend();
+		else
+			coro_suspend_timeout(left);
+		/*
+		 * Cancel the rest. The completed ones and the ones of the
+		 * closed channels are unlinked already.
+		 */
+		for (int i = 0; i < count; ++i)
+			rlist_del_entry(&waits[i].entry, base);
+		for (int i = 0; i < count; ++i) {
+			if (!coro_bus_channel_is_same(bus, ops[i].channel,
+						      waits[i].generation))
+				goto out;
+		}
+	}
+out:
+	if (waits != waits_buf)
+		free(waits);
+	return rc;
+}
+
+#if NEED_BROADCAST
+
+/**
+ * Check if a broadcast to @a count channels can proceed. It
+ * takes all the channels of the bus, and none of them can be full.
+ */
+static int
+coro_bus_broadcast_check(struct coro_bus *bus, int count)
+{
+	if (bus->channel_count == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (count != bus->channel_count) {
+		coro_bus_errno_set(CORO_BUS_ERR_WRONG_SIZE);
+		return -1;
+	}
+	if (bus->full_count > 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Wait until a broadcast can proceed. The broadcasts are woken up
+ * only when the last full channel gets space, so it is not checked
+ * on each message going through the channels.
+ */
+static int
+coro_bus_broadcast_wait(struct coro_bus *bus, const int *count)
+{
+	while (coro_bus_broadcast_check(bus, *count) != 0) {
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+			return -1;
+		wakeup_queue_suspend_this(&bus->broadcast_queue);
+	}
+	return 0;
+}
+
+/** Send the message to all the channels, there is space in each. */
+static void
+coro_bus_broadcast_impl(struct coro_bus *bus, const void *msg)
+{
+	for (int i = 0; i < bus->slot_count; ++i) {
+		struct coro_bus_channel *ch = bus->slots[i].channel;
+		if (ch != NULL)
+			coro_bus_channel_try_send_v(ch, msg, 1);
+	}
+}
+
+int
+coro_bus_broadcast(struct coro_bus *bus, unsigned data)
+{
+	if (coro_bus_broadcast_wait(bus, &bus->unsigned_count) != 0)
+		return -1;
+	coro_bus_broadcast_impl(bus, &data);
+	return 0;
+}
+
+int
+coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
+{
+	if (coro_bus_broadcast_check(bus, bus->unsigned_count) != 0)
+		return -1;
+	coro_bus_broadcast_impl(bus, &data);
+	return 0;
+}
+
+int
+coro_bus_channel_open_shared(struct coro_bus *bus, size_t size_limit)
+{
+	return coro_bus_channel_open_impl(bus, size_limit, size_limit,
+		sizeof(void *), true);
+}
+
+/** Copy the message once and send its references to all the channels. */
+static void
+coro_bus_broadcast_shared_impl(struct coro_bus *bus, const void *msg,
+	size_t size)
+{
+	struct coro_bus_shared *shared = malloc(sizeof(*shared) + size);
+	shared->ref_count = bus->channel_count;
+	memcpy(shared->data, msg, size);
+	const void *ref = shared->data;
+	coro_bus_broadcast_impl(bus, &ref);
+}
+
+int
+coro_bus_broadcast_shared(struct coro_bus *bus, const void *msg, size_t size)
+{
+	if (coro_bus_broadcast_wait(bus, &bus->shared_count) != 0)
+		return -1;
+	coro_bus_broadcast_shared_impl(bus, msg, size);
+	return 0;
+}
+
+int
+coro_bus_try_broadcast_shared(struct coro_bus *bus, const void *msg,
+	size_t size)
+{
+	if (coro_bus_broadcast_check(bus, bus->shared_count) != 0)
+		return -1;
+	coro_bus_broadcast_shared_impl(bus, msg, size);
+	return 0;
+}
+
+void
+coro_bus_shared_unref(const void *msg)
+{
+	coro_bus_shared_unref_impl(msg);
 }
 
 #endif
+
+
+#if NEED_BATCH
+
+int
+coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data,
+	unsigned count)
+{
+	return coro_bus_do_send_v(bus, channel, 0, data, count,
+		sizeof(*data));
+}
+
+int
+coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data,
+	unsigned count)
+{
+	return coro_bus_do_try_send_v(bus, channel, 0, data, count,
+		sizeof(*data));
+}
+
+int
+coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data,
+	unsigned capacity)
+{
+	return coro_bus_do_recv_v(bus, channel, data, capacity,
+		sizeof(*data));
+}
+
+int
+coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data,
+	unsigned capacity)
+{
+	return coro_bus_do_try_recv_v(bus, channel, data, capacity,
+		sizeof(*data));
+}
+
+#endif
+
+/**
+ * Thread-safe channel. The messages are in a bounded lock-free
+ * ring of Dmitry Vyukov's design. Each cell has a sequence number
+ * which says whose turn it is. The cell is free for the push at the
+ * position equal to the number, and has a message for the pop at
+ * the position one less than it. A push or pop only moves its own
+ * position with a CAS and then publishes the cell with a release
+ * store, so producers and consumers don't stop each other.
+ *
+ * The wait lists are under a mutex, which is taken only when
+ * somebody waits. The coroutines of other threads are woken up
+ * through their engines by coro_wakeup(). A waiter registers
+ * itself first and checks the ring after that. The other side
+ * changes the ring first and checks the waiter count after that,
+ * with a full fence on both sides. So a wakeup is never lost.
+ */
+
+enum {
+	CORO_BUS_CACHE_LINE = 64,
+};
+
+struct coro_mpmc_cell {
+	size_t seq;
+	max_align_t data[];
+};
+
+/** A coroutine waiting in a thread-safe channel. */
+struct coro_mpmc_waiter {
+	struct rlist link;
+	struct coro *coro;
+};
+
+struct coro_mpmc_waiters {
+	struct rlist coros;
+	/** Length of the list. Read without the mutex. */
+	int count;
+};
+
+struct coro_mpmc {
+	char *cells;
+	/** Size of a cell rounded up to keep the messages aligned. */
+	size_t cell_size;
+	size_t elem_size;
+	/** Ring capacity minus 1. The capacity is a power of 2. */
+	size_t mask;
+	bool is_closed;
+	/** Separate cache lines for the producers and the consumers. */
+	_Alignas(CORO_BUS_CACHE_LINE) size_t push_pos;
+	_Alignas(CORO_BUS_CACHE_LINE) size_t pop_pos;
+	_Alignas(CORO_BUS_CACHE_LINE) pthread_mutex_t mutex;
+	struct coro_mpmc_waiters senders;
+	struct coro_mpmc_waiters receivers;
+};
+
+static struct coro_mpmc_cell *
+coro_mpmc_cell(struct coro_mpmc *q, size_t pos)
+{
+	return (struct coro_mpmc_cell *)(q->cells +
+		(pos & q->mask) * q->cell_size);
+}
+
+struct coro_mpmc *
+coro_mpmc_new(size_t size_limit, size_t elem_size)
+{
+	assert(elem_size > 0);
+	/* With one cell its free and busy numbers would be the same. */
+	size_t capacity = 2;
+	while (capacity < size_limit)
+		capacity <<= 1;
+	size_t align = sizeof(max_align_t);
+	struct coro_mpmc *q = aligned_alloc(CORO_BUS_CACHE_LINE,
+		(sizeof(*q) + CORO_BUS_CACHE_LINE - 1) &
+		~(size_t)(CORO_BUS_CACHE_LINE - 1));
+	q->elem_size = elem_size;
+	q->cell_size = (sizeof(struct coro_mpmc_cell) + elem_size + align - 1) &
+		~(align - 1);
+	q->cells = malloc(q->cell_size * capacity);
+	q->mask = capacity - 1;
+	for (size_t i = 0; i < capacity; ++i)
+		coro_mpmc_cell(q, i)->seq = i;
+	q->is_closed = false;
+	q->push_pos = 0;
+	q->pop_pos = 0;
+	pthread_mutex_init(&q->mutex, NULL);
+	rlist_create(&q->senders.coros);
+	q->senders.count = 0;
+	rlist_create(&q->receivers.coros);
+	q->receivers.count = 0;
+	return q;
+}
+
+void
+coro_mpmc_delete(struct coro_mpmc *q)
+{
+	assert(rlist_empty(&q->senders.coros));
+	assert(rlist_empty(&q->receivers.coros));
+	pthread_mutex_destroy(&q->mutex);
+	free(q->cells);
+	free(q);
+}
+
+/**
+ * Difference of the cell's number and the position, wrapped. 0
+ * means the cell is ready at this position, below 0 - not yet.
+ */
+static intptr_t
+coro_mpmc_cell_diff(struct coro_mpmc_cell *cell, size_t pos)
+{
+	size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+	return (intptr_t)(seq - pos);
+}
+
+static bool
+coro_mpmc_try_push(struct coro_mpmc *q, const void *msg)
+{
+	size_t pos = __atomic_load_n(&q->push_pos, __ATOMIC_RELAXED);
+	while (true) {
+		struct coro_mpmc_cell *cell = coro_mpmc_cell(q, pos);
+		intptr_t diff = coro_mpmc_cell_diff(cell, pos);
+		if (diff < 0)
+			return false;
+		if (diff > 0) {
+			pos = __atomic_load_n(&q->push_pos, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&q->push_pos, &pos, pos + 1,
+						true, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+			memcpy(cell->data, msg, q->elem_size);
+			__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+			return true;
+		}
+	}
+}
+
+static bool
+coro_mpmc_try_pop(struct coro_mpmc *q, void *msg)
+{
+	size_t pos = __atomic_load_n(&q->pop_pos, __ATOMIC_RELAXED);
+	while (true) {
+		struct coro_mpmc_cell *cell = coro_mpmc_cell(q, pos);
+		intptr_t diff = coro_mpmc_cell_diff(cell, pos + 1);
+		if (diff < 0)
+			return false;
+		if (diff > 0) {
+			pos = __atomic_load_n(&q->pop_pos, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&q->pop_pos, &pos, pos + 1,
+						true, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+			memcpy(msg, cell->data, q->elem_size);
+			__atomic_store_n(&cell->seq, pos + q->mask + 1,
+				__ATOMIC_RELEASE);
+			return true;
+		}
+	}
+}
+
+/** The ring seems not full, so a push should be tried. */
+static bool
+coro_mpmc_can_push(struct coro_mpmc *q)
+{
+	size_t pos = __atomic_load_n(&q->push_pos, __ATOMIC_RELAXED);
+	return coro_mpmc_cell_diff(coro_mpmc_cell(q, pos), pos) >= 0;
+}
+
+/** The ring seems not empty, so a pop should be tried. */
+static bool
+coro_mpmc_can_pop(struct coro_mpmc *q)
+{
+	size_t pos = __atomic_load_n(&q->pop_pos, __ATOMIC_RELAXED);
+	return coro_mpmc_cell_diff(coro_mpmc_cell(q, pos), pos + 1) >= 0;
+}
+
+static bool
+coro_mpmc_is_closed(struct coro_mpmc *q)
+{
+	return __atomic_load_n(&q->is_closed, __ATOMIC_ACQUIRE);
+}
+
+/** Wake up the first waiter of the other side, if there is one. */
+static void
+coro_mpmc_wakeup_first(struct coro_mpmc *q, struct coro_mpmc_waiters *w)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&w->count, __ATOMIC_RELAXED) == 0)
+		return;
+	pthread_mutex_lock(&q->mutex);
+	if (!rlist_empty(&w->coros)) {
+		struct coro_mpmc_waiter *waiter = rlist_first_entry(&w->coros,
+			struct coro_mpmc_waiter, link);
+		rlist_del_entry(waiter, link);
+		__atomic_store_n(&w->count, w->count - 1, __ATOMIC_RELAXED);
+		coro_wakeup(waiter->coro);
+	}
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/**
+ * Suspend until woken up by the other side, unless the operation
+ * can already be retried. A wakeup could be spurious, the caller
+ * checks the ring again anyway.
+ */
+static void
+coro_mpmc_wait(struct coro_mpmc *q, struct coro_mpmc_waiters *w,
+	bool is_send)
+{
+	struct coro_mpmc_waiter waiter;
+	waiter.coro = coro_this();
+	pthread_mutex_lock(&q->mutex);
+	rlist_add_tail_entry(&w->coros, &waiter, link);
+	__atomic_store_n(&w->count, w->count + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&q->mutex);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	bool is_ready = coro_mpmc_is_closed(q) ||
+		(is_send ? coro_mpmc_can_push(q) : coro_mpmc_can_pop(q));
+	if (!is_ready)
+		coro_suspend();
+	pthread_mutex_lock(&q->mutex);
+	/* Unlinked by the one who woke it up. */
+	if (!rlist_empty(&waiter.link)) {
+		rlist_del_entry(&waiter, link);
+		__atomic_store_n(&w->count, w->count - 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&q->mutex);
+}
+
+int
+coro_mpmc_try_send(struct coro_mpmc *q, const void *msg)
+{
+	if (coro_mpmc_is_closed(q)) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (!coro_mpmc_try_push(q, msg)) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	coro_mpmc_wakeup_first(q, &q->receivers);
+	return 0;
+}
+
+int
+coro_mpmc_send(struct coro_mpmc *q, const void *msg)
+{
+	while (coro_mpmc_try_send(q, msg) != 0) {
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+			return -1;
+		coro_mpmc_wait(q, &q->senders, true);
+	}
+	return 0;
+}
+
+int
+coro_mpmc_try_recv(struct coro_mpmc *q, void *msg)
+{
+	if (!coro_mpmc_try_pop(q, msg)) {
+		coro_bus_errno_set(coro_mpmc_is_closed(q) ?
+			CORO_BUS_ERR_NO_CHANNEL : CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	coro_mpmc_wakeup_first(q, &q->senders);
+	return 0;
+}
+
+int
+coro_mpmc_recv(struct coro_mpmc *q, void *msg)
+{
+	while (coro_mpmc_try_recv(q, msg) != 0) {
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+			return -1;
+		coro_mpmc_wait(q, &q->receivers, false);
+	}
+	return 0;
+}
+
+/** Wake up all the waiters, they will see the channel is closed. */
+static void
+coro_mpmc_wakeup_all(struct coro_mpmc_waiters *w)
+{
+	while (!rlist_empty(&w->coros)) {
+		struct coro_mpmc_waiter *waiter = rlist_first_entry(&w->coros,
+			struct coro_mpmc_waiter, link);
+		rlist_del_entry(waiter, link);
+		coro_wakeup(waiter->coro);
+	}
+	__atomic_store_n(&w->count, 0, __ATOMIC_RELAXED);
+}
+
+void
+coro_mpmc_close(struct coro_mpmc *q)
+{
+	__atomic_store_n(&q->is_closed, true, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&q->mutex);
+	coro_mpmc_wakeup_all(&q->senders);
+	coro_mpmc_wakeup_all(&q->receivers);
+	pthread_mutex_unlock(&q->mutex);
+}
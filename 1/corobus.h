@@ -1,20 +1,25 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 /**
  * Here you should specify which bonuses do you want via the
  * macros. It is important to define these macros here, in the
  * header, because it is used by tests.
  */
-#define NEED_BROADCAST 0
-#define NEED_BATCH 0
+#define NEED_BROADCAST 1
+#define NEED_BATCH 1
 
 enum coro_bus_error_code {
 	CORO_BUS_ERR_NONE = 0,
 	CORO_BUS_ERR_NO_CHANNEL,
 	CORO_BUS_ERR_WOULD_BLOCK,
 	CORO_BUS_ERR_NOT_IMPLEMENTED,
+	CORO_BUS_ERR_WRONG_SIZE,
+	/** A system call failed, errno has the reason. */
+	CORO_BUS_ERR_SYSTEM,
 };
 
 struct coro_bus;
@@ -51,6 +56,170 @@ coro_bus_delete(struct coro_bus *bus);
 int
 coro_bus_channel_open(struct coro_bus *bus, size_t size_limit);
 
+/**
+ * Same as coro_bus_channel_open(), but the messages are of the
+ * given size instead of unsigned. They are stored in the channel
+ * by value, with no allocations per message. Such a channel is
+ * used with the *_msg() functions and the send reservation. The
+ * functions for unsigned messages fail with
+ * CORO_BUS_ERR_WRONG_SIZE on it, unless it is of sizeof(unsigned).
+ * @param bus The bus to create the channel in.
+ * @param size_limit Maximum messages a channel can hold in memory
+ *     at once.
+ * @param elem_size Size of one message in bytes, not 0.
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int
+coro_bus_channel_open_ex(struct coro_bus *bus, size_t size_limit,
+	size_t elem_size);
+
+/** Counters of a channel since it was opened. */
+struct coro_bus_channel_stats {
+	/** Descriptor of the channel. */
+	int channel;
+	/** Number of the messages in the channel now. */
+	size_t size;
+	size_t size_limit;
+	/** Same as the size limit, except in the elastic channels. */
+	size_t soft_limit;
+	/** Size of one message in bytes. */
+	size_t elem_size;
+	/** The most messages the channel has held at once. */
+	size_t size_max;
+	/** Number of the sent and received messages. */
+	uint64_t send_count;
+	uint64_t recv_count;
+	/**
+	 * How many times the senders were blocked on the full
+	 * channel, and for how long in total, in nanoseconds.
+	 */
+	uint64_t send_wait_count;
+	uint64_t send_wait_ns;
+	/** Same for the receivers on the empty channel. */
+	uint64_t recv_wait_count;
+	uint64_t recv_wait_ns;
+	/**
+	 * In the spilling channels, number of the messages in the
+	 * spill file now, and written there in total.
+	 */
+	size_t spill_size;
+	uint64_t spill_count;
+	/**
+	 * Number of the failed writes to the spill file. The messages
+	 * stay in memory then.
+	 */
+	uint64_t spill_error_count;
+};
+
+/**
+ * Get the counters of the channel. Together with the size limit
+ * they show if the limit fits the load. A channel which stays full
+ * while its senders wait longer and longer has a stalled consumer.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_channel_stats(struct coro_bus *bus, int channel,
+	struct coro_bus_channel_stats *stats);
+
+/**
+ * Iterate over the open channels of the bus. Start with -1:
+ *
+ *     for (int c = coro_bus_channel_next(bus, -1); c >= 0;
+ *          c = coro_bus_channel_next(bus, c))
+ *
+ * @return Descriptor of the next open channel after @a channel,
+ *     or -1 if there are no more.
+ */
+int
+coro_bus_channel_next(struct coro_bus *bus, int channel);
+
+/**
+ * Create an elastic channel. Up to the soft limit the messages are
+ * kept in a ring, like in the other channels. Above it the channel
+ * grows by segments from a pool of the bus, up to the hard limit,
+ * where the senders block. Growing and shrinking never moves the
+ * messages already in the channel.
+ * @param bus The bus to create the channel in.
+ * @param soft_limit Number of the messages above which the
+ *     channel signals backpressure.
+ * @param hard_limit Maximum messages the channel can hold at once,
+ *     SIZE_MAX for no limit.
+ * @param elem_size Size of one message in bytes, not 0.
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int
+coro_bus_channel_open_elastic(struct coro_bus *bus, size_t soft_limit,
+	size_t hard_limit, size_t elem_size);
+
+/**
+ * Create a spilling channel. It is an elastic channel with no hard
+ * limit, which keeps only about the own soft limit of the messages
+ * in memory. The ones above it are written to an unlinked file in
+ * @a dir, in batches of the segments, and are read back in order as
+ * the receivers catch up. So the senders never block, and a stalled
+ * receiver costs disk space, not memory. Besides the ring, the
+ * channel keeps about 17 segments of 4KB being filled, and 64KB of
+ * the messages read from the file, at least one message in each.
+ * When a write to the file fails, the messages stay in memory, and
+ * the channel grows like an elastic one until a write succeeds. The
+ * backpressure callback tells when
+ * the channel starts and stops spilling.
+ * @param bus The bus to create the channel in.
+ * @param mem_limit Number of the messages kept in the ring.
+ * @param elem_size Size of one message in bytes, not 0.
+ * @param dir Directory for the file, NULL for /tmp.
+ *
+ * @retval >=0 Descriptor of the channel.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_SYSTEM - the file couldn't be created.
+ */
+int
+coro_bus_channel_open_spill(struct coro_bus *bus, size_t mem_limit,
+	size_t elem_size, const char *dir);
+
+/**
+ * Create a channel of priority lanes. Each lane is a ring of its
+ * own, of @a lane_limit messages, so a flood in one lane never takes
+ * the space of another, and a sender blocks only on its own full
+ * lane. coro_bus_send_prio() picks the lane, the other sends go to
+ * lane 0, the lowest. A receiver gets the messages of the highest
+ * non-empty lane first, in their order within the lane. The channel
+ * stats count the messages of all the lanes, but the size limit is
+ * of one lane, and a broadcast needs space in lane 0.
+ * @param bus The bus to create the channel in.
+ * @param lane_limit Maximum messages a lane can hold at once.
+ * @param lane_count Number of the lanes, not 0. With 1 it is a
+ *     plain channel.
+ * @param elem_size Size of one message in bytes, not 0.
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int
+coro_bus_channel_open_prio(struct coro_bus *bus, size_t lane_limit,
+	unsigned lane_count, size_t elem_size);
+
+/**
+ * Backpressure callback. Called with @a is_on true when the
+ * channel size goes above its soft limit, and with false when it
+ * goes back to the limit. It is called right inside the sending or
+ * receiving operation, so it must not suspend or use the channel.
+ */
+typedef void (*coro_bus_backpressure_f)(struct coro_bus *bus, int channel,
+	bool is_on, void *arg);
+
+/**
+ * Set the backpressure callback of the channel, NULL to remove it.
+ * The channel must exist.
+ */
+void
+coro_bus_channel_set_backpressure(struct coro_bus *bus, int channel,
+	coro_bus_backpressure_f cb, void *arg);
+
 /**
  * Destroy the channel identified by the given descriptor. The
  * channel must exist. All pending messages of the channel are
@@ -126,6 +295,153 @@ coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data);
 int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
 
+/**
+ * Same as coro_bus_send(), but the message is of the channel's
+ * size, see coro_bus_channel_open_ex(). It is copied from @a msg.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_send_msg(struct coro_bus *bus, int channel, const void *msg);
+
+/**
+ * Same as coro_bus_send_msg(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_bus_try_send_msg(struct coro_bus *bus, int channel, const void *msg);
+
+/**
+ * Same as coro_bus_send_msg(), but into the lane @a prio of a
+ * priority channel, see coro_bus_channel_open_prio(). Only a full
+ * lane of this priority suspends the sender. A priority above the
+ * highest lane is the highest one, so in a plain channel it is the
+ * same as coro_bus_send_msg().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_send_prio(struct coro_bus *bus, int channel, unsigned prio,
+	const void *msg);
+
+/**
+ * Same as coro_bus_send_prio(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the lane is full.
+ */
+int
+coro_bus_try_send_prio(struct coro_bus *bus, int channel, unsigned prio,
+	const void *msg);
+
+/**
+ * Same as coro_bus_recv(), but the message is of the channel's
+ * size. It is copied into @a msg.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_recv_msg(struct coro_bus *bus, int channel, void *msg);
+
+/**
+ * Same as coro_bus_recv_msg(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ */
+int
+coro_bus_try_recv_msg(struct coro_bus *bus, int channel, void *msg);
+
+/**
+ * Take the place of the next message right in the channel, to fill
+ * it there with no copying. If the channel is full, the coroutine
+ * is suspended until there is space or until the channel is gone.
+ * The message is sent by coro_bus_send_commit(). Until then the
+ * coroutine can't yield or do anything else with the channel.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ *
+ * @retval not NULL Place of the message, of the channel's size.
+ * @retval NULL Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+void *
+coro_bus_send_reserve(struct coro_bus *bus, int channel);
+
+/**
+ * Same as coro_bus_send_reserve(), but never suspends.
+ *
+ * @retval not NULL Place of the message, of the channel's size.
+ * @retval NULL Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+void *
+coro_bus_try_send_reserve(struct coro_bus *bus, int channel);
+
+/**
+ * Send the message filled in the place from coro_bus_send_reserve().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_send_commit(struct coro_bus *bus, int channel);
+
+enum coro_bus_op_type {
+	CORO_BUS_OP_SEND,
+	CORO_BUS_OP_RECV,
+};
+
+/** One of the operations to wait for in coro_bus_select(). */
+struct coro_bus_op {
+	enum coro_bus_op_type type;
+	/** Descriptor of the channel to send to or recv from. */
+	int channel;
+	/** One message of the channel's size. */
+	union {
+		/** Message to send. */
+		const void *send_data;
+		/** Output parameter for the received message. */
+		void *recv_data;
+	};
+};
+
+/**
+ * Do one of the given operations, the first one which can proceed.
+ * If none can, the coroutine is suspended until any of them can,
+ * or until the timeout.
+ * @param bus Bus where the channels are located.
+ * @param ops Operations to choose from. Each sends or receives one
+ *     message.
+ * @param count Size of @a ops.
+ * @param timeout Timeout in seconds. Negative means no timeout,
+ *     0 means only try the operations.
+ *
+ * @retval >=0 Success, index of the done operation.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - one of the channels doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the timeout expired.
+ */
+int
+coro_bus_select(struct coro_bus *bus, const struct coro_bus_op *ops,
+	int count, double timeout);
+
 
 #if NEED_BROADCAST /* Bonus 1 */
 
@@ -140,6 +456,7 @@ coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
  * @retval 0 Success. Sent to all the channels.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - no channels in the bus.
+ *     - CORO_BUS_ERR_WRONG_SIZE - a channel is not of unsigned.
  */
 int
 coro_bus_broadcast(struct coro_bus *bus, unsigned data);
@@ -153,11 +470,67 @@ coro_bus_broadcast(struct coro_bus *bus, unsigned data);
  * @retval 0 Success. Sent to all the channels.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - no channels in the bus.
+ *     - CORO_BUS_ERR_WRONG_SIZE - a channel is not of unsigned.
  *     - CORO_BUS_ERR_WOULD_BLOCK - at least one channel is full.
  */
 int
 coro_bus_try_broadcast(struct coro_bus *bus, unsigned data);
 
+/**
+ * Create a channel of shared messages. It gets the messages only
+ * from coro_bus_broadcast_shared(). Each of them is received with
+ * coro_bus_recv_msg() or coro_bus_try_recv_msg() as a pointer,
+ * const void *, and must be released with coro_bus_shared_unref()
+ * then. Each channel has its own size limit, so the subscribers
+ * can lag behind each other by different numbers of messages.
+ * @param bus The bus to create the channel in.
+ * @param size_limit Maximum messages a channel can hold at once.
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int
+coro_bus_channel_open_shared(struct coro_bus *bus, size_t size_limit);
+
+/**
+ * Same as coro_bus_broadcast(), but the message is of any size and
+ * is copied only once. The channels get references to it. All the
+ * channels of the bus must be of shared messages.
+ * @param bus Bus where the channels are located.
+ * @param msg Message to send.
+ * @param size Size of @a msg.
+ *
+ * @retval 0 Success. Sent to all the channels.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no channels in the bus.
+ *     - CORO_BUS_ERR_WRONG_SIZE - a channel is not of shared
+ *       messages.
+ */
+int
+coro_bus_broadcast_shared(struct coro_bus *bus, const void *msg, size_t size);
+
+/**
+ * Same as coro_bus_broadcast_shared(), but if any of the channels
+ * are full, it instantly returns, not suspends.
+ *
+ * @retval 0 Success. Sent to all the channels.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no channels in the bus.
+ *     - CORO_BUS_ERR_WRONG_SIZE - a channel is not of shared
+ *       messages.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - at least one channel is full.
+ */
+int
+coro_bus_try_broadcast_shared(struct coro_bus *bus, const void *msg,
+	size_t size);
+
+/**
+ * Release a shared message received from a channel. It is freed
+ * when released by all the receivers. The messages left in the
+ * channels are released when the channels are closed.
+ */
+void
+coro_bus_shared_unref(const void *msg);
+
 #endif /* Bonus 1 */
 
 #if NEED_BATCH /* Bonus 2 */
@@ -245,3 +618,83 @@ coro_bus_try_recv_v(struct coro_bus *bus, int channel,
 	unsigned *data, unsigned capacity);
 
 #endif /* Bonus 2 */
+
+/**
+ * Thread-safe channel, for the coroutines in different threads,
+ * like the workers of coro_workers_start(). It is not a part of a
+ * bus and has no descriptor, so it is not found through a shared
+ * table on each operation. The send and recv don't take locks,
+ * unless they have to wait or wake somebody up. It must be used
+ * only by the coroutines, because the waiters are coroutines.
+ */
+struct coro_mpmc;
+
+/**
+ * Create a thread-safe channel.
+ * @param size_limit Maximum messages the channel can hold at
+ *     once. It is rounded up to a power of 2, not less than 2.
+ * @param elem_size Size of one message in bytes, not 0.
+ */
+struct coro_mpmc *
+coro_mpmc_new(size_t size_limit, size_t elem_size);
+
+/**
+ * Destroy the channel. Nobody can use it anymore or wait on it.
+ * The messages left in it are lost.
+ */
+void
+coro_mpmc_delete(struct coro_mpmc *q);
+
+/**
+ * Close the channel. All the waiters are woken up. The sends fail
+ * then, and the recvs fail when the channel is empty. A message
+ * sent in parallel with the closing could be left in the channel.
+ */
+void
+coro_mpmc_close(struct coro_mpmc *q);
+
+/**
+ * Send the message of the channel's size. If the channel is full,
+ * the coroutine is suspended until there is space or until the
+ * channel is closed.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel is closed.
+ */
+int
+coro_mpmc_send(struct coro_mpmc *q, const void *msg);
+
+/**
+ * Same as coro_mpmc_send(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel is closed.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_mpmc_try_send(struct coro_mpmc *q, const void *msg);
+
+/**
+ * Recv a message of the channel's size. If the channel is empty,
+ * the coroutine is suspended until there is a message or until the
+ * channel is closed.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel is closed and empty.
+ */
+int
+coro_mpmc_recv(struct coro_mpmc *q, void *msg);
+
+/**
+ * Same as coro_mpmc_recv(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel is closed and empty.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ */
+int
+coro_mpmc_try_recv(struct coro_mpmc *q, void *msg);
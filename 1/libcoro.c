@@ -1,49 +1,553 @@
 #include "libcoro.h"
 
 #include "rlist.h"
+#include "trace.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define CORO_USE_EPOLL 1
+#else
+#include <sys/event.h>
+#define CORO_USE_EPOLL 0
+#endif
+
+#define lengthof(array) (sizeof(array) / sizeof((array)[0]))
+
+/**
+ * Stack sizes are rounded up to a power of 2, from the page size
+ * to 1 GB. Each power is a size class.
+ */
+enum {
+	CORO_STACK_CLASS_MIN_SHIFT = 12,
+	CORO_STACK_CLASS_MAX_SHIFT = 30,
+	CORO_STACK_CLASS_COUNT =
+		CORO_STACK_CLASS_MAX_SHIFT - CORO_STACK_CLASS_MIN_SHIFT + 1,
+};
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
 	exit(-1);																	\
 } while(0)
 
+/**
+ * Context switch backend. By default the coroutines are switched
+ * by a hand-written routine which saves only the callee-saved
+ * registers and the stack pointer. On the platforms where it is
+ * not available, or when built with -DCORO_USE_SIGJMP=1, the
+ * portable sigsetjmp()/siglongjmp() pair is used instead.
+ */
+#ifndef CORO_USE_SIGJMP
+#if defined(__x86_64__) || defined(__aarch64__)
+#define CORO_USE_SIGJMP 0
+#else
+#define CORO_USE_SIGJMP 1
+#endif
+#endif
+
+#if CORO_USE_SIGJMP
+
+/** Saved execution context of a coroutine. */
+struct coro_ctx {
+	sigjmp_buf buf;
+};
+
+/**
+ * Save the current context into @a from and continue execution
+ * from @a to. Returns when something switches back to @a from.
+ * Has to be a macro - a function calling sigsetjmp() can't be
+ * returned from and jumped into again.
+ */
+#define coro_ctx_switch(from, to) do {											\
+	if (sigsetjmp((from)->buf, 0) == 0)											\
+		siglongjmp((to)->buf, 1);												\
+} while (0)
+
+#else /* !CORO_USE_SIGJMP */
+
+/**
+ * Saved execution context of a coroutine. All the callee-saved
+ * registers are pushed onto the coroutine's own stack, so only
+ * the stack pointer needs to be remembered.
+ */
+struct coro_ctx {
+	void *sp;
+};
+
+/**
+ * Save the current context into @a from and continue execution
+ * from @a to. Returns when something switches back to @a from.
+ */
+void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+	__attribute__((visibility("hidden")));
+
+#if defined(__APPLE__)
+#define CORO_ASM_SYM(name) "_" #name
+#define CORO_ASM_FUNC_BEGIN(name)												\
+	".text\n"																	\
+	".globl " CORO_ASM_SYM(name) "\n"											\
+	".private_extern " CORO_ASM_SYM(name) "\n"									\
+	".p2align 4\n"																\
+	CORO_ASM_SYM(name) ":\n"
+#define CORO_ASM_FUNC_END(name) ""
+#else
+#define CORO_ASM_SYM(name) #name
+#define CORO_ASM_FUNC_BEGIN(name)												\
+	".text\n"																	\
+	".globl " CORO_ASM_SYM(name) "\n"											\
+	".hidden " CORO_ASM_SYM(name) "\n"											\
+	".type " CORO_ASM_SYM(name) ", @function\n"								\
+	".p2align 4\n"																\
+	CORO_ASM_SYM(name) ":\n"
+#define CORO_ASM_FUNC_END(name)													\
+	".size " CORO_ASM_SYM(name) ", .-" CORO_ASM_SYM(name) "\n"
+#endif
+
+#if defined(__x86_64__)
+
+/*
+ * System V AMD64: from in rdi, to in rsi. Callee-saved are rbx,
+ * rbp, r12-r15, and the control bits of MXCSR and x87 FPU.
+ */
+__asm__(
+	CORO_ASM_FUNC_BEGIN(coro_ctx_switch)
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	CORO_ASM_FUNC_END(coro_ctx_switch)
+);
+
+#elif defined(__aarch64__)
+
+/*
+ * AAPCS64: from in x0, to in x1. Callee-saved are x19-x28, the
+ * frame pointer x29, the link register x30, and d8-d15.
+ */
+__asm__(
+	CORO_ASM_FUNC_BEGIN(coro_ctx_switch)
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	ldr x9, [x1]\n"
+	"	mov sp, x9\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	CORO_ASM_FUNC_END(coro_ctx_switch)
+);
+
+#endif
+
+#endif /* !CORO_USE_SIGJMP */
+
 enum coro_state {
 	CORO_STATE_RUNNING,
 	CORO_STATE_SUSPENDED,
 	CORO_STATE_FINISHED,
 };
 
+/**
+ * Value of the joiner of a finished coroutine. No joiner can be
+ * installed after that.
+ */
+#define CORO_JOINER_FINISHED ((struct coro *)(uintptr_t)1)
+
+/** Number of the priority levels, from CORO_PRIO_HIGH to LOW. */
+#define CORO_PRIO_COUNT (CORO_PRIO_HIGH - CORO_PRIO_LOW + 1)
+
+/**
+ * How many times in a row the high priority coroutines can run
+ * while the others wait. Then one of the others gets a turn, so
+ * they are not starved.
+ */
+#define CORO_PRIO_HIGH_STREAK_MAX 16
+
+/** Position of a coroutine not in the timer heap. */
+#define CORO_TIMER_NONE UINT32_MAX
+
+/** Size of a cache line, assumed for the data layout. */
+#define CORO_CACHE_LINE 64
+
+/**
+ * Requests to an engine from other threads. They are delivered
+ * via the engine's inbox and are executed by the engine's own
+ * thread.
+ */
+enum coro_remote_event {
+	/** Wakeup the coroutine. */
+	CORO_REMOTE_WAKEUP = 1 << 0,
+	/**
+	 * Take ownership over the coroutine and run it. Sent for
+	 * the coroutines created in other threads and for the
+	 * migrating ones.
+	 */
+	CORO_REMOTE_ADOPT = 1 << 1,
+	/** The coroutine is joined, it can be reused. */
+	CORO_REMOTE_RECYCLE = 1 << 2,
+};
+
 /** Main coroutine structure, its context. */
 struct coro {
+	/*
+	 * The first cache line has everything a wakeup and a switch
+	 * need. In the sigjmp mode the context is too big, so only
+	 * its start is there.
+	 */
 	/** Coroutine state. */
 	enum coro_state state;
+	/** Level in the run queue, CORO_PRIO_HIGH is 0. */
+	int prio_level;
+	/**
+	 * Engine owning the coroutine. Only the owner can run and
+	 * change it. Other threads send requests to the owner.
+	 */
+	struct coro_engine *engine;
+	/** Links in a coroutine list, used by the scheduler. */
+	struct rlist link;
+	/**
+	 * Stack, used by the coroutine. Points at the usable
+	 * part, right above the guard page.
+	 */
+	void *stack;
+	/** Position in the owner's timer heap, or CORO_TIMER_NONE. */
+	uint32_t timer_pos;
+	/** Descriptor the coroutine waits for, or -1. */
+	int wait_fd;
+	/**
+	 * A wakeup from another thread came while the coroutine was
+	 * running. Then the next suspension returns right away.
+	 * Otherwise the wakeup could be lost when it races with
+	 * the suspension.
+	 */
+	bool wakeup_pending;
+	/**
+	 * It is a stackless task. Then the state is right after the
+	 * structure, and func and func_arg are not used.
+	 */
+	bool is_task;
+	/**
+	 * The stack is bound only when the coroutine starts and is
+	 * given back right when it finishes.
+	 */
+	bool is_lazy;
+	/** The structure is allocated from the slab. */
+	bool is_slab;
+	/** Last remembered coroutine context. */
+	struct coro_ctx ctx;
+
+	/** Counters of the scheduling events and times. */
+	struct coro_stats stats;
+	/**
+	 * With timing on - when the coroutine has started running,
+	 * or when it has become runnable, in nanoseconds.
+	 */
+	uint64_t stats_ts;
+
 	/** A value, returned by func. */
 	void *ret;
-	/** Stack, used by the coroutine. */
-	void *stack;
+	/** Usable size of the stack, without the guard page. */
+	size_t stack_size;
+	/** Index of the stack size class, see coro_stack_class(). */
+	int stack_class;
+	/**
+	 * Committed stack bytes seen when the stack was checked
+	 * last time.
+	 */
+	size_t stack_committed;
+	/**
+	 * Lowest address of the stack used by a finished coroutine
+	 * waiting for reuse. Everything below it can be given back
+	 * to the OS.
+	 */
+	char *stack_live;
+	/**
+	 * The stack has nothing below the frames in use, as the stack
+	 * profiling expects. A fresh one is clean.
+	 */
+	bool is_stack_clean;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
-	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
+	/** Step function of the task. */
+	coro_task_f task_func;
 	/**
 	 * Coroutine which is trying to join this one right now.
 	 */
 	struct coro *joiner;
-	/** Links in a coroutine list, used by the scheduler. */
+	/** Link in the list of all coroutines of the engine. */
+	struct rlist engine_link;
+	/** Link in the inbox of the owner engine. */
+	struct rlist remote_link;
+	/**
+	 * Requests from other threads waiting in the owner's inbox,
+	 * a mask of enum coro_remote_event. Protected by the
+	 * inbox mutex.
+	 */
+	unsigned remote_events;
+	/**
+	 * Deadline of the timed suspension, in nanoseconds of
+	 * CLOCK_MONOTONIC.
+	 */
+	uint64_t timer_deadline;
+	/** The last timed suspension has ended by the timeout. */
+	bool is_timed_out;
+	/** Events the coroutine waits for, CORO_FD_READ/WRITE. */
+	int wait_events;
+	/** Events which have woken the coroutine up. */
+	int wait_revents;
+	/** Name given in the attributes, for debug. */
+	char name[CORO_NAME_MAX];
+	/**
+	 * Bits of the coroutine-local keys set in this coroutine. The
+	 * other values are garbage, so a reset is a single store.
+	 */
+	uint32_t key_mask;
+	/** Values of the coroutine-local keys. */
+	void *keys[CORO_KEY_MAX];
+};
+
+#if !CORO_USE_SIGJMP
+_Static_assert(offsetof(struct coro, ctx) + sizeof(struct coro_ctx) <=
+	       CORO_CACHE_LINE, "hot fields of struct coro fit a cache line");
+#endif
+_Static_assert(CORO_KEY_MAX <= 32, "key bits fit coro.key_mask");
+
+/** Offset of the inline state of a task from its structure. */
+#define CORO_TASK_STATE_OFFSET ((sizeof(struct coro) + 15) & ~(size_t)15)
+
+/** Biggest task state which still fits a slab slot. */
+#define CORO_TASK_INLINE_MAX 64
+
+/**
+ * Size of a slab slot - a coroutine, or a task with a small
+ * state. Slots are cache line aligned, so the hot fields of a
+ * coroutine never straddle two lines.
+ */
+#define CORO_SLOT_SIZE ((CORO_TASK_STATE_OFFSET + CORO_TASK_INLINE_MAX +	\
+			 CORO_CACHE_LINE - 1) & ~(size_t)(CORO_CACHE_LINE - 1))
+
+/** Number of slots in one slab chunk. */
+#define CORO_SLAB_CHUNK_SLOTS 64
+
+/**
+ * How many free slots an engine can keep. The rest go to the
+ * shared list.
+ */
+#define CORO_SLAB_CACHE_MAX (4 * CORO_SLAB_CHUNK_SLOTS)
+
+/** A free slot of the slab. The link is in the slot itself. */
+struct coro_slot {
+	struct coro_slot *next;
+};
+
+/** Header of a slab chunk. The slots follow after a cache line. */
+struct coro_slab_chunk {
+	struct coro_slab_chunk *next;
+};
+
+/**
+ * Memory for the coroutine structures, shared by all engines.
+ * Each engine has a cache of free slots and goes here only when
+ * the cache is empty or too big. The chunks live while any engine
+ * exists, so a slot can be freed by another engine than the one
+ * which has allocated it.
+ */
+static struct {
+	pthread_mutex_t mutex;
+	/** Free slots given back by the engines. */
+	struct coro_slot *free;
+	/** All the chunks, to free them with the last engine. */
+	struct coro_slab_chunk *chunks;
+	/** Number of the existing engines. */
+	int engine_count;
+} coro_slab = {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0};
+
+/**
+ * A stack given back by a finished lazy coroutine, cached for the
+ * next ones. Lives in the top bytes of the stack itself, which
+ * are committed anyway.
+ */
+struct coro_free_stack {
+	/** Link in the engine's list of the free stacks. */
 	struct rlist link;
+	/** Usable part of the stack, same as coro.stack. */
+	void *stack;
+	/** Committed bytes, same as coro.stack_committed. */
+	size_t stack_committed;
+	/** Same as coro.is_stack_clean. */
+	bool is_stack_clean;
+};
+
+/** Storage of a deque, which is replaced when grows. */
+struct coro_deque_array {
+	/** Capacity - 1. The capacity is a power of 2. */
+	int64_t mask;
+	/**
+	 * The previous smaller array. They are freed only together
+	 * with the deque, because thieves might still read them.
+	 */
+	struct coro_deque_array *prev;
+	struct coro *items[];
+};
+
+/**
+ * Chase-Lev work-stealing deque of runnable coroutines. Only the
+ * owner pushes to the bottom. Everyone takes from the top - the
+ * owner to run the coroutines in FIFO order, the other threads to
+ * steal them.
+ */
+struct coro_deque {
+	/** Index of the first item. */
+	int64_t top;
+	/** Index after the last item. */
+	int64_t bottom;
+	struct coro_deque_array *array;
 };
 
+static struct coro_deque_array *
+coro_deque_array_new(int64_t capacity, struct coro_deque_array *prev)
+{
+	struct coro_deque_array *a = malloc(sizeof(*a) +
+		capacity * sizeof(a->items[0]));
+	a->mask = capacity - 1;
+	a->prev = prev;
+	return a;
+}
+
+static void
+coro_deque_create(struct coro_deque *d)
+{
+	d->top = 0;
+	d->bottom = 0;
+	d->array = coro_deque_array_new(64, NULL);
+}
+
+static void
+coro_deque_destroy(struct coro_deque *d)
+{
+	assert(d->top == d->bottom);
+	struct coro_deque_array *a = d->array;
+	while (a != NULL) {
+		struct coro_deque_array *prev = a->prev;
+		free(a);
+		a = prev;
+	}
+}
+
+/** Approximate number of items. Precise only for the owner. */
+static int64_t
+coro_deque_size(const struct coro_deque *d)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	return b - t;
+}
+
+/** Push to the bottom. Can be called only by the owner. */
+static void
+coro_deque_push(struct coro_deque *d, struct coro *c)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	struct coro_deque_array *a = d->array;
+	if (b - t > a->mask) {
+		struct coro_deque_array *old = a;
+		a = coro_deque_array_new(2 * (old->mask + 1), old);
+		for (int64_t i = t; i < b; ++i)
+			a->items[i & a->mask] = old->items[i & old->mask];
+		__atomic_store_n(&d->array, a, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&a->items[b & a->mask], c, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Take the top item if its index is below @a end. Can be called
+ * by any thread.
+ * @retval NULL Nothing to take.
+ */
+static struct coro *
+coro_deque_take(struct coro_deque *d, int64_t end)
+{
+	while (true) {
+		/*
+		 * The owner never pops from the bottom, so the only
+		 * race is between the takers, and the CAS settles it.
+		 */
+		int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+		int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+		if (b > end)
+			b = end;
+		if (t >= b)
+			return NULL;
+		struct coro_deque_array *a =
+			__atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+		struct coro *c = __atomic_load_n(&a->items[t & a->mask],
+			__ATOMIC_RELAXED);
+		/*
+		 * If the slot was overwritten after the read, then
+		 * the top has moved, and this fails.
+		 */
+		if (__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_RELAXED))
+			return c;
+	}
+}
+
 struct coro_engine {
 	/**
 	 * Scheduler is the main coroutine - it represents the
@@ -54,174 +558,2167 @@ struct coro_engine {
 	struct coro *this;
 
 	/**
-	 * Coroutines to run in this iteration of the loop. The
-	 * list gets populated once at the start of the iteration.
+	 * Coroutines to run in this iteration of the loop, one
+	 * list per priority level. The lists get populated once at
+	 * the start of the iteration. Only the high priority ones
+	 * are added during the iteration too.
 	 */
-	struct rlist coros_running_now;
+	struct rlist coros_running_now[CORO_PRIO_COUNT];
 	/**
 	 * Coroutines to run in the next iteration of the loop.
-	 * The list gets populated by wakeups and yields and new
+	 * The lists get populated by wakeups and yields and new
 	 * coros.
 	 */
-	struct rlist coros_running_next;
-	/** Joined coroutines to be reused. */
-	struct rlist coros_pool;
+	struct rlist coros_running_next[CORO_PRIO_COUNT];
+	/**
+	 * How many high priority coroutines have run in a row
+	 * while the others waited.
+	 */
+	int prio_high_streak;
+	/**
+	 * Joined coroutines to be reused. One list per stack size
+	 * class, so a coroutine is never given a stack of another
+	 * size.
+	 */
+	struct rlist coros_pool[CORO_STACK_CLASS_COUNT];
+	/** Number of coroutines in each of the pool lists. */
+	size_t coros_pool_count[CORO_STACK_CLASS_COUNT];
+	/**
+	 * Stacks of the finished lazy coroutines, one list per
+	 * stack size class. Limited by the same high-water mark as
+	 * the pool.
+	 */
+	struct rlist stacks_free[CORO_STACK_CLASS_COUNT];
+	/** Number of stacks in each of the free lists. */
+	size_t stacks_free_count[CORO_STACK_CLASS_COUNT];
+	/** Free slab slots for the new coroutines. */
+	struct coro_slot *slots_free;
+	/** Number of the free slab slots. */
+	size_t slots_free_count;
+	/**
+	 * A lazy coroutine which has just finished. Its stack can
+	 * be given away only when it is left.
+	 */
+	struct coro *unbinding;
+	/**
+	 * High-water mark of each pool list in bytes of stack.
+	 * Coroutines joined above it are freed right away.
+	 */
+	size_t pool_limit;
 	/** Total number of coroutines, including the pool. */
 	size_t coro_count;
+	/**
+	 * All the owned coroutines, including the pool. Only the lazy
+	 * ones might have no stack.
+	 */
+	struct rlist coros_all;
+	/** Default stack size for the new coroutines. */
+	size_t stack_size;
+	/** Sum of the committed bytes of all stacks, free included. */
+	size_t stack_committed;
+	/** Maximal value of stack_committed ever seen. */
+	size_t stack_committed_peak;
+	/**
+	 * Number of owned coroutines not finished yet. Atomic,
+	 * because thieves change it too.
+	 */
+	size_t active_count;
+	/** Index of the worker thread having this engine, or -1. */
+	int worker_id;
+	/**
+	 * A coroutine which is moving to another engine. It can be
+	 * handed over only when its stack is left, so this is done
+	 * by whatever coroutine is resumed next.
+	 */
+	struct coro *leaving;
+	/** Where the leaving coroutine goes. */
+	struct coro_engine *leaving_to;
+	/**
+	 * A coroutine which has yielded. It can be made runnable only
+	 * when its stack is left, otherwise it could be stolen and
+	 * resumed in another thread too early.
+	 */
+	struct coro *yielding;
+	/**
+	 * A coroutine on whose stack a task runs now. It is in the
+	 * middle of a switch, so if the task wakes it up, it still
+	 * can't be stolen until the switch is done.
+	 */
+	struct coro *task_host;
+	/**
+	 * Runnable coroutines of a worker, one deque per priority
+	 * level. Used instead of the run lists, so the other workers
+	 * can steal them.
+	 */
+	struct coro_deque ready[CORO_PRIO_COUNT];
+	/**
+	 * Index in each ready deque where the current round of the
+	 * scheduler ends. The coroutines pushed after the round
+	 * start are run in the next round. Except for the high
+	 * priority ones, which run as soon as possible.
+	 */
+	int64_t round_end[CORO_PRIO_COUNT];
+	/** Worker to try stealing from first, round-robin. */
+	int steal_next;
+	/**
+	 * The worker has nothing to run and is about to sleep or
+	 * already sleeps. Then others wake it up when they have
+	 * more work than they can do.
+	 */
+	int is_idle;
+	/** Another worker has woken this one up to steal something. */
+	bool wake_requested;
+	/**
+	 * Min-heap of the coroutines in a timed suspension, by
+	 * their deadlines.
+	 */
+	struct coro **timers;
+	/** Number of the coroutines in the timer heap. */
+	size_t timer_count;
+	/** Capacity of the timer heap. */
+	size_t timer_capacity;
+	/** Epoll or kqueue descriptor. Created at the first use. */
+	int poll_fd;
+	/**
+	 * Pipe to wake the poller up from other threads. The read
+	 * end is in the poller.
+	 */
+	int poll_wake_fd[2];
+	/** Number of the coroutines waiting for descriptors. */
+	size_t fd_wait_count;
+	/** Totals of the scheduling counters of the coroutines. */
+	struct coro_stats stats;
+	/** Whether the running and waiting times are measured. */
+	bool is_timing;
+	/**
+	 * When the timing was turned on. Older time stamps of the
+	 * coroutines are not valid.
+	 */
+	uint64_t timing_start;
+	/** Period of the statistics dump, 0 if disabled. */
+	uint64_t dump_period;
+	/** When to dump the statistics next time. */
+	uint64_t dump_next;
+	/**
+	 * Protects the inbox, the stop flag, and the ownership of
+	 * the coroutines - the list of all of them and the counters.
+	 */
+	pthread_mutex_t inbox_mutex;
+	/** Signaled when the inbox gets new requests. */
+	pthread_cond_t inbox_cond;
+	/** Coroutines having requests from other threads. */
+	struct rlist inbox;
+	/**
+	 * Number of coroutines in the inbox. Can be read without
+	 * the mutex to quickly check if there is anything.
+	 */
+	size_t inbox_size;
+	/** The engine's thread sleeps on inbox_cond or in the poller. */
+	bool is_waiting;
+	/** The engine's thread sleeps in the poller. */
+	bool is_polling;
+	/** The poller is already woken up via the wake pipe. */
+	bool is_poll_woken;
+	/**
+	 * The worker should exit when all its coroutines are
+	 * finished.
+	 */
+	bool is_stopping;
+#if CORO_USE_SIGJMP
 	/**
 	 * Buffer, used by the coroutine constructor to escape
 	 * from the signal handler back into the constructor to
 	 * rollback sigaltstack etc.
 	 */
 	sigjmp_buf start_point;
+#endif
 };
 
-static void
-coro_engine_create(struct coro_engine *engine)
+static uint64_t
+coro_clock_ns(void)
 {
-	memset(engine, 0, sizeof(*engine));
-	rlist_create(&engine->sched.link);
-	rlist_create(&engine->coros_running_now);
-	rlist_create(&engine->coros_running_next);
-	rlist_create(&engine->coros_pool);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static void
-coro_engine_resume_next(struct coro_engine *engine)
+static size_t
+coro_page_size(void)
 {
-	assert(!rlist_empty(&engine->coros_running_now));
-	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
-		struct coro, link);
-	struct coro *from = engine->this;
-	assert(from != NULL);
-
-	engine->this = NULL;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	assert(rlist_empty(&from->link));
-	assert(engine->this == NULL);
-	engine->this = from;
+	static size_t page_size = 0;
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
 }
 
-static void
-coro_engine_suspend(struct coro_engine *engine)
+/**
+ * Turn the requested stack size into the real one - not smaller
+ * than the platform needs, rounded up to the size class.
+ */
+static size_t
+coro_stack_size_normalize(size_t size)
 {
-	struct coro *this = engine->this;
-	if (this == NULL) {
-		printf("Error: deadlock - suspension with no active "
-			"coroutines\n");
+#if CORO_USE_SIGJMP
+	if (size < (size_t)SIGSTKSZ)
+		size = SIGSTKSZ;
+#endif
+	if (size < coro_page_size())
+		size = coro_page_size();
+	size_t max_size = (size_t)1 << CORO_STACK_CLASS_MAX_SHIFT;
+	if (size > max_size) {
+		printf("Error: stack size %zu is too big, max is %zu\n",
+			size, max_size);
 		exit(-1);
 	}
-	assert(rlist_empty(&this->link));
-	assert(this->state == CORO_STATE_RUNNING);
-	this->state = CORO_STATE_SUSPENDED;
-	coro_engine_resume_next(engine);
+	size_t result = (size_t)1 << CORO_STACK_CLASS_MIN_SHIFT;
+	while (result < size)
+		result <<= 1;
+	return result;
+}
+
+/** Size class of a normalized stack size. */
+static int
+coro_stack_class(size_t size)
+{
+	int shift = CORO_STACK_CLASS_MIN_SHIFT;
+	while (((size_t)1 << shift) < size)
+		++shift;
+	assert(((size_t)1 << shift) == size);
+	return shift - CORO_STACK_CLASS_MIN_SHIFT;
 }
 
+/**
+ * Allocate a stack for the coroutine. It is mapped right away,
+ * but the physical pages are committed by the kernel lazily, on
+ * first access. So the memory usage follows the actual stack
+ * depth. The lowest page is a guard - a stack overflow crashes
+ * instead of silently corrupting the neighbour memory.
+ */
 static void
-coro_engine_yield(struct coro_engine *engine)
+coro_stack_create(struct coro *c, size_t size)
 {
-	struct coro *this = engine->this;
-	assert(rlist_empty(&this->link));
-	assert(this->state == CORO_STATE_RUNNING);
-	rlist_add_tail_entry(&engine->coros_running_next, this, link);
-	coro_engine_resume_next(engine);
+	size_t page_size = coro_page_size();
+	assert(size == coro_stack_size_normalize(size));
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+#ifdef MAP_STACK
+	flags |= MAP_STACK;
+#endif
+	char *base = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+		flags, -1, 0);
+	if (base == MAP_FAILED)
+		handle_error();
+	if (mprotect(base, page_size, PROT_NONE) != 0)
+		handle_error();
+	c->stack = base + page_size;
+	c->stack_size = size;
+	c->stack_class = coro_stack_class(size);
+	c->stack_committed = 0;
+	c->stack_live = NULL;
+	c->is_stack_clean = true;
 }
 
+/** Unmap a stack starting at its usable part. */
 static void
-coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+coro_stack_unmap(void *stack, size_t stack_size)
 {
-	if (coro->state == CORO_STATE_RUNNING)
-		return;
-	if (coro->state == CORO_STATE_FINISHED)
-		return;
-	assert(coro->state == CORO_STATE_SUSPENDED);
-	assert(rlist_empty(&coro->link));
-	coro->state = CORO_STATE_RUNNING;
-	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
+	size_t page_size = coro_page_size();
+	if (munmap((char *)stack - page_size, stack_size + page_size) != 0)
+		handle_error();
 }
 
 static void
-coro_engine_run(struct coro_engine *engine)
+coro_stack_destroy(struct coro *c)
 {
-	while (true) {
-		assert(rlist_empty(&engine->coros_running_now));
-		rlist_splice_tail(&engine->coros_running_now,
-			&engine->coros_running_next);
-		if (rlist_empty(&engine->coros_running_now))
-			break;
+	coro_stack_unmap(c->stack, c->stack_size);
+	c->stack = NULL;
+	c->stack_size = 0;
+}
 
-		assert(engine->this == NULL);
-		engine->this = &engine->sched;
-		assert(rlist_empty(&engine->sched.link));
-		/*
-		 * Add the scheduler to the tail so the control
-		 * comes back in the end of this iteration of the
-		 * loop.
-		 */
-		rlist_add_tail_entry(&engine->coros_running_now,
-			&engine->sched, link);
-		coro_engine_resume_next(engine);
-		assert(rlist_empty(&engine->coros_running_now));
-		assert(engine->this == &engine->sched);
-		engine->this = NULL;
-	}
+/** Size of the stacks of the given size class. */
+static size_t
+coro_stack_class_size(int stack_class)
+{
+	return (size_t)1 << (stack_class + CORO_STACK_CLASS_MIN_SHIFT);
 }
 
-static void
-coro_engine_destroy(struct coro_engine *engine)
+/** Find how many bytes of the stack are backed by physical pages. */
+static size_t
+coro_stack_committed_at(void *stack, size_t stack_size)
 {
-	assert(engine->this == NULL);
-	assert(rlist_empty(&engine->coros_running_now));
-	assert(rlist_empty(&engine->coros_running_next));
-	while (!rlist_empty(&engine->coros_pool)) {
-		struct coro *c = rlist_shift_entry(&engine->coros_pool,
-			struct coro, link);
-		free(c->stack);
-		free(c);
-		assert(engine->coro_count > 0);
-		--engine->coro_count;
+	size_t page_size = coro_page_size();
+	size_t page_count = stack_size / page_size;
+	size_t result = 0;
+	unsigned char vec[256];
+	for (size_t i = 0; i < page_count; i += lengthof(vec)) {
+		size_t count = page_count - i;
+		if (count > lengthof(vec))
+			count = lengthof(vec);
+		if (mincore((char *)stack + i * page_size,
+			    count * page_size, (void *)vec) != 0)
+			handle_error();
+		for (size_t j = 0; j < count; ++j) {
+			if (vec[j] & 1)
+				result += page_size;
+		}
 	}
-	assert(engine->coro_count == 0);
-	memset(engine, '#', sizeof(*engine));
+	return result;
 }
 
-static __thread struct coro_engine *new_coro_engine = NULL;
+static size_t
+coro_stack_committed(const struct coro *c)
+{
+	if (c->stack == NULL)
+		return 0;
+	return coro_stack_committed_at(c->stack, c->stack_size);
+}
+
+/** Functions the stack profiler tells apart, a power of 2. */
+#define CORO_STACK_PROFILE_SIZE 256
 
 /**
- * The core part of the coroutines creation - this signal handler
- * runs on a separate stack using sigaltstack. At invocation it
- * remembers its current context and jumps back to the coroutine
- * constructor. Later the coroutine continues from here.
+ * Bytes right below the frame of the measurement, which are not
+ * measured nor zeroed, because the measurement itself uses them.
+ * Every coroutine goes that deep anyway, to call its function.
  */
-static void
-coro_body(int signum)
-{
-	(void)signum;
-	struct coro_engine *my_engine = new_coro_engine;
-	new_coro_engine = NULL;
+#define CORO_STACK_PROFILE_SLACK 1024
+
+/** Stack depths of the finished coroutines, for all the engines. */
+static struct {
+	pthread_mutex_t mutex;
+	bool is_enabled;
+	/** Open addressing by the function. */
+	struct coro_stack_profile entries[CORO_STACK_PROFILE_SIZE];
+	/** Number of the used entries. */
+	int count;
+	/** Finished on a stack used before the profiling was on. */
+	uint64_t skip_count;
+	/** Not measured, because the table is full. */
+	uint64_t lost_count;
+} coro_stack_profiler = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * The lowest committed page of the stack below @a limit, or
+ * @a limit. The pages below it were never touched.
+ */
+static char *
+coro_stack_lowest_committed(char *stack, char *limit)
+{
+	size_t page_size = coro_page_size();
+	size_t page_count = (limit - stack) / page_size;
+	unsigned char vec[64];
+	for (size_t i = 0; i < page_count; i += lengthof(vec)) {
+		size_t count = page_count - i;
+		if (count > lengthof(vec))
+			count = lengthof(vec);
+		if (mincore(stack + i * page_size, count * page_size,
+			    (void *)vec) != 0)
+			handle_error();
+		for (size_t j = 0; j < count; ++j) {
+			if (vec[j] & 1)
+				return stack + (i + j) * page_size;
+		}
+	}
+	return limit;
+}
+
+static void
+coro_stack_profile_add(const struct coro *c, size_t depth)
+{
+	pthread_mutex_lock(&coro_stack_profiler.mutex);
+	size_t mask = CORO_STACK_PROFILE_SIZE - 1;
+	size_t i = ((uintptr_t)c->func >> 4) & mask;
+	struct coro_stack_profile *p;
+	for (size_t n = 0; n <= mask; ++n, i = (i + 1) & mask) {
+		p = &coro_stack_profiler.entries[i];
+		if (p->func == c->func)
+			goto found;
+		if (p->func == NULL) {
+			p->func = c->func;
+			++coro_stack_profiler.count;
+			goto found;
+		}
+	}
+	++coro_stack_profiler.lost_count;
+	pthread_mutex_unlock(&coro_stack_profiler.mutex);
+	return;
+found:
+	memcpy(p->name, c->name, sizeof(p->name));
+	++p->count;
+	p->total_depth += depth;
+	if (depth > p->max_depth)
+		p->max_depth = depth;
+	if (c->stack_size > p->stack_size)
+		p->stack_size = c->stack_size;
+	pthread_mutex_unlock(&coro_stack_profiler.mutex);
+}
+
+/**
+ * Measure how deep the finished coroutine has used its stack, and
+ * zero the used part, so the next function on this stack starts
+ * clean. Runs on the same stack, so everything near its own frame
+ * is spared. The zeroing is a plain loop, which doesn't go below
+ * the frame.
+ */
+static void __attribute__((noinline))
+coro_stack_profile_finish(struct coro *c)
+{
+	char *limit = (char *)__builtin_frame_address(0) -
+		CORO_STACK_PROFILE_SLACK;
+	limit = (char *)((uintptr_t)limit & ~(uintptr_t)7);
+	volatile uint64_t *pos = (uint64_t *)
+		coro_stack_lowest_committed(c->stack, limit);
+	while ((char *)pos < limit && *pos == 0)
+		++pos;
+	if (c->is_stack_clean) {
+		coro_stack_profile_add(c, (char *)c->stack + c->stack_size -
+			(char *)pos);
+	} else {
+		__atomic_add_fetch(&coro_stack_profiler.skip_count, 1,
+			__ATOMIC_RELAXED);
+	}
+	for (; (char *)pos < limit; ++pos)
+		*pos = 0;
+	c->is_stack_clean = true;
+}
+
+/**
+ * Refresh the committed stack bytes of all the coroutines. Pages
+ * are never committed back, so the total can only grow until
+ * some stacks are released. Hence it is enough to check the
+ * peak here and right before any release.
+ */
+static void
+coro_engine_update_stack_stats(struct coro_engine *engine)
+{
+	size_t total = 0;
+	struct coro *c;
+	pthread_mutex_lock(&engine->inbox_mutex);
+	rlist_foreach_entry(c, &engine->coros_all, engine_link) {
+		c->stack_committed = coro_stack_committed(c);
+		total += c->stack_committed;
+	}
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		struct coro_free_stack *s;
+		rlist_foreach_entry(s, &engine->stacks_free[i], link) {
+			s->stack_committed = coro_stack_committed_at(s->stack,
+				coro_stack_class_size(i));
+			total += s->stack_committed;
+		}
+	}
+	engine->stack_committed = total;
+	if (total > engine->stack_committed_peak)
+		engine->stack_committed_peak = total;
+	pthread_mutex_unlock(&engine->inbox_mutex);
+}
+
+/** Get more free slots from the shared list or from a new chunk. */
+static void
+coro_engine_refill_slots(struct coro_engine *engine)
+{
+	assert(engine->slots_free == NULL);
+	pthread_mutex_lock(&coro_slab.mutex);
+	if (coro_slab.free != NULL) {
+		while (coro_slab.free != NULL &&
+		       engine->slots_free_count < CORO_SLAB_CHUNK_SLOTS) {
+			struct coro_slot *slot = coro_slab.free;
+			coro_slab.free = slot->next;
+			slot->next = engine->slots_free;
+			engine->slots_free = slot;
+			++engine->slots_free_count;
+		}
+		pthread_mutex_unlock(&coro_slab.mutex);
+		return;
+	}
+	struct coro_slab_chunk *chunk = aligned_alloc(CORO_CACHE_LINE,
+		CORO_CACHE_LINE + CORO_SLAB_CHUNK_SLOTS * CORO_SLOT_SIZE);
+	if (chunk == NULL)
+		handle_error();
+	chunk->next = coro_slab.chunks;
+	coro_slab.chunks = chunk;
+	pthread_mutex_unlock(&coro_slab.mutex);
+	/* In the address order, so the neighbours are allocated together. */
+	char *slots = (char *)chunk + CORO_CACHE_LINE;
+	for (int i = CORO_SLAB_CHUNK_SLOTS - 1; i >= 0; --i) {
+		struct coro_slot *slot =
+			(struct coro_slot *)(slots + i * CORO_SLOT_SIZE);
+		slot->next = engine->slots_free;
+		engine->slots_free = slot;
+	}
+	engine->slots_free_count = CORO_SLAB_CHUNK_SLOTS;
+}
+
+/** Give the free slots above @a keep to the shared list. */
+static void
+coro_engine_flush_slots(struct coro_engine *engine, size_t keep)
+{
+	if (engine->slots_free_count <= keep)
+		return;
+	pthread_mutex_lock(&coro_slab.mutex);
+	while (engine->slots_free_count > keep) {
+		struct coro_slot *slot = engine->slots_free;
+		engine->slots_free = slot->next;
+		--engine->slots_free_count;
+		slot->next = coro_slab.free;
+		coro_slab.free = slot;
+	}
+	pthread_mutex_unlock(&coro_slab.mutex);
+}
+
+/**
+ * Allocate memory for a coroutine structure of the given size,
+ * bigger than struct coro for the tasks. The small ones come from
+ * the slab.
+ */
+static struct coro *
+coro_engine_alloc_coro(struct coro_engine *engine, size_t size,
+	bool *is_slab)
+{
+	if (size > CORO_SLOT_SIZE) {
+		size = (size + CORO_CACHE_LINE - 1) &
+			~(size_t)(CORO_CACHE_LINE - 1);
+		struct coro *c = aligned_alloc(CORO_CACHE_LINE, size);
+		if (c == NULL)
+			handle_error();
+		*is_slab = false;
+		return c;
+	}
+	if (engine->slots_free == NULL)
+		coro_engine_refill_slots(engine);
+	struct coro_slot *slot = engine->slots_free;
+	engine->slots_free = slot->next;
+	--engine->slots_free_count;
+	*is_slab = true;
+	return (struct coro *)slot;
+}
+
+static void
+coro_engine_free_coro(struct coro_engine *engine, struct coro *c)
+{
+	if (!c->is_slab) {
+		free(c);
+		return;
+	}
+	struct coro_slot *slot = (struct coro_slot *)c;
+	slot->next = engine->slots_free;
+	engine->slots_free = slot;
+	if (++engine->slots_free_count > CORO_SLAB_CACHE_MAX)
+		coro_engine_flush_slots(engine, CORO_SLAB_CACHE_MAX / 2);
+}
+
+/** Free a joined coroutine together with its stack. */
+static void
+coro_engine_release(struct coro_engine *engine, struct coro *c)
+{
+	pthread_mutex_lock(&engine->inbox_mutex);
+	assert(engine->stack_committed >= c->stack_committed);
+	engine->stack_committed -= c->stack_committed;
+	rlist_del_entry(c, engine_link);
+	assert(engine->coro_count > 0);
+	--engine->coro_count;
+	pthread_mutex_unlock(&engine->inbox_mutex);
+	if (c->stack != NULL)
+		coro_stack_destroy(c);
+	coro_engine_free_coro(engine, c);
+}
+
+/** How many coroutines the pool of the given class can keep. */
+static size_t
+coro_engine_pool_max(const struct coro_engine *engine, int stack_class)
+{
+	return engine->pool_limit >> (stack_class + CORO_STACK_CLASS_MIN_SHIFT);
+}
+
+/** Unmap a free stack. The caller has removed it from its list. */
+static void
+coro_engine_release_free_stack(struct coro_engine *engine,
+	struct coro_free_stack *s, int stack_class)
+{
+	pthread_mutex_lock(&engine->inbox_mutex);
+	assert(engine->stack_committed >= s->stack_committed);
+	engine->stack_committed -= s->stack_committed;
+	pthread_mutex_unlock(&engine->inbox_mutex);
+	coro_stack_unmap(s->stack, coro_stack_class_size(stack_class));
+}
+
+/**
+ * Free the joined coroutines kept for reuse, so that each pool
+ * list has not more than @a keep_bytes of stacks.
+ */
+static void
+coro_engine_shrink_pool(struct coro_engine *engine, size_t keep_bytes)
+{
+	coro_engine_update_stack_stats(engine);
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		struct rlist *pool = &engine->coros_pool[i];
+		size_t keep = keep_bytes >> (i + CORO_STACK_CLASS_MIN_SHIFT);
+		while (engine->coros_pool_count[i] > keep) {
+			struct coro *c = rlist_shift_tail_entry(pool,
+				struct coro, link);
+			--engine->coros_pool_count[i];
+			coro_engine_release(engine, c);
+		}
+		while (engine->stacks_free_count[i] > keep) {
+			struct coro_free_stack *s = rlist_shift_tail_entry(
+				&engine->stacks_free[i], struct coro_free_stack,
+				link);
+			--engine->stacks_free_count[i];
+			coro_engine_release_free_stack(engine, s, i);
+		}
+	}
+}
+
+/** Free all the joined coroutines kept for reuse. */
+static void
+coro_engine_clear_pool(struct coro_engine *engine)
+{
+	coro_engine_shrink_pool(engine, 0);
+}
+
+/**
+ * Give the physical pages of the pooled stacks back to the OS.
+ * The mappings stay, so the reuse is still cheap. The pages in
+ * use by the finished coroutine's own frames are kept.
+ */
+static void
+coro_engine_trim(struct coro_engine *engine)
+{
+	coro_engine_shrink_pool(engine, engine->pool_limit);
+	size_t page_size = coro_page_size();
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		struct coro *c;
+		rlist_foreach_entry(c, &engine->coros_pool[i], link) {
+			uintptr_t end = (uintptr_t)c->stack_live &
+				~(uintptr_t)(page_size - 1);
+			/* Keep one more page as a margin. */
+			end -= page_size;
+			if (end <= (uintptr_t)c->stack)
+				continue;
+			if (madvise(c->stack, end - (uintptr_t)c->stack,
+				    MADV_DONTNEED) != 0)
+				handle_error();
+		}
+		/* Only the page with the list link is needed. */
+		size_t size = coro_stack_class_size(i);
+		struct coro_free_stack *s;
+		rlist_foreach_entry(s, &engine->stacks_free[i], link) {
+			if (size > page_size &&
+			    madvise(s->stack, size - page_size,
+				    MADV_DONTNEED) != 0)
+				handle_error();
+		}
+	}
+	coro_engine_update_stack_stats(engine);
+}
+
+static void
+coro_engine_create(struct coro_engine *engine)
+{
+	memset(engine, 0, sizeof(*engine));
+	rlist_create(&engine->sched.link);
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		rlist_create(&engine->coros_running_now[i]);
+		rlist_create(&engine->coros_running_next[i]);
+		coro_deque_create(&engine->ready[i]);
+	}
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		rlist_create(&engine->coros_pool[i]);
+		rlist_create(&engine->stacks_free[i]);
+	}
+	rlist_create(&engine->coros_all);
+	engine->stack_size = CORO_STACK_SIZE_DEFAULT;
+	engine->pool_limit = CORO_POOL_LIMIT_DEFAULT;
+	engine->sched.engine = engine;
+	rlist_create(&engine->sched.remote_link);
+	engine->worker_id = -1;
+	pthread_mutex_init(&engine->inbox_mutex, NULL);
+	/* Timed waits use the same clock as the timers. */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&engine->inbox_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	rlist_create(&engine->inbox);
+	engine->poll_fd = -1;
+	engine->poll_wake_fd[0] = -1;
+	engine->poll_wake_fd[1] = -1;
+	pthread_mutex_lock(&coro_slab.mutex);
+	++coro_slab.engine_count;
+	pthread_mutex_unlock(&coro_slab.mutex);
+}
+
+/** Give the engine's slots back, and free the slab with the last one. */
+static void
+coro_engine_destroy_slots(struct coro_engine *engine)
+{
+	coro_engine_flush_slots(engine, 0);
+	pthread_mutex_lock(&coro_slab.mutex);
+	assert(coro_slab.engine_count > 0);
+	if (--coro_slab.engine_count == 0) {
+		/* No engines - no coroutines, all the slots are free. */
+		while (coro_slab.chunks != NULL) {
+			struct coro_slab_chunk *chunk = coro_slab.chunks;
+			coro_slab.chunks = chunk->next;
+			free(chunk);
+		}
+		coro_slab.free = NULL;
+	}
+	pthread_mutex_unlock(&coro_slab.mutex);
+}
+
+/** Number of worker threads, each with an own engine. */
+static int coro_worker_count = 0;
+
+struct coro_worker {
+	/** Thread running the engine. */
+	pthread_t thread;
+	/** The worker's own engine. */
+	struct coro_engine engine;
+};
+
+/** Worker threads for the M:N mode. */
+static struct coro_worker *coro_workers = NULL;
+/** Number of the idle workers, which can steal more work. */
+static int coro_idle_count = 0;
+
+/**
+ * Make the coroutine runnable in the next round of the scheduler,
+ * or in the current one if it has the high priority. Must be
+ * called by the engine's own thread.
+ */
+static void
+coro_engine_schedule(struct coro_engine *engine, struct coro *c)
+{
+	int level = c->prio_level;
+	if (engine->worker_id < 0) {
+		if (level == 0) {
+			rlist_add_tail_entry(&engine->coros_running_now[0], c,
+				link);
+		} else {
+			rlist_add_tail_entry(&engine->coros_running_next[level],
+				c, link);
+		}
+		return;
+	}
+	if (c == engine->task_host) {
+		/* Pushed by coro_engine_after_switch(). */
+		assert(engine->yielding == NULL);
+		engine->yielding = c;
+		return;
+	}
+	coro_deque_push(&engine->ready[level], c);
+}
+
+/** Take the next coroutine of the current round at the level. */
+static struct coro *
+coro_engine_take(struct coro_engine *engine, int level)
+{
+	if (engine->worker_id >= 0) {
+		return coro_deque_take(&engine->ready[level],
+			engine->round_end[level]);
+	}
+	struct rlist *list = &engine->coros_running_now[level];
+	if (rlist_empty(list))
+		return NULL;
+	return rlist_shift_entry(list, struct coro, link);
+}
+
+/** Check if the engine has any runnable coroutines. */
+static bool
+coro_engine_has_ready(struct coro_engine *engine)
+{
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		if (!rlist_empty(&engine->coros_running_now[i]) ||
+		    coro_deque_size(&engine->ready[i]) > 0)
+			return true;
+	}
+	return false;
+}
+
+/** Number of coroutines in the ready deques of the engine. */
+static int64_t
+coro_engine_ready_size(struct coro_engine *engine)
+{
+	int64_t size = 0;
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i)
+		size += coro_deque_size(&engine->ready[i]);
+	return size;
+}
+
+/**
+ * Count the coroutine as owned by the engine. The inbox must be
+ * locked.
+ */
+static void
+coro_engine_own_locked(struct coro_engine *engine, struct coro *c)
+{
+	assert(c->engine == engine);
+	++engine->coro_count;
+	__atomic_add_fetch(&engine->active_count, 1, __ATOMIC_RELAXED);
+	engine->stack_committed += c->stack_committed;
+	rlist_add_tail_entry(&engine->coros_all, c, engine_link);
+}
+
+/**
+ * Give the coroutine away to another engine. The inbox must be
+ * locked, so no new requests can get lost in it. The requests
+ * already sent to the old engine are moved together with the
+ * coroutine.
+ * @return Requests which the new owner should execute.
+ */
+static unsigned
+coro_engine_disown_locked(struct coro_engine *engine, struct coro *c,
+	struct coro_engine *to)
+{
+	assert(c->engine == engine);
+	unsigned events = c->remote_events;
+	if (events != 0) {
+		rlist_del_entry(c, remote_link);
+		c->remote_events = 0;
+		__atomic_store_n(&engine->inbox_size, engine->inbox_size - 1,
+			__ATOMIC_RELAXED);
+	}
+	rlist_del_entry(c, engine_link);
+	assert(engine->coro_count > 0);
+	--engine->coro_count;
+	assert(__atomic_load_n(&engine->active_count,
+			       __ATOMIC_RELAXED) > 0);
+	__atomic_sub_fetch(&engine->active_count, 1, __ATOMIC_RELAXED);
+	assert(engine->stack_committed >= c->stack_committed);
+	engine->stack_committed -= c->stack_committed;
+	__atomic_store_n(&c->engine, to, __ATOMIC_RELEASE);
+	return events;
+}
+
+static void
+coro_engine_post_locked(struct coro_engine *engine, struct coro *coro,
+	unsigned events);
+
+static void
+coro_engine_prime_stack(struct coro_engine *engine, struct coro *c,
+	size_t stack_size);
+
+/**
+ * Give a lazy coroutine a stack right before it starts - a cached
+ * one, still warm after another lazy coroutine, or a new one.
+ */
+static void
+coro_engine_bind_stack(struct coro_engine *engine, struct coro *c)
+{
+	assert(c->is_lazy && c->stack == NULL);
+	int stack_class = c->stack_class;
+	struct rlist *list = &engine->stacks_free[stack_class];
+	if (rlist_empty(list)) {
+		coro_stack_create(c, coro_stack_class_size(stack_class));
+	} else {
+		struct coro_free_stack *s = rlist_shift_entry(list,
+			struct coro_free_stack, link);
+		--engine->stacks_free_count[stack_class];
+		void *stack = s->stack;
+		size_t committed = s->stack_committed;
+		c->is_stack_clean = s->is_stack_clean;
+		pthread_mutex_lock(&engine->inbox_mutex);
+		c->stack = stack;
+		c->stack_committed = committed;
+		pthread_mutex_unlock(&engine->inbox_mutex);
+		c->stack_live = NULL;
+	}
+	coro_engine_prime_stack(engine, c, c->stack_size);
+}
+
+/** Take the stack from a lazy coroutine which has finished. */
+static void
+coro_engine_unbind_stack(struct coro_engine *engine, struct coro *c)
+{
+	assert(c->is_lazy && c->state == CORO_STATE_FINISHED);
+	int stack_class = c->stack_class;
+	size_t size = coro_stack_class_size(stack_class);
+	struct coro_free_stack *s = (struct coro_free_stack *)
+		((char *)c->stack + size) - 1;
+	/* The committed bytes move from the coroutine to the stack. */
+	pthread_mutex_lock(&engine->inbox_mutex);
+	s->stack = c->stack;
+	s->stack_committed = c->stack_committed;
+	s->is_stack_clean = c->is_stack_clean;
+	c->stack = NULL;
+	c->stack_committed = 0;
+	pthread_mutex_unlock(&engine->inbox_mutex);
+	if (engine->stacks_free_count[stack_class] >=
+	    coro_engine_pool_max(engine, stack_class)) {
+		coro_engine_release_free_stack(engine, s, stack_class);
+		return;
+	}
+	/* The most recently used go first, same as in the pool. */
+	rlist_add_entry(&engine->stacks_free[stack_class], s, link);
+	++engine->stacks_free_count[stack_class];
+}
+
+static void
+coro_engine_wakeup_local(struct coro_engine *engine, struct coro *coro);
+
+static void
+coro_engine_finish(struct coro_engine *engine, struct coro *c,
+	struct coro *joiner);
+
+/**
+ * Run one step of a task right on the current stack. It is either
+ * finished then, or waits for a wakeup.
+ */
+static void
+coro_engine_run_task(struct coro_engine *engine, struct coro *c)
+{
+	assert(c->is_task && c->state == CORO_STATE_RUNNING);
+	struct coro *prev = engine->this;
+	engine->this = c;
+	engine->task_host = prev;
+	++c->stats.switch_count;
+	++engine->stats.switch_count;
+	uint64_t start = 0;
+	if (engine->is_timing) {
+		start = coro_clock_ns();
+		uint64_t ready = c->stats_ts > engine->timing_start ?
+			c->stats_ts : engine->timing_start;
+		uint64_t wait = start - ready;
+		c->stats.wait_ns += wait;
+		engine->stats.wait_ns += wait;
+		if (wait > c->stats.wait_max_ns)
+			c->stats.wait_max_ns = wait;
+		if (wait > engine->stats.wait_max_ns)
+			engine->stats.wait_max_ns = wait;
+	}
+	TRACE_BEGIN("task", (uintptr_t)c);
+	bool is_done = c->task_func(c, (char *)c + CORO_TASK_STATE_OFFSET);
+	TRACE_END("task");
+	if (engine->is_timing) {
+		uint64_t run = coro_clock_ns() - start;
+		c->stats.run_ns += run;
+		engine->stats.run_ns += run;
+		if (run > c->stats.run_max_ns)
+			c->stats.run_max_ns = run;
+		if (run > engine->stats.run_max_ns)
+			engine->stats.run_max_ns = run;
+	}
+	engine->this = prev;
+	if (is_done) {
+		assert(__atomic_load_n(&engine->active_count,
+				       __ATOMIC_RELAXED) > 0);
+		__atomic_sub_fetch(&engine->active_count, 1, __ATOMIC_RELAXED);
+		struct coro *joiner = __atomic_exchange_n(&c->joiner,
+			CORO_JOINER_FINISHED, __ATOMIC_ACQ_REL);
+		coro_engine_finish(engine, c, joiner);
+		engine->task_host = NULL;
+		return;
+	}
+	engine->task_host = NULL;
+	++c->stats.suspend_count;
+	++engine->stats.suspend_count;
+	__atomic_store_n(&c->state, CORO_STATE_SUSPENDED, __ATOMIC_RELAXED);
+	/* Woken up by itself during the step. */
+	if (c->wakeup_pending) {
+		c->wakeup_pending = false;
+		coro_engine_wakeup_local(engine, c);
+	}
+}
+
+/**
+ * Hand the leaving coroutine over to its new engine. Must be
+ * called right after each switch, on the resumed side, when the
+ * previous coroutine's stack is not used anymore.
+ */
+static void
+coro_engine_after_switch(struct coro_engine *engine)
+{
+	struct coro *c = engine->unbinding;
+	if (c != NULL) {
+		engine->unbinding = NULL;
+		coro_engine_unbind_stack(engine, c);
+	}
+	c = engine->yielding;
+	if (c != NULL) {
+		engine->yielding = NULL;
+		coro_engine_schedule(engine, c);
+	}
+	c = engine->leaving;
+	if (c == NULL)
+		return;
+	struct coro_engine *to = engine->leaving_to;
+	engine->leaving = NULL;
+	engine->leaving_to = NULL;
+	pthread_mutex_lock(&engine->inbox_mutex);
+	unsigned events = coro_engine_disown_locked(engine, c, to);
+	pthread_mutex_unlock(&engine->inbox_mutex);
+
+	pthread_mutex_lock(&to->inbox_mutex);
+	coro_engine_post_locked(to, c, events | CORO_REMOTE_ADOPT);
+	pthread_mutex_unlock(&to->inbox_mutex);
+}
+
+/**
+ * Pick the next coroutine or task to run in the current round, the
+ * most important first. When the round is over, it is the
+ * scheduler.
+ */
+static struct coro *
+coro_engine_pick(struct coro_engine *engine)
+{
+	int level = 0;
+	if (engine->prio_high_streak >= CORO_PRIO_HIGH_STREAK_MAX) {
+		/*
+		 * Let the others have a turn. If there are none, the
+		 * scheduler gets it, so the inbox and the timers are
+		 * not starved either.
+		 */
+		engine->prio_high_streak = 0;
+		level = 1;
+	}
+	for (; level < CORO_PRIO_COUNT; ++level) {
+		struct coro *c = coro_engine_take(engine, level);
+		if (c == NULL)
+			continue;
+		if (level == 0)
+			++engine->prio_high_streak;
+		else
+			engine->prio_high_streak = 0;
+		return c;
+	}
+	engine->prio_high_streak = 0;
+	return &engine->sched;
+}
+
+/**
+ * Pick the next coroutine to switch to. The tasks on the way are
+ * run right here. Not inlined to keep its locals away from
+ * sigsetjmp() in the caller.
+ */
+static struct coro * __attribute__((noinline))
+coro_engine_next(struct coro_engine *engine)
+{
+	while (true) {
+		struct coro *c = coro_engine_pick(engine);
+		if (c->is_task) {
+			coro_engine_run_task(engine, c);
+			continue;
+		}
+		if (c->stack == NULL && c != &engine->sched)
+			coro_engine_bind_stack(engine, c);
+		return c;
+	}
+}
+
+/** A coroutine has become runnable. */
+static inline void
+coro_engine_stats_ready(struct coro_engine *engine, struct coro *c)
+{
+	if (engine->is_timing)
+		c->stats_ts = coro_clock_ns();
+}
+
+/**
+ * Account a switch between the coroutines. Not inlined to keep
+ * its locals away from sigsetjmp() in the caller.
+ */
+static void __attribute__((noinline))
+coro_engine_stats_switch(struct coro_engine *engine, struct coro *from,
+	struct coro *to)
+{
+	/*
+	 * Each coroutine's slice is begun and ended by the thread it
+	 * runs on, even if it migrates, so the slices nest right.
+	 */
+	if (from != &engine->sched)
+		TRACE_END("coro");
+	if (to != &engine->sched)
+		TRACE_BEGIN("coro", (uintptr_t)to);
+	struct coro_stats *total = &engine->stats;
+	++total->switch_count;
+	++to->stats.switch_count;
+	if (!engine->is_timing)
+		return;
+	uint64_t now = coro_clock_ns();
+	/* The scheduler itself is not accounted. */
+	if (from != &engine->sched) {
+		uint64_t start = from->stats_ts > engine->timing_start ?
+			from->stats_ts : engine->timing_start;
+		uint64_t run = now - start;
+		from->stats.run_ns += run;
+		total->run_ns += run;
+		if (run > from->stats.run_max_ns)
+			from->stats.run_max_ns = run;
+		if (run > total->run_max_ns)
+			total->run_max_ns = run;
+		/* If it yields, then it waits from now on. */
+		from->stats_ts = now;
+	}
+	if (to != &engine->sched) {
+		uint64_t start = to->stats_ts > engine->timing_start ?
+			to->stats_ts : engine->timing_start;
+		uint64_t wait = now - start;
+		to->stats.wait_ns += wait;
+		total->wait_ns += wait;
+		if (wait > to->stats.wait_max_ns)
+			to->stats.wait_max_ns = wait;
+		if (wait > total->wait_max_ns)
+			total->wait_max_ns = wait;
+		to->stats_ts = now;
+	}
+}
+
+static void
+coro_engine_resume_next(struct coro_engine *engine)
+{
+	struct coro *to = coro_engine_next(engine);
+	struct coro *from = engine->this;
+	assert(from != NULL);
+
+	coro_engine_stats_switch(engine, from, to);
+	engine->this = NULL;
+	coro_ctx_switch(&from->ctx, &to->ctx);
+	/*
+	 * The coroutine might have been resumed by another engine
+	 * if it has migrated.
+	 */
+	engine = from->engine;
+	assert(rlist_empty(&from->link));
+	assert(engine->this == NULL);
+	engine->this = from;
+	coro_engine_after_switch(engine);
+}
+
+/** Tasks have no stack to pause on, they can only return. */
+static void
+coro_check_stackful(const struct coro *c)
+{
+	if (c->is_task) {
+		printf("Error: a task can't block, it should return "
+			"and wait for a wakeup\n");
+		exit(-1);
+	}
+}
+
+static void
+coro_engine_suspend(struct coro_engine *engine)
+{
+	struct coro *this = engine->this;
+	if (this == NULL) {
+		printf("Error: deadlock - suspension with no active "
+			"coroutines\n");
+		exit(-1);
+	}
+	coro_check_stackful(this);
+	assert(rlist_empty(&this->link));
+	assert(this->state == CORO_STATE_RUNNING);
+	if (this->wakeup_pending) {
+		this->wakeup_pending = false;
+		return;
+	}
+	++this->stats.suspend_count;
+	++engine->stats.suspend_count;
+	/* Joiners from other threads can read it. */
+	__atomic_store_n(&this->state, CORO_STATE_SUSPENDED, __ATOMIC_RELAXED);
+	coro_engine_resume_next(engine);
+}
+
+static void
+coro_engine_yield(struct coro_engine *engine)
+{
+	struct coro *this = engine->this;
+	coro_check_stackful(this);
+	assert(rlist_empty(&this->link));
+	assert(this->state == CORO_STATE_RUNNING);
+	++this->stats.yield_count;
+	++engine->stats.yield_count;
+	if (engine->worker_id < 0) {
+		coro_engine_schedule(engine, this);
+	} else {
+		assert(engine->yielding == NULL);
+		engine->yielding = this;
+	}
+	coro_engine_resume_next(engine);
+}
+
+/** Deadline in @a sec seconds from now. */
+static uint64_t
+coro_deadline_after(double sec)
+{
+	if (sec <= 0)
+		return coro_clock_ns();
+	if (sec > 1e9)
+		sec = 1e9;
+	return coro_clock_ns() + (uint64_t)(sec * 1e9);
+}
+
+static void
+coro_engine_timer_set(struct coro_engine *engine, size_t pos, struct coro *c)
+{
+	engine->timers[pos] = c;
+	c->timer_pos = pos;
+}
+
+/** Move the timer up the heap until its parent is earlier. */
+static void
+coro_engine_timer_up(struct coro_engine *engine, size_t pos)
+{
+	struct coro *c = engine->timers[pos];
+	while (pos > 0) {
+		size_t parent = (pos - 1) / 2;
+		struct coro *p = engine->timers[parent];
+		if (p->timer_deadline <= c->timer_deadline)
+			break;
+		coro_engine_timer_set(engine, pos, p);
+		pos = parent;
+	}
+	coro_engine_timer_set(engine, pos, c);
+}
+
+/** Move the timer down the heap until its children are later. */
+static void
+coro_engine_timer_down(struct coro_engine *engine, size_t pos)
+{
+	struct coro *c = engine->timers[pos];
+	size_t count = engine->timer_count;
+	while (true) {
+		size_t child = 2 * pos + 1;
+		if (child >= count)
+			break;
+		if (child + 1 < count && engine->timers[child + 1]->
+		    timer_deadline < engine->timers[child]->timer_deadline)
+			++child;
+		struct coro *ch = engine->timers[child];
+		if (c->timer_deadline <= ch->timer_deadline)
+			break;
+		coro_engine_timer_set(engine, pos, ch);
+		pos = child;
+	}
+	coro_engine_timer_set(engine, pos, c);
+}
+
+static void
+coro_engine_timer_add(struct coro_engine *engine, struct coro *c,
+	uint64_t deadline)
+{
+	assert(c->timer_pos == CORO_TIMER_NONE);
+	if (engine->timer_count == engine->timer_capacity) {
+		size_t cap = engine->timer_capacity * 2;
+		if (cap == 0)
+			cap = 16;
+		engine->timers = realloc(engine->timers,
+			cap * sizeof(engine->timers[0]));
+		if (engine->timers == NULL)
+			handle_error();
+		engine->timer_capacity = cap;
+	}
+	c->timer_deadline = deadline;
+	size_t pos = engine->timer_count++;
+	coro_engine_timer_set(engine, pos, c);
+	coro_engine_timer_up(engine, pos);
+}
+
+static void
+coro_engine_timer_del(struct coro_engine *engine, struct coro *c)
+{
+	size_t pos = c->timer_pos;
+	assert(pos < engine->timer_count && engine->timers[pos] == c);
+	c->timer_pos = CORO_TIMER_NONE;
+	struct coro *last = engine->timers[--engine->timer_count];
+	if (last == c)
+		return;
+	coro_engine_timer_set(engine, pos, last);
+	coro_engine_timer_up(engine, pos);
+	coro_engine_timer_down(engine, last->timer_pos);
+}
+
+static void
+coro_set_nonblock_cloexec(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+		handle_error();
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0)
+		handle_error();
+}
+
+/** Create the poller with the wake pipe in it, if not yet. */
+static void
+coro_engine_poll_create(struct coro_engine *engine)
+{
+	if (engine->poll_fd >= 0)
+		return;
+	if (pipe(engine->poll_wake_fd) != 0)
+		handle_error();
+	coro_set_nonblock_cloexec(engine->poll_wake_fd[0]);
+	coro_set_nonblock_cloexec(engine->poll_wake_fd[1]);
+	int wake_fd = engine->poll_wake_fd[0];
+#if CORO_USE_EPOLL
+	engine->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (engine->poll_fd < 0)
+		handle_error();
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(engine->poll_fd, EPOLL_CTL_ADD, wake_fd, &ev) != 0)
+		handle_error();
+#else
+	engine->poll_fd = kqueue();
+	if (engine->poll_fd < 0)
+		handle_error();
+	if (fcntl(engine->poll_fd, F_SETFD, FD_CLOEXEC) != 0)
+		handle_error();
+	struct kevent ev;
+	EV_SET(&ev, wake_fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	if (kevent(engine->poll_fd, &ev, 1, NULL, 0, NULL) != 0)
+		handle_error();
+#endif
+}
+
+static void
+coro_engine_poll_destroy(struct coro_engine *engine)
+{
+	assert(engine->fd_wait_count == 0);
+	if (engine->poll_fd < 0)
+		return;
+	close(engine->poll_fd);
+	close(engine->poll_wake_fd[0]);
+	close(engine->poll_wake_fd[1]);
+}
+
+/**
+ * Subscribe the coroutine for the events of the descriptor, once.
+ * @retval -1 Error, errno is set.
+ */
+static int
+coro_engine_fd_add(struct coro_engine *engine, struct coro *c, int fd,
+	int events)
+{
+	coro_engine_poll_create(engine);
+#if CORO_USE_EPOLL
+	struct epoll_event ev;
+	ev.events = EPOLLONESHOT;
+	if ((events & CORO_FD_READ) != 0)
+		ev.events |= EPOLLIN;
+	if ((events & CORO_FD_WRITE) != 0)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = c;
+	if (epoll_ctl(engine->poll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		return -1;
+#else
+	struct kevent ev[2];
+	int count = 0;
+	if ((events & CORO_FD_READ) != 0) {
+		EV_SET(&ev[count++], fd, EVFILT_READ, EV_ADD | EV_ONESHOT, 0,
+			0, c);
+	}
+	if ((events & CORO_FD_WRITE) != 0) {
+		EV_SET(&ev[count++], fd, EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0,
+			0, c);
+	}
+	if (kevent(engine->poll_fd, ev, count, NULL, 0, NULL) != 0)
+		return -1;
+#endif
+	c->wait_fd = fd;
+	c->wait_events = events;
+	c->wait_revents = 0;
+	++engine->fd_wait_count;
+	return 0;
+}
+
+/** Unsubscribe the coroutine from its descriptor. */
+static void
+coro_engine_fd_del(struct coro_engine *engine, struct coro *c)
+{
+	assert(c->wait_fd >= 0);
+	assert(engine->fd_wait_count > 0);
+#if CORO_USE_EPOLL
+	epoll_ctl(engine->poll_fd, EPOLL_CTL_DEL, c->wait_fd, NULL);
+#else
+	/*
+	 * The fired one-shot filters are already gone, so errors
+	 * are ignored.
+	 */
+	struct kevent ev;
+	if ((c->wait_events & CORO_FD_READ) != 0) {
+		EV_SET(&ev, c->wait_fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+		kevent(engine->poll_fd, &ev, 1, NULL, 0, NULL);
+	}
+	if ((c->wait_events & CORO_FD_WRITE) != 0) {
+		EV_SET(&ev, c->wait_fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+		kevent(engine->poll_fd, &ev, 1, NULL, 0, NULL);
+	}
+#endif
+	c->wait_fd = -1;
+	--engine->fd_wait_count;
+}
+
+static void
+coro_engine_wakeup_local(struct coro_engine *engine, struct coro *coro);
+
+/**
+ * Collect the ready descriptors and wake their coroutines up.
+ * @param timeout_ms How long to block, -1 for infinity.
+ */
+static void
+coro_engine_poll(struct coro_engine *engine, int timeout_ms)
+{
+	enum { CORO_POLL_BATCH = 64 };
+	int wake_fd = engine->poll_wake_fd[0];
+#if CORO_USE_EPOLL
+	struct epoll_event events[CORO_POLL_BATCH];
+	int count = epoll_wait(engine->poll_fd, events, CORO_POLL_BATCH,
+		timeout_ms);
+#else
+	struct kevent events[CORO_POLL_BATCH];
+	struct timespec ts, *tsp = NULL;
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+		tsp = &ts;
+	}
+	int count = kevent(engine->poll_fd, NULL, 0, events, CORO_POLL_BATCH,
+		tsp);
+#endif
+	if (count < 0) {
+		if (errno == EINTR)
+			return;
+		handle_error();
+	}
+	for (int i = 0; i < count; ++i) {
+#if CORO_USE_EPOLL
+		struct coro *c = events[i].data.ptr;
+		uint32_t flags = events[i].events;
+		int revents = 0;
+		if ((flags & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0)
+			revents |= CORO_FD_READ;
+		if ((flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0)
+			revents |= CORO_FD_WRITE;
+#else
+		struct coro *c = events[i].udata;
+		int revents = events[i].filter == EVFILT_READ ?
+			CORO_FD_READ : CORO_FD_WRITE;
+		if ((events[i].flags & (EV_EOF | EV_ERROR)) != 0)
+			revents |= CORO_FD_READ | CORO_FD_WRITE;
+#endif
+		if (c == NULL) {
+			char buf[64];
+			while (read(wake_fd, buf, sizeof(buf)) > 0);
+			continue;
+		}
+		/* Could be reported twice by kqueue, for each filter. */
+		if (c->wait_fd < 0)
+			continue;
+		c->wait_revents = revents & c->wait_events;
+		coro_engine_wakeup_local(engine, c);
+	}
+}
+
+/**
+ * Wait for a descriptor to become readable or writable, for not
+ * longer than until the deadline.
+ * @return Ready events, 0 on timeout or a wakeup, -1 on error.
+ */
+static int
+coro_engine_wait_fd(struct coro_engine *engine, int fd, int events,
+	uint64_t deadline)
+{
+	struct coro *this = engine->this;
+	if (this == NULL || this == &engine->sched) {
+		printf("Error: waiting for a descriptor with no active "
+			"coroutines\n");
+		exit(-1);
+	}
+	if (coro_engine_fd_add(engine, this, fd, events) != 0)
+		return -1;
+	if (deadline == UINT64_MAX) {
+		coro_engine_suspend(engine);
+	} else {
+		this->is_timed_out = false;
+		coro_engine_timer_add(engine, this, deadline);
+		coro_engine_suspend(engine);
+		if (this->timer_pos != CORO_TIMER_NONE)
+			coro_engine_timer_del(this->engine, this);
+	}
+	/* A pending wakeup returns without a switch. */
+	if (this->wait_fd >= 0)
+		coro_engine_fd_del(this->engine, this);
+	return this->wait_revents;
+}
+
+static void
+coro_engine_wakeup_local(struct coro_engine *engine, struct coro *coro)
+{
+	assert(coro->engine == engine);
+	if (coro->state == CORO_STATE_RUNNING) {
+		/* A task wakes itself up to run one more step. */
+		if (coro->is_task && engine->this == coro)
+			coro->wakeup_pending = true;
+		return;
+	}
+	if (coro->state == CORO_STATE_FINISHED)
+		return;
+	assert(coro->state == CORO_STATE_SUSPENDED);
+	assert(rlist_empty(&coro->link));
+	/*
+	 * The timer is removed by the owner right away. After the
+	 * wakeup the coroutine could be stolen by another thread.
+	 */
+	if (coro->timer_pos != CORO_TIMER_NONE)
+		coro_engine_timer_del(engine, coro);
+	if (coro->wait_fd >= 0)
+		coro_engine_fd_del(engine, coro);
+	++coro->stats.wakeup_count;
+	++engine->stats.wakeup_count;
+	coro_engine_stats_ready(engine, coro);
+	__atomic_store_n(&coro->state, CORO_STATE_RUNNING, __ATOMIC_RELAXED);
+	coro_engine_schedule(engine, coro);
+}
+
+/**
+ * Suspend the current coroutine until a wakeup or until the
+ * deadline.
+ * @retval true Woken up.
+ * @retval false Timed out.
+ */
+static bool
+coro_engine_suspend_until(struct coro_engine *engine, uint64_t deadline)
+{
+	struct coro *this = engine->this;
+	if (this == NULL || this == &engine->sched) {
+		printf("Error: timed suspension with no active "
+			"coroutines\n");
+		exit(-1);
+	}
+	this->is_timed_out = false;
+	coro_engine_timer_add(engine, this, deadline);
+	coro_engine_suspend(engine);
+	/*
+	 * A pending wakeup returns right away, the timer is still
+	 * there. Otherwise it was removed by the wakeup or has
+	 * expired.
+	 */
+	if (this->timer_pos != CORO_TIMER_NONE)
+		coro_engine_timer_del(this->engine, this);
+	return !this->is_timed_out;
+}
+
+/**
+ * Wake the engine's thread up if it sleeps. The inbox must be
+ * locked.
+ */
+static void
+coro_engine_notify_locked(struct coro_engine *engine)
+{
+	if (!engine->is_waiting)
+		return;
+	if (!engine->is_polling) {
+		pthread_cond_signal(&engine->inbox_cond);
+		return;
+	}
+	if (engine->is_poll_woken)
+		return;
+	engine->is_poll_woken = true;
+	char c = 0;
+	/* Full pipe is fine, the poller is going to wake up anyway. */
+	if (write(engine->poll_wake_fd[1], &c, 1) < 0 && errno != EAGAIN)
+		handle_error();
+}
 
-	struct coro *c = my_engine->this;
-	my_engine->this = NULL;
+/** Deliver a request into the inbox. The inbox must be locked. */
+static void
+coro_engine_post_locked(struct coro_engine *engine, struct coro *coro,
+	unsigned events)
+{
+	if (coro->remote_events == 0) {
+		rlist_add_tail_entry(&engine->inbox, coro, remote_link);
+		__atomic_store_n(&engine->inbox_size, engine->inbox_size + 1,
+			__ATOMIC_RELEASE);
+	}
+	coro->remote_events |= events;
+	coro_engine_notify_locked(engine);
+}
+
+/**
+ * Lock the inbox of the coroutine's owner engine. The owner can't
+ * change until the inbox is unlocked.
+ */
+static struct coro_engine *
+coro_engine_lock_owner(struct coro *coro)
+{
+	while (true) {
+		struct coro_engine *owner =
+			__atomic_load_n(&coro->engine, __ATOMIC_ACQUIRE);
+		pthread_mutex_lock(&owner->inbox_mutex);
+		/* Could migrate while the lock was taken. */
+		if (__atomic_load_n(&coro->engine, __ATOMIC_RELAXED) == owner)
+			return owner;
+		pthread_mutex_unlock(&owner->inbox_mutex);
+	}
+}
+
+/** Send a request to the coroutine's owner engine. */
+static void
+coro_engine_post(struct coro *coro, unsigned events)
+{
+	struct coro_engine *owner = coro_engine_lock_owner(coro);
+	coro_engine_post_locked(owner, coro, events);
+	pthread_mutex_unlock(&owner->inbox_mutex);
+}
+
+static void
+coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+{
 	/*
-	 * On invocation jump back to the constructor right after
-	 * remembering the context.
+	 * Only the owner can change the owner. So if it is this
+	 * engine, it can't change concurrently.
 	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(my_engine->start_point, 1);
+	if (__atomic_load_n(&coro->engine, __ATOMIC_RELAXED) == engine)
+		coro_engine_wakeup_local(engine, coro);
+	else
+		coro_engine_post(coro, CORO_REMOTE_WAKEUP);
+}
+
+/** Put a joined coroutine into the pool, or free it. */
+static void
+coro_engine_recycle(struct coro_engine *engine, struct coro *coro)
+{
+	assert(coro->engine == engine);
+	assert(coro->state == CORO_STATE_FINISHED);
+	assert(rlist_empty(&coro->link));
+	if (__atomic_load_n(&coro->remote_events, __ATOMIC_RELAXED) != 0) {
+		/*
+		 * Late wakeups could still be in the inbox, for
+		 * example the one which woke this coroutine up
+		 * when it was a joiner itself.
+		 */
+		pthread_mutex_lock(&engine->inbox_mutex);
+		assert((coro->remote_events & ~CORO_REMOTE_WAKEUP) == 0);
+		rlist_del_entry(coro, remote_link);
+		coro->remote_events = 0;
+		__atomic_store_n(&engine->inbox_size, engine->inbox_size - 1,
+			__ATOMIC_RELAXED);
+		pthread_mutex_unlock(&engine->inbox_mutex);
+	}
+	if (coro->is_lazy || coro->is_task) {
+		/* The stack is already given back, or never existed. */
+		assert(coro->stack == NULL);
+		coro_engine_release(engine, coro);
+		return;
+	}
+	int stack_class = coro->stack_class;
+	if (engine->coros_pool_count[stack_class] >=
+	    coro_engine_pool_max(engine, stack_class)) {
+		size_t committed = coro_stack_committed(coro);
+		pthread_mutex_lock(&engine->inbox_mutex);
+		engine->stack_committed += committed - coro->stack_committed;
+		coro->stack_committed = committed;
+		if (engine->stack_committed > engine->stack_committed_peak)
+			engine->stack_committed_peak = engine->stack_committed;
+		pthread_mutex_unlock(&engine->inbox_mutex);
+		coro_engine_release(engine, coro);
+		return;
+	}
 	/*
-	 * If the execution is here, then the coroutine should
-	 * finally start work.
+	 * The most recently used stacks go first - their pages are
+	 * likely still hot.
+	 */
+	rlist_add_entry(&engine->coros_pool[stack_class], coro, link);
+	++engine->coros_pool_count[stack_class];
+}
+
+/**
+ * Take ownership over a coroutine and schedule it. The inbox must
+ * be locked.
+ */
+static void
+coro_engine_adopt_locked(struct coro_engine *engine, struct coro *coro)
+{
+	assert(coro->state == CORO_STATE_RUNNING);
+	assert(rlist_empty(&coro->link));
+	coro_engine_own_locked(engine, coro);
+	coro_engine_schedule(engine, coro);
+}
+
+/** Execute the requests which came from other threads. */
+static void
+coro_engine_process_inbox(struct coro_engine *engine)
+{
+	if (__atomic_load_n(&engine->inbox_size, __ATOMIC_ACQUIRE) == 0)
+		return;
+	/* Recycling takes the lock itself, so it is done after. */
+	RLIST_HEAD(recycled);
+	pthread_mutex_lock(&engine->inbox_mutex);
+	while (!rlist_empty(&engine->inbox)) {
+		struct coro *c = rlist_shift_entry(&engine->inbox,
+			struct coro, remote_link);
+		unsigned events = c->remote_events;
+		c->remote_events = 0;
+		if ((events & CORO_REMOTE_ADOPT) != 0)
+			coro_engine_adopt_locked(engine, c);
+		if ((events & CORO_REMOTE_WAKEUP) != 0) {
+			if (c->state == CORO_STATE_RUNNING)
+				c->wakeup_pending = true;
+			else
+				coro_engine_wakeup_local(engine, c);
+		}
+		if ((events & CORO_REMOTE_RECYCLE) != 0)
+			rlist_add_tail_entry(&recycled, c, link);
+	}
+	__atomic_store_n(&engine->inbox_size, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&engine->inbox_mutex);
+	while (!rlist_empty(&recycled)) {
+		struct coro *c = rlist_shift_entry(&recycled, struct coro,
+			link);
+		coro_engine_recycle(engine, c);
+	}
+}
+
+/**
+ * Check if the scheduler has to wait for requests from other
+ * threads instead of returning when nothing is runnable. The
+ * inbox must be locked.
+ */
+static bool
+coro_engine_need_wait_locked(const struct coro_engine *engine)
+{
+	size_t active_count = __atomic_load_n(&engine->active_count,
+		__ATOMIC_RELAXED);
+	if (engine->worker_id >= 0)
+		return !engine->is_stopping || active_count > 0;
+	if (engine->timer_count > 0 || engine->fd_wait_count > 0)
+		return true;
+	return active_count > 0 &&
+		__atomic_load_n(&coro_worker_count, __ATOMIC_RELAXED) > 0;
+}
+
+/** Wake up the coroutines whose timers have expired. */
+static void
+coro_engine_fire_timers(struct coro_engine *engine)
+{
+	if (engine->timer_count == 0)
+		return;
+	uint64_t now = coro_clock_ns();
+	while (engine->timer_count > 0 &&
+	       engine->timers[0]->timer_deadline <= now) {
+		struct coro *c = engine->timers[0];
+		coro_engine_timer_del(engine, c);
+		c->is_timed_out = true;
+		coro_engine_wakeup_local(engine, c);
+	}
+}
+
+/**
+ * Take over the coroutines stolen from another worker. They are
+ * runnable and don't run anywhere.
+ */
+static void
+coro_engine_take_over(struct coro_engine *engine, struct coro_engine *victim,
+	struct coro **coros, unsigned *events, int count)
+{
+	pthread_mutex_lock(&victim->inbox_mutex);
+	for (int i = 0; i < count; ++i)
+		events[i] = coro_engine_disown_locked(victim, coros[i], engine);
+	pthread_mutex_unlock(&victim->inbox_mutex);
+
+	pthread_mutex_lock(&engine->inbox_mutex);
+	for (int i = 0; i < count; ++i) {
+		coro_engine_adopt_locked(engine, coros[i]);
+		if (events[i] != 0)
+			coro_engine_post_locked(engine, coros[i], events[i]);
+	}
+	pthread_mutex_unlock(&engine->inbox_mutex);
+}
+
+/**
+ * Steal runnable coroutines from another worker, up to a half of
+ * its ready deque.
+ * @retval true Something is stolen.
+ */
+static bool
+coro_engine_steal(struct coro_engine *engine)
+{
+	enum { CORO_STEAL_MAX = 32 };
+	int count = __atomic_load_n(&coro_worker_count, __ATOMIC_ACQUIRE);
+	if (engine->worker_id < 0 || count < 2)
+		return false;
+	struct coro *coros[CORO_STEAL_MAX];
+	unsigned events[CORO_STEAL_MAX];
+	int start = engine->steal_next++;
+	for (int i = 0; i < count; ++i) {
+		struct coro_engine *victim =
+			&coro_workers[(start + i) % count].engine;
+		if (victim == engine)
+			continue;
+		int stolen = 0;
+		for (int level = 0; level < CORO_PRIO_COUNT &&
+		     stolen < CORO_STEAL_MAX; ++level) {
+			struct coro_deque *ready = &victim->ready[level];
+			int64_t size = coro_deque_size(ready);
+			if (size <= 0)
+				continue;
+			size = (size + 1) / 2;
+			if (size > CORO_STEAL_MAX - stolen)
+				size = CORO_STEAL_MAX - stolen;
+			for (int64_t j = 0; j < size; ++j) {
+				struct coro *c = coro_deque_take(ready,
+					INT64_MAX);
+				if (c == NULL)
+					break;
+				coros[stolen++] = c;
+			}
+		}
+		if (stolen == 0)
+			continue;
+		coro_engine_take_over(engine, victim, coros, events, stolen);
+		return true;
+	}
+	return false;
+}
+
+/** Stop being idle, if nobody has done it already. */
+static void
+coro_engine_unidle(struct coro_engine *engine)
+{
+	int idle = 1;
+	if (__atomic_compare_exchange_n(&engine->is_idle, &idle, 0, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		__atomic_sub_fetch(&coro_idle_count, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Wake up an idle worker if this one has more runnable coroutines
+ * than it can start right now.
+ */
+static void
+coro_engine_share(struct coro_engine *engine)
+{
+	if (engine->worker_id < 0 || coro_engine_ready_size(engine) < 2)
+		return;
+	/*
+	 * Pairs with the idle worker which first announces itself
+	 * and then checks the deques. Either it sees the new
+	 * coroutines, or this thread sees it idle.
 	 */
-	my_engine->this = c;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&coro_idle_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	int count = __atomic_load_n(&coro_worker_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count; ++i) {
+		struct coro_engine *e = &coro_workers[i].engine;
+		int idle = 1;
+		if (e == engine || __atomic_load_n(&e->is_idle,
+						   __ATOMIC_RELAXED) == 0)
+			continue;
+		if (!__atomic_compare_exchange_n(&e->is_idle, &idle, 0, false,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_RELAXED))
+			continue;
+		__atomic_sub_fetch(&coro_idle_count, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_lock(&e->inbox_mutex);
+		e->wake_requested = true;
+		coro_engine_notify_locked(e);
+		pthread_mutex_unlock(&e->inbox_mutex);
+		return;
+	}
+}
+
+/**
+ * Sleep until other threads send something to this engine.
+ * @retval true The inbox is processed, can try running again.
+ * @retval false Nothing to wait for.
+ */
+static bool
+coro_engine_wait(struct coro_engine *engine)
+{
+	bool is_worker = engine->worker_id >= 0;
+	if (is_worker) {
+		__atomic_store_n(&engine->is_idle, 1, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&coro_idle_count, 1, __ATOMIC_SEQ_CST);
+		if (coro_engine_steal(engine)) {
+			coro_engine_unidle(engine);
+			return true;
+		}
+	}
+	bool rc = true;
+	pthread_mutex_lock(&engine->inbox_mutex);
+	while (engine->inbox_size == 0 && !engine->wake_requested) {
+		if (!coro_engine_need_wait_locked(engine)) {
+			rc = false;
+			break;
+		}
+		engine->is_waiting = true;
+		if (engine->fd_wait_count > 0) {
+			/*
+			 * Sleep in the poller. The other threads wake
+			 * it up via the pipe.
+			 */
+			int timeout_ms = -1;
+			if (engine->timer_count > 0) {
+				uint64_t deadline =
+					engine->timers[0]->timer_deadline;
+				uint64_t now = coro_clock_ns();
+				timeout_ms = deadline <= now ? 0 :
+					(deadline - now + 999999) / 1000000;
+			}
+			engine->is_polling = true;
+			pthread_mutex_unlock(&engine->inbox_mutex);
+			coro_engine_poll(engine, timeout_ms);
+			pthread_mutex_lock(&engine->inbox_mutex);
+			engine->is_polling = false;
+			engine->is_poll_woken = false;
+			engine->is_waiting = false;
+			break;
+		}
+		if (engine->timer_count == 0) {
+			pthread_cond_wait(&engine->inbox_cond,
+				&engine->inbox_mutex);
+			engine->is_waiting = false;
+			continue;
+		}
+		/*
+		 * With only timers pending the thread just sleeps
+		 * until the closest one. Nothing spins.
+		 */
+		uint64_t deadline = engine->timers[0]->timer_deadline;
+		struct timespec ts;
+		ts.tv_sec = deadline / 1000000000;
+		ts.tv_nsec = deadline % 1000000000;
+		int err = pthread_cond_timedwait(&engine->inbox_cond,
+			&engine->inbox_mutex, &ts);
+		engine->is_waiting = false;
+		if (err == ETIMEDOUT)
+			break;
+	}
+	engine->wake_requested = false;
+	pthread_mutex_unlock(&engine->inbox_mutex);
+	if (is_worker)
+		coro_engine_unidle(engine);
+	if (rc)
+		coro_engine_process_inbox(engine);
+	return rc;
+}
+
+static const char *
+coro_state_str(enum coro_state state)
+{
+	switch (state) {
+	case CORO_STATE_RUNNING:
+		return "running";
+	case CORO_STATE_SUSPENDED:
+		return "suspended";
+	case CORO_STATE_FINISHED:
+		return "finished";
+	}
+	return "unknown";
+}
+
+static int
+coro_cmp_run_max(const void *l, const void *r)
+{
+	const struct coro *a = *(const struct coro *const *)l;
+	const struct coro *b = *(const struct coro *const *)r;
+	if (a->stats.run_max_ns != b->stats.run_max_ns)
+		return a->stats.run_max_ns > b->stats.run_max_ns ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Print the engine's counters and the coroutines which run for the
+ * longest without a switch - the ones hogging the thread.
+ */
+static void
+coro_engine_dump_stats(struct coro_engine *engine, FILE *out)
+{
+	enum { CORO_DUMP_TOP = 10 };
+	const struct coro_stats *t = &engine->stats;
+	pthread_mutex_lock(&engine->inbox_mutex);
+	size_t count = engine->coro_count;
+	struct coro **coros = malloc((count + 1) * sizeof(coros[0]));
+	size_t i = 0;
+	struct coro *c;
+	rlist_foreach_entry(c, &engine->coros_all, engine_link)
+		coros[i++] = c;
+	pthread_mutex_unlock(&engine->inbox_mutex);
+	assert(i == count);
+	fprintf(out, "coro engine %d: coros %zu, switches %llu, yields %llu, "
+		"suspends %llu, wakeups %llu\n", engine->worker_id, count,
+		(unsigned long long)t->switch_count,
+		(unsigned long long)t->yield_count,
+		(unsigned long long)t->suspend_count,
+		(unsigned long long)t->wakeup_count);
+	if (engine->is_timing) {
+		fprintf(out, "    run %.3lf ms, max run %.3lf us, wait %.3lf ms, "
+			"max wait %.3lf us\n", t->run_ns / 1e6,
+			t->run_max_ns / 1e3, t->wait_ns / 1e6,
+			t->wait_max_ns / 1e3);
+	}
+	qsort(coros, count, sizeof(coros[0]), coro_cmp_run_max);
+	if (count > CORO_DUMP_TOP)
+		count = CORO_DUMP_TOP;
+	for (i = 0; i < count; ++i) {
+		c = coros[i];
+		const struct coro_stats *s = &c->stats;
+		fprintf(out, "    %p '%s' %s: switches %llu, yields %llu, "
+			"suspends %llu, wakeups %llu", (void *)c, c->name,
+			coro_state_str(c->state),
+			(unsigned long long)s->switch_count,
+			(unsigned long long)s->yield_count,
+			(unsigned long long)s->suspend_count,
+			(unsigned long long)s->wakeup_count);
+		if (engine->is_timing) {
+			fprintf(out, ", run %.3lf ms, max run %.3lf us, wait "
+				"%.3lf ms, max wait %.3lf us", s->run_ns / 1e6,
+				s->run_max_ns / 1e3, s->wait_ns / 1e6,
+				s->wait_max_ns / 1e3);
+		}
+		fprintf(out, "\n");
+	}
+	free(coros);
+}
+
+/** Dump the statistics if the period has passed. */
+static void
+coro_engine_dump_periodic(struct coro_engine *engine)
+{
+	if (engine->dump_period == 0)
+		return;
+	uint64_t now = coro_clock_ns();
+	if (now < engine->dump_next)
+		return;
+	engine->dump_next = now + engine->dump_period;
+	coro_engine_dump_stats(engine, stderr);
+}
+
+static void
+coro_engine_run(struct coro_engine *engine)
+{
+	while (true) {
+		coro_engine_dump_periodic(engine);
+		coro_engine_process_inbox(engine);
+		coro_engine_fire_timers(engine);
+		/* Check the descriptors without blocking. */
+		if (engine->fd_wait_count > 0)
+			coro_engine_poll(engine, 0);
+		/*
+		 * The high priority coroutines run right away, only
+		 * the others wait for a new round.
+		 */
+		for (int i = 1; i < CORO_PRIO_COUNT; ++i) {
+			assert(rlist_empty(&engine->coros_running_now[i]));
+			rlist_splice_tail(&engine->coros_running_now[i],
+				&engine->coros_running_next[i]);
+			engine->round_end[i] = engine->ready[i].bottom;
+		}
+		engine->round_end[0] = INT64_MAX;
+		if (!coro_engine_has_ready(engine)) {
+			if (coro_engine_steal(engine))
+				continue;
+			if (!coro_engine_wait(engine))
+				break;
+			continue;
+		}
+		coro_engine_share(engine);
+
+		assert(engine->this == NULL);
+		engine->this = &engine->sched;
+		/*
+		 * The control comes back when nothing is left in
+		 * this iteration of the loop.
+		 */
+		coro_engine_resume_next(engine);
+		assert(engine->this == &engine->sched);
+		engine->this = NULL;
+	}
+}
+
+static void
+coro_engine_destroy(struct coro_engine *engine)
+{
+	assert(engine->this == NULL);
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		assert(rlist_empty(&engine->coros_running_now[i]));
+		assert(rlist_empty(&engine->coros_running_next[i]));
+	}
+	coro_engine_process_inbox(engine);
+	assert(rlist_empty(&engine->inbox));
+	coro_engine_clear_pool(engine);
+	assert(engine->coro_count == 0);
+	coro_engine_destroy_slots(engine);
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i)
+		coro_deque_destroy(&engine->ready[i]);
+	assert(engine->timer_count == 0);
+	free(engine->timers);
+	coro_engine_poll_destroy(engine);
+	pthread_mutex_destroy(&engine->inbox_mutex);
+	pthread_cond_destroy(&engine->inbox_cond);
+	memset(engine, '#', sizeof(*engine));
+}
+
+/**
+ * Publish that the coroutine is finished and wake its joiner up.
+ * A joiner from another thread must not see the state before the
+ * wakeup is delivered, because then it could be gone already
+ * while the wakeup is still being sent. And it must see the state
+ * once woken up. So the state is stored under the lock of the
+ * joiner's inbox, right after the wakeup.
+ */
+static void
+coro_engine_finish(struct coro_engine *engine, struct coro *c,
+	struct coro *joiner)
+{
+	if (joiner == NULL ||
+	    __atomic_load_n(&joiner->engine, __ATOMIC_RELAXED) == engine) {
+		if (joiner != NULL)
+			coro_engine_wakeup_local(engine, joiner);
+		__atomic_store_n(&c->state, CORO_STATE_FINISHED,
+			__ATOMIC_RELEASE);
+		return;
+	}
+	struct coro_engine *owner = coro_engine_lock_owner(joiner);
+	coro_engine_post_locked(owner, joiner, CORO_REMOTE_WAKEUP);
+	__atomic_store_n(&c->state, CORO_STATE_FINISHED, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&owner->inbox_mutex);
+}
+
+/**
+ * Body of every coroutine. Runs the coroutine function, and when
+ * it is finished - yields to the scheduler until the coroutine
+ * is reused from the pool with a new function.
+ */
+static void __attribute__((noreturn))
+coro_body_loop(struct coro *c)
+{
+	struct coro_engine *engine = c->engine;
+	engine->this = c;
+	coro_engine_after_switch(engine);
 	while (true) {
 		c->ret = c->func(c->func_arg);
+		if (__atomic_load_n(&coro_stack_profiler.is_enabled,
+				    __ATOMIC_RELAXED))
+			coro_stack_profile_finish(c);
+		else
+			c->is_stack_clean = false;
+		/* Could migrate during the execution. */
+		engine = c->engine;
 		c->func = NULL;
 		assert(c->state == CORO_STATE_RUNNING);
-		c->state = CORO_STATE_FINISHED;
-		if (c->joiner != NULL)
-			coro_engine_wakeup(my_engine, c->joiner);
-		coro_engine_resume_next(my_engine);
+		assert(__atomic_load_n(&engine->active_count,
+			       __ATOMIC_RELAXED) > 0);
+		__atomic_sub_fetch(&engine->active_count, 1, __ATOMIC_RELAXED);
+		struct coro *joiner = __atomic_exchange_n(&c->joiner,
+			CORO_JOINER_FINISHED, __ATOMIC_ACQ_REL);
+		coro_engine_finish(engine, c, joiner);
+		if (c->is_lazy) {
+			/*
+			 * The stack is cached for other coroutines right
+			 * after the switch. This one never comes back.
+			 */
+			assert(engine->unbinding == NULL);
+			engine->unbinding = c;
+			coro_engine_resume_next(engine);
+			abort();
+		}
+		c->stack_live = __builtin_frame_address(0);
+		coro_engine_resume_next(engine);
+		engine = c->engine;
 		/*
 		 * Here it is restarted already, must have its
 		 * state restored.
@@ -231,20 +2728,47 @@ coro_body(int signum)
 	}
 }
 
-static struct coro *
-coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
+#if CORO_USE_SIGJMP
+
+static __thread struct coro_engine *new_coro_engine = NULL;
+
+/**
+ * The core part of the coroutines creation - this signal handler
+ * runs on a separate stack using sigaltstack. At invocation it
+ * remembers its current context and jumps back to the coroutine
+ * constructor. Later the coroutine continues from here.
+ */
+static void
+coro_body(int signum)
+{
+	(void)signum;
+	struct coro_engine *my_engine = new_coro_engine;
+	new_coro_engine = NULL;
+
+	struct coro *c = my_engine->this;
+	my_engine->this = NULL;
+	/*
+	 * On invocation jump back to the constructor right after
+	 * remembering the context.
+	 */
+	if (sigsetjmp(c->ctx.buf, 0) == 0)
+		siglongjmp(my_engine->start_point, 1);
+	/*
+	 * If the execution is here, then the coroutine should
+	 * finally start work.
+	 */
+	coro_body_loop(c);
+}
+
+/**
+ * Make the coroutine's stack usable - enter it once via a signal
+ * handler on sigaltstack and remember the context there. Costs
+ * about a dozen syscalls, but is portable.
+ */
+static void
+coro_engine_prime_stack(struct coro_engine *engine, struct coro *c,
+	size_t stack_size)
 {
-	struct coro *c = malloc(sizeof(*c));
-	c->state = CORO_STATE_RUNNING;
-	c->ret = NULL;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->joiner = NULL;
-	rlist_create(&c->link);
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -305,102 +2829,943 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+}
+
+#else /* !CORO_USE_SIGJMP */
+
+/**
+ * The first code executed on a new coroutine stack. Moves the
+ * argument from a callee-saved register, where
+ * coro_engine_prime_stack() has put it, into the argument
+ * register, and calls the coroutine body. It never returns.
+ */
+void
+coro_ctx_trampoline(void) __attribute__((visibility("hidden")));
+
+#if defined(__x86_64__)
+
+__asm__(
+	CORO_ASM_FUNC_BEGIN(coro_ctx_trampoline)
+	"	movq %r13, %rdi\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	CORO_ASM_FUNC_END(coro_ctx_trampoline)
+);
+
+#elif defined(__aarch64__)
+
+__asm__(
+	CORO_ASM_FUNC_BEGIN(coro_ctx_trampoline)
+	"	mov x0, x20\n"
+	"	blr x19\n"
+	"	brk #0\n"
+	CORO_ASM_FUNC_END(coro_ctx_trampoline)
+);
+
+#endif
+
+/**
+ * Make the coroutine's stack usable - build a frame on it which
+ * looks exactly like the one saved by coro_ctx_switch(). The
+ * first switch to the coroutine then "returns" into the
+ * trampoline. No syscalls are involved.
+ */
+static void
+coro_engine_prime_stack(struct coro_engine *engine, struct coro *c,
+	size_t stack_size)
+{
+	(void)engine;
+	uintptr_t top = ((uintptr_t)c->stack + stack_size) & ~(uintptr_t)15;
+#if defined(__x86_64__)
+	/*
+	 * The frame, from lower addresses: MXCSR and x87 control
+	 * words, r15, r14, r13, r12, rbx, rbp, return address.
+	 * After 'ret' the stack pointer has to be 16-aligned, same
+	 * as right before a 'call'.
+	 */
+	uint64_t *frame = (uint64_t *)(top - 16) - 8;
+	uint32_t mxcsr;
+	uint16_t fpucw;
+	__asm__ volatile("stmxcsr %0" : "=m"(mxcsr));
+	__asm__ volatile("fnstcw %0" : "=m"(fpucw));
+	frame[0] = mxcsr | ((uint64_t)fpucw << 32);
+	frame[1] = 0;
+	frame[2] = 0;
+	frame[3] = (uint64_t)(uintptr_t)c;
+	frame[4] = (uint64_t)(uintptr_t)coro_body_loop;
+	frame[5] = 0;
+	frame[6] = 0;
+	frame[7] = (uint64_t)(uintptr_t)coro_ctx_trampoline;
+#elif defined(__aarch64__)
+	/*
+	 * The frame, from lower addresses: x19-x28, x29, x30,
+	 * d8-d15. Stack pointer is always 16-aligned.
+	 */
+	uint64_t *frame = (uint64_t *)(top - 160);
+	memset(frame, 0, 160);
+	frame[0] = (uint64_t)(uintptr_t)coro_body_loop;
+	frame[1] = (uint64_t)(uintptr_t)c;
+	frame[11] = (uint64_t)(uintptr_t)coro_ctx_trampoline;
+#endif
+	c->ctx.sp = frame;
+}
+
+#endif /* !CORO_USE_SIGJMP */
+
+/**
+ * Create a new coroutine with a new stack. It is not scheduled
+ * anywhere yet. The stack is primed by the current engine, but
+ * the owner can be another one. A lazy coroutine gets no stack
+ * until it starts.
+ */
+static struct coro *
+coro_engine_create_coro(struct coro_engine *engine, struct coro_engine *owner,
+	coro_f func, void *func_arg, size_t stack_size, bool is_lazy)
+{
+	bool is_slab;
+	struct coro *c = coro_engine_alloc_coro(engine, sizeof(*c), &is_slab);
+	c->is_slab = is_slab;
+	c->state = CORO_STATE_RUNNING;
+	c->engine = owner;
+	c->ret = NULL;
+	c->is_lazy = is_lazy;
+	c->is_task = false;
+	if (is_lazy) {
+		c->stack = NULL;
+		c->stack_size = stack_size;
+		c->stack_class = coro_stack_class(stack_size);
+		c->stack_committed = 0;
+		c->stack_live = NULL;
+	} else {
+		coro_stack_create(c, stack_size);
+	}
+	c->func = func;
+	c->func_arg = func_arg;
+	c->joiner = NULL;
+	rlist_create(&c->link);
+	rlist_create(&c->remote_link);
+	c->timer_pos = CORO_TIMER_NONE;
+	c->is_timed_out = false;
+	c->wait_fd = -1;
+	memset(&c->stats, 0, sizeof(c->stats));
+	coro_engine_stats_ready(engine, c);
+	c->remote_events = 0;
+	c->wakeup_pending = false;
+	c->key_mask = 0;
+	if (!is_lazy)
+		coro_engine_prime_stack(engine, c, c->stack_size);
+	return c;
+}
+
+static void
+coro_set_name(struct coro *c, const char *name)
+{
+	if (name != NULL) {
+		strncpy(c->name, name, sizeof(c->name) - 1);
+		c->name[sizeof(c->name) - 1] = 0;
+	} else {
+		c->name[0] = 0;
+	}
+}
+
+static void
+coro_set_prio(struct coro *c, int prio)
+{
+	if (prio < CORO_PRIO_LOW || prio > CORO_PRIO_HIGH) {
+		printf("Error: invalid coroutine priority %d\n", prio);
+		exit(-1);
+	}
+	c->prio_level = CORO_PRIO_HIGH - prio;
+}
 
-	/* Now scheduler can work with that coroutine. */
-	++engine->coro_count;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
+/** Apply the attributes which don't depend on the stack. */
+static void
+coro_set_attr(struct coro *c, const struct coro_attr *attr)
+{
+	coro_set_name(c, attr != NULL ? attr->name : NULL);
+	coro_set_prio(c, attr != NULL ? attr->priority : CORO_PRIO_NORMAL);
 }
 
-static struct coro *
-coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg)
+/** Stack size for a new coroutine with the given attributes. */
+static size_t
+coro_engine_stack_size(const struct coro_engine *engine,
+	const struct coro_attr *attr)
 {
-	if (rlist_empty(&engine->coros_pool))
-		return coro_engine_spawn_new(engine, func, func_arg);
+	size_t stack_size = engine->stack_size;
+	if (attr != NULL && attr->stack_size != 0)
+		stack_size = attr->stack_size;
+	return coro_stack_size_normalize(stack_size);
+}
+
+static bool
+coro_attr_is_lazy(const struct coro_attr *attr)
+{
+	return attr != NULL && attr->is_lazy;
+}
 
-	struct coro *c = rlist_shift_entry(&engine->coros_pool,
-		struct coro, link);
+/**
+ * Take a joined coroutine from the pool for a new function. It
+ * keeps its stack, so even a lazy one starts right away.
+ * @retval NULL The pool is empty.
+ */
+static struct coro *
+coro_engine_reuse(struct coro_engine *engine, size_t stack_size, coro_f func,
+	void *func_arg)
+{
+	struct rlist *pool = &engine->coros_pool[coro_stack_class(stack_size)];
+	if (rlist_empty(pool))
+		return NULL;
+	struct coro *c = rlist_shift_entry(pool, struct coro, link);
+	--engine->coros_pool_count[c->stack_class];
+	assert(c->stack_size == stack_size && !c->is_lazy);
 	c->func = func;
 	c->func_arg = func_arg;
 	c->state = CORO_STATE_RUNNING;
+	c->wakeup_pending = false;
+	c->key_mask = 0;
+	memset(&c->stats, 0, sizeof(c->stats));
+	coro_engine_stats_ready(engine, c);
+	return c;
+}
+
+static struct coro *
+coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg,
+	const struct coro_attr *attr)
+{
+	size_t stack_size = coro_engine_stack_size(engine, attr);
+	struct coro *c = coro_engine_reuse(engine, stack_size, func, func_arg);
+	if (c == NULL) {
+		c = coro_engine_create_coro(engine, engine, func, func_arg,
+			stack_size, coro_attr_is_lazy(attr));
+		coro_set_attr(c, attr);
+		pthread_mutex_lock(&engine->inbox_mutex);
+		coro_engine_adopt_locked(engine, c);
+		pthread_mutex_unlock(&engine->inbox_mutex);
+		return c;
+	}
+	coro_set_attr(c, attr);
+	__atomic_add_fetch(&engine->active_count, 1, __ATOMIC_RELAXED);
 	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
+	coro_engine_schedule(engine, c);
+	return c;
+}
+
+/** Create a stackless task and schedule it. */
+static struct coro *
+coro_engine_spawn_task(struct coro_engine *engine, coro_task_f func,
+	const void *state, size_t state_size, const struct coro_attr *attr)
+{
+	bool is_slab;
+	struct coro *c = coro_engine_alloc_coro(engine,
+		CORO_TASK_STATE_OFFSET + state_size, &is_slab);
+	memset(c, 0, sizeof(*c));
+	c->is_slab = is_slab;
+	c->state = CORO_STATE_RUNNING;
+	c->engine = engine;
+	c->is_task = true;
+	c->task_func = func;
+	c->timer_pos = CORO_TIMER_NONE;
+	c->wait_fd = -1;
+	rlist_create(&c->link);
+	rlist_create(&c->remote_link);
+	if (state_size > 0)
+		memcpy((char *)c + CORO_TASK_STATE_OFFSET, state, state_size);
+	coro_engine_stats_ready(engine, c);
+	coro_set_attr(c, attr);
+	pthread_mutex_lock(&engine->inbox_mutex);
+	coro_engine_adopt_locked(engine, c);
+	pthread_mutex_unlock(&engine->inbox_mutex);
+	return c;
+}
+
+/**
+ * Spawn many coroutines with the same function and attributes.
+ * The attributes are resolved and the inbox is locked only once
+ * for all of them.
+ */
+static void
+coro_engine_spawn_many(struct coro_engine *engine, coro_f func,
+	void *const *args, size_t count, const struct coro_attr *attr,
+	struct coro **coros)
+{
+	size_t stack_size = coro_engine_stack_size(engine, attr);
+	bool is_lazy = coro_attr_is_lazy(attr);
+	RLIST_HEAD(created);
+	size_t reused_count = 0;
+	for (size_t i = 0; i < count; ++i) {
+		void *arg = args != NULL ? args[i] : NULL;
+		struct coro *c = coro_engine_reuse(engine, stack_size, func,
+			arg);
+		if (c != NULL) {
+			++reused_count;
+		} else {
+			c = coro_engine_create_coro(engine, engine, func, arg,
+				stack_size, is_lazy);
+			rlist_add_tail_entry(&created, c, link);
+		}
+		coro_set_attr(c, attr);
+		coros[i] = c;
+	}
+	__atomic_add_fetch(&engine->active_count, reused_count,
+		__ATOMIC_RELAXED);
+	pthread_mutex_lock(&engine->inbox_mutex);
+	struct coro *c;
+	rlist_foreach_entry(c, &created, link)
+		coro_engine_own_locked(engine, c);
+	pthread_mutex_unlock(&engine->inbox_mutex);
+	/* Creation order, no matter which were reused. */
+	for (size_t i = 0; i < count; ++i) {
+		rlist_del_entry(coros[i], link);
+		coro_engine_schedule(engine, coros[i]);
+	}
+}
+
+/**
+ * Spawn a coroutine owned by another engine. It is always a new
+ * one, because the pool belongs to the owner's thread.
+ */
+static struct coro *
+coro_engine_spawn_remote(struct coro_engine *engine, struct coro_engine *owner,
+	coro_f func, void *func_arg, const struct coro_attr *attr)
+{
+	size_t stack_size = coro_engine_stack_size(owner, attr);
+	struct coro *c = coro_engine_create_coro(engine, owner, func,
+		func_arg, stack_size, coro_attr_is_lazy(attr));
+	coro_set_attr(c, attr);
+	coro_engine_post(c, CORO_REMOTE_ADOPT);
 	return c;
 }
 
+/**
+ * Move the current coroutine to another engine. It continues
+ * there in the next iteration of that engine's scheduler.
+ */
+static void
+coro_engine_migrate(struct coro_engine *engine, struct coro_engine *to)
+{
+	struct coro *this = engine->this;
+	assert(this != NULL && this != &engine->sched);
+	coro_check_stackful(this);
+	if (to == engine)
+		return;
+	assert(rlist_empty(&this->link));
+	assert(this->state == CORO_STATE_RUNNING);
+	assert(engine->leaving == NULL);
+	engine->leaving = this;
+	engine->leaving_to = to;
+	/*
+	 * When nothing else is runnable, the switch goes to the
+	 * scheduler. So there is always where to switch to.
+	 */
+	coro_engine_resume_next(engine);
+	assert(this->engine == to);
+}
+
+/** Index of a finished coroutine in the array, or -1. */
+static int
+coro_find_finished(struct coro *const *coros, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		if (__atomic_load_n(&coros[i]->state, __ATOMIC_ACQUIRE) ==
+		    CORO_STATE_FINISHED)
+			return i;
+	}
+	return -1;
+}
+
+/** Some of the coroutines are not finished and belong to the engine. */
+static bool
+coro_engine_has_unfinished(struct coro_engine *engine,
+	struct coro *const *coros, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		if (__atomic_load_n(&coros[i]->engine, __ATOMIC_RELAXED) ==
+		    engine && __atomic_load_n(&coros[i]->state,
+		    __ATOMIC_ACQUIRE) != CORO_STATE_FINISHED)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Block the thread outside of any coroutine until any of the given
+ * ones finishes in another thread, or until the deadline.
+ */
+static void
+coro_engine_wait_finish(struct coro_engine *engine,
+	struct coro *const *coros, int count, uint64_t deadline)
+{
+	pthread_mutex_lock(&engine->inbox_mutex);
+	while (engine->inbox_size == 0 &&
+	       coro_find_finished(coros, count) < 0) {
+		engine->is_waiting = true;
+		int err = 0;
+		if (deadline == UINT64_MAX) {
+			pthread_cond_wait(&engine->inbox_cond,
+				&engine->inbox_mutex);
+		} else {
+			struct timespec ts;
+			ts.tv_sec = deadline / 1000000000;
+			ts.tv_nsec = deadline % 1000000000;
+			err = pthread_cond_timedwait(&engine->inbox_cond,
+				&engine->inbox_mutex, &ts);
+		}
+		engine->is_waiting = false;
+		if (err == ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&engine->inbox_mutex);
+	coro_engine_process_inbox(engine);
+}
+
+/** Take the result of a finished coroutine and free it. */
 static void *
-coro_engine_join(struct coro_engine *engine, struct coro *coro)
+coro_engine_join_finished(struct coro_engine *engine, struct coro *coro)
 {
-	assert(coro->joiner == NULL);
-	coro->joiner = engine->this;
-	while (coro->state == CORO_STATE_RUNNING ||
-		coro->state == CORO_STATE_SUSPENDED)
-		coro_engine_suspend(engine);
-	assert(coro->state == CORO_STATE_FINISHED);
-	assert(coro->joiner == engine->this);
 	coro->joiner = NULL;
 	void *ret = coro->ret;
 	coro->ret = NULL;
-	assert(rlist_empty(&coro->link));
-	rlist_add_entry(&engine->coros_pool, coro, link);
+	/* A finished coroutine can't migrate anymore. */
+	if (__atomic_load_n(&coro->engine, __ATOMIC_ACQUIRE) != engine)
+		coro_engine_post(coro, CORO_REMOTE_RECYCLE);
+	else
+		coro_engine_recycle(engine, coro);
+	return ret;
+}
+
+/**
+ * Join whichever of the coroutines finishes first. The caller is
+ * installed as the joiner of all of them, so it is woken up only
+ * by a completion or by the deadline. Before return it is removed
+ * from the rest.
+ * @return Index of the joined coroutine, or -1 on timeout.
+ */
+static int
+coro_engine_join_any(struct coro_engine *engine, struct coro *const *coros,
+	int count, uint64_t deadline, void **result)
+{
+	struct coro *joiner = engine->this;
+	/*
+	 * Outside of any coroutine a remote one still can be
+	 * joined - the thread then sleeps on its engine's inbox
+	 * until the scheduler pseudo-coroutine gets a wakeup.
+	 */
+	if (joiner == NULL)
+		joiner = &engine->sched;
+	int found = -1;
+	int installed = 0;
+	for (; installed < count; ++installed) {
+		struct coro *old = NULL;
+		if (!__atomic_compare_exchange_n(&coros[installed]->joiner,
+						 &old, joiner, false,
+						 __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE)) {
+			/*
+			 * The coroutine has finished and isn't going
+			 * to wake anyone up. Only its state might be
+			 * not stored yet.
+			 */
+			assert(old == CORO_JOINER_FINISHED);
+			found = installed;
+			break;
+		}
+	}
+	while (found < 0) {
+		found = coro_find_finished(coros, count);
+		if (found >= 0)
+			break;
+		if (deadline != UINT64_MAX && coro_clock_ns() >= deadline)
+			break;
+		if (joiner != &engine->sched) {
+			if (deadline == UINT64_MAX)
+				coro_engine_suspend(engine);
+			else
+				coro_engine_suspend_until(engine, deadline);
+		} else if (coro_engine_has_unfinished(engine, coros, count)) {
+			/* Nothing can run them - reported as a deadlock. */
+			coro_engine_suspend(engine);
+		} else {
+			coro_engine_wait_finish(engine, coros, count,
+				deadline);
+		}
+	}
+	for (int i = 0; i < installed; ++i) {
+		if (i == found)
+			continue;
+		/*
+		 * If it has just finished, it is going to be seen as
+		 * finished by the next join.
+		 */
+		struct coro *old = joiner;
+		__atomic_compare_exchange_n(&coros[i]->joiner, &old, NULL,
+			false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+	if (found < 0)
+		return -1;
+	struct coro *coro = coros[found];
+	while (__atomic_load_n(&coro->state, __ATOMIC_ACQUIRE) !=
+	       CORO_STATE_FINISHED);
+	void *ret = coro_engine_join_finished(engine, coro);
+	if (result != NULL)
+		*result = ret;
+	return found;
+}
+
+static void *
+coro_engine_join(struct coro_engine *engine, struct coro *coro)
+{
+	void *ret;
+	coro_engine_join_any(engine, &coro, 1, UINT64_MAX, &ret);
 	return ret;
 }
 
 //////////////////////////////////////////////////////////////////
 
-static struct coro_engine glob_engine;
+/** Engine of the current thread. */
+static __thread struct coro_engine *current_engine = NULL;
+/** Storage for the engine of a thread which is not a worker. */
+static __thread struct coro_engine thread_engine;
+
+/** Round-robin counter to pick a worker for CORO_WORKER_ANY. */
+static unsigned coro_worker_next = 0;
+
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_worker *worker = arg;
+	current_engine = &worker->engine;
+	coro_engine_run(current_engine);
+	/*
+	 * The engine is destroyed only when all the workers are
+	 * stopped. Until then the others can look into it to steal
+	 * something.
+	 */
+	current_engine = NULL;
+	return NULL;
+}
+
+/** Engine of the given worker, or any worker's. */
+static struct coro_engine *
+coro_worker_engine(int worker_id)
+{
+	int count = __atomic_load_n(&coro_worker_count, __ATOMIC_ACQUIRE);
+	if (count == 0) {
+		printf("Error: no worker threads\n");
+		exit(-1);
+	}
+	if (worker_id == CORO_WORKER_ANY) {
+		worker_id = __atomic_fetch_add(&coro_worker_next, 1,
+			__ATOMIC_RELAXED) % count;
+	}
+	assert(worker_id >= 0 && worker_id < count);
+	return &coro_workers[worker_id].engine;
+}
 
 void
 coro_sched_init(void)
 {
-	coro_engine_create(&glob_engine);
+	current_engine = &thread_engine;
+	coro_engine_create(current_engine);
 }
 
 void
 coro_sched_run(void)
 {
-	coro_engine_run(&glob_engine);
+	coro_engine_run(current_engine);
 }
 
 void
 coro_sched_destroy(void)
 {
-	coro_engine_destroy(&glob_engine);
+	coro_engine_destroy(current_engine);
+	current_engine = NULL;
+}
+
+void
+coro_workers_start(int count)
+{
+	assert(coro_workers == NULL && count > 0);
+	coro_workers = calloc(count, sizeof(coro_workers[0]));
+	for (int i = 0; i < count; ++i) {
+		coro_engine_create(&coro_workers[i].engine);
+		coro_workers[i].engine.worker_id = i;
+	}
+	__atomic_store_n(&coro_worker_count, count, __ATOMIC_RELEASE);
+	for (int i = 0; i < count; ++i) {
+		struct coro_worker *w = &coro_workers[i];
+		if (pthread_create(&w->thread, NULL, coro_worker_f, w) != 0)
+			handle_error();
+	}
+}
+
+void
+coro_workers_stop(void)
+{
+	int count = coro_worker_count;
+	for (int i = 0; i < count; ++i) {
+		struct coro_engine *e = &coro_workers[i].engine;
+		pthread_mutex_lock(&e->inbox_mutex);
+		e->is_stopping = true;
+		coro_engine_notify_locked(e);
+		pthread_mutex_unlock(&e->inbox_mutex);
+	}
+	for (int i = 0; i < count; ++i) {
+		if (pthread_join(coro_workers[i].thread, NULL) != 0)
+			handle_error();
+	}
+	for (int i = 0; i < count; ++i)
+		coro_engine_destroy(&coro_workers[i].engine);
+	__atomic_store_n(&coro_worker_count, 0, __ATOMIC_RELEASE);
+	free(coro_workers);
+	coro_workers = NULL;
+}
+
+int
+coro_workers_count(void)
+{
+	return __atomic_load_n(&coro_worker_count, __ATOMIC_ACQUIRE);
+}
+
+int
+coro_worker_id(void)
+{
+	return current_engine != NULL ? current_engine->worker_id : -1;
+}
+
+struct coro *
+coro_new_on(int worker_id, coro_f func, void *func_arg,
+	const struct coro_attr *attr)
+{
+	struct coro_engine *owner = coro_worker_engine(worker_id);
+	if (owner == current_engine)
+		return coro_engine_spawn(owner, func, func_arg, attr);
+	return coro_engine_spawn_remote(current_engine, owner, func, func_arg,
+		attr);
+}
+
+void
+coro_migrate(int worker_id)
+{
+	coro_engine_migrate(current_engine, coro_worker_engine(worker_id));
+}
+
+void
+coro_sched_set_stack_size(size_t size)
+{
+	if (size == 0)
+		size = CORO_STACK_SIZE_DEFAULT;
+	current_engine->stack_size = size;
+}
+
+void
+coro_sched_set_pool_limit(size_t size)
+{
+	current_engine->pool_limit = size;
+}
+
+void
+coro_sched_trim(void)
+{
+	coro_engine_trim(current_engine);
+}
+
+void
+coro_sched_stats(struct coro_sched_stats *stats)
+{
+	struct coro_engine *engine = current_engine;
+	coro_engine_update_stack_stats(engine);
+	memset(stats, 0, sizeof(*stats));
+	size_t page_size = coro_page_size();
+	struct coro *c;
+	pthread_mutex_lock(&engine->inbox_mutex);
+	rlist_foreach_entry(c, &engine->coros_all, engine_link) {
+		if (c->stack == NULL)
+			continue;
+		++stats->stack_count;
+		stats->stack_reserved_bytes += c->stack_size + page_size;
+	}
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		stats->stack_count += engine->stacks_free_count[i];
+		stats->stack_reserved_bytes += engine->stacks_free_count[i] *
+			(coro_stack_class_size(i) + page_size);
+	}
+	stats->stack_committed_bytes = engine->stack_committed;
+	stats->stack_committed_peak_bytes = engine->stack_committed_peak;
+	pthread_mutex_unlock(&engine->inbox_mutex);
+}
+
+void
+coro_sched_stats_ex(struct coro_sched_stats *stats,
+	struct coro_stats *total)
+{
+	coro_sched_stats(stats);
+	*total = current_engine->stats;
+}
+
+void
+coro_sched_set_timing(bool is_enabled)
+{
+	struct coro_engine *engine = current_engine;
+	if (is_enabled && !engine->is_timing)
+		engine->timing_start = coro_clock_ns();
+	engine->is_timing = is_enabled;
+}
+
+void
+coro_sched_dump_stats(FILE *out)
+{
+	coro_engine_dump_stats(current_engine, out);
+}
+
+void
+coro_sched_set_dump_period(double sec)
+{
+	struct coro_engine *engine = current_engine;
+	engine->dump_period = sec > 0 ? (uint64_t)(sec * 1e9) : 0;
+	engine->dump_next = coro_clock_ns() + engine->dump_period;
+}
+
+void
+coro_sched_set_stack_profiling(bool is_enabled)
+{
+	__atomic_store_n(&coro_stack_profiler.is_enabled, is_enabled,
+		__ATOMIC_RELAXED);
+}
+
+static int
+coro_stack_profile_cmp(const void *a, const void *b)
+{
+	const struct coro_stack_profile *l = a;
+	const struct coro_stack_profile *r = b;
+	if (l->max_depth != r->max_depth)
+		return l->max_depth > r->max_depth ? -1 : 1;
+	return 0;
+}
+
+int
+coro_sched_stack_profile(struct coro_stack_profile *profiles, int count)
+{
+	struct coro_stack_profile all[CORO_STACK_PROFILE_SIZE];
+	int total = 0;
+	pthread_mutex_lock(&coro_stack_profiler.mutex);
+	for (int i = 0; i < CORO_STACK_PROFILE_SIZE; ++i) {
+		if (coro_stack_profiler.entries[i].func != NULL)
+			all[total++] = coro_stack_profiler.entries[i];
+	}
+	pthread_mutex_unlock(&coro_stack_profiler.mutex);
+	qsort(all, total, sizeof(all[0]), coro_stack_profile_cmp);
+	for (int i = 0; i < count && i < total; ++i)
+		profiles[i] = all[i];
+	return total;
+}
+
+void
+coro_sched_dump_stack_profile(FILE *out)
+{
+	struct coro_stack_profile all[CORO_STACK_PROFILE_SIZE];
+	int count = coro_sched_stack_profile(all, CORO_STACK_PROFILE_SIZE);
+	fprintf(out, "coro stack profile: functions %d, not measured %llu, "
+		"lost %llu\n", count, (unsigned long long)
+		__atomic_load_n(&coro_stack_profiler.skip_count,
+			__ATOMIC_RELAXED), (unsigned long long)
+		__atomic_load_n(&coro_stack_profiler.lost_count,
+			__ATOMIC_RELAXED));
+	size_t max_size = (size_t)1 << CORO_STACK_CLASS_MAX_SHIFT;
+	for (int i = 0; i < count; ++i) {
+		const struct coro_stack_profile *p = &all[i];
+		/* A quarter more is the margin for the unlucky paths. */
+		size_t enough = p->max_depth + p->max_depth / 4;
+		enough = coro_stack_size_normalize(
+			enough < max_size ? enough : max_size);
+		fprintf(out, "    %p '%s': coros %llu, max %.1lf KB, avg "
+			"%.1lf KB, stack %zu KB, enough %zu KB\n",
+			(void *)(uintptr_t)p->func, p->name,
+			(unsigned long long)p->count, p->max_depth / 1024.0,
+			p->total_depth / 1024.0 / p->count,
+			p->stack_size / 1024, enough / 1024);
+	}
+}
+
+void
+coro_set_priority(struct coro *coro, int prio)
+{
+	coro_set_prio(coro, prio);
+}
+
+int
+coro_priority(const struct coro *coro)
+{
+	return CORO_PRIO_HIGH - coro->prio_level;
+}
+
+void
+coro_stats(const struct coro *coro, struct coro_stats *stats)
+{
+	*stats = coro->stats;
 }
 
 struct coro *
 coro_this(void)
 {
-	return glob_engine.this;
+	return current_engine->this;
 }
 
 struct coro *
 coro_new(coro_f func, void *func_arg)
 {
-	return coro_engine_spawn(&glob_engine, func, func_arg);
+	return coro_engine_spawn(current_engine, func, func_arg, NULL);
+}
+
+void
+coro_attr_create(struct coro_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr)
+{
+	return coro_engine_spawn(current_engine, func, func_arg, attr);
+}
+
+struct coro *
+coro_task_new(coro_task_f func, const void *state, size_t state_size,
+	const struct coro_attr *attr)
+{
+	return coro_engine_spawn_task(current_engine, func, state, state_size,
+		attr);
+}
+
+void *
+coro_task_state(struct coro *task)
+{
+	assert(task->is_task);
+	return (char *)task + CORO_TASK_STATE_OFFSET;
+}
+
+void
+coro_spawn_many(coro_f func, void *const *args, size_t count,
+	const struct coro_attr *attr, struct coro **coros)
+{
+	coro_engine_spawn_many(current_engine, func, args, count, attr,
+		coros);
+}
+
+/** Bits of the taken coroutine-local keys. */
+static uint32_t coro_key_taken = 0;
+
+int
+coro_key_create(void)
+{
+	uint32_t taken = __atomic_load_n(&coro_key_taken, __ATOMIC_RELAXED);
+	while (true) {
+		if (taken == (1u << CORO_KEY_MAX) - 1)
+			return -1;
+		int key = __builtin_ctz(~taken);
+		if (__atomic_compare_exchange_n(&coro_key_taken, &taken,
+						taken | (1u << key), true,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+			return key;
+	}
+}
+
+void *
+coro_key_get(int key)
+{
+	assert(key >= 0 && key < CORO_KEY_MAX);
+	const struct coro *c = current_engine->this;
+	if ((c->key_mask & (1u << key)) == 0)
+		return NULL;
+	return c->keys[key];
+}
+
+void
+coro_key_set(int key, void *value)
+{
+	assert(key >= 0 && key < CORO_KEY_MAX);
+	struct coro *c = current_engine->this;
+	c->keys[key] = value;
+	c->key_mask |= 1u << key;
+}
+
+const char *
+coro_name(const struct coro *coro)
+{
+	return coro->name;
+}
+
+size_t
+coro_stack_size(const struct coro *coro)
+{
+	return coro->stack_size;
 }
 
 void *
 coro_join(struct coro *coro)
 {
-	return coro_engine_join(&glob_engine, coro);
+	return coro_engine_join(current_engine, coro);
+}
+
+bool
+coro_join_timeout(struct coro *coro, double timeout, void **result)
+{
+	uint64_t deadline = timeout < 0 ? UINT64_MAX :
+		coro_deadline_after(timeout);
+	return coro_engine_join_any(current_engine, &coro, 1, deadline,
+		result) == 0;
+}
+
+int
+coro_join_any(struct coro *const *coros, int count, double timeout,
+	void **result)
+{
+	uint64_t deadline = timeout < 0 ? UINT64_MAX :
+		coro_deadline_after(timeout);
+	return coro_engine_join_any(current_engine, coros, count, deadline,
+		result);
 }
 
 void
 coro_suspend(void)
 {
-	coro_engine_suspend(&glob_engine);
+	coro_engine_suspend(current_engine);
+}
+
+bool
+coro_suspend_timeout(double timeout)
+{
+	return coro_engine_suspend_until(current_engine,
+		coro_deadline_after(timeout));
+}
+
+int
+coro_wait_fd(int fd, int events, double timeout)
+{
+	uint64_t deadline = timeout < 0 ? UINT64_MAX :
+		coro_deadline_after(timeout);
+	return coro_engine_wait_fd(current_engine, fd, events, deadline);
+}
+
+void
+coro_sleep(double sec)
+{
+	uint64_t deadline = coro_deadline_after(sec);
+	/* Wakeups don't interrupt the sleep. */
+	while (coro_clock_ns() < deadline) {
+		/* It could migrate, so the engine is taken each time. */
+		coro_engine_suspend_until(current_engine, deadline);
+	}
 }
 
 void
 coro_yield(void)
 {
-	coro_engine_yield(&glob_engine);
+	coro_engine_yield(current_engine);
 }
 
 void
 coro_wakeup(struct coro *coro)
 {
-	coro_engine_wakeup(&glob_engine, coro);
+	coro_engine_wakeup(current_engine, coro);
 }
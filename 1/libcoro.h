@@ -1,10 +1,22 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 struct coro;
 typedef void *(*coro_f)(void *);
 
+/**
+ * Step of a stackless task, see coro_task_new().
+ * @param task The task itself.
+ * @param state Inline state of the task.
+ * @retval true The task is finished.
+ * @retval false Run the next step after a wakeup.
+ */
+typedef bool (*coro_task_f)(struct coro *task, void *state);
+
 /** Initialize the coroutines engine. */
 void
 coro_sched_init(void);
@@ -23,6 +35,199 @@ coro_sched_run(void);
 void
 coro_sched_destroy(void);
 
+/**
+ * Start the given number of worker threads, each with its own
+ * engine and scheduler loop. The coroutines can be then created
+ * on them with coro_new_on(), and can move between them with
+ * coro_migrate(). An idle worker also steals runnable coroutines
+ * from the busy ones, so a coroutine created on one worker can
+ * run and finish on another. The calling thread keeps its own
+ * engine, if it has one, and it doesn't take part in stealing.
+ */
+void
+coro_workers_start(int count);
+
+/**
+ * Stop the worker threads started by coro_workers_start(). All
+ * the coroutines created on the workers must be joined by now.
+ */
+void
+coro_workers_stop(void);
+
+/** Number of the running worker threads. */
+int
+coro_workers_count(void);
+
+/**
+ * Index of the worker thread running the current coroutine, or -1
+ * if it is not a worker.
+ */
+int
+coro_worker_id(void);
+
+/** Stack size of a coroutine unless configured otherwise. */
+#define CORO_STACK_SIZE_DEFAULT (1024 * 1024)
+
+/** Maximal length of a coroutine name, including the terminating 0. */
+#define CORO_NAME_MAX 32
+
+/**
+ * Set the stack size for the coroutines created afterwards
+ * without an explicit size. Zero means the default size.
+ */
+void
+coro_sched_set_stack_size(size_t size);
+
+/** Default high-water mark of the pool of joined coroutines. */
+#define CORO_POOL_LIMIT_DEFAULT (64 * 1024 * 1024)
+
+/**
+ * Set the high-water mark of the pool of joined coroutines kept
+ * for reuse, in bytes of stack per stack size class. Coroutines
+ * joined above the mark are freed right away.
+ */
+void
+coro_sched_set_pool_limit(size_t size);
+
+/**
+ * Release the memory cached by the engine. The pooled coroutines
+ * above the high-water mark are freed. The physical pages of the
+ * remaining pooled stacks are given back to the OS, while their
+ * virtual memory is kept for cheap reuse. Can be called between
+ * bursts of coroutines.
+ */
+void
+coro_sched_trim(void);
+
+struct coro_sched_stats {
+	/** Number of coroutine stacks, including the pooled ones. */
+	size_t stack_count;
+	/** Virtual memory reserved for the stacks, with guard pages. */
+	size_t stack_reserved_bytes;
+	/** Stack memory actually backed by physical pages now. */
+	size_t stack_committed_bytes;
+	/** Maximal committed stack memory seen so far. */
+	size_t stack_committed_peak_bytes;
+};
+
+/** Get the statistics of the coroutines engine. */
+void
+coro_sched_stats(struct coro_sched_stats *stats);
+
+/** Scheduling counters of a coroutine, or totals of an engine. */
+struct coro_stats {
+	/** How many times the coroutine was switched to. */
+	uint64_t switch_count;
+	/** Number of coro_yield() calls. */
+	uint64_t yield_count;
+	/** Number of suspensions which really paused it. */
+	uint64_t suspend_count;
+	/** Number of wakeups which made it runnable. */
+	uint64_t wakeup_count;
+	/**
+	 * Time spent running, in nanoseconds. This and the other
+	 * times are measured only with the timing turned on.
+	 */
+	uint64_t run_ns;
+	/** The longest run without a switch - a hog indicator. */
+	uint64_t run_max_ns;
+	/**
+	 * Time spent runnable but waiting to be run - the
+	 * scheduling latency.
+	 */
+	uint64_t wait_ns;
+	/** The longest scheduling latency. */
+	uint64_t wait_max_ns;
+};
+
+/**
+ * Same as coro_sched_stats(), plus the totals of the scheduling
+ * counters of the coroutines of the engine.
+ */
+void
+coro_sched_stats_ex(struct coro_sched_stats *stats, struct coro_stats *total);
+
+/**
+ * Change the priority of the coroutine. It takes effect the next
+ * time the coroutine becomes runnable. Must be called in the
+ * thread owning the coroutine.
+ */
+void
+coro_set_priority(struct coro *coro, int prio);
+
+/** Get the priority of the coroutine. */
+int
+coro_priority(const struct coro *coro);
+
+/** Get the scheduling counters of the coroutine. */
+void
+coro_stats(const struct coro *coro, struct coro_stats *stats);
+
+/**
+ * Turn the measurement of the running and waiting times on or
+ * off. It is off by default, because it reads the clock on each
+ * switch and wakeup.
+ */
+void
+coro_sched_set_timing(bool is_enabled);
+
+/**
+ * Print the engine's counters and the coroutines running for the
+ * longest without a switch.
+ */
+void
+coro_sched_dump_stats(FILE *out);
+
+/**
+ * Make the scheduler dump the statistics into stderr every given
+ * number of seconds. 0 turns it off.
+ */
+void
+coro_sched_set_dump_period(double sec);
+
+/** Stack use of the finished coroutines of one function. */
+struct coro_stack_profile {
+	/** Function of the coroutines. */
+	coro_f func;
+	/** Name of the last measured one. Can be empty. */
+	char name[CORO_NAME_MAX];
+	/** Number of the measured coroutines. */
+	uint64_t count;
+	/** The deepest use of the stack, in bytes. */
+	size_t max_depth;
+	/** Sum of the depths, for the average. */
+	uint64_t total_depth;
+	/** The biggest stack size the coroutines had. */
+	size_t stack_size;
+};
+
+/**
+ * Turn the stack profiling on or off, in all the threads. It is
+ * off by default. When on, each finished coroutine finds how deep
+ * it has used its stack, and the depths are aggregated by the
+ * coroutine function. That is the size to give to coro_new_ex(),
+ * with a margin. The untouched stack pages are zero, and the used
+ * part is zeroed back at the finish, so the deepest non-zero word
+ * is the high-water mark. It is precise to about a KB, and costs a
+ * pass over the used part of the stack per coroutine. A stack used
+ * before the profiling was on isn't measured once.
+ */
+void
+coro_sched_set_stack_profiling(bool is_enabled);
+
+/**
+ * Get up to @a count entries of the stack profile, the deepest
+ * first.
+ * @return Number of the profiled functions, can be bigger than
+ *     @a count.
+ */
+int
+coro_sched_stack_profile(struct coro_stack_profile *profiles, int count);
+
+/** Print the stack profile, the deepest functions first. */
+void
+coro_sched_dump_stack_profile(FILE *out);
+
 /** Get the currently working coroutine. */
 struct coro *
 coro_this(void);
@@ -38,6 +243,142 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Priority levels of the coroutines. A runnable coroutine of a
+ * higher level runs before the lower ones. The high priority
+ * coroutines don't wait for the current round of the scheduler
+ * to end, but still let the others run now and then, so they are
+ * not starved.
+ */
+enum {
+	CORO_PRIO_LOW = -1,
+	CORO_PRIO_NORMAL = 0,
+	CORO_PRIO_HIGH = 1,
+};
+
+/** Attributes of a new coroutine. */
+struct coro_attr {
+	/**
+	 * Stack size. It is rounded up to a power of 2, at least a
+	 * page. Zero means the engine's default size.
+	 */
+	size_t stack_size;
+	/**
+	 * Name of the coroutine, for debug. It is copied and may
+	 * be truncated to CORO_NAME_MAX - 1 characters. Can be
+	 * NULL.
+	 */
+	const char *name;
+	/** One of CORO_PRIO_*, by default CORO_PRIO_NORMAL. */
+	int priority;
+	/**
+	 * Don't allocate the stack until the coroutine starts, and
+	 * give it back as soon as it finishes, not when joined.
+	 * Then many short coroutines share a few warm stacks.
+	 */
+	bool is_lazy;
+};
+
+/** Fill the attributes with the default values. */
+void
+coro_attr_create(struct coro_attr *attr);
+
+/**
+ * Same as coro_new(), but with the given attributes. NULL means
+ * all the defaults. The joined coroutines are reused only for new
+ * ones of the same stack size class.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr);
+
+/**
+ * Create @a count coroutines with the same function and
+ * attributes at once, cheaper than one by one. The i-th one gets
+ * args[i] as the argument, or NULL if @a args is NULL. The
+ * coroutines are stored into @a coros, they start in that order.
+ */
+void
+coro_spawn_many(coro_f func, void *const *args, size_t count,
+	const struct coro_attr *attr, struct coro **coros);
+
+/**
+ * Create a stackless task - a step function with a small inline
+ * state, copied from @a state. It needs no stack and shares the
+ * run queue with the coroutines. The step is called when the task
+ * starts and then after each wakeup. It runs on the stack of the
+ * switching coroutine or the scheduler, so it must be short and
+ * can't suspend, yield, join, sleep, or migrate. Calling
+ * coro_wakeup() on itself makes the task run one more step. It is
+ * joined like a coroutine, coro_join() returns NULL. The stack
+ * size and laziness in the attributes are ignored.
+ */
+struct coro *
+coro_task_new(coro_task_f func, const void *state, size_t state_size,
+	const struct coro_attr *attr);
+
+/** Inline state of the task. */
+void *
+coro_task_state(struct coro *task);
+
+/** Pick the worker in coro_new_on() and coro_migrate() by itself. */
+#define CORO_WORKER_ANY -1
+
+/**
+ * Same as coro_new_ex(), but the coroutine is owned by and runs in
+ * the given worker thread. It can be joined and woken up from any
+ * thread, including from plain code outside of coroutines. The
+ * stack size default and the pool are of the target worker. The
+ * calling thread must have an engine - be a worker or call
+ * coro_sched_init() first.
+ */
+struct coro *
+coro_new_on(int worker_id, coro_f func, void *func_arg,
+	const struct coro_attr *attr);
+
+/**
+ * Move the current coroutine to the given worker thread. Returns
+ * when the coroutine continues there. Can't be called by the main
+ * coroutine of coro_sched_run().
+ */
+void
+coro_migrate(int worker_id);
+
+/** Maximal number of the coroutine-local keys in the process. */
+#define CORO_KEY_MAX 8
+
+/**
+ * Create a key of the coroutine-local storage, like
+ * pthread_key_create() for the threads. Each coroutine has its own
+ * value of each key, NULL until set. The keys live till the process
+ * exits.
+ * @return The key, or -1 if all CORO_KEY_MAX are taken.
+ */
+int
+coro_key_create(void);
+
+/**
+ * Value of the key in the current coroutine. Constant time, no
+ * lookup.
+ */
+void *
+coro_key_get(int key);
+
+/**
+ * Set the value of the key in the current coroutine. The values
+ * are not freed by the library, and a coroutine reused after a join
+ * starts with all of them NULL.
+ */
+void
+coro_key_set(int key, void *value);
+
+/** Name of the coroutine. Empty string if it has none. */
+const char *
+coro_name(const struct coro *coro);
+
+/** Usable stack size of the coroutine, after rounding. */
+size_t
+coro_stack_size(const struct coro *coro);
+
 /**
  * Join a coroutine. When joined, its resources are freed, and the
  * result of its callback function is returned. Each coroutine
@@ -46,6 +387,32 @@ coro_new(coro_f func, void *func_arg);
 void *
 coro_join(struct coro *coro);
 
+/**
+ * Same as coro_join(), but not for longer than the given timeout
+ * in seconds. Negative timeout means no timeout. On timeout the
+ * coroutine stays not joined.
+ * @param[out] result Result of the coroutine, if not NULL.
+ * @retval true Joined.
+ * @retval false Timed out.
+ */
+bool
+coro_join_timeout(struct coro *coro, double timeout, void **result);
+
+/**
+ * Join any one of the given coroutines, the first finished in the
+ * array. Wait not longer than the timeout in seconds, negative
+ * means no timeout. The caller is woken up by a completion of any
+ * of them, so joining many coroutines as they finish takes one
+ * wakeup per completion. The joined one should be removed from the
+ * array before the next call. Each coroutine can have only one
+ * joiner at a time.
+ * @param[out] result Result of the joined coroutine, if not NULL.
+ * @return Index of the joined coroutine, or -1 on timeout.
+ */
+int
+coro_join_any(struct coro *const *coros, int count, double timeout,
+	void **result);
+
 /**
  * Pause the current coroutine until its explicitly woken up with
  * coro_wakeup(). Can be used to wait for some event, which will
@@ -54,6 +421,42 @@ coro_join(struct coro *coro);
 void
 coro_suspend(void);
 
+/**
+ * Same as coro_suspend(), but not for longer than the given
+ * timeout in seconds.
+ * @retval true Woken up.
+ * @retval false Timed out.
+ */
+bool
+coro_suspend_timeout(double timeout);
+
+enum {
+	CORO_FD_READ = 1 << 0,
+	CORO_FD_WRITE = 1 << 1,
+};
+
+/**
+ * Pause the current coroutine until the descriptor becomes ready
+ * for any of the given events, CORO_FD_READ and CORO_FD_WRITE,
+ * or until the timeout in seconds. Negative timeout means no
+ * timeout. Only one coroutine can wait for a descriptor at a
+ * time. While the engine has nothing to run, it blocks in the
+ * poller, epoll or kqueue.
+ * @return Mask of the ready events. 0 on timeout or on an
+ *     explicit wakeup. -1 if the descriptor can't be polled, and
+ *     errno is set.
+ */
+int
+coro_wait_fd(int fd, int events, double timeout);
+
+/**
+ * Pause the current coroutine for the given number of seconds.
+ * Wakeups don't interrupt it. When all the coroutines sleep, the
+ * scheduler blocks the thread until the closest deadline.
+ */
+void
+coro_sleep(double sec);
+
 /**
  * Pause the current coroutine until the next iteration of the
  * scheduler. Can be used to let the other coroutines work for a
@@ -65,7 +468,10 @@ coro_yield(void);
 /**
  * Wakeup a coroutine. If it was suspended, then it is going to be
  * continued on the next iteration of the scheduler. Otherwise
- * this function is a nop.
+ * this function is a nop. A wakeup from another thread, while the
+ * coroutine was running, makes its next coro_suspend() return
+ * right away. So the suspensions should be done in a loop checking
+ * the condition.
  */
 void
 coro_wakeup(struct coro *coro);
@@ -2,6 +2,11 @@
 
 #include "unit.h"
 
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -162,6 +167,1003 @@ test_wakeup_of_finished(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void *
+test_deep_stack_f(void *arg)
+{
+	size_t size = *(size_t *)arg;
+	volatile char buf[size];
+	memset((char *)buf, 1, size);
+	return (void *)(size_t)buf[size - 1];
+}
+
+static void
+test_stack_stats(void)
+{
+	unit_test_start();
+
+	struct coro_sched_stats before;
+	coro_sched_stats(&before);
+	unit_check(before.stack_committed_bytes <=
+		before.stack_reserved_bytes, "committed <= reserved");
+	unit_check(before.stack_committed_peak_bytes >=
+		before.stack_committed_bytes, "peak >= committed");
+
+	size_t depth = 256 * 1024;
+	struct coro *c = coro_new(test_deep_stack_f, &depth);
+	unit_check(coro_join(c) == (void *)1, "deep stack coro result");
+
+	struct coro_sched_stats after;
+	coro_sched_stats(&after);
+	unit_check(after.stack_committed_bytes >=
+		before.stack_committed_bytes + depth / 2,
+		"stack pages are committed on use");
+	unit_check(after.stack_committed_bytes <
+		after.stack_reserved_bytes, "not the whole stack is committed");
+	unit_check(after.stack_committed_peak_bytes >=
+		after.stack_committed_bytes, "peak is updated");
+
+	coro_sched_set_stack_size(64 * 1024);
+	depth = 16 * 1024;
+	c = coro_new(test_deep_stack_f, &depth);
+	unit_check(coro_stack_size(c) == 64 * 1024, "engine stack size");
+	unit_check(coro_join(c) == (void *)1, "small stack coro result");
+	coro_sched_set_stack_size(0);
+
+	unit_test_finish();
+}
+
+static void *
+test_shallow_stack_f(void *arg)
+{
+	return arg;
+}
+
+static const struct coro_stack_profile *
+test_stack_profile_find(const struct coro_stack_profile *profiles, int count,
+	coro_f func)
+{
+	for (int i = 0; i < count; ++i) {
+		if (profiles[i].func == func)
+			return &profiles[i];
+	}
+	return NULL;
+}
+
+static void
+test_stack_profile(void)
+{
+	unit_test_start();
+
+	/* The pooled stacks are used without the profiling. */
+	coro_sched_set_pool_limit(0);
+	coro_sched_trim();
+	coro_sched_set_pool_limit(CORO_POOL_LIMIT_DEFAULT);
+	coro_sched_set_stack_profiling(true);
+
+	size_t depth = 128 * 1024;
+	struct coro *c = coro_new(test_deep_stack_f, &depth);
+	coro_join(c);
+	/* Reuses the deep one from the pool. */
+	c = coro_new(test_shallow_stack_f, NULL);
+	coro_join(c);
+	c = coro_new(test_deep_stack_f, &depth);
+	coro_join(c);
+
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.is_lazy = true;
+	attr.name = "lazy";
+	c = coro_new_ex(test_deep_stack_f, &depth, &attr);
+	coro_join(c);
+	/* Gets the stack of the deep one. */
+	c = coro_new_ex(test_shallow_stack_f, NULL, &attr);
+	coro_join(c);
+	coro_sched_set_stack_profiling(false);
+
+	struct coro_stack_profile profiles[16];
+	int count = coro_sched_stack_profile(profiles, 16);
+	unit_check(count >= 2 && count <= 16, "profiled functions");
+	const struct coro_stack_profile *deep = test_stack_profile_find(
+		profiles, count, test_deep_stack_f);
+	const struct coro_stack_profile *shallow = test_stack_profile_find(
+		profiles, count, test_shallow_stack_f);
+	unit_fail_if(deep == NULL || shallow == NULL);
+	unit_check(deep->count == 3 && shallow->count == 2, "counted");
+	unit_check(deep->max_depth >= depth &&
+		deep->max_depth < depth + 8 * 1024, "deep one is measured");
+	unit_check(shallow->max_depth < 8 * 1024,
+		"shallow one is measured on a used stack");
+	unit_check(deep->stack_size == CORO_STACK_SIZE_DEFAULT, "stack size");
+	unit_check(strcmp(shallow->name, "lazy") == 0, "name of the last one");
+	unit_check(profiles[0].max_depth >= deep->max_depth,
+		"the deepest is first");
+	coro_sched_dump_stack_profile(stdout);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int test_key = -1;
+
+static void *
+test_key_f(void *arg)
+{
+	unit_assert(coro_key_get(test_key) == NULL);
+	coro_key_set(test_key, arg);
+	coro_yield();
+	return coro_key_get(test_key);
+}
+
+static void *
+test_key_get_f(void *arg)
+{
+	(void)arg;
+	return coro_key_get(test_key);
+}
+
+static void
+test_keys(void)
+{
+	unit_test_start();
+
+	test_key = coro_key_create();
+	int other_key = coro_key_create();
+	unit_check(test_key >= 0 && other_key >= 0 && test_key != other_key,
+		"keys are created");
+	unit_check(coro_key_get(test_key) == NULL, "NULL by default");
+	int data;
+	coro_key_set(test_key, &data);
+	coro_key_set(other_key, &other_key);
+
+	int values[2];
+	struct coro *c1 = coro_new(test_key_f, &values[0]);
+	struct coro *c2 = coro_new(test_key_f, &values[1]);
+	unit_check(coro_join(c1) == &values[0] &&
+		coro_join(c2) == &values[1], "each coroutine has its own");
+	unit_check(coro_key_get(test_key) == &data &&
+		coro_key_get(other_key) == &other_key, "the own ones are kept");
+
+	struct coro *c = coro_new(test_key_get_f, NULL);
+	unit_check(coro_join(c) == NULL, "a reused coroutine starts clean");
+
+	int count = 2;
+	while (coro_key_create() >= 0)
+		++count;
+	unit_check(count == CORO_KEY_MAX, "keys are limited");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_new_ex(void)
+{
+	unit_test_start();
+
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = 10 * 1024;
+	attr.name = "small";
+	size_t depth = 4 * 1024;
+	struct coro *small = coro_new_ex(test_deep_stack_f, &depth, &attr);
+	unit_check(coro_stack_size(small) == 16 * 1024, "rounded up size");
+	unit_check(strcmp(coro_name(small), "small") == 0, "name");
+	unit_check(coro_join(small) == (void *)1, "small coro result");
+
+	struct coro_sched_stats stats1;
+	coro_sched_stats(&stats1);
+	attr.stack_size = 4 * 1024 * 1024;
+	attr.name = "big";
+	depth = 2 * 1024 * 1024;
+	struct coro *big = coro_new_ex(test_deep_stack_f, &depth, &attr);
+	unit_check(big != small, "small stack is not reused for a big one");
+	unit_check(coro_stack_size(big) == 4 * 1024 * 1024, "big size");
+	unit_check(coro_join(big) == (void *)1, "big coro result");
+
+	struct coro_sched_stats stats2;
+	coro_sched_stats(&stats2);
+	unit_check(stats2.stack_count == stats1.stack_count + 1,
+		"new stack for the new size");
+	attr.stack_size = 16 * 1024;
+	attr.name = NULL;
+	depth = 1024;
+	struct coro *reused = coro_new_ex(test_deep_stack_f, &depth, &attr);
+	unit_check(reused == small, "same size class is reused");
+	unit_check(coro_name(reused)[0] == 0, "name is reset");
+	unit_check(coro_join(reused) == (void *)1, "reused coro result");
+	coro_sched_stats(&stats1);
+	unit_check(stats1.stack_count == stats2.stack_count,
+		"no new stacks on reuse");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_pool_trim(void)
+{
+	unit_test_start();
+
+	/* Only the running coroutines remain. */
+	coro_sched_set_pool_limit(0);
+	coro_sched_trim();
+	struct coro_sched_stats stats;
+	coro_sched_stats(&stats);
+	size_t base_count = stats.stack_count;
+	/* Only 2 default stacks can stay in the pool. */
+	coro_sched_set_pool_limit(2 * CORO_STACK_SIZE_DEFAULT);
+
+	enum { count = 10 };
+	struct coro *coros[count];
+	size_t depth = 128 * 1024;
+	for (int i = 0; i < count; ++i)
+		coros[i] = coro_new(test_deep_stack_f, &depth);
+	for (int i = 0; i < count; ++i)
+		unit_assert(coro_join(coros[i]) == (void *)1);
+	coro_sched_stats(&stats);
+	unit_check(stats.stack_count <= base_count + 2,
+		"stacks above the high-water mark are freed");
+	unit_check(stats.stack_committed_peak_bytes >= count * depth,
+		"peak counts the freed stacks");
+
+	size_t committed = stats.stack_committed_bytes;
+	coro_sched_trim();
+	coro_sched_stats(&stats);
+	unit_check(stats.stack_committed_bytes < committed,
+		"trim gives the pooled pages back");
+	unit_check(stats.stack_count <= base_count + 2, "pool is kept");
+
+	/* The trimmed coroutines are still usable. */
+	for (int i = 0; i < count; ++i)
+		coros[i] = coro_new(test_deep_stack_f, &depth);
+	for (int i = 0; i < count; ++i)
+		unit_assert(coro_join(coros[i]) == (void *)1);
+
+	coro_sched_set_pool_limit(0);
+	coro_sched_trim();
+	coro_sched_stats(&stats);
+	unit_check(stats.stack_count == base_count, "zero limit drops pool");
+	coro_sched_set_pool_limit(CORO_POOL_LIMIT_DEFAULT);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static double
+test_clock(clockid_t id)
+{
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+test_now(void)
+{
+	return test_clock(CLOCK_MONOTONIC);
+}
+
+static void *
+test_sleep_f(void *arg)
+{
+	coro_sleep(*(double *)arg);
+	return NULL;
+}
+
+static void *
+test_suspend_timeout_f(void *arg)
+{
+	return (void *)(long)coro_suspend_timeout(*(double *)arg);
+}
+
+static void
+test_sleep(void)
+{
+	unit_test_start();
+
+	double timeout = 0.05;
+	double start = test_now();
+	double cpu_start = test_clock(CLOCK_PROCESS_CPUTIME_ID);
+	struct coro *c1 = coro_new(test_sleep_f, &timeout);
+	struct coro *c2 = coro_new(test_sleep_f, &timeout);
+	coro_join(c1);
+	coro_join(c2);
+	double duration = test_now() - start;
+	double cpu = test_clock(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+	unit_check(duration >= timeout, "slept long enough");
+	unit_check(duration < timeout * 10, "slept not too long");
+	unit_check(cpu < duration / 2, "scheduler doesn't spin while sleeping");
+
+	/* A wakeup doesn't interrupt a sleep. */
+	start = test_now();
+	c1 = coro_new(test_sleep_f, &timeout);
+	coro_yield();
+	coro_wakeup(c1);
+	coro_join(c1);
+	unit_check(test_now() - start >= timeout, "sleep ignores wakeups");
+
+	start = test_now();
+	c1 = coro_new(test_suspend_timeout_f, &timeout);
+	unit_check(coro_join(c1) == (void *)0, "suspension timed out");
+	unit_check(test_now() - start >= timeout, "waited for the timeout");
+
+	double long_timeout = 10;
+	start = test_now();
+	c1 = coro_new(test_suspend_timeout_f, &long_timeout);
+	coro_yield();
+	coro_wakeup(c1);
+	unit_check(coro_join(c1) == (void *)1, "woken up before the timeout");
+	unit_check(test_now() - start < 1, "didn't wait for the timeout");
+
+	/* Timers fire in the order of their deadlines. */
+	double timeouts[] = {0.03, 0.01, 0.02};
+	struct coro *coros[3];
+	for (int i = 0; i < 3; ++i)
+		coros[i] = coro_new(test_sleep_f, &timeouts[i]);
+	start = test_now();
+	coro_join(coros[1]);
+	double t1 = test_now() - start;
+	coro_join(coros[0]);
+	double t0 = test_now() - start;
+	coro_join(coros[2]);
+	unit_check(t1 >= 0.01 && t1 < t0 && t0 >= 0.03, "timers order");
+
+	unit_test_finish();
+}
+
+static void *
+test_join_any_f(void *arg)
+{
+	coro_sleep(*(double *)arg);
+	return arg;
+}
+
+static void
+test_join_timeout(void)
+{
+	unit_test_start();
+
+	double timeout = 0.05;
+	struct coro *c = coro_new(test_sleep_f, &timeout);
+	double start = test_now();
+	void *ret = &ret;
+	unit_check(!coro_join_timeout(c, 0.01, &ret) && ret == &ret,
+		"join timed out");
+	unit_check(test_now() - start >= 0.01, "waited for the timeout");
+	unit_check(coro_join_timeout(c, -1, &ret) && ret == NULL,
+		"joined after a timeout");
+
+	c = coro_new(test_sleep_f, &timeout);
+	unit_check(coro_join_timeout(c, 10, NULL), "joined before the timeout");
+
+	/* Completions come in the order of the deadlines. */
+	enum { COUNT = 4 };
+	double timeouts[COUNT] = {0.04, 0.01, 0.03, 0.02};
+	struct coro *coros[COUNT];
+	for (int i = 0; i < COUNT; ++i)
+		coros[i] = coro_new(test_join_any_f, &timeouts[i]);
+	unit_check(coro_join_any(coros, COUNT, 0, NULL) == -1,
+		"join-any with zero timeout");
+	bool ok = true;
+	double prev = 0;
+	int count = COUNT;
+	while (count > 0) {
+		int i = coro_join_any(coros, count, -1, &ret);
+		ok = ok && i >= 0 && *(double *)ret > prev;
+		prev = *(double *)ret;
+		coros[i] = coros[--count];
+	}
+	unit_check(ok, "join-any in the order of completion");
+
+	c = coro_new(test_sleep_f, &timeout);
+	struct coro *done = coro_new(test_sleep_f, &(double){0});
+	coro_yield();
+	coros[0] = c;
+	coros[1] = done;
+	unit_check(coro_join_any(coros, 2, 0, NULL) == 1,
+		"join-any takes a finished one right away");
+	unit_check(coro_join_any(coros, 1, 0.001, NULL) == -1,
+		"join-any timed out");
+	struct coro_stats before, after;
+	coro_stats(coro_this(), &before);
+	unit_check(coro_join_any(coros, 1, -1, NULL) == 0,
+		"join-any after a timeout");
+	coro_stats(coro_this(), &after);
+	unit_check(after.wakeup_count - before.wakeup_count == 1,
+		"one wakeup per completion");
+
+	unit_test_finish();
+}
+
+struct test_task_state {
+	int *counter;
+	int target;
+	bool is_self_woken;
+};
+
+static bool
+test_task_step(struct coro *task, void *arg)
+{
+	struct test_task_state *state = arg;
+	if (++*state->counter >= state->target)
+		return true;
+	if (state->is_self_woken)
+		coro_wakeup(task);
+	return false;
+}
+
+static void *
+test_task_root_f(void *arg)
+{
+	(void)arg;
+	enum { COUNT = 100 };
+	struct coro *tasks[COUNT];
+	int counters[COUNT];
+	for (int i = 0; i < COUNT; ++i) {
+		counters[i] = 0;
+		struct test_task_state state = {&counters[i], 3, true};
+		tasks[i] = coro_task_new(test_task_step, &state,
+			sizeof(state), NULL);
+	}
+	bool ok = true;
+	for (int i = 0; i < COUNT; ++i) {
+		coro_join(tasks[i]);
+		ok = ok && counters[i] == 3;
+	}
+	return (void *)ok;
+}
+
+static void
+test_tasks(void)
+{
+	unit_test_start();
+
+	int counter = 0;
+	struct test_task_state state = {&counter, 5, true};
+	struct coro *task = coro_task_new(test_task_step, &state,
+		sizeof(state), NULL);
+	unit_check(((struct test_task_state *)coro_task_state(task))->target
+		   == 5, "inline state is copied");
+	unit_check(coro_join(task) == NULL, "task is joined");
+	unit_check(counter == 5, "task woke itself up");
+
+	counter = 0;
+	state.is_self_woken = false;
+	state.target = 3;
+	task = coro_task_new(test_task_step, &state, sizeof(state), NULL);
+	coro_yield();
+	unit_check(counter == 1, "task has started");
+	coro_yield();
+	unit_check(counter == 1, "task waits for a wakeup");
+	coro_wakeup(task);
+	coro_yield();
+	unit_check(counter == 2, "wakeup runs a step");
+	coro_wakeup(task);
+	coro_join(task);
+	unit_check(counter == 3, "task has finished");
+
+	/* The joiners wait in the middle of a switch to the tasks. */
+	coro_workers_start(2);
+	struct coro *roots[2];
+	for (int i = 0; i < 2; ++i)
+		roots[i] = coro_new_on(i, test_task_root_f, NULL, NULL);
+	bool ok = true;
+	for (int i = 0; i < 2; ++i)
+		ok = coro_join(roots[i]) == (void *)true && ok;
+	coro_workers_stop();
+	unit_check(ok, "tasks in the workers");
+
+	unit_test_finish();
+}
+
+static int test_lazy_started[100];
+static int test_lazy_start_count = 0;
+
+static void *
+test_lazy_f(void *arg)
+{
+	int i = (int)(intptr_t)arg;
+	test_lazy_started[test_lazy_start_count++] = i;
+	if (i % 10 == 0)
+		coro_yield();
+	return arg;
+}
+
+static void
+test_lazy_and_many(void)
+{
+	unit_test_start();
+
+	enum { COUNT = 100 };
+	struct coro *coros[COUNT];
+	void *args[COUNT];
+	for (int i = 0; i < COUNT; ++i)
+		args[i] = (void *)(intptr_t)i;
+	/* Start with no cached stacks. */
+	coro_sched_set_pool_limit(0);
+	coro_sched_trim();
+	coro_sched_set_pool_limit(CORO_POOL_LIMIT_DEFAULT);
+	struct coro_sched_stats before, stats;
+	coro_sched_stats(&before);
+
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.is_lazy = true;
+	coro_spawn_many(test_lazy_f, args, COUNT, &attr, coros);
+	coro_sched_stats(&stats);
+	unit_check(stats.stack_count == before.stack_count,
+		"no stacks before the start");
+	coro_yield();
+	coro_sched_stats(&stats);
+	unit_check(stats.stack_count - before.stack_count <= COUNT / 10 + 2,
+		"finished coroutines share the stacks");
+	bool ok = true;
+	for (int i = 0; i < COUNT; ++i) {
+		ok = ok && coro_join(coros[i]) == args[i];
+		ok = ok && test_lazy_started[i] == i;
+	}
+	unit_check(ok, "all started in order and returned");
+	coro_sched_stats(&stats);
+	unit_check(stats.stack_count > before.stack_count,
+		"stacks are cached");
+
+	/* Not lazy, with no arguments, partially from the pool. */
+	test_lazy_start_count = 0;
+	coro_spawn_many(test_lazy_f, NULL, COUNT, NULL, coros);
+	ok = true;
+	for (int i = 0; i < COUNT; ++i)
+		ok = ok && coro_join(coros[i]) == NULL;
+	unit_check(ok && test_lazy_start_count == COUNT, "batch of coroutines");
+
+	coro_sched_set_pool_limit(0);
+	coro_sched_trim();
+	coro_sched_stats(&stats);
+	unit_check(stats.stack_count == before.stack_count,
+		"cached stacks are freed");
+	coro_sched_set_pool_limit(CORO_POOL_LIMIT_DEFAULT);
+
+	unit_test_finish();
+}
+
+static int test_prio_order[3];
+static int test_prio_order_count = 0;
+
+static void *
+test_prio_order_f(void *arg)
+{
+	test_prio_order[test_prio_order_count++] = *(int *)arg;
+	return NULL;
+}
+
+static int test_prio_counter = 0;
+
+static void *
+test_prio_bulk_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 10; ++i) {
+		++test_prio_counter;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+test_prio_urgent_f(void *arg)
+{
+	coro_suspend();
+	*(int *)arg = test_prio_counter;
+	return NULL;
+}
+
+static bool test_prio_normal_ran = false;
+
+static void *
+test_prio_hog_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 1000; ++i)
+		coro_yield();
+	return (void *)test_prio_normal_ran;
+}
+
+static void *
+test_prio_normal_f(void *arg)
+{
+	(void)arg;
+	test_prio_normal_ran = true;
+	return NULL;
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	int prios[] = {CORO_PRIO_LOW, CORO_PRIO_NORMAL, CORO_PRIO_HIGH};
+	struct coro *coros[3];
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	unit_check(attr.priority == CORO_PRIO_NORMAL, "default priority");
+	for (int i = 0; i < 3; ++i) {
+		attr.priority = prios[i];
+		coros[i] = coro_new_ex(test_prio_order_f, &prios[i], &attr);
+		unit_assert(coro_priority(coros[i]) == prios[i]);
+	}
+	for (int i = 0; i < 3; ++i)
+		coro_join(coros[i]);
+	unit_check(test_prio_order[0] == CORO_PRIO_HIGH &&
+		   test_prio_order[1] == CORO_PRIO_NORMAL &&
+		   test_prio_order[2] == CORO_PRIO_LOW, "order of priorities");
+
+	/* A woken up urgent coroutine doesn't wait for the bulk. */
+	struct coro *bulk[10];
+	for (int i = 0; i < 10; ++i)
+		bulk[i] = coro_new(test_prio_bulk_f, NULL);
+	int seen = -1;
+	struct coro *urgent = coro_new(test_prio_urgent_f, &seen);
+	coro_set_priority(urgent, CORO_PRIO_HIGH);
+	coro_yield();
+	coro_yield();
+	int counter = test_prio_counter;
+	coro_wakeup(urgent);
+	coro_yield();
+	coro_join(urgent);
+	unit_check(seen == counter, "urgent coroutine runs first");
+	for (int i = 0; i < 10; ++i)
+		coro_join(bulk[i]);
+
+	/* A busy high priority coroutine doesn't starve the others. */
+	attr.priority = CORO_PRIO_HIGH;
+	struct coro *hog = coro_new_ex(test_prio_hog_f, NULL, &attr);
+	struct coro *normal = coro_new(test_prio_normal_f, NULL);
+	unit_check(coro_join(hog) == (void *)true, "no starvation");
+	coro_join(normal);
+
+	unit_test_finish();
+}
+
+static void *
+test_slab_f(void *arg)
+{
+	return arg;
+}
+
+static void
+test_slab(void)
+{
+	unit_test_start();
+
+	int counter = 0;
+	struct test_task_state state = {&counter, 1, false};
+	struct coro *task = coro_task_new(test_task_step, &state,
+		sizeof(state), NULL);
+	unit_check((uintptr_t)task % 64 == 0, "task is cache line aligned");
+	coro_join(task);
+	struct coro *next = coro_task_new(test_task_step, &state,
+		sizeof(state), NULL);
+	unit_check(next == task, "freed slot is reused");
+	coro_join(next);
+
+	/* Too big for a slot. */
+	char big[1024];
+	memset(big, 0, sizeof(big));
+	memcpy(big, &state, sizeof(state));
+	task = coro_task_new(test_task_step, big, sizeof(big), NULL);
+	unit_check((uintptr_t)task % 64 == 0 &&
+		   memcmp(coro_task_state(task), big, sizeof(big)) == 0,
+		   "big task is allocated aside");
+	coro_join(task);
+
+	enum { COUNT = 1000 };
+	static struct coro *coros[COUNT];
+	coro_spawn_many(test_slab_f, NULL, COUNT, NULL, coros);
+	bool ok = true;
+	for (int i = 0; i < COUNT; ++i) {
+		ok = ok && (uintptr_t)coros[i] % 64 == 0;
+		ok = ok && coro_join(coros[i]) == NULL;
+	}
+	unit_check(ok, "many coroutines in the slab");
+
+	unit_test_finish();
+}
+
+static void *
+test_stats_f(void *arg)
+{
+	struct coro_stats *stats = arg;
+	coro_yield();
+	coro_yield();
+	coro_suspend();
+	/* Hog the thread for a while. */
+	double start = test_now();
+	while (test_now() - start < 0.01)
+		;
+	/* The run is accounted when the coroutine is switched out. */
+	coro_yield();
+	coro_stats(coro_this(), stats);
+	return NULL;
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct coro_sched_stats sched;
+	struct coro_stats before, after, stats;
+	coro_sched_stats_ex(&sched, &before);
+	coro_sched_set_timing(true);
+	struct coro *c = coro_new(test_stats_f, &stats);
+	coro_yield();
+	coro_yield();
+	coro_yield();
+	coro_wakeup(c);
+	coro_join(c);
+	coro_sched_stats_ex(&sched, &after);
+	coro_sched_set_timing(false);
+	unit_check(stats.yield_count == 3, "yields");
+	unit_check(stats.suspend_count == 1, "suspends");
+	unit_check(stats.wakeup_count == 1, "wakeups");
+	unit_check(stats.switch_count == 5, "switches");
+	unit_check(stats.run_max_ns >= 10000000, "max run time");
+	unit_check(stats.run_ns >= stats.run_max_ns, "run time");
+	unit_check(stats.wait_ns >= stats.wait_max_ns, "wait time");
+	unit_check(after.yield_count - before.yield_count >= 6,
+		"engine yields");
+	unit_check(after.switch_count - before.switch_count >= 4,
+		"engine switches");
+	unit_check(after.run_max_ns >= stats.run_max_ns, "engine max run time");
+
+	FILE *out = tmpfile();
+	unit_fail_if(out == NULL);
+	coro_sched_dump_stats(out);
+	unit_check(ftell(out) > 0, "dump");
+	fclose(out);
+
+	unit_test_finish();
+}
+
+static void *
+test_wait_read_f(void *arg)
+{
+	int fd = *(int *)arg;
+	return (void *)(long)coro_wait_fd(fd, CORO_FD_READ, 5);
+}
+
+static void *
+test_delayed_write_f(void *arg)
+{
+	int fd = *(int *)arg;
+	usleep(50 * 1000);
+	if (write(fd, "x", 1) != 1)
+		abort();
+	return NULL;
+}
+
+static void
+test_wait_fd(void)
+{
+	unit_test_start();
+
+	int fds[2];
+	unit_assert(pipe(fds) == 0);
+	unit_check(coro_wait_fd(fds[1], CORO_FD_WRITE, 1) == CORO_FD_WRITE,
+		"pipe is writable");
+	double start = test_now();
+	unit_check(coro_wait_fd(fds[0], CORO_FD_READ, 0.02) == 0,
+		"read timed out");
+	unit_check(test_now() - start >= 0.02, "waited for the timeout");
+
+	struct coro *c = coro_new(test_wait_read_f, &fds[0]);
+	coro_yield();
+	unit_assert(write(fds[1], "x", 1) == 1);
+	unit_check(coro_join(c) == (void *)CORO_FD_READ, "read is ready");
+	char buf[16];
+	unit_assert(read(fds[0], buf, sizeof(buf)) == 1);
+
+	c = coro_new(test_wait_read_f, &fds[0]);
+	coro_yield();
+	coro_wakeup(c);
+	unit_check(coro_join(c) == (void *)0, "explicit wakeup");
+
+	/* Nothing runnable - the scheduler has to block in poll. */
+	pthread_t thread;
+	start = test_now();
+	double cpu_start = test_clock(CLOCK_PROCESS_CPUTIME_ID);
+	unit_assert(pthread_create(&thread, NULL, test_delayed_write_f,
+		&fds[1]) == 0);
+	c = coro_new(test_wait_read_f, &fds[0]);
+	unit_check(coro_join(c) == (void *)CORO_FD_READ,
+		"woken up by another thread's write");
+	double duration = test_now() - start;
+	double cpu = test_clock(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+	unit_check(cpu < duration / 2, "scheduler doesn't spin in poll");
+	pthread_join(thread, NULL);
+
+	unit_check(coro_wait_fd(-1, CORO_FD_READ, 0) == -1, "bad descriptor");
+	close(fds[0]);
+	close(fds[1]);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_worker_id_f(void *arg)
+{
+	(void)arg;
+	coro_yield();
+	return (void *)(long)coro_worker_id();
+}
+
+static void *
+test_migrate_f(void *arg)
+{
+	int *path = arg;
+	path[0] = coro_worker_id();
+	coro_migrate(1);
+	path[1] = coro_worker_id();
+	coro_migrate(0);
+	path[2] = coro_worker_id();
+	return NULL;
+}
+
+static void *
+test_remote_suspend_f(void *arg)
+{
+	int *flag = arg;
+	while (__atomic_load_n(flag, __ATOMIC_ACQUIRE) == 0)
+		coro_suspend();
+	return (void *)(long)coro_worker_id();
+}
+
+static void
+test_workers(void)
+{
+	unit_test_start();
+
+	coro_workers_start(2);
+	unit_assert(coro_workers_count() == 2);
+	unit_check(coro_worker_id() == -1, "main thread is not a worker");
+
+	enum { count = 10 };
+	struct coro *coros[count];
+	for (int i = 0; i < count; ++i)
+		coros[i] = coro_new_on(CORO_WORKER_ANY, test_worker_id_f, NULL,
+			NULL);
+	bool ok = true;
+	for (int i = 0; i < count; ++i) {
+		long id = (long)coro_join(coros[i]);
+		ok = ok && id >= 0 && id < 2;
+	}
+	unit_check(ok, "coroutines run in the workers");
+
+	int path[3] = {-1, -1, -1};
+	struct coro *c = coro_new_on(0, test_migrate_f, path, NULL);
+	unit_assert(coro_join(c) == NULL);
+	unit_check(path[0] == 0 && path[1] == 1 && path[2] == 0,
+		"migration between the workers");
+
+	int flag = 0;
+	c = coro_new_on(1, test_remote_suspend_f, &flag, NULL);
+	coro_yield();
+	__atomic_store_n(&flag, 1, __ATOMIC_RELEASE);
+	coro_wakeup(c);
+	unit_check(coro_join(c) == (void *)1, "wakeup from another thread");
+
+	double timeout = 0.02;
+	double start = test_now();
+	c = coro_new_on(1, test_sleep_f, &timeout, NULL);
+	unit_assert(coro_join(c) == NULL);
+	unit_check(test_now() - start >= timeout, "sleep in a worker");
+
+	/* A worker sleeping in its poller is woken up by a request. */
+	int fds[2];
+	unit_assert(pipe(fds) == 0);
+	c = coro_new_on(1, test_wait_read_f, &fds[0], NULL);
+	usleep(20 * 1000);
+	coro_wakeup(c);
+	unit_check(coro_join(c) == (void *)0, "wakeup of a worker in poll");
+	close(fds[0]);
+	close(fds[1]);
+
+	unit_test_finish();
+}
+
+static void *
+test_steal_child_f(void *arg)
+{
+	int *is_stolen = arg;
+	if (coro_worker_id() != 0)
+		__atomic_store_n(is_stolen, 1, __ATOMIC_RELEASE);
+	/*
+	 * Occupy the thread without yields, so the others can only
+	 * be taken by the idle worker.
+	 */
+	double deadline = test_now() + 2;
+	while (__atomic_load_n(is_stolen, __ATOMIC_ACQUIRE) == 0 &&
+	       test_now() < deadline);
+	return NULL;
+}
+
+static void *
+test_steal_root_f(void *arg)
+{
+	enum { count = 10 };
+	struct coro *coros[count];
+	for (int i = 0; i < count; ++i)
+		coros[i] = coro_new(test_steal_child_f, arg);
+	for (int i = 0; i < count; ++i)
+		coro_join(coros[i]);
+	return NULL;
+}
+
+static void
+test_work_stealing(void)
+{
+	unit_test_start();
+
+	int is_stolen = 0;
+	struct coro *c = coro_new_on(0, test_steal_root_f, &is_stolen, NULL);
+	unit_assert(coro_join(c) == NULL);
+	unit_check(is_stolen == 1, "idle worker steals coroutines");
+
+	unit_test_finish();
+}
+
+static void *
+test_supervisor_f(void *arg)
+{
+	(void)arg;
+	enum { COUNT = 200 };
+	struct coro *coros[COUNT];
+	for (int i = 0; i < COUNT; ++i) {
+		coros[i] = coro_new_on(CORO_WORKER_ANY, test_worker_id_f, NULL,
+			NULL);
+	}
+	struct coro_stats before, after;
+	coro_stats(coro_this(), &before);
+	int count = COUNT;
+	while (count > 0) {
+		int i = coro_join_any(coros, count, -1, NULL);
+		if (i < 0)
+			return (void *)false;
+		coros[i] = coros[--count];
+	}
+	coro_stats(coro_this(), &after);
+	bool ok = after.wakeup_count - before.wakeup_count <= COUNT;
+	return (void *)ok;
+}
+
+static void
+test_workers_join_outside(void)
+{
+	unit_test_start();
+
+	struct coro *c = coro_new_on(1, test_worker_id_f, NULL, NULL);
+	unit_check(coro_join(c) == (void *)1, "join outside of coroutines");
+	c = coro_new_on(0, test_supervisor_f, NULL, NULL);
+	unit_check(coro_join(c) == (void *)true, "join-any in the workers");
+	double timeout = 0.05;
+	c = coro_new_on(1, test_sleep_f, &timeout, NULL);
+	unit_check(!coro_join_timeout(c, 0.01, NULL),
+		"join timed out outside of coroutines");
+	unit_check(coro_join_timeout(c, 10, NULL),
+		"joined with a timeout outside of coroutines");
+	coro_workers_stop();
+	unit_check(coro_workers_count() == 0, "workers are stopped");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -171,6 +1173,21 @@ coro_main_f(void *arg)
 	test_wakup_self();
 	test_join_of_join();
 	test_wakeup_of_finished();
+	test_stack_stats();
+	test_stack_profile();
+	test_keys();
+	test_new_ex();
+	test_pool_trim();
+	test_sleep();
+	test_join_timeout();
+	test_stats();
+	test_priority();
+	test_lazy_and_many();
+	test_tasks();
+	test_slab();
+	test_wait_fd();
+	test_workers();
+	test_work_stealing();
 	return NULL;
 }
 
@@ -182,6 +1199,7 @@ main(void)
 	coro_sched_run();
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
+	test_workers_join_outside();
 	coro_sched_destroy();
 	return 0;
 }
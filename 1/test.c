@@ -743,6 +743,641 @@ test_wakeup_on_close(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_direct_handoff(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+
+	unit_msg("a waiting receiver gets the message before anyone else");
+	unsigned data1 = 0;
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c1, &data1);
+	coro_yield();
+	unit_assert(!recv_ctx.is_done);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unsigned data2 = 0;
+	unit_assert(coro_bus_try_recv(bus, c1, &data2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(recv_join(&recv_ctx) == 0 && data1 == 1);
+
+	unit_msg("a waiting sender takes the freed space");
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 3);
+	coro_yield();
+	unit_assert(!send_ctx.is_done);
+	unit_assert(coro_bus_recv(bus, c1, &data2) == 0 && data2 == 2);
+	unit_assert(coro_bus_try_send(bus, c1, 4) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(send_join(&send_ctx) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data2) == 0 && data2 == 3);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_reopen_during_wait(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("start a sender and a receiver on full and empty channels");
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 >= 0);
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 2);
+	unsigned data = 0;
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c2, &data);
+	coro_yield();
+	unit_assert(!send_ctx.is_done && !recv_ctx.is_done);
+
+	unit_msg("reopen the channels on the same descriptors");
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, c2);
+	unit_assert(coro_bus_channel_open(bus, 1) == c2);
+	unit_assert(coro_bus_channel_open(bus, 1) == c1);
+	unit_assert(coro_bus_send(bus, c2, 3) == 0);
+
+	unit_msg("the waiters don't use the new channels");
+	unit_assert(send_join(&send_ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(recv_join(&recv_ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(data == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == 0 && data == 3);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, c2);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_msg {
+	unsigned id;
+	double value;
+	char name[20];
+};
+
+struct ctx_recv_msg {
+	struct coro_bus *bus;
+	int channel;
+	struct test_msg msg;
+	int rc;
+};
+
+static void *
+recv_msg_f(void *arg)
+{
+	struct ctx_recv_msg *ctx = arg;
+	ctx->rc = coro_bus_recv_msg(ctx->bus, ctx->channel, &ctx->msg);
+	return NULL;
+}
+
+static void
+test_typed_messages(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_ex(bus, 3, sizeof(struct test_msg));
+	unit_assert(c1 >= 0);
+
+	unit_msg("send and recv messages by value");
+	struct test_msg msg;
+	for (unsigned i = 0; i < 3; ++i) {
+		memset(&msg, 0, sizeof(msg));
+		msg.id = i;
+		msg.value = i * 1.5;
+		snprintf(msg.name, sizeof(msg.name), "msg %u", i);
+		unit_assert(coro_bus_try_send_msg(bus, c1, &msg) == 0);
+	}
+	unit_assert(coro_bus_try_send_msg(bus, c1, &msg) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	bool ok = true;
+	for (unsigned i = 0; i < 3; ++i) {
+		ok = ok && coro_bus_recv_msg(bus, c1, &msg) == 0 &&
+			msg.id == i && msg.value == i * 1.5;
+		char name[20];
+		snprintf(name, sizeof(name), "msg %u", i);
+		ok = ok && strcmp(msg.name, name) == 0;
+	}
+	unit_assert(ok);
+	unit_assert(coro_bus_try_recv_msg(bus, c1, &msg) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("unsigned messages don't fit");
+	unit_assert(coro_bus_try_send(bus, c1, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+	unsigned data;
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+#if NEED_BROADCAST
+	unit_assert(coro_bus_try_broadcast(bus, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+#endif
+
+	unit_msg("a waiting receiver gets a reserved message");
+	struct ctx_recv_msg ctx;
+	ctx.bus = bus;
+	ctx.channel = c1;
+	ctx.rc = -1;
+	struct coro *worker = coro_new(recv_msg_f, &ctx);
+	coro_yield();
+	struct test_msg *place = coro_bus_try_send_reserve(bus, c1);
+	unit_assert(place != NULL);
+	place->id = 100;
+	place->value = 0.5;
+	strcpy(place->name, "reserved");
+	unit_assert(coro_bus_send_commit(bus, c1) == 0);
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(ctx.rc == 0 && ctx.msg.id == 100 && ctx.msg.value == 0.5 &&
+		    strcmp(ctx.msg.name, "reserved") == 0);
+
+	unit_msg("reserve in a full channel");
+	for (unsigned i = 0; i < 3; ++i) {
+		place = coro_bus_send_reserve(bus, c1);
+		unit_assert(place != NULL);
+		place->id = i;
+		unit_assert(coro_bus_send_commit(bus, c1) == 0);
+	}
+	unit_assert(coro_bus_try_send_reserve(bus, c1) == NULL);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	for (unsigned i = 0; i < 3; ++i) {
+		ok = ok && coro_bus_recv_msg(bus, c1, &msg) == 0 &&
+			msg.id == i;
+	}
+	unit_assert(ok);
+
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_bus_send_reserve(bus, c1) == NULL);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_select {
+	struct coro_bus *bus;
+	struct coro_bus_op ops[2];
+	double timeout;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+select_f(void *arg)
+{
+	struct ctx_select *ctx = arg;
+	ctx->rc = coro_bus_select(ctx->bus, ctx->ops, 2, ctx->timeout);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+select_start(struct ctx_select *ctx, double timeout)
+{
+	ctx->timeout = timeout;
+	ctx->rc = -2;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_done = false;
+	ctx->worker = coro_new(select_f, ctx);
+}
+
+static int
+select_join(struct ctx_select *ctx)
+{
+	unit_assert(coro_join(ctx->worker) == NULL);
+	unit_assert(ctx->is_done);
+	coro_bus_errno_set(ctx->err);
+	return ctx->rc;
+}
+
+static void
+test_select(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 >= 0);
+	unsigned data1 = 0;
+	unsigned data2 = 0;
+	struct ctx_select ctx;
+	ctx.bus = bus;
+	ctx.ops[0].type = CORO_BUS_OP_RECV;
+	ctx.ops[0].channel = c1;
+	ctx.ops[0].recv_data = &data1;
+	ctx.ops[1].type = CORO_BUS_OP_RECV;
+	ctx.ops[1].channel = c2;
+	ctx.ops[1].recv_data = &data2;
+
+	unit_msg("nothing to receive");
+	unit_assert(coro_bus_select(bus, ctx.ops, 2, 0) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_select(bus, ctx.ops, 2, 0.01) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("receive from the one with data");
+	unit_assert(coro_bus_send(bus, c2, 5) == 0);
+	unit_assert(coro_bus_select(bus, ctx.ops, 2, 0) == 1);
+	unit_assert(data2 == 5);
+
+	unit_msg("wait on both channels");
+	select_start(&ctx, -1);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_send(bus, c2, 6) == 0);
+	unit_assert(select_join(&ctx) == 1 && data2 == 6);
+	unit_msg("the other wait is cancelled");
+	unit_assert(coro_bus_send(bus, c1, 7) == 0);
+	coro_yield();
+	unit_assert(coro_bus_try_recv(bus, c1, &data1) == 0 && data1 == 7);
+
+	unit_msg("send and recv together");
+	unit_assert(coro_bus_send(bus, c1, 8) == 0);
+	unsigned to_send = 9;
+	ctx.ops[0].type = CORO_BUS_OP_SEND;
+	ctx.ops[0].send_data = &to_send;
+	select_start(&ctx, 10);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_recv(bus, c1, &data1) == 0 && data1 == 8);
+	unit_assert(select_join(&ctx) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data1) == 0 && data1 == 9);
+
+	unit_msg("a channel is closed during the wait");
+	ctx.ops[0].type = CORO_BUS_OP_RECV;
+	ctx.ops[0].recv_data = &data1;
+	select_start(&ctx, -1);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(select_join(&ctx) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_select(bus, ctx.ops, 2, 0) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_channel_close(bus, c2);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_channel_stats(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 2);
+	int c2 = coro_bus_channel_open(bus, 5);
+	int c3 = coro_bus_channel_open(bus, 1);
+
+	unit_msg("iterate over the open channels");
+	coro_bus_channel_close(bus, c2);
+	int channels[3];
+	int count = 0;
+	for (int c = coro_bus_channel_next(bus, -1); c >= 0;
+	     c = coro_bus_channel_next(bus, c))
+		channels[count++] = c;
+	unit_assert(count == 2 && channels[0] == c1 && channels[1] == c3);
+
+	unit_msg("count the messages and the depth");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unsigned data;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	struct coro_bus_channel_stats stats;
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.size == 1 && stats.size_limit == 2);
+	unit_assert(stats.elem_size == sizeof(unsigned));
+	unit_assert(stats.size_max == 2);
+	unit_assert(stats.send_count == 2 && stats.recv_count == 1);
+	unit_assert(stats.send_wait_count == 0 && stats.recv_wait_count == 0);
+
+	unit_msg("count the waits");
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c3, &data);
+	coro_sleep(0.01);
+	unit_assert(coro_bus_send(bus, c3, 3) == 0);
+	unit_assert(recv_join(&recv_ctx) == 0 && data == 3);
+	unit_assert(coro_bus_send(bus, c3, 4) == 0);
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c3, 5);
+	coro_yield();
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0 && data == 4);
+	unit_assert(send_join(&send_ctx) == 0);
+	unit_assert(coro_bus_channel_stats(bus, c3, &stats) == 0);
+	unit_assert(stats.recv_wait_count == 1);
+	unit_assert(stats.recv_wait_ns >= 10000000);
+	unit_assert(stats.send_wait_count == 1);
+	unit_assert(stats.send_count == 3 && stats.recv_count == 2);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, c3);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_channel_next(bus, -1) == -1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_backpressure {
+	int channel;
+	int on_count;
+	int off_count;
+};
+
+static void
+test_backpressure_cb(struct coro_bus *bus, int channel, bool is_on, void *arg)
+{
+	(void)bus;
+	struct test_backpressure *bp = arg;
+	bp->channel = channel;
+	if (is_on)
+		++bp->on_count;
+	else
+		++bp->off_count;
+}
+
+static void
+test_elastic_channel(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_elastic(bus, 2, 5, sizeof(unsigned));
+	unit_assert(c1 >= 0);
+	struct test_backpressure bp = {-1, 0, 0};
+	coro_bus_channel_set_backpressure(bus, c1, test_backpressure_cb, &bp);
+
+	unit_msg("grow above the soft limit up to the hard one");
+	bool ok = true;
+	for (unsigned i = 0; i < 5; ++i) {
+		ok = ok && coro_bus_try_send(bus, c1, i) == 0;
+		ok = ok && bp.on_count == (i >= 2);
+	}
+	unit_assert(ok);
+	unit_assert(bp.channel == c1 && bp.off_count == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 5) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	struct coro_bus_channel_stats stats;
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.size == 5 && stats.soft_limit == 2 &&
+		    stats.size_limit == 5);
+
+	unit_msg("a blocked sender gets the freed space");
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 5);
+	coro_yield();
+	unit_assert(!send_ctx.is_done);
+	unsigned data;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 0);
+	unit_assert(send_join(&send_ctx) == 0);
+
+	unit_msg("the order is kept while shrinking");
+	unsigned batch[4];
+	unit_assert(coro_bus_recv_v(bus, c1, batch, 4) == 4);
+	unit_assert(batch[0] == 1 && batch[1] == 2 && batch[2] == 3 &&
+		    batch[3] == 4);
+	unit_assert(bp.off_count == 1);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 5);
+
+	unit_msg("reserve above the soft limit");
+	unit_assert(coro_bus_send(bus, c1, 6) == 0);
+	unit_assert(coro_bus_send(bus, c1, 7) == 0);
+	unsigned *place = coro_bus_send_reserve(bus, c1);
+	unit_assert(place != NULL);
+	*place = 8;
+	unit_assert(coro_bus_send_commit(bus, c1) == 0);
+	unit_assert(bp.on_count == 2);
+	for (unsigned i = 6; i <= 8; ++i)
+		ok = ok && coro_bus_recv(bus, c1, &data) == 0 && data == i;
+	unit_assert(ok);
+	coro_bus_channel_close(bus, c1);
+
+	unit_msg("unbounded channel over many segments");
+	int c2 = coro_bus_channel_open_elastic(bus, 10, SIZE_MAX,
+		sizeof(unsigned));
+	for (unsigned i = 0; i < 10000; ++i)
+		ok = ok && coro_bus_try_send(bus, c2, i) == 0;
+	unit_assert(ok);
+	for (unsigned i = 0; i < 10000; i += 100) {
+		unsigned many[100];
+		ok = ok && coro_bus_try_recv_v(bus, c2, many, 100) == 100;
+		for (unsigned j = 0; j < 100; ++j)
+			ok = ok && many[j] == i + j;
+	}
+	unit_assert(ok);
+	unit_assert(coro_bus_try_recv(bus, c2, &data) != 0);
+	unit_msg("the messages left are freed with the channel");
+	for (unsigned i = 0; i < 3000; ++i)
+		ok = ok && coro_bus_try_send(bus, c2, i) == 0;
+	unit_assert(ok);
+	coro_bus_channel_close(bus, c2);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_spill_channel(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	unit_assert(coro_bus_channel_open_spill(bus, 4, sizeof(unsigned),
+		"/no/such/dir") < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_SYSTEM);
+	int c1 = coro_bus_channel_open_spill(bus, 4, sizeof(unsigned), NULL);
+	unit_assert(c1 >= 0);
+	struct test_backpressure bp = {-1, 0, 0};
+	coro_bus_channel_set_backpressure(bus, c1, test_backpressure_cb, &bp);
+
+	unit_msg("the senders never block, the messages go to the file");
+	bool ok = true;
+	const unsigned count = 100000;
+	for (unsigned i = 0; i < count; ++i)
+		ok = ok && coro_bus_try_send(bus, c1, i) == 0;
+	unit_assert(ok);
+	unit_assert(bp.on_count == 1);
+	struct coro_bus_channel_stats stats;
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.size == count && stats.size_limit == SIZE_MAX);
+	unit_assert(stats.spill_size > count / 2);
+	unit_assert(stats.spill_count == stats.spill_size);
+	unit_assert(stats.spill_error_count == 0);
+
+	unit_msg("replayed in order while more are sent");
+	unsigned next = 0;
+	unsigned sent = count;
+	unsigned many[1000];
+	for (int i = 0; i < 100; ++i) {
+		int rc = coro_bus_try_recv_v(bus, c1, many, 1000);
+		ok = ok && rc == 1000;
+		for (int j = 0; j < rc; ++j)
+			ok = ok && many[j] == next++;
+		for (int j = 0; j < 300; ++j)
+			ok = ok && coro_bus_try_send(bus, c1, sent++) == 0;
+	}
+	unit_assert(ok);
+
+	unit_msg("a big batch is spilled too");
+	static unsigned batch[20000];
+	for (unsigned i = 0; i < 20000; ++i)
+		batch[i] = sent++;
+	unit_assert(coro_bus_send_v(bus, c1, batch, 20000) == 20000);
+	unsigned *place = coro_bus_send_reserve(bus, c1);
+	unit_assert(place != NULL);
+	*place = sent++;
+	unit_assert(coro_bus_send_commit(bus, c1) == 0);
+	unsigned data;
+	while (coro_bus_try_recv(bus, c1, &data) == 0)
+		ok = ok && data == next++;
+	unit_assert(ok);
+	unit_assert(next == sent);
+	unit_assert(bp.off_count == 1);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.size == 0 && stats.spill_size == 0);
+
+	unit_msg("a blocked receiver gets the messages");
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c1, &data);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, c1, 7) == 0);
+	unit_assert(recv_join(&recv_ctx) == 0 && data == 7);
+
+	unit_msg("the spilled messages are dropped with the channel");
+	for (unsigned i = 0; i < count; ++i)
+		ok = ok && coro_bus_try_send(bus, c1, i) == 0;
+	unit_assert(ok);
+	coro_bus_channel_close(bus, c1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/** A sender into a priority lane, the lane's number is the data. */
+static void *
+test_prio_send_f(void *arg)
+{
+	struct ctx_send *ctx = arg;
+	ctx->is_started = true;
+	ctx->rc = coro_bus_send_prio(ctx->bus, ctx->channel, ctx->data,
+		&ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_prio_channel(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_prio(bus, 2, 3, sizeof(unsigned));
+	unit_assert(c1 >= 0);
+
+	unit_msg("a full lane 0 doesn't block the higher lanes");
+	unit_assert(coro_bus_send(bus, c1, 100) == 0);
+	unit_assert(coro_bus_send(bus, c1, 101) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 102) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 102);
+	coro_yield();
+	unit_assert(send_ctx.is_started && !send_ctx.is_done);
+	unsigned msg = 200;
+	unit_assert(coro_bus_try_send_prio(bus, c1, 2, &msg) == 0);
+	msg = 201;
+	unit_assert(coro_bus_send_prio(bus, c1, 1, &msg) == 0);
+	unit_msg("a priority above the highest is the highest");
+	msg = 202;
+	unit_assert(coro_bus_send_prio(bus, c1, 100, &msg) == 0);
+	unit_assert(coro_bus_try_send_prio(bus, c1, 2, &msg) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	struct coro_bus_channel_stats stats;
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.size == 5 && stats.size_max == 5 &&
+		    stats.size_limit == 2);
+
+	unit_msg("the higher lanes are received first");
+	unsigned data;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 200);
+	unsigned batch[3];
+	unit_assert(coro_bus_recv_v(bus, c1, batch, 3) == 3);
+	unit_assert(batch[0] == 202 && batch[1] == 201 && batch[2] == 100);
+	unit_assert(send_join(&send_ctx) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 101);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 102);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+
+	unit_msg("a blocked sender of a lane gets its space");
+	msg = 1;
+	unit_assert(coro_bus_send_prio(bus, c1, 1, &msg) == 0);
+	unit_assert(coro_bus_send_prio(bus, c1, 1, &msg) == 0);
+	send_ctx.bus = bus;
+	send_ctx.channel = c1;
+	send_ctx.data = 1;
+	send_ctx.is_started = false;
+	send_ctx.is_done = false;
+	send_ctx.worker = coro_new(test_prio_send_f, &send_ctx);
+	coro_yield();
+	unit_assert(send_ctx.is_started && !send_ctx.is_done);
+	unit_msg("lane 0 is free all this time");
+	unit_assert(coro_bus_try_send(bus, c1, 103) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(send_join(&send_ctx) == 0);
+	unit_assert(coro_bus_recv_v(bus, c1, batch, 3) == 3);
+	unit_assert(batch[0] == 1 && batch[1] == 1 && batch[2] == 103);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.send_count == 10 && stats.recv_count == 10);
+
+	unit_msg("close wakes up the senders of the lanes");
+	unit_assert(coro_bus_send_prio(bus, c1, 2, &msg) == 0);
+	unit_assert(coro_bus_send_prio(bus, c1, 2, &msg) == 0);
+	send_ctx.data = 2;
+	send_ctx.is_started = false;
+	send_ctx.is_done = false;
+	send_ctx.worker = coro_new(test_prio_send_f, &send_ctx);
+	coro_yield();
+	unit_assert(send_ctx.is_started && !send_ctx.is_done);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(send_join(&send_ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("a plain channel has one lane");
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(coro_bus_send_prio(bus, c2, 5, &msg) == 0);
+	unit_assert(coro_bus_try_send(bus, c2, 3) != 0);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == msg);
+	coro_bus_channel_close(bus, c2);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
 static void
 test_close_non_empty_bus(void)
 {
@@ -1014,6 +1649,101 @@ test_broadcast_blocking_drop_channel_during_wait(void)
 #endif
 }
 
+static void
+test_broadcast_wakeup_when_all_have_space(void)
+{
+#if NEED_BROADCAST
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(coro_bus_broadcast(bus, 1) == 0);
+
+	unit_msg("the broadcast waits for both channels");
+	struct ctx_broadcast ctx;
+	broadcast_start(&ctx, bus, 2);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+	struct coro_stats stats;
+	coro_stats(ctx.worker, &stats);
+	uint64_t switch_count = stats.switch_count;
+	unsigned data;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	coro_yield();
+	coro_stats(ctx.worker, &stats);
+	unit_assert(stats.switch_count == switch_count);
+	unit_assert(!ctx.is_done);
+
+	unit_msg("it is woken up when none is full");
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 1);
+	unit_assert(broadcast_join(&ctx) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 2);
+
+	unit_msg("a channel of zero limit is always full");
+	int c3 = coro_bus_channel_open(bus, 0);
+	unit_assert(coro_bus_try_broadcast(bus, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_channel_close(bus, c3);
+	unit_assert(coro_bus_try_broadcast(bus, 3) == 0);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, c2);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+static void
+test_broadcast_shared(void)
+{
+#if NEED_BROADCAST
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_shared(bus, 2);
+	int c2 = coro_bus_channel_open_shared(bus, 1);
+	unit_assert(c1 >= 0 && c2 >= 0);
+
+	unit_msg("one copy for all the channels");
+	char msg[100] = "shared message";
+	unit_assert(coro_bus_broadcast_shared(bus, msg, sizeof(msg)) == 0);
+	msg[0] = 0;
+	const void *ref1;
+	const void *ref2;
+	unit_assert(coro_bus_recv_msg(bus, c1, &ref1) == 0);
+	unit_assert(coro_bus_recv_msg(bus, c2, &ref2) == 0);
+	unit_assert(ref1 == ref2);
+	unit_assert(strcmp(ref1, "shared message") == 0);
+	coro_bus_shared_unref(ref1);
+	coro_bus_shared_unref(ref2);
+
+	unit_msg("the channels lag by their own limits");
+	unit_assert(coro_bus_try_broadcast_shared(bus, "a", 2) == 0);
+	unit_assert(coro_bus_try_broadcast_shared(bus, "b", 2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv_msg(bus, c2, &ref2) == 0);
+	unit_assert(strcmp(ref2, "a") == 0);
+	coro_bus_shared_unref(ref2);
+	unit_assert(coro_bus_try_broadcast_shared(bus, "b", 2) == 0);
+
+	unit_msg("no other messages in the shared channels");
+	unit_assert(coro_bus_try_send_msg(bus, c1, &ref1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+	unit_assert(coro_bus_try_broadcast(bus, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+	int c3 = coro_bus_channel_open(bus, 1);
+	unit_assert(coro_bus_try_broadcast_shared(bus, "c", 2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+	coro_bus_channel_close(bus, c3);
+
+	unit_msg("the messages left are released with the channels");
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, c2);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void
@@ -1603,6 +2333,92 @@ test_recv_vector_blocking_recv_many(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+enum {
+	TEST_MPMC_PAIRS = 2,
+	TEST_MPMC_COUNT = 20000,
+};
+
+struct ctx_mpmc {
+	struct coro_mpmc *q;
+	uint64_t sum;
+	bool ok;
+};
+
+static void *
+mpmc_sender_f(void *arg)
+{
+	struct ctx_mpmc *ctx = arg;
+	for (uint64_t i = 1; i <= TEST_MPMC_COUNT; ++i)
+		ctx->ok = coro_mpmc_send(ctx->q, &i) == 0 && ctx->ok;
+	return NULL;
+}
+
+static void *
+mpmc_receiver_f(void *arg)
+{
+	struct ctx_mpmc *ctx = arg;
+	uint64_t data;
+	while (coro_mpmc_recv(ctx->q, &data) == 0)
+		ctx->sum += data;
+	ctx->ok = coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL;
+	return NULL;
+}
+
+static void
+test_mpmc(void)
+{
+	unit_test_start();
+
+	unit_msg("the limit is a power of 2");
+	struct coro_mpmc *q = coro_mpmc_new(3, sizeof(uint64_t));
+	uint64_t data = 0;
+	unit_assert(coro_mpmc_try_recv(q, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	bool ok = true;
+	for (uint64_t i = 0; i < 4; ++i)
+		ok = ok && coro_mpmc_try_send(q, &i) == 0;
+	unit_assert(ok);
+	unit_assert(coro_mpmc_try_send(q, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	for (uint64_t i = 0; i < 4; ++i)
+		ok = ok && coro_mpmc_try_recv(q, &data) == 0 && data == i;
+	unit_assert(ok);
+
+	unit_msg("senders and receivers in the worker threads");
+	coro_workers_start(2 * TEST_MPMC_PAIRS);
+	struct ctx_mpmc ctxs[2 * TEST_MPMC_PAIRS];
+	struct coro *coros[2 * TEST_MPMC_PAIRS];
+	for (int i = 0; i < 2 * TEST_MPMC_PAIRS; ++i) {
+		ctxs[i].q = q;
+		ctxs[i].sum = 0;
+		ctxs[i].ok = true;
+		coros[i] = coro_new_on(i, i % 2 == 0 ? mpmc_sender_f :
+			mpmc_receiver_f, &ctxs[i], NULL);
+	}
+	for (int i = 0; i < 2 * TEST_MPMC_PAIRS; i += 2)
+		coro_join(coros[i]);
+	unit_msg("the close stops the receivers");
+	coro_mpmc_close(q);
+	uint64_t sum = 0;
+	for (int i = 0; i < 2 * TEST_MPMC_PAIRS; ++i) {
+		if (i % 2 != 0)
+			coro_join(coros[i]);
+		ok = ok && ctxs[i].ok;
+		sum += ctxs[i].sum;
+	}
+	coro_workers_stop();
+	unit_assert(ok);
+	unit_assert(sum == (uint64_t)TEST_MPMC_PAIRS * TEST_MPMC_COUNT *
+		    (TEST_MPMC_COUNT + 1) / 2);
+	unit_assert(coro_mpmc_try_send(q, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	coro_mpmc_delete(q);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -1622,11 +2438,21 @@ coro_main_f(void *arg)
 	test_stress_send_recv_concurrent();
 	test_send_recv_very_many();
 	test_wakeup_on_close();
+	test_reopen_during_wait();
+	test_direct_handoff();
+	test_typed_messages();
+	test_select();
+	test_channel_stats();
+	test_elastic_channel();
+	test_spill_channel();
+	test_prio_channel();
 	test_close_non_empty_bus();
 
 	test_broadcast_basic();
 	test_broadcast_blocking_basic();
 	test_broadcast_blocking_drop_channel_during_wait();
+	test_broadcast_wakeup_when_all_have_space();
+	test_broadcast_shared();
 
 	test_send_vector_basic();
 	test_send_vector_blocking();
@@ -1635,6 +2461,8 @@ coro_main_f(void *arg)
 	test_recv_vector_basic();
 	test_recv_vector_blocking();
 	test_recv_vector_blocking_recv_many();
+
+	test_mpmc();
 	return NULL;
 }
 
@@ -0,0 +1,352 @@
+/*
+ * Throughput of the parser on big generated scripts, in MB and in
+ * thousands of lines per second. Each tokenizer change should be
+ * judged by all of them.
+ *
+ * Long words: each line is a command with many long plain
+ * arguments. The script is fed by blocks, like the shell reads its
+ * input, and all the command lines are popped after each block.
+ * Either by small blocks, or the whole script at once, when all the
+ * lines are popped from one big buffer.
+ *
+ * Quoting: the words are in single and double quotes, with escapes
+ * and the quotes glued to the plain parts.
+ *
+ * Long pipes: each line is a pipeline of many short commands.
+ *
+ * Logic: each line is a chain of commands joined by && and ||.
+ *
+ * Random: random runs of the special characters and short words, as
+ * a fuzzer would make. Many lines are errors, they are counted as
+ * lines too.
+ *
+ * Huge line: one command with a lot of arguments, fed by 1 KB like
+ * the shell does. Most of the feeds end in the middle of the line.
+ *
+ * Repeated lines: a script of the same few lines again and again,
+ * like a generated loop, parsed with and without the cache of the
+ * given size.
+ *
+ * Bulk: the quoting script is parsed all at once by parser_bulk on
+ * the given number of threads, in chunks of 1 MB.
+ *
+ * All but 'Long words', 'Huge line', and 'Bulk' are fed by 64 KB,
+ * like a script file.
+ *
+ * Build with 'make bench'.
+ */
+#include "parser.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum {
+	BENCH_RUN_COUNT = 5,
+	BENCH_SCRIPT_SIZE = 8 * 1024 * 1024,
+	BENCH_WORD_COUNT = 20,
+	BENCH_WORD_SIZE = 40,
+	BENCH_FEED_SIZE = 64 * 1024,
+	BENCH_PIPE_SIZE = 20,
+	BENCH_LOGIC_SIZE = 20,
+	BENCH_RANDOM_LINE_SIZE = 80,
+	BENCH_HUGE_LINE_SIZE = 4 * 1024 * 1024,
+	BENCH_HUGE_LINE_FEED_SIZE = 1024,
+	BENCH_REPEAT_CACHE_SIZE = 64,
+	BENCH_BULK_CHUNK_SIZE = 1024 * 1024,
+	/** More than any generated line takes. */
+	BENCH_LINE_SIZE_MAX = 4096,
+};
+
+/** The body of a loop, which the repeated script is made of. */
+static const char *bench_repeat_lines[] = {
+	"mkdir -p \"out dir\" && cd \"out dir\" || exit 1\n",
+	"cat input.txt | grep -v '^#' | sort | uniq -c > counts.txt\n",
+	"echo \"processing item\" >> log.txt\n",
+	"gcc -O2 -Wall -Wextra -c main.c -o main.o && echo built\n",
+	"cd .. && rm -rf \"out dir\"\n",
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_double(const void *l, const void *r)
+{
+	double a = *(const double *)l;
+	double b = *(const double *)r;
+	return a < b ? -1 : a > b;
+}
+
+static void
+bench_print(const char *title, size_t param, double *times)
+{
+	qsort(times, BENCH_RUN_COUNT, sizeof(times[0]), bench_cmp_double);
+	printf("%s %zu\n", title, param);
+	printf("    min: %.2lf\n", times[0]);
+	printf("    med: %.2lf\n", times[BENCH_RUN_COUNT / 2]);
+	printf("    max: %.2lf\n", times[BENCH_RUN_COUNT - 1]);
+}
+
+struct bench_script {
+	char *data;
+	uint32_t size;
+	uint32_t line_count;
+	/** The errors are expected, and the line count isn't known. */
+	bool has_errors;
+};
+
+/**
+ * Make a script of the lines made by @a create_line, up to @a size
+ * bytes. It gets the line's number and returns its size.
+ */
+static void
+bench_script_create(struct bench_script *s, uint32_t size,
+	int (*create_line)(char *pos, uint32_t i))
+{
+	s->data = malloc(size + BENCH_LINE_SIZE_MAX);
+	s->size = 0;
+	s->line_count = 0;
+	s->has_errors = false;
+	while (s->size < size)
+		s->size += create_line(s->data + s->size, s->line_count++);
+}
+
+/** Lines of @a word_count words, up to @a size bytes. */
+static void
+bench_script_create_words(struct bench_script *s, uint32_t size,
+	int word_count)
+{
+	s->data = malloc(size + (BENCH_WORD_SIZE + 1) * word_count + 16);
+	s->size = 0;
+	s->line_count = 0;
+	s->has_errors = false;
+	while (s->size < size) {
+		s->size += sprintf(s->data + s->size, "echo");
+		for (int i = 0; i < word_count; ++i) {
+			char *pos = s->data + s->size;
+			*pos++ = ' ';
+			for (int j = 0; j < BENCH_WORD_SIZE; ++j)
+				*pos++ = 'a' + (s->line_count + i + j) % 26;
+			s->size = pos - s->data;
+		}
+		s->data[s->size++] = '\n';
+		++s->line_count;
+	}
+}
+
+static int
+bench_line_quoting(char *pos, uint32_t i)
+{
+	return sprintf(pos, "echo \"the \\\"quick\\\" brown %u\" 'fox jumps' "
+		"over\\ the \"lazy\\\\dog\" mi\"x\"'ed'\"%u\" '' \"a\\$b\" "
+		"'\"in single\"' \"'in double'\"\n", i, i % 7);
+}
+
+static int
+bench_line_pipe(char *pos, uint32_t i)
+{
+	int size = sprintf(pos, "cat file%u.txt", i % 10);
+	for (int j = 1; j < BENCH_PIPE_SIZE; ++j)
+		size += sprintf(pos + size, " | grep -v x%d", j);
+	size += sprintf(pos + size, " > out.txt\n");
+	return size;
+}
+
+static int
+bench_line_logic(char *pos, uint32_t i)
+{
+	int size = sprintf(pos, "test -f a%u", i % 10);
+	for (int j = 1; j < BENCH_LOGIC_SIZE; ++j) {
+		size += sprintf(pos + size, j % 2 == 0 ? " && echo ok%d" :
+			" || false %d", j);
+	}
+	pos[size++] = '\n';
+	return size;
+}
+
+static int
+bench_line_random(char *pos, uint32_t i)
+{
+	(void)i;
+	static const char *parts[] = {
+		"a", "word", "echo", " ", "  ", "\t", "\"", "'", "\\", "|",
+		"||", "&", "&&", ">", ">>", "#", "\n",
+	};
+	enum { PART_COUNT = sizeof(parts) / sizeof(parts[0]) };
+	int size = 0;
+	while (size < BENCH_RANDOM_LINE_SIZE) {
+		const char *part = parts[rand() % PART_COUNT];
+		int len = strlen(part);
+		memcpy(pos + size, part, len);
+		size += len;
+	}
+	pos[size++] = '\n';
+	return size;
+}
+
+static int
+bench_line_repeat(char *pos, uint32_t i)
+{
+	enum { LINE_COUNT = sizeof(bench_repeat_lines) /
+		sizeof(bench_repeat_lines[0]) };
+	return sprintf(pos, "%s", bench_repeat_lines[i % LINE_COUNT]);
+}
+
+/** Nanoseconds to parse the whole script by parser_bulk. */
+static uint64_t
+bench_parse_bulk(const struct bench_script *s, uint32_t thread_count,
+	uint32_t *line_count)
+{
+	*line_count = 0;
+	uint64_t start = bench_now_ns();
+	struct parser_bulk *b = parser_bulk_new(s->data, s->size, thread_count,
+		BENCH_BULK_CHUNK_SIZE);
+	while (true) {
+		struct command_line *line = NULL;
+		enum parser_error err = parser_bulk_pop_next(b, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			break;
+		if (err != PARSER_ERR_NONE && !s->has_errors) {
+			printf("Error: parsing failed: %d\n", (int)err);
+			exit(-1);
+		}
+		++*line_count;
+		if (line != NULL)
+			command_line_delete(line);
+	}
+	parser_bulk_delete(b);
+	return bench_now_ns() - start;
+}
+
+/** Nanoseconds to parse the whole script. */
+static uint64_t
+bench_parse(const struct bench_script *s, uint32_t feed_size,
+	uint32_t cache_size, uint32_t *line_count)
+{
+	struct parser *p = parser_new();
+	parser_set_cache_size(p, cache_size);
+	*line_count = 0;
+	uint64_t start = bench_now_ns();
+	for (uint32_t pos = 0; pos < s->size; pos += feed_size) {
+		uint32_t size = s->size - pos;
+		if (size > feed_size)
+			size = feed_size;
+		parser_feed(p, s->data + pos, size);
+		while (true) {
+			struct command_line *line = NULL;
+			enum parser_error err = parser_pop_next(p, &line);
+			if (err == PARSER_ERR_NONE && line == NULL)
+				break;
+			if (err != PARSER_ERR_NONE && !s->has_errors) {
+				printf("Error: parsing failed: %d\n", (int)err);
+				exit(-1);
+			}
+			++*line_count;
+			if (line != NULL)
+				command_line_delete(line);
+		}
+	}
+	uint64_t duration = bench_now_ns() - start;
+	parser_delete(p);
+	return duration;
+}
+
+/**
+ * Parse the script a few times and print MB/s and lines/s. With
+ * @a thread_count, the script is parsed by parser_bulk instead.
+ */
+static void
+bench_run(const char *title, const char *param_name, size_t param,
+	const struct bench_script *s, uint32_t feed_size, uint32_t cache_size,
+	uint32_t thread_count)
+{
+	double mb_per_sec[BENCH_RUN_COUNT];
+	double klines_per_sec[BENCH_RUN_COUNT];
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+		uint32_t line_count;
+		uint64_t duration = thread_count > 0 ?
+			bench_parse_bulk(s, thread_count, &line_count) :
+			bench_parse(s, feed_size, cache_size, &line_count);
+		if (!s->has_errors && line_count != s->line_count) {
+			printf("Error: parsed %u lines instead of %u\n",
+				line_count, s->line_count);
+			exit(-1);
+		}
+		mb_per_sec[run_i] = (double)s->size * 1000 / duration;
+		klines_per_sec[run_i] = (double)line_count * 1000000 / duration;
+	}
+	char name[128];
+	snprintf(name, sizeof(name), "%s, MB per second, %s", title,
+		param_name);
+	bench_print(name, param, mb_per_sec);
+	snprintf(name, sizeof(name), "%s, K lines per second, %s", title,
+		param_name);
+	bench_print(name, param, klines_per_sec);
+}
+
+int
+main(void)
+{
+	struct bench_script s;
+	bench_script_create_words(&s, BENCH_SCRIPT_SIZE, BENCH_WORD_COUNT);
+	const uint32_t feed_sizes[] = {4096, s.size};
+	for (size_t i = 0; i < sizeof(feed_sizes) / sizeof(feed_sizes[0]);
+	     ++i) {
+		bench_run("Long words", "feed size", feed_sizes[i], &s,
+			feed_sizes[i], 0, 0);
+	}
+	free(s.data);
+
+	struct {
+		const char *title;
+		int (*create_line)(char *pos, uint32_t i);
+		bool has_errors;
+	} cases[] = {
+		{"Quoting", bench_line_quoting, false},
+		{"Long pipes", bench_line_pipe, false},
+		{"Logic", bench_line_logic, false},
+		{"Random", bench_line_random, true},
+	};
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		/* The same random script in each run of the bench. */
+		srand(1);
+		bench_script_create(&s, BENCH_SCRIPT_SIZE, cases[i].create_line);
+		s.has_errors = cases[i].has_errors;
+		bench_run(cases[i].title, "feed size", BENCH_FEED_SIZE, &s,
+			BENCH_FEED_SIZE, 0, 0);
+		free(s.data);
+	}
+
+	bench_script_create(&s, BENCH_SCRIPT_SIZE, bench_line_quoting);
+	const uint32_t thread_counts[] = {1, 2, 4};
+	for (size_t i = 0; i < sizeof(thread_counts) /
+	     sizeof(thread_counts[0]); ++i) {
+		bench_run("Bulk", "threads", thread_counts[i], &s, 0, 0,
+			thread_counts[i]);
+	}
+	free(s.data);
+
+	bench_script_create_words(&s, BENCH_HUGE_LINE_SIZE,
+		BENCH_HUGE_LINE_SIZE / (BENCH_WORD_SIZE + 1));
+	bench_run("Huge line", "size", s.size, &s, BENCH_HUGE_LINE_FEED_SIZE,
+		0, 0);
+	free(s.data);
+
+	bench_script_create(&s, BENCH_SCRIPT_SIZE, bench_line_repeat);
+	const uint32_t cache_sizes[] = {0, BENCH_REPEAT_CACHE_SIZE};
+	for (size_t i = 0; i < sizeof(cache_sizes) / sizeof(cache_sizes[0]);
+	     ++i) {
+		bench_run("Repeated lines", "cache size", cache_sizes[i], &s,
+			BENCH_FEED_SIZE, cache_sizes[i], 0);
+	}
+	free(s.data);
+	return 0;
+}
@@ -0,0 +1,282 @@
+/*
+ * Cost of starting the commands of a long pipeline, with fork() and
+ * with posix_spawn().
+ *
+ * Pipeline: 'echo test | cat | ... | cat > /dev/null' of 100
+ * commands in total is executed by the shell, which has a resident
+ * heap of the given size. fork() has to copy its page tables for
+ * each command, posix_spawn() doesn't.
+ *
+ * The builtins are off there, so each 'cat' is a started program.
+ *
+ * Builtins: a script line 'true && echo test > /dev/null' is run
+ * again and again, either by the builtins in the shell itself, or by
+ * starting the programs.
+ *
+ * PATH: 'true' is started again and again with a $PATH of 20
+ * directories, and the program only in the last one. Either looked
+ * up once and then started by its full path, or by execvp() which
+ * tries to start it from each directory.
+ *
+ * Copy: 'cat FILE | cat > FILE2' and 'cat FILE > FILE2' of a file of
+ * the given size, in MB per second. The builtin cat copies with
+ * splice() and copy_file_range(), the program with read() and
+ * write().
+ *
+ * Pipe size: the same pipe copy by the programs, with the pipe of
+ * the given capacity in KB. A bigger pipe takes fewer switches
+ * between the writer and the reader.
+ *
+ * Build with 'make bench'.
+ */
+#include "parser.h"
+#include "shell.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	BENCH_RUN_COUNT = 5,
+	BENCH_PIPELINE_SIZE = 100,
+	BENCH_PIPELINE_COUNT = 5,
+	BENCH_SCRIPT_COUNT = 500,
+	BENCH_COPY_SIZE_MB = 256,
+};
+
+#define BENCH_COPY_SRC "bench_copy_src.bin"
+#define BENCH_COPY_DST "bench_copy_dst.bin"
+
+static const size_t bench_heap_sizes_mb[] = {0, 256};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_double(const void *l, const void *r)
+{
+	double a = *(const double *)l;
+	double b = *(const double *)r;
+	return a < b ? -1 : a > b;
+}
+
+static void
+bench_print(const char *title, size_t param, double *times)
+{
+	qsort(times, BENCH_RUN_COUNT, sizeof(times[0]), bench_cmp_double);
+	printf("%s %zu\n", title, param);
+	printf("    min: %.2lf\n", times[0]);
+	printf("    med: %.2lf\n", times[BENCH_RUN_COUNT / 2]);
+	printf("    max: %.2lf\n", times[BENCH_RUN_COUNT - 1]);
+}
+
+static struct command_line *
+bench_line_new(const char *str, int len)
+{
+	struct parser *p = parser_new();
+	parser_feed(p, str, len);
+	struct command_line *line = NULL;
+	if (parser_pop_next(p, &line) != PARSER_ERR_NONE || line == NULL) {
+		printf("Error: can't parse the pipeline\n");
+		exit(-1);
+	}
+	parser_delete(p);
+	return line;
+}
+
+static struct command_line *
+bench_pipeline_new(void)
+{
+	char *str = malloc(BENCH_PIPELINE_SIZE * 6 + 32);
+	int len = sprintf(str, "echo test");
+	for (int i = 1; i < BENCH_PIPELINE_SIZE; ++i)
+		len += sprintf(str + len, " | cat");
+	len += sprintf(str + len, " > /dev/null\n");
+	struct command_line *line = bench_line_new(str, len);
+	free(str);
+	return line;
+}
+
+/** Milliseconds per pipeline. */
+static double
+bench_pipeline(enum shell_spawn_mode mode, const struct command_line *line)
+{
+	struct shell sh;
+	shell_create(&sh);
+	sh.spawn_mode = mode;
+	sh.use_builtins = false;
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < BENCH_PIPELINE_COUNT; ++i) {
+		shell_execute(&sh, line);
+		if (sh.status != 0) {
+			printf("Error: the pipeline failed: %d\n", sh.status);
+			exit(-1);
+		}
+	}
+	uint64_t duration = bench_now_ns() - start;
+	shell_destroy(&sh);
+	return (double)duration / 1000000 / BENCH_PIPELINE_COUNT;
+}
+
+/** Microseconds per script line. */
+static double
+bench_script(bool use_builtins, bool use_path_cache,
+	const struct command_line *line)
+{
+	struct shell sh;
+	shell_create(&sh);
+	sh.use_builtins = use_builtins;
+	sh.use_path_cache = use_path_cache;
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < BENCH_SCRIPT_COUNT; ++i) {
+		shell_execute(&sh, line);
+		if (sh.status != 0) {
+			printf("Error: the script failed: %d\n", sh.status);
+			exit(-1);
+		}
+	}
+	uint64_t duration = bench_now_ns() - start;
+	shell_destroy(&sh);
+	return (double)duration / 1000 / BENCH_SCRIPT_COUNT;
+}
+
+static void
+bench_copy_file_create(void)
+{
+	int fd = open(BENCH_COPY_SRC, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("Error: can't create %s\n", BENCH_COPY_SRC);
+		exit(-1);
+	}
+	enum { BLOCK_SIZE = 1024 * 1024 };
+	char *block = malloc(BLOCK_SIZE);
+	for (int i = 0; i < BLOCK_SIZE; ++i)
+		block[i] = 'a' + i % 26;
+	for (int i = 0; i < BENCH_COPY_SIZE_MB; ++i) {
+		if (write(fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
+			printf("Error: can't write %s\n", BENCH_COPY_SRC);
+			exit(-1);
+		}
+	}
+	free(block);
+	close(fd);
+}
+
+/** MB per second. */
+static double
+bench_copy(bool use_builtins, uint32_t pipe_size,
+	   const struct command_line *line)
+{
+	struct shell sh;
+	shell_create(&sh);
+	sh.use_builtins = use_builtins;
+	if (shell_set_pipe_size(&sh, pipe_size) != 0) {
+		printf("Error: can't set the pipe size %u\n", pipe_size);
+		exit(-1);
+	}
+	uint64_t start = bench_now_ns();
+	shell_execute(&sh, line);
+	uint64_t duration = bench_now_ns() - start;
+	shell_destroy(&sh);
+	if (sh.status != 0) {
+		printf("Error: the copy failed: %d\n", sh.status);
+		exit(-1);
+	}
+	return BENCH_COPY_SIZE_MB * 1000000000.0 / duration;
+}
+
+int
+main(void)
+{
+	double times[BENCH_RUN_COUNT];
+	struct command_line *line = bench_pipeline_new();
+	for (size_t i = 0; i < sizeof(bench_heap_sizes_mb) /
+	     sizeof(bench_heap_sizes_mb[0]); ++i) {
+		size_t heap_size = bench_heap_sizes_mb[i] * 1024 * 1024;
+		/* Touched, so all its pages are mapped. */
+		char *heap = malloc(heap_size + 1);
+		memset(heap, 1, heap_size + 1);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			times[run_i] = bench_pipeline(SHELL_SPAWN_FORK, line);
+		bench_print("fork(), ms per pipeline, heap MB",
+			bench_heap_sizes_mb[i], times);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			times[run_i] = bench_pipeline(SHELL_SPAWN_POSIX, line);
+		bench_print("posix_spawn(), ms per pipeline, heap MB",
+			bench_heap_sizes_mb[i], times);
+		free(heap);
+	}
+	command_line_delete(line);
+	const char *script = "true && echo test > /dev/null\n";
+	line = bench_line_new(script, strlen(script));
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+		times[run_i] = bench_script(true, true, line);
+	bench_print("Builtins, us per line, on", 1, times);
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+		times[run_i] = bench_script(false, true, line);
+	bench_print("Builtins, us per line, on", 0, times);
+	command_line_delete(line);
+
+	script = "true\n";
+	line = bench_line_new(script, strlen(script));
+	char *old_path = strdup(getenv("PATH"));
+	char path[1024];
+	int len = 0;
+	for (int i = 0; i < 19; ++i)
+		len += sprintf(path + len, "/nonexistent/bench%d:", i);
+	/* Only 'true' is needed. */
+	sprintf(path + len, "/bin");
+	setenv("PATH", path, 1);
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+		times[run_i] = bench_script(false, true, line);
+	bench_print("PATH, us per command, cache on", 1, times);
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+		times[run_i] = bench_script(false, false, line);
+	bench_print("PATH, us per command, cache on", 0, times);
+	setenv("PATH", old_path, 1);
+	free(old_path);
+	command_line_delete(line);
+
+	bench_copy_file_create();
+	const char *copies[] = {
+		"cat " BENCH_COPY_SRC " | cat > " BENCH_COPY_DST "\n",
+		"cat " BENCH_COPY_SRC " > " BENCH_COPY_DST "\n",
+	};
+	const char *titles[] = {
+		"Pipe copy, MB/s, builtins on",
+		"File copy, MB/s, builtins on",
+	};
+	for (size_t i = 0; i < sizeof(copies) / sizeof(copies[0]); ++i) {
+		line = bench_line_new(copies[i], strlen(copies[i]));
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			times[run_i] = bench_copy(true, 0, line);
+		bench_print(titles[i], 1, times);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			times[run_i] = bench_copy(false, 0, line);
+		bench_print(titles[i], 0, times);
+		command_line_delete(line);
+	}
+	line = bench_line_new(copies[0], strlen(copies[0]));
+	const uint32_t pipe_sizes_kb[] = {64, 1024};
+	for (size_t i = 0; i < sizeof(pipe_sizes_kb) /
+	     sizeof(pipe_sizes_kb[0]); ++i) {
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+			times[run_i] = bench_copy(false,
+				pipe_sizes_kb[i] * 1024, line);
+		}
+		bench_print("Pipe size, MB/s, KB", pipe_sizes_kb[i], times);
+	}
+	command_line_delete(line);
+	unlink(BENCH_COPY_SRC);
+	unlink(BENCH_COPY_DST);
+	return 0;
+}
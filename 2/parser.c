@@ -2,13 +2,28 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
-struct parser {
-	char *buffer;
-	uint32_t size;
-	uint32_t capacity;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+enum parser_stage {
+	/** Commands and operators between them. */
+	PARSER_STAGE_EXPR,
+	/** The file name after an output redirect. */
+	PARSER_STAGE_OUT_FILE,
+	/** The end of the line after the output redirect. */
+	PARSER_STAGE_OUT_DONE,
+	/** The end of the line after '&'. */
+	PARSER_STAGE_BACKGROUND,
+	/** A bad line is skipped till its end. */
+	PARSER_STAGE_SKIP,
 };
 
 enum token_type {
@@ -25,47 +40,416 @@ enum token_type {
 
 struct token {
 	enum token_type type;
+	/**
+	 * The token's string. Either a slice of the parsed buffer, when
+	 * the token is contiguous in it, or the own data.
+	 */
+	const char *str;
+	uint32_t size;
+	/**
+	 * Own copy of the token. Used only when there were escapes
+	 * or line continuations, which cut the token in pieces.
+	 */
 	char *data;
+	uint32_t capacity;
+	/**
+	 * State of a not finished token. How much of the input it has
+	 * taken, whether it is in quotes or in a comment.
+	 */
+	uint32_t consumed;
+	char quote;
+	bool is_comment;
+};
+
+/**
+ * A parsed line by its text. The line is all in one chunk, so a
+ * clone is one malloc and memcpy, and the pointers are moved.
+ */
+struct parser_cache_entry {
+	/** Next entry in the same hash bucket. */
+	struct parser_cache_entry *next_in_bucket;
+	/** Neighbours in the order of use. */
+	struct parser_cache_entry *newer;
+	struct parser_cache_entry *older;
+	uint32_t hash;
+	struct command_line *line;
+	/** Size of the line's chunk. */
+	uint32_t line_size;
+	uint32_t key_size;
+	char key[];
+};
+
+/** LRU cache of the parsed lines. */
+struct parser_cache {
+	struct parser_cache_entry **buckets;
+	/** Bucket count - 1, the count is a power of 2. */
+	uint32_t bucket_mask;
 	uint32_t size;
+	/** Max size, 0 when the cache is off. */
 	uint32_t capacity;
+	struct parser_cache_entry *newest;
+	struct parser_cache_entry *oldest;
+	struct parser_cache_stat stat;
 };
 
+struct parser {
+	char *buffer;
+	/**
+	 * Offset of the first not consumed byte. The bytes before it
+	 * are not moved away right after each command line.
+	 */
+	uint32_t begin;
+	/** End of the fed data. */
+	uint32_t size;
+	uint32_t capacity;
+	/**
+	 * The state of a not finished line, kept between the feeds, so
+	 * its parsing is continued rather than started anew.
+	 */
+	struct command_line *line;
+	/** Bytes after the begin which are parsed into the line. */
+	uint32_t parsed;
+	/** What the line waits for. */
+	enum parser_stage stage;
+	/** Error of the line being skipped. */
+	enum parser_error error;
+	/** The current token, maybe not finished. */
+	struct token token;
+	/** Offset of a paused token's slice from the begin. */
+	uint32_t token_str_pos;
+	struct parser_cache cache;
+};
+
+enum {
+	/** Size of the first chunk of a command line's memory. */
+	COMMAND_LINE_CHUNK_SIZE = 1024,
+	COMMAND_LINE_ALIGN = sizeof(void *),
+	/** Default size of a chunk of a script parsed by its own thread. */
+	PARSER_BULK_CHUNK_SIZE = 1024 * 1024,
+	/** Chunks parsed ahead of the popped one, per thread. */
+	PARSER_BULK_AHEAD_PER_THREAD = 2,
+	/** Memory of the parsed lines waiting to be popped. */
+	PARSER_BULK_BLOCK_SIZE = 1024 * 1024,
+	/** A chunk is fed by pieces, so the parser's buffer stays small. */
+	PARSER_BULK_FEED_SIZE = 64 * 1024,
+};
+
+/**
+ * Piece of a command line's memory. The parts of the line are
+ * allocated one after another in it, and are never freed one by
+ * one. A typical line fits one chunk, then it is just one malloc
+ * and one free.
+ */
+struct command_line_chunk {
+	struct command_line_chunk *next;
+	uint32_t size;
+	uint32_t used;
+	char data[];
+};
+
+static struct command_line_chunk *
+command_line_chunk_new(uint32_t size, struct command_line_chunk *next)
+{
+	struct command_line_chunk *c = malloc(sizeof(*c) + size);
+	c->next = next;
+	c->size = size;
+	c->used = 0;
+	return c;
+}
+
+static inline uint32_t
+command_line_align(uint32_t size)
+{
+	return (size + COMMAND_LINE_ALIGN - 1) & ~(COMMAND_LINE_ALIGN - 1);
+}
+
+/** Allocate memory for a part of the line from its chunks. */
+static void *
+command_line_alloc(struct command_line *line, uint32_t size)
+{
+	size = command_line_align(size);
+	struct command_line_chunk *c = line->chunks;
+	if (c->size - c->used < size) {
+		uint32_t new_size = c->size * 2;
+		if (new_size < size)
+			new_size = size;
+		c = command_line_chunk_new(new_size, c);
+		line->chunks = c;
+	}
+	void *res = c->data + c->used;
+	c->used += size;
+	return res;
+}
+
+/**
+ * Create an empty line, which is the head of its own memory. The
+ * first chunk is of @a size bytes.
+ */
+static struct command_line *
+command_line_new_in(struct command_line_chunk *c)
+{
+	struct command_line *line = (struct command_line *)c->data;
+	c->used = command_line_align(sizeof(*line));
+	memset(line, 0, sizeof(*line));
+	line->chunks = c;
+	return line;
+}
+
+static struct command_line *
+command_line_new(uint32_t size)
+{
+	return command_line_new_in(command_line_chunk_new(size, NULL));
+}
+
 static char *
-token_strdup(const struct token *t)
+token_strdup(struct command_line *line, const struct token *t)
 {
 	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
+	char *res = command_line_alloc(line, t->size + 1);
+	/* Empty quotes "" give an empty string. */
+	if (t->size > 0)
+		memcpy(res, t->str, t->size);
 	res[t->size] = 0;
 	return res;
 }
 
+/** Append characters to the own copy of the token, making it if needed. */
 static void
-token_append(struct token *t, char c)
+token_append_copy(struct token *t, const char *pos, uint32_t len)
 {
-	if (t->size == t->capacity) {
-		t->capacity = (t->capacity + 1) * 2;
-		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
-	} else {
-		assert(t->size < t->capacity);
+	uint32_t new_size = t->size + len;
+	if (new_size > t->capacity) {
+		uint32_t new_capacity = t->capacity * 2;
+		if (new_capacity < new_size * 2)
+			new_capacity = new_size * 2;
+		char *new_data = malloc(sizeof(*t->data) * new_capacity);
+		if (t->size > 0)
+			memcpy(new_data, t->str, t->size);
+		free(t->data);
+		t->data = new_data;
+		t->capacity = new_capacity;
+		t->str = t->data;
+	} else if (t->str != t->data) {
+		/* The data is kept between the tokens, only refilled. */
+		if (t->size > 0)
+			memcpy(t->data, t->str, t->size);
+		t->str = t->data;
+	}
+	memcpy(t->data + t->size, pos, len);
+	t->size = new_size;
+}
+
+/**
+ * Append @a len characters at @a pos. While they go one after
+ * another in the buffer, the token just grows as a slice of it.
+ * Otherwise the token is copied into its own data.
+ */
+static inline void
+token_append(struct token *t, const char *pos, uint32_t len)
+{
+	if (t->size == 0) {
+		t->str = pos;
+		t->size = len;
+		return;
+	}
+	if (t->str + t->size == pos) {
+		t->size += len;
+		return;
+	}
+	token_append_copy(t, pos, len);
+}
+
+/**
+ * Characters which need the full state machine outside of quotes.
+ * All the others are a part of the current word as is.
+ */
+static inline bool
+token_char_is_special(char c)
+{
+	switch (c) {
+	case '\'':
+	case '"':
+	case '\\':
+	case '&':
+	case '|':
+	case '>':
+	case ' ':
+	case '\t':
+	case '\r':
+	case '\n':
+	case '#':
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * The scans below find the end of a run of plain characters 16 at a
+ * time, so the state machine runs only at the token boundaries. The
+ * tails and the platforms without SIMD go byte by byte.
+ */
+#if defined(__SSE2__)
+
+typedef __m128i token_vec;
+
+static inline token_vec
+token_vec_load(const char *pos)
+{
+	return _mm_loadu_si128((const __m128i *)pos);
+}
+
+static inline token_vec
+token_vec_eq(token_vec v, char c)
+{
+	return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+}
+
+/** Bytes not above @a c, as unsigned. */
+static inline token_vec
+token_vec_le(token_vec v, char c)
+{
+	return _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(c)), v);
+}
+
+static inline token_vec
+token_vec_or(token_vec a, token_vec b)
+{
+	return _mm_or_si128(a, b);
+}
+
+/** Offset of the first matched byte, or 16 if none. */
+static inline int
+token_vec_first(token_vec m)
+{
+	int mask = _mm_movemask_epi8(m);
+	return mask == 0 ? 16 : __builtin_ctz(mask);
+}
+
+#define TOKEN_HAVE_VEC 1
+
+#elif defined(__ARM_NEON)
+
+typedef uint8x16_t token_vec;
+
+static inline token_vec
+token_vec_load(const char *pos)
+{
+	return vld1q_u8((const uint8_t *)pos);
+}
+
+static inline token_vec
+token_vec_eq(token_vec v, char c)
+{
+	return vceqq_u8(v, vdupq_n_u8((uint8_t)c));
+}
+
+static inline token_vec
+token_vec_le(token_vec v, char c)
+{
+	return vcleq_u8(v, vdupq_n_u8((uint8_t)c));
+}
+
+static inline token_vec
+token_vec_or(token_vec a, token_vec b)
+{
+	return vorrq_u8(a, b);
+}
+
+static inline int
+token_vec_first(token_vec m)
+{
+	/* Narrow each byte of the mask to 4 bits. */
+	uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+	uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(n), 0);
+	return mask == 0 ? 16 : __builtin_ctzll(mask) / 4;
+}
+
+#define TOKEN_HAVE_VEC 1
+
+#else
+
+#define TOKEN_HAVE_VEC 0
+
+#endif
+
+/** Find the first special character outside of quotes. */
+static inline const char *
+token_scan_plain(const char *pos, const char *end)
+{
+#if TOKEN_HAVE_VEC
+	while (end - pos >= 16) {
+		token_vec v = token_vec_load(pos);
+		/*
+		 * The ones below the space are all taken, and the few which
+		 * are not special are sorted out by the exact check.
+		 */
+		token_vec m = token_vec_le(v, ' ');
+		m = token_vec_or(m, token_vec_eq(v, '"'));
+		m = token_vec_or(m, token_vec_eq(v, '#'));
+		m = token_vec_or(m, token_vec_eq(v, '&'));
+		m = token_vec_or(m, token_vec_eq(v, '\''));
+		m = token_vec_or(m, token_vec_eq(v, '>'));
+		m = token_vec_or(m, token_vec_eq(v, '\\'));
+		m = token_vec_or(m, token_vec_eq(v, '|'));
+		int i = token_vec_first(m);
+		if (i == 16) {
+			pos += 16;
+			continue;
+		}
+		pos += i;
+		if (token_char_is_special(*pos))
+			return pos;
+		++pos;
 	}
-	t->data[t->size++] = c;
+#endif
+	while (pos < end && !token_char_is_special(*pos))
+		++pos;
+	return pos;
+}
+
+/** Find the closing quote or a backslash. */
+static inline const char *
+token_scan_quoted(const char *pos, const char *end, char quote)
+{
+#if TOKEN_HAVE_VEC
+	while (end - pos >= 16) {
+		token_vec v = token_vec_load(pos);
+		token_vec m = token_vec_or(token_vec_eq(v, quote),
+			token_vec_eq(v, '\\'));
+		int i = token_vec_first(m);
+		if (i < 16)
+			return pos + i;
+		pos += 16;
+	}
+#endif
+	while (pos < end && *pos != quote && *pos != '\\')
+		++pos;
+	return pos;
 }
 
 static void
 token_reset(struct token *t)
 {
 	t->size = 0;
+	t->str = NULL;
 	t->type = TOKEN_TYPE_NONE;
+	t->consumed = 0;
+	t->quote = 0;
+	t->is_comment = false;
 }
 
 static void
-command_append_arg(struct command *cmd, char *arg)
+command_append_arg(struct command_line *line, struct command *cmd, char *arg)
 {
 	if (cmd->arg_count == cmd->arg_capacity) {
 		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+		char **args = command_line_alloc(line,
+			sizeof(*cmd->args) * cmd->arg_capacity);
+		if (cmd->arg_count > 0)
+			memcpy(args, cmd->args, sizeof(*args) * cmd->arg_count);
+		/* The old array stays in the chunk until the line is deleted. */
+		cmd->args = args;
 	} else {
 		assert(cmd->arg_count < cmd->arg_capacity);
 	}
@@ -75,20 +459,23 @@ command_append_arg(struct command *cmd, char *arg)
 void
 command_line_delete(struct command_line *line)
 {
-	while (line->head != NULL) {
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
-		}
-		line->head = e->next;
-		free(e);
+	/* The line itself is in the last chunk. */
+	struct command_line_chunk *c = line->chunks;
+	while (c != NULL) {
+		struct command_line_chunk *next = c->next;
+		free(c);
+		c = next;
 	}
-	free(line->out_file);
-	free(line);
+}
+
+/** New expression of the given type in the line's memory. */
+static struct expr *
+command_line_new_expr(struct command_line *line, enum expr_type type)
+{
+	struct expr *e = command_line_alloc(line, sizeof(*e));
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+	return e;
 }
 
 static void
@@ -111,6 +498,17 @@ void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
 	uint32_t cap = p->capacity - p->size;
+	/*
+	 * Move the not parsed data to the start only when at least as
+	 * much is consumed. Then each byte is moved at most once on
+	 * average, and the feeding is linear however big the input is.
+	 */
+	if (cap < len && p->begin > 0 && p->begin >= p->size - p->begin) {
+		memmove(p->buffer, p->buffer + p->begin, p->size - p->begin);
+		p->size -= p->begin;
+		p->begin = 0;
+		cap = p->capacity - p->size;
+	}
 	if (cap < len) {
 		uint32_t new_capacity = (p->capacity + 1) * 2;
 		if (new_capacity - p->size < len)
@@ -126,53 +524,64 @@ parser_feed(struct parser *p, const char *str, uint32_t len)
 static void
 parser_consume(struct parser *p, uint32_t size)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
+	assert(p->size - p->begin >= size);
+	p->begin += size;
+	if (p->begin == p->size) {
+		p->begin = 0;
 		p->size = 0;
-		return;
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
 }
 
+/**
+ * Parse the next token starting at @a pos, or continue the one in
+ * @a out, if it was not finished. Then @a pos is still the token's
+ * start.
+ * @retval 0 Need more data, the token's state is kept in @a out.
+ * @retval >0 Size of the token together with the whitespaces
+ *     before it.
+ */
 static uint32_t
 parse_token(const char *pos, const char *end, struct token *out)
 {
-	token_reset(out);
+	if (out->type != TOKEN_TYPE_NONE)
+		token_reset(out);
 	const char *begin = pos;
-	while (pos < end) {
-		if (!isspace(*pos))
-			break;
-		if (*pos == '\n') {
-			out->type = TOKEN_TYPE_NEW_LINE;
-			return pos + 1 - begin;
+	pos += out->consumed;
+	if (out->is_comment)
+		goto skip_comment;
+	if (out->size == 0 && out->quote == 0) {
+		while (pos < end) {
+			if (!isspace(*pos))
+				break;
+			if (*pos == '\n') {
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return pos + 1 - begin;
+			}
+			++pos;
 		}
-		++pos;
 	}
-	char quote = 0;
 	while (pos < end) {
 		char c = *pos;
 		switch(c) {
 		case '\'':
 		case '"':
-			if (quote == 0) {
-				quote = c;
+			if (out->quote == 0) {
+				out->quote = c;
 				++pos;
-				if (pos == end)
-					return 0;
 				continue;
 			}
-			if (quote != c)
+			if (out->quote != c)
 				goto append_and_next;
 			out->type = TOKEN_TYPE_STR;
 			return pos + 1 - begin;
 		case '\\':
-			if (quote == '\'')
+			if (out->quote == '\'')
 				goto append_and_next;
-			if (quote == '"') {
+			/* Need the next character to know what it escapes. */
+			if (pos + 1 == end)
+				goto need_more;
+			if (out->quote == '"') {
 				++pos;
-				if (pos == end)
-					return 0;
 				c = *pos;
 				switch (c)
 				{
@@ -186,13 +595,12 @@ parse_token(const char *pos, const char *end, struct token *out)
 				default:
 					break;
 				}
-				token_append(out, '\\');
+				/* The backslash is kept, it is right before. */
+				token_append(out, pos - 1, 1);
 				goto append_and_next;
 			}
-			assert(quote == 0);
+			assert(out->quote == 0);
 			++pos;
-			if (pos == end)
-				return 0;
 			c = *pos;
 			if (c == '\n') {
 				++pos;
@@ -202,15 +610,16 @@ parse_token(const char *pos, const char *end, struct token *out)
 		case '&':
 		case '|':
 		case '>':
-			if (quote != 0)
+			if (out->quote != 0)
 				goto append_and_next;
 			if (out->size > 0) {
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
 			}
+			/* Same, can be a single or a double operator. */
+			if (pos + 1 == end)
+				goto need_more;
 			++pos;
-			if (pos == end)
-				return 0;
 			if (*pos == c) {
 				switch(c) {
 				case '&':
@@ -247,196 +656,869 @@ parse_token(const char *pos, const char *end, struct token *out)
 		case ' ':
 		case '\t':
 		case '\r':
-			if (quote != 0)
+			if (out->quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
+			/*
+			 * Nothing is taken yet when a line continuation was
+			 * the first, then it is just a space before the token.
+			 */
+			if (out->size == 0) {
+				++pos;
+				continue;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos + 1 - begin;
 		case '\n':
-			if (quote != 0)
+			if (out->quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
+			if (out->size == 0) {
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return pos + 1 - begin;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos - begin;
 		case '#':
-			if (quote != 0)
+			if (out->quote != 0)
 				goto append_and_next;
 			if (out->size > 0) {
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
 			}
+			out->is_comment = true;
 			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
-				++pos;
-			}
-			return 0;
-		default:
-			goto append_and_next;
+			goto skip_comment;
+		default: {
+			/*
+			 * Take the whole run of the plain characters at once.
+			 * In quotes only the closing quote and a backslash
+			 * can stop it.
+			 */
+			const char *run_end;
+			if (out->quote == 0)
+				run_end = token_scan_plain(pos + 1, end);
+			else
+				run_end = token_scan_quoted(pos + 1, end, out->quote);
+			token_append(out, pos, run_end - pos);
+			pos = run_end;
+			continue;
+		}
 		}
 	append_and_next:
-		token_append(out, c);
+		token_append(out, pos, 1);
+		++pos;
+	}
+	goto need_more;
+
+skip_comment:
+	while (pos < end) {
+		if (*pos == '\n') {
+			out->type = TOKEN_TYPE_NEW_LINE;
+			return pos + 1 - begin;
+		}
 		++pos;
 	}
+
+need_more:
+	out->consumed = pos - begin;
 	return 0;
 }
 
-enum parser_error
-parser_pop_next(struct parser *p, struct command_line **out)
+/** Memory for a copy of the line all in one chunk. */
+static uint32_t
+command_line_flat_size(const struct command_line *line)
 {
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
-	const char *begin = pos;
-	char *end = pos + p->size;
-	struct token token = {0};
-	enum parser_error res = PARSER_ERR_NONE;
+	uint32_t size = command_line_align(sizeof(*line));
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		size += command_line_align(sizeof(*e));
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		const struct command *cmd = &e->cmd;
+		size += command_line_align(strlen(cmd->exe) + 1);
+		size += command_line_align(sizeof(*cmd->args) * cmd->arg_count);
+		for (uint32_t i = 0; i < cmd->arg_count; ++i)
+			size += command_line_align(strlen(cmd->args[i]) + 1);
+	}
+	if (line->out_file != NULL)
+		size += command_line_align(strlen(line->out_file) + 1);
+	return size;
+}
 
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		struct expr *e;
-		switch(token.type) {
+static char *
+command_line_strdup(struct command_line *line, const char *str)
+{
+	uint32_t size = strlen(str) + 1;
+	char *res = command_line_alloc(line, size);
+	memcpy(res, str, size);
+	return res;
+}
+
+/**
+ * Copy of the line all in the chunk @a c, which is empty and of
+ * command_line_flat_size() bytes.
+ */
+static struct command_line *
+command_line_flatten_in(const struct command_line *src,
+	struct command_line_chunk *c)
+{
+	struct command_line *line = command_line_new_in(c);
+	line->out_type = src->out_type;
+	line->is_background = src->is_background;
+	if (src->out_file != NULL)
+		line->out_file = command_line_strdup(line, src->out_file);
+	for (const struct expr *se = src->head; se != NULL; se = se->next) {
+		struct expr *e = command_line_new_expr(line, se->type);
+		command_line_append(line, e);
+		if (se->type != EXPR_TYPE_COMMAND)
+			continue;
+		const struct command *scmd = &se->cmd;
+		struct command *cmd = &e->cmd;
+		cmd->exe = command_line_strdup(line, scmd->exe);
+		if (scmd->arg_count == 0)
+			continue;
+		cmd->args = command_line_alloc(line,
+			sizeof(*cmd->args) * scmd->arg_count);
+		for (uint32_t i = 0; i < scmd->arg_count; ++i)
+			cmd->args[i] = command_line_strdup(line, scmd->args[i]);
+		cmd->arg_count = scmd->arg_count;
+		cmd->arg_capacity = scmd->arg_count;
+	}
+	assert(line->chunks == c && c->used == c->size);
+	return line;
+}
+
+/** Copy of the line all in one new chunk of @a size bytes. */
+static struct command_line *
+command_line_flatten(const struct command_line *src, uint32_t size)
+{
+	return command_line_flatten_in(src, command_line_chunk_new(size, NULL));
+}
+
+/** Copy of a line made by command_line_flatten(). */
+static struct command_line *
+command_line_clone_flat(const struct command_line *src, uint32_t size)
+{
+	struct command_line_chunk *c = command_line_chunk_new(size, NULL);
+	memcpy(c->data, src, size);
+	c->used = size;
+	struct command_line *line = (struct command_line *)c->data;
+	line->chunks = c;
+	/* All the pointers are into the chunk, at the same offsets. */
+	uintptr_t delta = (uintptr_t)line - (uintptr_t)src;
+#define MOVE_PTR(ptr) ((ptr) = (void *)((uintptr_t)(ptr) + delta))
+	MOVE_PTR(line->head);
+	MOVE_PTR(line->tail);
+	if (line->out_file != NULL)
+		MOVE_PTR(line->out_file);
+	for (struct expr *e = line->head; e != NULL; e = e->next) {
+		if (e->next != NULL)
+			MOVE_PTR(e->next);
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		struct command *cmd = &e->cmd;
+		MOVE_PTR(cmd->exe);
+		if (cmd->arg_count == 0)
+			continue;
+		MOVE_PTR(cmd->args);
+		for (uint32_t i = 0; i < cmd->arg_count; ++i)
+			MOVE_PTR(cmd->args[i]);
+	}
+#undef MOVE_PTR
+	return line;
+}
+
+static uint32_t
+parser_cache_hash(const char *str, uint32_t size)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (uint32_t i = 0; i < size; ++i) {
+		h ^= (unsigned char)str[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct parser_cache_entry *
+parser_cache_find(struct parser_cache *cache, const char *key, uint32_t size,
+	uint32_t hash)
+{
+	struct parser_cache_entry *e = cache->buckets[hash & cache->bucket_mask];
+	for (; e != NULL; e = e->next_in_bucket) {
+		if (e->hash == hash && e->key_size == size &&
+		    memcmp(e->key, key, size) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+/** Make the entry the newest one. */
+static void
+parser_cache_touch(struct parser_cache *cache, struct parser_cache_entry *e)
+{
+	if (cache->newest == e)
+		return;
+	if (e->newer != NULL)
+		e->newer->older = e->older;
+	if (e->older != NULL)
+		e->older->newer = e->newer;
+	else if (cache->oldest == e)
+		cache->oldest = e->newer;
+	e->newer = NULL;
+	e->older = cache->newest;
+	if (cache->newest != NULL)
+		cache->newest->newer = e;
+	cache->newest = e;
+	if (cache->oldest == NULL)
+		cache->oldest = e;
+}
+
+static void
+parser_cache_delete_oldest(struct parser_cache *cache)
+{
+	struct parser_cache_entry *e = cache->oldest;
+	struct parser_cache_entry **pos =
+		&cache->buckets[e->hash & cache->bucket_mask];
+	while (*pos != e)
+		pos = &(*pos)->next_in_bucket;
+	*pos = e->next_in_bucket;
+	cache->oldest = e->newer;
+	if (cache->oldest != NULL)
+		cache->oldest->older = NULL;
+	else
+		cache->newest = NULL;
+	command_line_delete(e->line);
+	free(e);
+	--cache->size;
+}
+
+/** Save the line just parsed from the start of the not consumed data. */
+static void
+parser_cache_put(struct parser *p, const struct command_line *line)
+{
+	struct parser_cache *cache = &p->cache;
+	const char *key = p->buffer + p->begin;
+	uint32_t size = p->parsed;
+	assert(size > 0 && key[size - 1] == '\n');
+	/* What is after the first new line doesn't make a key. */
+	if (memchr(key, '\n', size - 1) != NULL)
+		return;
+	++cache->stat.miss_count;
+	uint32_t hash = parser_cache_hash(key, size);
+	struct parser_cache_entry *e = parser_cache_find(cache, key, size, hash);
+	if (e != NULL) {
+		/* Was not found while its end was not fed yet. */
+		parser_cache_touch(cache, e);
+		return;
+	}
+	if (cache->size == cache->capacity)
+		parser_cache_delete_oldest(cache);
+	e = malloc(sizeof(*e) + size);
+	e->hash = hash;
+	e->line_size = command_line_flat_size(line);
+	e->line = command_line_flatten(line, e->line_size);
+	e->key_size = size;
+	memcpy(e->key, key, size);
+	struct parser_cache_entry **bucket =
+		&cache->buckets[hash & cache->bucket_mask];
+	e->next_in_bucket = *bucket;
+	*bucket = e;
+	e->newer = NULL;
+	e->older = NULL;
+	++cache->size;
+	parser_cache_touch(cache, e);
+}
+
+/**
+ * Clone the next line from the cache, if it is there and nothing of
+ * it is parsed yet.
+ */
+static bool
+parser_cache_pop(struct parser *p, struct command_line **out)
+{
+	/* A paused token with nothing consumed has no state. */
+	if (p->parsed != 0 || (p->token.type == TOKEN_TYPE_NONE &&
+	    p->token.consumed != 0))
+		return false;
+	const char *key = p->buffer + p->begin;
+	const char *end = memchr(key, '\n', p->size - p->begin);
+	if (end == NULL)
+		return false;
+	uint32_t size = end + 1 - key;
+	struct parser_cache *cache = &p->cache;
+	struct parser_cache_entry *e = parser_cache_find(cache, key, size,
+		parser_cache_hash(key, size));
+	if (e == NULL)
+		return false;
+	++cache->stat.hit_count;
+	parser_cache_touch(cache, e);
+	parser_consume(p, size);
+	*out = command_line_clone_flat(e->line, e->line_size);
+	return true;
+}
+
+static void
+parser_cache_destroy(struct parser_cache *cache)
+{
+	while (cache->size > 0)
+		parser_cache_delete_oldest(cache);
+	free(cache->buckets);
+	memset(cache, 0, sizeof(*cache));
+}
+
+/** The current line is parsed, start a new one after it. */
+static void
+parser_next_line(struct parser *p)
+{
+	parser_consume(p, p->parsed);
+	p->parsed = 0;
+	p->stage = PARSER_STAGE_EXPR;
+	if (p->line != NULL) {
+		command_line_delete(p->line);
+		p->line = NULL;
+	}
+}
+
+/** The line can't be executed, skip it till the end. */
+static enum parser_error
+parser_skip_line(struct parser *p, enum parser_error err)
+{
+	if (p->token.type == TOKEN_TYPE_NEW_LINE) {
+		parser_next_line(p);
+		return err;
+	}
+	p->stage = PARSER_STAGE_SKIP;
+	p->error = err;
+	return PARSER_ERR_NONE;
+}
+
+static enum parser_error
+parser_finish_line(struct parser *p, struct command_line **out)
+{
+	struct command_line *line = p->line;
+	if (line->tail == NULL || line->tail->type != EXPR_TYPE_COMMAND) {
+		parser_next_line(p);
+		return PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+	}
+	p->line = NULL;
+	if (p->cache.capacity > 0)
+		parser_cache_put(p, line);
+	parser_next_line(p);
+	*out = line;
+	return PARSER_ERR_NONE;
+}
+
+/**
+ * Add the next token to the current line.
+ * @retval true The line is finished, or is an error.
+ * @retval false Need more tokens.
+ */
+static bool
+parser_apply_token(struct parser *p, struct command_line **out,
+	enum parser_error *res)
+{
+	struct command_line *line = p->line;
+	struct token *token = &p->token;
+	struct expr *e;
+	*res = PARSER_ERR_NONE;
+	switch (p->stage) {
+	case PARSER_STAGE_EXPR:
+		switch(token->type) {
 		case TOKEN_TYPE_STR:
 			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
-				continue;
+				command_append_arg(line, &line->tail->cmd,
+					token_strdup(line, token));
+				return false;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
+			e = command_line_new_expr(line, EXPR_TYPE_COMMAND);
+			e->cmd.exe = token_strdup(line, token);
 			command_line_append(line, e);
-			continue;
+			return false;
 		case TOKEN_TYPE_NEW_LINE:
 			/* Skip new lines. */
-			if (line->tail == NULL)
-				continue;
-			goto close_and_return;
+			if (line->tail == NULL) {
+				parser_consume(p, p->parsed);
+				p->parsed = 0;
+				return false;
+			}
+			*res = parser_finish_line(p, out);
+			return true;
 		case TOKEN_TYPE_PIPE:
 			if (line->tail == NULL) {
-				res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
-				goto return_error;
+				*res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
+				goto skip_line;
 			}
 			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
+				*res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
+				goto skip_line;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_PIPE;
+			e = command_line_new_expr(line, EXPR_TYPE_PIPE);
 			command_line_append(line, e);
-			continue;
+			return false;
 		case TOKEN_TYPE_AND:
 			if (line->tail == NULL) {
-				res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
-				goto return_error;
+				*res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
+				goto skip_line;
 			}
 			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
+				*res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
+				goto skip_line;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_AND;
+			e = command_line_new_expr(line, EXPR_TYPE_AND);
 			command_line_append(line, e);
-			continue;
+			return false;
 		case TOKEN_TYPE_OR:
 			if (line->tail == NULL) {
-				res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-				goto return_error;
+				*res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
+				goto skip_line;
 			}
 			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
+				*res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
+				goto skip_line;
 			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_OR;
+			e = command_line_new_expr(line, EXPR_TYPE_OR);
 			command_line_append(line, e);
-			continue;
+			return false;
 		case TOKEN_TYPE_OUT_NEW:
+			line->out_type = OUTPUT_TYPE_FILE_NEW;
+			p->stage = PARSER_STAGE_OUT_FILE;
+			return false;
 		case TOKEN_TYPE_OUT_APPEND:
+			line->out_type = OUTPUT_TYPE_FILE_APPEND;
+			p->stage = PARSER_STAGE_OUT_FILE;
+			return false;
 		case TOKEN_TYPE_BACKGROUND:
-			goto close_and_return;
+			line->is_background = true;
+			p->stage = PARSER_STAGE_BACKGROUND;
+			return false;
 		default:
 			assert(false);
+			return false;
 		}
-	}
-	goto return_no_line;
-
-close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
-	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
-			line->out_type = OUTPUT_TYPE_FILE_NEW;
-		else
-			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
-			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-			goto return_error;
+	case PARSER_STAGE_OUT_FILE:
+		if (token->type != TOKEN_TYPE_STR) {
+			*res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+			goto skip_line;
 		}
-		line->out_file = token_strdup(&token);
-		used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
-		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(line->tail != NULL);
-		parser_consume(p, pos - begin);
-		if (line->tail->type != EXPR_TYPE_COMMAND) {
-			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
+		line->out_file = token_strdup(line, token);
+		p->stage = PARSER_STAGE_OUT_DONE;
+		return false;
+	case PARSER_STAGE_OUT_DONE:
+		if (token->type == TOKEN_TYPE_BACKGROUND) {
+			line->is_background = true;
+			p->stage = PARSER_STAGE_BACKGROUND;
+			return false;
 		}
-		res = PARSER_ERR_NONE;
-		*out = line;
-		goto return_final;
+		/* Fallthrough. */
+	case PARSER_STAGE_BACKGROUND:
+		if (token->type == TOKEN_TYPE_NEW_LINE) {
+			*res = parser_finish_line(p, out);
+			return true;
+		}
+		*res = PARSER_ERR_TOO_LATE_ARGUMENTS;
+		goto skip_line;
+	case PARSER_STAGE_SKIP:
+		if (token->type != TOKEN_TYPE_NEW_LINE)
+			return false;
+		*res = p->error;
+		parser_next_line(p);
+		return true;
+	default:
+		assert(false);
+		return false;
 	}
-	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
-	goto return_error;
 
-return_error:
+skip_line:
 	/*
 	 * Try to skip the whole current line. It can't be executed but can't
 	 * just crash here because of that.
 	 */
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			break;
-		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE) {
-			parser_consume(p, pos - begin);
-			goto return_no_line;
+	*res = parser_skip_line(p, *res);
+	return *res != PARSER_ERR_NONE;
+}
+
+enum parser_error
+parser_pop_next(struct parser *p, struct command_line **out)
+{
+	*out = NULL;
+	if (p->cache.capacity > 0 && parser_cache_pop(p, out))
+		return PARSER_ERR_NONE;
+	if (p->line == NULL)
+		p->line = command_line_new(COMMAND_LINE_CHUNK_SIZE);
+	struct token *token = &p->token;
+	/* The buffer could be moved since the token was paused. */
+	if (token->type == TOKEN_TYPE_NONE && token->size > 0 &&
+	    token->str != token->data)
+		token->str = p->buffer + p->begin + p->token_str_pos;
+	while (true) {
+		const char *pos = p->buffer + p->begin + p->parsed;
+		const char *end = p->buffer + p->size;
+		uint32_t used = parse_token(pos, end, token);
+		if (used == 0) {
+			if (token->size > 0 && token->str != token->data) {
+				p->token_str_pos =
+					token->str - (p->buffer + p->begin);
+			}
+			return PARSER_ERR_NONE;
 		}
+		p->parsed += used;
+		enum parser_error res;
+		if (parser_apply_token(p, out, &res))
+			return res;
 	}
-	res = PARSER_ERR_NONE;
-	goto return_no_line;
+}
 
-return_no_line:
-	command_line_delete(line);
-	*out = NULL;
+void
+parser_set_cache_size(struct parser *p, uint32_t size)
+{
+	struct parser_cache *cache = &p->cache;
+	parser_cache_destroy(cache);
+	if (size == 0)
+		return;
+	uint32_t bucket_count = 1;
+	while (bucket_count < size)
+		bucket_count <<= 1;
+	cache->buckets = calloc(bucket_count, sizeof(*cache->buckets));
+	cache->bucket_mask = bucket_count - 1;
+	cache->capacity = size;
+}
 
-return_final:
-	free(token.data);
-	return res;
+void
+parser_get_cache_stat(const struct parser *p, struct parser_cache_stat *stat)
+{
+	*stat = p->cache.stat;
 }
 
 void
 parser_delete(struct parser *p)
 {
+	parser_cache_destroy(&p->cache);
+	if (p->line != NULL)
+		command_line_delete(p->line);
+	free(p->token.data);
 	free(p->buffer);
 	free(p);
 }
+
+/**
+ * Memory of the lines of a chunk. It is not inherited by fork(). The
+ * shell forks for the builtins in the pipes, and the pages of a heap
+ * full of the parsed lines would be copied on write after each one.
+ */
+struct parser_bulk_block {
+	struct parser_bulk_block *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+/** A parsed line or an error of a chunk. */
+struct parser_bulk_result {
+	struct command_line *line;
+	/** Size of the line's chunk in a block, 0 if it is on the heap. */
+	uint32_t size;
+	enum parser_error error;
+};
+
+struct parser_bulk_chunk {
+	const char *data;
+	size_t size;
+	/** The end of the script is the end of the last line too. */
+	bool is_last;
+	bool is_done;
+	/** The lines and the errors in their order. */
+	struct parser_bulk_result *results;
+	uint32_t result_count;
+	uint32_t result_capacity;
+	/** The newest first. */
+	struct parser_bulk_block *blocks;
+	/**
+	 * The parser is kept when the chunk doesn't end at a line end.
+	 * Then the next chunk is parsed again by it.
+	 */
+	struct parser *parser;
+};
+
+struct parser_bulk {
+	struct parser_bulk_chunk *chunks;
+	uint32_t chunk_count;
+	/** The next chunk for a thread to take. */
+	uint32_t next_chunk;
+	/**
+	 * The chunk being popped, and its next result. The threads
+	 * don't go too far ahead of it, so the lines don't take all
+	 * the memory when they are executed slower than parsed.
+	 */
+	uint32_t pop_chunk;
+	uint32_t pop_result;
+	/** Max chunk count from the popped one to a parsed one. */
+	uint32_t max_ahead;
+	bool is_stopped;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	/** 0 when none could be started, then all is parsed by the popper. */
+	uint32_t thread_count;
+};
+
+/** Nothing of a next line is parsed or fed yet. */
+static bool
+parser_is_at_line_end(const struct parser *p)
+{
+	const struct token *t = &p->token;
+	/* A finished token is reset only when the next one is parsed. */
+	if (t->type == TOKEN_TYPE_NONE && (t->consumed != 0 || t->size != 0 ||
+	    t->quote != 0 || t->is_comment))
+		return false;
+	return p->begin == p->size && p->parsed == 0 &&
+	       p->stage == PARSER_STAGE_EXPR &&
+	       (p->line == NULL || p->line->head == NULL);
+}
+
+/**
+ * Move the line to the blocks of the chunk, all in one piece.
+ * @retval Size of its piece, 0 if it stays on the heap.
+ */
+static uint32_t
+parser_bulk_chunk_store(struct parser_bulk_chunk *c,
+			struct command_line **line)
+{
+	uint32_t line_size = command_line_flat_size(*line);
+	size_t size = command_line_align(sizeof(struct command_line_chunk) +
+					 line_size);
+	struct parser_bulk_block *b = c->blocks;
+	if (b == NULL || b->size - b->used < size) {
+		size_t block_size = PARSER_BULK_BLOCK_SIZE;
+		if (block_size < sizeof(*b) + size)
+			block_size = sizeof(*b) + size;
+		b = mmap(NULL, block_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (b == MAP_FAILED)
+			return 0;
+		madvise(b, block_size, MADV_DONTFORK);
+		b->next = c->blocks;
+		b->size = block_size - sizeof(*b);
+		b->used = 0;
+		c->blocks = b;
+	}
+	struct command_line_chunk *lc = (void *)(b->data + b->used);
+	b->used += size;
+	lc->next = NULL;
+	lc->size = line_size;
+	lc->used = 0;
+	struct command_line *flat = command_line_flatten_in(*line, lc);
+	command_line_delete(*line);
+	*line = flat;
+	return line_size;
+}
+
+static void
+parser_bulk_chunk_feed(struct parser_bulk_chunk *c, struct parser *p,
+		       const char *data, uint32_t size)
+{
+	parser_feed(p, data, size);
+	while (true) {
+		struct command_line *line;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			return;
+		if (c->result_count == c->result_capacity) {
+			c->result_capacity = (c->result_capacity + 1) * 2;
+			c->results = realloc(c->results, sizeof(*c->results) *
+					     c->result_capacity);
+		}
+		struct parser_bulk_result *r = &c->results[c->result_count++];
+		r->size = line != NULL ? parser_bulk_chunk_store(c, &line) : 0;
+		r->line = line;
+		r->error = err;
+	}
+}
+
+static void
+parser_bulk_chunk_parse(struct parser_bulk *b, struct parser_bulk_chunk *c,
+			struct parser *p)
+{
+	for (size_t pos = 0; pos < c->size; pos += PARSER_BULK_FEED_SIZE) {
+		if (__atomic_load_n(&b->is_stopped, __ATOMIC_RELAXED))
+			break;
+		size_t size = c->size - pos;
+		if (size > PARSER_BULK_FEED_SIZE)
+			size = PARSER_BULK_FEED_SIZE;
+		parser_bulk_chunk_feed(c, p, c->data + pos, size);
+	}
+	if (c->is_last)
+		parser_bulk_chunk_feed(c, p, "\n", 1);
+	if (parser_is_at_line_end(p)) {
+		parser_delete(p);
+		p = NULL;
+	}
+	c->parser = p;
+}
+
+/** Delete the lines not popped, and the parser. */
+static void
+parser_bulk_chunk_clear(struct parser_bulk_chunk *c)
+{
+	for (uint32_t i = 0; i < c->result_count; ++i) {
+		struct parser_bulk_result *r = &c->results[i];
+		if (r->line != NULL && r->size == 0)
+			command_line_delete(r->line);
+	}
+	while (c->blocks != NULL) {
+		struct parser_bulk_block *b = c->blocks;
+		c->blocks = b->next;
+		munmap(b, sizeof(*b) + b->size);
+	}
+	free(c->results);
+	c->results = NULL;
+	c->result_count = 0;
+	c->result_capacity = 0;
+	if (c->parser != NULL) {
+		parser_delete(c->parser);
+		c->parser = NULL;
+	}
+}
+
+static void *
+parser_bulk_worker_f(void *arg)
+{
+	struct parser_bulk *b = arg;
+	while (!__atomic_load_n(&b->is_stopped, __ATOMIC_RELAXED)) {
+		uint32_t i = __atomic_fetch_add(&b->next_chunk, 1,
+						__ATOMIC_RELAXED);
+		if (i >= b->chunk_count)
+			break;
+		pthread_mutex_lock(&b->mutex);
+		while (i >= b->pop_chunk + b->max_ahead && !b->is_stopped)
+			pthread_cond_wait(&b->cond, &b->mutex);
+		pthread_mutex_unlock(&b->mutex);
+		struct parser_bulk_chunk *c = &b->chunks[i];
+		parser_bulk_chunk_parse(b, c, parser_new());
+		pthread_mutex_lock(&b->mutex);
+		c->is_done = true;
+		pthread_cond_broadcast(&b->cond);
+		pthread_mutex_unlock(&b->mutex);
+	}
+	return NULL;
+}
+
+static void
+parser_bulk_wait(struct parser_bulk *b, struct parser_bulk_chunk *c)
+{
+	if (b->thread_count == 0) {
+		if (!c->is_done) {
+			parser_bulk_chunk_parse(b, c, parser_new());
+			c->is_done = true;
+		}
+		return;
+	}
+	pthread_mutex_lock(&b->mutex);
+	while (!c->is_done)
+		pthread_cond_wait(&b->cond, &b->mutex);
+	pthread_mutex_unlock(&b->mutex);
+}
+
+struct parser_bulk *
+parser_bulk_new(const char *data, size_t size, uint32_t thread_count,
+		uint32_t chunk_size)
+{
+	if (chunk_size == 0)
+		chunk_size = PARSER_BULK_CHUNK_SIZE;
+	struct parser_bulk *b = calloc(1, sizeof(*b));
+	/* All the chunks but the last are at least of the chunk size. */
+	b->chunks = calloc(size / chunk_size + 1, sizeof(*b->chunks));
+	size_t begin = 0;
+	while (begin < size) {
+		size_t end = begin + chunk_size;
+		while (end < size) {
+			const char *nl = memchr(data + end, '\n', size - end);
+			if (nl == NULL) {
+				end = size;
+				break;
+			}
+			end = nl + 1 - data;
+			/* Surely a continuation, not worth a try. */
+			if (nl[-1] != '\\')
+				break;
+		}
+		if (end > size)
+			end = size;
+		struct parser_bulk_chunk *c = &b->chunks[b->chunk_count++];
+		c->data = data + begin;
+		c->size = end - begin;
+		begin = end;
+	}
+	if (b->chunk_count > 0)
+		b->chunks[b->chunk_count - 1].is_last = true;
+	if (thread_count > b->chunk_count)
+		thread_count = b->chunk_count;
+	b->max_ahead = PARSER_BULK_AHEAD_PER_THREAD * thread_count;
+	pthread_mutex_init(&b->mutex, NULL);
+	pthread_cond_init(&b->cond, NULL);
+	b->threads = malloc(sizeof(*b->threads) * (thread_count + 1));
+	for (uint32_t i = 0; i < thread_count; ++i) {
+		if (pthread_create(&b->threads[i], NULL, parser_bulk_worker_f,
+				   b) != 0)
+			break;
+		++b->thread_count;
+	}
+	return b;
+}
+
+enum parser_error
+parser_bulk_pop_next(struct parser_bulk *b, struct command_line **out)
+{
+	*out = NULL;
+	while (b->pop_chunk < b->chunk_count) {
+		struct parser_bulk_chunk *c = &b->chunks[b->pop_chunk];
+		parser_bulk_wait(b, c);
+		if (b->pop_result < c->result_count) {
+			struct parser_bulk_result *r =
+				&c->results[b->pop_result++];
+			*out = r->line;
+			/* To the heap, the line can be used by a child. */
+			if (r->size != 0)
+				*out = command_line_clone_flat(r->line, r->size);
+			r->line = NULL;
+			return r->error;
+		}
+		struct parser *p = c->parser;
+		c->parser = NULL;
+		parser_bulk_chunk_clear(c);
+		pthread_mutex_lock(&b->mutex);
+		b->pop_chunk++;
+		pthread_cond_broadcast(&b->cond);
+		pthread_mutex_unlock(&b->mutex);
+		b->pop_result = 0;
+		if (p == NULL)
+			continue;
+		if (b->pop_chunk == b->chunk_count) {
+			/* The script ends inside of quotes, for example. */
+			parser_delete(p);
+			break;
+		}
+		/* The next chunk was parsed from a wrong start. */
+		struct parser_bulk_chunk *next = &b->chunks[b->pop_chunk];
+		parser_bulk_wait(b, next);
+		parser_bulk_chunk_clear(next);
+		parser_bulk_chunk_parse(b, next, p);
+	}
+	return PARSER_ERR_NONE;
+}
+
+void
+parser_bulk_delete(struct parser_bulk *b)
+{
+	pthread_mutex_lock(&b->mutex);
+	__atomic_store_n(&b->is_stopped, true, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->mutex);
+	for (uint32_t i = 0; i < b->thread_count; ++i)
+		pthread_join(b->threads[i], NULL);
+	for (uint32_t i = 0; i < b->chunk_count; ++i)
+		parser_bulk_chunk_clear(&b->chunks[i]);
+	pthread_mutex_destroy(&b->mutex);
+	pthread_cond_destroy(&b->cond);
+	free(b->threads);
+	free(b->chunks);
+	free(b);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct parser;
@@ -52,6 +53,11 @@ struct command_line {
 	/** Valid if the out type is FILE. */
 	char *out_file;
 	bool is_background;
+	/**
+	 * Memory of all the parts of the command line, including
+	 * itself. They are freed together.
+	 */
+	struct command_line_chunk *chunks;
 };
 
 void
@@ -66,5 +72,58 @@ parser_feed(struct parser *p, const char *str, uint32_t len);
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out);
 
+/**
+ * Keep up to @a size last parsed lines by their text. Then a repeated
+ * line is cloned instead of parsed again. Only the lines which are
+ * all within one line of the input are cached, not the ones with a
+ * multiline string, for example. 0 turns the cache off, as it is by
+ * default. The old entries and the stat are dropped.
+ */
+void
+parser_set_cache_size(struct parser *p, uint32_t size);
+
+struct parser_cache_stat {
+	/** Lines cloned from the cache. */
+	uint64_t hit_count;
+	/** Lines which could be cached but were parsed. */
+	uint64_t miss_count;
+};
+
+void
+parser_get_cache_stat(const struct parser *p, struct parser_cache_stat *stat);
+
 void
 parser_delete(struct parser *p);
+
+struct parser_bulk;
+
+/**
+ * Parse a whole script of @a size bytes on @a thread_count threads.
+ * The script is cut into chunks of about @a chunk_size bytes after
+ * new lines, 0 means 4 MB, and the chunks are parsed in parallel.
+ * The lines are then popped in their order in the script, the first
+ * ones while the rest are still parsed. The end of the script is the
+ * end of its last line, even with no new line.
+ *
+ * A cut can't be known to be outside of quotes or a continuation
+ * until everything before it is parsed. So each chunk is parsed as
+ * if it was, and its lines are taken only when the previous chunk
+ * ends at a line end. Otherwise the chunk is parsed again, by the
+ * parser of the previous one, in the thread which pops the lines.
+ *
+ * The data must live till the bulk is deleted.
+ */
+struct parser_bulk *
+parser_bulk_new(const char *data, size_t size, uint32_t thread_count,
+		uint32_t chunk_size);
+
+/**
+ * Pop the next line, like parser_pop_next(). Waits for its chunk to
+ * be parsed. The line is NULL when the script is over.
+ */
+enum parser_error
+parser_bulk_pop_next(struct parser_bulk *b, struct command_line **out);
+
+/** Stop the threads and delete the lines not popped. */
+void
+parser_bulk_delete(struct parser_bulk *b);
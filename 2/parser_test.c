@@ -773,6 +773,308 @@ test_background(void)
 	unit_test_finish();
 }
 
+static void
+test_long_words(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	enum { WORD_SIZE = 3000 };
+	char *word = malloc(WORD_SIZE + 1);
+	for (int i = 0; i < WORD_SIZE; ++i)
+		word[i] = 'a' + i % 26;
+	word[WORD_SIZE] = 0;
+	/*
+	 * echo <word> <word with an escaped space in the middle> "<word>"
+	 */
+	char *str = malloc(WORD_SIZE * 3 + 32);
+	int len = sprintf(str, "echo %s %.*s\\ %s \"%s\"\n", word,
+		WORD_SIZE / 2, word, word + WORD_SIZE / 2, word);
+	parser_feed(p, str, len);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct expr *e = line->head;
+	unit_check(e->type == EXPR_TYPE_COMMAND, "expr type");
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 3, "arg count");
+	unit_check(strcmp(e->cmd.args[0], word) == 0, "plain word");
+	sprintf(str, "%.*s %s", WORD_SIZE / 2, word, word + WORD_SIZE / 2);
+	unit_check(strcmp(e->cmd.args[1], str) == 0, "escaped word");
+	unit_check(strcmp(e->cmd.args[2], word) == 0, "quoted word");
+	unit_check(e->next == NULL, "no more exprs");
+	command_line_delete(line);
+
+	free(str);
+	free(word);
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_many_lines(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	enum { LINE_COUNT = 10000, FEED_SIZE = 7 };
+	char *str = malloc(LINE_COUNT * 16);
+	int len = 0;
+	for (int i = 0; i < LINE_COUNT; ++i)
+		len += sprintf(str + len, "echo %d\n", i);
+	/*
+	 * Odd feeds, so parts of a line are left in the buffer while
+	 * the parsed ones get compacted away.
+	 */
+	int line_count = 0;
+	bool ok = true;
+	for (int pos = 0; pos < len; pos += FEED_SIZE) {
+		int size = len - pos < FEED_SIZE ? len - pos : FEED_SIZE;
+		parser_feed(p, str + pos, size);
+		while (parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+		       line != NULL) {
+			char num[16];
+			sprintf(num, "%d", line_count++);
+			ok = ok && line->head->cmd.arg_count == 1 &&
+				strcmp(line->head->cmd.args[0], num) == 0;
+			command_line_delete(line);
+		}
+	}
+	unit_check(ok, "all lines are correct");
+	unit_check(line_count == LINE_COUNT, "all lines are parsed");
+
+	free(str);
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_word_boundaries(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	/*
+	 * Words of all the lengths around the block sizes of the
+	 * scanning, ended with a special character, and with a control
+	 * one inside, which is not special.
+	 */
+	char str[512];
+	char word[64];
+	bool ok = true;
+	for (int len = 1; len < 40; ++len) {
+		memset(word, 'w', len);
+		word[len] = 0;
+		int size = sprintf(str, "%s|%s\v%s \"%s\\\"\"\n", word, word,
+			word, word);
+		parser_feed(p, str, size);
+		ok = ok && parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+			line != NULL;
+		if (!ok)
+			break;
+		struct expr *e = line->head;
+		ok = ok && strcmp(e->cmd.exe, word) == 0;
+		e = e->next;
+		ok = ok && e->type == EXPR_TYPE_PIPE;
+		e = e->next;
+		sprintf(str, "%s\v%s", word, word);
+		ok = ok && strcmp(e->cmd.exe, str) == 0;
+		sprintf(str, "%s\"", word);
+		ok = ok && e->cmd.arg_count == 1 &&
+			strcmp(e->cmd.args[0], str) == 0;
+		command_line_delete(line);
+	}
+	unit_check(ok, "all words are correct");
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_empty_string(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "echo \"\" a ''\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 3, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "") == 0, "arg[0]");
+	unit_check(strcmp(e->cmd.args[1], "a") == 0, "arg[1]");
+	unit_check(strcmp(e->cmd.args[2], "") == 0, "arg[2]");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static bool
+test_lines_are_equal(const struct command_line *a,
+	const struct command_line *b)
+{
+	if (a->out_type != b->out_type || a->is_background != b->is_background)
+		return false;
+	if ((a->out_file == NULL) != (b->out_file == NULL) ||
+	    (a->out_file != NULL && strcmp(a->out_file, b->out_file) != 0))
+		return false;
+	const struct expr *ea = a->head;
+	const struct expr *eb = b->head;
+	for (; ea != NULL && eb != NULL; ea = ea->next, eb = eb->next) {
+		if (ea->type != eb->type)
+			return false;
+		if (ea->type != EXPR_TYPE_COMMAND)
+			continue;
+		if (strcmp(ea->cmd.exe, eb->cmd.exe) != 0 ||
+		    ea->cmd.arg_count != eb->cmd.arg_count)
+			return false;
+		for (uint32_t i = 0; i < ea->cmd.arg_count; ++i) {
+			if (strcmp(ea->cmd.args[i], eb->cmd.args[i]) != 0)
+				return false;
+		}
+	}
+	return ea == NULL && eb == NULL && (a->tail == NULL ||
+		a->tail->next == NULL);
+}
+
+static void
+test_continuation_before_word(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	/* A line continuation is a space, when a word starts with it. */
+	const char *str = "echo a \\\n b\\\n\tc \\\n\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line != NULL, "has line");
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 3, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "a") == 0, "arg[0]");
+	unit_check(strcmp(e->cmd.args[1], "b") == 0, "arg[1]");
+	unit_check(strcmp(e->cmd.args[2], "c") == 0, "arg[2]");
+	command_line_delete(line);
+
+	/* Or it is an empty line. */
+	str = "\\\n\necho d\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line != NULL, "has line");
+	unit_check(strcmp(line->head->cmd.exe, "echo") == 0, "exe");
+	unit_check(line->head->cmd.arg_count == 1, "arg count");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+/**
+ * Feed the same data to both parsers by @a feed_size and check they
+ * give the same. @a count is increased by the number of lines.
+ */
+static bool
+test_cache_feed(struct parser *p, struct parser *ref, const char *str,
+	int len, int feed_size, int *count)
+{
+	struct command_line *line = NULL;
+	struct command_line *ref_line = NULL;
+	bool ok = true;
+	for (int pos = 0; pos < len; pos += feed_size) {
+		int size = len - pos < feed_size ? len - pos : feed_size;
+		parser_feed(p, str + pos, size);
+		parser_feed(ref, str + pos, size);
+		while (true) {
+			enum parser_error err = parser_pop_next(p, &line);
+			enum parser_error ref_err = parser_pop_next(ref,
+				&ref_line);
+			ok = ok && err == ref_err && (line == NULL) ==
+				(ref_line == NULL);
+			if (line != NULL && ref_line != NULL) {
+				ok = ok && test_lines_are_equal(line, ref_line);
+				++*count;
+			}
+			if (line != NULL)
+				command_line_delete(line);
+			if (ref_line != NULL)
+				command_line_delete(ref_line);
+			if (err == PARSER_ERR_NONE && line == NULL)
+				break;
+		}
+	}
+	return ok;
+}
+
+static void
+test_cache(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct parser *ref = parser_new();
+	struct command_line *line = NULL;
+	struct parser_cache_stat stat;
+
+	/*
+	 * The same lines parsed with and without the cache must be the
+	 * same. With the bad ones, and those which are not within one
+	 * line of the input. Fed by odd pieces, when a line is mostly
+	 * parsed before its end comes, and all at once, when the cache
+	 * is used.
+	 */
+	const char *lines[] = {
+		"echo a b c\n",
+		"  ls -l | grep x && echo \"1 2\" || false > out &\n",
+		"echo a b c\n",
+		"cat file >> log # comment\n",
+		"\n",
+		"# only a comment\n",
+		"echo \"multi\nline\"\n",
+		"echo con\\\ntinued\n",
+		"| bad\n",
+		"echo a b c\n",
+		"echo > \n",
+		"sleep 1 &\n",
+	};
+	enum { LINE_COUNT = sizeof(lines) / sizeof(lines[0]) };
+	parser_set_cache_size(p, 8);
+	char str[4096];
+	int len = 0;
+	for (int i = 0; i < 50; ++i)
+		len += sprintf(str + len, "%s", lines[(i * 7) % LINE_COUNT]);
+	int count = 0;
+	unit_check(test_cache_feed(p, ref, str, len, 5, &count),
+		"the same as without the cache, by pieces");
+	unit_check(test_cache_feed(p, ref, str, len, len, &count),
+		"the same as without the cache, at once");
+	parser_get_cache_stat(p, &stat);
+	unit_check(stat.hit_count > 0, "there are hits");
+	unit_check(stat.hit_count + stat.miss_count < (uint64_t)count,
+		"multiline lines are not cached");
+
+	/* The least recently used line is evicted. */
+	parser_set_cache_size(p, 2);
+	const char *str2 = "a\nb\na\nc\nb\na\n";
+	parser_feed(p, str2, strlen(str2));
+	count = 0;
+	while (parser_pop_next(p, &line) == PARSER_ERR_NONE && line != NULL) {
+		++count;
+		command_line_delete(line);
+	}
+	unit_check(count == 6, "all lines are parsed");
+	parser_get_cache_stat(p, &stat);
+	unit_check(stat.hit_count == 1, "hit count");
+	unit_check(stat.miss_count == 5, "miss count");
+
+	parser_delete(ref);
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_error_one(struct parser *p, const char *expr, enum parser_error err)
 {
@@ -819,6 +1121,110 @@ test_errors(void)
 	unit_test_finish();
 }
 
+/** Print the line or the error to @a buf, to compare the results. */
+static int
+test_bulk_print(char *buf, enum parser_error err,
+	const struct command_line *line)
+{
+	if (err != PARSER_ERR_NONE)
+		return sprintf(buf, "error %d\n", (int)err);
+	int size = 0;
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		if (e->type != EXPR_TYPE_COMMAND) {
+			size += sprintf(buf + size, "op %d ", (int)e->type);
+			continue;
+		}
+		size += sprintf(buf + size, "[%s]", e->cmd.exe);
+		for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
+			size += sprintf(buf + size, "[%s]", e->cmd.args[i]);
+		buf[size++] = ' ';
+	}
+	size += sprintf(buf + size, "out %d %s bg %d\n", (int)line->out_type,
+		line->out_file != NULL ? line->out_file : "-",
+		(int)line->is_background);
+	return size;
+}
+
+static void
+test_bulk(void)
+{
+	unit_test_start();
+	/*
+	 * Quotes, continuations and comments across the new lines make
+	 * many chunks start at a wrong place.
+	 */
+	const char *script =
+		"echo 1\n"
+		"echo \"multi\nline\n'string\" | cat > out.txt\n"
+		"# comment with a 'quote\n"
+		"echo a\\\n"
+		"b && false || echo 'x\n\ny' &\n"
+		"| bad\n"
+		"\n\n"
+		"echo \"\\\"\n\\\\\" 'z'\n"
+		"echo 2 >> 'f\ng' # tail\n"
+		"exe &&\n"
+		"last line";
+	uint32_t len = strlen(script);
+	char expected[4096];
+	int expected_size = 0;
+	struct parser *p = parser_new();
+	parser_feed(p, script, len);
+	parser_feed(p, "\n", 1);
+	while (true) {
+		struct command_line *line;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			break;
+		expected_size += test_bulk_print(expected + expected_size, err,
+			line);
+		if (line != NULL)
+			command_line_delete(line);
+	}
+	parser_delete(p);
+
+	bool is_ok = true;
+	for (uint32_t threads = 0; threads <= 4; ++threads) {
+		for (uint32_t chunk = 1; chunk <= len; ++chunk) {
+			struct parser_bulk *b = parser_bulk_new(script, len,
+				threads, chunk);
+			char got[4096];
+			int got_size = 0;
+			while (true) {
+				struct command_line *line;
+				enum parser_error err =
+					parser_bulk_pop_next(b, &line);
+				if (err == PARSER_ERR_NONE && line == NULL)
+					break;
+				got_size += test_bulk_print(got + got_size, err,
+					line);
+				if (line != NULL)
+					command_line_delete(line);
+			}
+			parser_bulk_delete(b);
+			if (got_size != expected_size ||
+			    memcmp(got, expected, got_size) != 0)
+				is_ok = false;
+		}
+	}
+	unit_check(is_ok, "same lines by any threads and chunks");
+
+	unit_msg("Stop in the middle");
+	struct parser_bulk *b = parser_bulk_new(script, len, 2, 8);
+	struct command_line *line;
+	unit_check(parser_bulk_pop_next(b, &line) == PARSER_ERR_NONE &&
+		line != NULL, "first line");
+	command_line_delete(line);
+	parser_bulk_delete(b);
+
+	b = parser_bulk_new("", 0, 2, 0);
+	unit_check(parser_bulk_pop_next(b, &line) == PARSER_ERR_NONE &&
+		line == NULL, "empty script");
+	parser_bulk_delete(b);
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -833,6 +1239,13 @@ main(void)
 	test_multiline_string();
 	test_logical_operators();
 	test_background();
+	test_long_words();
+	test_many_lines();
+	test_word_boundaries();
+	test_empty_string();
+	test_continuation_before_word();
+	test_cache();
 	test_errors();
+	test_bulk();
 	return 0;
 }
@@ -0,0 +1,1343 @@
+/* splice() and copy_file_range(). */
+#define _GNU_SOURCE
+#include "shell.h"
+
+#include "parser.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+enum {
+	/**
+	 * Done jobs never reported by 'jobs' or 'wait' are forgotten,
+	 * when there are more. Like bash remembers only some of them.
+	 */
+	SHELL_DONE_JOB_MAX = 1024,
+};
+
+/** SIGCHLD has come, so there can be a job to reap. */
+static volatile sig_atomic_t shell_is_child_done = 0;
+
+static void
+shell_on_sigchld(int signo)
+{
+	(void)signo;
+	shell_is_child_done = 1;
+}
+
+void
+shell_create(struct shell *sh)
+{
+	sh->spawn_mode = SHELL_SPAWN_POSIX;
+	sh->use_builtins = true;
+	sh->status = 0;
+	sh->is_exit = false;
+	sh->jobs = NULL;
+	sh->job_count = 0;
+	sh->job_capacity = 0;
+	sh->running_job_count = 0;
+	sh->max_jobs = 0;
+	sh->use_path_cache = true;
+	sh->path_buckets = NULL;
+	sh->path_bucket_mask = 0;
+	sh->path_count = 0;
+	sh->path_env = NULL;
+	sh->pipe_size = 0;
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = shell_on_sigchld;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+}
+
+/** A program found in $PATH. */
+struct shell_path_entry {
+	/** Next entry in the same hash bucket. */
+	struct shell_path_entry *next_in_bucket;
+	uint32_t hash;
+	/** Full path of the program. */
+	char *path;
+	/** The command name. */
+	char name[];
+};
+
+static uint32_t
+shell_path_hash(const char *name)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (; *name != 0; ++name) {
+		h ^= (unsigned char)*name;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void
+shell_path_clear(struct shell *sh)
+{
+	for (uint32_t i = 0; sh->path_count > 0; ++i) {
+		struct shell_path_entry *e = sh->path_buckets[i];
+		while (e != NULL) {
+			struct shell_path_entry *next = e->next_in_bucket;
+			free(e->path);
+			free(e);
+			--sh->path_count;
+			e = next;
+		}
+		sh->path_buckets[i] = NULL;
+	}
+}
+
+static void
+shell_path_add(struct shell *sh, const char *name, uint32_t hash,
+	char *path)
+{
+	if (sh->path_count >= (sh->path_bucket_mask + 1) / 2) {
+		uint32_t count = sh->path_buckets == NULL ? 64 :
+			(sh->path_bucket_mask + 1) * 2;
+		struct shell_path_entry **buckets =
+			calloc(count, sizeof(*buckets));
+		for (uint32_t i = 0; sh->path_buckets != NULL &&
+		     i <= sh->path_bucket_mask; ++i) {
+			struct shell_path_entry *e = sh->path_buckets[i];
+			while (e != NULL) {
+				struct shell_path_entry *next =
+					e->next_in_bucket;
+				struct shell_path_entry **bucket =
+					&buckets[e->hash & (count - 1)];
+				e->next_in_bucket = *bucket;
+				*bucket = e;
+				e = next;
+			}
+		}
+		free(sh->path_buckets);
+		sh->path_buckets = buckets;
+		sh->path_bucket_mask = count - 1;
+	}
+	size_t name_size = strlen(name) + 1;
+	struct shell_path_entry *e = malloc(sizeof(*e) + name_size);
+	e->hash = hash;
+	e->path = path;
+	memcpy(e->name, name, name_size);
+	struct shell_path_entry **bucket =
+		&sh->path_buckets[hash & sh->path_bucket_mask];
+	e->next_in_bucket = *bucket;
+	*bucket = e;
+	++sh->path_count;
+}
+
+/**
+ * Find the program like execvp() would, but without trying to start
+ * it from each directory. Only in the absolute directories, a found
+ * relative path would change with 'cd'. NULL if not found, malloc'ed
+ * otherwise.
+ */
+static char *
+shell_path_search(const char *env, const char *name)
+{
+	size_t name_size = strlen(name);
+	while (*env != 0) {
+		size_t dir_size = strcspn(env, ":");
+		if (env[0] != '/')
+			return NULL;
+		char *path = malloc(dir_size + name_size + 2);
+		memcpy(path, env, dir_size);
+		path[dir_size] = '/';
+		memcpy(path + dir_size + 1, name, name_size + 1);
+		struct stat st;
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+		    access(path, X_OK) == 0)
+			return path;
+		free(path);
+		env += dir_size;
+		if (*env == ':')
+			++env;
+	}
+	return NULL;
+}
+
+/**
+ * Full path of the command's program, from the cache or found in
+ * $PATH. NULL when the command has a '/', when it is not found, or
+ * the cache is off. Then it is up to execvp().
+ */
+static const char *
+shell_path_find(struct shell *sh, const char *name)
+{
+	if (!sh->use_path_cache || *name == 0 || strchr(name, '/') != NULL)
+		return NULL;
+	const char *env = getenv("PATH");
+	if (env == NULL)
+		return NULL;
+	if (sh->path_env == NULL || strcmp(sh->path_env, env) != 0) {
+		shell_path_clear(sh);
+		free(sh->path_env);
+		sh->path_env = strdup(env);
+	}
+	uint32_t hash = shell_path_hash(name);
+	if (sh->path_count > 0) {
+		struct shell_path_entry *e =
+			sh->path_buckets[hash & sh->path_bucket_mask];
+		for (; e != NULL; e = e->next_in_bucket) {
+			if (e->hash == hash && strcmp(e->name, name) == 0)
+				return e->path;
+		}
+	}
+	char *path = shell_path_search(env, name);
+	if (path != NULL)
+		shell_path_add(sh, name, hash, path);
+	return path;
+}
+
+/** The program of the command is not where it was found. */
+static void
+shell_path_forget(struct shell *sh, const char *name)
+{
+	if (sh->path_count == 0)
+		return;
+	uint32_t hash = shell_path_hash(name);
+	struct shell_path_entry **pos =
+		&sh->path_buckets[hash & sh->path_bucket_mask];
+	for (; *pos != NULL; pos = &(*pos)->next_in_bucket) {
+		struct shell_path_entry *e = *pos;
+		if (e->hash == hash && strcmp(e->name, name) == 0) {
+			*pos = e->next_in_bucket;
+			free(e->path);
+			free(e);
+			--sh->path_count;
+			return;
+		}
+	}
+}
+
+void
+shell_destroy(struct shell *sh)
+{
+	for (uint32_t i = 0; i < sh->job_count; ++i)
+		free(sh->jobs[i].text);
+	free(sh->jobs);
+	shell_path_clear(sh);
+	free(sh->path_buckets);
+	free(sh->path_env);
+}
+
+static int
+shell_status_from_wait(int wstatus)
+{
+	if (WIFEXITED(wstatus))
+		return WEXITSTATUS(wstatus);
+	if (WIFSIGNALED(wstatus))
+		return 128 + WTERMSIG(wstatus);
+	return 1;
+}
+
+/** A word of the job's text, quoted if it has special characters. */
+static void
+shell_text_word(FILE *f, const char *word)
+{
+	if (*word != 0 && word[strcspn(word, " \t\n'\"\\&|>#")] == 0) {
+		fputs(word, f);
+		return;
+	}
+	fputc('"', f);
+	for (; *word != 0; ++word) {
+		if (*word == '"' || *word == '\\')
+			fputc('\\', f);
+		fputc(*word, f);
+	}
+	fputc('"', f);
+}
+
+/** The command line as text, close to how it was typed. */
+static char *
+shell_line_text(const struct command_line *line)
+{
+	char *text = NULL;
+	size_t size = 0;
+	FILE *f = open_memstream(&text, &size);
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		switch (e->type) {
+		case EXPR_TYPE_COMMAND:
+			shell_text_word(f, e->cmd.exe);
+			for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
+				fputc(' ', f);
+				shell_text_word(f, e->cmd.args[i]);
+			}
+			break;
+		case EXPR_TYPE_PIPE:
+			fputs(" | ", f);
+			break;
+		case EXPR_TYPE_AND:
+			fputs(" && ", f);
+			break;
+		case EXPR_TYPE_OR:
+			fputs(" || ", f);
+			break;
+		}
+	}
+	if (line->out_type != OUTPUT_TYPE_STDOUT) {
+		fputs(line->out_type == OUTPUT_TYPE_FILE_NEW ? " > " : " >> ",
+			f);
+		shell_text_word(f, line->out_file);
+	}
+	fputs(" &", f);
+	fclose(f);
+	return text;
+}
+
+/** Remove the job from the table. */
+static void
+shell_job_delete(struct shell *sh, struct shell_job *job)
+{
+	assert(job->is_done);
+	free(job->text);
+	uint32_t i = job - sh->jobs;
+	memmove(job, job + 1, sizeof(*job) * (sh->job_count - i - 1));
+	--sh->job_count;
+}
+
+static void
+shell_job_add(struct shell *sh, pid_t pid, char *text)
+{
+	if (sh->job_count - sh->running_job_count >= SHELL_DONE_JOB_MAX) {
+		struct shell_job *job = sh->jobs;
+		while (!job->is_done)
+			++job;
+		shell_job_delete(sh, job);
+	}
+	if (sh->job_count == sh->job_capacity) {
+		sh->job_capacity = sh->job_capacity == 0 ? 16 :
+			sh->job_capacity * 2;
+		sh->jobs = realloc(sh->jobs,
+			sizeof(*sh->jobs) * sh->job_capacity);
+	}
+	struct shell_job *job = &sh->jobs[sh->job_count];
+	/* The ids are reused when the last jobs are forgotten, like bash. */
+	job->id = sh->job_count == 0 ? 1 : job[-1].id + 1;
+	job->pid = pid;
+	job->text = text;
+	job->is_done = false;
+	job->wstatus = 0;
+	++sh->job_count;
+	++sh->running_job_count;
+}
+
+/** The running job of the given process. */
+static struct shell_job *
+shell_job_by_pid(struct shell *sh, pid_t pid)
+{
+	for (uint32_t i = 0; i < sh->job_count; ++i) {
+		struct shell_job *job = &sh->jobs[i];
+		if (!job->is_done && job->pid == pid)
+			return job;
+	}
+	return NULL;
+}
+
+static void
+shell_job_end(struct shell *sh, struct shell_job *job, int wstatus)
+{
+	assert(!job->is_done);
+	job->is_done = true;
+	job->wstatus = wstatus;
+	--sh->running_job_count;
+}
+
+/** Wait for the job, unless it is already done. */
+static void
+shell_job_wait(struct shell *sh, struct shell_job *job)
+{
+	while (!job->is_done) {
+		int wstatus;
+		if (waitpid(job->pid, &wstatus, 0) == job->pid)
+			shell_job_end(sh, job, wstatus);
+		else if (errno != EINTR)
+			shell_job_end(sh, job, W_EXITCODE(127, 0));
+	}
+}
+
+/** Wait till any of the running jobs is done. */
+static void
+shell_job_wait_any(struct shell *sh)
+{
+	int wstatus;
+	pid_t pid = waitpid(-1, &wstatus, 0);
+	if (pid > 0) {
+		struct shell_job *job = shell_job_by_pid(sh, pid);
+		if (job != NULL)
+			shell_job_end(sh, job, wstatus);
+		return;
+	}
+	if (errno != ECHILD)
+		return;
+	/* Can't be, but the shell must not hang then. */
+	for (uint32_t i = 0; i < sh->job_count; ++i) {
+		if (!sh->jobs[i].is_done)
+			shell_job_end(sh, &sh->jobs[i], W_EXITCODE(127, 0));
+	}
+}
+
+/**
+ * Make a pipe which is not inherited by the started commands. Only
+ * the ends moved to their stdin and stdout are.
+ */
+static void
+shell_pipe(const struct shell *sh, int fds[2])
+{
+	if (pipe(fds) != 0) {
+		printf("Error: pipe() failed: %s\n", strerror(errno));
+		exit(-1);
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	/* Checked by shell_set_pipe_size(), can only fail on no memory. */
+	if (sh->pipe_size != 0)
+		fcntl(fds[1], F_SETPIPE_SZ, (int)sh->pipe_size);
+}
+
+int
+shell_set_pipe_size(struct shell *sh, uint32_t size)
+{
+	if (size != 0) {
+		int fds[2];
+		if (pipe(fds) != 0)
+			return -1;
+		int rc = fcntl(fds[1], F_SETPIPE_SZ, (int)size);
+		int err = errno;
+		close(fds[0]);
+		close(fds[1]);
+		if (rc < 0) {
+			errno = err;
+			return -1;
+		}
+	}
+	sh->pipe_size = size;
+	return 0;
+}
+
+/** Arguments for exec: the name, the arguments, and NULL. */
+static char **
+command_argv(const struct command *cmd)
+{
+	char **argv = malloc(sizeof(*argv) * (cmd->arg_count + 2));
+	argv[0] = cmd->exe;
+	if (cmd->arg_count > 0)
+		memcpy(&argv[1], cmd->args, sizeof(*argv) * cmd->arg_count);
+	argv[cmd->arg_count + 1] = NULL;
+	return argv;
+}
+
+static void
+shell_write_fd(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t rc = write(fd, data, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		data += rc;
+		size -= rc;
+	}
+}
+
+/**
+ * Builtins' output. To stdout it goes via the stdio buffer, so in a
+ * script many echo lines become one write. The buffer is flushed
+ * before any command is started, which keeps the order.
+ */
+static void
+shell_write_all(int fd, const char *data, size_t size)
+{
+	if (fd == STDOUT_FILENO) {
+		fwrite(data, 1, size, stdout);
+		return;
+	}
+	shell_write_fd(fd, data, size);
+}
+
+static int
+shell_builtin_cd(struct shell *sh, const struct command *cmd, int out)
+{
+	(void)sh;
+	(void)out;
+	const char *path = cmd->arg_count > 0 ? cmd->args[0] : getenv("HOME");
+	if (path == NULL) {
+		fprintf(stderr, "cd: HOME not set\n");
+		return 1;
+	}
+	if (chdir(path) != 0) {
+		fprintf(stderr, "cd: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * 'exit' ends the shell only when it is run by the shell itself, not
+ * in a child.
+ */
+static int
+shell_builtin_exit(struct shell *sh, const struct command *cmd, int out)
+{
+	(void)out;
+	int status = sh->status;
+	if (cmd->arg_count > 0)
+		status = (int)(strtol(cmd->args[0], NULL, 10) & 0xff);
+	sh->is_exit = true;
+	return status;
+}
+
+static int
+shell_builtin_true(struct shell *sh, const struct command *cmd, int out)
+{
+	(void)sh;
+	(void)cmd;
+	(void)out;
+	return 0;
+}
+
+static int
+shell_builtin_false(struct shell *sh, const struct command *cmd, int out)
+{
+	(void)sh;
+	(void)cmd;
+	(void)out;
+	return 1;
+}
+
+/**
+ * Append the escape sequence at @a pos of echo -e to @a buf.
+ * @return Position after the sequence, or NULL for '\c', which
+ *     stops the output.
+ */
+static const char *
+shell_echo_escape(const char *pos, char *buf, size_t *size)
+{
+	assert(*pos == '\\');
+	char c = *++pos;
+	int base = 0;
+	int max_digits = 0;
+	switch (c) {
+	case 'a': c = '\a'; break;
+	case 'b': c = '\b'; break;
+	case 'e': c = 27; break;
+	case 'f': c = '\f'; break;
+	case 'n': c = '\n'; break;
+	case 'r': c = '\r'; break;
+	case 't': c = '\t'; break;
+	case 'v': c = '\v'; break;
+	case '\\': break;
+	case 'c': return NULL;
+	case '0': base = 8; max_digits = 3; break;
+	case 'x': base = 16; max_digits = 2; break;
+	default:
+		/* Not an escape, printed as is. */
+		buf[(*size)++] = '\\';
+		if (c == 0)
+			return pos;
+		break;
+	}
+	++pos;
+	if (base == 0) {
+		buf[(*size)++] = c;
+		return pos;
+	}
+	int value = 0;
+	int digits = 0;
+	for (; digits < max_digits; ++digits, ++pos) {
+		int d;
+		if (*pos >= '0' && *pos <= '7')
+			d = *pos - '0';
+		else if (base == 16 && *pos >= 'a' && *pos <= 'f')
+			d = *pos - 'a' + 10;
+		else if (base == 16 && *pos >= 'A' && *pos <= 'F')
+			d = *pos - 'A' + 10;
+		else if (base == 16 && (*pos == '8' || *pos == '9'))
+			d = *pos - '0';
+		else
+			break;
+		value = value * base + d;
+	}
+	if (base == 16 && digits == 0) {
+		buf[(*size)++] = '\\';
+		buf[(*size)++] = 'x';
+		return pos;
+	}
+	buf[(*size)++] = (char)value;
+	return pos;
+}
+
+/** echo with the bash options -n, -e and -E. */
+static int
+shell_builtin_echo(struct shell *sh, const struct command *cmd, int out)
+{
+	(void)sh;
+	bool is_newline = true;
+	bool is_escape = false;
+	uint32_t i = 0;
+	for (; i < cmd->arg_count; ++i) {
+		const char *arg = cmd->args[i];
+		if (arg[0] != '-' || arg[1] == 0 ||
+		    arg[strspn(arg + 1, "neE") + 1] != 0)
+			break;
+		for (++arg; *arg != 0; ++arg) {
+			if (*arg == 'n')
+				is_newline = false;
+			else
+				is_escape = *arg == 'e';
+		}
+	}
+	/* The escapes only make the output shorter. */
+	size_t cap = 1;
+	for (uint32_t j = i; j < cmd->arg_count; ++j)
+		cap += strlen(cmd->args[j]) + 1;
+	char *buf = malloc(cap);
+	size_t size = 0;
+	for (; i < cmd->arg_count; ++i) {
+		const char *pos = cmd->args[i];
+		while (*pos != 0) {
+			if (!is_escape || *pos != '\\') {
+				buf[size++] = *pos++;
+				continue;
+			}
+			pos = shell_echo_escape(pos, buf, &size);
+			if (pos == NULL)
+				goto write;
+		}
+		if (i + 1 < cmd->arg_count)
+			buf[size++] = ' ';
+	}
+	if (is_newline)
+		buf[size++] = '\n';
+write:
+	shell_write_all(out, buf, size);
+	free(buf);
+	return 0;
+}
+
+/** State of the job, as 'jobs' in bash prints it. */
+static void
+shell_job_state(const struct shell_job *job, char *buf, size_t size)
+{
+	if (!job->is_done)
+		snprintf(buf, size, "Running");
+	else if (WIFSIGNALED(job->wstatus))
+		snprintf(buf, size, "%s", strsignal(WTERMSIG(job->wstatus)));
+	else if (WEXITSTATUS(job->wstatus) != 0)
+		snprintf(buf, size, "Exit %d", WEXITSTATUS(job->wstatus));
+	else
+		snprintf(buf, size, "Done");
+}
+
+/** List the jobs. The done ones are forgotten after that. */
+static int
+shell_builtin_jobs(struct shell *sh, const struct command *cmd, int out)
+{
+	(void)cmd;
+	shell_reap(sh);
+	char *text = NULL;
+	size_t size = 0;
+	FILE *f = open_memstream(&text, &size);
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < sh->job_count; ++i) {
+		struct shell_job *job = &sh->jobs[i];
+		char state[64];
+		shell_job_state(job, state, sizeof(state));
+		fprintf(f, "[%d]  %-24s%s\n", job->id, state, job->text);
+		if (job->is_done)
+			free(job->text);
+		else
+			sh->jobs[count++] = *job;
+	}
+	sh->job_count = count;
+	fclose(f);
+	shell_write_all(out, text, size);
+	free(text);
+	return 0;
+}
+
+/** The job by its '%id' or pid. */
+static struct shell_job *
+shell_job_find(struct shell *sh, const char *arg)
+{
+	bool is_id = arg[0] == '%';
+	char *end;
+	long value = strtol(arg + is_id, &end, 10);
+	if (*end != 0 || end == arg + is_id)
+		return NULL;
+	/* A pid of a done job can be reused by a newer one. */
+	for (uint32_t i = sh->job_count; i > 0; --i) {
+		struct shell_job *job = &sh->jobs[i - 1];
+		if (is_id ? job->id == value : job->pid == value)
+			return job;
+	}
+	return NULL;
+}
+
+/**
+ * Wait for the given jobs, or for all. The status is the one of the
+ * last given job, like in bash.
+ */
+static int
+shell_builtin_wait(struct shell *sh, const struct command *cmd, int out)
+{
+	(void)out;
+	if (cmd->arg_count == 0) {
+		for (uint32_t i = 0; i < sh->job_count; ++i) {
+			shell_job_wait(sh, &sh->jobs[i]);
+			free(sh->jobs[i].text);
+		}
+		sh->job_count = 0;
+		return 0;
+	}
+	int status = 0;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		const char *arg = cmd->args[i];
+		struct shell_job *job = shell_job_find(sh, arg);
+		if (job == NULL) {
+			if (arg[0] == '%') {
+				fprintf(stderr, "wait: %s: no such job\n", arg);
+			} else {
+				fprintf(stderr, "wait: pid %s is not a child of "
+					"this shell\n", arg);
+			}
+			status = 127;
+			continue;
+		}
+		shell_job_wait(sh, job);
+		status = shell_status_from_wait(job->wstatus);
+		shell_job_delete(sh, job);
+	}
+	return status;
+}
+
+/** The syscalls to copy between two files, in the order of trying. */
+enum shell_copy_method {
+	/** Between regular files, can be just a reflink. */
+	SHELL_COPY_FILE_RANGE,
+	/** One of the files is a pipe. */
+	SHELL_COPY_SPLICE,
+	/** From a regular file to anything. */
+	SHELL_COPY_SENDFILE,
+	/** Via a buffer, always works. */
+	SHELL_COPY_READ_WRITE,
+};
+
+/**
+ * Copy all from @a in to @a out till the end of @a in. The data
+ * doesn't go through the user space, if the types of the files
+ * allow. A method is given up on when it fails for these files.
+ * @retval 0 Success.
+ * @retval -1 Error, in errno.
+ */
+static int
+shell_copy_fd(int in, int out)
+{
+	enum {
+		/** Per one syscall, any amount would do. */
+		COPY_SIZE = 1 << 30,
+		BUF_SIZE = 64 * 1024,
+	};
+	enum shell_copy_method method = SHELL_COPY_FILE_RANGE;
+	bool is_copied = false;
+	char *buf = NULL;
+	while (true) {
+		ssize_t rc;
+		switch (method) {
+		case SHELL_COPY_FILE_RANGE:
+			rc = copy_file_range(in, NULL, out, NULL, COPY_SIZE, 0);
+			break;
+		case SHELL_COPY_SPLICE:
+			rc = splice(in, NULL, out, NULL, COPY_SIZE, 0);
+			break;
+		case SHELL_COPY_SENDFILE:
+			rc = sendfile(out, in, NULL, COPY_SIZE);
+			break;
+		default:
+			if (buf == NULL)
+				buf = malloc(BUF_SIZE);
+			rc = read(in, buf, BUF_SIZE);
+			if (rc > 0) {
+				shell_write_fd(out, buf, rc);
+				break;
+			}
+		}
+		if (rc > 0) {
+			is_copied = true;
+			continue;
+		}
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (!is_copied && method != SHELL_COPY_READ_WRITE &&
+		    (rc == 0 || errno == EINVAL || errno == EXDEV ||
+		    errno == EBADF || errno == ENOSYS || errno == EOPNOTSUPP)) {
+			/*
+			 * Not for these files. copy_file_range() can also see
+			 * nothing in the files of /proc.
+			 */
+			++method;
+			continue;
+		}
+		if (rc == 0)
+			break;
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	return 0;
+}
+
+/** cat of the files, or of stdin for '-' or no files. */
+static int
+shell_builtin_cat(struct shell *sh, const struct command *cmd, int out)
+{
+	(void)sh;
+	/* The data goes to the fd, not to the buffer of the shell. */
+	if (out == STDOUT_FILENO)
+		fflush(stdout);
+	struct stat out_st;
+	bool is_out_file = fstat(out, &out_st) == 0 &&
+		S_ISREG(out_st.st_mode);
+	int status = 0;
+	uint32_t count = cmd->arg_count > 0 ? cmd->arg_count : 1;
+	for (uint32_t i = 0; i < count; ++i) {
+		const char *path = cmd->arg_count > 0 ? cmd->args[i] : "-";
+		int in = STDIN_FILENO;
+		if (strcmp(path, "-") != 0 &&
+		    (in = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+			fprintf(stderr, "cat: %s: %s\n", path, strerror(errno));
+			status = 1;
+			continue;
+		}
+		struct stat in_st;
+		if (is_out_file && fstat(in, &in_st) == 0 &&
+		    in_st.st_dev == out_st.st_dev &&
+		    in_st.st_ino == out_st.st_ino) {
+			/* Otherwise 'cat f >> f' would never end. */
+			fprintf(stderr, "cat: %s: input file is output file\n",
+				path);
+			status = 1;
+		} else if (shell_copy_fd(in, out) != 0) {
+			fprintf(stderr, "cat: %s: %s\n", path, strerror(errno));
+			status = 1;
+		}
+		if (in != STDIN_FILENO)
+			close(in);
+	}
+	return status;
+}
+
+/** The options of cat are left to the program. */
+static bool
+shell_builtin_cat_is_supported(const struct command *cmd)
+{
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		const char *arg = cmd->args[i];
+		if (arg[0] == '-' && arg[1] != 0)
+			return false;
+	}
+	return true;
+}
+
+struct shell_builtin {
+	const char *name;
+	/** Run in the shell without a fork, when not in a pipe. */
+	int (*func)(struct shell *sh, const struct command *cmd, int out);
+	/** Can't be turned off, it changes the shell itself. */
+	bool is_required;
+	/** Can run the command, or its program is needed. NULL is yes. */
+	bool (*is_supported)(const struct command *cmd);
+};
+
+static const struct shell_builtin shell_builtins[] = {
+	{"cd", shell_builtin_cd, true, NULL},
+	{"exit", shell_builtin_exit, true, NULL},
+	{"echo", shell_builtin_echo, false, NULL},
+	{"true", shell_builtin_true, false, NULL},
+	{"false", shell_builtin_false, false, NULL},
+	{"cat", shell_builtin_cat, false, shell_builtin_cat_is_supported},
+	{"jobs", shell_builtin_jobs, true, NULL},
+	{"wait", shell_builtin_wait, true, NULL},
+};
+
+static const struct shell_builtin *
+shell_find_builtin(const struct shell *sh, const struct command *cmd)
+{
+	for (size_t i = 0; i < sizeof(shell_builtins) /
+	     sizeof(shell_builtins[0]); ++i) {
+		const struct shell_builtin *b = &shell_builtins[i];
+		if (strcmp(cmd->exe, b->name) != 0)
+			continue;
+		if (!b->is_required && !sh->use_builtins)
+			return NULL;
+		if (b->is_supported != NULL && !b->is_supported(cmd))
+			return NULL;
+		return b;
+	}
+	return NULL;
+}
+
+/** Report a failed exec and get the status for it, like bash. */
+static int
+shell_exec_error(const char *exe, int err)
+{
+	if (err == ENOENT) {
+		fprintf(stderr, "%s: command not found\n", exe);
+		return 127;
+	}
+	fprintf(stderr, "%s: %s\n", exe, strerror(err));
+	return 126;
+}
+
+/**
+ * Body of a forked child. Never returns. @a path is the program
+ * found by the shell, or NULL.
+ */
+static void
+shell_child_exec(struct shell *sh, const struct command *cmd,
+	const struct shell_builtin *builtin, const char *path, int in, int out)
+{
+	if (in != STDIN_FILENO)
+		dup2(in, STDIN_FILENO);
+	if (out != STDOUT_FILENO)
+		dup2(out, STDOUT_FILENO);
+	if (builtin != NULL) {
+		int rc = builtin->func(sh, cmd, STDOUT_FILENO);
+		fflush(stdout);
+		_exit(rc);
+	}
+	char **argv = command_argv(cmd);
+	/*
+	 * The program can be gone, or be a script without '#!', which
+	 * only execvp() runs. The shell won't know, the path stays.
+	 */
+	if (path != NULL)
+		execv(path, argv);
+	execvp(cmd->exe, argv);
+	_exit(shell_exec_error(cmd->exe, errno));
+}
+
+/**
+ * Start the command with the given stdin and stdout.
+ * @retval >0 Pid of the started command.
+ * @retval -1 It couldn't be started, then @a status is its status.
+ */
+static pid_t
+shell_spawn(struct shell *sh, const struct command *cmd, int in, int out,
+	int *status)
+{
+	/*
+	 * The command must see the shell's output before its own. And a
+	 * forked child would print the buffered output again.
+	 */
+	fflush(stdout);
+	const struct shell_builtin *builtin = shell_find_builtin(sh, cmd);
+	const char *path = builtin == NULL ? shell_path_find(sh, cmd->exe) :
+		NULL;
+	if (sh->spawn_mode == SHELL_SPAWN_POSIX && builtin == NULL) {
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		if (in != STDIN_FILENO)
+			posix_spawn_file_actions_adddup2(&actions, in,
+				STDIN_FILENO);
+		if (out != STDOUT_FILENO)
+			posix_spawn_file_actions_adddup2(&actions, out,
+				STDOUT_FILENO);
+		char **argv = command_argv(cmd);
+		pid_t pid;
+		int rc = ENOENT;
+		if (path != NULL) {
+			rc = posix_spawn(&pid, path, &actions, NULL, argv,
+				environ);
+			/* Gone, then it is looked up in $PATH again. */
+			if (rc == ENOENT)
+				shell_path_forget(sh, cmd->exe);
+		}
+		if (rc == ENOENT) {
+			rc = posix_spawnp(&pid, cmd->exe, &actions, NULL, argv,
+				environ);
+		}
+		free(argv);
+		posix_spawn_file_actions_destroy(&actions);
+		if (rc != 0) {
+			*status = shell_exec_error(cmd->exe, rc);
+			return -1;
+		}
+		return pid;
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fork: %s\n", strerror(errno));
+		*status = 1;
+		return -1;
+	}
+	if (pid == 0)
+		shell_child_exec(sh, cmd, builtin, path, in, out);
+	return pid;
+}
+
+/** The first expression after the pipeline which starts at @a e. */
+static const struct expr *
+shell_pipeline_end(const struct expr *e)
+{
+	while (e != NULL && e->type != EXPR_TYPE_AND &&
+	       e->type != EXPR_TYPE_OR)
+		e = e->next;
+	return e;
+}
+
+/** What 'time' reports of a command of a pipeline. */
+struct shell_stage {
+	pid_t pid;
+	/** Readable when the process is done, -1 if there is none. */
+	int pidfd;
+	const char *exe;
+	bool is_done;
+	int wstatus;
+	/** When the process was seen done, in ns. */
+	uint64_t end;
+	struct rusage usage;
+	/** Bytes the process wrote, to the pipe mostly. */
+	uint64_t written;
+};
+
+static uint64_t
+shell_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+shell_timeval_ns(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000000 + tv->tv_usec * 1000;
+}
+
+/** 'wchar' of /proc/<pid>/io, 0 if it can't be read. */
+static uint64_t
+shell_proc_written(pid_t pid)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "/proc/%d/io", (int)pid);
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	char buf[512];
+	ssize_t rc = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (rc <= 0)
+		return 0;
+	buf[rc] = 0;
+	const char *pos = strstr(buf, "wchar:");
+	return pos != NULL ? strtoull(pos + 6, NULL, 10) : 0;
+}
+
+/**
+ * Reap the stage which is done or is about to be. The counters of
+ * /proc are read before the reaping, while the zombie still has them.
+ */
+static void
+shell_stage_reap(struct shell_stage *st)
+{
+	siginfo_t info;
+	while (waitid(P_PID, st->pid, &info, WEXITED | WNOWAIT) < 0 &&
+	       errno == EINTR)
+		;
+	st->end = shell_now_ns();
+	st->written = shell_proc_written(st->pid);
+	while (wait4(st->pid, &st->wstatus, 0, &st->usage) < 0 &&
+	       errno == EINTR)
+		;
+	st->is_done = true;
+	if (st->pidfd >= 0)
+		close(st->pidfd);
+}
+
+/**
+ * Wait for all the stages, in the order they end, so each one gets
+ * its own real time. Without pidfds, the stages are waited in turn,
+ * and the times of the ones ended before the previous ones are late.
+ */
+static void
+shell_stages_wait(struct shell_stage *stages, uint32_t count)
+{
+	struct pollfd *fds = malloc(sizeof(*fds) * count);
+	uint32_t *idx = malloc(sizeof(*idx) * count);
+	while (true) {
+		uint32_t n = 0;
+		for (uint32_t i = 0; i < count; ++i) {
+			if (stages[i].is_done || stages[i].pidfd < 0)
+				continue;
+			fds[n].fd = stages[i].pidfd;
+			fds[n].events = POLLIN;
+			fds[n].revents = 0;
+			idx[n++] = i;
+		}
+		if (n == 0)
+			break;
+		if (poll(fds, n, -1) < 0) {
+			/* SIGCHLD of a background job. */
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (uint32_t i = 0; i < n; ++i) {
+			if (fds[i].revents != 0)
+				shell_stage_reap(&stages[idx[i]]);
+		}
+	}
+	free(fds);
+	free(idx);
+	for (uint32_t i = 0; i < count; ++i) {
+		if (!stages[i].is_done)
+			shell_stage_reap(&stages[i]);
+	}
+}
+
+/**
+ * Print the times of the stages to stderr. Blocked is the real time
+ * when the command wasn't on CPU: waiting for the pipes mostly, but
+ * also for the disk, or for a CPU taken by the other stages.
+ */
+static void
+shell_stages_report(const struct shell_stage *stages, uint32_t count,
+		    uint64_t start, uint64_t end)
+{
+	for (uint32_t i = 0; i < count; ++i) {
+		const struct shell_stage *st = &stages[i];
+		if (st->pid < 0) {
+			fprintf(stderr, "time: %u %s: not started\n", i + 1,
+				st->exe);
+			continue;
+		}
+		uint64_t real = st->end - start;
+		uint64_t user = shell_timeval_ns(&st->usage.ru_utime);
+		uint64_t sys = shell_timeval_ns(&st->usage.ru_stime);
+		uint64_t blocked = real > user + sys ? real - user - sys : 0;
+		double mbps = real != 0 ?
+			st->written * 1000.0 / real : 0;
+		fprintf(stderr, "time: %u %s: real %.3fs user %.3fs sys %.3fs "
+			"blocked %.3fs, out %llu bytes, %.1f MB/s\n", i + 1,
+			st->exe, real / 1e9, user / 1e9, sys / 1e9,
+			blocked / 1e9, (unsigned long long)st->written, mbps);
+	}
+	fprintf(stderr, "time: real %.3fs\n", (end - start) / 1e9);
+}
+
+/**
+ * Run the pipeline starting at @a e and wait for it. @a out is the
+ * stdout of its last command. With 'time' in front of the first
+ * command, the times of each command are printed to stderr after.
+ */
+static void
+shell_run_pipeline(struct shell *sh, const struct expr *e, int out)
+{
+	assert(e->type == EXPR_TYPE_COMMAND);
+	/* The first command without 'time', the others are as is. */
+	const struct command *cmd = &e->cmd;
+	struct command timed;
+	bool is_timed = strcmp(cmd->exe, "time") == 0 && cmd->arg_count > 0;
+	if (is_timed) {
+		timed.exe = cmd->args[0];
+		timed.args = cmd->args + 1;
+		timed.arg_count = cmd->arg_count - 1;
+		timed.arg_capacity = timed.arg_count;
+		cmd = &timed;
+	}
+	uint64_t start = is_timed ? shell_now_ns() : 0;
+	/* A single builtin runs in the shell itself, with no fork. */
+	if (e->next == NULL || e->next->type != EXPR_TYPE_PIPE) {
+		const struct shell_builtin *b = shell_find_builtin(sh, cmd);
+		if (b != NULL) {
+			sh->status = b->func(sh, cmd, out);
+			if (is_timed)
+				shell_stages_report(NULL, 0, start, shell_now_ns());
+			return;
+		}
+	}
+	uint32_t count = 1;
+	for (const struct expr *it = e->next; it != NULL &&
+	     it->type == EXPR_TYPE_PIPE; it = it->next->next)
+		++count;
+	pid_t *pids = malloc(sizeof(*pids) * count);
+	const struct expr *head = e;
+	int in = STDIN_FILENO;
+	int status = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		assert(e->type == EXPR_TYPE_COMMAND);
+		bool is_last = i == count - 1;
+		int fds[2];
+		int cmd_out = out;
+		if (!is_last) {
+			shell_pipe(sh, fds);
+			cmd_out = fds[1];
+		}
+		pids[i] = shell_spawn(sh, i == 0 ? cmd : &e->cmd, in, cmd_out,
+				      &status);
+		if (in != STDIN_FILENO)
+			close(in);
+		if (!is_last) {
+			close(fds[1]);
+			in = fds[0];
+			e = e->next->next;
+		}
+	}
+	if (is_timed) {
+		struct shell_stage *stages = calloc(count, sizeof(*stages));
+		e = head;
+		for (uint32_t i = 0; i < count; ++i) {
+			struct shell_stage *st = &stages[i];
+			st->pid = pids[i];
+			st->exe = i == 0 ? cmd->exe : e->cmd.exe;
+			st->is_done = st->pid < 0;
+			st->pidfd = st->pid < 0 ? -1 :
+				(int)syscall(SYS_pidfd_open, st->pid, 0);
+			if (i + 1 < count)
+				e = e->next->next;
+		}
+		shell_stages_wait(stages, count);
+		shell_stages_report(stages, count, start, shell_now_ns());
+		if (stages[count - 1].pid >= 0) {
+			status = shell_status_from_wait(
+				stages[count - 1].wstatus);
+		}
+		free(stages);
+		free(pids);
+		sh->status = status;
+		return;
+	}
+	/* The status of a pipeline is the one of its last command. */
+	for (uint32_t i = 0; i < count; ++i) {
+		if (pids[i] < 0)
+			continue;
+		int wstatus;
+		while (waitpid(pids[i], &wstatus, 0) < 0 && errno == EINTR)
+			;
+		if (i == count - 1)
+			status = shell_status_from_wait(wstatus);
+	}
+	free(pids);
+	sh->status = status;
+}
+
+/** Open the file of the output redirect, or -1 with the error printed. */
+static int
+shell_open_output(const struct command_line *line)
+{
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+	if (line->out_type == OUTPUT_TYPE_FILE_APPEND)
+		flags |= O_APPEND;
+	else
+		flags |= O_TRUNC;
+	int fd = open(line->out_file, flags, 0666);
+	if (fd < 0)
+		fprintf(stderr, "%s: %s\n", line->out_file, strerror(errno));
+	return fd;
+}
+
+static void
+shell_run_line(struct shell *sh, const struct command_line *line)
+{
+	const struct expr *e = line->head;
+	while (e != NULL) {
+		const struct expr *end = shell_pipeline_end(e);
+		/* The redirect belongs to the last pipeline. */
+		int out = STDOUT_FILENO;
+		if (end == NULL && line->out_type != OUTPUT_TYPE_STDOUT)
+			out = shell_open_output(line);
+		if (out >= 0) {
+			shell_run_pipeline(sh, e, out);
+			if (out != STDOUT_FILENO)
+				close(out);
+		} else {
+			sh->status = 1;
+		}
+		if (sh->is_exit)
+			return;
+		/* Skip the pipelines which the status makes not needed. */
+		e = end;
+		while (e != NULL) {
+			bool is_needed = e->type == EXPR_TYPE_AND ?
+				sh->status == 0 : sh->status != 0;
+			e = e->next;
+			if (is_needed)
+				break;
+			e = shell_pipeline_end(e);
+		}
+	}
+}
+
+void
+shell_execute(struct shell *sh, const struct command_line *line)
+{
+	if (!line->is_background) {
+		shell_run_line(sh, line);
+		return;
+	}
+	shell_reap(sh);
+	while (sh->max_jobs != 0 && sh->running_job_count >= sh->max_jobs)
+		shell_job_wait_any(sh);
+	char *text = shell_line_text(line);
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fork: %s\n", strerror(errno));
+		free(text);
+		sh->status = 1;
+		return;
+	}
+	if (pid == 0) {
+		/* The jobs of the shell are not children of the copy. */
+		sh->job_count = 0;
+		sh->running_job_count = 0;
+		/* Background commands don't read the shell's input. */
+		int fd = open("/dev/null", O_RDONLY);
+		if (fd >= 0) {
+			dup2(fd, STDIN_FILENO);
+			close(fd);
+		}
+		shell_run_line(sh, line);
+		fflush(stdout);
+		_exit(sh->status);
+	}
+	shell_job_add(sh, pid, text);
+	sh->status = 0;
+}
+
+void
+shell_reap(struct shell *sh)
+{
+	if (sh->running_job_count == 0 || !shell_is_child_done)
+		return;
+	/* Cleared before the wait, so a SIGCHLD during it is not lost. */
+	shell_is_child_done = 0;
+	int wstatus;
+	pid_t pid;
+	while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+		struct shell_job *job = shell_job_by_pid(sh, pid);
+		if (job != NULL)
+			shell_job_end(sh, job, wstatus);
+	}
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct command_line;
+struct shell_path_entry;
+
+/** How the commands are started. */
+enum shell_spawn_mode {
+	/** fork() and exec in the child. */
+	SHELL_SPAWN_FORK,
+	/**
+	 * posix_spawn(), which doesn't copy the shell's page tables.
+	 * The builtins inside a pipe still need fork().
+	 */
+	SHELL_SPAWN_POSIX,
+};
+
+/** A background command line, started with '&'. */
+struct shell_job {
+	/** Number for 'wait %N', like in bash. */
+	int id;
+	/** The copy of the shell which runs the line. */
+	pid_t pid;
+	/** The command line, for the reports of 'jobs'. */
+	char *text;
+	bool is_done;
+	/** Status from waitpid(), when done. */
+	int wstatus;
+};
+
+struct shell {
+	enum shell_spawn_mode spawn_mode;
+	/**
+	 * Run echo, true, false, and cat in the shell, rather than start
+	 * the programs. cd and exit are always builtins.
+	 */
+	bool use_builtins;
+	/** Exit status of the last pipeline, like $? in bash. */
+	int status;
+	/** 'exit' was called in the shell itself, not in a pipe. */
+	bool is_exit;
+	/**
+	 * Background jobs by their ids. The running ones and the done
+	 * ones not reported by 'jobs' or 'wait' yet.
+	 */
+	struct shell_job *jobs;
+	uint32_t job_count;
+	uint32_t job_capacity;
+	uint32_t running_job_count;
+	/**
+	 * Max number of the jobs running at once, 0 is no limit. A new
+	 * one waits till another one is done, like in 'make -j'.
+	 */
+	uint32_t max_jobs;
+	/**
+	 * Look the programs up in $PATH once, and then start them right
+	 * by their full paths, like 'hash' in bash does.
+	 */
+	bool use_path_cache;
+	/**
+	 * The programs found in $PATH by the command names. All are
+	 * dropped when $PATH is changed, and one when its file is gone.
+	 */
+	struct shell_path_entry **path_buckets;
+	/** Bucket count - 1, the count is a power of 2. */
+	uint32_t path_bucket_mask;
+	uint32_t path_count;
+	/** $PATH which the programs were found in. */
+	char *path_env;
+	/**
+	 * Capacity of the pipes between the commands, set by
+	 * F_SETPIPE_SZ. 0 keeps the system default, 64 KB on Linux.
+	 */
+	uint32_t pipe_size;
+};
+
+void
+shell_create(struct shell *sh);
+
+/**
+ * Set the capacity of the pipes made by the shell. The kernel rounds
+ * it up to a power of 2 pages, and an unprivileged user can't go
+ * over /proc/sys/fs/pipe-max-size.
+ * @retval 0 Success.
+ * @retval -1 The size is not allowed, errno is set.
+ */
+int
+shell_set_pipe_size(struct shell *sh, uint32_t size);
+
+/** Free the job table. The running jobs are left running. */
+void
+shell_destroy(struct shell *sh);
+
+/**
+ * Execute the command line and wait for it, unless it is a
+ * background one. Then it is run by a copy of the shell.
+ */
+void
+shell_execute(struct shell *sh, const struct command_line *line);
+
+/**
+ * Reap the finished background jobs. Costs no syscalls when none
+ * has finished since the last time, SIGCHLD tells that.
+ */
+void
+shell_reap(struct shell *sh);
@@ -1,71 +1,231 @@
 #include "parser.h"
+#include "shell.h"
 
-#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+enum {
+	/** Reads of the interactive input. */
+	READ_SIZE = 1024,
+	/** Feeds of a script to the parser. */
+	SCRIPT_FEED_SIZE = 1024 * 1024,
+	/** Reads of a script which can't be mapped, like a pipe. */
+	SCRIPT_READ_SIZE = 64 * 1024,
+	/** Output buffer of a script's own commands, like echo. */
+	SCRIPT_OUT_SIZE = 64 * 1024,
+};
+
+/** Execute a popped line, or report its error. */
 static void
-execute_command_line(const struct command_line *line)
+run_line(struct shell *sh, enum parser_error err, struct command_line *line)
 {
-	/* REPLACE THIS CODE WITH ACTUAL COMMAND EXECUTION */
+	if (err != PARSER_ERR_NONE) {
+		printf("Error: %d\n", (int)err);
+		return;
+	}
+	shell_execute(sh, line);
+	command_line_delete(line);
+	shell_reap(sh);
+}
 
-	assert(line != NULL);
-	printf("================================\n");
-	printf("Command line:\n");
-	printf("Is background: %d\n", (int)line->is_background);
-	printf("Output: ");
-	if (line->out_type == OUTPUT_TYPE_STDOUT) {
-		printf("stdout\n");
-	} else if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
-		printf("new file - \"%s\"\n", line->out_file);
-	} else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
-		printf("append file - \"%s\"\n", line->out_file);
-	} else {
-		assert(false);
+/** Parse and execute the input. Stops after 'exit'. */
+static void
+run_input(struct shell *sh, struct parser *p, const char *data, uint32_t size)
+{
+	parser_feed(p, data, size);
+	struct command_line *line = NULL;
+	while (!sh->is_exit) {
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			break;
+		run_line(sh, err, line);
 	}
-	printf("Expressions:\n");
-	const struct expr *e = line->head;
-	while (e != NULL) {
-		if (e->type == EXPR_TYPE_COMMAND) {
-			printf("\tCommand: %s", e->cmd.exe);
-			for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
-				printf(" %s", e->cmd.args[i]);
-			printf("\n");
-		} else if (e->type == EXPR_TYPE_PIPE) {
-			printf("\tPIPE\n");
-		} else if (e->type == EXPR_TYPE_AND) {
-			printf("\tAND\n");
-		} else if (e->type == EXPR_TYPE_OR) {
-			printf("\tOR\n");
-		} else {
-			assert(false);
+}
+
+/** Execute a script parsed by many threads. Stops after 'exit'. */
+static void
+run_bulk(struct shell *sh, struct parser_bulk *b)
+{
+	struct command_line *line = NULL;
+	while (!sh->is_exit) {
+		enum parser_error err = parser_bulk_pop_next(b, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			break;
+		run_line(sh, err, line);
+	}
+}
+
+/** The last line can have no new line in the end, like in bash. */
+static void
+run_input_end(struct shell *sh, struct parser *p)
+{
+	if (!sh->is_exit)
+		run_input(sh, p, "\n", 1);
+}
+
+static void
+run_interactive(struct shell *sh, struct parser *p)
+{
+	char buf[READ_SIZE];
+	int rc;
+	while (!sh->is_exit) {
+		/* The user must see the output before typing more. */
+		fflush(stdout);
+		if ((rc = read(STDIN_FILENO, buf, sizeof(buf))) <= 0)
+			break;
+		run_input(sh, p, buf, rc);
+	}
+	run_input_end(sh, p);
+}
+
+/**
+ * Run a script file. It is mapped and fed by big blocks, and the
+ * shell's own output is buffered till a command is started. With
+ * @a parse_threads, a mapped script is parsed by that many threads
+ * while its first lines are executed.
+ */
+static int
+run_script(struct shell *sh, struct parser *p, const char *path,
+	   uint32_t parse_threads)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 127;
+	}
+	/* Without a buffer glibc would ignore the size. */
+	static char out_buf[SCRIPT_OUT_SIZE];
+	setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+	struct stat st;
+	char *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data != MAP_FAILED && parse_threads > 0) {
+		struct parser_bulk *b = parser_bulk_new(data, st.st_size,
+							parse_threads, 0);
+		run_bulk(sh, b);
+		parser_bulk_delete(b);
+		munmap(data, st.st_size);
+		close(fd);
+		/* The bulk parser takes the end of the last line itself. */
+		return sh->status;
+	}
+	if (data != MAP_FAILED) {
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+		for (off_t pos = 0; pos < st.st_size && !sh->is_exit;
+		     pos += SCRIPT_FEED_SIZE) {
+			off_t size = st.st_size - pos;
+			if (size > SCRIPT_FEED_SIZE)
+				size = SCRIPT_FEED_SIZE;
+			run_input(sh, p, data + pos, size);
 		}
-		e = e->next;
+		munmap(data, st.st_size);
+	} else {
+		char *buf = malloc(SCRIPT_READ_SIZE);
+		ssize_t rc;
+		while (!sh->is_exit &&
+		       (rc = read(fd, buf, SCRIPT_READ_SIZE)) > 0)
+			run_input(sh, p, buf, rc);
+		free(buf);
 	}
+	close(fd);
+	run_input_end(sh, p);
+	return sh->status;
 }
 
 int
-main(void)
+main(int argc, char **argv)
 {
-	const size_t buf_size = 1024;
-	char buf[buf_size];
-	int rc;
-	struct parser *p = parser_new();
-	while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
-		parser_feed(p, buf, rc);
-		struct command_line *line = NULL;
-		while (true) {
-			enum parser_error err = parser_pop_next(p, &line);
-			if (err == PARSER_ERR_NONE && line == NULL)
-				break;
-			if (err != PARSER_ERR_NONE) {
-				printf("Error: %d\n", (int)err);
-				continue;
+	struct shell sh;
+	shell_create(&sh);
+	const char *script = NULL;
+	long cache_size = 0;
+	long parse_threads = 0;
+	bool is_cache_stat = false;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--fork") == 0) {
+			sh.spawn_mode = SHELL_SPAWN_FORK;
+		} else if (strcmp(argv[i], "--no-builtins") == 0) {
+			sh.use_builtins = false;
+		} else if (strcmp(argv[i], "--no-path-cache") == 0) {
+			sh.use_path_cache = false;
+		} else if (strcmp(argv[i], "--pipe-size") == 0 &&
+			   i + 1 < argc) {
+			/* In bytes, like F_SETPIPE_SZ. */
+			char *end;
+			const char *value = argv[++i];
+			long size = strtol(value, &end, 10);
+			if (*value == 0 || *end != 0 || size < 0 ||
+			    size > INT32_MAX ||
+			    shell_set_pipe_size(&sh, size) != 0) {
+				printf("Error: bad --pipe-size value '%s'\n",
+				       value);
+				return -1;
 			}
-			execute_command_line(line);
-			command_line_delete(line);
+		} else if (strncmp(argv[i], "-j", 2) == 0) {
+			/* Both '-j 4' and '-j4', like make. */
+			const char *value = argv[i][2] != 0 ? &argv[i][2] :
+				i + 1 < argc ? argv[++i] : "";
+			char *end;
+			long max_jobs = strtol(value, &end, 10);
+			if (*value == 0 || *end != 0 || max_jobs < 0) {
+				printf("Error: bad -j value '%s'\n", value);
+				return -1;
+			}
+			sh.max_jobs = max_jobs;
+		} else if (strcmp(argv[i], "--cache-stat") == 0) {
+			is_cache_stat = true;
+		} else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+			/* Of the parsed lines, for scripts which repeat them. */
+			char *end;
+			cache_size = strtol(argv[++i], &end, 10);
+			if (*argv[i] == 0 || *end != 0 || cache_size < 0 ||
+			    cache_size > UINT32_MAX) {
+				printf("Error: bad --cache value '%s'\n", argv[i]);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--parse-threads") == 0 &&
+			   i + 1 < argc) {
+			/* For huge scripts. The cache is not used then. */
+			char *end;
+			parse_threads = strtol(argv[++i], &end, 10);
+			if (*argv[i] == 0 || *end != 0 || parse_threads < 0 ||
+			    parse_threads > 1024) {
+				printf("Error: bad --parse-threads value '%s'\n",
+				       argv[i]);
+				return -1;
+			}
+		} else if (argv[i][0] != '-' && script == NULL) {
+			script = argv[i];
+		} else {
+			printf("Error: unknown option %s\n", argv[i]);
+			return -1;
 		}
 	}
+	struct parser *p = parser_new();
+	parser_set_cache_size(p, cache_size);
+	int rc;
+	if (script != NULL) {
+		rc = run_script(&sh, p, script, parse_threads);
+	} else {
+		run_interactive(&sh, p);
+		rc = sh.status;
+	}
+	/* To stderr, so the output of the script is the same. */
+	if (is_cache_stat) {
+		struct parser_cache_stat stat;
+		parser_get_cache_stat(p, &stat);
+		fprintf(stderr, "Parser cache: %llu hits, %llu misses\n",
+			(unsigned long long)stat.hit_count,
+			(unsigned long long)stat.miss_count);
+	}
 	parser_delete(p);
-	return 0;
+	shell_destroy(&sh);
+	return rc;
 }
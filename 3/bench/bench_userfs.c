@@ -0,0 +1,853 @@
+/*
+ * Throughput of UserFS on a big file, in MB per second, and on many
+ * small files, in thousands of operations per second.
+ *
+ * Sequential read: one descriptor reads the whole file from the
+ * start by chunks of the given size.
+ *
+ * Bytes: a 100 MB file is read from the start by ufs_read() of the
+ * given tiny size, and is written so too. Nearly all the cost is
+ * the call itself.
+ *
+ * Random read: ufs_pread() of the chunks at random offsets. The block
+ * of each is found by the offset, not as the next one after the
+ * last read. Without the block index it would cost a walk over the
+ * block list from its start, and this case would be much slower
+ * than the sequential one.
+ *
+ * Records: the file is read by 64 byte records, with a ufs_read()
+ * per record, or with a ufs_readv() of the given number of them.
+ *
+ * Scan: the file is searched for a byte which is not in it, like a
+ * parser looks for a delimiter. By ufs_read() into a buffer of the
+ * given size, or by ufs_read_span() of up to that size, which needs
+ * no copy.
+ *
+ * Clone: a copy of the big file is made by ufs_clone(), or by
+ * reading it and writing into a new file by 1 MB, in microseconds.
+ * Then the copy is written by 4 KB at random offsets, which copy
+ * the shared blocks on the first touch.
+ *
+ * Threads: the given number of threads do ufs_pread() of 4 KB at
+ * random offsets. All of the same file, or each of its own one. Or
+ * each does ufs_pwrite() into its own file. The total MB per
+ * second is printed. The shared file is locked for reads only, so
+ * the threads should not wait for each other in any of the cases.
+ *
+ * Sequential write: a new file is written by 1 MB chunks, with the
+ * blocks growing up to the given max size. With 512 all the blocks
+ * are of the same size, like in the classic block list.
+ *
+ * Files: the given number of empty files is created, then each of
+ * them is opened, then deleted, all in a random order. Each open is
+ * followed by a close.
+ *
+ * Descriptors: the given number of descriptors is kept open, and a
+ * random one of them is closed and opened again, which reuses its
+ * number as the lowest free one.
+ *
+ * Churn: a file of the given size is created, written, and deleted,
+ * again and again, like temporary files are.
+ *
+ * Sparse: a file is resized to the given size, 16 pieces of 4 KB
+ * are written at random offsets, and the file is resized to 0. It
+ * costs the same for any size, when the holes are not allocated.
+ *
+ * Dirs: a tree of directories of the given depth, each has 10
+ * subdirectories, and the deepest ones have 10 files each. Random
+ * files are opened by their paths, each open followed by a close,
+ * and random deepest directories are listed. A listing only
+ * touches its own directory. A path costs a lookup per its part,
+ * unless its directory is one of the recent ones in the path
+ * cache, which the random paths of the deep tree mostly are not.
+ *
+ * Image: the given number of files is written into the heap, which
+ * is a rebuild of the FS from scratch, or the same files are opened
+ * by ufs_mount() of an image keeping them. The time of each, in
+ * milliseconds. Many files of 4 KB, or 64 files of 1 MB.
+ *
+ * Build with 'make bench'.
+ */
+#include "userfs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	BENCH_RUN_COUNT = 5,
+	BENCH_FILE_SIZE = 32 * 1024 * 1024,
+	BENCH_WRITE_SIZE = 1024 * 1024,
+	BENCH_RANDOM_READ_SIZE = BENCH_FILE_SIZE / 4,
+	BENCH_RECORD_SIZE = 64,
+	BENCH_RECORDS_PER_READ_MAX = 64,
+	BENCH_BYTES_FILE_SIZE = 100 * 1024 * 1024,
+	BENCH_THREAD_CHUNK_SIZE = 4096,
+	BENCH_THREAD_FILE_SIZE = 4 * 1024 * 1024,
+	BENCH_THREAD_COUNT_MAX = 4,
+};
+
+static const char *bench_file_name = "bench_file";
+
+enum bench_file_op {
+	BENCH_FILE_CREATE,
+	BENCH_FILE_OPEN,
+	BENCH_FILE_DELETE,
+	BENCH_FILE_OP_COUNT,
+};
+
+static const char *bench_file_op_titles[] = {
+	"Files create, K per second, file count",
+	"Files open, K per second, file count",
+	"Files delete, K per second, file count",
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_double(const void *l, const void *r)
+{
+	double a = *(const double *)l;
+	double b = *(const double *)r;
+	return a < b ? -1 : a > b;
+}
+
+static void
+bench_print(const char *title, size_t param, double *times)
+{
+	qsort(times, BENCH_RUN_COUNT, sizeof(times[0]), bench_cmp_double);
+	printf("%s %zu\n", title, param);
+	printf("    min: %.2lf\n", times[0]);
+	printf("    med: %.2lf\n", times[BENCH_RUN_COUNT / 2]);
+	printf("    max: %.2lf\n", times[BENCH_RUN_COUNT - 1]);
+}
+
+static void
+bench_bad_rc(const char *what)
+{
+	printf("Error: %s failed: %d\n", what, (int)ufs_errno());
+	exit(-1);
+}
+
+static int
+bench_open(void)
+{
+	int fd = ufs_open(bench_file_name, 0);
+	if (fd == -1)
+		bench_bad_rc("open");
+	return fd;
+}
+
+/** Create the file and return nanoseconds spent on it. */
+static uint64_t
+bench_file_create(void)
+{
+	char *buf = malloc(BENCH_WRITE_SIZE);
+	for (int i = 0; i < BENCH_WRITE_SIZE; ++i)
+		buf[i] = 'a' + i % 26;
+	uint64_t start = bench_now_ns();
+	int fd = ufs_open(bench_file_name, UFS_CREATE);
+	for (int i = 0; i < BENCH_FILE_SIZE / BENCH_WRITE_SIZE; ++i) {
+		if (ufs_write(fd, buf, BENCH_WRITE_SIZE) != BENCH_WRITE_SIZE)
+			bench_bad_rc("write");
+	}
+	ufs_close(fd);
+	uint64_t duration = bench_now_ns() - start;
+	free(buf);
+	return duration;
+}
+
+static double
+bench_sequential(size_t chunk_size)
+{
+	char *buf = malloc(chunk_size);
+	int fd = bench_open();
+	size_t total = 0;
+	uint64_t start = bench_now_ns();
+	ssize_t rc;
+	while ((rc = ufs_read(fd, buf, chunk_size)) > 0)
+		total += rc;
+	uint64_t duration = bench_now_ns() - start;
+	ufs_close(fd);
+	free(buf);
+	if (total != BENCH_FILE_SIZE) {
+		printf("Error: read %zu bytes instead of %d\n", total,
+			BENCH_FILE_SIZE);
+		exit(-1);
+	}
+	return (double)total * 1000 / duration;
+}
+
+/** Write and read the big file by @a size bytes, MB per second. */
+static void
+bench_bytes(size_t size, double *write_speed, double *read_speed)
+{
+	char buf[16];
+	memset(buf, 'x', sizeof(buf));
+	int fd = ufs_open(bench_file_name, UFS_CREATE);
+	uint64_t start = bench_now_ns();
+	for (size_t i = 0; i < BENCH_BYTES_FILE_SIZE; i += size) {
+		if (ufs_write(fd, buf, size) != (ssize_t)size)
+			bench_bad_rc("write");
+	}
+	uint64_t duration = bench_now_ns() - start;
+	*write_speed = (double)BENCH_BYTES_FILE_SIZE * 1000 / duration;
+	ufs_close(fd);
+	fd = bench_open();
+	size_t total = 0;
+	ssize_t rc;
+	start = bench_now_ns();
+	while ((rc = ufs_read(fd, buf, size)) > 0)
+		total += rc;
+	duration = bench_now_ns() - start;
+	*read_speed = (double)total * 1000 / duration;
+	ufs_close(fd);
+	ufs_delete(bench_file_name);
+	if (total != BENCH_BYTES_FILE_SIZE)
+		bench_bad_rc("read");
+}
+
+static double
+bench_random(size_t chunk_size)
+{
+	int fd = bench_open();
+	char *buf = malloc(chunk_size);
+	size_t total = 0;
+	size_t chunk_count = BENCH_FILE_SIZE / chunk_size;
+	uint64_t start = bench_now_ns();
+	for (size_t i = 0; i < BENCH_RANDOM_READ_SIZE / chunk_size; ++i) {
+		size_t offset = (rand() % chunk_count) * chunk_size;
+		ssize_t rc = ufs_pread(fd, buf, chunk_size, offset);
+		if (rc != (ssize_t)chunk_size)
+			bench_bad_rc("pread");
+		total += rc;
+	}
+	uint64_t duration = bench_now_ns() - start;
+	free(buf);
+	ufs_close(fd);
+	return (double)total * 1000 / duration;
+}
+
+/** Read the file by records, @a count of them per call. */
+static double
+bench_records(int count)
+{
+	int fd = bench_open();
+	char *buf = malloc(BENCH_RECORD_SIZE * count);
+	struct iovec iov[BENCH_RECORDS_PER_READ_MAX];
+	for (int i = 0; i < count; ++i) {
+		iov[i].iov_base = buf + i * BENCH_RECORD_SIZE;
+		iov[i].iov_len = BENCH_RECORD_SIZE;
+	}
+	size_t total = 0;
+	uint64_t start = bench_now_ns();
+	ssize_t rc;
+	if (count == 1) {
+		while ((rc = ufs_read(fd, buf, BENCH_RECORD_SIZE)) > 0)
+			total += rc;
+	} else {
+		while ((rc = ufs_readv(fd, iov, count)) > 0)
+			total += rc;
+	}
+	uint64_t duration = bench_now_ns() - start;
+	free(buf);
+	ufs_close(fd);
+	if (total != BENCH_FILE_SIZE)
+		bench_bad_rc("read");
+	return (double)total * 1000 / duration;
+}
+
+static void
+bench_shuffle(char (*names)[16], uint32_t count)
+{
+	for (uint32_t i = count - 1; i > 0; --i) {
+		uint32_t j = rand() % (i + 1);
+		char tmp[16];
+		memcpy(tmp, names[i], sizeof(tmp));
+		memcpy(names[i], names[j], sizeof(tmp));
+		memcpy(names[j], tmp, sizeof(tmp));
+	}
+}
+
+/**
+ * Run each operation on all the files, and save thousands of the
+ * operations per second into @a times by the operation type.
+ */
+static void
+bench_files(uint32_t count, double times[BENCH_FILE_OP_COUNT])
+{
+	char (*names)[16] = malloc(count * sizeof(names[0]));
+	for (uint32_t i = 0; i < count; ++i)
+		sprintf(names[i], "file%u", i);
+	for (int op = 0; op < BENCH_FILE_OP_COUNT; ++op) {
+		bench_shuffle(names, count);
+		uint64_t start = bench_now_ns();
+		for (uint32_t i = 0; i < count; ++i) {
+			if (op == BENCH_FILE_DELETE) {
+				if (ufs_delete(names[i]) != 0)
+					bench_bad_rc("delete");
+				continue;
+			}
+			int fd = ufs_open(names[i], op == BENCH_FILE_CREATE ?
+				UFS_CREATE : 0);
+			if (fd == -1 || ufs_close(fd) != 0)
+				bench_bad_rc("open");
+		}
+		uint64_t duration = bench_now_ns() - start;
+		times[op] = (double)count * 1000000 / duration;
+	}
+	free(names);
+}
+
+static void
+bench_dir_path(char *path, int depth, uint32_t n)
+{
+	char *pos = path;
+	for (int i = 0; i < depth; ++i, n /= 10)
+		pos += sprintf(pos, "d%u/", n % 10);
+	*pos = 0;
+}
+
+static void
+bench_dir_tree(char *path, int depth, int level, bool is_create)
+{
+	size_t size = strlen(path);
+	for (int i = 0; i < 10; ++i) {
+		if (level == depth)
+			sprintf(path + size, "file%d", i);
+		else
+			sprintf(path + size, "d%d", i);
+		if (level == depth && is_create) {
+			int fd = ufs_open(path, UFS_CREATE);
+			if (fd == -1 || ufs_close(fd) != 0)
+				bench_bad_rc("open");
+		} else if (level == depth) {
+			if (ufs_delete(path) != 0)
+				bench_bad_rc("delete");
+		} else {
+			if (is_create && ufs_mkdir(path) != 0)
+				bench_bad_rc("mkdir");
+			strcat(path, "/");
+			bench_dir_tree(path, depth, level + 1, is_create);
+			path[strlen(path) - 1] = 0;
+			if (!is_create && ufs_rmdir(path) != 0)
+				bench_bad_rc("rmdir");
+		}
+	}
+	path[size] = 0;
+}
+
+/** Thousands of opens and of listings per second. */
+static void
+bench_dirs(int depth, double *open_speed, double *list_speed)
+{
+	enum { DIR_OP_COUNT = 100000 };
+	char path[128] = "";
+	bench_dir_tree(path, depth, 0, true);
+	uint32_t leaf_count = 1;
+	for (int i = 0; i < depth; ++i)
+		leaf_count *= 10;
+	uint64_t start = bench_now_ns();
+	for (uint32_t i = 0; i < DIR_OP_COUNT; ++i) {
+		bench_dir_path(path, depth, rand() % leaf_count);
+		sprintf(path + strlen(path), "file%d", rand() % 10);
+		int fd = ufs_open(path, 0);
+		if (fd == -1 || ufs_close(fd) != 0)
+			bench_bad_rc("open");
+	}
+	*open_speed = (double)DIR_OP_COUNT * 1000000 /
+		(bench_now_ns() - start);
+	start = bench_now_ns();
+	for (uint32_t i = 0; i < DIR_OP_COUNT; ++i) {
+		bench_dir_path(path, depth, rand() % leaf_count);
+		struct ufs_dir *dir = ufs_opendir(path);
+		struct ufs_dirent e;
+		int count = 0;
+		while (dir != NULL && ufs_readdir(dir, &e) == 1)
+			++count;
+		if (dir == NULL || count != 10)
+			bench_bad_rc("opendir");
+		ufs_closedir(dir);
+	}
+	*list_speed = (double)DIR_OP_COUNT * 1000000 /
+		(bench_now_ns() - start);
+	path[0] = 0;
+	bench_dir_tree(path, depth, 0, false);
+}
+
+/** Thousands of close + open per second. */
+static double
+bench_descriptors(uint32_t count)
+{
+	int fd = ufs_open(bench_file_name, UFS_CREATE);
+	ufs_close(fd);
+	int *fds = malloc(count * sizeof(fds[0]));
+	for (uint32_t i = 0; i < count; ++i)
+		fds[i] = bench_open();
+	enum { REOPEN_COUNT = 100000 };
+	uint64_t start = bench_now_ns();
+	for (uint32_t i = 0; i < REOPEN_COUNT; ++i) {
+		uint32_t k = rand() % count;
+		if (ufs_close(fds[k]) != 0)
+			bench_bad_rc("close");
+		fds[k] = bench_open();
+	}
+	uint64_t duration = bench_now_ns() - start;
+	for (uint32_t i = 0; i < count; ++i)
+		ufs_close(fds[i]);
+	free(fds);
+	ufs_delete(bench_file_name);
+	return (double)REOPEN_COUNT * 1000000 / duration;
+}
+
+/** Thousands of files per second. */
+static double
+bench_churn(size_t size)
+{
+	enum { CHURN_COUNT = 20000 };
+	char *buf = malloc(size);
+	memset(buf, 'x', size);
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < CHURN_COUNT; ++i) {
+		int fd = ufs_open(bench_file_name, UFS_CREATE);
+		if (fd == -1)
+			bench_bad_rc("open");
+		if (ufs_write(fd, buf, size) != (ssize_t)size)
+			bench_bad_rc("write");
+		ufs_close(fd);
+		if (ufs_delete(bench_file_name) != 0)
+			bench_bad_rc("delete");
+	}
+	uint64_t duration = bench_now_ns() - start;
+	free(buf);
+	return (double)CHURN_COUNT * 1000000 / duration;
+}
+
+/**
+ * Microseconds to copy the big file, by a clone or by data, into
+ * @a copy_us. And MB per second of random writes into the copy.
+ */
+static void
+bench_clone(bool use_clone, double *copy_us, double *write_speed)
+{
+	const char *copy_name = "bench_copy";
+	uint64_t start = bench_now_ns();
+	if (use_clone) {
+		if (ufs_clone(bench_file_name, copy_name) != 0)
+			bench_bad_rc("clone");
+	} else {
+		char *buf = malloc(BENCH_WRITE_SIZE);
+		int src = bench_open();
+		int dst = ufs_open(copy_name, UFS_CREATE);
+		ssize_t rc;
+		while ((rc = ufs_read(src, buf, BENCH_WRITE_SIZE)) > 0) {
+			if (ufs_write(dst, buf, rc) != rc)
+				bench_bad_rc("write");
+		}
+		ufs_close(src);
+		ufs_close(dst);
+		free(buf);
+	}
+	*copy_us = (double)(bench_now_ns() - start) / 1000;
+	enum {
+		CHUNK_SIZE = 4096,
+		CHUNK_COUNT = BENCH_FILE_SIZE / CHUNK_SIZE,
+	};
+	char chunk[CHUNK_SIZE];
+	memset(chunk, 'y', sizeof(chunk));
+	int fd = ufs_open(copy_name, 0);
+	size_t total = 0;
+	start = bench_now_ns();
+	for (int i = 0; i < BENCH_RANDOM_READ_SIZE / CHUNK_SIZE; ++i) {
+		size_t offset = (size_t)(rand() % CHUNK_COUNT) * CHUNK_SIZE;
+		if (ufs_pwrite(fd, chunk, CHUNK_SIZE, offset) != CHUNK_SIZE)
+			bench_bad_rc("pwrite");
+		total += CHUNK_SIZE;
+	}
+	*write_speed = (double)total * 1000 / (bench_now_ns() - start);
+	ufs_close(fd);
+	ufs_delete(copy_name);
+}
+
+/** Sparse files per second. */
+static double
+bench_sparse(size_t size)
+{
+	enum { SPARSE_COUNT = 200, PIECE_COUNT = 16, PIECE_SIZE = 4096 };
+	char buf[PIECE_SIZE];
+	memset(buf, 'x', sizeof(buf));
+	int fd = ufs_open(bench_file_name, UFS_CREATE);
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < SPARSE_COUNT; ++i) {
+		if (ufs_resize(fd, size) != 0)
+			bench_bad_rc("resize");
+		for (int j = 0; j < PIECE_COUNT; ++j) {
+			size_t offset = rand() % (size - PIECE_SIZE);
+			ssize_t rc = ufs_pwrite(fd, buf, PIECE_SIZE, offset);
+			if (rc != PIECE_SIZE)
+				bench_bad_rc("pwrite");
+		}
+		if (ufs_resize(fd, 0) != 0)
+			bench_bad_rc("resize");
+	}
+	uint64_t duration = bench_now_ns() - start;
+	ufs_close(fd);
+	ufs_delete(bench_file_name);
+	return (double)SPARSE_COUNT * 1000000000 / duration;
+}
+
+/**
+ * Milliseconds to make @a count files in the heap, or to mount an
+ * image with them.
+ */
+static double
+bench_image(uint32_t count, size_t file_size, bool use_image)
+{
+	const char *path = "bench_image.img";
+	char *buf = malloc(file_size);
+	memset(buf, 'x', file_size);
+	char name[16];
+	if (use_image) {
+		unlink(path);
+		if (ufs_mount(path, count * file_size * 2 + (1 << 20)) != 0)
+			bench_bad_rc("mount");
+	}
+	uint64_t start = bench_now_ns();
+	for (uint32_t i = 0; i < count; ++i) {
+		sprintf(name, "file%u", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd == -1 ||
+		    ufs_write(fd, buf, file_size) != (ssize_t)file_size)
+			bench_bad_rc("write");
+		ufs_close(fd);
+	}
+	uint64_t duration = bench_now_ns() - start;
+	if (use_image) {
+		ufs_destroy();
+		start = bench_now_ns();
+		if (ufs_mount(path, 0) != 0)
+			bench_bad_rc("mount");
+		duration = bench_now_ns() - start;
+		sprintf(name, "file%u", count - 1);
+		int fd = ufs_open(name, 0);
+		if (fd == -1 ||
+		    ufs_read(fd, buf, file_size) != (ssize_t)file_size)
+			bench_bad_rc("read");
+		ufs_close(fd);
+	}
+	ufs_destroy();
+	unlink(path);
+	free(buf);
+	return (double)duration / 1000000;
+}
+
+static double
+bench_scan(size_t max, bool use_span)
+{
+	int fd = bench_open();
+	char *buf = malloc(max);
+	size_t total = 0;
+	uint64_t start = bench_now_ns();
+	ssize_t rc;
+	while (true) {
+		const char *data = buf;
+		if (use_span) {
+			struct ufs_span span;
+			rc = ufs_read_span(fd, max, &span);
+			data = span.data;
+		} else {
+			rc = ufs_read(fd, buf, max);
+		}
+		if (rc <= 0)
+			break;
+		if (memchr(data, '\n', rc) != NULL)
+			bench_bad_rc("scan");
+		total += rc;
+	}
+	uint64_t duration = bench_now_ns() - start;
+	free(buf);
+	ufs_close(fd);
+	if (total != BENCH_FILE_SIZE)
+		bench_bad_rc("read");
+	return (double)total * 1000 / duration;
+}
+
+enum bench_thread_mode {
+	BENCH_THREAD_READ_SHARED,
+	BENCH_THREAD_READ_OWN,
+	BENCH_THREAD_WRITE_OWN,
+	BENCH_THREAD_MODE_COUNT,
+};
+
+static const char *bench_thread_mode_titles[] = {
+	"Threads read one file, MB per second, thread count",
+	"Threads read own files, MB per second, thread count",
+	"Threads write own files, MB per second, thread count",
+};
+
+struct bench_thread {
+	pthread_t id;
+	int fd;
+	enum bench_thread_mode mode;
+	unsigned seed;
+};
+
+static void *
+bench_thread_f(void *arg)
+{
+	struct bench_thread *t = arg;
+	char buf[BENCH_THREAD_CHUNK_SIZE];
+	memset(buf, 'x', sizeof(buf));
+	enum {
+		CHUNK_COUNT = BENCH_THREAD_FILE_SIZE / BENCH_THREAD_CHUNK_SIZE,
+	};
+	for (int i = 0; i < BENCH_RANDOM_READ_SIZE / BENCH_THREAD_CHUNK_SIZE;
+	     ++i) {
+		size_t offset = (size_t)(rand_r(&t->seed) % CHUNK_COUNT) *
+			BENCH_THREAD_CHUNK_SIZE;
+		ssize_t rc;
+		if (t->mode == BENCH_THREAD_WRITE_OWN)
+			rc = ufs_pwrite(t->fd, buf, sizeof(buf), offset);
+		else
+			rc = ufs_pread(t->fd, buf, sizeof(buf), offset);
+		if (rc != (ssize_t)sizeof(buf))
+			bench_bad_rc("thread io");
+	}
+	return NULL;
+}
+
+static double
+bench_threads(int count, enum bench_thread_mode mode)
+{
+	struct bench_thread threads[BENCH_THREAD_COUNT_MAX];
+	char *buf = malloc(BENCH_THREAD_FILE_SIZE);
+	memset(buf, 'a', BENCH_THREAD_FILE_SIZE);
+	for (int i = 0; i < count; ++i) {
+		char name[16];
+		sprintf(name, "thread%d",
+			mode == BENCH_THREAD_READ_SHARED ? 0 : i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd == -1)
+			bench_bad_rc("open");
+		if (ufs_pwrite(fd, buf, BENCH_THREAD_FILE_SIZE, 0) !=
+		    BENCH_THREAD_FILE_SIZE)
+			bench_bad_rc("pwrite");
+		threads[i].fd = fd;
+		threads[i].mode = mode;
+		threads[i].seed = i + 1;
+	}
+	free(buf);
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < count; ++i) {
+		if (pthread_create(&threads[i].id, NULL, bench_thread_f,
+		    &threads[i]) != 0)
+			bench_bad_rc("pthread_create");
+	}
+	for (int i = 0; i < count; ++i)
+		pthread_join(threads[i].id, NULL);
+	uint64_t duration = bench_now_ns() - start;
+	for (int i = 0; i < count; ++i) {
+		char name[16];
+		sprintf(name, "thread%d", i);
+		ufs_close(threads[i].fd);
+		ufs_delete(name);
+	}
+	return (double)count * BENCH_RANDOM_READ_SIZE * 1000 / duration;
+}
+
+int
+main(void)
+{
+	const size_t block_sizes[] = {512, 1024 * 1024};
+	for (size_t i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]);
+	     ++i) {
+		double mb_per_sec[BENCH_RUN_COUNT];
+		ufs_set_block_size(512, block_sizes[i]);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+			uint64_t duration = bench_file_create();
+			mb_per_sec[run_i] = (double)BENCH_FILE_SIZE * 1000 /
+				duration;
+			ufs_delete(bench_file_name);
+		}
+		bench_print("Sequential write, MB per second, max block size",
+			block_sizes[i], mb_per_sec);
+	}
+
+	const size_t byte_sizes[] = {1, 8};
+	for (size_t i = 0; i < sizeof(byte_sizes) / sizeof(byte_sizes[0]);
+	     ++i) {
+		double write_speed[BENCH_RUN_COUNT];
+		double read_speed[BENCH_RUN_COUNT];
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+			bench_bytes(byte_sizes[i], &write_speed[run_i],
+				&read_speed[run_i]);
+		}
+		bench_print("Bytes write, MB per second, size", byte_sizes[i],
+			write_speed);
+		bench_print("Bytes read, MB per second, size", byte_sizes[i],
+			read_speed);
+	}
+
+	bench_file_create();
+	const size_t chunk_sizes[] = {64, 4096};
+	for (size_t i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]);
+	     ++i) {
+		double mb_per_sec[BENCH_RUN_COUNT];
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			mb_per_sec[run_i] = bench_sequential(chunk_sizes[i]);
+		bench_print("Sequential read, MB per second, chunk size",
+			chunk_sizes[i], mb_per_sec);
+		srand(1);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			mb_per_sec[run_i] = bench_random(chunk_sizes[i]);
+		bench_print("Random read, MB per second, chunk size",
+			chunk_sizes[i], mb_per_sec);
+	}
+	const int record_counts[] = {1, BENCH_RECORDS_PER_READ_MAX};
+	for (size_t i = 0; i < sizeof(record_counts) / sizeof(record_counts[0]);
+	     ++i) {
+		double mb_per_sec[BENCH_RUN_COUNT];
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			mb_per_sec[run_i] = bench_records(record_counts[i]);
+		bench_print("Records, MB per second, records per read",
+			record_counts[i], mb_per_sec);
+	}
+	const size_t scan_sizes[] = {4096, 1024 * 1024};
+	for (size_t i = 0; i < sizeof(scan_sizes) / sizeof(scan_sizes[0]);
+	     ++i) {
+		double mb_per_sec[BENCH_RUN_COUNT];
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			mb_per_sec[run_i] = bench_scan(scan_sizes[i], false);
+		bench_print("Scan by read, MB per second, buffer size",
+			scan_sizes[i], mb_per_sec);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			mb_per_sec[run_i] = bench_scan(scan_sizes[i], true);
+		bench_print("Scan by span, MB per second, max span size",
+			scan_sizes[i], mb_per_sec);
+	}
+	for (int use_clone = 0; use_clone <= 1; ++use_clone) {
+		double copy_us[BENCH_RUN_COUNT];
+		double write_speed[BENCH_RUN_COUNT];
+		srand(1);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+			bench_clone(use_clone, &copy_us[run_i],
+				&write_speed[run_i]);
+		}
+		const char *how = use_clone ? "clone" : "data";
+		char title[128];
+		snprintf(title, sizeof(title), "Copy by %s, microseconds, "
+			"file size", how);
+		bench_print(title, BENCH_FILE_SIZE, copy_us);
+		snprintf(title, sizeof(title), "Copy by %s, then writes, "
+			"MB per second, file size", how);
+		bench_print(title, BENCH_FILE_SIZE, write_speed);
+	}
+	ufs_delete(bench_file_name);
+
+	for (int mode = 0; mode < BENCH_THREAD_MODE_COUNT; ++mode) {
+		for (int count = 1; count <= BENCH_THREAD_COUNT_MAX;
+		     count *= 2) {
+			double mb_per_sec[BENCH_RUN_COUNT];
+			for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+				mb_per_sec[run_i] = bench_threads(count, mode);
+			bench_print(bench_thread_mode_titles[mode], count,
+				mb_per_sec);
+		}
+	}
+
+	const uint32_t file_counts[] = {10000, 1000000};
+	for (size_t i = 0; i < sizeof(file_counts) / sizeof(file_counts[0]);
+	     ++i) {
+		double times[BENCH_FILE_OP_COUNT][BENCH_RUN_COUNT];
+		srand(1);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+			double run_times[BENCH_FILE_OP_COUNT];
+			bench_files(file_counts[i], run_times);
+			for (int op = 0; op < BENCH_FILE_OP_COUNT; ++op)
+				times[op][run_i] = run_times[op];
+		}
+		for (int op = 0; op < BENCH_FILE_OP_COUNT; ++op) {
+			bench_print(bench_file_op_titles[op], file_counts[i],
+				times[op]);
+		}
+	}
+
+	const int dir_depths[] = {1, 4};
+	for (size_t i = 0; i < sizeof(dir_depths) / sizeof(dir_depths[0]);
+	     ++i) {
+		double open_speed[BENCH_RUN_COUNT];
+		double list_speed[BENCH_RUN_COUNT];
+		srand(1);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+			bench_dirs(dir_depths[i], &open_speed[run_i],
+				&list_speed[run_i]);
+		}
+		bench_print("Dirs open, K per second, depth", dir_depths[i],
+			open_speed);
+		bench_print("Dirs list, K per second, depth", dir_depths[i],
+			list_speed);
+	}
+
+	const uint32_t desc_counts[] = {100, 100000};
+	for (size_t i = 0; i < sizeof(desc_counts) / sizeof(desc_counts[0]);
+	     ++i) {
+		double k_per_sec[BENCH_RUN_COUNT];
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			k_per_sec[run_i] = bench_descriptors(desc_counts[i]);
+		bench_print("Descriptors reopen, K per second, open count",
+			desc_counts[i], k_per_sec);
+	}
+
+	const size_t churn_sizes[] = {4096, 64 * 1024};
+	for (size_t i = 0; i < sizeof(churn_sizes) / sizeof(churn_sizes[0]);
+	     ++i) {
+		double k_per_sec[BENCH_RUN_COUNT];
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			k_per_sec[run_i] = bench_churn(churn_sizes[i]);
+		bench_print("Churn, K files per second, file size",
+			churn_sizes[i], k_per_sec);
+	}
+
+	const size_t sparse_sizes[] = {1024 * 1024, 64 * 1024 * 1024};
+	for (size_t i = 0; i < sizeof(sparse_sizes) / sizeof(sparse_sizes[0]);
+	     ++i) {
+		double per_sec[BENCH_RUN_COUNT];
+		srand(1);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			per_sec[run_i] = bench_sparse(sparse_sizes[i]);
+		bench_print("Sparse, files per second, file size",
+			sparse_sizes[i], per_sec);
+	}
+
+	const struct {
+		uint32_t count;
+		size_t size;
+	} images[] = {{1000, 4096}, {100000, 4096}, {64, 1024 * 1024}};
+	for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); ++i) {
+		double ms[BENCH_RUN_COUNT];
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+			ms[run_i] = bench_image(images[i].count, images[i].size,
+				false);
+		}
+		bench_print("Image rebuild in heap, ms, file count",
+			images[i].count, ms);
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+			ms[run_i] = bench_image(images[i].count, images[i].size,
+				true);
+		}
+		bench_print("Image mount, ms, file count", images[i].count, ms);
+	}
+	ufs_destroy();
+	return 0;
+}
@@ -1,8 +1,12 @@
 #include "userfs.h"
 #include "unit.h"
 #include <assert.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -70,6 +74,72 @@ test_stress_open(void)
 	unit_test_finish();
 }
 
+static void
+test_many_files(void)
+{
+	unit_test_start();
+
+	const int count = 10000;
+	char name[16];
+	unit_msg("create %d files and delete a half of them", count);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "f%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, name, strlen(name) + 1) <= 0);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	for (int i = 0; i < count; i += 2) {
+		sprintf(name, "f%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < count && ok; ++i) {
+		sprintf(name, "f%d", i);
+		int fd = ufs_open(name, 0);
+		if (i % 2 == 0) {
+			ok = fd == -1 && ufs_errno() == UFS_ERR_NO_FILE;
+			continue;
+		}
+		char buf[16];
+		ok = fd != -1 && ufs_read(fd, buf, sizeof(buf)) ==
+			(ssize_t)strlen(name) + 1 && strcmp(buf, name) == 0;
+		ok = ufs_close(fd) == 0 && ufs_delete(name) == 0 && ok;
+	}
+	unit_check(ok, "the rest are found, the deleted ones are not");
+
+	unit_test_finish();
+}
+
+static void
+test_fd_reuse(void)
+{
+	unit_test_start();
+
+	const int count = 10000;
+	int *fds = malloc(count * sizeof(fds[0]));
+	bool ok = true;
+	for (int i = 0; i < count && ok; ++i) {
+		fds[i] = ufs_open("file", UFS_CREATE);
+		ok = fds[i] == i;
+	}
+	unit_check(ok, "descriptors are taken in order");
+	for (int i = 7; i < count; i += 1000)
+		unit_fail_if(ufs_close(fds[i]) != 0);
+	unit_fail_if(ufs_close(fds[count - 1]) != 0);
+	for (int i = 7; i < count && ok; i += 1000)
+		ok = ufs_open("file", 0) == i;
+	unit_check(ok, "the lowest free descriptor is taken first");
+	unit_check(ufs_open("file", 0) == count - 1, "then the last one");
+	unit_check(ufs_open("file", 0) == count, "then a new one");
+	for (int i = 0; i <= count; ++i)
+		unit_fail_if(ufs_close(i) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	free(fds);
+
+	unit_test_finish();
+}
+
 static void
 test_close(void)
 {
@@ -469,6 +539,812 @@ test_resize(void)
 #endif
 }
 
+static void
+test_positional_io(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pwrite(fd, "hello", 5, 1000) == 5, "pwrite beyond end");
+	char buf[2048];
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 1005,
+		"the position was not moved");
+	bool ok = memcmp(buf + 1000, "hello", 5) == 0;
+	for (int i = 0; i < 1000 && ok; ++i)
+		ok = buf[i] == 0;
+	unit_check(ok, "the gap is zeros");
+	unit_check(ufs_pread(fd, buf, 3, 1001) == 3, "pread");
+	unit_check(memcmp(buf, "ell", 3) == 0, "got the data");
+	unit_check(ufs_pread(fd, buf, 100, 1003) == 2, "pread at the end");
+	unit_check(ufs_pread(fd, buf, 100, 5000) == 0, "pread beyond end");
+	unit_check(ufs_read(fd, buf, 1) == 0, "the position is still the end");
+	unit_check(ufs_pwrite(fd, "a", 1, 1024 * 1024 * 100) == -1,
+		"can not pwrite over max file size");
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM, "errno is set");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	char data[3000];
+	for (size_t i = 0; i < sizeof(data); ++i)
+		data[i] = 'a' + i % 26;
+	struct iovec iov[] = {
+		{data, 10}, {data + 10, 0}, {data + 10, 990},
+		{data + 1000, 2000},
+	};
+	int iovcnt = sizeof(iov) / sizeof(iov[0]);
+	unit_check(ufs_writev(fd, iov, iovcnt) == 3000, "writev");
+	unit_check(ufs_pread(fd, buf, 5, 2995) == 5, "pread its end");
+	unit_check(memcmp(buf, data + 2995, 5) == 0, "got the data");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	char out[3100];
+	memset(out, 0, sizeof(out));
+	struct iovec out_iov[] = {
+		{out, 1}, {out + 1, 1500}, {out + 1501, 0}, {out + 1501, 1599},
+	};
+	unit_check(ufs_readv(fd, out_iov, 4) == 3000, "readv till the end");
+	unit_check(memcmp(out, data, 3000) == 0, "got all the data");
+	unit_check(ufs_readv(fd, out_iov, 4) == 0, "then EOF");
+	unit_fail_if(ufs_close(fd) != 0);
+
+#if NEED_OPEN_FLAGS
+	fd = ufs_open("file", UFS_READ_ONLY);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pwrite(fd, "a", 1, 0) == -1, "no pwrite in read only");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION, "errno is set");
+	unit_check(ufs_writev(fd, iov, 1) == -1, "no writev in read only");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("file", UFS_WRITE_ONLY);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pread(fd, buf, 1, 0) == -1, "no pread in write only");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION, "errno is set");
+	unit_check(ufs_readv(fd, out_iov, 1) == -1, "no readv in write only");
+	unit_fail_if(ufs_close(fd) != 0);
+#endif
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_read_span(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char data[5000];
+	for (size_t i = 0; i < sizeof(data); ++i)
+		data[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, data, sizeof(data)) != sizeof(data));
+	unit_fail_if(ufs_close(fd) != 0);
+
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	struct ufs_span span;
+	size_t progress = 0;
+	bool ok = true;
+	while (ok) {
+		ssize_t rc = ufs_read_span(fd, 700, &span);
+		if (rc <= 0) {
+			ok = rc == 0 && span.size == 0;
+			break;
+		}
+		ok = span.size == (size_t)rc && rc <= 700 &&
+			memcmp(span.data, data + progress, rc) == 0;
+		progress += rc;
+	}
+	unit_check(ok && progress == sizeof(data), "read all by spans");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	struct ufs_span spans[2];
+	unit_fail_if(ufs_pread_span(fd, 700, 2048, &spans[0]) != 700);
+	unit_fail_if(ufs_pread_span(fd, 100, 10, &spans[1]) != 100);
+	unit_check(ufs_pread_span(fd, 100, 5000, &span) == 0,
+		"no span at the end");
+	unit_check(ufs_read_span(fd, 100, &span) == 100 &&
+		memcmp(span.data, data, 100) == 0, "the position is the same");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_check(memcmp(spans[0].data, data + 2048, 700) == 0 &&
+		memcmp(spans[1].data, data + 10, 100) == 0,
+		"many spans live on after the file");
+	ufs_span_release(&spans[0]);
+	ufs_span_release(&spans[1]);
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, data, sizeof(data)) != sizeof(data));
+	unit_fail_if(ufs_close(fd) != 0);
+
+#if NEED_RESIZE
+	fd = ufs_open("file", 0);
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd == -1 || fd2 == -1);
+	char buf[4000];
+	unit_fail_if(ufs_read(fd, buf, 3000) != 3000);
+	unit_fail_if(ufs_read_span(fd, 100, &span) != 100);
+	unit_fail_if(ufs_resize(fd2, 10) != 0);
+	int tmp = ufs_open("tmp", UFS_CREATE);
+	memset(buf, 'z', sizeof(buf));
+	unit_fail_if(ufs_write(tmp, buf, sizeof(buf)) != sizeof(buf));
+	unit_check(memcmp(span.data, data + 3000, 100) == 0,
+		"span survives the shrink of its block");
+	unit_check(ufs_read_span(fd, 100, &span) == 0,
+		"then the descriptor is at the new end");
+	unit_fail_if(ufs_close(tmp) != 0);
+	unit_fail_if(ufs_delete("tmp") != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+#endif
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static bool
+test_is_zero(const char *buf, size_t size)
+{
+	for (size_t i = 0; i < size; ++i) {
+		if (buf[i] != 0)
+			return false;
+	}
+	return true;
+}
+
+static void
+test_sparse(void)
+{
+#if NEED_RESIZE
+	unit_test_start();
+
+	enum { SIZE = 10 * 1024 * 1024, MIDDLE = SIZE / 2 };
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_resize(fd, SIZE) != 0);
+	static char buf[64 * 1024];
+	memset(buf, 1, sizeof(buf));
+	unit_check(ufs_pread(fd, buf, sizeof(buf), MIDDLE) == sizeof(buf) &&
+		test_is_zero(buf, sizeof(buf)), "a hole reads as zeros");
+
+	unit_fail_if(ufs_pwrite(fd, "abc", 3, MIDDLE) != 3);
+	memset(buf, 1, sizeof(buf));
+	unit_fail_if(ufs_pread(fd, buf, 1000, MIDDLE - 500) != 1000);
+	unit_check(test_is_zero(buf, 500) &&
+		memcmp(buf + 500, "abc", 3) == 0 &&
+		test_is_zero(buf + 503, 497),
+		"a write into a hole is surrounded by zeros");
+
+	struct ufs_span span;
+	unit_fail_if(ufs_read_span(fd, SIZE, &span) <= 0);
+	unit_check(test_is_zero(span.data, span.size), "a span of a hole");
+
+	unit_fail_if(ufs_resize(fd, MIDDLE + 1) != 0);
+	unit_fail_if(ufs_resize(fd, SIZE) != 0);
+	memset(buf, 1, sizeof(buf));
+	unit_fail_if(ufs_pread(fd, buf, 1000, MIDDLE) != 1000);
+	unit_check(buf[0] == 'a' && test_is_zero(buf + 1, 999),
+		"shrink and grow give zeros after the cut");
+
+	unit_fail_if(ufs_resize(fd, 100) != 0);
+	unit_fail_if(ufs_pwrite(fd, "x", 1, 3000) != 1);
+	memset(buf, 1, sizeof(buf));
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 3001 &&
+		test_is_zero(buf, 3000) && buf[3000] == 'x',
+		"a write after the end leaves zeros in the gap");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	static char data[300000];
+	static char buf[300000];
+	for (size_t i = 0; i < sizeof(data); ++i)
+		data[i] = 'a' + i % 23;
+	unit_check(ufs_clone("no_file", "copy") == -1 &&
+		ufs_errno() == UFS_ERR_NO_FILE, "clone of no file");
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, data, sizeof(data)) != sizeof(data));
+	unit_fail_if(ufs_clone("file", "copy") != 0);
+	unit_check(ufs_clone("file", "file") == 0, "clone to itself");
+
+	unit_fail_if(ufs_pwrite(fd, "XYZ", 3, 1000) != 3);
+	unit_fail_if(ufs_write(fd, "tail", 4) != 4);
+	int copy = ufs_open("copy", 0);
+	unit_fail_if(copy == -1);
+	unit_check(ufs_read(copy, buf, sizeof(buf)) == sizeof(data) &&
+		memcmp(buf, data, sizeof(data)) == 0,
+		"the clone doesn't see the writes into the original");
+
+	unit_fail_if(ufs_pwrite(copy, "abc", 3, 200000) != 3);
+	unit_fail_if(ufs_pread(fd, buf, 3, 200000) != 3);
+	unit_check(memcmp(buf, data + 200000, 3) == 0 &&
+		ufs_pread(fd, buf, 3, 1000) == 3 && memcmp(buf, "XYZ", 3) == 0,
+		"the original doesn't see the writes into the clone");
+
+	struct ufs_span span;
+	unit_fail_if(ufs_read_span(fd, 100, &span) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("file", 0);
+	unit_fail_if(ufs_read_span(fd, 100, &span) != 100);
+	unit_fail_if(ufs_pwrite(fd, "123", 3, 0) != 3);
+	unit_check(memcmp(span.data, data, 100) == 0,
+		"a span is a snapshot too");
+
+#if NEED_RESIZE
+	unit_fail_if(ufs_resize(copy, 1500) != 0);
+	unit_fail_if(ufs_resize(copy, 2000) != 0);
+	unit_fail_if(ufs_pread(copy, buf, sizeof(buf), 0) != 2000);
+	unit_check(memcmp(buf, data, 1500) == 0 && test_is_zero(buf + 1500,
+		500), "a shrink and a grow of the clone");
+	unit_fail_if(ufs_pread(fd, buf, 1000, 1000) != 1000);
+	unit_check(memcmp(buf, "XYZ", 3) == 0 &&
+		memcmp(buf + 3, data + 1003, 997) == 0,
+		"and the original has its data after the clone's end");
+#endif
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_clone("copy", "file") != 0);
+	unit_fail_if(ufs_clone("copy", "file") != 0);
+	fd = ufs_open("file", 0);
+	memset(buf, 0, sizeof(buf));
+	unit_check(ufs_read(fd, buf, sizeof(buf)) > 0 &&
+		memcmp(buf, data, 1000) == 0,
+		"a clone replaces an existing file");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(copy) != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static int
+test_dir_count(const char *path, int *dir_count)
+{
+	struct ufs_dir *dir = ufs_opendir(path);
+	if (dir == NULL)
+		return -1;
+	int count = 0;
+	*dir_count = 0;
+	struct ufs_dirent e;
+	while (ufs_readdir(dir, &e) == 1) {
+		++count;
+		*dir_count += e.is_dir;
+	}
+	ufs_closedir(dir);
+	return count;
+}
+
+static void
+test_dirs(void)
+{
+	unit_test_start();
+
+	int dir_count;
+	unit_check(ufs_open("a/file", UFS_CREATE) == -1 &&
+		ufs_errno() == UFS_ERR_NO_FILE, "no file in no directory");
+	unit_check(ufs_mkdir("a/b") == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		"no directory in no directory");
+	unit_fail_if(ufs_mkdir("a") != 0);
+	unit_fail_if(ufs_mkdir("/a/b") != 0);
+	unit_check(ufs_mkdir("a/b") == -1 && ufs_errno() == UFS_ERR_EXISTS,
+		"mkdir of an existing directory");
+	int fd = ufs_open("a/b/file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "data", 4) != 4);
+	unit_fail_if(ufs_close(fd) != 0);
+	char buf[16];
+	fd = ufs_open("/a//b/file", 0);
+	unit_check(fd != -1 && ufs_read(fd, buf, sizeof(buf)) == 4 &&
+		memcmp(buf, "data", 4) == 0, "the extra slashes are skipped");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("file", 0) == -1 && ufs_open("a/file", 0) == -1,
+		"the file is only in its directory");
+	unit_check(ufs_open("a/b", 0) == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		"a directory can't be opened as a file");
+	unit_check(ufs_open("a/b", UFS_CREATE) == -1 &&
+		ufs_errno() == UFS_ERR_EXISTS, "nor created as one");
+	unit_check(ufs_mkdir("a/b/file") == -1 &&
+		ufs_errno() == UFS_ERR_EXISTS, "a file is not a directory");
+	unit_check(ufs_open("a/b/file/x", UFS_CREATE) == -1 &&
+		ufs_errno() == UFS_ERR_NO_FILE, "nor is a part of a path");
+
+	for (int i = 0; i < 100; ++i) {
+		char name[32];
+		sprintf(name, "a/f%d", i);
+		fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_fail_if(ufs_clone("a/b/file", "a/copy") != 0);
+	unit_check(ufs_clone("a/b/file", "a/b") == -1 &&
+		ufs_errno() == UFS_ERR_EXISTS, "can't clone over a directory");
+	unit_check(test_dir_count("a", &dir_count) == 102 && dir_count == 1,
+		"listing of a directory");
+	unit_check(test_dir_count("/", &dir_count) == 1 && dir_count == 1,
+		"listing of the root");
+	unit_check(ufs_opendir("a/f1") == NULL &&
+		ufs_errno() == UFS_ERR_NO_FILE, "a file can't be listed");
+	struct ufs_attr attr;
+	unit_check(ufs_getattr("a/b/file", &attr) == 0 && !attr.is_dir &&
+		attr.size == 4, "attributes of a file");
+	unit_check(ufs_getattr("a/b", &attr) == 0 && attr.is_dir &&
+		ufs_getattr("/", &attr) == 0 && attr.is_dir,
+		"of a directory and of the root");
+	unit_check(ufs_getattr("a/x", &attr) == -1 &&
+		ufs_errno() == UFS_ERR_NO_FILE, "of nothing");
+	struct ufs_stats st;
+	ufs_stats(&st);
+	unit_check(st.file_count == 102 && st.dir_count == 2, "stats");
+
+	unit_check(ufs_rmdir("a/b") == -1 && ufs_errno() == UFS_ERR_NOT_EMPTY,
+		"rmdir of a non-empty directory");
+	fd = ufs_open("a/b/file", 0);
+	unit_fail_if(ufs_delete("a/b/file") != 0);
+	unit_fail_if(ufs_rmdir("a/b") != 0);
+	unit_check(ufs_open("a/b/file", 0) == -1 &&
+		ufs_read(fd, buf, sizeof(buf)) == 4,
+		"a deleted file lives in its descriptor without the directory");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_rmdir("a/b") == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		"the path is not cached after rmdir");
+	unit_fail_if(ufs_mkdir("a/b") != 0);
+	unit_check(test_dir_count("a/b", &dir_count) == 0,
+		"a new directory of the same path is empty");
+	ufs_destroy();
+	unit_check(ufs_opendir("a") == NULL, "destroy deletes the directories");
+
+	const char *path = "test_dirs.img";
+	unlink(path);
+	unit_fail_if(ufs_mount(path, 1024 * 1024) != 0);
+	unit_fail_if(ufs_mkdir("x") != 0);
+	unit_fail_if(ufs_mkdir("x/empty") != 0);
+	unit_fail_if(ufs_mkdir("x/y") != 0);
+	fd = ufs_open("x/y/file", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "data", 4) != 4);
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+	unit_fail_if(ufs_mount(path, 0) != 0);
+	fd = ufs_open("x/y/file", 0);
+	unit_check(fd != -1 && ufs_read(fd, buf, sizeof(buf)) == 4 &&
+		test_dir_count("x/empty", &dir_count) == 0 &&
+		test_dir_count("x", &dir_count) == 2 && dir_count == 2,
+		"the directories are back after the mount");
+	ufs_destroy();
+	unlink(path);
+
+	unit_test_finish();
+}
+
+enum {
+	TEST_THREAD_COUNT = 4,
+	TEST_THREAD_ITER_COUNT = 2000,
+	TEST_THREAD_CHUNK_SIZE = 3000,
+};
+
+static void *
+test_threads_worker(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	char name[16];
+	sprintf(name, "t%d", id);
+	int own = ufs_open(name, UFS_CREATE);
+	int shared = ufs_open("shared", 0);
+	if (own == -1 || shared == -1)
+		return "open failed";
+	char chunk[TEST_THREAD_CHUNK_SIZE];
+	char buf[TEST_THREAD_CHUNK_SIZE];
+	memset(chunk, 'a' + id, sizeof(chunk));
+	for (int i = 0; i < TEST_THREAD_ITER_COUNT; ++i) {
+		if (ufs_write(own, chunk, sizeof(chunk)) != sizeof(chunk))
+			return "write failed";
+		/* A chunk is written at once, never seen half-written. */
+		if (ufs_pwrite(shared, chunk, sizeof(chunk), 100) !=
+		    sizeof(chunk))
+			return "pwrite failed";
+		if (ufs_pread(shared, buf, sizeof(buf), 100) != sizeof(buf))
+			return "pread failed";
+		for (size_t j = 1; j < sizeof(buf); ++j) {
+			if (buf[j] != buf[0])
+				return "torn read";
+		}
+		if (ufs_open("no_such_file", 0) != -1 ||
+		    ufs_errno() != UFS_ERR_NO_FILE)
+			return "no error";
+		if (i % 100 != 0)
+			continue;
+		/* A clone is a consistent snapshot, and is own. */
+		char clone_name[16];
+		sprintf(clone_name, "c%d", id);
+		if (ufs_clone("shared", clone_name) != 0)
+			return "clone failed";
+		int clone = ufs_open(clone_name, 0);
+		if (ufs_pwrite(clone, chunk, 10, 100) != 10 ||
+		    ufs_pread(clone, buf, sizeof(buf), 100) != sizeof(buf))
+			return "clone io failed";
+		if (memcmp(buf, chunk, 10) != 0)
+			return "clone lost a write";
+		for (size_t j = 11; j < sizeof(buf); ++j) {
+			if (buf[j] != buf[10])
+				return "torn clone";
+		}
+		if (ufs_close(clone) != 0 || ufs_delete(clone_name) != 0)
+			return "clone delete failed";
+	}
+	if (ufs_close(own) != 0 || ufs_close(shared) != 0)
+		return "close failed";
+	own = ufs_open(name, 0);
+	for (int i = 0; i < TEST_THREAD_ITER_COUNT; ++i) {
+		if (ufs_read(own, buf, sizeof(buf)) != sizeof(buf) ||
+		    memcmp(buf, chunk, sizeof(buf)) != 0)
+			return "wrong own data";
+	}
+	if (ufs_close(own) != 0 || ufs_delete(name) != 0)
+		return "delete failed";
+	return NULL;
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct ufs_stats base, st;
+	ufs_stats(&base);
+	static char data[1000];
+	memset(data, 'a', sizeof(data));
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, data, sizeof(data)) != sizeof(data));
+	ufs_stats(&st);
+	unit_check(st.file_count == base.file_count + 1 &&
+		st.descriptor_count == base.descriptor_count + 1,
+		"a file and a descriptor are counted");
+	/* Two blocks of 512 bytes. */
+	unit_check(st.block_count == base.block_count + 2 &&
+		st.reserved_size == base.reserved_size + 1024 &&
+		st.used_size == base.used_size + 1000 &&
+		st.fragmented_size == base.fragmented_size + 24,
+		"the blocks, the data, and the tail of the last block");
+
+	unit_fail_if(ufs_clone("file", "copy") != 0);
+	ufs_stats(&st);
+	unit_check(st.file_count == base.file_count + 2 &&
+		st.block_count == base.block_count + 2 &&
+		st.used_size == base.used_size + 1000,
+		"a clone takes no blocks and its data is not counted twice");
+	int copy = ufs_open("copy", 0);
+	unit_fail_if(ufs_write(copy, "b", 1) != 1);
+	ufs_stats(&st);
+	unit_check(st.block_count == base.block_count + 3 &&
+		st.reserved_size == base.reserved_size + 1536 &&
+		st.used_size == base.used_size + 1512,
+		"a write into the clone copies one block");
+
+	unit_fail_if(ufs_delete("file") != 0);
+	ufs_stats(&st);
+	unit_check(st.file_count == base.file_count + 1 &&
+		st.used_size == base.used_size + 1512,
+		"a deleted file still opened is counted by its descriptor");
+	size_t cached_size = st.cached_size;
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(copy) != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+	ufs_stats(&st);
+	unit_check(st.file_count == base.file_count &&
+		st.descriptor_count == base.descriptor_count &&
+		st.block_count == base.block_count &&
+		st.reserved_size == base.reserved_size &&
+		st.used_size == base.used_size &&
+		st.cached_size == cached_size + 1536,
+		"all is freed, and the blocks are kept for reuse");
+
+#if NEED_LATENCY
+	uint64_t writes = 0;
+	for (int i = 0; i < UFS_LATENCY_BUCKET_COUNT; ++i)
+		writes += st.latency[UFS_OP_WRITE][i] -
+			base.latency[UFS_OP_WRITE][i];
+	unit_check(writes == 2, "the writes are in the latency histogram");
+#endif
+
+	unit_test_finish();
+}
+
+static void
+test_compact(void)
+{
+	unit_test_start();
+
+	enum { MB = 1024 * 1024, SIZE = 10 * MB };
+	static char buf[SIZE];
+	static char zeros[4096];
+	int copy_fd = ufs_open("hot", UFS_CREATE);
+	unit_fail_if(ufs_write(copy_fd, "abc", 3) != 3);
+	unit_fail_if(ufs_clone("hot", "cloned") != 0);
+	/* A byte per each 1 MB block, and a block of zeros. */
+	int fd = ufs_open("sparse", UFS_CREATE);
+	int fd2 = ufs_open("sparse2", UFS_CREATE);
+	unit_fail_if(fd == -1 || fd2 == -1);
+	for (int i = 0; i < 9; ++i) {
+		char c = 'a' + i;
+		unit_fail_if(ufs_pwrite(fd, &c, 1, (size_t)i * MB + 100) != 1);
+		unit_fail_if(ufs_pwrite(fd2, &c, 1, (size_t)i * MB) != 1);
+	}
+	unit_fail_if(ufs_pwrite(fd, zeros, sizeof(zeros), SIZE - 4096) !=
+		     sizeof(zeros));
+	unit_fail_if(ufs_read(fd, buf, MB + 50) != MB + 50);
+
+	unit_check(ufs_compact(0) == 0, "the first call only finds the "
+		   "written files");
+	struct ufs_stats before, after;
+	ufs_stats(&before);
+	unit_check(ufs_compact(1) > 0, "a call with a budget compacts a "
+		   "file");
+	ufs_stats(&after);
+	unit_check(after.reserved_size < before.reserved_size - 4 * MB,
+		   "its big blocks are given back");
+	size_t freed = ufs_compact(1);
+	ufs_stats(&before);
+	unit_check(freed > 0 &&
+		   before.reserved_size == after.reserved_size - freed,
+		   "the next call compacts the other file");
+	unit_check(before.reserved_size < 64 * 1024, "only the data is kept");
+	unit_check(ufs_compact(0) == 0, "the compacted and the shared files "
+		   "stay");
+
+	unit_fail_if(ufs_read(fd, buf, 100) != 100);
+	unit_check(buf[50] == 'b', "the descriptor goes on from its "
+		   "position");
+	unit_fail_if(ufs_pread(fd, buf, SIZE, 0) != SIZE);
+	bool is_ok = true;
+	for (size_t i = 0; i < SIZE && is_ok; ++i) {
+		char expected = i % MB == 100 && i < 9 * MB ? 'a' + i / MB : 0;
+		is_ok = buf[i] == expected;
+	}
+	unit_check(is_ok, "the data is the same");
+	unit_fail_if(ufs_pread(fd2, buf, 2, 8 * MB) != 1 || buf[0] != 'i');
+
+	memset(buf, 'z', SIZE);
+	unit_fail_if(ufs_pwrite(fd, buf, SIZE, 0) != SIZE);
+	unit_fail_if(ufs_pread(fd, buf, SIZE, 0) != SIZE);
+	unit_check(buf[0] == 'z' && buf[SIZE - 1] == 'z' &&
+		   buf[5 * MB + 7] == 'z', "a compacted file is written again");
+	ufs_stats(&before);
+	ufs_compact(0);
+	ufs_compact(0);
+	ufs_stats(&after);
+	unit_check(after.block_count < before.block_count / 10 &&
+		   after.used_size == before.used_size,
+		   "the dense data is moved back into the big blocks");
+	unit_fail_if(ufs_pread(fd, buf, 3, SIZE - 2) != 2);
+	unit_check(buf[0] == 'z' && buf[1] == 'z', "with the data");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(copy_fd) != 0);
+	unit_fail_if(ufs_delete("sparse") != 0);
+	unit_fail_if(ufs_delete("sparse2") != 0);
+	unit_fail_if(ufs_delete("hot") != 0);
+	unit_fail_if(ufs_delete("cloned") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	int ro = ufs_open("shared", UFS_READ_ONLY);
+	unit_fail_if(ro == -1);
+	unit_fail_if(ufs_write(ro, "a", 1) != -1);
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_PERMISSION);
+	pthread_t threads[TEST_THREAD_COUNT];
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+		unit_fail_if(pthread_create(&threads[i], NULL,
+			test_threads_worker, (void *)(intptr_t)i) != 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+		void *err;
+		pthread_join(threads[i], &err);
+		if (err != NULL) {
+			unit_msg("thread %d: %s", i, (const char *)err);
+			ok = false;
+		}
+	}
+	unit_check(ok, "threads work with own and shared files");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION,
+		"errno of this thread is not changed by the others");
+	unit_fail_if(ufs_close(ro) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_block_size(void)
+{
+	unit_test_start();
+
+	const size_t sizes[][2] = {{512, 512}, {1, 1}, {16, 4096}, {3, 100}};
+	const size_t data_size = 100000;
+	char *data = malloc(data_size);
+	char *buf = malloc(data_size);
+	for (size_t i = 0; i < data_size; ++i)
+		data[i] = 'a' + i % 23;
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		unit_msg("blocks from %zu to %zu bytes", sizes[i][0],
+			sizes[i][1]);
+		ufs_set_block_size(sizes[i][0], sizes[i][1]);
+		int fd = ufs_open("file", UFS_CREATE);
+		unit_fail_if(fd == -1);
+		size_t progress = 0;
+		while (progress < data_size) {
+			size_t to_write = progress % 1234 + 1;
+			if (to_write > data_size - progress)
+				to_write = data_size - progress;
+			ssize_t rc = ufs_write(fd, data + progress, to_write);
+			unit_fail_if(rc != (ssize_t)to_write);
+			progress += rc;
+		}
+		unit_fail_if(ufs_close(fd) != 0);
+		fd = ufs_open("file", 0);
+		unit_fail_if(fd == -1);
+		progress = 0;
+		while (progress < data_size) {
+			ssize_t rc = ufs_read(fd, buf + progress,
+				progress % 777 + 1);
+			unit_fail_if(rc <= 0);
+			progress += rc;
+		}
+		unit_fail_if(ufs_read(fd, buf, 1) != 0);
+		unit_check(memcmp(data, buf, data_size) == 0,
+			"data is correct");
+#if NEED_RESIZE
+		unit_fail_if(ufs_resize(fd, 5000) != 0);
+		unit_fail_if(ufs_resize(fd, 6000) != 0);
+		unit_fail_if(ufs_close(fd) != 0);
+		fd = ufs_open("file", 0);
+		unit_fail_if(ufs_read(fd, buf, data_size) != 6000);
+		bool ok = memcmp(buf, data, 5000) == 0;
+		for (int j = 5000; j < 6000 && ok; ++j)
+			ok = buf[j] == 0;
+		unit_check(ok, "resized data is correct");
+#endif
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete("file") != 0);
+	}
+	ufs_set_block_size(512, 1024 * 1024);
+	free(buf);
+	free(data);
+
+	unit_test_finish();
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	const char *path = "test_image.img";
+	unlink(path);
+	ufs_destroy();
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_check(ufs_mount(path, 1024 * 1024) == -1 &&
+		ufs_errno() == UFS_ERR_IO, "can't mount a non-empty FS");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_fail_if(ufs_mount(path, 4 * 1024 * 1024) != 0);
+	static char data[100000];
+	static char buf[200000];
+	for (size_t i = 0; i < sizeof(data); ++i)
+		data[i] = 'a' + i % 23;
+	fd = ufs_open("a", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, data, sizeof(data)) != sizeof(data));
+	int fd2 = ufs_open("c", UFS_CREATE);
+	unit_fail_if(ufs_write(fd2, data, 5000) != 5000);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("c") != 0);
+#if NEED_RESIZE
+	fd2 = ufs_open("b", UFS_CREATE);
+	unit_fail_if(ufs_resize(fd2, 50 * 1024 * 1024) != 0);
+	unit_fail_if(ufs_pwrite(fd2, "xyz", 3, 30 * 1024 * 1024) != 3);
+	unit_fail_if(ufs_close(fd2) != 0);
+#endif
+	unit_fail_if(ufs_clone("a", "a_copy") != 0);
+	struct ufs_stats saved;
+	ufs_stats(&saved);
+	/* The open descriptor is closed and the file is saved. */
+	ufs_destroy();
+
+	unit_fail_if(ufs_mount(path, 0) != 0);
+	struct ufs_stats st;
+	ufs_stats(&st);
+	unit_check(st.file_count == saved.file_count &&
+		st.used_size == saved.used_size &&
+		st.block_count == saved.block_count + 1,
+		"the mount counts the blocks, and one more for the file list");
+	fd = ufs_open("a", 0);
+	unit_check(fd != -1 && ufs_read(fd, buf, sizeof(buf)) ==
+		sizeof(data) && memcmp(buf, data, sizeof(data)) == 0,
+		"a file is back after the mount");
+	unit_check(ufs_open("c", 0) == -1, "a deleted file is not");
+	fd2 = ufs_open("a_copy", 0);
+	unit_fail_if(ufs_pwrite(fd2, "!", 1, 0) != 1);
+	unit_check(ufs_pread(fd, buf, 1, 0) == 1 && buf[0] == data[0],
+		"a clone is still copy-on-write after the mount");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("a_copy") != 0);
+#if NEED_RESIZE
+	fd2 = ufs_open("b", 0);
+	memset(buf, 1, 10);
+	unit_check(fd2 != -1 &&
+		ufs_pread(fd2, buf, 10, 30 * 1024 * 1024 - 2) == 10 &&
+		memcmp(buf, "\0\0xyz\0\0\0\0\0", 10) == 0 &&
+		ufs_pread(fd2, buf, 10, 50 * 1024 * 1024 - 5) == 5,
+		"a sparse file is back");
+	unit_fail_if(ufs_close(fd2) != 0);
+#endif
+
+	fd2 = ufs_open("big", UFS_CREATE);
+	unit_fail_if(ufs_write(fd2, data, sizeof(data)) != sizeof(data));
+	bool is_full = false;
+	for (int i = 0; i < 50 && !is_full; ++i)
+		is_full = ufs_write(fd2, data, sizeof(data)) == -1;
+	unit_check(is_full && ufs_errno() == UFS_ERR_NO_MEM,
+		"a write fails when the image is full");
+	unit_check(ufs_pread(fd2, buf, sizeof(buf), 0) == sizeof(buf),
+		"the failed write changed nothing");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("big") != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("a") != 0);
+	fd = ufs_open("new", UFS_CREATE);
+	unit_check(ufs_write(fd, data, sizeof(data)) == sizeof(data) &&
+		ufs_sync() == 0, "the freed space is reused");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+
+	unit_fail_if(ufs_mount(path, 0) != 0);
+	fd = ufs_open("new", 0);
+	unit_check(fd != -1 && ufs_open("a", 0) == -1 &&
+		ufs_read(fd, buf, sizeof(buf)) == sizeof(data) &&
+		memcmp(buf, data, sizeof(data)) == 0,
+		"the file list is saved again");
+	ufs_destroy();
+	unlink(path);
+
+	int img = open(path, O_WRONLY | O_CREAT, 0644);
+	unit_fail_if(img == -1);
+	memset(buf, 'x', 8192);
+	unit_fail_if(write(img, buf, 8192) != 8192);
+	close(img);
+	unit_check(ufs_mount(path, 0) == -1 && ufs_errno() == UFS_ERR_IO,
+		"not an image");
+	unit_check(ufs_open("new", 0) == -1, "and the FS is still empty");
+	unlink(path);
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -490,9 +1366,21 @@ main(int argc, char **argv)
 	test_io();
 	test_delete();
 	test_stress_open();
+	test_many_files();
+	test_fd_reuse();
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_positional_io();
+	test_read_span();
+	test_sparse();
+	test_clone();
+	test_dirs();
+	test_stats();
+	test_compact();
+	test_threads();
+	test_block_size();
+	test_image();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
@@ -1,53 +1,475 @@
 #include "userfs.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 enum {
+	/** Default size of the first block of a file. */
 	BLOCK_SIZE = 512,
+	/** Default size of the biggest blocks. */
+	BLOCK_SIZE_MAX = 1024 * 1024,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
+	/** The blocks up to this size are cut from the arenas. */
+	BLOCK_POOL_SIZE_MAX = 128 * 1024,
+	BLOCK_ARENA_SIZE = 1024 * 1024,
+	/** How much memory of the free big blocks is kept for reuse. */
+	BLOCK_POOL_CACHE_MAX = 64 * 1024 * 1024,
+	/** The image superblock takes a page, the blocks are after. */
+	IMAGE_HEADER_SIZE = 4096,
+	/** Slots of the directory path cache, a power of 2. */
+	DIR_CACHE_SIZE = 256,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+static const char image_magic[8] = "UFSIMG2";
+
+/** Block sizes for the new files, see ufs_set_block_size(). */
+static int block_shift_min = __builtin_ctz(BLOCK_SIZE);
+static int block_shift_max = __builtin_ctz(BLOCK_SIZE_MAX);
+
+/**
+ * Error code of the last failed call in this thread. Set from any
+ * function on any error.
+ */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+
+/**
+ * The locks. The global mutex protects the names: the file list and
+ * the directories, the files' refs, and the allocation of the
+ * descriptor numbers. Each file has its own read-write lock for its
+ * size and blocks, taken after the global one when both are needed.
+ * The descriptor table is read without locks. So the reads of
+ * different files never wait each other, and the reads of one file
+ * only wait the writes into it.
+ */
+static pthread_mutex_t ufs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#if NEED_LATENCY
+
+/** Call counts by the kind and the log2 of nanoseconds. Atomic. */
+static uint64_t ufs_latency[UFS_OP_COUNT][UFS_LATENCY_BUCKET_COUNT];
+
+struct ufs_timer {
+	enum ufs_op op;
+	uint64_t start;
+};
+
+static uint64_t
+ufs_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+ufs_timer_stop(struct ufs_timer *t)
+{
+	uint64_t duration = ufs_now_ns() - t->start;
+	int bucket = duration == 0 ? 0 : 63 - __builtin_clzll(duration);
+	if (bucket >= UFS_LATENCY_BUCKET_COUNT)
+		bucket = UFS_LATENCY_BUCKET_COUNT - 1;
+	__atomic_add_fetch(&ufs_latency[t->op][bucket], 1, __ATOMIC_RELAXED);
+}
+
+/** Time the rest of the function, till any of its returns. */
+#define UFS_LATENCY(op)							\
+	struct ufs_timer ufs_timer __attribute__((cleanup(ufs_timer_stop))) = \
+		{op, ufs_now_ns()}
+
+#else
+
+#define UFS_LATENCY(op) (void)0
+
+#endif
 
 struct block {
-	/** Block memory. */
-	char *memory;
-	/** How many bytes are occupied. */
-	int occupied;
-	/** Next block in the file. */
+	/**
+	 * The files sharing the block, ufs_clone(), the descriptors with
+	 * a span in it, ufs_read_span(), and the spans of
+	 * ufs_pread_span(). The last one frees it, and a write into a
+	 * block with more than one copies it first. Atomic, the files
+	 * lock only themselves.
+	 */
+	int refs;
+	/** Next block in the pool's free list. */
 	struct block *next;
-	/** Previous block in the file. */
-	struct block *prev;
+	/** Block memory, right after the header. */
+	char memory[];
+};
 
-	/* PUT HERE OTHER MEMBERS */
+struct block_arena {
+	struct block_arena *next;
+	/** How many bytes of the data are given to the blocks. */
+	size_t used;
+	char data[];
 };
 
+/**
+ * Allocator of the blocks. A block is one allocation together with
+ * its header. The small ones are cut from big arenas, and on free
+ * are put into a list by their size, to be reused while still hot
+ * when the files are deleted and created again. The arenas are
+ * freed only by ufs_destroy(). The big blocks are malloc'ed one by
+ * one, and the free ones are kept in the lists too, but only up to
+ * a limit. Otherwise a deleted big file is given back to the system,
+ * and a new one would page fault on each page again.
+ *
+ * With an image, ufs_mount(), all the blocks are cut from it and
+ * are never freed to the system, and it is the only limit.
+ */
+static struct block_pool {
+	/** The files take blocks under their own locks. */
+	pthread_mutex_t mutex;
+	/** The first one is where the new blocks are cut from. */
+	struct block_arena *arenas;
+	/** Free blocks by the log2 of their memory size. */
+	struct block *free_lists[64];
+	int free_counts[64];
+	/** Memory size of the big blocks in the free lists. */
+	size_t cached_size;
+	/** The blocks given out and not freed, and their memory size. */
+	size_t taken_count;
+	size_t taken_size;
+	/** The mapped image, or NULL. */
+	struct image_super *image;
+} block_pool = {PTHREAD_MUTEX_INITIALIZER, NULL, {NULL}, {0}, 0, 0, 0,
+	NULL};
+
+/**
+ * Head of the image file. The blocks follow it, and the offsets are
+ * from the image start. The block pointers in the image itself are
+ * not used, they are built again on each mount.
+ */
+struct image_super {
+	char magic[8];
+	/** Size of the image file. */
+	uint64_t size;
+	/** Where the never used space starts. */
+	uint64_t used;
+	/** The block with the files and the free blocks, or 0. */
+	uint64_t meta_offset;
+	/** Log2 of its size. */
+	uint64_t meta_shift;
+};
+
+/** Size of a block in an arena or in the image. */
+static size_t
+block_full_size(size_t size)
+{
+	size_t align = _Alignof(struct block);
+	return (sizeof(struct block) + size + align - 1) & ~(align - 1);
+}
+
+static bool
+block_is_pooled(size_t size)
+{
+	return sizeof(struct block) + size <= BLOCK_POOL_SIZE_MAX;
+}
+
+static struct block **
+block_free_list(size_t size)
+{
+	return &block_pool.free_lists[__builtin_ctzll(size)];
+}
+
+static struct block *
+block_get_locked(size_t size)
+{
+	struct block **free_list = block_free_list(size);
+	struct block *b = *free_list;
+	if (b != NULL) {
+		*free_list = b->next;
+		--block_pool.free_counts[__builtin_ctzll(size)];
+		if (!block_is_pooled(size) && block_pool.image == NULL)
+			block_pool.cached_size -= size;
+		return b;
+	}
+	struct image_super *image = block_pool.image;
+	if (image != NULL) {
+		size = block_full_size(size);
+		if (size > image->size - image->used)
+			return NULL;
+		b = (struct block *)((char *)image + image->used);
+		image->used += size;
+		return b;
+	}
+	if (!block_is_pooled(size))
+		return malloc(sizeof(struct block) + size);
+	size = block_full_size(size);
+	struct block_arena *a = block_pool.arenas;
+	if (a == NULL || a->used + size > BLOCK_ARENA_SIZE) {
+		a = malloc(sizeof(*a) + BLOCK_ARENA_SIZE);
+		a->used = 0;
+		a->next = block_pool.arenas;
+		block_pool.arenas = a;
+	}
+	b = (struct block *)(a->data + a->used);
+	a->used += size;
+	return b;
+}
+
+static void
+block_count_taken(size_t size)
+{
+	++block_pool.taken_count;
+	block_pool.taken_size += size;
+}
+
+/**
+ * A block with the memory of @a size bytes, a power of 2. NULL only
+ * when an image is full.
+ */
+static struct block *
+block_new_locked(size_t size)
+{
+	struct block *b = block_get_locked(size);
+	if (b != NULL)
+		block_count_taken(size);
+	return b;
+}
+
+/**
+ * The blocks of the given count by the log2 of their size can be
+ * taken from the pool.
+ */
+static bool
+block_pool_can_alloc(const int *counts)
+{
+	struct image_super *image = block_pool.image;
+	if (image == NULL)
+		return true;
+	size_t size = 0;
+	for (int shift = 0; shift < 64; ++shift) {
+		int count = counts[shift] - block_pool.free_counts[shift];
+		if (count > 0)
+			size += count * block_full_size((size_t)1 << shift);
+	}
+	return size <= image->size - image->used;
+}
+
+static void
+block_delete_locked(struct block *b, size_t size)
+{
+	--block_pool.taken_count;
+	block_pool.taken_size -= size;
+	if (!block_is_pooled(size) && block_pool.image == NULL) {
+		if (block_pool.cached_size + size > BLOCK_POOL_CACHE_MAX) {
+			free(b);
+			return;
+		}
+		block_pool.cached_size += size;
+	}
+	struct block **free_list = block_free_list(size);
+	b->next = *free_list;
+	*free_list = b;
+	++block_pool.free_counts[__builtin_ctzll(size)];
+}
+
+static void
+block_delete(struct block *b, size_t size)
+{
+	pthread_mutex_lock(&block_pool.mutex);
+	block_delete_locked(b, size);
+	pthread_mutex_unlock(&block_pool.mutex);
+}
+
+static void
+block_ref(struct block *b)
+{
+	__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+}
+
+/** Drop a reference, and free the block if it was the last one. */
+static void
+block_unref_locked(struct block *b, size_t size)
+{
+	if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		block_delete_locked(b, size);
+}
+
+/**
+ * The block is only of this file, can be changed in place. Under the
+ * file's write lock, so no new refs can appear meanwhile.
+ */
+static bool
+block_is_own(const struct block *b)
+{
+	return __atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) == 1;
+}
+
+static void
+block_pool_destroy(void)
+{
+	for (int shift = 0; shift < 64 && block_pool.image == NULL; ++shift) {
+		if (block_is_pooled((size_t)1 << shift))
+			continue;
+		struct block *b = block_pool.free_lists[shift];
+		while (b != NULL) {
+			struct block *next = b->next;
+			free(b);
+			b = next;
+		}
+	}
+	block_pool.cached_size = 0;
+	block_pool.taken_count = 0;
+	block_pool.taken_size = 0;
+	while (block_pool.arenas != NULL) {
+		struct block_arena *a = block_pool.arenas;
+		block_pool.arenas = a->next;
+		free(a);
+	}
+	memset(block_pool.free_lists, 0, sizeof(block_pool.free_lists));
+	memset(block_pool.free_counts, 0, sizeof(block_pool.free_counts));
+}
+
+/**
+ * A file or a directory, by its name in the parent directory. The
+ * name is the last part of the path.
+ */
+struct dir_entry {
+	char *name;
+	/** Hash of the name, for the index of the parent. */
+	uint32_t hash;
+	bool is_dir;
+	/** NULL for the root, and for a deleted file. */
+	struct dir *parent;
+};
+
+/**
+ * Entries of a directory by their names. An open addressing hash
+ * table with linear probing. The hashes are stored next to the
+ * entry pointers, so a probe rarely has to touch an entry and
+ * compare the names. The deleted entries' slots are filled by the
+ * following ones, so there are no tombstones.
+ */
+struct dir_index_slot {
+	uint32_t hash;
+	/** NULL for a free slot. */
+	struct dir_entry *entry;
+};
+
+/**
+ * A directory. It is only its entries, so a lookup and a listing
+ * cost as much as the directory size, not the count of all the
+ * files.
+ */
+struct dir {
+	struct dir_entry entry;
+	struct dir_index_slot *index;
+	/** Power of 2. */
+	uint32_t index_capacity;
+	uint32_t index_count;
+};
+
+/**
+ * A file is an array of blocks growing twice in size, from the min
+ * size to the max one: B, B, 2B, 4B, ..., M, M, M.... Then a big
+ * file is a few big blocks, and a small file doesn't waste much of
+ * its memory. The beginning of each block except the first is equal
+ * to its size while they grow, and the block of an offset is found
+ * by the offset's highest bit.
+ *
+ * The files are sparse. A block is allocated by the first write
+ * into it, and till then it is a hole reading as zeros. So a file
+ * grown by ufs_resize() takes no memory for the new part. The bytes
+ * after the file end in its last block are garbage, and are zeroed
+ * when the file grows over them.
+ */
 struct file {
-	/** Double-linked list of file blocks. */
-	struct block *block_list;
-	/**
-	 * Last block in the list above for fast access to the end
-	 * of file.
-	 */
-	struct block *last_block;
+	/** The blocks by their numbers, NULL for a hole. */
+	struct block **blocks;
+	int block_count;
+	int block_capacity;
+	/** Log2 of the first block size and of the max block size. */
+	int block_shift_min;
+	int block_shift_max;
+	/** Protects the size and the blocks. */
+	pthread_rwlock_t lock;
+	/** File size in bytes. */
+	size_t size;
 	/** How many file descriptors are opened on the file. */
 	int refs;
-	/** File name. */
-	char *name;
+	/** Name and place in the directory. */
+	struct dir_entry entry;
+	/**
+	 * The file is not in the list anymore, and lives until its
+	 * last descriptor is closed.
+	 */
+	bool is_deleted;
+	/** Written since the last ufs_compact() has passed it. */
+	bool is_hot;
+	/** Compacted by ufs_compact(), and not written since. */
+	bool is_compact;
 	/** Files are stored in a double-linked list. */
 	struct file *next;
 	struct file *prev;
-
-	/* PUT HERE OTHER MEMBERS */
 };
 
+/** What a span of a hole points at. */
+static const char file_hole[64 * 1024];
+
 /** List of all files. */
 static struct file *file_list = NULL;
 
+/** The root directory, with no name. */
+static struct dir dir_root = {{NULL, 0, true, NULL}, NULL, 0, 0};
+
+/** Count of the files with a name, and of the directories. */
+static size_t file_count = 0;
+static size_t dir_count = 0;
+
+/**
+ * Recently resolved paths of the directories, direct mapped by the
+ * hash of the path. So the files of a deep directory are found by
+ * one hash of the path and two lookups, not one per each part. A
+ * removal of a directory bumps the generation, which drops all the
+ * slots at once. Under the FS lock.
+ */
+struct dir_cache_slot {
+	uint64_t generation;
+	uint32_t hash;
+	size_t path_size;
+	char *path;
+	struct dir *dir;
+};
+
+static struct dir_cache_slot dir_cache[DIR_CACHE_SIZE];
+static uint64_t dir_cache_generation = 1;
+
+/** A position in a file, with its block found. */
+struct file_cursor {
+	/** Offset in the file. */
+	size_t pos;
+	/** Number of the block with the offset. */
+	int block;
+	/** Offset in the block. */
+	size_t offset;
+};
+
 struct filedesc {
 	struct file *file;
-
-	/* PUT HERE OTHER MEMBERS */
+	/**
+	 * Where the next read or write is, with its block found, so the
+	 * sequential calls don't look for it. A resize doesn't break it,
+	 * the blocks are at the same places by their numbers in any
+	 * size. Can be beyond the file end after a shrink, then the
+	 * descriptor proceeds from the end. A compaction changing the
+	 * block sizes finds the block again, by the position.
+	 */
+	struct file_cursor cursor;
+	bool can_read;
+	bool can_write;
+	/** The block of the last span, and its memory size. */
+	struct block *pinned;
+	size_t pinned_size;
 };
 
 /**
@@ -55,10 +477,31 @@ struct filedesc {
  * created, its pointer drops here. When a file descriptor is
  * closed, its place in this array is set to NULL and can be
  * taken by next ufs_open() call.
+ *
+ * The table is read without locks. So it is never reallocated in
+ * place: a bigger copy replaces it, and the old one stays readable
+ * till ufs_destroy().
  */
-static struct filedesc **file_descriptors = NULL;
+struct filedesc_table {
+	int capacity;
+	/** The smaller table replaced by this one. */
+	struct filedesc_table *prev;
+	struct filedesc *descs[];
+};
+
+static struct filedesc_table *file_descriptors = NULL;
 static int file_descriptor_count = 0;
-static int file_descriptor_capacity = 0;
+
+/**
+ * Free descriptor numbers, a bit per number, and a bit per each
+ * word of them which has a free bit. The lowest free number is found
+ * by two find-first-set, and by a scan of the second level only when
+ * there are more than 4096 descriptors. The scan starts from the
+ * hint, below which all the numbers are taken.
+ */
+static uint64_t *file_descriptor_free = NULL;
+static uint64_t *file_descriptor_free_words = NULL;
+static int file_descriptor_free_hint = 0;
 
 enum ufs_error_code
 ufs_errno()
@@ -66,58 +509,1187 @@ ufs_errno()
 	return ufs_error_code;
 }
 
+static uint32_t
+dir_name_hash(const char *name, size_t size)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < size; ++i) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static bool
+dir_name_equal(const struct dir_entry *e, const char *name, size_t size)
+{
+	return memcmp(e->name, name, size) == 0 && e->name[size] == 0;
+}
+
+/** Slot of the entry with the given name, or the free slot for it. */
+static uint32_t
+dir_index_find(const struct dir *d, const char *name, size_t size,
+	       uint32_t hash)
+{
+	uint32_t mask = d->index_capacity - 1;
+	uint32_t i = hash & mask;
+	for (;; i = (i + 1) & mask) {
+		const struct dir_index_slot *slot = &d->index[i];
+		if (slot->entry == NULL)
+			return i;
+		if (slot->hash == hash && dir_name_equal(slot->entry, name, size))
+			return i;
+	}
+}
+
+static void
+dir_index_grow(struct dir *d)
+{
+	struct dir_index_slot *old = d->index;
+	uint32_t old_capacity = d->index_capacity;
+	d->index_capacity = old_capacity == 0 ? 16 : old_capacity * 2;
+	d->index = calloc(d->index_capacity, sizeof(d->index[0]));
+	uint32_t mask = d->index_capacity - 1;
+	for (uint32_t i = 0; i < old_capacity; ++i) {
+		if (old[i].entry == NULL)
+			continue;
+		uint32_t j = old[i].hash & mask;
+		while (d->index[j].entry != NULL)
+			j = (j + 1) & mask;
+		d->index[j] = old[i];
+	}
+	free(old);
+}
+
+static struct dir_entry *
+dir_lookup(const struct dir *d, const char *name, size_t size)
+{
+	if (d->index_count == 0)
+		return NULL;
+	uint32_t hash = dir_name_hash(name, size);
+	return d->index[dir_index_find(d, name, size, hash)].entry;
+}
+
+/** Name the entry and put it into the directory. */
+static void
+dir_add(struct dir *d, struct dir_entry *e, const char *name, bool is_dir)
+{
+	/* Keep the load factor under 3/4. */
+	if ((d->index_count + 1) * 4 > d->index_capacity * 3)
+		dir_index_grow(d);
+	size_t size = strlen(name);
+	e->name = strdup(name);
+	e->hash = dir_name_hash(name, size);
+	e->is_dir = is_dir;
+	e->parent = d;
+	struct dir_index_slot *slot =
+		&d->index[dir_index_find(d, name, size, e->hash)];
+	slot->hash = e->hash;
+	slot->entry = e;
+	++d->index_count;
+}
+
+/**
+ * Free the slot and move the following ones of the same probe
+ * sequence back, so the lookups don't stop on the hole.
+ */
+static void
+dir_remove(struct dir_entry *e)
+{
+	struct dir *d = e->parent;
+	uint32_t mask = d->index_capacity - 1;
+	uint32_t i = dir_index_find(d, e->name, strlen(e->name), e->hash);
+	for (uint32_t j = (i + 1) & mask; d->index[j].entry != NULL;
+	     j = (j + 1) & mask) {
+		uint32_t home = d->index[j].hash & mask;
+		/* Can move when the home isn't in (i, j], cyclically. */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			d->index[i] = d->index[j];
+			i = j;
+		}
+	}
+	d->index[i].entry = NULL;
+	--d->index_count;
+	e->parent = NULL;
+}
+
+/**
+ * Directory by its path, each part is a name of a subdirectory of
+ * the previous one. The empty parts are skipped, so "", "/", and
+ * "//" are the root. NULL if a part is not found or is a file.
+ */
+static struct dir *
+dir_walk(const char *path, size_t size)
+{
+	struct dir *d = &dir_root;
+	const char *end = path + size;
+	while (path < end) {
+		const char *next = memchr(path, '/', end - path);
+		if (next == NULL)
+			next = end;
+		if (next > path) {
+			struct dir_entry *e = dir_lookup(d, path, next - path);
+			if (e == NULL || !e->is_dir)
+				return NULL;
+			d = (struct dir *)e;
+		}
+		path = next + 1;
+	}
+	return d;
+}
+
+/** Same as dir_walk(), but via the path cache. */
+static struct dir *
+dir_find(const char *path, size_t size)
+{
+	if (size == 0)
+		return &dir_root;
+	uint32_t hash = dir_name_hash(path, size);
+	struct dir_cache_slot *slot = &dir_cache[hash & (DIR_CACHE_SIZE - 1)];
+	if (slot->generation == dir_cache_generation && slot->hash == hash &&
+	    slot->path_size == size && memcmp(slot->path, path, size) == 0)
+		return slot->dir;
+	struct dir *d = dir_walk(path, size);
+	if (d == NULL)
+		return NULL;
+	if (slot->path == NULL || slot->path_size < size) {
+		free(slot->path);
+		slot->path = malloc(size);
+	}
+	memcpy(slot->path, path, size);
+	slot->path_size = size;
+	slot->hash = hash;
+	slot->dir = d;
+	slot->generation = dir_cache_generation;
+	return d;
+}
+
+/**
+ * Directory of the path's last part, which is saved into @a name.
+ * NULL with the error set when the directory doesn't exist.
+ */
+static struct dir *
+dir_of(const char *path, const char **name)
+{
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL) {
+		*name = path;
+		return &dir_root;
+	}
+	*name = slash + 1;
+	struct dir *d = dir_find(path, slash - path);
+	if (d == NULL)
+		ufs_error_code = UFS_ERR_NO_FILE;
+	return d;
+}
+
+/** An entry by its full path, or NULL with the error set. */
+static struct dir_entry *
+dir_entry_find(const char *path)
+{
+	const char *name;
+	struct dir *d = dir_of(path, &name);
+	if (d == NULL)
+		return NULL;
+	struct dir_entry *e = dir_lookup(d, name, strlen(name));
+	if (e == NULL)
+		ufs_error_code = UFS_ERR_NO_FILE;
+	return e;
+}
+
+/** A file by its path, or NULL with the error set. */
+static struct file *
+file_find(const char *path)
+{
+	struct dir_entry *e = dir_entry_find(path);
+	if (e == NULL)
+		return NULL;
+	if (e->is_dir) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return NULL;
+	}
+	return (struct file *)((char *)e - offsetof(struct file, entry));
+}
+
+static struct file *
+file_new(struct dir *d, const char *name)
+{
+	struct file *f = calloc(1, sizeof(*f));
+	pthread_rwlock_init(&f->lock, NULL);
+	dir_add(d, &f->entry, name, false);
+	++file_count;
+	f->block_shift_min = block_shift_min;
+	f->block_shift_max = block_shift_max;
+	f->next = file_list;
+	if (file_list != NULL)
+		file_list->prev = f;
+	file_list = f;
+	return f;
+}
+
+static void
+file_unlink(struct file *f)
+{
+	dir_remove(&f->entry);
+	--file_count;
+	if (f->prev != NULL)
+		f->prev->next = f->next;
+	else
+		file_list = f->next;
+	if (f->next != NULL)
+		f->next->prev = f->prev;
+	f->next = NULL;
+	f->prev = NULL;
+}
+
+/** Free the empty directory. */
+static void
+dir_delete(struct dir *d)
+{
+	dir_remove(&d->entry);
+	--dir_count;
+	/* The paths through it are stale. */
+	++dir_cache_generation;
+	free(d->index);
+	free(d->entry.name);
+	free(d);
+}
+
+/** Free all the directories, all the files must be gone already. */
+static void
+dir_delete_all(struct dir *d)
+{
+	for (uint32_t i = 0; i < d->index_capacity && d->index_count > 0;
+	     ++i) {
+		struct dir_entry *e = d->index[i].entry;
+		if (e == NULL)
+			continue;
+		dir_delete_all((struct dir *)e);
+		dir_delete((struct dir *)e);
+		/* The following slots could have moved back into this one. */
+		--i;
+	}
+	if (d == &dir_root) {
+		free(d->index);
+		d->index = NULL;
+		d->index_capacity = 0;
+		for (int i = 0; i < DIR_CACHE_SIZE; ++i) {
+			free(dir_cache[i].path);
+			dir_cache[i].path = NULL;
+			dir_cache[i].generation = 0;
+		}
+	}
+}
+
+static struct dir *
+dir_new(struct dir *parent, const char *name)
+{
+	struct dir *d = calloc(1, sizeof(*d));
+	dir_add(parent, &d->entry, name, true);
+	++dir_count;
+	return d;
+}
+
+/** Path of the entry from the root, malloc'ed. */
+static char *
+dir_entry_path(const struct dir_entry *e)
+{
+	size_t size = 0;
+	for (const struct dir_entry *i = e; i->parent != NULL;
+	     i = &i->parent->entry)
+		size += strlen(i->name) + 1;
+	char *path = malloc(size == 0 ? 1 : size);
+	char *pos = path + (size == 0 ? 0 : size - 1);
+	*pos = 0;
+	for (const struct dir_entry *i = e; i->parent != NULL;
+	     i = &i->parent->entry) {
+		size_t name_size = strlen(i->name);
+		pos -= name_size;
+		memcpy(pos, i->name, name_size);
+		if (pos > path)
+			*--pos = '/';
+	}
+	return path;
+}
+
+/** Offset of the block number @a i in the file. */
+static size_t
+file_block_start(const struct file *f, int i)
+{
+	int grow_count = f->block_shift_max - f->block_shift_min;
+	if (i <= grow_count)
+		return i == 0 ? 0 : (size_t)1 << (f->block_shift_min + i - 1);
+	return (size_t)(i - grow_count) << f->block_shift_max;
+}
+
+static size_t
+file_block_size(const struct file *f, int i)
+{
+	int grow_count = f->block_shift_max - f->block_shift_min;
+	if (i <= grow_count)
+		return (size_t)1 << (f->block_shift_min + (i == 0 ? 0 : i - 1));
+	return (size_t)1 << f->block_shift_max;
+}
+
+/** Number of the block containing the offset @a pos. */
+static int
+file_block_of(const struct file *f, size_t pos)
+{
+	if ((pos >> f->block_shift_max) == 0) {
+		size_t min_count = pos >> f->block_shift_min;
+		if (min_count == 0)
+			return 0;
+		return 64 - __builtin_clzll(min_count);
+	}
+	return f->block_shift_max - f->block_shift_min +
+		(pos >> f->block_shift_max);
+}
+
+/**
+ * Make it @a count blocks. The new ones are holes, and the dropped
+ * ones are unrefed at once, under one lock of the pool.
+ */
+static void
+file_set_block_count(struct file *f, int count)
+{
+	if (count > f->block_capacity) {
+		int capacity = f->block_capacity == 0 ? 16 : f->block_capacity;
+		while (capacity < count)
+			capacity *= 2;
+		f->blocks = realloc(f->blocks, capacity * sizeof(f->blocks[0]));
+		f->block_capacity = capacity;
+	}
+	if (count >= f->block_count) {
+		memset(f->blocks + f->block_count, 0,
+			(count - f->block_count) * sizeof(f->blocks[0]));
+		f->block_count = count;
+		return;
+	}
+	pthread_mutex_lock(&block_pool.mutex);
+	for (int i = count; i < f->block_count; ++i) {
+		struct block *b = f->blocks[i];
+		if (b != NULL)
+			block_unref_locked(b, file_block_size(f, i));
+	}
+	pthread_mutex_unlock(&block_pool.mutex);
+	f->block_count = count;
+}
+
+/**
+ * Free the file and unref its blocks. It has no descriptors, and no
+ * one else can see it anymore. Not under the FS lock, the blocks are
+ * given to the pool under one lock of its own.
+ */
+static void
+file_delete(struct file *f)
+{
+	pthread_mutex_lock(&block_pool.mutex);
+	for (int i = 0; i < f->block_count; ++i) {
+		struct block *b = f->blocks[i];
+		if (b != NULL)
+			block_unref_locked(b, file_block_size(f, i));
+	}
+	pthread_mutex_unlock(&block_pool.mutex);
+	free(f->blocks);
+	free(f->entry.name);
+	pthread_rwlock_destroy(&f->lock);
+	free(f);
+}
+
+/** Descriptor by its number, or NULL with the error set. */
+static struct filedesc *
+filedesc_get(int fd)
+{
+	struct filedesc_table *t =
+		__atomic_load_n(&file_descriptors, __ATOMIC_ACQUIRE);
+	struct filedesc *desc = NULL;
+	if (fd >= 0 && t != NULL && fd < t->capacity)
+		desc = __atomic_load_n(&t->descs[fd], __ATOMIC_ACQUIRE);
+	if (desc == NULL)
+		ufs_error_code = UFS_ERR_NO_FILE;
+	return desc;
+}
+
+static void
+filedesc_set(int fd, struct filedesc *desc)
+{
+	__atomic_store_n(&file_descriptors->descs[fd], desc, __ATOMIC_RELEASE);
+}
+
+static int
+filedesc_capacity(void)
+{
+	return file_descriptors == NULL ? 0 : file_descriptors->capacity;
+}
+
+static void
+filedesc_grow(void)
+{
+	struct filedesc_table *old = file_descriptors;
+	int old_capacity = filedesc_capacity();
+	int capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+	struct filedesc_table *t = calloc(1, sizeof(*t) +
+		capacity * sizeof(t->descs[0]));
+	t->capacity = capacity;
+	t->prev = old;
+	if (old != NULL) {
+		memcpy(t->descs, old->descs,
+		       old_capacity * sizeof(t->descs[0]));
+	}
+	__atomic_store_n(&file_descriptors, t, __ATOMIC_RELEASE);
+	/* The capacity is a multiple of 64, the new words are all free. */
+	int old_word_count = old_capacity / 64;
+	int word_count = capacity / 64;
+	file_descriptor_free = realloc(file_descriptor_free,
+		word_count * sizeof(file_descriptor_free[0]));
+	memset(file_descriptor_free + old_word_count, 0xff,
+	       (word_count - old_word_count) * sizeof(file_descriptor_free[0]));
+	int old_top_count = (old_word_count + 63) / 64;
+	int top_count = (word_count + 63) / 64;
+	file_descriptor_free_words = realloc(file_descriptor_free_words,
+		top_count * sizeof(file_descriptor_free_words[0]));
+	memset(file_descriptor_free_words + old_top_count, 0,
+	       (top_count - old_top_count) *
+	       sizeof(file_descriptor_free_words[0]));
+	for (int w = old_word_count; w < word_count; ++w)
+		file_descriptor_free_words[w / 64] |= (uint64_t)1 << (w % 64);
+}
+
+/** Take the lowest free descriptor number. */
+static int
+filedesc_alloc(void)
+{
+	int top_count = (filedesc_capacity() / 64 + 63) / 64;
+	int top = file_descriptor_free_hint;
+	while (top < top_count && file_descriptor_free_words[top] == 0)
+		++top;
+	if (top == top_count) {
+		filedesc_grow();
+		/* The new words can start in the old last top word. */
+		top = top_count > 0 ? top_count - 1 : 0;
+		while (file_descriptor_free_words[top] == 0)
+			++top;
+	}
+	file_descriptor_free_hint = top;
+	int w = top * 64 + __builtin_ctzll(file_descriptor_free_words[top]);
+	int bit = __builtin_ctzll(file_descriptor_free[w]);
+	file_descriptor_free[w] &= ~((uint64_t)1 << bit);
+	if (file_descriptor_free[w] == 0)
+		file_descriptor_free_words[top] &= ~((uint64_t)1 << (w % 64));
+	return w * 64 + bit;
+}
+
+static void
+filedesc_free(int fd)
+{
+	int w = fd / 64;
+	file_descriptor_free[w] |= (uint64_t)1 << (fd % 64);
+	file_descriptor_free_words[w / 64] |= (uint64_t)1 << (w % 64);
+	if (w / 64 < file_descriptor_free_hint)
+		file_descriptor_free_hint = w / 64;
+}
+
 int
 ufs_open(const char *filename, int flags)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)filename;
-	(void)flags;
-	(void)file_list;
-	(void)file_descriptors;
-	(void)file_descriptor_count;
-	(void)file_descriptor_capacity;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	UFS_LATENCY(UFS_OP_OPEN);
+	struct filedesc *desc = malloc(sizeof(*desc));
+	memset(&desc->cursor, 0, sizeof(desc->cursor));
+	desc->pinned = NULL;
+	int mode = flags & (UFS_READ_ONLY | UFS_WRITE_ONLY | UFS_READ_WRITE);
+	desc->can_read = mode != UFS_WRITE_ONLY;
+	desc->can_write = mode != UFS_READ_ONLY;
+	pthread_mutex_lock(&ufs_mutex);
+	const char *name;
+	struct dir *d = dir_of(filename, &name);
+	struct dir_entry *e = NULL;
+	if (d != NULL)
+		e = dir_lookup(d, name, strlen(name));
+	struct file *f;
+	if (e != NULL && !e->is_dir) {
+		f = (struct file *)((char *)e - offsetof(struct file, entry));
+	} else if (e == NULL && d != NULL && (flags & UFS_CREATE) != 0) {
+		f = file_new(d, name);
+	} else {
+		pthread_mutex_unlock(&ufs_mutex);
+		free(desc);
+		if (e != NULL && (flags & UFS_CREATE) != 0)
+			ufs_error_code = UFS_ERR_EXISTS;
+		else
+			ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	desc->file = f;
+	int fd = filedesc_alloc();
+	filedesc_set(fd, desc);
+	++file_descriptor_count;
+	++f->refs;
+	pthread_mutex_unlock(&ufs_mutex);
+	return fd;
+}
+
+static void
+file_cursor_seek(const struct file *f, struct file_cursor *c, size_t pos)
+{
+	c->pos = pos;
+	c->block = file_block_of(f, pos);
+	c->offset = pos - file_block_start(f, c->block);
+}
+
+/**
+ * Memory at the cursor, and the cursor is moved forward by @a size
+ * bytes, or to the end of the block, whichever is closer. The size
+ * of the returned part is saved into @a part_size. NULL for a hole.
+ */
+static char *
+file_cursor_next(const struct file *f, struct file_cursor *c, size_t size,
+	size_t *part_size)
+{
+	size_t block_size = file_block_size(f, c->block);
+	struct block *b = f->blocks[c->block];
+	char *memory = b == NULL ? NULL : b->memory + c->offset;
+	size_t part = block_size - c->offset;
+	if (part > size)
+		part = size;
+	c->pos += part;
+	c->offset += part;
+	if (c->offset == block_size) {
+		++c->block;
+		c->offset = 0;
+	}
+	*part_size = part;
+	return memory;
+}
+
+static void
+file_cursor_read(const struct file *f, struct file_cursor *c, char *buf,
+	size_t size)
+{
+	while (size > 0) {
+		size_t part;
+		const char *memory = file_cursor_next(f, c, size, &part);
+		if (memory != NULL)
+			memcpy(buf, memory, part);
+		else
+			memset(buf, 0, part);
+		buf += part;
+		size -= part;
+	}
+}
+
+/**
+ * The block number @a i is to be changed by a write, and must be own.
+ * A hole or a shared block is counted in @a counts by its size.
+ */
+static bool
+file_block_needs_new(const struct file *f, int i, int *counts)
+{
+	struct block *b = f->blocks[i];
+	if (b != NULL && block_is_own(b))
+		return false;
+	++counts[__builtin_ctzll(file_block_size(f, i))];
+	return true;
+}
+
+/**
+ * Replace the hole or the shared block number @a i with an own one.
+ * A copy keeps the data before @a old_size, and the rest within the
+ * file is zeroed. A new block in a hole is zeroed except the part
+ * to be written, from @a begin to @a end.
+ */
+static void
+file_block_renew(struct file *f, int i, size_t old_size, size_t begin,
+	size_t end)
+{
+	struct block *old = f->blocks[i];
+	if (old != NULL && block_is_own(old))
+		return;
+	size_t block_size = file_block_size(f, i);
+	struct block *b = block_new_locked(block_size);
+	b->refs = 1;
+	f->blocks[i] = b;
+	size_t start = file_block_start(f, i);
+	size_t file_end = f->size - start < block_size ?
+		f->size - start : block_size;
+	if (old != NULL) {
+		size_t keep = 0;
+		if (old_size > start)
+			keep = old_size - start < block_size ?
+				old_size - start : block_size;
+		memcpy(b->memory, old->memory, keep);
+		if (file_end > keep)
+			memset(b->memory + keep, 0, file_end - keep);
+		block_unref_locked(old, block_size);
+		return;
+	}
+	size_t write_begin = begin > start ? begin - start : 0;
+	size_t write_end = end - start < block_size ? end - start : block_size;
+	memset(b->memory, 0, write_begin);
+	if (file_end > write_end)
+		memset(b->memory + write_end, 0, file_end - write_end);
+}
+
+/**
+ * Make own blocks for a write of the bytes from @a begin to @a end,
+ * after the file is resized from @a old_size: allocate the holes
+ * and copy the shared blocks under them. And the block of the old
+ * end, when its garbage tail is going to be zeroed. All at once or
+ * none, because an image can be full.
+ */
+static bool
+file_alloc(struct file *f, size_t old_size, size_t begin, size_t end)
+{
+	int first = 0;
+	int last = -1;
+	if (begin < end) {
+		first = file_block_of(f, begin);
+		last = file_block_of(f, end - 1);
+	}
+	int tail = -1;
+	if (old_size < begin) {
+		tail = file_block_of(f, old_size);
+		if (file_block_start(f, tail) == old_size ||
+		    (tail >= first && tail <= last))
+			tail = -1;
+	}
+	int counts[64] = {0};
+	bool needs_new = tail >= 0 && f->blocks[tail] != NULL &&
+		file_block_needs_new(f, tail, counts);
+	for (int i = first; i <= last; ++i)
+		needs_new = file_block_needs_new(f, i, counts) || needs_new;
+	if (!needs_new)
+		return true;
+	pthread_mutex_lock(&block_pool.mutex);
+	if (!block_pool_can_alloc(counts)) {
+		pthread_mutex_unlock(&block_pool.mutex);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return false;
+	}
+	if (tail >= 0 && f->blocks[tail] != NULL)
+		file_block_renew(f, tail, old_size, begin, end);
+	for (int i = first; i <= last; ++i)
+		file_block_renew(f, i, old_size, begin, end);
+	pthread_mutex_unlock(&block_pool.mutex);
+	return true;
+}
+
+/** Write to the cursor, the blocks under it are allocated. */
+static void
+file_cursor_write(const struct file *f, struct file_cursor *c,
+	const char *buf, size_t size)
+{
+	while (size > 0) {
+		size_t part;
+		char *memory = file_cursor_next(f, c, size, &part);
+		memcpy(memory, buf, part);
+		buf += part;
+		size -= part;
+	}
+}
+
+/**
+ * Zero the garbage after the old file end @a begin up to @a end, when
+ * the file grows. It is only in the block of the old end, the next
+ * ones are holes.
+ */
+static void
+file_zero_tail(const struct file *f, size_t begin, size_t end)
+{
+	struct file_cursor c;
+	file_cursor_seek(f, &c, begin);
+	if (c.offset == 0 || f->blocks[c.block] == NULL)
+		return;
+	size_t part = file_block_size(f, c.block) - c.offset;
+	if (part > end - begin)
+		part = end - begin;
+	memset(f->blocks[c.block]->memory + c.offset, 0, part);
+}
+
+/**
+ * Set the size and the block count for it. The new blocks are
+ * holes, and the bytes after the old end are not initialized.
+ */
+static void
+file_set_size(struct file *f, size_t new_size)
+{
+	int block_count = 0;
+	if (new_size > 0)
+		block_count = file_block_of(f, new_size - 1) + 1;
+	file_set_block_count(f, block_count);
+	f->size = new_size;
+}
+
+/** Read into the buffers from the cursor till the file end. */
+static size_t
+file_readv(const struct file *f, struct file_cursor *c,
+	const struct iovec *iov, int iovcnt)
+{
+	if (c->pos >= f->size)
+		return 0;
+	size_t rest = f->size - c->pos;
+	size_t total = 0;
+	for (int i = 0; i < iovcnt && rest > 0; ++i) {
+		size_t size = iov[i].iov_len;
+		if (size > rest)
+			size = rest;
+		file_cursor_read(f, c, iov[i].iov_base, size);
+		rest -= size;
+		total += size;
+	}
+	return total;
+}
+
+/**
+ * Write the buffers at the cursor. A gap between the file end and
+ * the cursor reads as zeros.
+ */
+static ssize_t
+file_writev(struct file *f, struct file_cursor *c, const struct iovec *iov,
+	int iovcnt)
+{
+	size_t pos = c->pos;
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		if (iov[i].iov_len > MAX_FILE_SIZE - total) {
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
+		}
+		total += iov[i].iov_len;
+	}
+	if (pos > MAX_FILE_SIZE || total > MAX_FILE_SIZE - pos) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	size_t old_size = f->size;
+	f->is_hot = true;
+	f->is_compact = false;
+	if (pos + total > old_size)
+		file_set_size(f, pos + total);
+	if (!file_alloc(f, old_size, pos, pos + total)) {
+		file_set_size(f, old_size);
+		return -1;
+	}
+	if (pos > old_size)
+		file_zero_tail(f, old_size, pos);
+	for (int i = 0; i < iovcnt; ++i)
+		file_cursor_write(f, c, iov[i].iov_base, iov[i].iov_len);
+	return total;
+}
+
+/** Descriptor opened for reading, or NULL with the error set. */
+static struct filedesc *
+filedesc_get_readable(int fd)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc != NULL && !desc->can_read) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return NULL;
+	}
+	return desc;
+}
+
+/** Descriptor opened for writing, or NULL with the error set. */
+static struct filedesc *
+filedesc_get_writable(int fd)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc != NULL && !desc->can_write) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return NULL;
+	}
+	return desc;
+}
+
+/** The descriptor's cursor, moved to the end if it is behind it. */
+static struct file_cursor *
+filedesc_cursor(struct filedesc *desc)
+{
+	const struct file *f = desc->file;
+	if (desc->cursor.pos > f->size)
+		file_cursor_seek(f, &desc->cursor, f->size);
+	return &desc->cursor;
+}
+
+/** Drop the pin of the last span, it is a ref of the block. */
+static void
+filedesc_unpin(struct filedesc *desc)
+{
+	struct block *b = desc->pinned;
+	if (b == NULL)
+		return;
+	desc->pinned = NULL;
+	if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		block_delete(b, desc->pinned_size);
 }
 
 ssize_t
 ufs_write(int fd, const char *buf, size_t size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	(void)buf;
-	(void)size;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	struct iovec iov = {(char *)buf, size};
+	return ufs_writev(fd, &iov, 1);
+}
+
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	UFS_LATENCY(UFS_OP_WRITE);
+	struct filedesc *desc = filedesc_get_writable(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	pthread_rwlock_wrlock(&f->lock);
+	ssize_t rc = file_writev(f, filedesc_cursor(desc), iov, iovcnt);
+	pthread_rwlock_unlock(&f->lock);
+	return rc;
+}
+
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+	UFS_LATENCY(UFS_OP_WRITE);
+	struct filedesc *desc = filedesc_get_writable(fd);
+	if (desc == NULL)
+		return -1;
+	struct iovec iov = {(char *)buf, size};
+	struct file *f = desc->file;
+	struct file_cursor c;
+	pthread_rwlock_wrlock(&f->lock);
+	file_cursor_seek(f, &c, offset);
+	ssize_t rc = file_writev(f, &c, &iov, 1);
+	pthread_rwlock_unlock(&f->lock);
+	return rc;
 }
 
 ssize_t
 ufs_read(int fd, char *buf, size_t size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	(void)buf;
-	(void)size;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	struct iovec iov = {buf, size};
+	return ufs_readv(fd, &iov, 1);
+}
+
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	UFS_LATENCY(UFS_OP_READ);
+	struct filedesc *desc = filedesc_get_readable(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	pthread_rwlock_rdlock(&f->lock);
+	size_t size = file_readv(f, filedesc_cursor(desc), iov, iovcnt);
+	pthread_rwlock_unlock(&f->lock);
+	return size;
+}
+
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset)
+{
+	UFS_LATENCY(UFS_OP_READ);
+	struct filedesc *desc = filedesc_get_readable(fd);
+	if (desc == NULL)
+		return -1;
+	struct iovec iov = {buf, size};
+	struct file *f = desc->file;
+	struct file_cursor c;
+	pthread_rwlock_rdlock(&f->lock);
+	file_cursor_seek(f, &c, offset);
+	size_t rc = file_readv(f, &c, &iov, 1);
+	pthread_rwlock_unlock(&f->lock);
+	return rc;
+}
+
+ssize_t
+ufs_read_span(int fd, size_t max, struct ufs_span *out)
+{
+	UFS_LATENCY(UFS_OP_READ);
+	struct filedesc *desc = filedesc_get_readable(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	pthread_rwlock_rdlock(&f->lock);
+	filedesc_unpin(desc);
+	out->data = NULL;
+	out->size = 0;
+	out->block = NULL;
+	struct file_cursor *c = filedesc_cursor(desc);
+	if (c->pos < f->size && max > 0) {
+		if (max > f->size - c->pos)
+			max = f->size - c->pos;
+		struct block *b = f->blocks[c->block];
+		if (b != NULL) {
+			desc->pinned = b;
+			desc->pinned_size = file_block_size(f, c->block);
+			block_ref(b);
+		} else if (max > sizeof(file_hole)) {
+			max = sizeof(file_hole);
+		}
+		out->data = file_cursor_next(f, c, max, &out->size);
+		if (b == NULL)
+			out->data = file_hole;
+	}
+	pthread_rwlock_unlock(&f->lock);
+	return out->size;
+}
+
+ssize_t
+ufs_pread_span(int fd, size_t max, size_t offset, struct ufs_span *out)
+{
+	UFS_LATENCY(UFS_OP_READ);
+	out->data = NULL;
+	out->size = 0;
+	out->block = NULL;
+	struct filedesc *desc = filedesc_get_readable(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	pthread_rwlock_rdlock(&f->lock);
+	if (offset < f->size && max > 0) {
+		if (max > f->size - offset)
+			max = f->size - offset;
+		struct file_cursor c;
+		file_cursor_seek(f, &c, offset);
+		struct block *b = f->blocks[c.block];
+		if (b != NULL) {
+			out->block = b;
+			out->block_size = file_block_size(f, c.block);
+			block_ref(b);
+		} else if (max > sizeof(file_hole)) {
+			max = sizeof(file_hole);
+		}
+		out->data = file_cursor_next(f, &c, max, &out->size);
+		if (b == NULL)
+			out->data = file_hole;
+	}
+	pthread_rwlock_unlock(&f->lock);
+	return out->size;
+}
+
+void
+ufs_span_release(struct ufs_span *span)
+{
+	struct block *b = span->block;
+	if (b == NULL)
+		return;
+	span->block = NULL;
+	if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		block_delete(b, span->block_size);
 }
 
 int
 ufs_close(int fd)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	UFS_LATENCY(UFS_OP_CLOSE);
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	if (desc->pinned != NULL) {
+		pthread_rwlock_rdlock(&f->lock);
+		filedesc_unpin(desc);
+		pthread_rwlock_unlock(&f->lock);
+	}
+	pthread_mutex_lock(&ufs_mutex);
+	filedesc_set(fd, NULL);
+	--file_descriptor_count;
+	filedesc_free(fd);
+	bool is_garbage = --f->refs == 0 && f->is_deleted;
+	pthread_mutex_unlock(&ufs_mutex);
+	if (is_garbage)
+		file_delete(f);
+	free(desc);
+	return 0;
 }
 
 int
 ufs_delete(const char *filename)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)filename;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	UFS_LATENCY(UFS_OP_DELETE);
+	pthread_mutex_lock(&ufs_mutex);
+	struct file *f = file_find(filename);
+	if (f == NULL) {
+		pthread_mutex_unlock(&ufs_mutex);
+		return -1;
+	}
+	file_unlink(f);
+	f->is_deleted = true;
+	bool is_garbage = f->refs == 0;
+	pthread_mutex_unlock(&ufs_mutex);
+	if (is_garbage)
+		file_delete(f);
+	return 0;
+}
+
+int
+ufs_mkdir(const char *path)
+{
+	pthread_mutex_lock(&ufs_mutex);
+	const char *name;
+	struct dir *d = dir_of(path, &name);
+	if (d == NULL) {
+		pthread_mutex_unlock(&ufs_mutex);
+		return -1;
+	}
+	/* "a/" is "a" itself. */
+	if (*name == 0 || dir_lookup(d, name, strlen(name)) != NULL) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_EXISTS;
+		return -1;
+	}
+	dir_new(d, name);
+	pthread_mutex_unlock(&ufs_mutex);
+	return 0;
+}
+
+int
+ufs_rmdir(const char *path)
+{
+	pthread_mutex_lock(&ufs_mutex);
+	struct dir_entry *e = dir_entry_find(path);
+	if (e == NULL || !e->is_dir) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	struct dir *d = (struct dir *)e;
+	if (d->index_count != 0) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NOT_EMPTY;
+		return -1;
+	}
+	dir_delete(d);
+	pthread_mutex_unlock(&ufs_mutex);
+	return 0;
+}
+
+/** The entries of a directory copied at the opening, and the names. */
+struct ufs_dir {
+	uint32_t count;
+	uint32_t pos;
+	struct ufs_dirent entries[];
+};
+
+int
+ufs_getattr(const char *path, struct ufs_attr *attr)
+{
+	pthread_mutex_lock(&ufs_mutex);
+	struct file *f = NULL;
+	struct dir *d = dir_find(path, strlen(path));
+	if (d == NULL)
+		f = file_find(path);
+	if (d == NULL && f == NULL) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	attr->is_dir = d != NULL;
+	attr->size = 0;
+	if (f != NULL) {
+		pthread_rwlock_rdlock(&f->lock);
+		attr->size = f->size;
+		pthread_rwlock_unlock(&f->lock);
+	}
+	pthread_mutex_unlock(&ufs_mutex);
+	return 0;
+}
+
+struct ufs_dir *
+ufs_opendir(const char *path)
+{
+	pthread_mutex_lock(&ufs_mutex);
+	struct dir *d = dir_find(path, strlen(path));
+	if (d == NULL) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return NULL;
+	}
+	size_t names_size = 0;
+	for (uint32_t i = 0; i < d->index_capacity; ++i) {
+		if (d->index[i].entry != NULL)
+			names_size += strlen(d->index[i].entry->name) + 1;
+	}
+	size_t entries_size = d->index_count * sizeof(struct ufs_dirent);
+	struct ufs_dir *res = malloc(sizeof(*res) + entries_size + names_size);
+	res->count = d->index_count;
+	res->pos = 0;
+	char *names = (char *)res->entries + entries_size;
+	struct ufs_dirent *out = res->entries;
+	for (uint32_t i = 0; i < d->index_capacity; ++i) {
+		const struct dir_entry *e = d->index[i].entry;
+		if (e == NULL)
+			continue;
+		size_t size = strlen(e->name) + 1;
+		memcpy(names, e->name, size);
+		out->name = names;
+		out->is_dir = e->is_dir;
+		names += size;
+		++out;
+	}
+	pthread_mutex_unlock(&ufs_mutex);
+	return res;
+}
+
+int
+ufs_readdir(struct ufs_dir *dir, struct ufs_dirent *entry)
+{
+	if (dir->pos == dir->count)
+		return 0;
+	*entry = dir->entries[dir->pos++];
+	return 1;
+}
+
+void
+ufs_closedir(struct ufs_dir *dir)
+{
+	free(dir);
+}
+
+int
+ufs_clone(const char *src, const char *dst)
+{
+	UFS_LATENCY(UFS_OP_CLONE);
+	pthread_mutex_lock(&ufs_mutex);
+	struct file *f = file_find(src);
+	const char *name;
+	struct dir *d = f == NULL ? NULL : dir_of(dst, &name);
+	if (d == NULL) {
+		pthread_mutex_unlock(&ufs_mutex);
+		return -1;
+	}
+	struct dir_entry *e = dir_lookup(d, name, strlen(name));
+	if (e == &f->entry) {
+		pthread_mutex_unlock(&ufs_mutex);
+		return 0;
+	}
+	if (e != NULL && e->is_dir) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_EXISTS;
+		return -1;
+	}
+	struct file *old = NULL;
+	bool is_garbage = false;
+	if (e != NULL) {
+		old = (struct file *)((char *)e - offsetof(struct file, entry));
+		file_unlink(old);
+		old->is_deleted = true;
+		is_garbage = old->refs == 0;
+	}
+	struct file *copy = file_new(d, name);
+	copy->block_shift_min = f->block_shift_min;
+	copy->block_shift_max = f->block_shift_max;
+	pthread_rwlock_rdlock(&f->lock);
+	file_set_size(copy, f->size);
+	for (int i = 0; i < f->block_count; ++i) {
+		struct block *b = f->blocks[i];
+		if (b != NULL)
+			block_ref(b);
+		copy->blocks[i] = b;
+	}
+	pthread_rwlock_unlock(&f->lock);
+	pthread_mutex_unlock(&ufs_mutex);
+	if (is_garbage)
+		file_delete(old);
+	return 0;
 }
 
 #if NEED_RESIZE
@@ -125,16 +1697,770 @@ ufs_delete(const char *filename)
 int
 ufs_resize(int fd, size_t new_size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	(void)new_size;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	UFS_LATENCY(UFS_OP_RESIZE);
+	struct filedesc *desc = filedesc_get_writable(fd);
+	if (desc == NULL)
+		return -1;
+	if (new_size > MAX_FILE_SIZE) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	struct file *f = desc->file;
+	pthread_rwlock_wrlock(&f->lock);
+	size_t old_size = f->size;
+	f->is_hot = true;
+	f->is_compact = false;
+	file_set_size(f, new_size);
+	if (new_size > old_size) {
+		/* The old end's block can be shared, then it is copied. */
+		if (!file_alloc(f, old_size, new_size, new_size)) {
+			file_set_size(f, old_size);
+			pthread_rwlock_unlock(&f->lock);
+			return -1;
+		}
+		file_zero_tail(f, old_size, new_size);
+	}
+	pthread_rwlock_unlock(&f->lock);
+	/* The descriptors behind the end are moved on their next access. */
+	return 0;
+}
+
+#endif
+
+void
+ufs_set_block_size(size_t min_size, size_t max_size)
+{
+	int shift_min = 0;
+	while (((size_t)1 << shift_min) < min_size)
+		++shift_min;
+	int shift_max = shift_min;
+	while (((size_t)1 << shift_max) < max_size)
+		++shift_max;
+	pthread_mutex_lock(&ufs_mutex);
+	block_shift_min = shift_min;
+	block_shift_max = shift_max;
+	pthread_mutex_unlock(&ufs_mutex);
+}
+
+/** The memory has only zeros. */
+static bool
+mem_is_zero(const char *p, size_t size)
+{
+	if (size == 0)
+		return true;
+	return p[0] == 0 && memcmp(p, p + 1, size - 1) == 0;
+}
+
+/**
+ * The block number @a i has data, by @a is_data: a flag per each
+ * piece of the min block size within the file.
+ */
+static bool
+compact_block_has_data(const struct file *f, const bool *is_data, int i)
+{
+	size_t piece = (size_t)1 << f->block_shift_min;
+	size_t start = file_block_start(f, i);
+	size_t end = start + file_block_size(f, i);
+	if (end > f->size)
+		end = f->size;
+	for (size_t j = start / piece; j < (end + piece - 1) / piece; ++j) {
+		if (is_data[j])
+			return true;
+	}
+	return false;
+}
+
+/** Memory of the file's blocks and of their pointers. */
+static size_t
+compact_cost(const struct file *f, const bool *is_data)
+{
+	size_t cost = sizeof(f->blocks[0]) * f->block_count;
+	for (int i = 0; i < f->block_count; ++i) {
+		bool has_data = is_data != NULL ?
+			compact_block_has_data(f, is_data, i) :
+			f->blocks[i] != NULL;
+		if (has_data)
+			cost += block_full_size(file_block_size(f, i));
+	}
+	return cost;
+}
+
+/**
+ * Lay the file out into the cheapest blocks for its data. The pieces
+ * of all zeros become holes, and when other max blocks would take
+ * less, the data is copied into them. So the big blocks with a bit
+ * of data, left by the small writes or by a truncate, are given back
+ * to the pool. Only the files with all the blocks own, no clones
+ * and no spans. Under the FS lock and the file's write lock.
+ * @retval Freed memory.
+ */
+static size_t
+file_compact(struct file *f)
+{
+	for (int i = 0; i < f->block_count; ++i) {
+		struct block *b = f->blocks[i];
+		if (b != NULL && !block_is_own(b))
+			return 0;
+	}
+	size_t piece = (size_t)1 << f->block_shift_min;
+	size_t piece_count = (f->size + piece - 1) / piece;
+	if (piece_count == 0)
+		return 0;
+	bool *is_data = malloc(piece_count * sizeof(is_data[0]));
+	struct file_cursor c;
+	file_cursor_seek(f, &c, 0);
+	for (size_t i = 0; i < piece_count; ++i) {
+		size_t part;
+		size_t size = f->size - c.pos < piece ? f->size - c.pos : piece;
+		const char *memory = file_cursor_next(f, &c, size, &part);
+		is_data[i] = memory != NULL && !mem_is_zero(memory, part);
+	}
+	/*
+	 * The bigger blocks win the ties, they are faster to go over. Up
+	 * to the size of the new files, so the data written again into
+	 * a compacted file gets its big blocks back.
+	 */
+	struct file layout = *f;
+	size_t best_cost = compact_cost(f, NULL);
+	int best_shift = -1;
+	int shift_max = f->block_shift_max > block_shift_max ?
+		f->block_shift_max : block_shift_max;
+	for (int shift = shift_max; shift >= f->block_shift_min; --shift) {
+		layout.block_shift_max = shift;
+		layout.block_count = file_block_of(&layout, f->size - 1) + 1;
+		size_t cost = compact_cost(&layout, is_data);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best_shift = shift;
+		}
+	}
+	if (best_shift < 0) {
+		free(is_data);
+		return 0;
+	}
+	layout.block_shift_max = best_shift;
+	layout.block_count = file_block_of(&layout, f->size - 1) + 1;
+	layout.block_capacity = layout.block_count;
+	layout.blocks = calloc(layout.block_count, sizeof(layout.blocks[0]));
+	bool *has_data = malloc(layout.block_count * sizeof(has_data[0]));
+	int counts[64] = {0};
+	for (int i = 0; i < layout.block_count; ++i) {
+		has_data[i] = compact_block_has_data(&layout, is_data, i);
+		if (has_data[i])
+			++counts[__builtin_ctzll(file_block_size(&layout, i))];
+	}
+	free(is_data);
+	pthread_mutex_lock(&block_pool.mutex);
+	/* The old blocks are freed only after the copying. */
+	if (!block_pool_can_alloc(counts)) {
+		pthread_mutex_unlock(&block_pool.mutex);
+		free(has_data);
+		free(layout.blocks);
+		return 0;
+	}
+	size_t old_size = block_pool.taken_size;
+	for (int i = 0; i < layout.block_count; ++i) {
+		if (!has_data[i])
+			continue;
+		size_t size = file_block_size(&layout, i);
+		size_t start = file_block_start(&layout, i);
+		struct block *b = block_new_locked(size);
+		b->refs = 1;
+		layout.blocks[i] = b;
+		file_cursor_seek(f, &c, start);
+		file_cursor_read(f, &c, b->memory,
+				 f->size - start < size ? f->size - start : size);
+	}
+	free(has_data);
+	for (int i = 0; i < f->block_count; ++i) {
+		if (f->blocks[i] != NULL)
+			block_unref_locked(f->blocks[i], file_block_size(f, i));
+	}
+	size_t new_size = block_pool.taken_size;
+	pthread_mutex_unlock(&block_pool.mutex);
+	free(f->blocks);
+	f->blocks = layout.blocks;
+	f->block_count = layout.block_count;
+	f->block_capacity = layout.block_capacity;
+	f->block_shift_max = layout.block_shift_max;
+	for (int fd = 0; fd < filedesc_capacity(); ++fd) {
+		struct filedesc *desc = file_descriptors->descs[fd];
+		if (desc != NULL && desc->file == f)
+			file_cursor_seek(f, &desc->cursor, desc->cursor.pos);
+	}
+	return old_size > new_size ? old_size - new_size : 0;
+}
+
+size_t
+ufs_compact(size_t budget)
+{
+	size_t freed = 0;
+	size_t scanned = 0;
+	pthread_mutex_lock(&ufs_mutex);
+	for (struct file *f = file_list; f != NULL; f = f->next) {
+		if (budget != 0 && scanned >= budget)
+			break;
+		if (f->is_compact)
+			continue;
+		/* A file busy right now is not cold either. */
+		if (pthread_rwlock_trywrlock(&f->lock) != 0)
+			continue;
+		if (f->is_hot) {
+			f->is_hot = false;
+		} else {
+			scanned += f->size;
+			freed += file_compact(f);
+			f->is_compact = true;
+		}
+		pthread_rwlock_unlock(&f->lock);
+	}
+	pthread_mutex_unlock(&ufs_mutex);
+	return freed;
+}
+
+/** A block which can be of a few files, and its used bytes. */
+struct stats_block {
+	const struct block *block;
+	size_t used;
+	size_t size;
+};
+
+struct stats_block_list {
+	struct stats_block *items;
+	size_t count;
+	size_t capacity;
+};
+
+static int
+stats_block_cmp(const void *l, const void *r)
+{
+	uintptr_t a = (uintptr_t)((const struct stats_block *)l)->block;
+	uintptr_t b = (uintptr_t)((const struct stats_block *)r)->block;
+	return a < b ? -1 : a > b;
+}
+
+/**
+ * Add the file's blocks to the stats. The ones of only this file are
+ * counted right away, and the others are put into the list, to be
+ * counted once for all their files. Or all of them, when the file
+ * can be seen more than once. Under the FS lock.
+ */
+static void
+stats_add_file(struct ufs_stats *stats, struct stats_block_list *shared,
+	struct file *f, bool is_seen_again)
+{
+	pthread_rwlock_rdlock(&f->lock);
+	for (int i = 0; i < f->block_count; ++i) {
+		const struct block *b = f->blocks[i];
+		if (b == NULL)
+			continue;
+		size_t start = file_block_start(f, i);
+		size_t size = file_block_size(f, i);
+		size_t used = f->size - start < size ? f->size - start : size;
+		/* The spans don't add files, refs 1 is for sure only ours. */
+		if (!is_seen_again && block_is_own(b)) {
+			stats->used_size += used;
+			stats->fragmented_size += size - used;
+			continue;
+		}
+		if (shared->count == shared->capacity) {
+			shared->capacity = shared->capacity == 0 ? 64 :
+				shared->capacity * 2;
+			shared->items = realloc(shared->items,
+				shared->capacity * sizeof(shared->items[0]));
+		}
+		shared->items[shared->count++] = (struct stats_block){
+			b, used, size};
+	}
+	pthread_rwlock_unlock(&f->lock);
 }
 
+void
+ufs_stats(struct ufs_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	struct stats_block_list shared = {NULL, 0, 0};
+	pthread_mutex_lock(&ufs_mutex);
+	stats->file_count = file_count;
+	stats->dir_count = dir_count;
+	stats->descriptor_count = file_descriptor_count;
+	for (struct file *f = file_list; f != NULL; f = f->next)
+		stats_add_file(stats, &shared, f, false);
+	/* The deleted files are only in their descriptors, maybe many. */
+	for (int fd = 0; fd < filedesc_capacity(); ++fd) {
+		struct filedesc *desc = file_descriptors->descs[fd];
+		if (desc != NULL && desc->file->is_deleted)
+			stats_add_file(stats, &shared, desc->file, true);
+	}
+	pthread_mutex_unlock(&ufs_mutex);
+	if (shared.count > 0) {
+		qsort(shared.items, shared.count, sizeof(shared.items[0]),
+		      stats_block_cmp);
+	}
+	for (size_t i = 0; i < shared.count;) {
+		size_t used = 0;
+		size_t j = i;
+		for (; j < shared.count && shared.items[j].block ==
+		     shared.items[i].block; ++j) {
+			if (shared.items[j].used > used)
+				used = shared.items[j].used;
+		}
+		stats->used_size += used;
+		stats->fragmented_size += shared.items[i].size - used;
+		i = j;
+	}
+	free(shared.items);
+
+	pthread_mutex_lock(&block_pool.mutex);
+	stats->block_count = block_pool.taken_count;
+	stats->reserved_size = block_pool.taken_size;
+	for (int shift = 0; shift < 64; ++shift) {
+		stats->cached_size +=
+			(size_t)block_pool.free_counts[shift] << shift;
+	}
+	pthread_mutex_unlock(&block_pool.mutex);
+#if NEED_LATENCY
+	for (int op = 0; op < UFS_OP_COUNT; ++op) {
+		for (int i = 0; i < UFS_LATENCY_BUCKET_COUNT; ++i) {
+			stats->latency[op][i] = __atomic_load_n(
+				&ufs_latency[op][i], __ATOMIC_RELAXED);
+		}
+	}
 #endif
+}
+
+/**
+ * The file list of an image is kept in a block of the image, in 64
+ * bit words. The file count, and for each file: the name size, the
+ * name padded to a word, the size, the min and max block shifts, the
+ * block count, and the block offsets, 0 for a hole. Then the free
+ * block count, and an offset and a size shift for each.
+ */
+struct image_writer {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void
+image_write(struct image_writer *w, const void *data, size_t size)
+{
+	size_t padded = (size + 7) & ~(size_t)7;
+	if (w->size + padded > w->capacity) {
+		w->capacity = w->capacity == 0 ? 4096 : w->capacity * 2;
+		if (w->capacity < w->size + padded)
+			w->capacity = w->size + padded;
+		w->data = realloc(w->data, w->capacity);
+	}
+	memcpy(w->data + w->size, data, size);
+	memset(w->data + w->size + size, 0, padded - size);
+	w->size += padded;
+}
+
+static void
+image_write_u64(struct image_writer *w, uint64_t value)
+{
+	image_write(w, &value, sizeof(value));
+}
+
+static uint64_t
+image_offset(const void *p)
+{
+	return (const char *)p - (const char *)block_pool.image;
+}
+
+/** Size shift of the block keeping @a size bytes of the file list. */
+static int
+image_meta_shift(uint64_t size)
+{
+	return size <= 1 ? 0 : 64 - __builtin_clzll(size - 1);
+}
+
+static void
+image_write_path(struct image_writer *w, const struct dir_entry *e)
+{
+	char *path = dir_entry_path(e);
+	size_t size = strlen(path);
+	image_write_u64(w, size);
+	image_write(w, path, size);
+	free(path);
+}
+
+/** The directories in the tree, each one before its subdirectories. */
+static void
+image_write_dirs(struct image_writer *w, const struct dir *d)
+{
+	for (uint32_t i = 0; i < d->index_capacity; ++i) {
+		const struct dir_entry *e = d->index[i].entry;
+		if (e == NULL || !e->is_dir)
+			continue;
+		image_write_path(w, e);
+		image_write_dirs(w, (const struct dir *)e);
+	}
+}
+
+/**
+ * Save the directories and the files by their paths, and flush the
+ * image. Under the FS lock.
+ */
+static int
+image_save(void)
+{
+	struct image_super *image = block_pool.image;
+	struct image_writer w = {NULL, 0, 0};
+	image_write_u64(&w, dir_count);
+	image_write_dirs(&w, &dir_root);
+	image_write_u64(&w, file_count);
+	for (struct file *f = file_list; f != NULL; f = f->next) {
+		pthread_rwlock_rdlock(&f->lock);
+		image_write_path(&w, &f->entry);
+		image_write_u64(&w, f->size);
+		image_write_u64(&w, f->block_shift_min);
+		image_write_u64(&w, f->block_shift_max);
+		image_write_u64(&w, f->block_count);
+		for (int i = 0; i < f->block_count; ++i) {
+			struct block *b = f->blocks[i];
+			image_write_u64(&w, b == NULL ? 0 : image_offset(b));
+		}
+		pthread_rwlock_unlock(&f->lock);
+	}
+	pthread_mutex_lock(&block_pool.mutex);
+	/* The old list is free in the new one, and one more is taken. */
+	uint64_t free_count = image->meta_offset != 0;
+	for (int shift = 0; shift < 64; ++shift)
+		free_count += block_pool.free_counts[shift];
+	int meta_shift = image_meta_shift(w.size + 8 + free_count * 16);
+	struct block *meta = block_new_locked((size_t)1 << meta_shift);
+	if (meta == NULL) {
+		pthread_mutex_unlock(&block_pool.mutex);
+		free(w.data);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	free_count = image->meta_offset != 0;
+	for (int shift = 0; shift < 64; ++shift)
+		free_count += block_pool.free_counts[shift];
+	image_write_u64(&w, free_count);
+	for (int shift = 0; shift < 64; ++shift) {
+		for (struct block *b = block_pool.free_lists[shift]; b != NULL;
+		     b = b->next) {
+			image_write_u64(&w, image_offset(b));
+			image_write_u64(&w, shift);
+		}
+	}
+	struct block *old_meta = NULL;
+	int old_meta_shift = 0;
+	if (image->meta_offset != 0) {
+		old_meta = (struct block *)((char *)image + image->meta_offset);
+		old_meta_shift = image->meta_shift;
+		image_write_u64(&w, image->meta_offset);
+		image_write_u64(&w, old_meta_shift);
+	}
+	memcpy(meta->memory, w.data, w.size);
+	free(w.data);
+	/* The list is on the disk before the superblock points at it. */
+	if (msync(image, image->size, MS_SYNC) != 0) {
+		block_delete_locked(meta, (size_t)1 << meta_shift);
+		pthread_mutex_unlock(&block_pool.mutex);
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	image->meta_offset = image_offset(meta);
+	image->meta_shift = meta_shift;
+	if (old_meta != NULL)
+		block_delete_locked(old_meta, (size_t)1 << old_meta_shift);
+	int rc = msync(image, IMAGE_HEADER_SIZE, MS_SYNC);
+	pthread_mutex_unlock(&block_pool.mutex);
+	if (rc != 0) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
+struct image_reader {
+	const char *pos;
+	const char *end;
+};
+
+static bool
+image_read(struct image_reader *r, void *data, size_t size)
+{
+	size_t padded = (size + 7) & ~(size_t)7;
+	if ((size_t)(r->end - r->pos) < padded)
+		return false;
+	memcpy(data, r->pos, size);
+	r->pos += padded;
+	return true;
+}
+
+/** A block of the image at @a offset, or NULL if it is not there. */
+static struct block *
+image_block(uint64_t offset, uint64_t shift)
+{
+	struct image_super *image = block_pool.image;
+	if (offset < IMAGE_HEADER_SIZE || offset > image->used || shift >= 48)
+		return NULL;
+	if (block_full_size((size_t)1 << shift) > image->used - offset)
+		return NULL;
+	return (struct block *)((char *)image + offset);
+}
+
+/**
+ * Read a path, and find the directory of its last part, which must
+ * be free. NULL if anything is wrong. Under the FS lock.
+ */
+static struct dir *
+image_load_path(struct image_reader *r, char **path, const char **name)
+{
+	uint64_t size;
+	if (!image_read(r, &size, 8) || size > (size_t)(r->end - r->pos))
+		return NULL;
+	*path = malloc(size + 1);
+	bool ok = image_read(r, *path, size);
+	(*path)[size] = 0;
+	struct dir *d = NULL;
+	if (ok && strlen(*path) == size)
+		d = dir_of(*path, name);
+	if (d != NULL && dir_lookup(d, *name, strlen(*name)) == NULL)
+		return d;
+	free(*path);
+	return NULL;
+}
+
+/** Read a file of the list. Under the FS lock. */
+static bool
+image_load_file(struct image_reader *r)
+{
+	uint64_t size, shift_min, shift_max, block_count;
+	char *path;
+	const char *name;
+	struct dir *d = image_load_path(r, &path, &name);
+	if (d == NULL)
+		return false;
+	bool ok = image_read(r, &size, 8) && image_read(r, &shift_min, 8) &&
+		image_read(r, &shift_max, 8) &&
+		image_read(r, &block_count, 8) && size <= MAX_FILE_SIZE &&
+		shift_min <= shift_max && shift_max < 48;
+	if (!ok) {
+		free(path);
+		return false;
+	}
+	struct file *f = file_new(d, name);
+	free(path);
+	f->block_shift_min = shift_min;
+	f->block_shift_max = shift_max;
+	file_set_size(f, size);
+	if (block_count != (uint64_t)f->block_count)
+		return false;
+	for (int i = 0; i < f->block_count; ++i) {
+		uint64_t offset;
+		if (!image_read(r, &offset, 8))
+			return false;
+		if (offset == 0)
+			continue;
+		uint64_t shift = __builtin_ctzll(file_block_size(f, i));
+		f->blocks[i] = image_block(offset, shift);
+		if (f->blocks[i] == NULL)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Make the files of the image, with their blocks right in it, and
+ * the free lists. Under the FS lock.
+ */
+static bool
+image_load(void)
+{
+	struct image_super *image = block_pool.image;
+	struct block *meta = image_block(image->meta_offset,
+		image->meta_shift);
+	if (meta == NULL)
+		return false;
+	struct image_reader r = {meta->memory,
+		meta->memory + ((size_t)1 << image->meta_shift)};
+	uint64_t count;
+	if (!image_read(&r, &count, 8))
+		return false;
+	for (uint64_t i = 0; i < count; ++i) {
+		char *path;
+		const char *name;
+		struct dir *d = image_load_path(&r, &path, &name);
+		if (d == NULL)
+			return false;
+		dir_new(d, name);
+		free(path);
+	}
+	if (!image_read(&r, &count, 8))
+		return false;
+	for (uint64_t i = 0; i < count; ++i) {
+		if (!image_load_file(&r))
+			return false;
+	}
+	/* The clones share blocks, the refs in the image can be stale. */
+	for (struct file *f = file_list; f != NULL; f = f->next) {
+		for (int i = 0; i < f->block_count; ++i) {
+			if (f->blocks[i] != NULL)
+				f->blocks[i]->refs = 0;
+		}
+	}
+	for (struct file *f = file_list; f != NULL; f = f->next) {
+		for (int i = 0; i < f->block_count; ++i) {
+			struct block *b = f->blocks[i];
+			if (b != NULL && ++b->refs == 1)
+				block_count_taken(file_block_size(f, i));
+		}
+	}
+	block_count_taken((size_t)1 << image->meta_shift);
+	uint64_t free_count;
+	if (!image_read(&r, &free_count, 8))
+		return false;
+	for (uint64_t i = 0; i < free_count; ++i) {
+		uint64_t offset, shift;
+		if (!image_read(&r, &offset, 8) || !image_read(&r, &shift, 8))
+			return false;
+		struct block *b = image_block(offset, shift);
+		if (b == NULL)
+			return false;
+		/* Was taken by the image, is freed into the lists now. */
+		block_count_taken((size_t)1 << shift);
+		block_delete_locked(b, (size_t)1 << shift);
+	}
+	return true;
+}
+
+/** Forget the files and unmap the image. Under the FS lock. */
+static void
+image_unmount(void)
+{
+	while (file_list != NULL) {
+		struct file *f = file_list;
+		file_unlink(f);
+		file_delete(f);
+	}
+	dir_delete_all(&dir_root);
+	struct image_super *image = block_pool.image;
+	size_t size = image->size;
+	block_pool_destroy();
+	block_pool.image = NULL;
+	munmap(image, size);
+}
+
+/** Map the image file, a new one of @a size if it is empty. */
+static struct image_super *
+image_map(const char *path, size_t size)
+{
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1)
+		return NULL;
+	struct stat st;
+	bool is_new = false;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size == 0) {
+		is_new = true;
+		if (size < IMAGE_HEADER_SIZE || ftruncate(fd, size) != 0) {
+			close(fd);
+			return NULL;
+		}
+	} else {
+		size = st.st_size;
+	}
+	struct image_super *image = MAP_FAILED;
+	if (size >= IMAGE_HEADER_SIZE) {
+		image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	}
+	close(fd);
+	if (image == MAP_FAILED)
+		return NULL;
+	if (is_new) {
+		memcpy(image->magic, image_magic, sizeof(image_magic));
+		image->size = size;
+		image->used = IMAGE_HEADER_SIZE;
+		image->meta_offset = 0;
+		image->meta_shift = 0;
+	} else if (memcmp(image->magic, image_magic, sizeof(image_magic)) !=
+		   0 || image->size != size || image->used > size ||
+		   image->used < IMAGE_HEADER_SIZE) {
+		munmap(image, size);
+		return NULL;
+	}
+	return image;
+}
+
+int
+ufs_mount(const char *path, size_t size)
+{
+	pthread_mutex_lock(&ufs_mutex);
+	struct image_super *image = NULL;
+	if (block_pool.image == NULL && file_list == NULL &&
+	    dir_count == 0 && file_descriptor_count == 0)
+		image = image_map(path, size);
+	if (image == NULL) {
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	/* No files, nothing uses the heap blocks. */
+	block_pool_destroy();
+	block_pool.image = image;
+	if (image->meta_offset != 0 && !image_load()) {
+		image_unmount();
+		pthread_mutex_unlock(&ufs_mutex);
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	pthread_mutex_unlock(&ufs_mutex);
+	return 0;
+}
+
+int
+ufs_sync(void)
+{
+	pthread_mutex_lock(&ufs_mutex);
+	int rc = block_pool.image == NULL ? 0 : image_save();
+	pthread_mutex_unlock(&ufs_mutex);
+	return rc;
+}
 
 void
 ufs_destroy(void)
 {
+	/* No other threads are supposed to use the FS now. */
+	for (int fd = 0; fd < filedesc_capacity(); ++fd) {
+		if (file_descriptors->descs[fd] != NULL)
+			ufs_close(fd);
+	}
+	while (file_descriptors != NULL) {
+		struct filedesc_table *t = file_descriptors;
+		file_descriptors = t->prev;
+		free(t);
+	}
+	file_descriptor_count = 0;
+	free(file_descriptor_free);
+	file_descriptor_free = NULL;
+	free(file_descriptor_free_words);
+	file_descriptor_free_words = NULL;
+	file_descriptor_free_hint = 0;
+	if (block_pool.image != NULL) {
+		image_save();
+		image_unmount();
+	}
+	while (file_list != NULL) {
+		struct file *f = file_list;
+		file_unlink(f);
+		file_delete(f);
+	}
+	dir_delete_all(&dir_root);
+	block_pool_destroy();
+	block_shift_min = __builtin_ctz(BLOCK_SIZE);
+	block_shift_max = __builtin_ctz(BLOCK_SIZE_MAX);
+#if NEED_LATENCY
+	memset(ufs_latency, 0, sizeof(ufs_latency));
+#endif
 }
@@ -1,12 +1,24 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
  * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * has an unique path. The parts of the path before the last '/'
+ * are the directories, which must exist, see ufs_mkdir(). A path
+ * without '/' is in the root directory, and "/a" is the same as
+ * "a".
+ *
+ * The functions can be called from many threads at once. Calls on
+ * different files go in parallel, reads of one file too, and a
+ * write to a file is atomic for the reads of it. But one descriptor
+ * has one position, so the calls moving it (read, write, and the
+ * like) should not be done on one descriptor from many threads at
+ * once. Use ufs_pread() and ufs_pwrite() for that.
  */
 
 /**
@@ -23,8 +35,17 @@
  * It is important to define these macros here, in the header,
  * because it is used by tests.
  */
-#define NEED_OPEN_FLAGS 0
-#define NEED_RESIZE 0
+#define NEED_OPEN_FLAGS 1
+#define NEED_RESIZE 1
+
+/**
+ * Build with -DNEED_LATENCY=1 to collect the latencies of the calls
+ * into ufs_stats(). It costs a clock read at the start and at the
+ * end of each call, so it is off by default.
+ */
+#ifndef NEED_LATENCY
+#define NEED_LATENCY 0
+#endif
 
 /**
  * Flags for ufs_open call.
@@ -67,9 +88,12 @@ enum ufs_error_code {
 
 	UFS_ERR_NO_PERMISSION,
 #endif
+	UFS_ERR_IO,
+	UFS_ERR_EXISTS,
+	UFS_ERR_NOT_EMPTY,
 };
 
-/** Get code of the last error. */
+/** Get code of the last error in this thread. */
 enum ufs_error_code
 ufs_errno();
 
@@ -81,7 +105,9 @@ ufs_errno();
  * @retval > 0 File descriptor.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified, or no such directory on the way.
+ *     - UFS_ERR_EXISTS - it is a directory, and UFS_CREATE flag
+ *       is specified.
  */
 int
 ufs_open(const char *filename, int flags);
@@ -114,6 +140,114 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data to the file at the offset @a offset. The descriptor's
+ * position is not changed. If the offset is beyond the file end,
+ * the gap is filled with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Offset in the file to write at.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file at the offset @a offset. The descriptor's
+ * position is not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Offset in the file to read from.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Write the buffers one after another, like ufs_write() of each of
+ * them, but all at once or nothing.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Count of @a iov.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read into the buffers one after another, like ufs_read() into each
+ * of them, but with one lookup of the position in the file. A buffer
+ * is filled fully before the next one, unless the file ends.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to read into.
+ * @param iovcnt Count of @a iov.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/** Part of a file's memory, see ufs_read_span(). */
+struct ufs_span {
+	const char *data;
+	size_t size;
+	/** Private, the memory held by ufs_pread_span(). */
+	void *block;
+	size_t block_size;
+};
+
+/**
+ * Read data from the file without copying it. The span points right
+ * into the file's memory, and the descriptor's position is moved
+ * past it. A span is never bigger than @a max and doesn't cross a
+ * block border, so a few calls can be needed for a long part.
+ *
+ * The memory stays valid till the next ufs_read_span() or
+ * ufs_close() on the same descriptor, even if the file is shrunk
+ * meanwhile. But the data can be changed by writes into the file.
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param max Maximum bytes to read.
+ * @param[out] out The read data.
+ *
+ * @retval > 0 Size of the span.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_read_span(int fd, size_t max, struct ufs_span *out);
+
+/**
+ * Same as ufs_read_span(), but at the offset @a offset, and the
+ * descriptor's position is not changed. The span holds its memory
+ * by itself, till ufs_span_release(). So many threads can read the
+ * spans of one descriptor at once, and keep them for any time.
+ */
+ssize_t
+ufs_pread_span(int fd, size_t max, size_t offset, struct ufs_span *out);
+
+/** Release the memory of a span from ufs_pread_span(). */
+void
+ufs_span_release(struct ufs_span *span);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -139,6 +273,99 @@ ufs_close(int fd);
 int
 ufs_delete(const char *filename);
 
+/**
+ * Make a copy of a file with a new name, which shares the blocks
+ * with the original instead of copying them. A block is copied only
+ * on the first write into it by either of the files. So a clone of
+ * any size costs a pointer per block, and is a stable snapshot of
+ * the file while the original keeps being written, and vice versa.
+ * An existing file with the new name is replaced, as if deleted.
+ *
+ * @param src Name of the file to clone.
+ * @param dst Name of the copy.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such file, or no such directory on the
+ *       way to the copy.
+ *     - UFS_ERR_EXISTS - the copy's path is a directory.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+/**
+ * Create a directory. The directories on the way must exist.
+ * @param path Path of the new directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory on the way.
+ *     - UFS_ERR_EXISTS - a file or a directory with this path
+ *       exists.
+ */
+int
+ufs_mkdir(const char *path);
+
+/**
+ * Delete an empty directory.
+ * @param path Path of the directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_EMPTY - the directory has entries.
+ */
+int
+ufs_rmdir(const char *path);
+
+/** An entry of a directory, see ufs_readdir(). */
+struct ufs_dirent {
+	/** Name in the directory, without the path. */
+	const char *name;
+	bool is_dir;
+};
+
+/** A file or a directory, see ufs_getattr(). */
+struct ufs_attr {
+	bool is_dir;
+	/** Size of a file, 0 for a directory. */
+	size_t size;
+};
+
+/**
+ * Get what a path is. "" and "/" are the root.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such file or directory.
+ */
+int
+ufs_getattr(const char *path, struct ufs_attr *attr);
+
+struct ufs_dir;
+
+/**
+ * Open a directory for listing. Its entries are copied right away,
+ * so the listing costs as much as the directory size, and the
+ * changes after the opening are not seen by it. "" and "/" are the
+ * root.
+ * @param path Path of the directory.
+ * @retval Not NULL Listing to pass to ufs_readdir().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ */
+struct ufs_dir *
+ufs_opendir(const char *path);
+
+/**
+ * Get the next entry of the listing, in no particular order. The
+ * name is valid till ufs_closedir().
+ * @retval 1 The entry is saved into @a entry.
+ * @retval 0 No more entries.
+ */
+int
+ufs_readdir(struct ufs_dir *dir, struct ufs_dirent *entry);
+
+/** Free the listing. */
+void
+ufs_closedir(struct ufs_dir *dir);
+
 #if NEED_RESIZE
 
 /**
@@ -164,10 +391,158 @@ ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/**
+ * Set sizes of the blocks of the files created after this call. The
+ * first block of a file is @a min_size bytes, and each next one is
+ * twice bigger than the previous, up to @a max_size. So a big file
+ * is made of a few big blocks, and a small one wastes little memory.
+ * Equal sizes make all the blocks of the same size. The sizes are
+ * rounded up to powers of 2. By default the blocks grow from 512
+ * bytes to 1 MB.
+ */
+void
+ufs_set_block_size(size_t min_size, size_t max_size);
+
+/**
+ * Give back the memory wasted by the cold files. The small writes
+ * far apart and the truncates leave big blocks with a bit of data
+ * each. A compacted file has the blocks of only zeros turned into
+ * holes, and its data is moved into smaller blocks when that takes
+ * less memory. Or back into the bigger ones, up to the size of the
+ * new files, ufs_set_block_size(), once it is dense again. The
+ * freed blocks go back to the pool, and the opened descriptors keep
+ * their positions.
+ *
+ * A file is cold when it wasn't written since the previous call has
+ * passed it. So the first call only marks the files, and the ones
+ * written all the time are never moved. The compacted files are
+ * skipped till their next write, and so are the clones and the
+ * files with spans, see ufs_read_span(), which share their blocks.
+ *
+ * The opens, closes, and deletes wait for the call. For compacting
+ * in the background, a thread can call it periodically with a
+ * @a budget: how many bytes of the files to go over, at least one
+ * file. The next call continues with the rest of them. 0 is for all
+ * at once.
+ *
+ * @retval Memory size of the freed blocks.
+ */
+size_t
+ufs_compact(size_t budget);
+
+#if NEED_LATENCY
+
+/** Kinds of the calls in the latency histogram. */
+enum ufs_op {
+	/** ufs_open(). */
+	UFS_OP_OPEN,
+	/** ufs_close(). */
+	UFS_OP_CLOSE,
+	/** ufs_read(), ufs_readv(), ufs_pread(), ufs_read_span(). */
+	UFS_OP_READ,
+	/** ufs_write(), ufs_writev(), ufs_pwrite(). */
+	UFS_OP_WRITE,
+	/** ufs_delete(). */
+	UFS_OP_DELETE,
+	/** ufs_clone(). */
+	UFS_OP_CLONE,
+	/** ufs_resize(). */
+	UFS_OP_RESIZE,
+	UFS_OP_COUNT,
+};
+
+enum {
+	/** Bucket i counts the calls of [2^i, 2^(i+1)) nanoseconds. */
+	UFS_LATENCY_BUCKET_COUNT = 32,
+};
+
+#endif
+
+/** The memory and the files of the FS, see ufs_stats(). */
+struct ufs_stats {
+	/** Files with a name. */
+	size_t file_count;
+	/** Directories, except the root. */
+	size_t dir_count;
+	/** Opened descriptors. */
+	size_t descriptor_count;
+	/** Blocks taken by the files, the spans, and an image's list. */
+	size_t block_count;
+	/** Memory of these blocks. */
+	size_t reserved_size;
+	/**
+	 * Bytes of the files' data in them. A block shared by clones is
+	 * counted once, and the holes are not counted at all.
+	 */
+	size_t used_size;
+	/**
+	 * Bytes of the files' blocks after their ends, taken but holding
+	 * no data. It grows with the block size.
+	 */
+	size_t fragmented_size;
+	/** Memory of the free blocks kept for reuse. */
+	size_t cached_size;
+#if NEED_LATENCY
+	/** Call counts by the kind and by the log2 of nanoseconds. */
+	uint64_t latency[UFS_OP_COUNT][UFS_LATENCY_BUCKET_COUNT];
+#endif
+};
+
+/**
+ * Get the usage of the memory and the counts of the files and the
+ * descriptors. The reserved memory is what the blocks take, and
+ * the used one is the data in them, so the difference shows the
+ * waste of the chosen block sizes. The blocks of the deleted files
+ * still opened, and the ones pinned only by spans, are reserved
+ * too. Other threads' calls meanwhile can make it a bit stale.
+ */
+void
+ufs_stats(struct ufs_stats *stats);
+
+/**
+ * Keep the FS in an image file mapped into the memory, instead of
+ * the heap. An existing image is opened with all its files, and
+ * their data is used right from the mapping, not read nor copied.
+ * Otherwise a new image of @a size bytes is created, which is then
+ * the limit for all the files together.
+ *
+ * The FS must be empty, before any file is created, or right after
+ * ufs_destroy(). The files are saved by ufs_sync() and by
+ * ufs_destroy(), which also unmaps the image, and the FS is in the
+ * heap again.
+ *
+ * @param path Image file.
+ * @param size Size of a new image. Unused for an existing one.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - the FS is not empty, the file can't be opened
+ *       or mapped, or it is not an image.
+ */
+int
+ufs_mount(const char *path, size_t size);
+
+/**
+ * Save the files into the image, ufs_mount(). The data is already
+ * there, so only the names, sizes, and block offsets are written,
+ * and the image is flushed to the disk. Nothing to do without an
+ * image.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - no space for the file list in the image.
+ *     - UFS_ERR_IO - the image can't be flushed.
+ */
+int
+ufs_sync(void);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
  * be used. Purpose of the destruction is to reclaim all the dynamic memory.
+ * No other thread may use the FS during the destruction. With an
+ * image, the files are saved in it, ufs_sync(), and only the memory
+ * is freed.
  */
 void
 ufs_destroy(void);
@@ -0,0 +1,757 @@
+/*
+ * Throughput of the thread pool on tiny tasks, in thousands of
+ * tasks per second.
+ *
+ * Push and join: the given number of threads push their shares of
+ * 100000 tasks into a pool of 4 workers, and then join them. Each
+ * task is an atomic increment, so nearly all the cost is the queue:
+ * the pushes and pops by many threads at once, and the wakeups of
+ * the workers.
+ *
+ * Batch push and join: the same, but each thread pushes all its
+ * share by one thread_pool_push_tasks().
+ *
+ * Quicksort: a parallel quicksort of 4M random ints, in ms. Each
+ * task partitions its part, pushes the left half as a new task into
+ * the same pool, and goes on with the right half. Small parts are
+ * sorted by qsort(). So all the tasks but the first are pushed by
+ * the workers themselves, and are spread between them by stealing.
+ *
+ * Task tree: each task pushes two detached subtasks into the same
+ * pool, down to 2^17 leaves, in K tasks per second. So nearly all
+ * the tasks are created and deleted by the workers.
+ *
+ * Parallel for: a pass over 16M ints, in ms. First by hand, a task
+ * per 1024 ints pushed and joined, then by thread_pool_parallel_for()
+ * with the same grain, and with no grain.
+ *
+ * Queue wait: a batch of bulk tasks of 20us each, and meanwhile a
+ * trickle of tiny latency-critical ones, p99 of the time from the
+ * push to the start, in us, per class. First with all the tasks of
+ * the same priority, then with the bulk ones low and the critical
+ * ones high.
+ *
+ * Empty tasks: push and join by one thread, like above, into pools
+ * of 1 to 20 workers. Shows how the queue and the wakeups scale with
+ * the worker count, rather than with the pusher count.
+ *
+ * Push to start and join latency: one empty task at a time into the
+ * pool of sleeping workers, in us. The time from the push to the
+ * start of the task, and from its return to the return of the join.
+ * So both are mostly a wakeup of a sleeping thread.
+ *
+ * Delete with a full queue: the workers are held by the tasks
+ * waiting for a flag, and the queue is filled up to TPOOL_MAX_TASKS
+ * with detached tasks. Then the flag is set and the delete is
+ * retried till it succeeds, in ms. So it is the drain of the whole
+ * queue, the free of the detached tasks, and the stop of the workers.
+ *
+ * Memory scan: each task fills its own 16MB buffer and sums it
+ * several times, in GB per second scanned. The pages are on the node
+ * where the task has first touched them. A NUMA-aware pool keeps the
+ * worker on that node, while a plain one lets the scheduler move it
+ * to another socket, and then every read is remote. On a single node
+ * both are the same.
+ *
+ * Build it for each queue to compare them, see 'make bench'.
+ */
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum {
+	BENCH_RUN_COUNT = 5,
+	BENCH_TASK_COUNT = 100000,
+	BENCH_WORKER_COUNT = 4,
+	BENCH_PUSHER_COUNT_MAX = 4,
+	BENCH_SORT_SIZE = 1 << 22,
+	BENCH_SORT_CUTOFF = 1 << 12,
+	BENCH_TREE_DEPTH = 17,
+	BENCH_FOR_SIZE = 1 << 24,
+	BENCH_FOR_GRAIN = 1 << 10,
+	BENCH_WAIT_BULK_COUNT = 4000,
+	BENCH_WAIT_BULK_US = 20,
+	BENCH_WAIT_CRITICAL_COUNT = 200,
+	BENCH_WAIT_CRITICAL_PERIOD_US = 200,
+	BENCH_LATENCY_COUNT = 1000,
+	BENCH_SCAN_TASK_COUNT = 16,
+	BENCH_SCAN_SIZE = 1 << 24,
+	BENCH_SCAN_REPEAT = 8,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_double(const void *l, const void *r)
+{
+	double a = *(const double *)l;
+	double b = *(const double *)r;
+	return a < b ? -1 : a > b;
+}
+
+static void
+bench_print(const char *title, size_t param, const char *name,
+	double *times)
+{
+	qsort(times, BENCH_RUN_COUNT, sizeof(times[0]), bench_cmp_double);
+	printf("%s %zu, %s queue\n", title, param, name);
+	printf("    min: %.2lf\n", times[0]);
+	printf("    med: %.2lf\n", times[BENCH_RUN_COUNT / 2]);
+	printf("    max: %.2lf\n", times[BENCH_RUN_COUNT - 1]);
+}
+
+static void
+bench_check_rc(int rc, const char *what)
+{
+	if (rc == 0)
+		return;
+	printf("Error: %s failed: %d\n", what, rc);
+	exit(-1);
+}
+
+static void *
+bench_incr_f(void *arg)
+{
+	__atomic_add_fetch((int *)arg, 1, __ATOMIC_RELAXED);
+	return arg;
+}
+
+struct bench_pusher {
+	pthread_t id;
+	struct thread_pool *pool;
+	struct thread_task **tasks;
+	int count;
+	bool is_batch;
+};
+
+static void *
+bench_pusher_f(void *arg)
+{
+	struct bench_pusher *p = arg;
+	if (p->is_batch) {
+		bench_check_rc(thread_pool_push_tasks(p->pool, p->tasks,
+			p->count), "push batch");
+	} else {
+		for (int i = 0; i < p->count; ++i)
+			bench_check_rc(thread_pool_push_task(p->pool,
+				p->tasks[i]), "push");
+	}
+	for (int i = 0; i < p->count; ++i) {
+		void *result;
+		bench_check_rc(thread_task_join(p->tasks[i], &result), "join");
+	}
+	return NULL;
+}
+
+/** K tasks per second pushed and joined by the given threads. */
+static double
+bench_push_join(struct thread_pool *pool, struct thread_task **tasks,
+	int pusher_count, bool is_batch)
+{
+	struct bench_pusher pushers[BENCH_PUSHER_COUNT_MAX];
+	int share = BENCH_TASK_COUNT / pusher_count;
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < pusher_count; ++i) {
+		pushers[i].pool = pool;
+		pushers[i].tasks = tasks + i * share;
+		pushers[i].count = share;
+		pushers[i].is_batch = is_batch;
+		bench_check_rc(pthread_create(&pushers[i].id, NULL,
+			bench_pusher_f, &pushers[i]), "pthread_create");
+	}
+	for (int i = 0; i < pusher_count; ++i)
+		pthread_join(pushers[i].id, NULL);
+	uint64_t duration = bench_now_ns() - start;
+	return (double)share * pusher_count * 1000000 / duration;
+}
+
+struct bench_sort {
+	struct thread_pool *pool;
+	/** Elements not yet in their places. Atomic. */
+	size_t left;
+	/** The last part signals the end. */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+struct bench_sort_part {
+	struct bench_sort *sort;
+	int *data;
+	size_t size;
+};
+
+static int
+bench_cmp_int(const void *l, const void *r)
+{
+	int a = *(const int *)l;
+	int b = *(const int *)r;
+	return a < b ? -1 : a > b;
+}
+
+/**
+ * Hoare partition around the middle element. Returns the size of
+ * the left part, never 0 nor the whole size.
+ */
+static size_t
+bench_partition(int *data, size_t size)
+{
+	int pivot = data[(size - 1) / 2];
+	size_t i = 0;
+	size_t j = size - 1;
+	while (true) {
+		while (data[i] < pivot)
+			++i;
+		while (data[j] > pivot)
+			--j;
+		if (i >= j)
+			return j + 1;
+		int tmp = data[i];
+		data[i++] = data[j];
+		data[j--] = tmp;
+	}
+}
+
+static void bench_sort_push(struct bench_sort *sort, int *data, size_t size);
+
+static void *
+bench_sort_f(void *arg)
+{
+	struct bench_sort_part *part = arg;
+	struct bench_sort *sort = part->sort;
+	int *data = part->data;
+	size_t size = part->size;
+	free(part);
+	while (size > BENCH_SORT_CUTOFF) {
+		size_t left_size = bench_partition(data, size);
+		bench_sort_push(sort, data, left_size);
+		data += left_size;
+		size -= left_size;
+	}
+	qsort(data, size, sizeof(data[0]), bench_cmp_int);
+	if (__atomic_sub_fetch(&sort->left, size, __ATOMIC_ACQ_REL) == 0) {
+		pthread_mutex_lock(&sort->mutex);
+		pthread_cond_signal(&sort->cond);
+		pthread_mutex_unlock(&sort->mutex);
+	}
+	return NULL;
+}
+
+static void
+bench_sort_push(struct bench_sort *sort, int *data, size_t size)
+{
+	struct bench_sort_part *part = malloc(sizeof(*part));
+	part->sort = sort;
+	part->data = data;
+	part->size = size;
+	struct thread_task *task;
+	thread_task_new(&task, bench_sort_f, part);
+	bench_check_rc(thread_pool_push_task(sort->pool, task), "push");
+	bench_check_rc(thread_task_detach(task), "detach");
+}
+
+/** Milliseconds to sort the array of random ints in the pool. */
+static double
+bench_quicksort(struct bench_sort *sort, int *data, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		data[i] = rand();
+	uint64_t start = bench_now_ns();
+	__atomic_store_n(&sort->left, size, __ATOMIC_RELAXED);
+	bench_sort_push(sort, data, size);
+	pthread_mutex_lock(&sort->mutex);
+	while (__atomic_load_n(&sort->left, __ATOMIC_ACQUIRE) != 0)
+		pthread_cond_wait(&sort->cond, &sort->mutex);
+	pthread_mutex_unlock(&sort->mutex);
+	uint64_t duration = bench_now_ns() - start;
+	for (size_t i = 1; i < size; ++i) {
+		if (data[i - 1] > data[i]) {
+			printf("Error: not sorted at %zu\n", i);
+			exit(-1);
+		}
+	}
+	return (double)duration / 1000000;
+}
+
+struct bench_tree;
+
+/** The argument of all the tasks of a depth. */
+struct bench_tree_level {
+	struct bench_tree *tree;
+	int depth;
+};
+
+struct bench_tree {
+	struct thread_pool *pool;
+	struct bench_tree_level levels[BENCH_TREE_DEPTH + 1];
+	/** Leaves not run yet. Atomic. */
+	int left;
+	bool is_done;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static void *
+bench_tree_f(void *arg)
+{
+	struct bench_tree_level *level = arg;
+	struct bench_tree *tree = level->tree;
+	if (level->depth == 0) {
+		if (__atomic_sub_fetch(&tree->left, 1, __ATOMIC_ACQ_REL) == 0) {
+			pthread_mutex_lock(&tree->mutex);
+			tree->is_done = true;
+			pthread_cond_signal(&tree->cond);
+			pthread_mutex_unlock(&tree->mutex);
+		}
+		return NULL;
+	}
+	for (int i = 0; i < 2; ++i) {
+		struct thread_task *task;
+		thread_task_new(&task, bench_tree_f, level - 1);
+		int rc = thread_pool_push_task(tree->pool, task);
+		/*
+		 * A FIFO queue goes breadth-first, and can hold more
+		 * leaves than fit. Then the subtree is done right here.
+		 */
+		if (rc == TPOOL_ERR_TOO_MANY_TASKS) {
+			thread_task_delete(task);
+			bench_tree_f(level - 1);
+			continue;
+		}
+		bench_check_rc(rc, "push");
+		bench_check_rc(thread_task_detach(task), "detach");
+	}
+	return NULL;
+}
+
+/** K tasks per second of the whole tree. */
+static double
+bench_task_tree(struct bench_tree *tree)
+{
+	tree->left = 1 << BENCH_TREE_DEPTH;
+	tree->is_done = false;
+	uint64_t start = bench_now_ns();
+	struct thread_task *root;
+	thread_task_new(&root, bench_tree_f,
+		&tree->levels[BENCH_TREE_DEPTH]);
+	bench_check_rc(thread_pool_push_task(tree->pool, root), "push");
+	bench_check_rc(thread_task_detach(root), "detach");
+	pthread_mutex_lock(&tree->mutex);
+	while (!tree->is_done)
+		pthread_cond_wait(&tree->cond, &tree->mutex);
+	pthread_mutex_unlock(&tree->mutex);
+	uint64_t duration = bench_now_ns() - start;
+	double count = (2 << BENCH_TREE_DEPTH) - 1;
+	return count * 1000000 / duration;
+}
+
+static void
+bench_for_f(size_t begin, size_t end, void *arg)
+{
+	int *data = arg;
+	for (size_t i = begin; i < end; ++i)
+		data[i] = data[i] * 3 + 1;
+}
+
+struct bench_chunk {
+	int *data;
+	size_t begin;
+	size_t end;
+};
+
+static void *
+bench_chunk_f(void *arg)
+{
+	struct bench_chunk *c = arg;
+	bench_for_f(c->begin, c->end, c->data);
+	return NULL;
+}
+
+/** Milliseconds for the pass, by fixed chunks or by parallel_for. */
+static double
+bench_for(struct thread_pool *pool, int *data, bool is_by_hand, size_t grain)
+{
+	uint64_t start = bench_now_ns();
+	if (!is_by_hand) {
+		bench_check_rc(thread_pool_parallel_for(pool, 0,
+			BENCH_FOR_SIZE, grain, bench_for_f, data),
+			"parallel for");
+		return (double)(bench_now_ns() - start) / 1000000;
+	}
+	enum { COUNT = BENCH_FOR_SIZE / BENCH_FOR_GRAIN };
+	struct bench_chunk *chunks = malloc(COUNT * sizeof(chunks[0]));
+	struct thread_task **tasks = malloc(COUNT * sizeof(tasks[0]));
+	for (int i = 0; i < COUNT; ++i) {
+		chunks[i].data = data;
+		chunks[i].begin = (size_t)i * BENCH_FOR_GRAIN;
+		chunks[i].end = chunks[i].begin + BENCH_FOR_GRAIN;
+		thread_task_new(&tasks[i], bench_chunk_f, &chunks[i]);
+		bench_check_rc(thread_pool_push_task(pool, tasks[i]), "push");
+	}
+	for (int i = 0; i < COUNT; ++i) {
+		void *result;
+		bench_check_rc(thread_task_join(tasks[i], &result), "join");
+		thread_task_delete(tasks[i]);
+	}
+	free(tasks);
+	free(chunks);
+	return (double)(bench_now_ns() - start) / 1000000;
+}
+
+struct bench_wait {
+	uint64_t push_ns;
+	uint64_t start_ns;
+	int work_us;
+};
+
+static void *
+bench_wait_f(void *arg)
+{
+	struct bench_wait *w = arg;
+	w->start_ns = bench_now_ns();
+	uint64_t end = w->start_ns + (uint64_t)w->work_us * 1000;
+	while (bench_now_ns() < end)
+		;
+	return NULL;
+}
+
+static int
+bench_cmp_u64(const void *l, const void *r)
+{
+	uint64_t a = *(const uint64_t *)l;
+	uint64_t b = *(const uint64_t *)r;
+	return a < b ? -1 : a > b;
+}
+
+/** p99 of the push to start times of the tasks, in us. */
+static double
+bench_wait_p99(struct bench_wait *waits, int count)
+{
+	uint64_t *ns = malloc(count * sizeof(ns[0]));
+	for (int i = 0; i < count; ++i)
+		ns[i] = waits[i].start_ns - waits[i].push_ns;
+	qsort(ns, count, sizeof(ns[0]), bench_cmp_u64);
+	double res = (double)ns[count * 99 / 100] / 1000;
+	free(ns);
+	return res;
+}
+
+/**
+ * Push the bulk batch and then the critical tasks one by one, with
+ * the given priorities. Store the p99 waits.
+ */
+static void
+bench_wait(struct thread_pool *pool, enum thread_task_priority bulk,
+	enum thread_task_priority critical, double *bulk_p99,
+	double *critical_p99)
+{
+	enum { COUNT = BENCH_WAIT_BULK_COUNT + BENCH_WAIT_CRITICAL_COUNT };
+	struct bench_wait *waits = malloc(COUNT * sizeof(waits[0]));
+	struct thread_task **tasks = malloc(COUNT * sizeof(tasks[0]));
+	for (int i = 0; i < COUNT; ++i) {
+		bool is_bulk = i < BENCH_WAIT_BULK_COUNT;
+		waits[i].work_us = is_bulk ? BENCH_WAIT_BULK_US : 0;
+		bench_check_rc(thread_task_new_ex(&tasks[i], bench_wait_f,
+			&waits[i], is_bulk ? bulk : critical), "new");
+	}
+	uint64_t now = bench_now_ns();
+	for (int i = 0; i < BENCH_WAIT_BULK_COUNT; ++i)
+		waits[i].push_ns = now;
+	bench_check_rc(thread_pool_push_tasks(pool, tasks,
+		BENCH_WAIT_BULK_COUNT), "push batch");
+	for (int i = BENCH_WAIT_BULK_COUNT; i < COUNT; ++i) {
+		uint64_t next = bench_now_ns() +
+			BENCH_WAIT_CRITICAL_PERIOD_US * 1000;
+		waits[i].push_ns = bench_now_ns();
+		bench_check_rc(thread_pool_push_task(pool, tasks[i]), "push");
+		while (bench_now_ns() < next)
+			sched_yield();
+	}
+	for (int i = 0; i < COUNT; ++i) {
+		void *result;
+		bench_check_rc(thread_task_join(tasks[i], &result), "join");
+		thread_task_delete(tasks[i]);
+	}
+	*bulk_p99 = bench_wait_p99(waits, BENCH_WAIT_BULK_COUNT);
+	*critical_p99 = bench_wait_p99(waits + BENCH_WAIT_BULK_COUNT,
+		BENCH_WAIT_CRITICAL_COUNT);
+	free(tasks);
+	free(waits);
+}
+
+struct bench_latency {
+	uint64_t start_ns;
+	uint64_t end_ns;
+};
+
+static void *
+bench_latency_f(void *arg)
+{
+	struct bench_latency *l = arg;
+	l->start_ns = bench_now_ns();
+	l->end_ns = bench_now_ns();
+	return NULL;
+}
+
+/** Mean push to start and finish to join times, in us. */
+static void
+bench_latency(struct thread_pool *pool, double *start_us, double *join_us)
+{
+	struct bench_latency l;
+	struct thread_task *task;
+	bench_check_rc(thread_task_new(&task, bench_latency_f, &l), "new");
+	uint64_t start_sum = 0;
+	uint64_t join_sum = 0;
+	for (int i = 0; i < BENCH_LATENCY_COUNT; ++i) {
+		uint64_t push_ns = bench_now_ns();
+		bench_check_rc(thread_pool_push_task(pool, task), "push");
+		void *result;
+		bench_check_rc(thread_task_join(task, &result), "join");
+		uint64_t join_ns = bench_now_ns();
+		start_sum += l.start_ns - push_ns;
+		join_sum += join_ns - l.end_ns;
+	}
+	thread_task_delete(task);
+	*start_us = (double)start_sum / BENCH_LATENCY_COUNT / 1000;
+	*join_us = (double)join_sum / BENCH_LATENCY_COUNT / 1000;
+}
+
+static void *
+bench_hold_f(void *arg)
+{
+	while (__atomic_load_n((bool *)arg, __ATOMIC_ACQUIRE))
+		sched_yield();
+	return NULL;
+}
+
+/** Ms to drain a full queue and delete the pool. */
+static double
+bench_delete_full(void)
+{
+	struct thread_pool *pool;
+	bench_check_rc(thread_pool_new(BENCH_WORKER_COUNT, &pool), "new");
+	struct thread_task **tasks = malloc(TPOOL_MAX_TASKS *
+		sizeof(tasks[0]));
+	bool is_held = true;
+	int counter = 0;
+	for (int i = 0; i < TPOOL_MAX_TASKS; ++i) {
+		bool is_holder = i < BENCH_WORKER_COUNT;
+		bench_check_rc(thread_task_new(&tasks[i], is_holder ?
+			bench_hold_f : bench_incr_f, is_holder ?
+			(void *)&is_held : (void *)&counter), "new");
+	}
+	bench_check_rc(thread_pool_push_tasks(pool, tasks, TPOOL_MAX_TASKS),
+		"push batch");
+	for (int i = 0; i < TPOOL_MAX_TASKS; ++i)
+		bench_check_rc(thread_task_detach(tasks[i]), "detach");
+	free(tasks);
+	uint64_t start = bench_now_ns();
+	__atomic_store_n(&is_held, false, __ATOMIC_RELEASE);
+	while (thread_pool_delete(pool) == TPOOL_ERR_HAS_TASKS)
+		sched_yield();
+	return (double)(bench_now_ns() - start) / 1000000;
+}
+
+static void *
+bench_scan_f(void *arg)
+{
+	(void)arg;
+	size_t count = BENCH_SCAN_SIZE / sizeof(uint64_t);
+	uint64_t *data = malloc(BENCH_SCAN_SIZE);
+	for (size_t i = 0; i < count; ++i)
+		data[i] = i;
+	uint64_t sum = 0;
+	for (int r = 0; r < BENCH_SCAN_REPEAT; ++r) {
+		for (size_t i = 0; i < count; ++i)
+			sum += data[i];
+		/* Keep the compiler from folding the repeats. */
+		__asm__ volatile("" : "+r"(sum));
+	}
+	free(data);
+	return (void *)(uintptr_t)sum;
+}
+
+/** GB per second summed by the tasks, first touch included. */
+static double
+bench_scan(bool is_numa_aware)
+{
+	struct thread_pool_attr attr;
+	thread_pool_attr_create(&attr);
+	attr.is_numa_aware = is_numa_aware;
+	struct thread_pool *pool;
+	bench_check_rc(thread_pool_new_ex(BENCH_WORKER_COUNT, &attr, &pool),
+		"new");
+	struct thread_task *tasks[BENCH_SCAN_TASK_COUNT];
+	for (int i = 0; i < BENCH_SCAN_TASK_COUNT; ++i)
+		thread_task_new(&tasks[i], bench_scan_f, NULL);
+	uint64_t start = bench_now_ns();
+	bench_check_rc(thread_pool_push_tasks(pool, tasks,
+		BENCH_SCAN_TASK_COUNT), "push batch");
+	for (int i = 0; i < BENCH_SCAN_TASK_COUNT; ++i) {
+		void *result;
+		bench_check_rc(thread_task_join(tasks[i], &result), "join");
+		thread_task_delete(tasks[i]);
+	}
+	uint64_t duration = bench_now_ns() - start;
+	bench_check_rc(thread_pool_delete(pool), "delete");
+	double bytes = (double)BENCH_SCAN_TASK_COUNT * BENCH_SCAN_SIZE *
+		BENCH_SCAN_REPEAT;
+	return bytes / duration;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *name = argc > 1 ? argv[1] : "default";
+	int counter = 0;
+	struct thread_task **tasks = malloc(BENCH_TASK_COUNT *
+		sizeof(tasks[0]));
+	for (int i = 0; i < BENCH_TASK_COUNT; ++i)
+		thread_task_new(&tasks[i], bench_incr_f, &counter);
+	struct thread_pool *pool;
+	bench_check_rc(thread_pool_new(BENCH_WORKER_COUNT, &pool), "new");
+	/* Start all the workers. */
+	bench_push_join(pool, tasks, 1, false);
+	for (int is_batch = 0; is_batch < 2; ++is_batch) {
+		const char *title = is_batch ? "Batch push and join, K tasks "
+			"per second, pusher count" : "Push and join, K tasks "
+			"per second, pusher count";
+		for (int count = 1; count <= BENCH_PUSHER_COUNT_MAX;
+		     count *= 2) {
+			double k_per_sec[BENCH_RUN_COUNT];
+			for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+				k_per_sec[run_i] = bench_push_join(pool, tasks,
+					count, is_batch);
+			}
+			bench_print(title, count, name, k_per_sec);
+		}
+	}
+	int worker_counts[] = {1, 2, 4, 8, 16, TPOOL_MAX_THREADS};
+	for (size_t i = 0; i < sizeof(worker_counts) /
+	     sizeof(worker_counts[0]); ++i) {
+		struct thread_pool *p;
+		bench_check_rc(thread_pool_new(worker_counts[i], &p), "new");
+		bench_push_join(p, tasks, 1, false);
+		double k_per_sec[BENCH_RUN_COUNT];
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			k_per_sec[run_i] = bench_push_join(p, tasks, 1, false);
+		bench_print("Empty tasks, K tasks per second, worker count",
+			worker_counts[i], name, k_per_sec);
+		bench_check_rc(thread_pool_delete(p), "delete");
+	}
+	for (int i = 0; i < BENCH_TASK_COUNT; ++i)
+		thread_task_delete(tasks[i]);
+	free(tasks);
+
+	struct bench_sort sort;
+	sort.pool = pool;
+	pthread_mutex_init(&sort.mutex, NULL);
+	pthread_cond_init(&sort.cond, NULL);
+	int *data = malloc(BENCH_SORT_SIZE * sizeof(data[0]));
+	srand(1);
+	double ms[BENCH_RUN_COUNT];
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+		ms[run_i] = bench_quicksort(&sort, data, BENCH_SORT_SIZE);
+	bench_print("Quicksort, ms, array size", BENCH_SORT_SIZE, name, ms);
+	pthread_cond_destroy(&sort.cond);
+	pthread_mutex_destroy(&sort.mutex);
+	free(data);
+
+	struct bench_tree *tree = malloc(sizeof(*tree));
+	tree->pool = pool;
+	for (int i = 0; i <= BENCH_TREE_DEPTH; ++i) {
+		tree->levels[i].tree = tree;
+		tree->levels[i].depth = i;
+	}
+	pthread_mutex_init(&tree->mutex, NULL);
+	pthread_cond_init(&tree->cond, NULL);
+	double k_per_sec[BENCH_RUN_COUNT];
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+		k_per_sec[run_i] = bench_task_tree(tree);
+	bench_print("Task tree, K tasks per second, depth", BENCH_TREE_DEPTH,
+		name, k_per_sec);
+	/* The same with the stats' clock reads. */
+	struct thread_pool_attr attr;
+	thread_pool_attr_create(&attr);
+	attr.is_timed = true;
+	bench_check_rc(thread_pool_new_ex(BENCH_WORKER_COUNT, &attr,
+		&tree->pool), "new");
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+		k_per_sec[run_i] = bench_task_tree(tree);
+	bench_print("Task tree, timed pool, K tasks per second, depth",
+		BENCH_TREE_DEPTH, name, k_per_sec);
+	while (thread_pool_delete(tree->pool) == TPOOL_ERR_HAS_TASKS)
+		sched_yield();
+	pthread_cond_destroy(&tree->cond);
+	pthread_mutex_destroy(&tree->mutex);
+	free(tree);
+
+	data = calloc(BENCH_FOR_SIZE, sizeof(data[0]));
+	/* By hand, with the same grain, with no grain. */
+	size_t grains[] = {BENCH_FOR_GRAIN, BENCH_FOR_GRAIN, 0};
+	const char *titles[] = {
+		"Parallel for by hand, ms, size",
+		"Parallel for, ms, size",
+		"Parallel for, no grain, ms, size",
+	};
+	for (int i = 0; i < 3; ++i) {
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			ms[run_i] = bench_for(pool, data, i == 0, grains[i]);
+		bench_print(titles[i], BENCH_FOR_SIZE, name, ms);
+	}
+	free(data);
+
+	for (int is_prio = 0; is_prio < 2; ++is_prio) {
+		double bulk_us[BENCH_RUN_COUNT];
+		double critical_us[BENCH_RUN_COUNT];
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+			bench_wait(pool, is_prio ? TPOOL_PRIORITY_LOW :
+				TPOOL_PRIORITY_NORMAL, is_prio ?
+				TPOOL_PRIORITY_HIGH : TPOOL_PRIORITY_NORMAL,
+				&bulk_us[run_i], &critical_us[run_i]);
+		}
+		const char *mode = is_prio ? "low and high" : "all normal";
+		printf("Queue wait p99, us, %s:\n", mode);
+		bench_print("    bulk tasks, count", BENCH_WAIT_BULK_COUNT,
+			name, bulk_us);
+		bench_print("    critical tasks, count",
+			BENCH_WAIT_CRITICAL_COUNT, name, critical_us);
+	}
+	double start_us[BENCH_RUN_COUNT];
+	double join_us[BENCH_RUN_COUNT];
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+		bench_latency(pool, &start_us[run_i], &join_us[run_i]);
+	bench_print("Push to start latency, us, tasks", BENCH_LATENCY_COUNT,
+		name, start_us);
+	bench_print("Finish to join latency, us, tasks", BENCH_LATENCY_COUNT,
+		name, join_us);
+	/* The detached tasks are deleted by the workers, a bit later. */
+	while (thread_pool_delete(pool) == TPOOL_ERR_HAS_TASKS)
+		sched_yield();
+
+	for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+		ms[run_i] = bench_delete_full();
+	bench_print("Delete with a full queue, ms, tasks", TPOOL_MAX_TASKS,
+		name, ms);
+
+	for (int is_numa = 0; is_numa < 2; ++is_numa) {
+		double gb_per_sec[BENCH_RUN_COUNT];
+		for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i)
+			gb_per_sec[run_i] = bench_scan(is_numa);
+		bench_print(is_numa ? "Memory scan, GB per second, NUMA-aware "
+			"workers" : "Memory scan, GB per second, plain workers",
+			BENCH_WORKER_COUNT, name, gb_per_sec);
+	}
+	return 0;
+}
@@ -1,6 +1,10 @@
+/* sched_getaffinity() and sched_getcpu(). */
+#define _GNU_SOURCE
 #include "thread_pool.h"
 #include "unit.h"
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdint.h>
 
@@ -363,6 +367,766 @@ test_detach_long(void)
 #endif
 }
 
+struct task_tree {
+	struct thread_pool *pool;
+	int depth;
+	int *leaf_count;
+};
+
+static void *
+task_push_child_f(void *arg)
+{
+	struct task_tree *node = arg;
+	struct thread_task *child;
+	if (thread_task_new(&child, task_incr_f, node->leaf_count) != 0 ||
+	    thread_pool_push_task(node->pool, child) != 0)
+		return NULL;
+	return child;
+}
+
+#if NEED_DETACH
+
+static void *
+task_tree_f(void *arg)
+{
+	struct task_tree *node = arg;
+	if (node->depth == 0) {
+		__atomic_add_fetch(node->leaf_count, 1, __ATOMIC_RELAXED);
+		free(node);
+		return NULL;
+	}
+	for (int i = 0; i < 2; ++i) {
+		struct task_tree *child = malloc(sizeof(*child));
+		*child = *node;
+		--child->depth;
+		struct thread_task *task;
+		if (thread_task_new(&task, task_tree_f, child) != 0 ||
+		    thread_pool_push_task(node->pool, task) != 0 ||
+		    thread_task_detach(task) != 0)
+			abort();
+	}
+	free(node);
+	return NULL;
+}
+
+#endif
+
+static void
+test_push_from_task(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	int leaf_count = 0;
+	struct task_tree parent = {p, 1, &leaf_count};
+	struct thread_task *task;
+	unit_fail_if(thread_task_new(&task, task_push_child_f, &parent) != 0);
+	unit_fail_if(thread_pool_push_task(p, task) != 0);
+	void *result;
+	unit_fail_if(thread_task_join(task, &result) != 0);
+	struct thread_task *child = result;
+	unit_check(child != NULL, "a task pushes into its pool");
+	unit_check(thread_task_join(child, &result) == 0 && leaf_count == 1,
+		   "the subtask runs");
+	unit_fail_if(thread_task_delete(child) != 0);
+	unit_fail_if(thread_task_delete(task) != 0);
+#if NEED_DETACH
+	/*
+	 * The tasks spread from one worker to the others only by
+	 * stealing.
+	 */
+	leaf_count = 0;
+	struct task_tree *root = malloc(sizeof(*root));
+	root->pool = p;
+	root->depth = 10;
+	root->leaf_count = &leaf_count;
+	unit_fail_if(thread_task_new(&task, task_tree_f, root) != 0);
+	unit_fail_if(thread_pool_push_task(p, task) != 0);
+	unit_fail_if(thread_task_join(task, &result) != 0);
+	unit_fail_if(thread_task_delete(task) != 0);
+	while (__atomic_load_n(&leaf_count, __ATOMIC_RELAXED) != 1 << 10)
+		usleep(1000);
+	unit_check(true, "a tree of tasks pushed by tasks");
+	while (thread_pool_delete(p) != 0)
+		usleep(100);
+#else
+	unit_fail_if(thread_pool_delete(p) != 0);
+#endif
+
+	unit_test_finish();
+}
+
+static void
+test_push_tasks(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(5, &p) != 0);
+	int count = TPOOL_MAX_TASKS;
+	struct thread_task **tasks = malloc(sizeof(*tasks) * count);
+	int arg = 0;
+	for (int i = 0; i < count; ++i)
+		thread_task_new(&tasks[i], task_incr_f, &arg);
+	unit_check(thread_pool_push_tasks(p, tasks, 0) == 0, "push nothing");
+	unit_check(thread_pool_push_tasks(p, tasks, -1) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative count");
+	/*
+	 * Normal batch.
+	 */
+	unit_check(thread_pool_push_tasks(p, tasks, 1000) == 0, "push a batch");
+	void *result;
+	for (int i = 0; i < 1000; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	unit_check(arg == 1000, "all the batch is done");
+	unit_check(thread_pool_thread_count(p) <= 5, "the threads are limited");
+	/*
+	 * All or nothing.
+	 */
+	int wait_arg = 0;
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, task_wait_for_f, &wait_arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	struct thread_task *pair[2] = {tasks[0], t};
+	unit_check(thread_pool_push_tasks(p, pair, 2) == TPOOL_ERR_TASK_IN_POOL,
+		   "a batch with a pushed task");
+	unit_check(thread_pool_push_tasks(p, tasks, count) ==
+		   TPOOL_ERR_TOO_MANY_TASKS, "a batch over the limit");
+	unit_check(thread_task_delete(tasks[0]) == 0 &&
+		   thread_task_delete(tasks[count - 1]) == 0,
+		   "nothing is pushed on an error");
+	__atomic_store_n(&wait_arg, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	for (int i = 1; i < count - 1; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	free(tasks);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_spawn_per_push(void)
+{
+	unit_test_start();
+	/*
+	 * A new worker is idle till it takes its task, so the pushes
+	 * right after it must not count on it.
+	 */
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	int arg = 0;
+	struct thread_task *tasks[4];
+	for (int i = 0; i < 4; ++i) {
+		thread_task_new(&tasks[i], task_wait_for_f, &arg);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	unit_check(thread_pool_thread_count(p) == 4,
+		   "a thread per push while all are busy");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	void *result;
+	for (int i = 0; i < 4; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	arg = 0;
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 2) != 0);
+	unit_fail_if(thread_pool_push_tasks(p, tasks + 2, 2) != 0);
+	unit_check(thread_pool_thread_count(p) == 4,
+		   "same for the batches");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 4; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_adaptive_size(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_attr attr;
+	thread_pool_attr_create(&attr);
+	attr.keep_alive = -1;
+	unit_check(thread_pool_new_ex(3, &attr, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative keep-alive");
+	/*
+	 * Idle threads retire.
+	 */
+	attr.keep_alive = 0.05;
+	unit_fail_if(thread_pool_new_ex(3, &attr, &p) != 0);
+	int arg = 0;
+	struct thread_task *tasks[3];
+	for (int i = 0; i < 3; ++i)
+		thread_task_new(&tasks[i], task_wait_for_f, &arg);
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 3) != 0);
+	unit_check(thread_pool_thread_count(p) == 3, "all threads are busy");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	void *result;
+	for (int i = 0; i < 3; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	while (thread_pool_thread_count(p) != 0)
+		usleep(1000);
+	unit_check(true, "then they retire");
+	arg = 0;
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 3) != 0);
+	unit_check(thread_pool_thread_count(p) == 3, "and are spawned again");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 3; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * Spawn by the queue latency.
+	 */
+	thread_pool_attr_create(&attr);
+	/* Never reached, even on a loaded machine. */
+	attr.spawn_delay = 100;
+	unit_fail_if(thread_pool_new_ex(3, &attr, &p) != 0);
+	arg = 0;
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 3) != 0);
+	unit_check(thread_pool_thread_count(p) == 1, "one thread for a start");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 3; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	attr.spawn_delay = 0.01;
+	unit_fail_if(thread_pool_new_ex(3, &attr, &p) != 0);
+	arg = 0;
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 3) != 0);
+	/* The first one is stuck on a task, the others wait too long. */
+	usleep(20000);
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(thread_pool_thread_count(p) >= 2,
+		   "more when the tasks have waited");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void *
+task_get_cpu_f(void *arg)
+{
+	(void)arg;
+	return (void *)(intptr_t)sched_getcpu();
+}
+
+static void
+test_placement(void)
+{
+	unit_test_start();
+
+	cpu_set_t allowed;
+	unit_fail_if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0);
+	int cpu = 0;
+	while (!CPU_ISSET(cpu, &allowed))
+		++cpu;
+	struct thread_pool *p;
+	struct thread_pool_attr attr;
+	thread_pool_attr_create(&attr);
+	int bad_cpu = -1;
+	attr.cpus = &bad_cpu;
+	attr.cpu_count = 1;
+	unit_check(thread_pool_new_ex(3, &attr, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative CPU");
+	bad_cpu = CPU_SETSIZE;
+	unit_check(thread_pool_new_ex(3, &attr, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "too big CPU");
+	attr.cpus = &cpu;
+	attr.cpu_count = -1;
+	unit_check(thread_pool_new_ex(3, &attr, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative CPU count");
+	/*
+	 * The workers run only on the given CPU.
+	 */
+	attr.cpu_count = 1;
+	unit_fail_if(thread_pool_new_ex(3, &attr, &p) != 0);
+	struct thread_task *tasks[3];
+	for (int i = 0; i < 3; ++i)
+		thread_task_new(&tasks[i], task_get_cpu_f, NULL);
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 3) != 0);
+	bool is_pinned = true;
+	void *result;
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		is_pinned = is_pinned && (intptr_t)result == cpu;
+	}
+	unit_check(is_pinned, "the workers are pinned");
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * Per-node queues still get all the tasks done, from outside
+	 * and from the tasks.
+	 */
+	thread_pool_attr_create(&attr);
+	attr.is_numa_aware = true;
+	unit_fail_if(thread_pool_new_ex(3, &attr, &p) != 0);
+	for (int i = 0; i < 3; ++i)
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	int leaf_count = 0;
+	struct task_tree parent = {p, 1, &leaf_count};
+	struct thread_task *task;
+	unit_fail_if(thread_task_new(&task, task_push_child_f, &parent) != 0);
+	unit_fail_if(thread_pool_push_task(p, task) != 0);
+	unit_fail_if(thread_task_join(task, &result) != 0);
+	struct thread_task *child = result;
+	unit_check(thread_task_join(child, &result) == 0 && leaf_count == 1,
+		   "NUMA-aware pool runs the tasks");
+	unit_fail_if(thread_task_delete(child) != 0);
+	unit_fail_if(thread_task_delete(task) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void *
+task_order_f(void *arg)
+{
+	return (void *)(intptr_t)__atomic_add_fetch((int *)arg, 1,
+		__ATOMIC_RELAXED);
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	struct thread_task *t;
+	unit_check(thread_task_new_ex(&t, task_incr_f, NULL,
+		   TPOOL_PRIORITY_COUNT) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "no such priority");
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	int arg = 0;
+	struct thread_task *blocker;
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	/*
+	 * Queued while the only worker is busy, in a batch mixing the
+	 * priorities.
+	 */
+	enum thread_task_priority priorities[] = {
+		TPOOL_PRIORITY_LOW, TPOOL_PRIORITY_NORMAL, TPOOL_PRIORITY_HIGH,
+		TPOOL_PRIORITY_LOW, TPOOL_PRIORITY_HIGH,
+	};
+	/* The order of the start of each task. */
+	intptr_t expected[] = {4, 3, 1, 5, 2};
+	enum { COUNT = sizeof(priorities) / sizeof(priorities[0]) };
+	struct thread_task *tasks[COUNT];
+	int order = 0;
+	for (int i = 0; i < COUNT; ++i) {
+		unit_fail_if(thread_task_new_ex(&tasks[i], task_order_f,
+			     &order, priorities[i]) != 0);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, COUNT) != 0);
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	bool is_ordered = true;
+	void *result;
+	for (int i = 0; i < COUNT; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		is_ordered = is_ordered && (intptr_t)result == expected[i];
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(is_ordered, "higher priority runs first");
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+struct task_sum {
+	int *values;
+	int count;
+};
+
+static void *
+task_sum_f(void *arg)
+{
+	struct task_sum *sum = arg;
+	int res = 0;
+	for (int i = 0; i < sum->count; ++i)
+		res += __atomic_load_n(&sum->values[i], __ATOMIC_RELAXED);
+	return (void *)(intptr_t)res;
+}
+
+static void *
+task_store_order_f(void *arg)
+{
+	int *value = arg;
+	static int order = 0;
+	__atomic_store_n(value, __atomic_add_fetch(&order, 1,
+		__ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void
+test_then(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	struct thread_task *a, *b, *c, *d;
+	int values[3] = {0, 0, 0};
+	struct task_sum sum = {values, 3};
+	unit_fail_if(thread_task_new(&a, task_store_order_f, &values[0]) != 0);
+	unit_fail_if(thread_task_new(&b, task_store_order_f, &values[1]) != 0);
+	unit_fail_if(thread_task_new(&c, task_store_order_f, &values[2]) != 0);
+	unit_fail_if(thread_task_new(&d, task_sum_f, &sum) != 0);
+	unit_check(thread_task_then(a, a) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "a task can't wait for itself");
+	/*
+	 * A diamond: a, then b and c, then d. On one thread, so any
+	 * blocking join would hang.
+	 */
+	unit_fail_if(thread_task_then(a, b) != 0);
+	unit_fail_if(thread_task_then(a, c) != 0);
+	unit_fail_if(thread_task_then(b, d) != 0);
+	unit_fail_if(thread_task_then(c, d) != 0);
+	unit_check(thread_task_delete(d) == TPOOL_ERR_TASK_IN_POOL,
+		   "a continuation can't be deleted");
+	unit_check(thread_pool_push_task(p, d) == TPOOL_ERR_TASK_IN_POOL,
+		   "nor pushed");
+	void *result;
+#if NEED_TIMED_JOIN
+	unit_check(thread_task_timed_join(d, 0.01, &result) ==
+		   TPOOL_ERR_TIMEOUT, "nor run before its dependencies");
+#endif
+	unit_fail_if(thread_pool_push_task(p, a) != 0);
+	unit_fail_if(thread_task_join(d, &result) != 0);
+	unit_check((intptr_t)result == 1 + 2 + 3 && values[0] == 1,
+		   "the continuations run in order");
+	unit_fail_if(thread_task_join(a, &result) != 0);
+	unit_fail_if(thread_task_join(b, &result) != 0);
+	unit_fail_if(thread_task_join(c, &result) != 0);
+	/*
+	 * A continuation of a finished task is pushed right away.
+	 */
+	unit_fail_if(thread_pool_push_task(p, a) != 0);
+	while (!thread_task_is_finished(a))
+		usleep(100);
+	unit_fail_if(thread_task_then(a, d) != 0);
+	unit_fail_if(thread_task_join(d, &result) != 0);
+	unit_check(true, "then after the finish");
+	unit_fail_if(thread_task_join(a, &result) != 0);
+	/*
+	 * And of a joined one, waits for its next run.
+	 */
+	unit_fail_if(thread_task_then(a, d) != 0);
+#if NEED_TIMED_JOIN
+	unit_check(thread_task_timed_join(d, 0.01, &result) ==
+		   TPOOL_ERR_TIMEOUT, "then after the join waits");
+#endif
+	unit_fail_if(thread_pool_push_task(p, a) != 0);
+	unit_fail_if(thread_task_join(d, &result) != 0);
+	unit_fail_if(thread_task_join(a, &result) != 0);
+	unit_fail_if(thread_task_delete(a) != 0);
+	unit_fail_if(thread_task_delete(b) != 0);
+	unit_fail_if(thread_task_delete(c) != 0);
+	unit_fail_if(thread_task_delete(d) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+for_set_f(size_t begin, size_t end, void *arg)
+{
+	int *values = arg;
+	for (size_t i = begin; i < end; ++i)
+		values[i] += (int)i;
+}
+
+struct test_range {
+	size_t begin;
+	size_t end;
+};
+
+static void *
+map_range_f(size_t begin, size_t end, void *arg)
+{
+	(void)arg;
+	struct test_range *r = malloc(sizeof(*r));
+	r->begin = begin;
+	r->end = end;
+	return r;
+}
+
+/** Glue the neighbour ranges, NULL if they are not in order. */
+static void *
+reduce_range_f(void *left, void *right, void *arg)
+{
+	(void)arg;
+	struct test_range *l = left;
+	struct test_range *r = right;
+	if (l == NULL || r == NULL || l->end != r->begin) {
+		free(l);
+		free(r);
+		return NULL;
+	}
+	l->end = r->end;
+	free(r);
+	return l;
+}
+
+enum { TEST_PARALLEL_SIZE = 100000 };
+
+static void *
+task_parallel_for_f(void *arg)
+{
+	struct thread_pool *p = ((void **)arg)[0];
+	int *values = ((void **)arg)[1];
+	thread_pool_parallel_for(p, 0, TEST_PARALLEL_SIZE, 100, for_set_f,
+				 values);
+	return NULL;
+}
+
+static void
+test_parallel(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	int *values = calloc(TEST_PARALLEL_SIZE, sizeof(values[0]));
+	unit_check(thread_pool_parallel_for(p, 1, 0, 0, for_set_f, values) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "reversed range");
+	unit_check(thread_pool_parallel_for(p, 5, 5, 0, for_set_f, values) ==
+		   0, "empty range");
+	unit_fail_if(thread_pool_parallel_for(p, 0, TEST_PARALLEL_SIZE, 0,
+		     for_set_f, values) != 0);
+	bool is_ok = true;
+	for (int i = 0; i < TEST_PARALLEL_SIZE; ++i)
+		is_ok = is_ok && values[i] == i;
+	unit_check(is_ok, "parallel for visits each index once");
+	void *result;
+	unit_fail_if(thread_pool_parallel_reduce(p, 3, TEST_PARALLEL_SIZE, 7,
+		     map_range_f, reduce_range_f, NULL, &result) != 0);
+	struct test_range *r = result;
+	unit_check(r != NULL && r->begin == 3 && r->end == TEST_PARALLEL_SIZE,
+		   "parallel reduce keeps the order");
+	free(r);
+	unit_fail_if(thread_pool_parallel_reduce(p, 0, 0, 0, map_range_f,
+		     reduce_range_f, NULL, &result) != 0);
+	unit_check(result == NULL, "empty reduce");
+	unit_check(thread_pool_delete(p) == 0, "no tasks left after");
+	/*
+	 * From a task of a one thread pool the task itself does all.
+	 */
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	void *args[] = {p, values};
+	struct thread_task *task;
+	unit_fail_if(thread_task_new(&task, task_parallel_for_f, args) != 0);
+	unit_fail_if(thread_pool_push_task(p, task) != 0);
+	unit_fail_if(thread_task_join(task, &result) != 0);
+	is_ok = true;
+	for (int i = 0; i < TEST_PARALLEL_SIZE; ++i)
+		is_ok = is_ok && values[i] == 2 * i;
+	unit_check(is_ok, "parallel for in a task");
+	unit_fail_if(thread_task_delete(task) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	free(values);
+
+	unit_test_finish();
+}
+
+static void *
+task_reuse_f(void *arg)
+{
+	(void)arg;
+	struct thread_task *t1, *t2;
+	thread_task_new(&t1, task_incr_f, NULL);
+	thread_task_delete(t1);
+	thread_task_new(&t2, task_incr_f, NULL);
+	thread_task_delete(t2);
+	return (void *)(intptr_t)(t1 == t2);
+}
+
+static void
+test_task_reuse(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	struct thread_task *task;
+	unit_fail_if(thread_task_new(&task, task_reuse_f, NULL) != 0);
+	unit_fail_if(thread_pool_push_task(p, task) != 0);
+	void *result;
+	unit_fail_if(thread_task_join(task, &result) != 0);
+	unit_check(result == (void *)1, "a worker reuses the deleted tasks");
+	unit_fail_if(thread_task_delete(task) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static uint64_t
+histogram_sum(const uint64_t *histogram, int from)
+{
+	uint64_t sum = 0;
+	for (int i = from; i < TPOOL_STATS_BUCKET_COUNT; ++i)
+		sum += histogram[i];
+	return sum;
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct thread_pool_attr attr;
+	thread_pool_attr_create(&attr);
+	attr.is_timed = true;
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new_ex(1, &attr, &p) != 0);
+	struct thread_pool_stats stats;
+	thread_pool_get_stats(p, &stats);
+	unit_check(stats.thread_count == 0 && stats.queue_depth == 0 &&
+		   stats.run_count == 0, "empty stats of a new pool");
+	enum { COUNT = 5 };
+	struct thread_task *tasks[COUNT];
+	int is_released = 0;
+	int done_count = 0;
+	unit_fail_if(thread_task_new(&tasks[0], task_wait_for_f,
+		     &is_released) != 0);
+	for (int i = 1; i < COUNT; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f,
+			     &done_count) != 0);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, COUNT) != 0);
+	do {
+		usleep(100);
+		thread_pool_get_stats(p, &stats);
+	} while (stats.busy_count == 0);
+	unit_check(stats.thread_count == 1 && stats.idle_count == 0,
+		   "the worker is busy");
+	unit_check(stats.queue_depth == COUNT - 1 &&
+		   stats.peak_queue_depth >= COUNT - 1,
+		   "the others are queued");
+	/* Over 16 ms is in the bucket 15 or further. */
+	usleep(20000);
+	__atomic_store_n(&is_released, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < COUNT; ++i) {
+		void *result;
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	thread_pool_get_stats(p, &stats);
+	unit_check(stats.queue_depth == 0 &&
+		   stats.peak_queue_depth >= COUNT - 1,
+		   "the peak stays after the queue is empty");
+	unit_check(stats.run_count == COUNT &&
+		   histogram_sum(stats.wait_histogram, 0) == COUNT &&
+		   histogram_sum(stats.run_histogram, 0) == COUNT,
+		   "every task is in the histograms");
+	unit_check(histogram_sum(stats.run_histogram, 15) == 1,
+		   "the long run is in a late bucket");
+	unit_check(histogram_sum(stats.wait_histogram, 15) == COUNT - 1 &&
+		   stats.wait_ns_sum >= (COUNT - 1) * 20000000ULL,
+		   "so are the waits behind it");
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/* Not timed by default, but counted. */
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	unit_fail_if(thread_task_new(&tasks[0], task_incr_f,
+		     &done_count) != 0);
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	void *result;
+	unit_fail_if(thread_task_join(tasks[0], &result) != 0);
+	unit_fail_if(thread_task_delete(tasks[0]) != 0);
+	thread_pool_get_stats(p, &stats);
+	unit_check(stats.run_count == 1 && stats.run_ns_sum == 0 &&
+		   histogram_sum(stats.run_histogram, 0) == 0,
+		   "no times without the attribute");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+finish_count_f(struct thread_task *task, void *arg)
+{
+	void *result;
+	/* Finished already, so doesn't block. */
+	if (thread_task_join(task, &result) == 0 && result == arg)
+		__atomic_add_fetch((int *)arg, 1, __ATOMIC_RELEASE);
+}
+
+static void
+test_completions(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	int done_count = 0;
+	struct thread_task *task;
+	unit_fail_if(thread_task_new(&task, task_incr_f, &done_count) != 0);
+	unit_fail_if(thread_task_on_finish(task, finish_count_f,
+		     &done_count) != 0);
+	unit_fail_if(thread_pool_push_task(p, task) != 0);
+	unit_check(thread_task_on_finish(task, NULL, NULL) ==
+		   TPOOL_ERR_TASK_IN_POOL, "no callback change in a pool");
+	while (__atomic_load_n(&done_count, __ATOMIC_ACQUIRE) != 2)
+		usleep(100);
+	unit_check(thread_task_is_finished(task), "the callback is called");
+	unit_fail_if(thread_task_delete(task) != 0);
+	/*
+	 * The completions are taken in batches, on the fd readiness.
+	 */
+	int fd = thread_pool_completion_fd(p);
+	unit_check(fd >= 0 && thread_pool_completion_fd(p) == fd,
+		   "the completion fd is one");
+	struct pollfd pfd = {fd, POLLIN, 0};
+	unit_check(poll(&pfd, 1, 0) == 0, "not readable without tasks");
+	enum { COUNT = 10 };
+	struct thread_task *tasks[COUNT];
+	int arg = 0;
+	for (int i = 0; i < COUNT; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f,
+			     &arg) != 0);
+		unit_fail_if(thread_task_notify(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, COUNT) != 0);
+	int taken = 0;
+	bool is_finished = true;
+	while (taken < COUNT) {
+		unit_fail_if(poll(&pfd, 1, -1) != 1);
+		struct thread_task *batch[3];
+		int n = thread_pool_take_completions(p, batch, 3);
+		for (int i = 0; i < n; ++i) {
+			is_finished = is_finished &&
+				thread_task_is_finished(batch[i]);
+			void *result;
+			unit_fail_if(thread_task_join(batch[i], &result) != 0);
+			unit_fail_if(thread_task_delete(batch[i]) != 0);
+		}
+		taken += n;
+	}
+	unit_check(is_finished && arg == COUNT, "all are taken finished");
+	unit_check(poll(&pfd, 1, 0) == 0 ||
+		   thread_pool_take_completions(p, tasks, 1) == 0,
+		   "and no more");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -386,6 +1150,17 @@ main(int argc, char **argv)
 	test_timed_join();
 	test_detach_stress();
 	test_detach_long();
+	test_push_from_task();
+	test_push_tasks();
+	test_spawn_per_push();
+	test_adaptive_size();
+	test_placement();
+	test_priority();
+	test_then();
+	test_parallel();
+	test_task_reuse();
+	test_stats();
+	test_completions();
 
 	unit_test_finish();
 	return 0;
@@ -1,86 +1,1925 @@
+/* CPU affinity and sched_getcpu(). */
+#define _GNU_SOURCE
 #include "thread_pool.h"
+#include "trace.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * The task queue of a pool. By default it is a lock-free bounded
+ * ring per priority for the tasks pushed from outside, plus a
+ * work-stealing deque per worker for the normal tasks pushed by the
+ * tasks. Only the workers
+ * finding all of them empty go to sleep, on a futex. When built with
+ * -DTPOOL_USE_MUTEX_QUEUE=1 it is just the same rings under a
+ * mutex, with the sleep on a condvar, to compare them.
+ */
+#ifndef TPOOL_USE_MUTEX_QUEUE
+#define TPOOL_USE_MUTEX_QUEUE 0
+#endif
+
+enum {
+	/** The ring never overflows, the task count is limited. */
+	TASK_QUEUE_SIZE = 1 << 17,
+	TASK_QUEUE_MASK = TASK_QUEUE_SIZE - 1,
+	CACHE_LINE_SIZE = 64,
+	/** The nodes with bigger numbers are not looked for. */
+	NUMA_NODE_MAX = 64,
+	/** The rest of the freed tasks go to free(). */
+	WORKER_FREE_TASK_MAX = 1024,
+};
+
+_Static_assert((int)TASK_QUEUE_SIZE >= (int)TPOOL_MAX_TASKS,
+	       "the task queue fits all the tasks");
+
+enum thread_task_state {
+	/** Created and never pushed. */
+	TASK_STATE_NEW,
+	/** Waits for the tasks it is a continuation of. */
+	TASK_STATE_PENDING,
+	TASK_STATE_QUEUED,
+	TASK_STATE_RUNNING,
+	/** Finished, and the result waits for a join. */
+	TASK_STATE_FINISHED,
+	/** Joined, can be pushed again or deleted. */
+	TASK_STATE_JOINED,
+};
+
+enum {
+	TASK_STATE_MASK = 0xff,
+	/** Somebody sleeps on the state, the finish has to wake it. */
+	TASK_FLAG_HAS_WAITER = 1 << 8,
+	/** Delete the task when it is finished. */
+	TASK_FLAG_IS_DETACHED = 1 << 9,
+};
+
+/** An edge of the task graph, in the list of the first task. */
+struct thread_task_link {
+	struct thread_task *next_task;
+	struct thread_task_link *next;
+};
+
+/** The list of a finished task, no more links are added. */
+static struct thread_task_link thread_task_links_closed;
+#define TASK_LINKS_CLOSED (&thread_task_links_closed)
 
 struct thread_task {
 	thread_task_f function;
-	void *arg;
+	union {
+		void *arg;
+		/** Next in the free list of a worker, once deleted. */
+		struct thread_task *next_free;
+	};
+	void *result;
+	/** When pushed, if the pool spawns by the queue latency or is timed. */
+	uint64_t push_ns;
+	/**
+	 * enum thread_task_state and the flags. Atomic. It is a futex,
+	 * the joiners sleep on it once they have set the waiter flag.
+	 * So a finish which nobody waits for is just one exchange.
+	 */
+	uint32_t state;
+	/** enum thread_task_priority, constant. */
+	uint32_t priority;
+	/** The unfinished tasks it is a continuation of. Atomic. */
+	uint32_t dependency_count;
+	/**
+	 * The continuations, pushed when it finishes. Atomic. Closed
+	 * when finished, till the join.
+	 */
+	struct thread_task_link *links;
+	/** The pool it is pushed to the last. */
+	struct thread_pool *pool;
+	/** Called by the worker, once the task is finished. */
+	thread_task_finish_f finish_f;
+	void *finish_arg;
+	/** Next in the completion queue of the pool. */
+	struct thread_task *next_completion;
+};
 
-	/* PUT HERE OTHER MEMBERS */
+/**
+ * A cell of the ring. Its sequence number tells whose turn it is:
+ * equal to the position for a push into it, and to the position + 1
+ * for a pop from it. After a pop it is set a ring size ahead, for
+ * the push of the next round.
+ */
+struct task_queue_cell {
+	uint64_t seq;
+	struct thread_task *task;
 };
 
-struct thread_pool {
-	pthread_t *threads;
+/**
+ * Bounded MPMC ring of the tasks, by Dmitry Vyukov. A push and a
+ * pop each take a position by one CAS, and then own the cell. The
+ * positions are padded to be on their own cache lines, so the
+ * pushers and the workers don't bounce one line between them.
+ */
+struct task_queue {
+	struct task_queue_cell *cells;
+	char pad1[CACHE_LINE_SIZE];
+	uint64_t push_pos;
+	char pad2[CACHE_LINE_SIZE];
+	uint64_t pop_pos;
+	char pad3[CACHE_LINE_SIZE];
+};
 
-	/* PUT HERE OTHER MEMBERS */
+#if !TPOOL_USE_MUTEX_QUEUE
+
+/** A worker sleeping till a push, on its stack. */
+struct thread_pool_sleeper {
+	uint32_t is_woken;
+	struct thread_pool_sleeper *next;
+};
+
+/**
+ * Storage of a deque. On growth the old one is kept till the deque
+ * is destroyed, because a thief could still be reading it.
+ */
+struct task_deque_array {
+	int64_t mask;
+	struct task_deque_array *prev;
+	struct thread_task *items[];
+};
+
+/**
+ * Chase-Lev work-stealing deque of a worker. The owner pushes and
+ * pops at the bottom, so the subtasks of a task run next, while
+ * their data is still in its cache. The other workers steal from
+ * the top, the oldest tasks, which in a divide and conquer are the
+ * biggest ones.
+ */
+struct task_deque {
+	/** Index of the first item. */
+	int64_t top;
+	/** Index after the last item. */
+	int64_t bottom;
+	struct task_deque_array *array;
+};
+
+#endif
+
+enum thread_pool_worker_state {
+	/** No thread. */
+	WORKER_STATE_FREE,
+	WORKER_STATE_RUNNING,
+	/** Retired, the thread needs a join before the slot's reuse. */
+	WORKER_STATE_EXITED,
 };
 
+/** The part of struct thread_pool_stats counted by a worker. */
+struct thread_pool_worker_stats {
+	uint64_t run_count;
+	uint64_t wait_ns_sum;
+	uint64_t run_ns_sum;
+	uint64_t wait_histogram[TPOOL_STATS_BUCKET_COUNT];
+	uint64_t run_histogram[TPOOL_STATS_BUCKET_COUNT];
+};
+
+struct thread_pool_worker {
+	struct thread_pool *pool;
+	pthread_t thread;
+	/** enum thread_pool_worker_state. Under the pool's mutex. */
+	int state;
+	/** Index in the pool, the stealing starts from the next one. */
+	int index;
+	/** NUMA node, in the pool's numbering. 0 if not NUMA-aware. */
+	int node;
+	/** The thread is started on these CPUs, if is_pinned. */
+	bool is_pinned;
+	cpu_set_t cpus;
+#if !TPOOL_USE_MUTEX_QUEUE
+	/** Tasks pushed by the tasks of this worker. */
+	struct task_deque deque;
+#endif
+	/**
+	 * The tasks deleted in this thread, for the new ones created in
+	 * it. So a task tree or a stream of detached tasks doesn't go
+	 * to malloc(). Kept with the slot, freed with the pool.
+	 */
+	struct thread_task *free_tasks;
+	int free_task_count;
+	/**
+	 * The tasks run in this slot. Changed only by the worker, read
+	 * by anybody, so atomic, but never a read-modify-write.
+	 */
+	struct thread_pool_worker_stats stats;
+	/** The thieves don't bounce the neighbour's deque. */
+	char pad[CACHE_LINE_SIZE];
+};
+
+struct thread_pool {
+	/**
+	 * All the max count of the slots. The new workers take the
+	 * first free ones, so the used slots stay below slot_count.
+	 */
+	struct thread_pool_worker *workers;
+	int max_thread_count;
+	/** Running workers. Atomic, changed under the mutex. */
+	int thread_count;
+	/** Slots ever used. Atomic, changed under the mutex. */
+	int slot_count;
+	/** Protects the threads and the deletion. */
+	pthread_mutex_t mutex;
+	/**
+	 * Workers not running a task. New ones are spawned when none,
+	 * or, if spawn_delay_ns is not 0, when a task has waited in the
+	 * queue for that long.
+	 */
+	int idle_count;
+	uint64_t spawn_delay_ns;
+	/** A worker sleeping for this long retires. */
+	uint64_t keep_alive_ns;
+	/** Pushed and not finished tasks. */
+	int task_count;
+	/**
+	 * The most tasks ever waiting to be started. Atomic, written
+	 * only when it grows.
+	 */
+	int peak_queue_depth;
+	/** The tasks are timed for the stats. */
+	bool is_timed;
+	/** The workers exit once they find the queue empty. */
+	bool is_deleted;
+	/**
+	 * NUMA nodes having the allowed CPUs, numbered from 0. 1 when
+	 * not NUMA-aware.
+	 */
+	int node_count;
+	/** The pool's node number of each CPU, NULL if one node. */
+	uint8_t *cpu_node;
+	/**
+	 * Finished tasks to be taken, the newest first. Atomic. Pushed
+	 * to by the workers, emptied at once by the reader.
+	 */
+	struct thread_task *completions;
+	/** Taken from the list above, the oldest first. The reader's. */
+	struct thread_task *taken_completions;
+	/** Readable while there are completions, or -1. Atomic. */
+	int completion_fd;
+#if TPOOL_USE_MUTEX_QUEUE
+	/**
+	 * A queue per priority. The nodes are only for the placement
+	 * here.
+	 */
+	struct task_queue queues[TPOOL_PRIORITY_COUNT];
+	pthread_mutex_t queue_mutex;
+	pthread_cond_t queue_cond;
+	int sleeper_count;
+#else
+	/**
+	 * A queue per priority and NUMA node, node_count of each
+	 * priority in a row. A push goes to the queue of the pushing
+	 * thread's node, and a worker looks into the queue of its node
+	 * first.
+	 */
+	struct task_queue *queues;
+	/**
+	 * The workers which found no tasks. A worker puts itself into
+	 * the list, checks the queue and the deques once more, and
+	 * sleeps on its own futex. A push wakes one of them, and takes it
+	 * off the list so the next pushes don't wake it again. When the
+	 * count is 0 a push touches nothing else. The task's publish and
+	 * the count's check by a push, and the count's increment and the
+	 * task's check by a worker, are all seq-cst. So either the push
+	 * sees the sleeper, or the worker sees the task.
+	 */
+	pthread_mutex_t sleep_mutex;
+	struct thread_pool_sleeper *sleepers;
+	/** Atomic, changed under the mutex. */
+	int sleeper_count;
+#endif
+};
+
+static void
+task_queue_create(struct task_queue *q)
+{
+	q->cells = malloc(TASK_QUEUE_SIZE * sizeof(q->cells[0]));
+	for (uint64_t i = 0; i < TASK_QUEUE_SIZE; ++i)
+		q->cells[i].seq = i;
+	q->push_pos = 0;
+	q->pop_pos = 0;
+}
+
+static void
+task_queue_destroy(struct task_queue *q)
+{
+	free(q->cells);
+}
+
+/**
+ * Push a batch of tasks. The positions for all of them are taken by
+ * one atomic add.
+ */
+static void
+task_queue_push(struct task_queue *q, struct thread_task **tasks, int count)
+{
+	uint64_t pos = __atomic_fetch_add(&q->push_pos, count,
+		__ATOMIC_RELAXED);
+	for (int i = 0; i < count; ++i, ++pos) {
+		struct task_queue_cell *cell = &q->cells[pos & TASK_QUEUE_MASK];
+		/*
+		 * The task count is limited, it never gets full. So the
+		 * cell is already freed by the pop of the previous round.
+		 */
+		assert(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) == pos);
+		cell->task = tasks[i];
+		/* Seq-cst to be ordered with the sleeper count. */
+		__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+/** The first task, or NULL if the queue is empty. */
+static struct thread_task *
+task_queue_pop(struct task_queue *q)
+{
+	uint64_t pos = __atomic_load_n(&q->pop_pos, __ATOMIC_RELAXED);
+	struct task_queue_cell *cell;
+	while (true) {
+		cell = &q->cells[pos & TASK_QUEUE_MASK];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_SEQ_CST);
+		int64_t diff = (int64_t)(seq - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->pop_pos, &pos,
+			    pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&q->pop_pos, __ATOMIC_RELAXED);
+		}
+	}
+	struct thread_task *task = cell->task;
+	__atomic_store_n(&cell->seq, pos + TASK_QUEUE_SIZE, __ATOMIC_RELEASE);
+	return task;
+}
+
+/**
+ * Sleep while the word has the value, till the deadline on the
+ * monotonic clock if it is not NULL.
+ * @retval 0 Woken up, maybe spuriously.
+ * @retval ETIMEDOUT The deadline has passed.
+ */
+static int
+futex_wait(uint32_t *addr, uint32_t value, const struct timespec *deadline)
+{
+	if (syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, value,
+		    deadline, NULL, FUTEX_BITSET_MATCH_ANY) == 0)
+		return 0;
+	return errno == ETIMEDOUT ? ETIMEDOUT : 0;
+}
+
+static void
+futex_wake(uint32_t *addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static uint64_t
+clock_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * The monotonic clock's time in @a ns from now. NULL if that is
+ * forever.
+ */
+static struct timespec *
+clock_deadline(uint64_t ns, struct timespec *ts)
+{
+	if (ns == UINT64_MAX)
+		return NULL;
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec += ns % 1000000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_nsec -= 1000000000;
+		++ts->tv_sec;
+	}
+	return ts;
+}
+
+/**
+ * Seconds to ns. More than 30 years is forever, UINT64_MAX.
+ * Negative means 0.
+ */
+static uint64_t
+timeout_to_ns(double timeout)
+{
+	if (timeout >= 1e9)
+		return UINT64_MAX;
+	if (timeout < 0)
+		return 0;
+	return (uint64_t)(timeout * 1000000000);
+}
+
+static struct thread_task *
+thread_pool_worker_retire(struct thread_pool_worker *worker);
+
+/** The worker running in this thread, NULL in the other threads. */
+static __thread struct thread_pool_worker *current_worker = NULL;
+
+/**
+ * How many of the first tasks have the same priority, to push them
+ * into their queue at once.
+ */
+static int
+thread_task_run_length(struct thread_task **tasks, int count)
+{
+	int n = 1;
+	while (n < count && tasks[n]->priority == tasks[0]->priority)
+		++n;
+	return n;
+}
+
+#if TPOOL_USE_MUTEX_QUEUE
+
+static void
+thread_pool_queue_create(struct thread_pool *pool)
+{
+	for (int i = 0; i < TPOOL_PRIORITY_COUNT; ++i)
+		task_queue_create(&pool->queues[i]);
+	pthread_mutex_init(&pool->queue_mutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool->queue_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pool->sleeper_count = 0;
+}
+
+static void
+thread_pool_queue_destroy(struct thread_pool *pool)
+{
+	pthread_cond_destroy(&pool->queue_cond);
+	pthread_mutex_destroy(&pool->queue_mutex);
+	for (int i = 0; i < TPOOL_PRIORITY_COUNT; ++i)
+		task_queue_destroy(&pool->queues[i]);
+}
+
+static void
+thread_pool_queue_push(struct thread_pool *pool, struct thread_task **tasks,
+		       int count)
+{
+	pthread_mutex_lock(&pool->queue_mutex);
+	for (int i = 0, n; i < count; i += n) {
+		n = thread_task_run_length(tasks + i, count - i);
+		task_queue_push(&pool->queues[tasks[i]->priority], tasks + i,
+			n);
+	}
+	if (pool->sleeper_count <= count) {
+		if (pool->sleeper_count > 0)
+			pthread_cond_broadcast(&pool->queue_cond);
+	} else {
+		for (int i = 0; i < count; ++i)
+			pthread_cond_signal(&pool->queue_cond);
+	}
+	pthread_mutex_unlock(&pool->queue_mutex);
+}
+
+/** The first task of the highest priority. */
+static struct thread_task *
+thread_pool_queue_pop_locked(struct thread_pool *pool)
+{
+	for (int i = 0; i < TPOOL_PRIORITY_COUNT; ++i) {
+		struct thread_task *task = task_queue_pop(&pool->queues[i]);
+		if (task != NULL)
+			return task;
+	}
+	return NULL;
+}
+
+static struct thread_task *
+thread_pool_worker_find(struct thread_pool_worker *worker)
+{
+	struct thread_pool *pool = worker->pool;
+	pthread_mutex_lock(&pool->queue_mutex);
+	struct thread_task *task = thread_pool_queue_pop_locked(pool);
+	pthread_mutex_unlock(&pool->queue_mutex);
+	return task;
+}
+
+/**
+ * Wait for a task. NULL when the pool is deleted, or the worker is
+ * retired.
+ */
+static struct thread_task *
+thread_pool_queue_pop(struct thread_pool_worker *worker)
+{
+	struct thread_pool *pool = worker->pool;
+	struct timespec ts;
+	struct timespec *deadline = NULL;
+	pthread_mutex_lock(&pool->queue_mutex);
+	struct thread_task *task;
+	while ((task = thread_pool_queue_pop_locked(pool)) == NULL &&
+	       !pool->is_deleted) {
+		if (deadline == NULL)
+			deadline = clock_deadline(pool->keep_alive_ns, &ts);
+		++pool->sleeper_count;
+		int rc;
+		if (deadline == NULL) {
+			rc = pthread_cond_wait(&pool->queue_cond,
+				&pool->queue_mutex);
+		} else {
+			rc = pthread_cond_timedwait(&pool->queue_cond,
+				&pool->queue_mutex, deadline);
+		}
+		--pool->sleeper_count;
+		if (rc == ETIMEDOUT) {
+			pthread_mutex_unlock(&pool->queue_mutex);
+			return thread_pool_worker_retire(worker);
+		}
+	}
+	pthread_mutex_unlock(&pool->queue_mutex);
+	return task;
+}
+
+static void
+thread_pool_queue_stop(struct thread_pool *pool)
+{
+	pthread_mutex_lock(&pool->queue_mutex);
+	pool->is_deleted = true;
+	pthread_cond_broadcast(&pool->queue_cond);
+	pthread_mutex_unlock(&pool->queue_mutex);
+}
+
+#else /* !TPOOL_USE_MUTEX_QUEUE */
+
+static struct task_deque_array *
+task_deque_array_new(int64_t capacity, struct task_deque_array *prev)
+{
+	struct task_deque_array *a = malloc(sizeof(*a) +
+		capacity * sizeof(a->items[0]));
+	a->mask = capacity - 1;
+	a->prev = prev;
+	return a;
+}
+
+static void
+task_deque_create(struct task_deque *d)
+{
+	d->top = 0;
+	d->bottom = 0;
+	d->array = task_deque_array_new(64, NULL);
+}
+
+static void
+task_deque_destroy(struct task_deque *d)
+{
+	assert(d->top == d->bottom);
+	struct task_deque_array *a = d->array;
+	while (a != NULL) {
+		struct task_deque_array *prev = a->prev;
+		free(a);
+		a = prev;
+	}
+}
+
+/** Push to the bottom. Can be called only by the owner. */
+static void
+task_deque_push(struct task_deque *d, struct thread_task *task)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	struct task_deque_array *a = d->array;
+	if (b - t > a->mask) {
+		struct task_deque_array *old = a;
+		a = task_deque_array_new(2 * (old->mask + 1), old);
+		for (int64_t i = t; i < b; ++i)
+			a->items[i & a->mask] = old->items[i & old->mask];
+		__atomic_store_n(&d->array, a, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&a->items[b & a->mask], task, __ATOMIC_RELAXED);
+	/* Seq-cst to be ordered with the sleeper count, see the pool. */
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Pop from the bottom. Can be called only by the owner.
+ * @retval NULL The deque is empty.
+ */
+static struct thread_task *
+task_deque_pop(struct task_deque *d)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	struct task_deque_array *a = d->array;
+	/*
+	 * The bottom is taken first, then the top is checked, both
+	 * seq-cst. So a thief either sees the item gone, or the owner
+	 * sees the top moved by the thief.
+	 */
+	__atomic_store_n(&d->bottom, b, __ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+	if (t > b) {
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	struct thread_task *task = __atomic_load_n(&a->items[b & a->mask],
+		__ATOMIC_RELAXED);
+	if (t == b) {
+		/* The last item, the thieves can race for it too. */
+		if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_RELAXED))
+			task = NULL;
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return task;
+}
+
+/**
+ * Take from the top. Can be called by any thread.
+ * @retval NULL The deque is empty.
+ */
+static struct thread_task *
+task_deque_steal(struct task_deque *d)
+{
+	while (true) {
+		int64_t t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+		int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST);
+		if (t >= b)
+			return NULL;
+		struct task_deque_array *a =
+			__atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+		struct thread_task *task = __atomic_load_n(
+			&a->items[t & a->mask], __ATOMIC_RELAXED);
+		/*
+		 * If the slot was overwritten after the read, then the
+		 * top has moved, and this fails.
+		 */
+		if (__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_RELAXED))
+			return task;
+	}
+}
+
+static void
+thread_pool_queue_create(struct thread_pool *pool)
+{
+	int count = TPOOL_PRIORITY_COUNT * pool->node_count;
+	pool->queues = malloc(count * sizeof(pool->queues[0]));
+	for (int i = 0; i < count; ++i)
+		task_queue_create(&pool->queues[i]);
+	for (int i = 0; i < pool->max_thread_count; ++i)
+		task_deque_create(&pool->workers[i].deque);
+	pthread_mutex_init(&pool->sleep_mutex, NULL);
+	pool->sleepers = NULL;
+	pool->sleeper_count = 0;
+}
+
+static void
+thread_pool_queue_destroy(struct thread_pool *pool)
+{
+	pthread_mutex_destroy(&pool->sleep_mutex);
+	for (int i = 0; i < pool->max_thread_count; ++i)
+		task_deque_destroy(&pool->workers[i].deque);
+	for (int i = 0; i < TPOOL_PRIORITY_COUNT * pool->node_count; ++i)
+		task_queue_destroy(&pool->queues[i]);
+	free(pool->queues);
+}
+
+static struct task_queue *
+thread_pool_queue(struct thread_pool *pool, int priority, int node)
+{
+	return &pool->queues[priority * pool->node_count + node];
+}
+
+/** The pool's node number of the CPU the calling thread is on. */
+static int
+thread_pool_current_node(const struct thread_pool *pool)
+{
+	if (pool->cpu_node == NULL)
+		return 0;
+	int cpu = sched_getcpu();
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return 0;
+	return pool->cpu_node[cpu];
+}
+
+static void
+thread_pool_sleeper_wake(struct thread_pool_sleeper *s)
+{
+	/*
+	 * The sleeper can leave right after the store, then the wake
+	 * is spurious for whatever is at the address, and is ignored.
+	 */
+	__atomic_store_n(&s->is_woken, 1, __ATOMIC_RELEASE);
+	futex_wake(&s->is_woken, 1);
+}
+
+/** Take a sleeper off the list, NULL if there is none. */
+static struct thread_pool_sleeper *
+thread_pool_sleeper_pop_locked(struct thread_pool *pool)
+{
+	struct thread_pool_sleeper *s = pool->sleepers;
+	if (s != NULL) {
+		pool->sleepers = s->next;
+		__atomic_store_n(&pool->sleeper_count, pool->sleeper_count - 1,
+			__ATOMIC_RELAXED);
+	}
+	return s;
+}
+
+/** Take the sleeper off the list, false if it is not there. */
+static bool
+thread_pool_sleeper_remove_locked(struct thread_pool *pool,
+				  struct thread_pool_sleeper *s)
+{
+	struct thread_pool_sleeper **pos = &pool->sleepers;
+	while (*pos != NULL && *pos != s)
+		pos = &(*pos)->next;
+	if (*pos == NULL)
+		return false;
+	*pos = s->next;
+	__atomic_store_n(&pool->sleeper_count, pool->sleeper_count - 1,
+		__ATOMIC_RELAXED);
+	return true;
+}
+
+/**
+ * Normal tasks pushed by a task of the same pool go to the worker's
+ * own deque, the others go to the queue of their priority on the
+ * pusher's node. A sleeper is woken up per task, while there are
+ * any.
+ */
+static void
+thread_pool_queue_push(struct thread_pool *pool, struct thread_task **tasks,
+		       int count)
+{
+	struct thread_pool_worker *worker = current_worker;
+	if (worker != NULL && worker->pool != pool)
+		worker = NULL;
+	int node = worker != NULL ? worker->node :
+		thread_pool_current_node(pool);
+	for (int i = 0, n; i < count; i += n) {
+		n = thread_task_run_length(tasks + i, count - i);
+		int priority = tasks[i]->priority;
+		if (worker != NULL && priority == TPOOL_PRIORITY_NORMAL) {
+			for (int j = i; j < i + n; ++j)
+				task_deque_push(&worker->deque, tasks[j]);
+		} else {
+			task_queue_push(thread_pool_queue(pool, priority, node),
+				tasks + i, n);
+		}
+	}
+	if (__atomic_load_n(&pool->sleeper_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	struct thread_pool_sleeper *woken = NULL;
+	pthread_mutex_lock(&pool->sleep_mutex);
+	struct thread_pool_sleeper *s;
+	for (int i = 0; i < count &&
+	     (s = thread_pool_sleeper_pop_locked(pool)) != NULL; ++i) {
+		s->next = woken;
+		woken = s;
+	}
+	pthread_mutex_unlock(&pool->sleep_mutex);
+	while (woken != NULL) {
+		/* Gone after the wakeup, the link is read before. */
+		s = woken;
+		woken = woken->next;
+		thread_pool_sleeper_wake(s);
+	}
+}
+
+/**
+ * Wait for the wakeup till the deadline, NULL for no limit.
+ * @retval ETIMEDOUT Not woken up by the deadline.
+ */
+static int
+thread_pool_sleeper_wait(struct thread_pool_sleeper *s,
+			 const struct timespec *deadline)
+{
+	while (__atomic_load_n(&s->is_woken, __ATOMIC_ACQUIRE) == 0) {
+		if (futex_wait(&s->is_woken, 0, deadline) == ETIMEDOUT)
+			return ETIMEDOUT;
+	}
+	return 0;
+}
+
+/** The oldest task of the priority, the own node's ones first. */
+static struct thread_task *
+thread_pool_worker_find_queued(struct thread_pool_worker *worker,
+			       int priority)
+{
+	struct thread_pool *pool = worker->pool;
+	for (int i = 0; i < pool->node_count; ++i) {
+		int node = (worker->node + i) % pool->node_count;
+		struct thread_task *task =
+			task_queue_pop(thread_pool_queue(pool, priority, node));
+		if (task != NULL)
+			return task;
+	}
+	return NULL;
+}
+
+/**
+ * Find a task: a high priority one, else the own newest one, else
+ * the oldest normal one from outside, else steal the oldest one of
+ * another worker, and only then a low priority one. The own node is
+ * looked at before the others.
+ */
+static struct thread_task *
+thread_pool_worker_find(struct thread_pool_worker *worker)
+{
+	struct thread_pool *pool = worker->pool;
+	struct thread_task *task =
+		thread_pool_worker_find_queued(worker, TPOOL_PRIORITY_HIGH);
+	if (task != NULL)
+		return task;
+	task = task_deque_pop(&worker->deque);
+	if (task != NULL)
+		return task;
+	task = thread_pool_worker_find_queued(worker, TPOOL_PRIORITY_NORMAL);
+	if (task != NULL)
+		return task;
+	int count = __atomic_load_n(&pool->slot_count, __ATOMIC_ACQUIRE);
+	bool is_numa = pool->node_count > 1;
+	for (int is_own_node = is_numa; is_own_node >= 0; --is_own_node) {
+		for (int i = 1; i < count; ++i) {
+			struct thread_pool_worker *victim =
+				&pool->workers[(worker->index + i) % count];
+			if (is_numa &&
+			    (victim->node == worker->node) != is_own_node)
+				continue;
+			task = task_deque_steal(&victim->deque);
+			if (task != NULL)
+				return task;
+		}
+	}
+	return thread_pool_worker_find_queued(worker, TPOOL_PRIORITY_LOW);
+}
+
+/**
+ * Wait for a task. NULL when the pool is deleted, or the worker is
+ * retired.
+ */
+static struct thread_task *
+thread_pool_queue_pop(struct thread_pool_worker *worker)
+{
+	struct thread_pool *pool = worker->pool;
+	struct timespec ts;
+	struct timespec *deadline = NULL;
+	while (true) {
+		struct thread_task *task = thread_pool_worker_find(worker);
+		if (task != NULL)
+			return task;
+		struct thread_pool_sleeper self = {0, NULL};
+		pthread_mutex_lock(&pool->sleep_mutex);
+		if (pool->is_deleted) {
+			pthread_mutex_unlock(&pool->sleep_mutex);
+			return NULL;
+		}
+		self.next = pool->sleepers;
+		pool->sleepers = &self;
+		__atomic_store_n(&pool->sleeper_count, pool->sleeper_count + 1,
+			__ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool->sleep_mutex);
+		task = thread_pool_worker_find(worker);
+		if (task == NULL) {
+			/* The wakeups don't prolong the keep-alive. */
+			if (deadline == NULL)
+				deadline = clock_deadline(pool->keep_alive_ns,
+					&ts);
+			if (thread_pool_sleeper_wait(&self, deadline) == 0)
+				continue;
+		}
+		pthread_mutex_lock(&pool->sleep_mutex);
+		bool is_listed = thread_pool_sleeper_remove_locked(pool, &self);
+		pthread_mutex_unlock(&pool->sleep_mutex);
+		/* Somebody is waking it, and must be let to finish. */
+		if (!is_listed)
+			thread_pool_sleeper_wait(&self, NULL);
+		if (task != NULL)
+			return task;
+		if (is_listed)
+			return thread_pool_worker_retire(worker);
+	}
+}
+
+static void
+thread_pool_queue_stop(struct thread_pool *pool)
+{
+	pthread_mutex_lock(&pool->sleep_mutex);
+	pool->is_deleted = true;
+	struct thread_pool_sleeper *s;
+	while ((s = thread_pool_sleeper_pop_locked(pool)) != NULL)
+		thread_pool_sleeper_wake(s);
+	pthread_mutex_unlock(&pool->sleep_mutex);
+}
+
+#endif /* !TPOOL_USE_MUTEX_QUEUE */
+
+void
+thread_pool_attr_create(struct thread_pool_attr *attr)
+{
+	attr->spawn_delay = 0;
+	attr->keep_alive = 1e9;
+	attr->cpus = NULL;
+	attr->cpu_count = 0;
+	attr->is_numa_aware = false;
+	attr->is_timed = false;
+}
+
+/**
+ * Read the NUMA node of each CPU from sysfs, so as not to depend on
+ * libnuma. The unknown CPUs get -1.
+ */
+static void
+numa_read_cpu_nodes(int *cpu_node)
+{
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		cpu_node[cpu] = -1;
+	for (int node = 0; node < NUMA_NODE_MAX; ++node) {
+		char path[64];
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%d/cpulist", node);
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		/* Like "0-3,8-11". */
+		int first;
+		while (fscanf(f, "%d", &first) == 1) {
+			int last = first;
+			int c = fgetc(f);
+			if (c == '-') {
+				if (fscanf(f, "%d", &last) != 1)
+					break;
+				c = fgetc(f);
+			}
+			for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE;
+			     ++cpu)
+				cpu_node[cpu] = node;
+			if (c != ',')
+				break;
+		}
+		fclose(f);
+	}
+}
+
+/**
+ * Choose the CPUs and the nodes of the worker slots. The pool's
+ * nodes are the ones having the allowed CPUs.
+ */
+static int
+thread_pool_place_workers(struct thread_pool *pool,
+			  const struct thread_pool_attr *attr)
+{
+	pool->node_count = 1;
+	pool->cpu_node = NULL;
+	for (int i = 0; i < pool->max_thread_count; ++i) {
+		pool->workers[i].node = 0;
+		pool->workers[i].is_pinned = false;
+	}
+	if (attr->cpu_count == 0 && !attr->is_numa_aware)
+		return 0;
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (attr->cpu_count > 0) {
+		cpu_set_t given;
+		CPU_ZERO(&given);
+		for (int i = 0; i < attr->cpu_count; ++i) {
+			int cpu = attr->cpus[i];
+			if (cpu < 0 || cpu >= CPU_SETSIZE)
+				return TPOOL_ERR_INVALID_ARGUMENT;
+			CPU_SET(cpu, &given);
+		}
+		CPU_AND(&allowed, &allowed, &given);
+		if (CPU_COUNT(&allowed) == 0)
+			return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	int cpu_node[CPU_SETSIZE];
+	if (attr->is_numa_aware)
+		numa_read_cpu_nodes(cpu_node);
+	else
+		memset(cpu_node, 0, sizeof(cpu_node));
+	/* A set per node for NUMA, or a set per CPU otherwise. */
+	cpu_set_t *sets = malloc(CPU_SETSIZE * sizeof(sets[0]));
+	int set_count = 0;
+	int node_index[NUMA_NODE_MAX + 1];
+	for (int i = 0; i <= NUMA_NODE_MAX; ++i)
+		node_index[i] = -1;
+	uint8_t *pool_cpu_node = calloc(CPU_SETSIZE, 1);
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		int set;
+		if (!attr->is_numa_aware) {
+			set = set_count++;
+			CPU_ZERO(&sets[set]);
+		} else {
+			/* The CPUs of unknown nodes go together. */
+			int node = cpu_node[cpu] + 1;
+			if (node_index[node] < 0) {
+				node_index[node] = set_count++;
+				CPU_ZERO(&sets[node_index[node]]);
+			}
+			set = node_index[node];
+			pool_cpu_node[cpu] = set;
+		}
+		CPU_SET(cpu, &sets[set]);
+	}
+	for (int i = 0; i < pool->max_thread_count; ++i) {
+		struct thread_pool_worker *worker = &pool->workers[i];
+		worker->is_pinned = true;
+		worker->cpus = sets[i % set_count];
+	}
+	free(sets);
+	if (!attr->is_numa_aware || set_count == 1) {
+		free(pool_cpu_node);
+		return 0;
+	}
+	pool->node_count = set_count;
+	pool->cpu_node = pool_cpu_node;
+	for (int i = 0; i < pool->max_thread_count; ++i)
+		pool->workers[i].node = i % set_count;
+	return 0;
+}
+
 int
 thread_pool_new(int max_thread_count, struct thread_pool **pool)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)max_thread_count;
-	(void)pool;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	return thread_pool_new_ex(max_thread_count, NULL, pool);
+}
+
+int
+thread_pool_new_ex(int max_thread_count, const struct thread_pool_attr *attr,
+		   struct thread_pool **pool)
+{
+	struct thread_pool_attr default_attr;
+	if (attr == NULL) {
+		thread_pool_attr_create(&default_attr);
+		attr = &default_attr;
+	}
+	if (max_thread_count <= 0 || max_thread_count > TPOOL_MAX_THREADS ||
+	    !(attr->spawn_delay >= 0) || !(attr->keep_alive >= 0) ||
+	    attr->cpu_count < 0)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	struct thread_pool *p = malloc(sizeof(*p));
+	p->workers = malloc(max_thread_count * sizeof(p->workers[0]));
+	for (int i = 0; i < max_thread_count; ++i) {
+		p->workers[i].pool = p;
+		p->workers[i].state = WORKER_STATE_FREE;
+		p->workers[i].index = i;
+		p->workers[i].free_tasks = NULL;
+		p->workers[i].free_task_count = 0;
+		memset(&p->workers[i].stats, 0, sizeof(p->workers[i].stats));
+	}
+	p->max_thread_count = max_thread_count;
+	int rc = thread_pool_place_workers(p, attr);
+	if (rc != 0) {
+		free(p->workers);
+		free(p);
+		return rc;
+	}
+	p->thread_count = 0;
+	p->slot_count = 0;
+	pthread_mutex_init(&p->mutex, NULL);
+	p->idle_count = 0;
+	p->spawn_delay_ns = timeout_to_ns(attr->spawn_delay);
+	p->keep_alive_ns = timeout_to_ns(attr->keep_alive);
+	p->task_count = 0;
+	p->peak_queue_depth = 0;
+	p->is_timed = attr->is_timed;
+	p->is_deleted = false;
+	p->completions = NULL;
+	p->taken_completions = NULL;
+	p->completion_fd = -1;
+	thread_pool_queue_create(p);
+	*pool = p;
+	return 0;
 }
 
 int
 thread_pool_thread_count(const struct thread_pool *pool)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)pool;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	return __atomic_load_n(&pool->thread_count, __ATOMIC_RELAXED);
+}
+
+/** Tasks pushed and not started, by the counters of the pool. */
+static int
+thread_pool_queue_depth(const struct thread_pool *pool)
+{
+	int busy_count = __atomic_load_n(&pool->thread_count,
+		__ATOMIC_RELAXED) - __atomic_load_n(&pool->idle_count,
+		__ATOMIC_RELAXED);
+	int depth = __atomic_load_n(&pool->task_count, __ATOMIC_RELAXED) -
+		(busy_count > 0 ? busy_count : 0);
+	return depth > 0 ? depth : 0;
+}
+
+/** Add a time to a histogram bucket, by the worker only. */
+static void
+stats_add(uint64_t *sum, uint64_t *histogram, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int i = us == 0 ? 0 : 64 - __builtin_clzll(us);
+	if (i >= TPOOL_STATS_BUCKET_COUNT)
+		i = TPOOL_STATS_BUCKET_COUNT - 1;
+	__atomic_store_n(sum, *sum + ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&histogram[i], histogram[i] + 1, __ATOMIC_RELAXED);
+}
+
+void
+thread_pool_get_stats(const struct thread_pool *pool,
+		      struct thread_pool_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->thread_count = thread_pool_thread_count(pool);
+	int idle_count = __atomic_load_n(&pool->idle_count, __ATOMIC_RELAXED);
+	/* Spawned workers count as idle a bit before as running. */
+	if (idle_count > stats->thread_count)
+		idle_count = stats->thread_count;
+	stats->idle_count = idle_count;
+	stats->busy_count = stats->thread_count - idle_count;
+	stats->queue_depth = thread_pool_queue_depth(pool);
+	stats->peak_queue_depth = __atomic_load_n(&pool->peak_queue_depth,
+		__ATOMIC_RELAXED);
+	if (stats->peak_queue_depth < stats->queue_depth)
+		stats->peak_queue_depth = stats->queue_depth;
+	int slot_count = __atomic_load_n(&pool->slot_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < slot_count; ++i) {
+		const struct thread_pool_worker_stats *w =
+			&pool->workers[i].stats;
+		stats->run_count += __atomic_load_n(&w->run_count,
+			__ATOMIC_RELAXED);
+		stats->wait_ns_sum += __atomic_load_n(&w->wait_ns_sum,
+			__ATOMIC_RELAXED);
+		stats->run_ns_sum += __atomic_load_n(&w->run_ns_sum,
+			__ATOMIC_RELAXED);
+		for (int j = 0; j < TPOOL_STATS_BUCKET_COUNT; ++j) {
+			stats->wait_histogram[j] += __atomic_load_n(
+				&w->wait_histogram[j], __ATOMIC_RELAXED);
+			stats->run_histogram[j] += __atomic_load_n(
+				&w->run_histogram[j], __ATOMIC_RELAXED);
+		}
+	}
 }
 
 int
 thread_pool_delete(struct thread_pool *pool)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)pool;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	pthread_mutex_lock(&pool->mutex);
+	if (__atomic_load_n(&pool->task_count, __ATOMIC_ACQUIRE) > 0) {
+		pthread_mutex_unlock(&pool->mutex);
+		return TPOOL_ERR_HAS_TASKS;
+	}
+	thread_pool_queue_stop(pool);
+	pthread_mutex_unlock(&pool->mutex);
+	/* The workers don't retire after the stop, the states are final. */
+	for (int i = 0; i < pool->slot_count; ++i) {
+		if (pool->workers[i].state != WORKER_STATE_FREE)
+			pthread_join(pool->workers[i].thread, NULL);
+	}
+	thread_pool_queue_destroy(pool);
+	pthread_mutex_destroy(&pool->mutex);
+	for (int i = 0; i < pool->max_thread_count; ++i) {
+		struct thread_task *task = pool->workers[i].free_tasks;
+		while (task != NULL) {
+			struct thread_task *next = task->next_free;
+			free(task);
+			task = next;
+		}
+	}
+	if (pool->completion_fd >= 0)
+		close(pool->completion_fd);
+	free(pool->cpu_node);
+	free(pool->workers);
+	free(pool);
+	return 0;
+}
+
+static enum thread_task_state
+thread_task_state(const struct thread_task *task)
+{
+	return __atomic_load_n(&task->state, __ATOMIC_ACQUIRE) &
+		TASK_STATE_MASK;
+}
+
+static void
+thread_task_destroy(struct thread_task *task)
+{
+	/* The continuations of a never finished task never run. */
+	struct thread_task_link *link = task->links;
+	while (link != NULL && link != TASK_LINKS_CLOSED) {
+		struct thread_task_link *next = link->next;
+		free(link);
+		link = next;
+	}
+	struct thread_pool_worker *worker = current_worker;
+	if (worker == NULL || worker->free_task_count == WORKER_FREE_TASK_MAX) {
+		free(task);
+		return;
+	}
+	task->next_free = worker->free_tasks;
+	worker->free_tasks = task;
+	++worker->free_task_count;
+}
+
+static void
+thread_pool_push_reserved(struct thread_pool *pool, struct thread_task **tasks,
+			  int count);
+
+/**
+ * One of the tasks the continuation waits for is finished. Push it
+ * if that was the last one. It is pushed even when the pool is full,
+ * nobody could be told about a failure.
+ */
+static void
+thread_task_release(struct thread_task *task, struct thread_pool *pool)
+{
+	if (__atomic_sub_fetch(&task->dependency_count, 1,
+			       __ATOMIC_ACQ_REL) != 0)
+		return;
+	__atomic_add_fetch(&pool->task_count, 1, __ATOMIC_RELAXED);
+	thread_pool_push_reserved(pool, &task, 1);
+}
+
+static void
+thread_task_run(struct thread_pool *pool, struct thread_task *task)
+{
+	/* QUEUED -> RUNNING, the flags are kept. */
+	__atomic_add_fetch(&task->state, TASK_STATE_RUNNING - TASK_STATE_QUEUED,
+		__ATOMIC_RELAXED);
+	/* The runs are always by a worker of the pool. */
+	struct thread_pool_worker_stats *stats = &current_worker->stats;
+	__atomic_store_n(&stats->run_count, stats->run_count + 1,
+		__ATOMIC_RELAXED);
+	uint64_t start_ns = 0;
+	if (pool->is_timed) {
+		start_ns = clock_now_ns();
+		stats_add(&stats->wait_ns_sum, stats->wait_histogram,
+			  start_ns - task->push_ns);
+	}
+	TRACE_BEGIN("task", (uintptr_t)task);
+	void *result = task->function(task->arg);
+	TRACE_END("task");
+	if (pool->is_timed) {
+		stats_add(&stats->run_ns_sum, stats->run_histogram,
+			  clock_now_ns() - start_ns);
+	}
+	/*
+	 * The continuations are pushed while the task still counts in
+	 * the pool, so the pool never looks empty between them.
+	 */
+	struct thread_task_link *link = __atomic_exchange_n(&task->links,
+		TASK_LINKS_CLOSED, __ATOMIC_ACQ_REL);
+	while (link != NULL) {
+		struct thread_task_link *next = link->next;
+		thread_task_release(link->next_task, pool);
+		free(link);
+		link = next;
+	}
+	/*
+	 * The pool is updated before the task is finished. Otherwise
+	 * the pool could look busy to whoever has joined the task.
+	 */
+	__atomic_add_fetch(&pool->idle_count, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&pool->task_count, 1, __ATOMIC_RELEASE);
+	task->result = result;
+	/* After the finish the task can be gone. */
+	thread_task_finish_f finish_f = task->finish_f;
+	void *finish_arg = task->finish_arg;
+	uint32_t old = __atomic_exchange_n(&task->state, TASK_STATE_FINISHED,
+		__ATOMIC_ACQ_REL);
+	if ((old & TASK_FLAG_IS_DETACHED) != 0) {
+		if (finish_f != NULL)
+			finish_f(task, finish_arg);
+		thread_task_destroy(task);
+		return;
+	}
+	if ((old & TASK_FLAG_HAS_WAITER) != 0) {
+		/*
+		 * The joiner can see the finish before the wake, and
+		 * delete the task. Then the wake is spurious for whatever is
+		 * at the address, and is ignored.
+		 */
+		futex_wake(&task->state, INT_MAX);
+	}
+	if (finish_f != NULL)
+		finish_f(task, finish_arg);
+}
+
+static void
+thread_pool_grow(struct thread_pool *pool, int task_count);
+
+static void *
+thread_pool_worker_f(void *arg)
+{
+	struct thread_pool_worker *worker = arg;
+	struct thread_pool *pool = worker->pool;
+	current_worker = worker;
+	struct thread_task *task;
+	while ((task = thread_pool_queue_pop(worker)) != NULL) {
+		__atomic_sub_fetch(&pool->idle_count, 1, __ATOMIC_RELAXED);
+		if (pool->spawn_delay_ns != 0 &&
+		    clock_now_ns() - task->push_ns >= pool->spawn_delay_ns)
+			thread_pool_grow(pool, 1);
+		thread_task_run(pool, task);
+	}
+	return NULL;
+}
+
+/**
+ * Start more workers if the idle ones are fewer than the waiting
+ * tasks, while the limit allows. A new worker is idle till it takes
+ * a task, so the ones queued before are counted too, otherwise a
+ * series of single pushes would be all given to one fresh worker.
+ */
+static void
+thread_pool_grow(struct thread_pool *pool, int task_count)
+{
+	/* Seq-cst to be ordered with the retirement, see there. */
+	int idle_count = __atomic_load_n(&pool->idle_count, __ATOMIC_SEQ_CST);
+	if (idle_count >= task_count ||
+	    thread_pool_thread_count(pool) == pool->max_thread_count)
+		return;
+	pthread_mutex_lock(&pool->mutex);
+	/*
+	 * Counted once, else a new worker taking a task right away
+	 * would look like a reason for one more.
+	 */
+	int need = task_count - __atomic_load_n(&pool->idle_count,
+		__ATOMIC_RELAXED);
+	for (; need > 0 && pool->thread_count < pool->max_thread_count;
+	     --need) {
+		int i = 0;
+		while (pool->workers[i].state == WORKER_STATE_RUNNING)
+			++i;
+		struct thread_pool_worker *worker = &pool->workers[i];
+		/* It has let the mutex go, and is just returning. */
+		if (worker->state == WORKER_STATE_EXITED)
+			pthread_join(worker->thread, NULL);
+		worker->state = WORKER_STATE_RUNNING;
+		__atomic_add_fetch(&pool->idle_count, 1, __ATOMIC_RELAXED);
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (worker->is_pinned)
+			pthread_attr_setaffinity_np(&attr, sizeof(worker->cpus),
+				&worker->cpus);
+		if (pthread_create(&worker->thread, &attr,
+		    thread_pool_worker_f, worker) != 0)
+			abort();
+		pthread_attr_destroy(&attr);
+		__atomic_store_n(&pool->thread_count, pool->thread_count + 1,
+			__ATOMIC_RELAXED);
+		if (i == pool->slot_count)
+			__atomic_store_n(&pool->slot_count, i + 1,
+				__ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Retire the worker, which has slept for the keep-alive time and
+ * is off the sleepers. It stops being idle before the last check
+ * for tasks, all seq-cst. So a push either sees fewer idle workers
+ * and spawns a new one, or its task is found here.
+ * @retval NULL The worker is retired.
+ * @retval not NULL The task to run instead.
+ */
+static struct thread_task *
+thread_pool_worker_retire(struct thread_pool_worker *worker)
+{
+	struct thread_pool *pool = worker->pool;
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->is_deleted) {
+		/* The delete joins it. */
+		pthread_mutex_unlock(&pool->mutex);
+		return NULL;
+	}
+	__atomic_sub_fetch(&pool->idle_count, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&pool->thread_count, pool->thread_count - 1,
+		__ATOMIC_SEQ_CST);
+	struct thread_task *task = thread_pool_worker_find(worker);
+	if (task != NULL) {
+		__atomic_add_fetch(&pool->idle_count, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&pool->thread_count, pool->thread_count + 1,
+			__ATOMIC_RELAXED);
+	} else {
+		worker->state = WORKER_STATE_EXITED;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return task;
 }
 
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)pool;
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	return thread_pool_push_tasks(pool, &task, 1);
 }
 
 int
-thread_task_new(struct thread_task **task, thread_task_f function, void *arg)
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+		       int count)
+{
+	if (count < 0)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	for (int i = 0; i < count; ++i) {
+		enum thread_task_state state = thread_task_state(tasks[i]);
+		if (state != TASK_STATE_NEW && state != TASK_STATE_JOINED)
+			return TPOOL_ERR_TASK_IN_POOL;
+	}
+	if (__atomic_add_fetch(&pool->task_count, count, __ATOMIC_RELAXED) >
+	    TPOOL_MAX_TASKS) {
+		__atomic_sub_fetch(&pool->task_count, count, __ATOMIC_RELAXED);
+		return TPOOL_ERR_TOO_MANY_TASKS;
+	}
+	thread_pool_push_reserved(pool, tasks, count);
+	return 0;
+}
+
+/** Push the tasks already counted in the pool. */
+static void
+thread_pool_push_reserved(struct thread_pool *pool, struct thread_task **tasks,
+			  int count)
+{
+	uint64_t now = pool->spawn_delay_ns != 0 || pool->is_timed ?
+		clock_now_ns() : 0;
+	for (int i = 0; i < count; ++i) {
+		struct thread_task *task = tasks[i];
+		task->push_ns = now;
+		task->pool = pool;
+		uint32_t state = __atomic_load_n(&task->state,
+			__ATOMIC_RELAXED);
+		/* A pending one can already have a joiner or be detached. */
+		if ((state & TASK_STATE_MASK) == TASK_STATE_PENDING) {
+			__atomic_add_fetch(&task->state,
+				TASK_STATE_QUEUED - TASK_STATE_PENDING,
+				__ATOMIC_RELAXED);
+		} else {
+			__atomic_store_n(&task->state, TASK_STATE_QUEUED,
+				__ATOMIC_RELAXED);
+		}
+	}
+	thread_pool_queue_push(pool, tasks, count);
+	/* Written only by a new peak, so mostly a read. */
+	int depth = thread_pool_queue_depth(pool);
+	int peak = __atomic_load_n(&pool->peak_queue_depth, __ATOMIC_RELAXED);
+	while (depth > peak && !__atomic_compare_exchange_n(
+	       &pool->peak_queue_depth, &peak, depth, true, __ATOMIC_RELAXED,
+	       __ATOMIC_RELAXED))
+		;
+	/*
+	 * With a spawn delay only the first worker is spawned here, the
+	 * others are spawned by the workers seeing the waited tasks.
+	 */
+	if (pool->spawn_delay_ns == 0)
+		thread_pool_grow(pool, depth);
+	else if (__atomic_load_n(&pool->thread_count, __ATOMIC_SEQ_CST) == 0)
+		thread_pool_grow(pool, 1);
+}
+
+/** A parallel_for() or parallel_reduce() call. */
+struct parallel_job {
+	struct thread_pool *pool;
+	/** One of them is set. */
+	thread_pool_for_f for_f;
+	thread_pool_map_f map_f;
+	/** Can be NULL for parallel_for(). */
+	thread_pool_reduce_f reduce_f;
+	void *arg;
+	size_t grain;
+	/** Splits of a part taken by a thief, enough to feed all. */
+	int split_count;
+	/** Set when the whole range is done. A futex. */
+	uint32_t is_done;
+};
+
+/**
+ * A node of the split tree of the range. A part bigger than the
+ * grain is split in halves: the right one is pushed as a task, to be
+ * stolen by an idle worker, and the left one is taken on by the same
+ * task. A part is split only a few times, unless it is stolen: then
+ * the work is wanted elsewhere, and it is split again. So the tasks
+ * are created by the demand, not by the size. The last finished
+ * child of a part reduces the results of both, so nobody waits for
+ * the other. The tree is freed by the caller in the end.
+ */
+struct parallel_part {
+	struct parallel_job *job;
+	struct parallel_part *parent;
+	/** The both children, in one block. */
+	struct parallel_part *left;
+	struct parallel_part *right;
+	size_t begin;
+	size_t end;
+	void *result;
+	/** Children not finished yet. Atomic. */
+	uint32_t pending;
+	/** How many more times it can be split. */
+	int split_count;
+	/** The task running it, if pushed. */
+	struct thread_task *task;
+	/** The worker which has pushed it, NULL if not a worker. */
+	struct thread_pool_worker *owner;
+};
+
+static void
+parallel_part_create(struct parallel_part *part, struct parallel_job *job,
+		     struct parallel_part *parent, size_t begin, size_t end)
+{
+	part->job = job;
+	part->parent = parent;
+	part->left = NULL;
+	part->right = NULL;
+	part->begin = begin;
+	part->end = end;
+	part->result = NULL;
+	part->split_count = parent != NULL ? parent->split_count - 1 :
+		job->split_count;
+	part->task = NULL;
+	part->owner = NULL;
+}
+
+/**
+ * Free the children and join their tasks, so the pool stops
+ * counting them.
+ */
+static void
+parallel_part_destroy(struct parallel_part *part)
+{
+	if (part->left == NULL)
+		return;
+	parallel_part_destroy(part->left);
+	parallel_part_destroy(part->right);
+	if (part->right->task != NULL) {
+		void *unused;
+		thread_task_join(part->right->task, &unused);
+		thread_task_delete(part->right->task);
+	}
+	free(part->left);
+}
+
+/** Reduce the parents as long as this is the last child of them. */
+static void
+parallel_part_complete(struct parallel_part *part)
+{
+	struct parallel_job *job = part->job;
+	struct parallel_part *parent;
+	while ((parent = part->parent) != NULL) {
+		if (__atomic_sub_fetch(&parent->pending, 1,
+				       __ATOMIC_ACQ_REL) != 0)
+			return;
+		if (job->reduce_f != NULL) {
+			parent->result = job->reduce_f(parent->left->result,
+				parent->right->result, job->arg);
+		}
+		part = parent;
+	}
+	__atomic_store_n(&job->is_done, 1, __ATOMIC_RELEASE);
+	futex_wake(&job->is_done, 1);
+}
+
+static void *
+parallel_part_f(void *arg);
+
+static void
+parallel_part_run(struct parallel_part *part)
+{
+	struct parallel_job *job = part->job;
+	while (part->end - part->begin > job->grain && part->split_count > 0) {
+		size_t middle = part->begin + (part->end - part->begin) / 2;
+		struct parallel_part *children = malloc(2 * sizeof(*children));
+		parallel_part_create(&children[0], job, part, part->begin,
+			middle);
+		parallel_part_create(&children[1], job, part, middle,
+			part->end);
+		part->left = &children[0];
+		part->right = &children[1];
+		part->pending = 2;
+		struct parallel_part *right = part->right;
+		right->owner = current_worker;
+		thread_task_new(&right->task, parallel_part_f, right);
+		if (thread_pool_push_task(job->pool, right->task) != 0) {
+			/* The pool is full, do it here. */
+			thread_task_delete(right->task);
+			right->task = NULL;
+			parallel_part_run(right);
+		}
+		part = part->left;
+	}
+	if (job->map_f != NULL)
+		part->result = job->map_f(part->begin, part->end, job->arg);
+	else
+		job->for_f(part->begin, part->end, job->arg);
+	parallel_part_complete(part);
+}
+
+static void *
+parallel_part_f(void *arg)
+{
+	struct parallel_part *part = arg;
+	if (part->owner != NULL && part->owner != current_worker)
+		part->split_count = part->job->split_count;
+	parallel_part_run(part);
+	return NULL;
+}
+
+static int
+parallel_job_run(struct parallel_job *job, size_t begin, size_t end,
+		 size_t grain, void **result)
+{
+	if (begin > end)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	*result = NULL;
+	if (begin == end)
+		return 0;
+	job->grain = grain != 0 ? grain : 1;
+	/* A few parts per thread, to balance the uneven ones. */
+	job->split_count = 0;
+	while ((1 << job->split_count) < 8 * job->pool->max_thread_count)
+		++job->split_count;
+	job->is_done = 0;
+	struct parallel_part root;
+	parallel_part_create(&root, job, NULL, begin, end);
+	parallel_part_run(&root);
+	/*
+	 * A worker of the same pool runs the tasks while waiting.
+	 * Otherwise its own parts could be left for nobody.
+	 */
+	struct thread_pool_worker *worker = current_worker;
+	if (worker != NULL && worker->pool != job->pool)
+		worker = NULL;
+	while (__atomic_load_n(&job->is_done, __ATOMIC_ACQUIRE) == 0) {
+		struct thread_task *task = worker != NULL ?
+			thread_pool_worker_find(worker) : NULL;
+		if (task != NULL) {
+			__atomic_sub_fetch(&job->pool->idle_count, 1,
+				__ATOMIC_RELAXED);
+			thread_task_run(job->pool, task);
+		} else {
+			futex_wait(&job->is_done, 0, NULL);
+		}
+	}
+	*result = root.result;
+	parallel_part_destroy(&root);
+	return 0;
+}
+
+int
+thread_pool_parallel_for(struct thread_pool *pool, size_t begin, size_t end,
+			 size_t grain, thread_pool_for_f function, void *arg)
+{
+	struct parallel_job job;
+	job.pool = pool;
+	job.for_f = function;
+	job.map_f = NULL;
+	job.reduce_f = NULL;
+	job.arg = arg;
+	void *result;
+	return parallel_job_run(&job, begin, end, grain, &result);
+}
+
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, size_t begin,
+			    size_t end, size_t grain, thread_pool_map_f map,
+			    thread_pool_reduce_f reduce, void *arg,
+			    void **result)
+{
+	struct parallel_job job;
+	job.pool = pool;
+	job.for_f = NULL;
+	job.map_f = map;
+	job.reduce_f = reduce;
+	job.arg = arg;
+	return parallel_job_run(&job, begin, end, grain, result);
+}
+
+int
+thread_pool_completion_fd(struct thread_pool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	int fd = pool->completion_fd;
+	if (fd < 0) {
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		__atomic_store_n(&pool->completion_fd, fd, __ATOMIC_SEQ_CST);
+		/* The ones posted before have not signaled it. */
+		if (fd >= 0 && (__atomic_load_n(&pool->completions,
+		    __ATOMIC_SEQ_CST) != NULL ||
+		    pool->taken_completions != NULL))
+			eventfd_write(fd, 1);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return fd;
+}
+
+static void
+thread_pool_completion_signal(struct thread_pool *pool)
+{
+	int fd = __atomic_load_n(&pool->completion_fd, __ATOMIC_SEQ_CST);
+	if (fd >= 0)
+		eventfd_write(fd, 1);
+}
+
+/** The finish callback of the notified tasks. */
+static void
+thread_pool_post_completion(struct thread_task *task, void *arg)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	(void)function;
 	(void)arg;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	struct thread_pool *pool = task->pool;
+	/* The task is the reader's right after the push. */
+	struct thread_task *head = __atomic_load_n(&pool->completions,
+		__ATOMIC_RELAXED);
+	do {
+		task->next_completion = head;
+	} while (!__atomic_compare_exchange_n(&pool->completions, &head,
+					      task, true, __ATOMIC_SEQ_CST,
+					      __ATOMIC_RELAXED));
+	/* The reader is woken up once per batch. */
+	if (head == NULL)
+		thread_pool_completion_signal(pool);
+}
+
+int
+thread_pool_take_completions(struct thread_pool *pool,
+			     struct thread_task **tasks, int count)
+{
+	if (pool->taken_completions == NULL) {
+		/*
+		 * Cleared before the list is emptied, so a post after
+		 * that signals it again.
+		 */
+		int fd = __atomic_load_n(&pool->completion_fd,
+			__ATOMIC_RELAXED);
+		eventfd_t value;
+		if (fd >= 0)
+			eventfd_read(fd, &value);
+		struct thread_task *task = __atomic_exchange_n(
+			&pool->completions, NULL, __ATOMIC_SEQ_CST);
+		/* Reverse, to give them in the order of the finish. */
+		while (task != NULL) {
+			struct thread_task *next = task->next_completion;
+			task->next_completion = pool->taken_completions;
+			pool->taken_completions = task;
+			task = next;
+		}
+	}
+	int taken = 0;
+	while (taken < count && pool->taken_completions != NULL) {
+		tasks[taken++] = pool->taken_completions;
+		pool->taken_completions =
+			pool->taken_completions->next_completion;
+	}
+	/* Not all are taken, the fd stays readable. */
+	if (pool->taken_completions != NULL)
+		thread_pool_completion_signal(pool);
+	return taken;
+}
+
+int
+thread_task_new(struct thread_task **task, thread_task_f function, void *arg)
+{
+	return thread_task_new_ex(task, function, arg, TPOOL_PRIORITY_NORMAL);
+}
+
+int
+thread_task_new_ex(struct thread_task **task, thread_task_f function,
+		   void *arg, enum thread_task_priority priority)
+{
+	if (priority < 0 || priority >= TPOOL_PRIORITY_COUNT)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	struct thread_pool_worker *worker = current_worker;
+	struct thread_task *t;
+	if (worker != NULL && worker->free_tasks != NULL) {
+		t = worker->free_tasks;
+		worker->free_tasks = t->next_free;
+		--worker->free_task_count;
+	} else {
+		t = malloc(sizeof(*t));
+	}
+	t->function = function;
+	t->arg = arg;
+	t->result = NULL;
+	t->state = TASK_STATE_NEW;
+	t->priority = priority;
+	t->dependency_count = 0;
+	t->links = NULL;
+	t->pool = NULL;
+	t->finish_f = NULL;
+	t->finish_arg = NULL;
+	*task = t;
+	return 0;
+}
+
+int
+thread_task_on_finish(struct thread_task *task, thread_task_finish_f function,
+		      void *arg)
+{
+	enum thread_task_state state = thread_task_state(task);
+	if (state != TASK_STATE_NEW && state != TASK_STATE_JOINED)
+		return TPOOL_ERR_TASK_IN_POOL;
+	task->finish_f = function;
+	task->finish_arg = arg;
+	return 0;
+}
+
+int
+thread_task_notify(struct thread_task *task)
+{
+	return thread_task_on_finish(task, thread_pool_post_completion, NULL);
+}
+
+int
+thread_task_then(struct thread_task *task, struct thread_task *next)
+{
+	if (task == next)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	enum thread_task_state state = thread_task_state(next);
+	if (state == TASK_STATE_NEW || state == TASK_STATE_JOINED) {
+		next->dependency_count = 1;
+		__atomic_store_n(&next->state, TASK_STATE_PENDING,
+			__ATOMIC_RELAXED);
+	} else if (state == TASK_STATE_PENDING) {
+		/* 0 means it is being pushed right now. */
+		uint32_t count = __atomic_load_n(&next->dependency_count,
+			__ATOMIC_RELAXED);
+		do {
+			if (count == 0)
+				return TPOOL_ERR_TASK_IN_POOL;
+		} while (!__atomic_compare_exchange_n(&next->dependency_count,
+			 &count, count + 1, true, __ATOMIC_RELAXED,
+			 __ATOMIC_RELAXED));
+	} else {
+		return TPOOL_ERR_TASK_IN_POOL;
+	}
+	struct thread_task_link *link = malloc(sizeof(*link));
+	link->next_task = next;
+	link->next = __atomic_load_n(&task->links, __ATOMIC_ACQUIRE);
+	while (link->next != TASK_LINKS_CLOSED) {
+		if (__atomic_compare_exchange_n(&task->links, &link->next,
+						link, true, __ATOMIC_RELEASE,
+						__ATOMIC_ACQUIRE))
+			return 0;
+	}
+	/* Already finished, nothing to wait for. */
+	free(link);
+	thread_task_release(next, task->pool);
+	return 0;
 }
 
 bool
 thread_task_is_finished(const struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return false;
+	enum thread_task_state state = thread_task_state(task);
+	return state == TASK_STATE_FINISHED || state == TASK_STATE_JOINED;
 }
 
 bool
 thread_task_is_running(const struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return false;
+	return thread_task_state(task) == TASK_STATE_RUNNING;
+}
+
+/** Wait for the task till the deadline, NULL for no limit. */
+static int
+thread_task_wait(struct thread_task *task, const struct timespec *deadline,
+		 void **result)
+{
+	uint32_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	if ((state & TASK_STATE_MASK) == TASK_STATE_NEW)
+		return TPOOL_ERR_TASK_NOT_PUSHED;
+	while ((state & TASK_STATE_MASK) < TASK_STATE_FINISHED) {
+		uint32_t waiting = state | TASK_FLAG_HAS_WAITER;
+		/* On a failure the state is reloaded. */
+		if (state != waiting &&
+		    !__atomic_compare_exchange_n(&task->state, &state, waiting,
+						 false, __ATOMIC_ACQUIRE,
+						 __ATOMIC_ACQUIRE))
+			continue;
+		int rc = futex_wait(&task->state, waiting, deadline);
+		state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+		if (rc == ETIMEDOUT &&
+		    (state & TASK_STATE_MASK) < TASK_STATE_FINISHED)
+			return TPOOL_ERR_TIMEOUT;
+	}
+	__atomic_store_n(&task->state, TASK_STATE_JOINED, __ATOMIC_RELAXED);
+	/* The next run can have continuations again. */
+	__atomic_store_n(&task->links, NULL, __ATOMIC_RELAXED);
+	*result = task->result;
+	return 0;
 }
 
 int
 thread_task_join(struct thread_task *task, void **result)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	(void)result;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	return thread_task_wait(task, NULL, result);
 }
 
 #if NEED_TIMED_JOIN
@@ -88,11 +1927,9 @@ thread_task_join(struct thread_task *task, void **result)
 int
 thread_task_timed_join(struct thread_task *task, double timeout, void **result)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	(void)timeout;
-	(void)result;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	struct timespec ts;
+	return thread_task_wait(task, clock_deadline(timeout_to_ns(timeout),
+		&ts), result);
 }
 
 #endif
@@ -100,9 +1937,11 @@ thread_task_timed_join(struct thread_task *task, double timeout, void **result)
 int
 thread_task_delete(struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	enum thread_task_state state = thread_task_state(task);
+	if (state != TASK_STATE_NEW && state != TASK_STATE_JOINED)
+		return TPOOL_ERR_TASK_IN_POOL;
+	thread_task_destroy(task);
+	return 0;
 }
 
 #if NEED_DETACH
@@ -110,9 +1949,26 @@ thread_task_delete(struct thread_task *task)
 int
 thread_task_detach(struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	uint32_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	while (true) {
+		switch (state & TASK_STATE_MASK) {
+		case TASK_STATE_NEW:
+			return TPOOL_ERR_TASK_NOT_PUSHED;
+		case TASK_STATE_FINISHED:
+		case TASK_STATE_JOINED:
+			thread_task_destroy(task);
+			return 0;
+		}
+		/*
+		 * The worker deletes it. If it has finished just now,
+		 * this fails, and the state is reloaded.
+		 */
+		if (__atomic_compare_exchange_n(&task->state, &state,
+						state | TASK_FLAG_IS_DETACHED,
+						false, __ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE))
+			return 0;
+	}
 }
 
 #endif
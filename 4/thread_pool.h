@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * Here you should specify which features do you want to implement via macros:
@@ -15,13 +17,14 @@
  * It is important to define these macros here, in the header, because it is
  * used by tests.
  */
-#define NEED_DETACH 0
-#define NEED_TIMED_JOIN 0
+#define NEED_DETACH 1
+#define NEED_TIMED_JOIN 1
 
 struct thread_pool;
 struct thread_task;
 
 typedef void *(*thread_task_f)(void *);
+typedef void (*thread_task_finish_f)(struct thread_task *task, void *arg);
 
 enum {
 	TPOOL_MAX_THREADS = 20,
@@ -38,6 +41,19 @@ enum thread_poool_errcode {
 	TPOOL_ERR_TIMEOUT,
 };
 
+/**
+ * The classes of the tasks. A worker takes a task of a higher class
+ * first, but a running task is never preempted.
+ */
+enum thread_task_priority {
+	/** Latency-critical, runs before all the queued ones. */
+	TPOOL_PRIORITY_HIGH,
+	TPOOL_PRIORITY_NORMAL,
+	/** Bulk, runs when there is nothing else. */
+	TPOOL_PRIORITY_LOW,
+	TPOOL_PRIORITY_COUNT,
+};
+
 /** Thread pool API. */
 
 /**
@@ -54,15 +70,113 @@ enum thread_poool_errcode {
 int
 thread_pool_new(int max_thread_count, struct thread_pool **pool);
 
+struct thread_pool_attr {
+	/**
+	 * Spawn a new worker only when a task has waited in the queue
+	 * for this long, in seconds. Then the first worker is spawned
+	 * by a push, and the next ones by the workers, when they get
+	 * the tasks which have waited too long. 0 means to spawn as
+	 * soon as all the workers are busy. The default is 0.
+	 */
+	double spawn_delay;
+	/**
+	 * Stop a worker which has had no tasks for this long, in
+	 * seconds. The default is forever, as any value of 1e9 or
+	 * more.
+	 */
+	double keep_alive;
+	/**
+	 * CPUs to run the workers on, each worker gets one of them
+	 * round-robin. With is_numa_aware they only limit the CPUs of
+	 * the nodes. NULL and 0 by default, any CPU.
+	 */
+	const int *cpus;
+	int cpu_count;
+	/**
+	 * Spread the workers over the NUMA nodes, each worker is run
+	 * on the CPUs of its node. Every node gets its own queue. A
+	 * push goes to the queue of the pushing thread's node, and the
+	 * workers take from their node first. Off by default.
+	 */
+	bool is_numa_aware;
+	/**
+	 * Measure the queue wait and the run time of each task, for
+	 * the histograms of thread_pool_get_stats(). It costs a clock
+	 * read per push and two per run. Off by default.
+	 */
+	bool is_timed;
+};
+
+/** Fill the attributes with the default values. */
+void
+thread_pool_attr_create(struct thread_pool_attr *attr);
+
 /**
- * How many threads are created by this pool. Can be less than
- * max.
+ * Same as thread_pool_new(), but with the given attributes. NULL
+ * means all the defaults.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - max_thread_count is too big,
+ *       or 0, or an attribute is negative, or none of the CPUs
+ *       can be used.
+ */
+int
+thread_pool_new_ex(int max_thread_count, const struct thread_pool_attr *attr,
+		   struct thread_pool **pool);
+
+/**
+ * How many threads are created by this pool and not retired. Can
+ * be less than max.
  * @param pool Thread pool to get thread count of.
  * @retval Thread count.
  */
 int
 thread_pool_thread_count(const struct thread_pool *pool);
 
+enum {
+	/**
+	 * Histogram buckets. Bucket 0 counts the times under 1 us,
+	 * bucket i the ones in [2^(i - 1), 2^i) us, and the last one
+	 * all the longer ones too.
+	 */
+	TPOOL_STATS_BUCKET_COUNT = 24,
+};
+
+struct thread_pool_stats {
+	/** Threads created and not retired. */
+	int thread_count;
+	/** Threads waiting for a task, and running one. */
+	int idle_count;
+	int busy_count;
+	/** Tasks pushed and not started yet, now and at most ever. */
+	int queue_depth;
+	int peak_queue_depth;
+	/** Tasks started by the workers. */
+	uint64_t run_count;
+	/**
+	 * Only with the is_timed attribute. The time from the push to
+	 * the start, and from the start to the return, of each task.
+	 * The sums are in nanoseconds.
+	 */
+	uint64_t wait_ns_sum;
+	uint64_t run_ns_sum;
+	uint64_t wait_histogram[TPOOL_STATS_BUCKET_COUNT];
+	uint64_t run_histogram[TPOOL_STATS_BUCKET_COUNT];
+};
+
+/**
+ * Get the counters of @a pool. The workers count only their own
+ * tasks, and the counters are summed up here, so the read is not
+ * a snapshot: the values of a busy pool can be a bit off from each
+ * other.
+ * @param pool Pool to get the stats of.
+ * @param[out] stats Stats to fill.
+ */
+void
+thread_pool_get_stats(const struct thread_pool *pool,
+		      struct thread_pool_stats *stats);
+
 /**
  * Delete @a pool, free its memory.
  * @param pool Pool to delete.
@@ -82,10 +196,103 @@ thread_pool_delete(struct thread_pool *pool);
  * @retval != Error code.
  *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
  *       already.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is pushed and not joined
+ *       yet.
  */
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 
+/**
+ * Push @a count tasks at once. The queue is touched once for all
+ * of them, and no more workers are woken up than there are tasks.
+ * Either all the tasks are pushed, or none.
+ * @param pool Pool to push into.
+ * @param tasks Tasks to push, all different.
+ * @param count Number of the tasks.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - count is negative.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has no room for all the
+ *       tasks.
+ *     - TPOOL_ERR_TASK_IN_POOL - one of the tasks is pushed and not
+ *       joined yet.
+ */
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+		       int count);
+
+/** Data-parallel helpers. */
+
+typedef void (*thread_pool_for_f)(size_t begin, size_t end, void *arg);
+typedef void *(*thread_pool_map_f)(size_t begin, size_t end, void *arg);
+typedef void *(*thread_pool_reduce_f)(void *left, void *right, void *arg);
+
+/**
+ * Call @a function on the subranges of [@a begin, @a end) in the
+ * pool, and wait till all are done. The range is split in halves,
+ * and the halves are stolen by the idle workers. A stolen half is
+ * split again, so there are about as many tasks as the balance
+ * needs, not one per grain. The calling thread does a share too.
+ * Can be called from a task of the same pool.
+ * @param pool Pool to run in.
+ * @param begin First index.
+ * @param end Index after the last one.
+ * @param grain Subranges this big are not split anymore. 0 means
+ *   no limit.
+ * @param function Function to call per subrange.
+ * @param arg Argument for @a function.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - @a begin is after @a end.
+ */
+int
+thread_pool_parallel_for(struct thread_pool *pool, size_t begin, size_t end,
+			 size_t grain, thread_pool_for_f function, void *arg);
+
+/**
+ * Like thread_pool_parallel_for(), but @a map returns a result per
+ * subrange, and @a reduce combines the results of two neighbour
+ * subranges, the left one first. So @a reduce has to be only
+ * associative.
+ * @param[out] result Result of the whole range, NULL if it is
+ *   empty.
+ */
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, size_t begin,
+			    size_t end, size_t grain, thread_pool_map_f map,
+			    thread_pool_reduce_f reduce, void *arg,
+			    void **result);
+
+/** Completion API, for the event loops which can't join. */
+
+/**
+ * The eventfd of the pool, readable while there are finished tasks
+ * to take by thread_pool_take_completions(). Only the tasks marked
+ * by thread_task_notify() get there. Created on the first call, and
+ * closed by the pool.
+ * @param pool Pool to get the fd of.
+ * @retval >= 0 File descriptor.
+ * @retval -1 Error, see errno.
+ */
+int
+thread_pool_completion_fd(struct thread_pool *pool);
+
+/**
+ * Take up to @a count of the finished tasks marked with
+ * thread_task_notify(), the first finished first. They can be joined
+ * right away, without blocking. The fd stays readable till all are
+ * taken. For one thread at a time.
+ * @param pool Pool to take from.
+ * @param[out] tasks Place for the tasks.
+ * @param count Size of @a tasks.
+ * @retval Number of the tasks taken.
+ */
+int
+thread_pool_take_completions(struct thread_pool *pool,
+			     struct thread_task **tasks, int count);
+
 /** Thread pool task API. */
 
 /**
@@ -99,6 +306,73 @@ thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 int
 thread_task_new(struct thread_task **task, thread_task_f function, void *arg);
 
+/**
+ * Same as thread_task_new(), but with the given priority. The
+ * default is TPOOL_PRIORITY_NORMAL.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no such priority.
+ */
+int
+thread_task_new_ex(struct thread_task **task, thread_task_f function,
+		   void *arg, enum thread_task_priority priority);
+
+/**
+ * Push @a next into the pool of @a task when @a task is finished,
+ * instead of joining one in the other. Called for several tasks with
+ * the same @a next, it waits for all of them, so any DAG can be
+ * built before its roots are pushed. @a next counts as pushed since
+ * the call: it can be joined and detached, but not pushed nor
+ * deleted. If @a task is finished already, @a next is pushed right
+ * away. A continuation of a task which is deleted without having
+ * been run never runs. It is pushed even if the pool is full.
+ * @param task Task to wait for. If it is not pushed, or joined,
+ *   then its next run.
+ * @param next Task to push after it.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the tasks are the same.
+ *     - TPOOL_ERR_TASK_IN_POOL - @a next is pushed already.
+ */
+int
+thread_task_then(struct thread_task *task, struct thread_task *next);
+
+/**
+ * Call @a function in the worker when @a task is finished. The task
+ * can be joined already, and @a function can join it without
+ * blocking. But if anybody else joins it, or it is detached, it can
+ * be gone, and @a function must not touch it. Replaces the
+ * notification of thread_task_notify().
+ * @param task Task to watch.
+ * @param function Function to call, NULL for none.
+ * @param arg Argument for @a function.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is pushed and not joined
+ *       yet.
+ */
+int
+thread_task_on_finish(struct thread_task *task, thread_task_finish_f function,
+		      void *arg);
+
+/**
+ * Put @a task into the completions of the pool it runs in, when it
+ * is finished. It is to be taken by thread_pool_take_completions()
+ * and joined after that, not before. Replaces the callback of
+ * thread_task_on_finish().
+ * @param task Task to watch.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is pushed and not joined
+ *       yet.
+ */
+int
+thread_task_notify(struct thread_task *task);
+
 /**
  * Check if @a task is finished and its result can be obtained.
  * @param task Task to check.
@@ -0,0 +1,485 @@
+/*
+ * A game lobby under load: a server with many idle clients and a
+ * few active ones, which all talk at once.
+ *
+ * The server runs in its own process. The idle clients are plain
+ * sockets, which never send anything, and only drain what the
+ * server broadcasts to them, in a thread of their own. The active
+ * ones are chat clients, each of them feeds the given number of
+ * messages at once, and the time is till each active client has got
+ * all the messages of all the others.
+ *
+ * Lobby: thousands of messages per second, and the server's CPU time
+ * per message, in microseconds, by the idle client count. A message
+ * goes to every client, idle or not, so its cost grows with their
+ * count. But the wait for the events should not, a server polling
+ * all of the sockets on every update would be much slower with many
+ * idle ones.
+ *
+ * The same for a server with 4 threads, each serving its own share
+ * of the clients. It scales with the cores, if there are any to
+ * spare. On one core it only shows the cost of the hand-over of the
+ * broadcasts between the threads.
+ *
+ * Each of them with the poll backend and with io_uring, where the
+ * kernel has it. The ring saves the wait and the receive calls, but
+ * a broadcast still takes a send per peer either way, which is most
+ * of the cost here. So do not expect the ring to win much.
+ *
+ * And the poll backend with the TCP options: no delay, the buffers
+ * of the peers cut down, and the busy poll. And with the idle
+ * clients in a room of their own, where the messages to the lobby
+ * don't go, so its cost should not grow with them at all.
+ *
+ * And the server's send calls per 1000 messages delivered to the
+ * clients. Gathering all the pending output of a peer into one send
+ * makes it fall far below 1000, once the messages come faster than
+ * the clients drain them.
+ */
+#include "chat.h"
+#include "chat_client.h"
+#include "chat_server.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	BENCH_RUN_COUNT = 5,
+	BENCH_ACTIVE_COUNT = 100,
+	BENCH_MSG_COUNT = 10,
+	BENCH_MSG_SIZE = 64,
+	BENCH_DRAIN_BATCH = 256,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_double(const void *l, const void *r)
+{
+	double a = *(const double *)l;
+	double b = *(const double *)r;
+	return a < b ? -1 : a > b;
+}
+
+static void
+bench_print(const char *title, size_t param, double *times)
+{
+	qsort(times, BENCH_RUN_COUNT, sizeof(times[0]), bench_cmp_double);
+	printf("%s %zu\n", title, param);
+	printf("    min: %.2lf\n", times[0]);
+	printf("    med: %.2lf\n", times[BENCH_RUN_COUNT / 2]);
+	printf("    max: %.2lf\n", times[BENCH_RUN_COUNT - 1]);
+}
+
+static void
+bench_check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+	printf("Error: %s failed: %s\n", what, strerror(errno));
+	exit(-1);
+}
+
+/** A server setup to run the lobby on. */
+struct bench_scenario {
+	const char *name;
+	enum chat_server_backend backend;
+	int thread_count;
+	struct chat_server_tcp_options tcp;
+	/** The idle clients join a room, away from the active ones. */
+	bool is_idle_away;
+};
+
+/** The server of the process, and where its stats are sent to. */
+static struct chat_server *bench_server;
+static int bench_stats_pipe;
+
+/**
+ * Reply to SIGUSR1 with the server's stats. From the handler, so a
+ * server waiting for events replies right away. It only reads a few
+ * counters, and write() is async-signal-safe.
+ */
+static void
+bench_server_stats_f(int signo)
+{
+	(void)signo;
+	struct chat_server_stats stats;
+	chat_server_get_stats(bench_server, &stats);
+	if (write(bench_stats_pipe, &stats, sizeof(stats)) != sizeof(stats))
+		abort();
+}
+
+/** Serve forever, till killed. */
+static void
+bench_server_run(const struct bench_scenario *sc, int port_pipe,
+		 int stats_pipe)
+{
+	struct chat_server *server = chat_server_new();
+	bench_check(chat_server_set_backend(server, sc->backend) == 0,
+		"set_backend");
+	bench_check(chat_server_set_thread_count(server,
+		sc->thread_count) == 0, "set_thread_count");
+	bench_check(chat_server_set_tcp_options(server, &sc->tcp) == 0,
+		"set_tcp_options");
+	bench_server = server;
+	bench_stats_pipe = stats_pipe;
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = bench_server_stats_f;
+	sa.sa_flags = SA_RESTART;
+	bench_check(sigaction(SIGUSR1, &sa, NULL) == 0, "sigaction");
+	bench_check(chat_server_listen(server, 0) == 0, "listen");
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	bench_check(getsockname(chat_server_get_socket(server),
+		(struct sockaddr *)&addr, &len) == 0, "getsockname");
+	uint16_t port = ntohs(addr.sin_port);
+	bench_check(write(port_pipe, &port, sizeof(port)) == sizeof(port),
+		"write");
+	close(port_pipe);
+	while (true) {
+		int rc = chat_server_update(server, -1);
+		bench_check(rc == 0 || rc == CHAT_ERR_TIMEOUT, "update");
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(server)) != NULL)
+			chat_message_delete(msg);
+	}
+}
+
+static void
+bench_server_stats(pid_t pid, int stats_pipe, struct chat_server_stats *stats)
+{
+	/*
+	 * The ring's sends are done before the server sees their
+	 * completions, and counts them. A moment to catch up.
+	 */
+	usleep(50000);
+	bench_check(kill(pid, SIGUSR1) == 0, "kill");
+	bench_check(read(stats_pipe, stats, sizeof(*stats)) ==
+		sizeof(*stats), "read");
+}
+
+/** CPU time of the process, all its threads, in microseconds. */
+static double
+bench_cpu_us(pid_t pid)
+{
+	char path[64];
+	sprintf(path, "/proc/%d/task", (int)pid);
+	DIR *dir = opendir(path);
+	bench_check(dir != NULL, "opendir");
+	unsigned long long sum = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		sprintf(path, "/proc/%d/task/%d/schedstat", (int)pid,
+			atoi(entry->d_name));
+		FILE *f = fopen(path, "r");
+		bench_check(f != NULL, "fopen");
+		/* The first is the time on a CPU, in ns. */
+		unsigned long long ns = 0;
+		int rc = fscanf(f, "%llu", &ns);
+		fclose(f);
+		bench_check(rc == 1, "fscanf");
+		sum += ns;
+	}
+	closedir(dir);
+	return (double)sum / 1000;
+}
+
+struct bench_idle {
+	int *fds;
+	int count;
+	int epoll_fd;
+	/** A byte into it stops the drain. */
+	int stop_pipe[2];
+	pthread_t thread;
+};
+
+static void *
+bench_idle_drain_f(void *arg)
+{
+	struct bench_idle *idle = arg;
+	struct epoll_event events[BENCH_DRAIN_BATCH];
+	char buf[16384];
+	while (true) {
+		int count = epoll_wait(idle->epoll_fd, events,
+			BENCH_DRAIN_BATCH, -1);
+		for (int i = 0; i < count; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == idle->stop_pipe[0])
+				return NULL;
+			while (recv(fd, buf, sizeof(buf), 0) > 0)
+				;
+		}
+	}
+}
+
+static void
+bench_idle_start(struct bench_idle *idle, int count, uint16_t port,
+		 bool is_away)
+{
+	idle->count = count;
+	idle->fds = malloc(count * sizeof(idle->fds[0]));
+	idle->epoll_fd = epoll_create1(0);
+	bench_check(idle->epoll_fd >= 0, "epoll_create");
+	bench_check(pipe(idle->stop_pipe) == 0, "pipe");
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = idle->stop_pipe[0];
+	epoll_ctl(idle->epoll_fd, EPOLL_CTL_ADD, idle->stop_pipe[0], &ev);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for (int i = 0; i < count; ++i) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		bench_check(fd >= 0, "socket");
+		bench_check(connect(fd, (struct sockaddr *)&addr,
+			sizeof(addr)) == 0, "connect");
+		if (is_away) {
+			const char *join = CHAT_JOIN_COMMAND " idle\n";
+			bench_check(send(fd, join, strlen(join), 0) ==
+				(ssize_t)strlen(join), "send");
+		}
+		chat_socket_setup(fd);
+		ev.data.fd = fd;
+		epoll_ctl(idle->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+		idle->fds[i] = fd;
+	}
+	bench_check(pthread_create(&idle->thread, NULL, bench_idle_drain_f,
+		idle) == 0, "pthread_create");
+}
+
+static void
+bench_idle_stop(struct bench_idle *idle)
+{
+	bench_check(write(idle->stop_pipe[1], "", 1) == 1, "write");
+	pthread_join(idle->thread, NULL);
+	for (int i = 0; i < idle->count; ++i)
+		close(idle->fds[i]);
+	close(idle->stop_pipe[0]);
+	close(idle->stop_pipe[1]);
+	close(idle->epoll_fd);
+	free(idle->fds);
+}
+
+/**
+ * Update the clients which have events, till each has got the given
+ * number of messages.
+ */
+static void
+bench_receive(struct chat_client **clis, int count, int msg_count)
+{
+	struct pollfd *pfds = malloc(count * sizeof(pfds[0]));
+	int *received = calloc(count, sizeof(received[0]));
+	int done_count = 0;
+	while (done_count < count) {
+		for (int i = 0; i < count; ++i) {
+			pfds[i].fd = chat_client_get_descriptor(clis[i]);
+			pfds[i].events = chat_events_to_poll_events(
+				chat_client_get_events(clis[i]));
+			pfds[i].revents = 0;
+		}
+		bench_check(poll(pfds, count, -1) > 0, "poll");
+		for (int i = 0; i < count; ++i) {
+			if (pfds[i].revents == 0)
+				continue;
+			int rc = chat_client_update(clis[i], 0);
+			bench_check(rc == 0 || rc == CHAT_ERR_TIMEOUT,
+				"client update");
+			struct chat_message *msg;
+			while ((msg = chat_client_pop_next(clis[i])) != NULL) {
+				chat_message_delete(msg);
+				if (++received[i] == msg_count)
+					++done_count;
+			}
+		}
+	}
+	free(received);
+	free(pfds);
+}
+
+/**
+ * One run with the given number of idle clients. Stores the
+ * messages per second, the server CPU per message, and its send
+ * calls per 1000 delivered messages.
+ */
+static void
+bench_lobby(const struct bench_scenario *sc, int idle_count,
+	    double *k_per_sec, double *cpu_us, double *sends)
+{
+	int port_pipe[2];
+	bench_check(pipe(port_pipe) == 0, "pipe");
+	int stats_pipe[2];
+	bench_check(pipe(stats_pipe) == 0, "pipe");
+	pid_t pid = fork();
+	bench_check(pid >= 0, "fork");
+	if (pid == 0) {
+		close(port_pipe[0]);
+		close(stats_pipe[0]);
+		bench_server_run(sc, port_pipe[1], stats_pipe[1]);
+	}
+	close(port_pipe[1]);
+	close(stats_pipe[1]);
+	uint16_t port;
+	bench_check(read(port_pipe[0], &port, sizeof(port)) == sizeof(port),
+		"read");
+	close(port_pipe[0]);
+	char addr[64];
+	sprintf(addr, "127.0.0.1:%u", port);
+
+	struct bench_idle idle;
+	bench_idle_start(&idle, idle_count, port, sc->is_idle_away);
+	struct chat_client *clis[BENCH_ACTIVE_COUNT];
+	for (int i = 0; i < BENCH_ACTIVE_COUNT; ++i) {
+		clis[i] = chat_client_new("bench");
+		bench_check(chat_client_connect(clis[i], addr) == 0,
+			"connect");
+	}
+	/*
+	 * The server accepts in the order of the connects. So once the
+	 * message of the last client has reached everyone, all of them
+	 * are in the lobby.
+	 */
+	struct chat_client *last = chat_client_new("bench");
+	bench_check(chat_client_connect(last, addr) == 0, "connect");
+	bench_check(chat_client_feed(last, "ready\n", 6) == 0, "feed");
+	while (chat_client_get_events(last) & CHAT_EVENT_OUTPUT)
+		chat_client_update(last, -1);
+	bench_receive(clis, BENCH_ACTIVE_COUNT, 1);
+	chat_client_delete(last);
+
+	char msg[BENCH_MSG_SIZE];
+	memset(msg, 'm', sizeof(msg));
+	msg[sizeof(msg) - 1] = '\n';
+	struct chat_server_stats stats_start, stats_end;
+	bench_server_stats(pid, stats_pipe[0], &stats_start);
+	double cpu_start = bench_cpu_us(pid);
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < BENCH_ACTIVE_COUNT; ++i) {
+		for (int j = 0; j < BENCH_MSG_COUNT; ++j) {
+			bench_check(chat_client_feed(clis[i], msg,
+				sizeof(msg)) == 0, "feed");
+		}
+	}
+	bench_receive(clis, BENCH_ACTIVE_COUNT,
+		(BENCH_ACTIVE_COUNT - 1) * BENCH_MSG_COUNT);
+	uint64_t duration = bench_now_ns() - start;
+	double cpu = bench_cpu_us(pid) - cpu_start;
+	double msg_count = BENCH_ACTIVE_COUNT * BENCH_MSG_COUNT;
+	*k_per_sec = msg_count * 1000000 / duration;
+	*cpu_us = cpu / msg_count;
+	/*
+	 * The server might still have output for the idle clients. It
+	 * is not in either of the counts.
+	 */
+	bench_server_stats(pid, stats_pipe[0], &stats_end);
+	*sends = (double)(stats_end.send_count - stats_start.send_count) *
+		1000 / (stats_end.sent_message_count -
+		stats_start.sent_message_count);
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	close(stats_pipe[0]);
+	for (int i = 0; i < BENCH_ACTIVE_COUNT; ++i)
+		chat_client_delete(clis[i]);
+	bench_idle_stop(&idle);
+}
+
+int
+main(void)
+{
+	/* Each process has its own sockets and the peer's ones. */
+	struct rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	long max_idle = (long)rl.rlim_cur - BENCH_ACTIVE_COUNT * 2 - 100;
+
+	const struct bench_scenario scenarios[] = {
+		{.name = "Lobby, poll", .backend = CHAT_BACKEND_POLL},
+		{.name = "Lobby, io_uring", .backend = CHAT_BACKEND_IO_URING},
+		{.name = "Lobby on 4 threads, poll",
+			.backend = CHAT_BACKEND_POLL, .thread_count = 4},
+		{.name = "Lobby on 4 threads, io_uring",
+			.backend = CHAT_BACKEND_IO_URING, .thread_count = 4},
+		{.name = "Lobby, poll, no delay", .backend = CHAT_BACKEND_POLL,
+			.tcp = {.no_delay = true}},
+		{.name = "Lobby, poll, 16KB buffers",
+			.backend = CHAT_BACKEND_POLL,
+			.tcp = {.send_buffer_size = 16 * 1024,
+				.receive_buffer_size = 16 * 1024}},
+		{.name = "Lobby, poll, busy poll 50us",
+			.backend = CHAT_BACKEND_POLL,
+			.tcp = {.busy_poll_timeout = 50}},
+		{.name = "Lobby, poll, idle in another room",
+			.backend = CHAT_BACKEND_POLL, .is_idle_away = true},
+	};
+	const int idle_counts[] = {0, 1000, 10000};
+	for (size_t si = 0; si < sizeof(scenarios) / sizeof(scenarios[0]);
+	     ++si) {
+		const struct bench_scenario *sc = &scenarios[si];
+		/* Not every system or user has all of them. */
+		struct chat_server *probe = chat_server_new();
+		int rc = chat_server_set_backend(probe, sc->backend);
+		if (rc == 0)
+			rc = chat_server_set_tcp_options(probe, &sc->tcp);
+		if (rc == 0)
+			rc = chat_server_listen(probe, 0);
+		chat_server_delete(probe);
+		if (rc != 0) {
+			printf("Skip %s, not supported\n", sc->name);
+			continue;
+		}
+		char title[256];
+		for (size_t i = 0;
+		     i < sizeof(idle_counts) / sizeof(idle_counts[0]); ++i) {
+			int idle_count = idle_counts[i];
+			if (idle_count > max_idle) {
+				printf("Skip %d idle clients, the descriptor "
+					"limit is too low\n", idle_count);
+				continue;
+			}
+			double k_per_sec[BENCH_RUN_COUNT];
+			double cpu_us[BENCH_RUN_COUNT];
+			double sends[BENCH_RUN_COUNT];
+			for (int run_i = 0; run_i < BENCH_RUN_COUNT; ++run_i) {
+				bench_lobby(sc, idle_count, &k_per_sec[run_i],
+					&cpu_us[run_i], &sends[run_i]);
+			}
+			sprintf(title, "%s, K messages per second, idle "
+				"clients", sc->name);
+			bench_print(title, idle_count, k_per_sec);
+			sprintf(title, "%s, server CPU us per message, idle "
+				"clients", sc->name);
+			bench_print(title, idle_count, cpu_us);
+			sprintf(title, "%s, server sends per 1000 delivered "
+				"messages, idle clients", sc->name);
+			bench_print(title, idle_count, sends);
+		}
+	}
+	return 0;
+}
@@ -1,13 +1,209 @@
 #include "chat.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifndef MSG_NOSIGNAL
+/* Has SO_NOSIGPIPE instead. */
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+#ifndef IOV_MAX
+/* Not all systems define it. That is the one of Linux and the BSDs. */
+#define IOV_MAX 1024
+#endif
+
+enum {
+	/** Less free space than that is grown before a read. */
+	CHAT_INPUT_READ_MIN = 4096,
+	/** Packets gathered by one send. */
+	CHAT_PACKET_SEND_BATCH = IOV_MAX,
+	CHAT_PACKET_QUEUE_MIN = 16,
+	/** Block sizes of the pool are this times the powers of 2. */
+	CHAT_MESSAGE_POOL_BLOCK_MIN = 64,
+	CHAT_MESSAGE_POOL_CLASS_COUNT = 7,
+	/** Returned messages kept by a pool. The rest are freed. */
+	CHAT_MESSAGE_POOL_CACHE_MAX = 256,
+};
+
+struct chat_message_pool {
+	/** The owner's thread. Its deletes need no atomics. */
+	pthread_t owner;
+	/** The owner's, to take from. */
+	struct chat_message *free[CHAT_MESSAGE_POOL_CLASS_COUNT];
+	uint32_t free_count;
+	/**
+	 * Returned by the other threads, newest first. Taken by the
+	 * owner all at once, so a push never races with a pop.
+	 */
+	struct chat_message *returned[CHAT_MESSAGE_POOL_CLASS_COUNT];
+	uint32_t returned_count;
+	/** Taken and not returned to the owner's lists. */
+	int64_t taken_count;
+	/**
+	 * Minus the returns by the other threads, and plus the taken
+	 * ones at the owner's delete. The last one to make it 0 frees
+	 * the pool.
+	 */
+	int64_t ref_count;
+};
+
+static void
+chat_message_list_free(struct chat_message *msg)
+{
+	while (msg != NULL) {
+		struct chat_message *next = msg->next;
+		free(msg);
+		msg = next;
+	}
+}
+
+static void
+chat_message_pool_free(struct chat_message_pool *pool)
+{
+	for (int i = 0; i < CHAT_MESSAGE_POOL_CLASS_COUNT; ++i) {
+		chat_message_list_free(pool->free[i]);
+		chat_message_list_free(pool->returned[i]);
+	}
+	free(pool);
+}
+
+struct chat_message_pool *
+chat_message_pool_new(void)
+{
+	struct chat_message_pool *pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		abort();
+	pool->owner = pthread_self();
+	return pool;
+}
+
+void
+chat_message_pool_delete(struct chat_message_pool *pool)
+{
+	if (__atomic_add_fetch(&pool->ref_count, pool->taken_count,
+			       __ATOMIC_ACQ_REL) == 0)
+		chat_message_pool_free(pool);
+}
+
+/** Move the returned messages of the size class to the owner. */
+static void
+chat_message_pool_take_returned(struct chat_message_pool *pool,
+				int size_class)
+{
+	struct chat_message *msg = __atomic_exchange_n(
+		&pool->returned[size_class], NULL, __ATOMIC_ACQUIRE);
+	uint32_t count = 0;
+	while (msg != NULL) {
+		struct chat_message *next = msg->next;
+		msg->next = pool->free[size_class];
+		pool->free[size_class] = msg;
+		msg = next;
+		++count;
+	}
+	__atomic_sub_fetch(&pool->returned_count, count, __ATOMIC_RELAXED);
+	pool->free_count += count;
+}
+
+struct chat_message *
+chat_message_new(struct chat_message_pool *pool, size_t size)
+{
+	size_t block_size = sizeof(struct chat_message) + size;
+	int size_class = 0;
+	while (size_class < CHAT_MESSAGE_POOL_CLASS_COUNT &&
+	       ((size_t)CHAT_MESSAGE_POOL_BLOCK_MIN << size_class) < block_size)
+		++size_class;
+	struct chat_message *msg;
+	if (pool == NULL || size_class == CHAT_MESSAGE_POOL_CLASS_COUNT ||
+	    !pthread_equal(pthread_self(), pool->owner)) {
+		msg = malloc(block_size);
+		if (msg == NULL)
+			abort();
+		msg->pool = NULL;
+	} else {
+		struct chat_message **list = &pool->free[size_class];
+		if (*list == NULL &&
+		    __atomic_load_n(&pool->returned[size_class],
+				    __ATOMIC_RELAXED) != NULL)
+			chat_message_pool_take_returned(pool, size_class);
+		msg = *list;
+		if (msg != NULL) {
+			*list = msg->next;
+			--pool->free_count;
+		} else {
+			msg = malloc(CHAT_MESSAGE_POOL_BLOCK_MIN << size_class);
+			if (msg == NULL)
+				abort();
+		}
+		msg->pool = pool;
+		msg->size_class = size_class;
+		++pool->taken_count;
+	}
+	msg->data = (char *)(msg + 1);
+	msg->next = NULL;
+	return msg;
+}
+
+/** Return the message from a thread other than the pool's owner. */
+static void
+chat_message_pool_return(struct chat_message_pool *pool,
+			 struct chat_message *msg)
+{
+	if (__atomic_add_fetch(&pool->returned_count, 1, __ATOMIC_RELAXED) >
+	    CHAT_MESSAGE_POOL_CACHE_MAX) {
+		__atomic_sub_fetch(&pool->returned_count, 1, __ATOMIC_RELAXED);
+		free(msg);
+	} else {
+		struct chat_message **list = &pool->returned[msg->size_class];
+		struct chat_message *head = __atomic_load_n(list,
+			__ATOMIC_RELAXED);
+		do {
+			msg->next = head;
+		} while (!__atomic_compare_exchange_n(list, &head, msg, true,
+						      __ATOMIC_RELEASE,
+						      __ATOMIC_RELAXED));
+	}
+	if (__atomic_sub_fetch(&pool->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+		chat_message_pool_free(pool);
+}
 
 void
 chat_message_delete(struct chat_message *msg)
 {
-	free(msg->data);
-	free(msg);
+	struct chat_message_pool *pool = msg->pool;
+	if (pool == NULL) {
+		free(msg);
+		return;
+	}
+	/*
+	 * The owner's thread can't race with its own delete of the
+	 * pool. After it, the owner's lists are not touched anymore.
+	 */
+	if (!pthread_equal(pthread_self(), pool->owner) ||
+	    __atomic_load_n(&pool->ref_count, __ATOMIC_RELAXED) > 0) {
+		chat_message_pool_return(pool, msg);
+		return;
+	}
+	--pool->taken_count;
+	if (pool->free_count >= CHAT_MESSAGE_POOL_CACHE_MAX) {
+		free(msg);
+		return;
+	}
+	msg->next = pool->free[msg->size_class];
+	pool->free[msg->size_class] = msg;
+	++pool->free_count;
 }
 
 int
@@ -20,3 +216,616 @@ chat_events_to_poll_events(int mask)
 		res |= POLLOUT;
 	return res;
 }
+
+void
+chat_message_queue_create(struct chat_message_queue *queue)
+{
+	queue->first = NULL;
+	queue->last = NULL;
+}
+
+void
+chat_message_queue_destroy(struct chat_message_queue *queue)
+{
+	struct chat_message *msg;
+	while ((msg = chat_message_queue_pop(queue)) != NULL)
+		chat_message_delete(msg);
+}
+
+void
+chat_message_queue_push(struct chat_message_queue *queue,
+			struct chat_message *msg)
+{
+	msg->next = NULL;
+	if (queue->last == NULL)
+		queue->first = msg;
+	else
+		queue->last->next = msg;
+	queue->last = msg;
+}
+
+struct chat_message *
+chat_message_queue_pop(struct chat_message_queue *queue)
+{
+	struct chat_message *msg = queue->first;
+	if (msg == NULL)
+		return NULL;
+	queue->first = msg->next;
+	if (queue->first == NULL)
+		queue->last = NULL;
+	return msg;
+}
+
+void
+chat_input_create(struct chat_input *in)
+{
+	memset(in, 0, sizeof(*in));
+}
+
+void
+chat_input_destroy(struct chat_input *in)
+{
+	free(in->data);
+}
+
+/** Make a room for the given bytes more, the content is unwrapped. */
+static void
+chat_input_grow(struct chat_input *in, size_t size)
+{
+	size_t capacity = in->capacity * 2;
+	if (capacity < in->size + size)
+		capacity = in->size + size;
+	char *data = malloc(capacity);
+	if (data == NULL)
+		abort();
+	size_t head = in->capacity - in->begin;
+	if (in->size == 0) {
+		/* Nothing to move, maybe not even data yet. */
+	} else if (head >= in->size) {
+		memcpy(data, in->data + in->begin, in->size);
+	} else {
+		memcpy(data, in->data + in->begin, head);
+		memcpy(data + head, in->data, in->size - head);
+	}
+	free(in->data);
+	in->data = data;
+	in->capacity = capacity;
+	in->begin = 0;
+}
+
+int
+chat_input_recv(struct chat_input *in, int fd)
+{
+	while (true) {
+		if (in->capacity - in->size < CHAT_INPUT_READ_MIN)
+			chat_input_grow(in, CHAT_INPUT_READ_MIN);
+		/* The free space is after the end and before the begin. */
+		struct iovec iov[2];
+		int iov_count = 1;
+		size_t end = in->begin + in->size;
+		if (end >= in->capacity) {
+			end -= in->capacity;
+			iov[0].iov_base = in->data + end;
+			iov[0].iov_len = in->begin - end;
+		} else {
+			iov[0].iov_base = in->data + end;
+			iov[0].iov_len = in->capacity - end;
+			iov[1].iov_base = in->data;
+			iov[1].iov_len = in->begin;
+			if (in->begin > 0)
+				iov_count = 2;
+		}
+		ssize_t rc = readv(fd, iov, iov_count);
+		if (rc > 0) {
+			in->size += rc;
+			continue;
+		}
+		if (rc == 0)
+			return -1;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		if (errno != EINTR)
+			return -1;
+	}
+}
+
+void
+chat_input_append(struct chat_input *in, const char *data, size_t size)
+{
+	if (in->capacity - in->size < size)
+		chat_input_grow(in, size);
+	size_t end = in->begin + in->size;
+	if (end >= in->capacity)
+		end -= in->capacity;
+	size_t tail = in->capacity - end;
+	if (tail >= size) {
+		memcpy(in->data + end, data, size);
+	} else {
+		memcpy(in->data + end, data, tail);
+		memcpy(in->data, data + tail, size - tail);
+	}
+	in->size += size;
+}
+
+/** A byte by its offset from the begin. */
+static inline char
+chat_input_at(const struct chat_input *in, size_t i)
+{
+	i += in->begin;
+	if (i >= in->capacity)
+		i -= in->capacity;
+	return in->data[i];
+}
+
+/** Offset of the first '\n' after the checked bytes, or size. */
+static size_t
+chat_input_find_delim(const struct chat_input *in)
+{
+	/* Two contiguous parts at most, each searched by memchr(). */
+	size_t pos = in->checked;
+	while (pos < in->size) {
+		size_t i = in->begin + pos;
+		if (i >= in->capacity)
+			i -= in->capacity;
+		size_t len = in->capacity - i;
+		if (len > in->size - pos)
+			len = in->size - pos;
+		const char *end = memchr(in->data + i, '\n', len);
+		if (end != NULL)
+			return pos + (end - (in->data + i));
+		pos += len;
+	}
+	return in->size;
+}
+
+/** Copy the bytes from the given offset from the begin. */
+static void
+chat_input_copy(const struct chat_input *in, size_t offset, char *dst,
+		size_t size)
+{
+	size_t i = in->begin + offset;
+	if (i >= in->capacity)
+		i -= in->capacity;
+	size_t head = in->capacity - i;
+	if (head >= size) {
+		memcpy(dst, in->data + i, size);
+	} else {
+		memcpy(dst, in->data + i, head);
+		memcpy(dst + head, in->data, size - head);
+	}
+}
+
+/** Drop the given bytes from the begin. */
+static void
+chat_input_consume(struct chat_input *in, size_t size)
+{
+	in->begin += size;
+	if (in->begin >= in->capacity)
+		in->begin -= in->capacity;
+	in->size -= size;
+	in->checked = 0;
+	/* Empty, so the next read gets the space in one piece. */
+	if (in->size == 0)
+		in->begin = 0;
+}
+
+struct chat_message *
+chat_input_next(struct chat_input *in, struct chat_message_pool *pool)
+{
+	while (true) {
+		size_t end = chat_input_find_delim(in);
+		if (end == in->size) {
+			in->checked = in->size;
+			return NULL;
+		}
+		/* Trimmed right in the ring, only the rest is copied. */
+		size_t begin = 0;
+		while (begin < end &&
+		       isspace((unsigned char)chat_input_at(in, begin)))
+			++begin;
+		size_t msg_end = end;
+		while (msg_end > begin &&
+		       isspace((unsigned char)chat_input_at(in, msg_end - 1)))
+			--msg_end;
+		size_t size = msg_end - begin;
+		struct chat_message *msg = NULL;
+		if (size > 0) {
+			msg = chat_message_new(pool, size + 1);
+			chat_input_copy(in, begin, msg->data, size);
+			msg->data[size] = 0;
+		}
+		chat_input_consume(in, end + 1);
+		if (msg != NULL)
+			return msg;
+	}
+}
+
+int
+chat_input_take_hello(struct chat_input *in, bool *is_framed)
+{
+	if (in->size == 0)
+		return 1;
+	if (chat_input_at(in, 0) != 0) {
+		*is_framed = false;
+		return 0;
+	}
+	if (in->size < CHAT_FRAME_HELLO_SIZE)
+		return 1;
+	char hello[CHAT_FRAME_HELLO_SIZE];
+	chat_input_copy(in, 0, hello, sizeof(hello));
+	if (memcmp(hello, CHAT_FRAME_HELLO, sizeof(hello)) != 0)
+		return -1;
+	chat_input_consume(in, sizeof(hello));
+	*is_framed = true;
+	return 0;
+}
+
+/**
+ * Decode a varint at the offset from the begin.
+ *
+ * @retval >0 Its size.
+ * @retval 0 Not all of it is here yet.
+ * @retval -1 Too big for 32 bits.
+ */
+static int
+chat_input_varint(const struct chat_input *in, size_t offset,
+		  uint32_t *value)
+{
+	uint64_t res = 0;
+	for (int i = 0; i < CHAT_VARINT_SIZE_MAX; ++i) {
+		if (offset + i >= in->size)
+			return 0;
+		unsigned char c = chat_input_at(in, offset + i);
+		res |= (uint64_t)(c & 0x7f) << (7 * i);
+		if ((c & 0x80) == 0) {
+			if (res > UINT32_MAX)
+				return -1;
+			*value = (uint32_t)res;
+			return i + 1;
+		}
+	}
+	return -1;
+}
+
+int
+chat_input_next_frame(struct chat_input *in, struct chat_message_pool *pool,
+		      struct chat_message **msg, uint32_t *size)
+{
+	*msg = NULL;
+	uint32_t body_size, author_size;
+	int rc = chat_input_varint(in, 0, &body_size);
+	if (rc <= 0)
+		return rc;
+	if (body_size > CHAT_FRAME_SIZE_MAX)
+		return -1;
+	size_t header_size = rc;
+	/* The whole frame is awaited, and then only copied out. */
+	if (in->size - header_size < body_size)
+		return 0;
+	rc = chat_input_varint(in, header_size, &author_size);
+	if (rc <= 0 || (uint32_t)rc + author_size > body_size)
+		return -1;
+	size_t author_offset = header_size + rc;
+	size_t data_offset = author_offset + author_size;
+	size_t data_size = header_size + body_size - data_offset;
+	size_t alloc_size = data_size + 1;
+#if NEED_AUTHOR
+	/* The author is right after the data, freed with it. */
+	alloc_size += author_size + 1;
+#endif
+	struct chat_message *res = chat_message_new(pool, alloc_size);
+	chat_input_copy(in, data_offset, res->data, data_size);
+	res->data[data_size] = 0;
+	/* The messages are strings, and the text peers can't take it. */
+	if (memchr(res->data, 0, data_size) != NULL) {
+		chat_message_delete(res);
+		return -1;
+	}
+#if NEED_AUTHOR
+	char *author = res->data + data_size + 1;
+	chat_input_copy(in, author_offset, author, author_size);
+	author[author_size] = 0;
+	res->author = author;
+#endif
+	chat_input_consume(in, header_size + body_size);
+	*msg = res;
+	*size = data_size;
+	return 0;
+}
+
+void
+chat_output_create(struct chat_output *out)
+{
+	memset(out, 0, sizeof(*out));
+}
+
+void
+chat_output_destroy(struct chat_output *out)
+{
+	free(out->data);
+}
+
+void
+chat_output_append(struct chat_output *out, const char *data, size_t size)
+{
+	if (out->capacity - out->size < size && out->sent > 0) {
+		memmove(out->data, out->data + out->sent,
+			out->size - out->sent);
+		out->size -= out->sent;
+		out->sent = 0;
+	}
+	if (out->capacity - out->size < size) {
+		size_t capacity = out->capacity * 2;
+		if (capacity < out->size + size)
+			capacity = out->size + size;
+		out->data = realloc(out->data, capacity);
+		if (out->data == NULL)
+			abort();
+		out->capacity = capacity;
+	}
+	memcpy(out->data + out->size, data, size);
+	out->size += size;
+}
+
+int
+chat_output_send(struct chat_output *out, int fd)
+{
+	while (!chat_output_is_empty(out)) {
+		size_t size = out->size - out->sent;
+		ssize_t rc = send(fd, out->data + out->sent, size,
+				  MSG_NOSIGNAL);
+		if (rc >= 0) {
+			out->sent += rc;
+			/* Short means full, no need for a call to see it. */
+			if ((size_t)rc < size)
+				return 0;
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		if (errno != EINTR)
+			return -1;
+	}
+	/* All is sent, the buffer is reused from the start. */
+	out->sent = 0;
+	out->size = 0;
+	return 0;
+}
+
+struct chat_packet *
+chat_packet_new(const char *data, uint32_t size)
+{
+	struct chat_packet *packet = malloc(sizeof(*packet) + size);
+	if (packet == NULL)
+		abort();
+	packet->ref_count = 1;
+	packet->size = size;
+	packet->next = NULL;
+	memcpy(packet->data, data, size);
+	return packet;
+}
+
+static size_t
+chat_varint_encode(char *buf, uint32_t value)
+{
+	size_t size = 0;
+	while (value >= 0x80) {
+		buf[size++] = (char)(value | 0x80);
+		value >>= 7;
+	}
+	buf[size++] = (char)value;
+	return size;
+}
+
+static size_t
+chat_varint_size(uint32_t value)
+{
+	size_t size = 1;
+	while (value >= 0x80) {
+		value >>= 7;
+		++size;
+	}
+	return size;
+}
+
+size_t
+chat_frame_header(char *buf, uint32_t author_size, uint32_t data_size)
+{
+	uint32_t body_size = chat_varint_size(author_size) + author_size +
+		data_size;
+	size_t size = chat_varint_encode(buf, body_size);
+	return size + chat_varint_encode(buf + size, author_size);
+}
+
+struct chat_packet *
+chat_packet_new_frame(const char *author, uint32_t author_size,
+		      const char *data, uint32_t data_size)
+{
+	char header[CHAT_FRAME_HEADER_MAX];
+	size_t header_size = chat_frame_header(header, author_size,
+					       data_size);
+	uint32_t size = header_size + author_size + data_size;
+	struct chat_packet *packet = malloc(sizeof(*packet) + size);
+	if (packet == NULL)
+		abort();
+	packet->ref_count = 1;
+	packet->size = size;
+	packet->next = NULL;
+	memcpy(packet->data, header, header_size);
+	memcpy(packet->data + header_size, author, author_size);
+	memcpy(packet->data + header_size + author_size, data, data_size);
+	return packet;
+}
+
+void
+chat_packet_ref(struct chat_packet *packet)
+{
+	++packet->ref_count;
+}
+
+void
+chat_packet_unref(struct chat_packet *packet)
+{
+	if (--packet->ref_count == 0)
+		free(packet);
+}
+
+void
+chat_packet_queue_create(struct chat_packet_queue *queue)
+{
+	memset(queue, 0, sizeof(*queue));
+}
+
+void
+chat_packet_queue_destroy(struct chat_packet_queue *queue)
+{
+	for (uint32_t i = 0; i < queue->count; ++i) {
+		uint32_t pos = (queue->head + i) % queue->capacity;
+		chat_packet_unref(queue->items[pos]);
+	}
+	free(queue->items);
+}
+
+void
+chat_packet_queue_push(struct chat_packet_queue *queue,
+		       struct chat_packet *packet)
+{
+	if (queue->count == queue->capacity) {
+		uint32_t capacity = queue->capacity * 2;
+		if (capacity < CHAT_PACKET_QUEUE_MIN)
+			capacity = CHAT_PACKET_QUEUE_MIN;
+		struct chat_packet **items = malloc(capacity *
+			sizeof(items[0]));
+		if (items == NULL)
+			abort();
+		/* Unrolled, so the head is at 0 again. */
+		for (uint32_t i = 0; i < queue->count; ++i) {
+			items[i] = queue->items[(queue->head + i) %
+				queue->capacity];
+		}
+		free(queue->items);
+		queue->items = items;
+		queue->head = 0;
+		queue->capacity = capacity;
+	}
+	chat_packet_ref(packet);
+	uint32_t pos = (queue->head + queue->count) % queue->capacity;
+	queue->items[pos] = packet;
+	++queue->count;
+	queue->size += packet->size;
+}
+
+uint32_t
+chat_packet_queue_drop_oldest(struct chat_packet_queue *queue, size_t size)
+{
+	uint32_t dropped = 0;
+	uint32_t busy = queue->in_flight;
+	if (busy == 0 && queue->offset > 0)
+		busy = 1;
+	while (queue->size > size && queue->count > busy + 1) {
+		uint32_t first = (queue->head + busy) % queue->capacity;
+		struct chat_packet *packet = queue->items[first];
+		queue->size -= packet->size;
+		chat_packet_unref(packet);
+		/* The busy ones move in its place. */
+		for (uint32_t i = busy; i > 0; --i) {
+			queue->items[(queue->head + i) % queue->capacity] =
+				queue->items[(queue->head + i - 1) %
+					     queue->capacity];
+		}
+		queue->head = (queue->head + 1) % queue->capacity;
+		--queue->count;
+		++dropped;
+	}
+	return dropped;
+}
+
+uint32_t
+chat_packet_queue_iov(const struct chat_packet_queue *queue,
+		      struct iovec *iov, uint32_t count)
+{
+	if (count > queue->count)
+		count = queue->count;
+	for (uint32_t i = 0; i < count; ++i) {
+		struct chat_packet *packet = queue->items[
+			(queue->head + i) % queue->capacity];
+		iov[i].iov_base = packet->data;
+		iov[i].iov_len = packet->size;
+	}
+	if (count > 0) {
+		iov[0].iov_base = (char *)iov[0].iov_base + queue->offset;
+		iov[0].iov_len -= queue->offset;
+	}
+	return count;
+}
+
+void
+chat_packet_queue_advance(struct chat_packet_queue *queue, size_t size,
+			  struct chat_send_stats *stats)
+{
+	/*
+	 * A partial send stops inside some packet, which becomes the
+	 * first iovec of the next send, at the offset.
+	 */
+	queue->size -= size;
+	size_t sent = size + queue->offset;
+	while (queue->count > 0) {
+		struct chat_packet *packet = queue->items[queue->head];
+		if (sent < packet->size)
+			break;
+		sent -= packet->size;
+		chat_packet_unref(packet);
+		queue->head = (queue->head + 1) % queue->capacity;
+		--queue->count;
+		__atomic_store_n(&stats->packet_count, stats->packet_count + 1,
+				 __ATOMIC_RELAXED);
+	}
+	queue->offset = sent;
+}
+
+int
+chat_packet_queue_send(struct chat_packet_queue *queue, int fd,
+		       struct chat_send_stats *stats)
+{
+	struct iovec iov[CHAT_PACKET_SEND_BATCH];
+	while (queue->count > 0) {
+		uint32_t count = chat_packet_queue_iov(queue, iov,
+						       CHAT_PACKET_SEND_BATCH);
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		/*
+		 * Not writev(), it has no way to avoid SIGPIPE. More to
+		 * come means no push of a part-filled segment, which with
+		 * Nagle would wait for the peer's delayed ACK.
+		 */
+		int flags = MSG_NOSIGNAL;
+		if (count < queue->count)
+			flags |= MSG_MORE;
+		ssize_t rc = sendmsg(fd, &msg, flags);
+		__atomic_store_n(&stats->call_count, stats->call_count + 1,
+				 __ATOMIC_RELAXED);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno != EINTR)
+				return -1;
+			continue;
+		}
+		chat_packet_queue_advance(queue, rc, stats);
+	}
+	return 0;
+}
+
+void
+chat_socket_setup(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+		abort();
+#ifdef SO_NOSIGPIPE
+	int value = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(value));
+#endif
+}
@@ -16,6 +16,10 @@
 #define NEED_AUTHOR 0
 #define NEED_SERVER_FEED 0
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 enum chat_errcode {
 	CHAT_ERR_INVALID_ARGUMENT = 1,
 	CHAT_ERR_TIMEOUT,
@@ -37,16 +41,348 @@ struct chat_message {
 	/** Author's name. */
 	const char *author;
 #endif
-	/** 0-terminate text. */
+	/** 0-terminate text. Right after the message, in one block. */
 	char *data;
+	/** Next in the queue of the received ones. */
+	struct chat_message *next;
+	/** Where to return it at the delete, NULL if none. */
+	struct chat_message_pool *pool;
+	/** Which of the pool's lists it is of. */
+	int size_class;
+};
+
+/**
+ * The binary framing. A client asks for it by the hello as the first
+ * bytes it sends, and the server confirms by the same hello. Till
+ * then both sides talk text, which never has a zero byte, so the
+ * hello can follow some text lines. A frame is a varint (LEB128) of
+ * the body size, and the body is a varint of the author size, the
+ * author and the data. The data is not trimmed and can have '\n'
+ * (a text peer gets it as several lines), but not a zero.
+ */
+#define CHAT_FRAME_HELLO "\0\1"
+
+enum {
+	CHAT_FRAME_HELLO_SIZE = 2,
+	CHAT_VARINT_SIZE_MAX = 5,
+	/** Body size and author size varints. */
+	CHAT_FRAME_HEADER_MAX = 2 * CHAT_VARINT_SIZE_MAX,
+	/** Bigger frames break the connection. */
+	CHAT_FRAME_SIZE_MAX = 1 << 30,
+};
+
+/**
+ * Rooms. A peer starts in the lobby, the room with the empty name,
+ * and a message goes only to the others in the sender's room. A
+ * message "/join <name>" moves the sender to the named room, "/join"
+ * alone back to the lobby. It is not a message itself, nobody gets
+ * it. A name longer than the max leaves the sender where it was.
+ */
+#define CHAT_JOIN_COMMAND "/join"
+
+enum {
+	CHAT_JOIN_COMMAND_SIZE = sizeof(CHAT_JOIN_COMMAND) - 1,
+	CHAT_ROOM_NAME_MAX = 64,
+};
 
-	/* PUT HERE OTHER MEMBERS */
+/**
+ * Multicast of the lobby, when the server has it on. A peer in the
+ * lobby sending "/multicast" gets the answer "/multicast <group>:<port>
+ * <seq>". Then the lobby messages numbered from seq come to it as UDP
+ * datagrams to the group instead of the TCP connection, its own ones
+ * too. A datagram is the number, 8 bytes big-endian, then the message
+ * with the delimiter, or nothing when the message is too big for a
+ * datagram. A gap in the numbers is asked for by "/nack <seq>", which
+ * is answered on the TCP connection by "/resend <seq> <message>", or
+ * by "/lost <seq>" when the server does not keep it anymore. A join of
+ * any room ends the multicast. Without the multicast on the server
+ * these are plain messages.
+ */
+#define CHAT_MULTICAST_COMMAND "/multicast"
+#define CHAT_NACK_COMMAND "/nack"
+#define CHAT_RESEND_COMMAND "/resend"
+#define CHAT_LOST_COMMAND "/lost"
+
+enum {
+	CHAT_MULTICAST_COMMAND_SIZE = sizeof(CHAT_MULTICAST_COMMAND) - 1,
+	CHAT_NACK_COMMAND_SIZE = sizeof(CHAT_NACK_COMMAND) - 1,
+	CHAT_MULTICAST_HEADER_SIZE = 8,
+	/** The header and the message, in one Ethernet frame. */
+	CHAT_MULTICAST_DATAGRAM_MAX = 1472,
 };
 
+/**
+ * Reused messages of a few size classes, up to a few KB. They are
+ * taken by one thread, the owner which has created the pool, and
+ * returned by any thread at the deletes, so a server's user can
+ * keep its messages after the server is deleted. The owner's own
+ * deletes need no atomics. The pool lives till the owner and all
+ * the messages are done with it.
+ */
+struct chat_message_pool;
+
+struct chat_message_pool *
+chat_message_pool_new(void);
+
+/** The owner is done with the pool. */
+void
+chat_message_pool_delete(struct chat_message_pool *pool);
+
+/**
+ * A message with the given bytes for the data, taken from the pool
+ * by its owner. The bigger ones, the ones for the other threads,
+ * and all of them without a pool, are allocated.
+ */
+struct chat_message *
+chat_message_new(struct chat_message_pool *pool, size_t size);
+
 /** Free message's memory. */
 void
 chat_message_delete(struct chat_message *msg);
 
+/** Received messages, in the order of arrival. */
+struct chat_message_queue {
+	struct chat_message *first;
+	struct chat_message *last;
+};
+
+void
+chat_message_queue_create(struct chat_message_queue *queue);
+
+/** Delete all the messages left in the queue. */
+void
+chat_message_queue_destroy(struct chat_message_queue *queue);
+
+void
+chat_message_queue_push(struct chat_message_queue *queue,
+			struct chat_message *msg);
+
+/** @retval NULL The queue is empty. */
+struct chat_message *
+chat_message_queue_pop(struct chat_message_queue *queue);
+
+/**
+ * Bytes read from a socket, not cut into messages yet. A ring, so a
+ * cut message frees its space without moving the rest. The size
+ * bytes start at begin and can wrap over the end of the data. The
+ * first checked of them have no '\n'.
+ */
+struct chat_input {
+	char *data;
+	size_t begin;
+	size_t checked;
+	size_t size;
+	size_t capacity;
+};
+
+void
+chat_input_create(struct chat_input *in);
+
+void
+chat_input_destroy(struct chat_input *in);
+
+/**
+ * Read from a non-blocking socket till it would block.
+ *
+ * @retval 0 All there is has been read.
+ * @retval -1 The peer has closed the socket, or an error.
+ */
+int
+chat_input_recv(struct chat_input *in, int fd);
+
+/** Append the bytes as if they were read. */
+void
+chat_input_append(struct chat_input *in, const char *data, size_t size);
+
+/**
+ * Cut the next message out of the input. It is trimmed from the
+ * spaces, and the empty ones are skipped.
+ *
+ * @retval NULL No full messages.
+ */
+struct chat_message *
+chat_input_next(struct chat_input *in, struct chat_message_pool *pool);
+
+/**
+ * Check if the input starts with the framing hello, and take it.
+ *
+ * @retval 0 Decided, is_framed is set.
+ * @retval 1 Not enough bytes to decide.
+ * @retval -1 A hello of an unknown version.
+ */
+int
+chat_input_take_hello(struct chat_input *in, bool *is_framed);
+
+/**
+ * Cut the next frame out of the input. Its data size is returned
+ * too, not to scan it again.
+ *
+ * @retval 0 Success, msg is NULL when no full frames.
+ * @retval -1 A broken frame, or its data has a zero.
+ */
+int
+chat_input_next_frame(struct chat_input *in, struct chat_message_pool *pool,
+		      struct chat_message **msg, uint32_t *size);
+
+/** Bytes to send. The ones before sent are already sent. */
+struct chat_output {
+	char *data;
+	size_t sent;
+	size_t size;
+	size_t capacity;
+};
+
+void
+chat_output_create(struct chat_output *out);
+
+void
+chat_output_destroy(struct chat_output *out);
+
+static inline bool
+chat_output_is_empty(const struct chat_output *out)
+{
+	return out->sent == out->size;
+}
+
+void
+chat_output_append(struct chat_output *out, const char *data, size_t size);
+
+/**
+ * Send into a non-blocking socket till all is sent or it would
+ * block. In the latter case the output stays non-empty.
+ *
+ * @retval 0 Success.
+ * @retval -1 The socket is broken.
+ */
+int
+chat_output_send(struct chat_output *out, int fd);
+
+/**
+ * Bytes to send to many sockets, shared by reference. For example a
+ * broadcast message with its '\n', copied once for all the peers.
+ */
+struct chat_packet {
+	/** Queues holding it. */
+	uint32_t ref_count;
+	uint32_t size;
+	/** In a list of packets handed over to another thread. */
+	struct chat_packet *next;
+	char data[];
+};
+
+/** A new packet with one reference. */
+struct chat_packet *
+chat_packet_new(const char *data, uint32_t size);
+
+/**
+ * Write the frame header for the author and data sizes into the buf
+ * of CHAT_FRAME_HEADER_MAX bytes.
+ *
+ * @return Size of the header.
+ */
+size_t
+chat_frame_header(char *buf, uint32_t author_size, uint32_t data_size);
+
+/** A new frame packet with one reference. */
+struct chat_packet *
+chat_packet_new_frame(const char *author, uint32_t author_size,
+		      const char *data, uint32_t data_size);
+
+void
+chat_packet_ref(struct chat_packet *packet);
+
+void
+chat_packet_unref(struct chat_packet *packet);
+
+/**
+ * Packets to send, a ring of references, the oldest at head. The
+ * first offset bytes of the oldest one are already sent.
+ */
+struct chat_packet_queue {
+	struct chat_packet **items;
+	uint32_t head;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t offset;
+	/** First packets given to an async send, not to be dropped. */
+	uint32_t in_flight;
+	/** Bytes left to send. */
+	size_t size;
+};
+
+void
+chat_packet_queue_create(struct chat_packet_queue *queue);
+
+/** Drop the references to the packets left in the queue. */
+void
+chat_packet_queue_destroy(struct chat_packet_queue *queue);
+
+static inline bool
+chat_packet_queue_is_empty(const struct chat_packet_queue *queue)
+{
+	return queue->count == 0;
+}
+
+/** The queue takes a new reference to the packet. */
+void
+chat_packet_queue_push(struct chat_packet_queue *queue,
+		       struct chat_packet *packet);
+
+/**
+ * Drop the oldest packets till the unsent bytes fit into the size.
+ * A packet sent in part or in flight is kept, it can not be cut. The
+ * newest one is kept too, so the queue does not get empty.
+ *
+ * @return Count of the dropped packets.
+ */
+uint32_t
+chat_packet_queue_drop_oldest(struct chat_packet_queue *queue, size_t size);
+
+/**
+ * Counters of the packet sends, summed over many queues. Written
+ * by one thread, but can be read by any.
+ */
+struct chat_send_stats {
+	/** Send calls, including the ones failed or would block. */
+	uint64_t call_count;
+	/** Packets sent out whole. */
+	uint64_t packet_count;
+};
+
+struct iovec;
+
+/**
+ * Point the iovecs at the first unsent bytes, up to the count of
+ * packets.
+ *
+ * @return Count of the filled iovecs.
+ */
+uint32_t
+chat_packet_queue_iov(const struct chat_packet_queue *queue,
+		      struct iovec *iov, uint32_t count);
+
+/** Drop the sent bytes from the front. */
+void
+chat_packet_queue_advance(struct chat_packet_queue *queue, size_t size,
+			  struct chat_send_stats *stats);
+
+/**
+ * Send the packets into a non-blocking socket, up to IOV_MAX by one
+ * call, till all are sent or it would block.
+ *
+ * @param stats Counters to add to.
+ *
+ * @retval 0 Success.
+ * @retval -1 The socket is broken.
+ */
+int
+chat_packet_queue_send(struct chat_packet_queue *queue, int fd,
+		       struct chat_send_stats *stats);
+
+/** Make the descriptor non-blocking and, where needed, SIGPIPE-free. */
+void
+chat_socket_setup(int fd);
+
 /** Convert chat_events mask to events suitable for poll(). */
 int
 chat_events_to_poll_events(int mask);
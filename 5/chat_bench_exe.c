@@ -0,0 +1,321 @@
+/*
+ * A load generator for a running chat server. Connects the given
+ * number of clients, spread over the threads, and each client sends
+ * at the given rate. Every message carries its send time, so each
+ * receiver knows how long it took to reach it. All the clients are
+ * in this process, so the clock is the same for all of them.
+ *
+ * Reports the sent and delivered messages per second, the latency
+ * percentiles of the deliveries, and, if given the server's pid, its
+ * CPU usage over the run.
+ */
+#include "chat.h"
+#include "chat_client.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	BENCH_MSG_SIZE = 64,
+	/** After the last send, to let the last messages arrive. */
+	BENCH_DRAIN_MS = 1000,
+};
+
+struct bench_thread {
+	pthread_t thread;
+	struct chat_client **clients;
+	int client_count;
+	/** Index of the first client among all the clients. */
+	int first_id;
+	/** Sends per second, of all the thread's clients together. */
+	double rate;
+	uint64_t end_ns;
+	uint64_t sent_count;
+	uint64_t error_count;
+	/** Latencies of the received messages, in microseconds. */
+	uint32_t *latencies;
+	size_t latency_count;
+	size_t latency_capacity;
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_u32(const void *l, const void *r)
+{
+	uint32_t a = *(const uint32_t *)l;
+	uint32_t b = *(const uint32_t *)r;
+	return a < b ? -1 : a > b;
+}
+
+/** CPU time of the process, all its threads, in microseconds. */
+static int
+bench_cpu_us(int pid, double *res)
+{
+	char path[64];
+	sprintf(path, "/proc/%d/task", pid);
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return -1;
+	unsigned long long sum = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		sprintf(path, "/proc/%d/task/%d/schedstat", pid,
+			atoi(entry->d_name));
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		/* The first is the time on a CPU, in ns. */
+		unsigned long long ns = 0;
+		if (fscanf(f, "%llu", &ns) == 1)
+			sum += ns;
+		fclose(f);
+	}
+	closedir(dir);
+	*res = (double)sum / 1000;
+	return 0;
+}
+
+static void
+bench_thread_add_latency(struct bench_thread *t, uint32_t us)
+{
+	if (t->latency_count == t->latency_capacity) {
+		t->latency_capacity = t->latency_capacity == 0 ?
+			1024 : t->latency_capacity * 2;
+		t->latencies = realloc(t->latencies,
+			t->latency_capacity * sizeof(t->latencies[0]));
+		if (t->latencies == NULL)
+			abort();
+	}
+	t->latencies[t->latency_count++] = us;
+}
+
+static void
+bench_thread_receive(struct bench_thread *t, struct chat_client *cli)
+{
+	struct chat_message *msg;
+	while ((msg = chat_client_pop_next(cli)) != NULL) {
+		/* "<sender> <send time in ns> <padding>". */
+		char *end;
+		strtol(msg->data, &end, 10);
+		uint64_t sent = strtoull(end, NULL, 10);
+		uint64_t now = bench_now_ns();
+		if (sent != 0 && now >= sent)
+			bench_thread_add_latency(t, (now - sent) / 1000);
+		chat_message_delete(msg);
+	}
+}
+
+static void *
+bench_thread_f(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct pollfd *pfds = malloc(t->client_count * sizeof(pfds[0]));
+	if (pfds == NULL)
+		abort();
+	char msg[BENCH_MSG_SIZE];
+	uint64_t interval = (uint64_t)(1000000000 / t->rate);
+	uint64_t next_send = bench_now_ns();
+	uint64_t drain_end = t->end_ns + (uint64_t)BENCH_DRAIN_MS * 1000000;
+	int next_client = 0;
+	while (true) {
+		uint64_t now = bench_now_ns();
+		if (now >= drain_end)
+			break;
+		/* The clients take turns, so each sends at its rate. */
+		while (now < t->end_ns && now >= next_send) {
+			struct chat_client *cli = t->clients[next_client];
+			int size = snprintf(msg, sizeof(msg), "%d %llu ",
+				t->first_id + next_client,
+				(unsigned long long)now);
+			memset(msg + size, 'x', sizeof(msg) - size - 1);
+			msg[sizeof(msg) - 1] = '\n';
+			if (chat_client_feed(cli, msg, sizeof(msg)) == 0)
+				++t->sent_count;
+			else
+				++t->error_count;
+			next_client = (next_client + 1) % t->client_count;
+			next_send += interval;
+		}
+		for (int i = 0; i < t->client_count; ++i) {
+			struct chat_client *cli = t->clients[i];
+			pfds[i].fd = chat_client_get_descriptor(cli);
+			pfds[i].events = chat_events_to_poll_events(
+				chat_client_get_events(cli));
+			pfds[i].revents = 0;
+		}
+		uint64_t wake = now < t->end_ns ? next_send : drain_end;
+		/* Rounded up, not to spin on the sub-ms waits. */
+		int ms = 0;
+		if (wake > now)
+			ms = (int)((wake - now + 999999) / 1000000);
+		int rc = poll(pfds, t->client_count, ms);
+		if (rc < 0 && errno != EINTR) {
+			printf("Poll error: %d\n", errno);
+			break;
+		}
+		for (int i = 0; i < t->client_count && rc > 0; ++i) {
+			if (pfds[i].revents == 0)
+				continue;
+			struct chat_client *cli = t->clients[i];
+			int err = chat_client_update(cli, 0);
+			if (err != 0 && err != CHAT_ERR_TIMEOUT)
+				++t->error_count;
+			bench_thread_receive(t, cli);
+		}
+	}
+	free(pfds);
+	return NULL;
+}
+
+static uint32_t
+bench_percentile(const uint32_t *values, size_t count, double p)
+{
+	if (count == 0)
+		return 0;
+	size_t i = (size_t)(p / 100 * (count - 1));
+	return values[i];
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		printf("Usage: %s <addr> [clients] [threads] [rate per "
+		       "client] [seconds] [server pid]\n", argv[0]);
+		return -1;
+	}
+	const char *addr = argv[1];
+	int client_count = argc > 2 ? atoi(argv[2]) : 100;
+	int thread_count = argc > 3 ? atoi(argv[3]) : 1;
+	double rate = argc > 4 ? atof(argv[4]) : 10;
+	double seconds = argc > 5 ? atof(argv[5]) : 10;
+	int server_pid = argc > 6 ? atoi(argv[6]) : 0;
+	if (client_count < 1 || thread_count < 1 || rate <= 0 ||
+	    seconds <= 0) {
+		printf("Invalid arguments\n");
+		return -1;
+	}
+	if (thread_count > client_count)
+		thread_count = client_count;
+	/* Each client is a descriptor. */
+	struct rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+
+	struct chat_client **clients =
+		malloc(client_count * sizeof(clients[0]));
+	if (clients == NULL)
+		abort();
+	for (int i = 0; i < client_count; ++i) {
+		clients[i] = chat_client_new("bench");
+		int rc = chat_client_connect(clients[i], addr);
+		if (rc != 0) {
+			printf("Couldn't connect client %d: %d\n", i, rc);
+			for (int j = 0; j <= i; ++j)
+				chat_client_delete(clients[j]);
+			free(clients);
+			return -1;
+		}
+	}
+	struct bench_thread *threads = calloc(thread_count,
+					      sizeof(threads[0]));
+	if (threads == NULL)
+		abort();
+	double cpu_start = 0;
+	if (server_pid > 0 && bench_cpu_us(server_pid, &cpu_start) != 0) {
+		printf("No such server process %d\n", server_pid);
+		server_pid = 0;
+	}
+	uint64_t start = bench_now_ns();
+	uint64_t end = start + (uint64_t)(seconds * 1000000000);
+	int first_id = 0;
+	for (int i = 0; i < thread_count; ++i) {
+		struct bench_thread *t = &threads[i];
+		t->client_count = client_count / thread_count +
+			(i < client_count % thread_count);
+		t->clients = clients + first_id;
+		t->first_id = first_id;
+		t->rate = rate * t->client_count;
+		t->end_ns = end;
+		first_id += t->client_count;
+		if (pthread_create(&t->thread, NULL, bench_thread_f, t) != 0)
+			abort();
+	}
+	uint64_t sent_count = 0;
+	uint64_t error_count = 0;
+	size_t latency_count = 0;
+	for (int i = 0; i < thread_count; ++i) {
+		pthread_join(threads[i].thread, NULL);
+		sent_count += threads[i].sent_count;
+		error_count += threads[i].error_count;
+		latency_count += threads[i].latency_count;
+	}
+	double duration = (double)(bench_now_ns() - start) / 1000000000;
+	double cpu_end = 0;
+	if (server_pid > 0 && bench_cpu_us(server_pid, &cpu_end) != 0)
+		server_pid = 0;
+
+	uint32_t *latencies = malloc((latency_count + 1) *
+				     sizeof(latencies[0]));
+	if (latencies == NULL)
+		abort();
+	size_t pos = 0;
+	for (int i = 0; i < thread_count; ++i) {
+		struct bench_thread *t = &threads[i];
+		memcpy(latencies + pos, t->latencies,
+		       t->latency_count * sizeof(latencies[0]));
+		pos += t->latency_count;
+		free(t->latencies);
+	}
+	qsort(latencies, latency_count, sizeof(latencies[0]), bench_cmp_u32);
+
+	printf("Clients: %d on %d threads, %.1lf messages per second each, "
+	       "%.1lf seconds\n", client_count, thread_count, rate, seconds);
+	printf("Sent: %llu, %.1lf per second\n",
+	       (unsigned long long)sent_count, sent_count / seconds);
+	printf("Delivered: %zu, %.1lf per second\n", latency_count,
+	       latency_count / seconds);
+	if (error_count > 0)
+		printf("Errors: %llu\n", (unsigned long long)error_count);
+	printf("Latency, us:\n");
+	printf("    p50: %u\n", bench_percentile(latencies, latency_count, 50));
+	printf("    p90: %u\n", bench_percentile(latencies, latency_count, 90));
+	printf("    p99: %u\n", bench_percentile(latencies, latency_count, 99));
+	printf("    p99.9: %u\n",
+	       bench_percentile(latencies, latency_count, 99.9));
+	printf("    max: %u\n",
+	       bench_percentile(latencies, latency_count, 100));
+	if (server_pid > 0) {
+		double cpu = cpu_end - cpu_start;
+		printf("Server CPU: %.1lf%%", cpu / 10000 / duration);
+		if (sent_count > 0)
+			printf(", %.2lf us per sent message", cpu / sent_count);
+		printf("\n");
+	}
+
+	free(latencies);
+	free(threads);
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(clients[i]);
+	free(clients);
+	return 0;
+}
@@ -1,17 +1,52 @@
 #include "chat.h"
 #include "chat_client.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+enum {
+	/**
+	 * Wait for a connect before starting the next one in parallel,
+	 * the one RFC 8305 recommends.
+	 */
+	CHAT_CLIENT_CONNECT_DELAY_MS = 250,
+};
+
 struct chat_client {
 	/** Socket connected to the server. */
 	int socket;
 	/** Array of received messages. */
-	/* ... */
+	struct chat_message_queue messages;
+	/** Received bytes, not cut into messages yet. */
+	struct chat_input input;
 	/** Output buffer. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	struct chat_output output;
+	/** Asked for at the connect. */
+	enum chat_framing framing;
+	/** The server has confirmed the framing, frames are received. */
+	bool is_framed;
+	/**
+	 * The fed line not complete yet, not cut into a frame. Binary
+	 * framing only.
+	 */
+	struct chat_input feed;
+	/** The fed output is held till there is this much, 0 for none. */
+	size_t flush_threshold;
+	/** Or till the oldest of it has waited for that long. */
+	int64_t flush_delay_ms;
+	/** When the first of the held output was fed. */
+	int64_t held_since_ms;
+	/** The held output is due, sent till all of it is gone. */
+	bool is_flushing;
+	/** The received messages and the fed lines. */
+	struct chat_message_pool *message_pool;
 };
 
 struct chat_client *
@@ -21,10 +56,20 @@ chat_client_new(const char *name)
 	(void)name;
 
 	struct chat_client *client = calloc(1, sizeof(*client));
+	if (client == NULL)
+		abort();
 	client->socket = -1;
-
-	/* IMPLEMENT THIS FUNCTION */
-
+	chat_message_queue_create(&client->messages);
+	chat_input_create(&client->input);
+	chat_output_create(&client->output);
+	client->framing = CHAT_FRAMING_TEXT;
+	client->is_framed = false;
+	chat_input_create(&client->feed);
+	client->flush_threshold = 0;
+	client->flush_delay_ms = 0;
+	client->held_since_ms = 0;
+	client->is_flushing = false;
+	client->message_pool = chat_message_pool_new();
 	return client;
 }
 
@@ -33,49 +78,326 @@ chat_client_delete(struct chat_client *client)
 {
 	if (client->socket >= 0)
 		close(client->socket);
+	chat_message_queue_destroy(&client->messages);
+	chat_input_destroy(&client->input);
+	chat_output_destroy(&client->output);
+	chat_input_destroy(&client->feed);
+	chat_message_pool_delete(client->message_pool);
+	free(client);
+}
 
-	/* IMPLEMENT THIS FUNCTION */
+static int64_t
+chat_client_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	free(client);
+/**
+ * Milliseconds till the output is due to send, 0 if it is already,
+ * -1 if there is none.
+ */
+static int64_t
+chat_client_due_ms(const struct chat_client *client)
+{
+	const struct chat_output *out = &client->output;
+	if (chat_output_is_empty(out))
+		return -1;
+	if (client->is_flushing ||
+	    out->size - out->sent >= client->flush_threshold)
+		return 0;
+	int64_t left = client->held_since_ms + client->flush_delay_ms -
+		       chat_client_now_ms();
+	return left > 0 ? left : 0;
+}
+
+/**
+ * The addresses to try, in the order of their start. The family of
+ * the first one goes in turns with the others, so a broken one can't
+ * hold back the rest.
+ */
+static struct addrinfo **
+chat_client_order_addrs(struct addrinfo *info, int *count)
+{
+	int n = 0;
+	for (struct addrinfo *i = info; i != NULL; i = i->ai_next)
+		++n;
+	struct addrinfo **addrs = malloc(2 * n * sizeof(addrs[0]));
+	if (addrs == NULL)
+		abort();
+	/* The first family in the first half, the rest in the second. */
+	struct addrinfo **firsts = addrs + n;
+	struct addrinfo **others = addrs + n;
+	int first_count = 0;
+	int other_count = 0;
+	for (struct addrinfo *i = info; i != NULL; i = i->ai_next) {
+		if (i->ai_family == info->ai_family)
+			firsts[first_count++] = i;
+	}
+	others += first_count;
+	for (struct addrinfo *i = info; i != NULL; i = i->ai_next) {
+		if (i->ai_family != info->ai_family)
+			others[other_count++] = i;
+	}
+	int k = 0;
+	for (int i = 0; i < first_count || i < other_count; ++i) {
+		if (i < first_count)
+			addrs[k++] = firsts[i];
+		if (i < other_count)
+			addrs[k++] = others[i];
+	}
+	*count = n;
+	return addrs;
+}
+
+/**
+ * Connect to the first address which answers. The next attempt is
+ * started when the previous one fails, or after a delay while it
+ * hangs, and the others go on in parallel, like in RFC 8305. So a
+ * broken IPv6 costs a delay, not a connect timeout.
+ *
+ * @retval >=0 The connected socket, non-blocking.
+ * @retval -1 All have failed, errno is of the last one.
+ */
+static int
+chat_client_connect_any(struct addrinfo *info)
+{
+	int count;
+	struct addrinfo **addrs = chat_client_order_addrs(info, &count);
+	struct pollfd *pfds = malloc(count * sizeof(pfds[0]));
+	if (pfds == NULL)
+		abort();
+	int pfd_count = 0;
+	int next = 0;
+	int64_t next_start = chat_client_now_ms();
+	int fd = -1;
+	int err = ECONNREFUSED;
+	while (fd < 0 && (next < count || pfd_count > 0)) {
+		int64_t now = chat_client_now_ms();
+		if (next < count && now >= next_start) {
+			struct addrinfo *a = addrs[next++];
+			next_start = now + CHAT_CLIENT_CONNECT_DELAY_MS;
+			int sock = socket(a->ai_family, a->ai_socktype,
+					  a->ai_protocol);
+			if (sock < 0) {
+				err = errno;
+				next_start = now;
+				continue;
+			}
+			chat_socket_setup(sock);
+			if (connect(sock, a->ai_addr, a->ai_addrlen) == 0) {
+				fd = sock;
+				break;
+			}
+			if (errno != EINPROGRESS) {
+				err = errno;
+				close(sock);
+				next_start = now;
+				continue;
+			}
+			pfds[pfd_count].fd = sock;
+			pfds[pfd_count].events = POLLOUT;
+			pfds[pfd_count].revents = 0;
+			++pfd_count;
+			continue;
+		}
+		int ms = -1;
+		if (next < count)
+			ms = (int)(next_start - now);
+		int rc = poll(pfds, pfd_count, ms);
+		if (rc < 0 && errno != EINTR) {
+			err = errno;
+			break;
+		}
+		for (int i = 0; i < pfd_count && rc > 0; ++i) {
+			if (pfds[i].revents == 0)
+				continue;
+			int value = 0;
+			socklen_t len = sizeof(value);
+			if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &value,
+				       &len) != 0)
+				value = errno;
+			if (value == 0) {
+				fd = pfds[i].fd;
+				pfds[i] = pfds[--pfd_count];
+				break;
+			}
+			/* Failed, so no need to wait for the next one. */
+			err = value;
+			close(pfds[i].fd);
+			pfds[i--] = pfds[--pfd_count];
+			next_start = chat_client_now_ms();
+		}
+	}
+	for (int i = 0; i < pfd_count; ++i)
+		close(pfds[i].fd);
+	free(pfds);
+	free(addrs);
+	if (fd < 0)
+		errno = err;
+	return fd;
 }
 
 int
 chat_client_connect(struct chat_client *client, const char *addr)
 {
-	/*
-	 * 1) Use getaddrinfo() to resolve addr to struct sockaddr_in.
-	 * 2) Create a client socket (function socket()).
-	 * 3) Connect it by the found address (function connect()).
-	 */
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	(void)addr;
+	if (client->socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	const char *sep = strrchr(addr, ':');
+	if (sep == NULL)
+		return CHAT_ERR_NO_ADDR;
+	size_t host_len = sep - addr;
+	char *host = malloc(host_len + 1);
+	if (host == NULL)
+		abort();
+	memcpy(host, addr, host_len);
+	host[host_len] = 0;
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *info;
+	int rc = getaddrinfo(host, sep + 1, &hints, &info);
+	free(host);
+	if (rc != 0)
+		return CHAT_ERR_NO_ADDR;
+	int fd = chat_client_connect_any(info);
+	freeaddrinfo(info);
+	if (fd < 0)
+		return CHAT_ERR_SYS;
+	client->socket = fd;
+	if (client->framing == CHAT_FRAMING_BINARY) {
+		chat_output_append(&client->output, CHAT_FRAME_HELLO,
+				   CHAT_FRAME_HELLO_SIZE);
+	}
+	return 0;
+}
+
+int
+chat_client_set_framing(struct chat_client *client,
+			enum chat_framing framing)
+{
+	if (client->socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	client->framing = framing;
+	return 0;
+}
+
+int
+chat_client_set_flush(struct chat_client *client, size_t threshold,
+		      double delay)
+{
+	if (delay < 0)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	client->flush_threshold = threshold;
+	client->flush_delay_ms = (int64_t)(delay * 1000);
+	return 0;
+}
 
-	return CHAT_ERR_NOT_IMPLEMENTED;
+double
+chat_client_get_timeout(const struct chat_client *client)
+{
+	if (client->socket < 0)
+		return -1;
+	int64_t ms = chat_client_due_ms(client);
+	return ms < 0 ? -1 : ms / 1000.0;
 }
 
 struct chat_message *
 chat_client_pop_next(struct chat_client *client)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	return NULL;
+	return chat_message_queue_pop(&client->messages);
+}
+
+/**
+ * Cut the received messages out of the input. The text lines go
+ * till the hello, and then the frames.
+ *
+ * @retval 0 Success.
+ * @retval -1 The server has broken the protocol.
+ */
+static int
+chat_client_parse(struct chat_client *client)
+{
+	struct chat_input *in = &client->input;
+	struct chat_message *msg;
+	while (!client->is_framed) {
+		/* A text line can't start with a zero, so it is a hello. */
+		if (client->framing == CHAT_FRAMING_BINARY) {
+			int rc = chat_input_take_hello(in, &client->is_framed);
+			if (rc != 0)
+				return rc > 0 ? 0 : -1;
+			if (client->is_framed)
+				break;
+		}
+		if ((msg = chat_input_next(in, client->message_pool)) == NULL)
+			return 0;
+		chat_message_queue_push(&client->messages, msg);
+	}
+	uint32_t size;
+	while (chat_input_next_frame(in, client->message_pool, &msg,
+				     &size) == 0) {
+		if (msg == NULL)
+			return 0;
+		chat_message_queue_push(&client->messages, msg);
+	}
+	return -1;
+}
+
+/** The server is gone, the socket is not needed anymore. */
+static void
+chat_client_disconnect(struct chat_client *client)
+{
+	close(client->socket);
+	client->socket = -1;
 }
 
 int
 chat_client_update(struct chat_client *client, double timeout)
 {
-	/*
-	 * The easiest way to wait for updates on a single socket with a timeout
-	 * is to use poll(). Epoll is good for many sockets, poll is good for a
-	 * few.
-	 *
-	 * You create one struct pollfd, fill it, call poll() on it, handle the
-	 * events (do read/write).
-	 */
-	(void)client;
-	(void)timeout;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (client->socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+	struct pollfd pfd;
+	pfd.fd = client->socket;
+	pfd.events = chat_events_to_poll_events(
+		chat_client_get_events(client));
+	pfd.revents = 0;
+	int ms = -1;
+	if (timeout >= 0) {
+		/* Rounded up, not to spin on the sub-ms timeouts. */
+		double value = timeout * 1000;
+		ms = value >= INT32_MAX ? INT32_MAX : (int)value;
+		if (ms < value)
+			++ms;
+	}
+	/* Woken up to send the held output when it gets due. */
+	int64_t due_ms = chat_client_due_ms(client);
+	bool is_held = due_ms > 0 && (ms < 0 || due_ms < ms);
+	if (is_held)
+		ms = (int)due_ms;
+	int rc = poll(&pfd, 1, ms);
+	if (rc < 0)
+		return errno == EINTR ? CHAT_ERR_TIMEOUT : CHAT_ERR_SYS;
+	if (rc == 0 && !is_held)
+		return CHAT_ERR_TIMEOUT;
+	if (rc == 0 || (pfd.revents & POLLOUT) != 0) {
+		client->is_flushing = true;
+		if (chat_output_send(&client->output, client->socket) != 0) {
+			chat_client_disconnect(client);
+			return 0;
+		}
+		if (chat_output_is_empty(&client->output))
+			client->is_flushing = false;
+	}
+	if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+		rc = chat_input_recv(&client->input, client->socket);
+		if (chat_client_parse(client) != 0)
+			rc = -1;
+		if (rc != 0)
+			chat_client_disconnect(client);
+	}
+	return 0;
 }
 
 int
@@ -87,20 +409,81 @@ chat_client_get_descriptor(const struct chat_client *client)
 int
 chat_client_get_events(const struct chat_client *client)
 {
-	/*
-	 * IMPLEMENT THIS FUNCTION - add OUTPUT event if has non-empty output
-	 * buffer.
-	 */
-	(void)client;
-	return CHAT_EVENT_INPUT;
+	if (client->socket < 0)
+		return 0;
+	int events = CHAT_EVENT_INPUT;
+	if (chat_client_due_ms(client) == 0)
+		events |= CHAT_EVENT_OUTPUT;
+	return events;
+}
+
+/** Frame the line, trimmed like the server does with text. */
+static void
+chat_client_frame_line(struct chat_client *client, const char *line,
+		       size_t size)
+{
+	while (size > 0 && isspace((unsigned char)*line)) {
+		++line;
+		--size;
+	}
+	while (size > 0 && isspace((unsigned char)line[size - 1]))
+		--size;
+	/* Like the server skips the empty lines. */
+	if (size == 0)
+		return;
+	char header[CHAT_FRAME_HEADER_MAX];
+	chat_output_append(&client->output, header,
+			   chat_frame_header(header, 0, size));
+	chat_output_append(&client->output, line, size);
+}
+
+/**
+ * Cut the fed data into frames by lines. One pass of memchr() over
+ * the data, the lines are framed right from it. Only the unfinished
+ * line at the end is copied aside till the next feed.
+ */
+static void
+chat_client_frame(struct chat_client *client, const char *data,
+		  uint32_t size)
+{
+	const char *end = data + size;
+	const char *delim = memchr(data, '\n', size);
+	if (delim == NULL) {
+		chat_input_append(&client->feed, data, size);
+		return;
+	}
+	if (client->feed.size > 0) {
+		/* The line begun by the previous feeds. */
+		chat_input_append(&client->feed, data, delim - data + 1);
+		struct chat_message *line = chat_input_next(
+			&client->feed, client->message_pool);
+		if (line != NULL) {
+			chat_client_frame_line(client, line->data,
+					       strlen(line->data));
+			chat_message_delete(line);
+		}
+		data = delim + 1;
+		delim = memchr(data, '\n', end - data);
+	}
+	while (delim != NULL) {
+		chat_client_frame_line(client, data, delim - data);
+		data = delim + 1;
+		delim = memchr(data, '\n', end - data);
+	}
+	if (data < end)
+		chat_input_append(&client->feed, data, end - data);
 }
 
 int
 chat_client_feed(struct chat_client *client, const char *msg, uint32_t msg_size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	(void)msg;
-	(void)msg_size;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (client->socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+	if (chat_output_is_empty(&client->output))
+		client->held_since_ms = chat_client_now_ms();
+	if (client->framing == CHAT_FRAMING_TEXT)
+		chat_output_append(&client->output, msg, msg_size);
+	else
+		chat_client_frame(client, msg, msg_size);
+	return 0;
 }
@@ -1,9 +1,21 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 struct chat_client;
 
+/** How a client talks to the server. */
+enum chat_framing {
+	/** '\n'-delimited text, the default. */
+	CHAT_FRAMING_TEXT,
+	/**
+	 * Frames from the connect on. The server's messages are text
+	 * till it confirms.
+	 */
+	CHAT_FRAMING_BINARY,
+};
+
 /**
  * Create a new chat client. No bind, no listen, just allocate and
  * initialize it.
@@ -16,7 +28,10 @@ void
 chat_client_delete(struct chat_client *client);
 
 /**
- * Try to connect to the given address.
+ * Try to connect to the given address. All the addresses it resolves
+ * to are tried in parallel, each next one a moment after the previous,
+ * and the first to answer wins. So an unreachable IPv6 does not hold
+ * the connect for a timeout.
  *
  * @param client Chat client.
  * @param addr Address to connect to, like 'localhost:1234',
@@ -31,6 +46,49 @@ chat_client_delete(struct chat_client *client);
 int
 chat_client_connect(struct chat_client *client, const char *addr);
 
+/**
+ * Choose how to talk to the server. Text by default.
+ *
+ * @param client Chat client.
+ * @param framing Framing to ask the server for at the connect.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ */
+int
+chat_client_set_framing(struct chat_client *client,
+			enum chat_framing framing);
+
+/**
+ * Hold the fed output till there is at least the threshold of it, or
+ * till the oldest of it has waited for the delay. So a big paste or
+ * a burst of lines goes out in a few big sends, not in one per feed.
+ * Both are 0 by default, all the fed data is sent by the next update.
+ * Can be changed any time, like to 0 to flush all before a close.
+ *
+ * @param client Chat client.
+ * @param threshold Bytes to send at once, 0 for any.
+ * @param delay Seconds the fed data can be held at most.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - a negative delay.
+ */
+int
+chat_client_set_flush(struct chat_client *client, size_t threshold,
+		      double delay);
+
+/**
+ * Seconds till the held output is due to send, for the timeout of an
+ * external wait. The client does not want CHAT_EVENT_OUTPUT till then.
+ *
+ * @retval >=0 Timeout, 0 when the output is due already.
+ * @retval -1 No output.
+ */
+double
+chat_client_get_timeout(const struct chat_client *client);
+
 /**
  * Pop a next pending chat message. The returned message has to be
  * freed using chat_message_delete().
@@ -80,7 +138,8 @@ int
 chat_client_get_events(const struct chat_client *client);
 
 /**
- * Feed a message to the client.
+ * Feed a message to the client. It is only buffered, all the fed
+ * data is sent at once by the next update.
  *
  * @param client Chat client.
  * @param msg Message.
@@ -9,6 +9,16 @@
 #include <string.h>
 #include <unistd.h>
 
+enum {
+	/** Read from stdin at once, a paste takes a few reads. */
+	CLIENT_READ_SIZE = 64 * 1024,
+	/** The fed lines are sent by this much at least... */
+	CLIENT_FLUSH_SIZE = 64 * 1024,
+};
+
+/** ...or after this many seconds, not to hold the typed ones. */
+static const double CLIENT_FLUSH_DELAY = 0.005;
+
 int
 main(int argc, char **argv)
 {
@@ -25,6 +35,7 @@ main(int argc, char **argv)
 		chat_client_delete(cli);
 		return -1;
 	}
+	chat_client_set_flush(cli, CLIENT_FLUSH_SIZE, CLIENT_FLUSH_DELAY);
 	struct pollfd poll_fds[2];
 	memset(poll_fds, 0, sizeof(poll_fds));
 
@@ -36,8 +47,7 @@ main(int argc, char **argv)
 	poll_client->fd = chat_client_get_descriptor(cli);
 	assert(poll_client->fd >= 0);
 
-	const int buf_size = 1024;
-	char buf[buf_size];
+	static char buf[CLIENT_READ_SIZE];
 	while (true) {
 		/*
 		 * Find what events the client wants. 'IN' is needed always,
@@ -48,9 +58,15 @@ main(int argc, char **argv)
 		 */
 		poll_client->events =
 			chat_events_to_poll_events(chat_client_get_events(cli));
-
-		int rc = poll(poll_fds, 2, -1);
-		if (rc < 0) {
+		/* After the stdin's end, only till all is sent. */
+		if (poll_input->fd < 0 &&
+		    (poll_client->events & POLLOUT) == 0)
+			break;
+		/* The held output is sent by an update when it is due. */
+		double timeout = chat_client_get_timeout(cli);
+		int count = poll(poll_fds, 2, timeout < 0 ? -1 :
+				 (int)(timeout * 1000) + 1);
+		if (count < 0) {
 			printf("Poll error: %d\n", errno);
 			break;
 		}
@@ -61,10 +77,13 @@ main(int argc, char **argv)
 			 * iteration immediately.
 			 */
 			poll_input->revents = 0;
-			rc = read(STDIN_FILENO, buf, buf_size - 1);
-			if (rc == 0) {
+			int rc = read(STDIN_FILENO, buf, sizeof(buf));
+			if (rc <= 0) {
 				printf("EOF - exiting\n");
-				break;
+				/* The rest is flushed before the exit. */
+				poll_input->fd = -1;
+				chat_client_set_flush(cli, 0, 0);
+				continue;
 			}
 			rc = chat_client_feed(cli, buf, rc);
 			if (rc != 0) {
@@ -72,14 +91,14 @@ main(int argc, char **argv)
 				break;
 			}
 		}
-		if (poll_client->revents != 0) {
+		if (poll_client->revents != 0 || count == 0) {
 			/*
 			 * Some of the client's needed events are ready. Let it
 			 * handle them internally. Timeout is not needed here,
 			 * hence it is zero.
 			 */
 			poll_client->revents = 0;
-			rc = chat_client_update(cli, 0);
+			int rc = chat_client_update(cli, 0);
 			if (rc != 0 && rc != CHAT_ERR_TIMEOUT) {
 				printf("Update error: %d\n", rc);
 				break;
@@ -1,133 +1,2360 @@
+/* For accept4(). */
+#define _GNU_SOURCE
 #include "chat.h"
 #include "chat_server.h"
+#include "chat_uring.h"
+#include "rlist.h"
+#include "trace.h"
 
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+/**
+ * The multiplexer: epoll on Linux, kqueue on the BSDs and macOS.
+ * Either way every socket is added once, edge-triggered for both
+ * input and output, and stays till it is closed. So a writable
+ * socket is reported only after a send has hit EAGAIN, and a peer
+ * with nothing to send costs no wakeups.
+ */
+#ifndef CHAT_USE_KQUEUE
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+	defined(__OpenBSD__) || defined(__DragonFly__)
+#define CHAT_USE_KQUEUE 1
+#else
+#define CHAT_USE_KQUEUE 0
+#endif
+#endif
+
+#if CHAT_USE_KQUEUE
+#include <sys/event.h>
+#else
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+/*
+ * TLS needs OpenSSL, see the tls target in the Makefile. Off by
+ * default, so the homework builds without it.
+ */
+#ifndef CHAT_USE_TLS
+#define CHAT_USE_TLS 0
+#endif
+#if CHAT_USE_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+enum {
+	/** Events taken by one wait, so a busy lobby needs few calls. */
+	CHAT_SERVER_EVENT_BATCH = 1024,
+	/** Requests of a reactor's ring, the completions are 8 times. */
+	CHAT_URING_ENTRIES = 4096,
+	/** Receive buffers of a reactor's ring, shared by its peers. */
+	CHAT_URING_BUF_COUNT = 512,
+	CHAT_URING_BUF_SIZE = 4096,
+	/**
+	 * Packets gathered by one async send, as many as the poll
+	 * backend's writev takes.
+	 */
+	CHAT_URING_SEND_BATCH = 1024,
+	/** A TLS record at most, read at once without the kernel's TLS. */
+	CHAT_TLS_READ_SIZE = 16 * 1024,
+	/** Lobby messages kept for the NACKs of the multicast peers. */
+	CHAT_MULTICAST_RESEND_COUNT = 4096,
+};
+
+/**
+ * An async send of a peer. Kept by the kernel till it is done. The
+ * iovecs grow with the peer's backlog, so the idle ones keep a few.
+ */
+struct chat_peer_send {
+	struct msghdr msg;
+	uint32_t capacity;
+	struct iovec iov[];
+};
+
+/** How a peer talks, decided by its first byte. */
+enum chat_peer_mode {
+	/** Nothing received yet. Sent text meanwhile. */
+	CHAT_PEER_NEW,
+	CHAT_PEER_TEXT,
+	/** Has sent the framing hello. */
+	CHAT_PEER_BINARY,
+};
+
+/** A message kept in a room's history. */
+struct chat_history_item {
+	/** The text line, with the delimiter. */
+	struct chat_packet *text;
+	/** The frame of it for the binary peers, NULL till needed. */
+	struct chat_packet *frame;
+};
+
+/**
+ * A room of a reactor, only of its peers. Each reactor has its own
+ * rooms, so the joins and the fan-outs never lock anything.
+ */
+struct chat_room {
+	/** The reactor's peers in the room. */
+	struct rlist members;
+	/** In the reactor's list of the rooms left empty. */
+	struct rlist in_empty;
+	/**
+	 * The last messages, a ring of the server's history size, the
+	 * oldest at head. Made at the first message.
+	 */
+	struct chat_history_item *history;
+	uint32_t history_head;
+	uint32_t history_count;
+	uint32_t hash;
+	uint32_t name_size;
+	char name[];
+};
+
+/**
+ * The rooms by their names. An open addressing hash table with
+ * linear probing and the hashes next to the pointers, without the
+ * tombstones: a delete moves the following ones back.
+ */
+struct chat_room_slot {
+	uint32_t hash;
+	/** NULL for a free slot. */
+	struct chat_room *room;
+};
+
+/**
+ * A broadcast handed over to another reactor. The packets are made
+ * by the reactor queueing them, so their refs never cross threads,
+ * and not made at all when the room has nobody there.
+ */
+struct chat_post {
+	/** In the reactor's inbox. */
+	struct chat_post *next;
+	/** Its number in the multicast group, 0 for none. */
+	uint64_t seq;
+	/** The data then the room name. */
+	uint32_t data_size;
+	uint32_t room_size;
+	char data[];
+};
+
 struct chat_peer {
-	/** Client's socket. To read/write messages. */
+	/** Client's socket. To read/write messages. -1 when closed. */
 	int socket;
-	/** Output buffer. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	enum chat_peer_mode mode;
+	/** Where its messages go. NULL when closed. */
+	struct chat_room *room;
+	/**
+	 * The first lobby message it takes from the multicast group, 0
+	 * when it takes them all from the socket.
+	 */
+	uint64_t multicast_seq;
+	/** In the room's members. */
+	struct rlist in_room;
+	/** Received bytes, not cut into messages yet. */
+	struct chat_input input;
+	/** Output buffer, the broadcasts shared with the other peers. */
+	struct chat_packet_queue output;
+	/** No EAGAIN on a send since the last writable event. */
+	bool is_writable;
+	/** Over the output budget since the output was last empty. */
+	bool is_backpressured;
+	/** In the reactor's list of all its peers. */
+	struct rlist in_peers;
+	/** In the reactor's list of the peers to send to, if any. */
+	struct rlist in_flush;
+	/** Io_uring only. A multishot receive is armed. */
+	bool is_receiving;
+	/** Io_uring only. Created at the first send. */
+	struct chat_peer_send *send;
+	/** Io_uring only. In flight, the peer is freed after them. */
+	int request_count;
+	/** TLS only. Till the handshake is done, out of any room. */
+	bool is_handshaking;
+#if CHAT_USE_TLS
+	/**
+	 * TLS only. Does the handshake, then the receives if the kernel
+	 * does not decrypt them. NULL when the kernel has all the records.
+	 */
+	SSL *ssl;
+#endif
 };
 
-struct chat_server {
+/** A lobby message sent to the multicast group, kept to resend it. */
+struct chat_datagram {
+	uint64_t seq;
+	/** The header with the number, then the message. */
+	uint32_t size;
+	char data[];
+};
+
+/**
+ * The lobby's multicast, shared by the reactors. The numbers are
+ * taken and the datagrams are sent under the lock, so they go out
+ * in their order.
+ */
+struct chat_multicast {
+	/** UDP socket to send from. -1 before the listen. */
+	int socket;
+	struct sockaddr_in group;
+	struct in_addr interface_addr;
+	/** Of the next datagram. 0 is for no number. */
+	uint64_t next_seq;
+	/** The last datagrams, by the number modulo the size. */
+	struct chat_datagram **sent;
+	uint32_t sent_size;
+	/** Counters, like in chat_server_stats. */
+	uint64_t sent_count;
+	uint64_t resent_count;
+	pthread_mutex_t mutex;
+};
+
+/**
+ * A descriptor to wake up a waiting thread: an eventfd, or a pipe
+ * where there is none. Readable since a signal till a clear.
+ */
+struct chat_wake {
+	int read_fd;
+	int write_fd;
+};
+
+/**
+ * A share of the clients. With its own listening socket and
+ * multiplexer, so the shares do not contend for anything but the
+ * broadcasts. A single-threaded server has one and runs it in the
+ * updates. Otherwise each runs in a thread of its own.
+ */
+struct chat_reactor {
+	struct chat_server *server;
 	/** Listening socket. To accept new clients. */
 	int socket;
-	/** Array of peers. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	/** Epoll or kqueue descriptor. -1 with io_uring. */
+	int poll_fd;
+	/** The ring, or NULL for epoll or kqueue. */
+	struct chat_uring *uring;
+	/** Io_uring only. In flight, for the destroy to wait for. */
+	int request_count;
+	/** Io_uring only. Set by the destroy, not to re-arm. */
+	bool is_closing;
+#if CHAT_USE_KQUEUE
+	struct kevent events[CHAT_SERVER_EVENT_BATCH];
+#else
+	struct epoll_event events[CHAT_SERVER_EVENT_BATCH];
+#endif
+	/** All the connected peers. */
+	struct rlist peers;
+	/** The peers got new output during the current update. */
+	struct rlist flush_peers;
+	/** Closed during the current update, freed at its end. */
+	struct rlist closed_peers;
+	/** Peers having not sent output. */
+	int output_peer_count;
+	/** The room of the new peers, never deleted. */
+	struct chat_room *lobby;
+	/** Power of 2. */
+	struct chat_room_slot *rooms;
+	uint32_t room_capacity;
+	uint32_t room_count;
+	/** Left empty during the update, freed at its end if still are. */
+	struct rlist empty_rooms;
+	/** Sends to all the peers. */
+	struct chat_send_stats send_stats;
+	/** Counters of the budget, like in chat_server_stats. */
+	uint64_t backpressure_peer_count;
+	uint64_t dropped_message_count;
+	uint64_t dropped_peer_count;
+	/** Broadcasts from the other reactors, newest first. */
+	struct chat_post *inbox;
+	/** Signaled when the inbox gets non-empty, and to stop. */
+	struct chat_wake wake;
+	/** The peers' messages, owned by the reactor's thread. */
+	struct chat_message_pool *message_pool;
+	pthread_t thread;
+};
+
+struct chat_server {
+	/** The shares of the clients, none before the listen. */
+	struct chat_reactor *reactors;
+	int reactor_count;
+	/** Reactor threads to start at the listen, 0 for none. */
+	int thread_count;
+	/** Wanted before the listen, then the one in use. */
+	enum chat_server_backend backend;
+	/** Output bytes per peer, 0 for no limit. */
+	size_t output_budget;
+	/** Messages kept per room, 0 for none. */
+	uint32_t history_size;
+	/** NULL when the lobby is not multicast. */
+	struct chat_multicast *multicast;
+	struct chat_server_tcp_options tcp_options;
+	enum chat_output_policy output_policy;
+#if CHAT_USE_TLS
+	/** The peers' certificate and options, NULL for no TLS. */
+	SSL_CTX *tls;
+#endif
+	/** Received messages to pop. */
+	struct chat_message_queue messages;
+	/** Received by the reactor threads, newest first. */
+	struct chat_message *incoming;
+	/** Signaled when the incoming get non-empty. */
+	struct chat_wake incoming_wake;
+	/** Set for the reactor threads to exit. */
+	bool is_stopped;
 };
 
+#if CHAT_USE_KQUEUE
+
+static void
+chat_wake_create(struct chat_wake *wake)
+{
+	int fds[2];
+	if (pipe(fds) != 0)
+		abort();
+	for (int i = 0; i < 2; ++i) {
+		int flags = fcntl(fds[i], F_GETFL);
+		if (flags < 0 ||
+		    fcntl(fds[i], F_SETFL, flags | O_NONBLOCK) != 0)
+			abort();
+	}
+	wake->read_fd = fds[0];
+	wake->write_fd = fds[1];
+}
+
+static void
+chat_wake_signal(struct chat_wake *wake)
+{
+	/* A full pipe is readable already. */
+	char c = 0;
+	while (write(wake->write_fd, &c, 1) < 0 && errno == EINTR)
+		;
+}
+
+static void
+chat_wake_clear(struct chat_wake *wake)
+{
+	char buf[64];
+	while (read(wake->read_fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+static void
+chat_wake_destroy(struct chat_wake *wake)
+{
+	close(wake->read_fd);
+	close(wake->write_fd);
+}
+
+static void
+chat_reactor_poll_add(struct chat_reactor *reactor, int fd, void *ptr,
+		      bool is_output)
+{
+	struct kevent ev[2];
+	EV_SET(&ev[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, ptr);
+	EV_SET(&ev[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, ptr);
+	int count = is_output ? 2 : 1;
+	if (kevent(reactor->poll_fd, ev, count, NULL, 0, NULL) != 0)
+		abort();
+}
+
+static void
+chat_reactor_poll_del(struct chat_reactor *reactor, int fd)
+{
+	/* Its events are dropped by the close. */
+	(void)reactor;
+	(void)fd;
+}
+
+static int
+chat_reactor_poll_wait(struct chat_reactor *reactor, double timeout)
+{
+	struct timespec ts;
+	struct timespec *tsp = NULL;
+	if (timeout >= 0) {
+		ts.tv_sec = (time_t)timeout;
+		ts.tv_nsec = (long)((timeout - ts.tv_sec) * 1000000000);
+		tsp = &ts;
+	}
+	return kevent(reactor->poll_fd, NULL, 0, reactor->events,
+		      CHAT_SERVER_EVENT_BATCH, tsp);
+}
+
+static void *
+chat_reactor_event(const struct chat_reactor *reactor, int i,
+		   bool *is_input, bool *is_output)
+{
+	const struct kevent *ev = &reactor->events[i];
+	/* EOF and errors are seen by the reads. */
+	*is_input = ev->filter == EVFILT_READ;
+	*is_output = ev->filter == EVFILT_WRITE;
+	return ev->udata;
+}
+
+#else /* !CHAT_USE_KQUEUE */
+
+static void
+chat_wake_create(struct chat_wake *wake)
+{
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		abort();
+	wake->read_fd = fd;
+	wake->write_fd = fd;
+}
+
+static void
+chat_wake_signal(struct chat_wake *wake)
+{
+	eventfd_write(wake->write_fd, 1);
+}
+
+static void
+chat_wake_clear(struct chat_wake *wake)
+{
+	eventfd_t value;
+	eventfd_read(wake->read_fd, &value);
+}
+
+static void
+chat_wake_destroy(struct chat_wake *wake)
+{
+	close(wake->read_fd);
+}
+
+static void
+chat_reactor_poll_add(struct chat_reactor *reactor, int fd, void *ptr,
+		      bool is_output)
+{
+	struct epoll_event ev;
+	ev.data.ptr = ptr;
+	ev.events = EPOLLIN | EPOLLET;
+	if (is_output)
+		ev.events |= EPOLLOUT;
+	if (epoll_ctl(reactor->poll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		abort();
+}
+
+static void
+chat_reactor_poll_del(struct chat_reactor *reactor, int fd)
+{
+	epoll_ctl(reactor->poll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int
+chat_reactor_poll_wait(struct chat_reactor *reactor, double timeout)
+{
+	int ms = -1;
+	if (timeout >= 0) {
+		/* Rounded up, not to spin on the sub-ms timeouts. */
+		double value = timeout * 1000;
+		ms = value >= INT32_MAX ? INT32_MAX : (int)value;
+		if (ms < value)
+			++ms;
+	}
+	return epoll_wait(reactor->poll_fd, reactor->events,
+			  CHAT_SERVER_EVENT_BATCH, ms);
+}
+
+static void *
+chat_reactor_event(const struct chat_reactor *reactor, int i,
+		   bool *is_input, bool *is_output)
+{
+	const struct epoll_event *ev = &reactor->events[i];
+	/* Errors and hangups are seen by the reads. */
+	*is_input = (ev->events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
+	*is_output = (ev->events & EPOLLOUT) != 0;
+	return ev->data.ptr;
+}
+
+#endif /* !CHAT_USE_KQUEUE */
+
 struct chat_server *
 chat_server_new(void)
 {
 	struct chat_server *server = calloc(1, sizeof(*server));
-	server->socket = -1;
+	if (server == NULL)
+		abort();
+	chat_message_queue_create(&server->messages);
+	server->incoming_wake.read_fd = -1;
+	server->incoming_wake.write_fd = -1;
+	return server;
+}
 
-	/* IMPLEMENT THIS FUNCTION */
+int
+chat_server_set_thread_count(struct chat_server *server, int count)
+{
+	if (server->reactor_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (count < 0)
+		return CHAT_ERR_INVALID_ARGUMENT;
+#ifndef SO_REUSEPORT
+	/* No way to share the port between the threads' sockets. */
+	if (count > 0)
+		return CHAT_ERR_NOT_IMPLEMENTED;
+#endif
+	server->thread_count = count;
+	return 0;
+}
 
-	return server;
+int
+chat_server_set_output_budget(struct chat_server *server, size_t size,
+			      enum chat_output_policy policy)
+{
+	if (server->reactor_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (policy != CHAT_OUTPUT_DROP_OLDEST &&
+	    policy != CHAT_OUTPUT_DISCONNECT && policy != CHAT_OUTPUT_THROTTLE)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	server->output_budget = size;
+	server->output_policy = policy;
+	return 0;
+}
+
+int
+chat_server_set_history_size(struct chat_server *server, uint32_t count)
+{
+	if (server->reactor_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->history_size = count;
+	return 0;
+}
+
+int
+chat_server_set_tls(struct chat_server *server, const char *cert_file,
+		    const char *key_file)
+{
+	if (server->reactor_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+#if CHAT_USE_TLS
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx == NULL)
+		return CHAT_ERR_SYS;
+	/* The records after the handshake are the kernel's. */
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	/* No resumption, so nothing is left to send after the handshake. */
+	SSL_CTX_set_num_tickets(ctx, 0);
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ctx, key_file,
+					SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key(ctx) != 1) {
+		ERR_clear_error();
+		SSL_CTX_free(ctx);
+		return CHAT_ERR_INVALID_ARGUMENT;
+	}
+	SSL_CTX_free(server->tls);
+	server->tls = ctx;
+	return 0;
+#else
+	(void)cert_file;
+	(void)key_file;
+	return CHAT_ERR_NOT_IMPLEMENTED;
+#endif
+}
+
+static inline bool
+chat_server_is_tls(const struct chat_server *server)
+{
+#if CHAT_USE_TLS
+	return server->tls != NULL;
+#else
+	(void)server;
+	return false;
+#endif
+}
+
+int
+chat_server_set_multicast(struct chat_server *server,
+			  const struct chat_server_multicast_options *options)
+{
+	if (server->reactor_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	struct in_addr group;
+	struct in_addr interface_addr;
+	interface_addr.s_addr = htonl(INADDR_ANY);
+	if (options->group == NULL ||
+	    inet_pton(AF_INET, options->group, &group) != 1 ||
+	    !IN_MULTICAST(ntohl(group.s_addr)) || options->port == 0)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	if (options->interface_addr != NULL &&
+	    inet_pton(AF_INET, options->interface_addr,
+		      &interface_addr) != 1)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	struct chat_multicast *m = server->multicast;
+	if (m == NULL) {
+		m = calloc(1, sizeof(*m));
+		if (m == NULL)
+			abort();
+		m->socket = -1;
+		m->next_seq = 1;
+		pthread_mutex_init(&m->mutex, NULL);
+		server->multicast = m;
+	}
+	m->group.sin_family = AF_INET;
+	m->group.sin_addr = group;
+	m->group.sin_port = htons(options->port);
+	m->interface_addr = interface_addr;
+	m->sent_size = options->resend_count > 0 ?
+		       options->resend_count : CHAT_MULTICAST_RESEND_COUNT;
+	return 0;
+}
+
+int
+chat_server_set_tcp_options(struct chat_server *server,
+			    const struct chat_server_tcp_options *options)
+{
+	if (server->reactor_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (options->send_buffer_size < 0 ||
+	    options->receive_buffer_size < 0 ||
+	    options->defer_accept_timeout < 0 ||
+	    options->busy_poll_timeout < 0)
+		return CHAT_ERR_INVALID_ARGUMENT;
+#ifndef TCP_DEFER_ACCEPT
+	if (options->defer_accept_timeout > 0)
+		return CHAT_ERR_NOT_IMPLEMENTED;
+#endif
+#ifndef SO_BUSY_POLL
+	if (options->busy_poll_timeout > 0)
+		return CHAT_ERR_NOT_IMPLEMENTED;
+#endif
+	server->tcp_options = *options;
+	return 0;
+}
+
+int
+chat_server_set_backend(struct chat_server *server,
+			enum chat_server_backend backend)
+{
+	if (server->reactor_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (backend != CHAT_BACKEND_AUTO && backend != CHAT_BACKEND_POLL &&
+	    backend != CHAT_BACKEND_IO_URING)
+		return CHAT_ERR_INVALID_ARGUMENT;
+#if CHAT_USE_IO_URING
+	if (backend == CHAT_BACKEND_IO_URING && !chat_uring_is_supported())
+		return CHAT_ERR_NOT_IMPLEMENTED;
+#else
+	if (backend == CHAT_BACKEND_IO_URING)
+		return CHAT_ERR_NOT_IMPLEMENTED;
+#endif
+	server->backend = backend;
+	return 0;
+}
+
+enum chat_server_backend
+chat_server_get_backend(const struct chat_server *server)
+{
+	return server->backend;
+}
+
+/** Add to a counter, which the other threads can read. */
+static inline void
+chat_stat_add(uint64_t *stat, int64_t value)
+{
+	__atomic_store_n(stat, *stat + value, __ATOMIC_RELAXED);
+}
+
+static void
+chat_peer_delete(struct chat_peer *peer)
+{
+	chat_input_destroy(&peer->input);
+	chat_packet_queue_destroy(&peer->output);
+	free(peer->send);
+#if CHAT_USE_TLS
+	SSL_free(peer->ssl);
+#endif
+	free(peer);
+}
+
+static uint32_t
+chat_room_hash(const char *name, uint32_t size)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (uint32_t i = 0; i < size; ++i) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/** Slot of the room with the given name, or the free slot for it. */
+static uint32_t
+chat_reactor_room_find(const struct chat_reactor *reactor, const char *name,
+		       uint32_t size, uint32_t hash)
+{
+	uint32_t mask = reactor->room_capacity - 1;
+	for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+		const struct chat_room_slot *slot = &reactor->rooms[i];
+		if (slot->room == NULL)
+			return i;
+		if (slot->hash == hash && slot->room->name_size == size &&
+		    memcmp(slot->room->name, name, size) == 0)
+			return i;
+	}
+}
+
+static void
+chat_reactor_rooms_grow(struct chat_reactor *reactor)
+{
+	struct chat_room_slot *old = reactor->rooms;
+	uint32_t old_capacity = reactor->room_capacity;
+	reactor->room_capacity = old_capacity == 0 ? 16 : old_capacity * 2;
+	reactor->rooms = calloc(reactor->room_capacity,
+				sizeof(reactor->rooms[0]));
+	if (reactor->rooms == NULL)
+		abort();
+	uint32_t mask = reactor->room_capacity - 1;
+	for (uint32_t i = 0; i < old_capacity; ++i) {
+		if (old[i].room == NULL)
+			continue;
+		uint32_t j = old[i].hash & mask;
+		while (reactor->rooms[j].room != NULL)
+			j = (j + 1) & mask;
+		reactor->rooms[j] = old[i];
+	}
+	free(old);
+}
+
+/** The room with the name, NULL if the reactor has none. */
+static struct chat_room *
+chat_reactor_room_get(const struct chat_reactor *reactor, const char *name,
+		      uint32_t size)
+{
+	uint32_t hash = chat_room_hash(name, size);
+	return reactor->rooms[chat_reactor_room_find(reactor, name, size,
+						     hash)].room;
+}
+
+/** The room with the name, a new one if the reactor has none. */
+static struct chat_room *
+chat_reactor_room_take(struct chat_reactor *reactor, const char *name,
+		       uint32_t size)
+{
+	/* Keep the load factor under 3/4. */
+	if ((reactor->room_count + 1) * 4 > reactor->room_capacity * 3)
+		chat_reactor_rooms_grow(reactor);
+	uint32_t hash = chat_room_hash(name, size);
+	struct chat_room_slot *slot =
+		&reactor->rooms[chat_reactor_room_find(reactor, name, size,
+						       hash)];
+	if (slot->room != NULL)
+		return slot->room;
+	struct chat_room *room = malloc(sizeof(*room) + size + 1);
+	if (room == NULL)
+		abort();
+	rlist_create(&room->members);
+	rlist_create(&room->in_empty);
+	room->history = NULL;
+	room->history_head = 0;
+	room->history_count = 0;
+	room->hash = hash;
+	room->name_size = size;
+	memcpy(room->name, name, size);
+	room->name[size] = 0;
+	slot->hash = hash;
+	slot->room = room;
+	++reactor->room_count;
+	return room;
+}
+
+static void
+chat_room_free(struct chat_room *room, uint32_t history_size)
+{
+	for (uint32_t i = 0; i < room->history_count; ++i) {
+		struct chat_history_item *item =
+			&room->history[(room->history_head + i) % history_size];
+		chat_packet_unref(item->text);
+		if (item->frame != NULL)
+			chat_packet_unref(item->frame);
+	}
+	free(room->history);
+	free(room);
+}
+
+/**
+ * Free the room and move the following slots of the same probe
+ * sequence back, so the lookups don't stop on the hole.
+ */
+static void
+chat_reactor_room_delete(struct chat_reactor *reactor, struct chat_room *room)
+{
+	uint32_t mask = reactor->room_capacity - 1;
+	uint32_t i = chat_reactor_room_find(reactor, room->name,
+					    room->name_size, room->hash);
+	for (uint32_t j = (i + 1) & mask; reactor->rooms[j].room != NULL;
+	     j = (j + 1) & mask) {
+		uint32_t home = reactor->rooms[j].hash & mask;
+		/* Can move when the home isn't in (i, j], cyclically. */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			reactor->rooms[i] = reactor->rooms[j];
+			i = j;
+		}
+	}
+	reactor->rooms[i].room = NULL;
+	--reactor->room_count;
+	rlist_del_entry(room, in_empty);
+	chat_room_free(room, reactor->server->history_size);
+}
+
+/**
+ * Take the peer out of its room. An emptied room is freed at the
+ * end of the update, not to free it under a fan-out over it.
+ */
+static void
+chat_reactor_leave_room(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	struct chat_room *room = peer->room;
+	rlist_del_entry(peer, in_room);
+	peer->room = NULL;
+	if (room != reactor->lobby && rlist_empty(&room->members) &&
+	    rlist_empty(&room->in_empty))
+		rlist_add_tail_entry(&reactor->empty_rooms, room, in_empty);
+}
+
+static void
+chat_reactor_join_room(struct chat_reactor *reactor, struct chat_peer *peer,
+		       struct chat_room *room)
+{
+	if (peer->room != NULL)
+		chat_reactor_leave_room(reactor, peer);
+	rlist_add_tail_entry(&room->members, peer, in_room);
+	peer->room = room;
+	peer->multicast_seq = 0;
+}
+
+/**
+ * Close the peer's socket. The peer stays till the end of the
+ * update, because the same batch can still have its events. With
+ * io_uring till its requests are done too, the shutdown ends them.
+ */
+static void
+chat_reactor_close_peer(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	if (reactor->uring == NULL)
+		chat_reactor_poll_del(reactor, peer->socket);
+	else
+		shutdown(peer->socket, SHUT_RDWR);
+	close(peer->socket);
+	peer->socket = -1;
+	if (!chat_packet_queue_is_empty(&peer->output))
+		--reactor->output_peer_count;
+	if (peer->is_backpressured)
+		chat_stat_add(&reactor->backpressure_peer_count, -1);
+	rlist_del_entry(peer, in_flush);
+	rlist_move_entry(&reactor->closed_peers, peer, in_peers);
+	if (peer->room != NULL)
+		chat_reactor_leave_room(reactor, peer);
+}
+
+/** Free the closed peers, and the rooms left empty. */
+static void
+chat_reactor_free_closed(struct chat_reactor *reactor)
+{
+	struct chat_peer *peer, *tmp;
+	rlist_foreach_entry_safe(peer, &reactor->closed_peers, in_peers,
+				 tmp) {
+		if (peer->request_count > 0)
+			continue;
+		rlist_del_entry(peer, in_peers);
+		chat_peer_delete(peer);
+	}
+	struct chat_room *room, *next;
+	rlist_foreach_entry_safe(room, &reactor->empty_rooms, in_empty,
+				 next) {
+		/* Could be joined again since, or has the history. */
+		if (rlist_empty(&room->members) && room->history_count == 0)
+			chat_reactor_room_delete(reactor, room);
+		else
+			rlist_del_entry(room, in_empty);
+	}
+}
+
+#if CHAT_USE_IO_URING
+static void
+chat_reactor_uring_accept(struct chat_reactor *reactor);
+
+static void
+chat_reactor_uring_wake(struct chat_reactor *reactor);
+
+static void
+chat_reactor_uring_drain(struct chat_reactor *reactor);
+#endif
+
+/** Close all but the sockets. Stopped already if in a thread. */
+static void
+chat_reactor_destroy(struct chat_reactor *reactor)
+{
+	struct chat_peer *peer, *tmp;
+	rlist_foreach_entry_safe(peer, &reactor->peers, in_peers, tmp)
+		chat_reactor_close_peer(reactor, peer);
+#if CHAT_USE_IO_URING
+	if (reactor->uring != NULL)
+		chat_reactor_uring_drain(reactor);
+#endif
+	chat_reactor_free_closed(reactor);
+	while (reactor->inbox != NULL) {
+		struct chat_post *post = reactor->inbox;
+		reactor->inbox = post->next;
+		free(post);
+	}
+	for (uint32_t i = 0; i < reactor->room_capacity; ++i) {
+		if (reactor->rooms[i].room != NULL) {
+			chat_room_free(reactor->rooms[i].room,
+				       reactor->server->history_size);
+		}
+	}
+	free(reactor->rooms);
+	if (reactor->wake.read_fd >= 0)
+		chat_wake_destroy(&reactor->wake);
+	if (reactor->poll_fd >= 0)
+		close(reactor->poll_fd);
+	if (reactor->server->thread_count == 0)
+		chat_message_pool_delete(reactor->message_pool);
+}
+
+static void
+chat_server_stop(struct chat_server *server)
+{
+	if (server->thread_count == 0)
+		return;
+	__atomic_store_n(&server->is_stopped, true, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < server->reactor_count; ++i)
+		chat_wake_signal(&server->reactors[i].wake);
+	for (int i = 0; i < server->reactor_count; ++i)
+		pthread_join(server->reactors[i].thread, NULL);
+}
+
+static void
+chat_multicast_delete(struct chat_multicast *m)
+{
+	if (m->socket >= 0)
+		close(m->socket);
+	if (m->sent != NULL) {
+		for (uint32_t i = 0; i < m->sent_size; ++i)
+			free(m->sent[i]);
+		free(m->sent);
+	}
+	pthread_mutex_destroy(&m->mutex);
+	free(m);
 }
 
 void
 chat_server_delete(struct chat_server *server)
 {
-	if (server->socket >= 0)
-		close(server->socket);
+	chat_server_stop(server);
+	for (int i = 0; i < server->reactor_count; ++i) {
+		struct chat_reactor *reactor = &server->reactors[i];
+		chat_reactor_destroy(reactor);
+		close(reactor->socket);
+	}
+	free(server->reactors);
+	struct chat_message *msg = server->incoming;
+	while (msg != NULL) {
+		struct chat_message *next = msg->next;
+		chat_message_delete(msg);
+		msg = next;
+	}
+	if (server->incoming_wake.read_fd >= 0)
+		chat_wake_destroy(&server->incoming_wake);
+	chat_message_queue_destroy(&server->messages);
+	if (server->multicast != NULL)
+		chat_multicast_delete(server->multicast);
+#if CHAT_USE_TLS
+	SSL_CTX_free(server->tls);
+#endif
+	free(server);
+}
 
-	/* IMPLEMENT THIS FUNCTION */
+static int
+chat_socket_set_int(int fd, int level, int name, int value)
+{
+	return setsockopt(fd, level, name, &value, sizeof(value));
+}
 
-	free(server);
+/** Only the ones which are set, the rest keep the system's defaults. */
+static int
+chat_server_apply_tcp_options(struct chat_server *server, int fd)
+{
+	const struct chat_server_tcp_options *o = &server->tcp_options;
+	if (o->no_delay &&
+	    chat_socket_set_int(fd, IPPROTO_TCP, TCP_NODELAY, 1) != 0)
+		return -1;
+	if (o->send_buffer_size > 0 &&
+	    chat_socket_set_int(fd, SOL_SOCKET, SO_SNDBUF,
+				o->send_buffer_size) != 0)
+		return -1;
+	/* Before the listen, or the window scale is chosen without it. */
+	if (o->receive_buffer_size > 0 &&
+	    chat_socket_set_int(fd, SOL_SOCKET, SO_RCVBUF,
+				o->receive_buffer_size) != 0)
+		return -1;
+#ifdef TCP_DEFER_ACCEPT
+	if (o->defer_accept_timeout > 0 &&
+	    chat_socket_set_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+				o->defer_accept_timeout) != 0)
+		return -1;
+#endif
+#ifdef SO_BUSY_POLL
+	if (o->busy_poll_timeout > 0 &&
+	    chat_socket_set_int(fd, SOL_SOCKET, SO_BUSY_POLL,
+				o->busy_poll_timeout) != 0)
+		return -1;
+#endif
+	return 0;
 }
 
-int
-chat_server_listen(struct chat_server *server, uint16_t port)
+/**
+ * A listening socket on the port. With SO_REUSEPORT, if the server
+ * has reactor threads, so each has its own one, and the kernel
+ * balances the connects between them.
+ *
+ * @retval >=0 The socket.
+ * @retval <0 Negative error code.
+ */
+static int
+chat_server_socket(struct chat_server *server, uint16_t port)
 {
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
 	/* Listen on all IPs of this machine. */
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-	/*
-	 * 1) Create a server socket (function socket()).
-	 * 2) Bind the server socket to addr (function bind()).
-	 * 3) Listen the server socket (function listen()).
-	 * 4) Create epoll/kqueue if needed.
-	 */
-	/* IMPLEMENT THIS FUNCTION */
-	(void)server;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -CHAT_ERR_SYS;
+	int value = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+#ifdef SO_REUSEPORT
+	if (server->thread_count > 0)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value));
+#endif
+	if (chat_server_apply_tcp_options(server, fd) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -CHAT_ERR_SYS;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return err == EADDRINUSE ? -CHAT_ERR_PORT_BUSY : -CHAT_ERR_SYS;
+	}
+	if (listen(fd, SOMAXCONN) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -CHAT_ERR_SYS;
+	}
+	chat_socket_setup(fd);
+	return fd;
+}
 
-	return CHAT_ERR_NOT_IMPLEMENTED;
+/** The socket and the resend ring, at the listen. */
+static int
+chat_multicast_open(struct chat_multicast *m)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	/* The TTL stays 1, the group is for the LAN. */
+	if (m->interface_addr.s_addr != htonl(INADDR_ANY) &&
+	    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &m->interface_addr,
+		       sizeof(m->interface_addr)) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	m->socket = fd;
+	m->sent = calloc(m->sent_size, sizeof(m->sent[0]));
+	if (m->sent == NULL)
+		abort();
+	return 0;
+}
+
+static void
+chat_reactor_create(struct chat_reactor *reactor, struct chat_server *server,
+		    int fd)
+{
+	reactor->server = server;
+	reactor->socket = fd;
+	reactor->poll_fd = -1;
+	reactor->uring = NULL;
+	reactor->request_count = 0;
+	reactor->is_closing = false;
+#if CHAT_USE_IO_URING
+	/* The TLS handshake is driven by the readiness events. */
+	if (server->backend != CHAT_BACKEND_POLL &&
+	    !chat_server_is_tls(server) && chat_uring_is_supported()) {
+		reactor->uring = malloc(sizeof(*reactor->uring));
+		if (reactor->uring == NULL)
+			abort();
+		if (chat_uring_create(reactor->uring, CHAT_URING_ENTRIES,
+				      CHAT_URING_BUF_COUNT,
+				      CHAT_URING_BUF_SIZE) != 0) {
+			free(reactor->uring);
+			reactor->uring = NULL;
+		}
+	}
+#endif
+	if (reactor->uring == NULL) {
+#if CHAT_USE_KQUEUE
+		reactor->poll_fd = kqueue();
+#else
+		reactor->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+#endif
+		if (reactor->poll_fd < 0)
+			abort();
+	}
+	rlist_create(&reactor->peers);
+	rlist_create(&reactor->flush_peers);
+	rlist_create(&reactor->closed_peers);
+	reactor->output_peer_count = 0;
+	reactor->rooms = NULL;
+	reactor->room_capacity = 0;
+	reactor->room_count = 0;
+	rlist_create(&reactor->empty_rooms);
+	reactor->lobby = chat_reactor_room_take(reactor, "", 0);
+	memset(&reactor->send_stats, 0, sizeof(reactor->send_stats));
+	reactor->inbox = NULL;
+	reactor->message_pool = NULL;
+	if (server->thread_count == 0)
+		reactor->message_pool = chat_message_pool_new();
+	reactor->wake.read_fd = -1;
+	reactor->wake.write_fd = -1;
+	if (server->thread_count > 0)
+		chat_wake_create(&reactor->wake);
+#if CHAT_USE_IO_URING
+	if (reactor->uring != NULL) {
+		/* Submitted by the first update, in the reactor's thread. */
+		chat_reactor_uring_accept(reactor);
+		if (server->thread_count > 0)
+			chat_reactor_uring_wake(reactor);
+		return;
+	}
+#endif
+	/* The own socket is told from the peers by NULL. */
+	chat_reactor_poll_add(reactor, fd, NULL, false);
+	/* And the wakeups by the reactor itself. */
+	if (server->thread_count > 0) {
+		chat_reactor_poll_add(reactor, reactor->wake.read_fd, reactor,
+				      false);
+	}
+}
+
+static void *
+chat_reactor_f(void *arg);
+
+int
+chat_server_listen(struct chat_server *server, uint16_t port)
+{
+	if (server->reactor_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	int count = server->thread_count > 0 ? server->thread_count : 1;
+	int *fds = malloc(count * sizeof(fds[0]));
+	if (fds == NULL)
+		abort();
+	for (int i = 0; i < count; ++i) {
+		fds[i] = chat_server_socket(server, port);
+		if (fds[i] >= 0 && i == 0) {
+			/* The port 0 is some free one, the same for all. */
+			struct sockaddr_in addr;
+			socklen_t len = sizeof(addr);
+			if (getsockname(fds[0], (struct sockaddr *)&addr,
+					&len) != 0)
+				abort();
+			port = ntohs(addr.sin_port);
+		}
+		if (fds[i] >= 0)
+			continue;
+		int rc = -fds[i];
+		int err = errno;
+		for (int j = 0; j < i; ++j)
+			close(fds[j]);
+		free(fds);
+		errno = err;
+		return rc;
+	}
+	if (server->multicast != NULL &&
+	    chat_multicast_open(server->multicast) != 0) {
+		int err = errno;
+		for (int i = 0; i < count; ++i)
+			close(fds[i]);
+		free(fds);
+		errno = err;
+		return CHAT_ERR_SYS;
+	}
+	server->reactors = calloc(count, sizeof(server->reactors[0]));
+	if (server->reactors == NULL)
+		abort();
+	for (int i = 0; i < count; ++i)
+		chat_reactor_create(&server->reactors[i], server, fds[i]);
+	free(fds);
+	server->reactor_count = count;
+	server->backend = server->reactors[0].uring != NULL ?
+		CHAT_BACKEND_IO_URING : CHAT_BACKEND_POLL;
+	if (server->thread_count == 0)
+		return 0;
+	chat_wake_create(&server->incoming_wake);
+	for (int i = 0; i < count; ++i) {
+		struct chat_reactor *reactor = &server->reactors[i];
+		if (pthread_create(&reactor->thread, NULL, chat_reactor_f,
+				   reactor) != 0)
+			abort();
+	}
+	return 0;
 }
 
 struct chat_message *
 chat_server_pop_next(struct chat_server *server)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)server;
+	return chat_message_queue_pop(&server->messages);
+}
+
+/** Schedule a send to the peer, at the end of the update. */
+static void
+chat_reactor_flush_later(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	if (rlist_empty(&peer->in_flush))
+		rlist_add_tail_entry(&reactor->flush_peers, peer, in_flush);
+}
+
+/** The peer's output has exceeded the budget, apply the policy. */
+static void
+chat_reactor_overflow(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	if (!peer->is_backpressured) {
+		peer->is_backpressured = true;
+		chat_stat_add(&reactor->backpressure_peer_count, 1);
+	}
+	struct chat_server *server = reactor->server;
+	uint32_t count;
+	switch (server->output_policy) {
+	case CHAT_OUTPUT_DROP_OLDEST:
+		count = chat_packet_queue_drop_oldest(&peer->output,
+						      server->output_budget);
+		chat_stat_add(&reactor->dropped_message_count, count);
+		break;
+	case CHAT_OUTPUT_DISCONNECT:
+		chat_stat_add(&reactor->dropped_peer_count, 1);
+		chat_reactor_close_peer(reactor, peer);
+		break;
+	case CHAT_OUTPUT_THROTTLE:
+		/* Its input events are ignored till the flush. */
+		break;
+	}
+}
+
+/** Queue the packet to the peer, it takes a ref. */
+static void
+chat_reactor_queue(struct chat_reactor *reactor, struct chat_peer *peer,
+		   struct chat_packet *packet)
+{
+	if (chat_packet_queue_is_empty(&peer->output))
+		++reactor->output_peer_count;
+	chat_packet_queue_push(&peer->output, packet);
+	chat_reactor_flush_later(reactor, peer);
+}
+
+/** A frame of the text packet, without the delimiter. */
+static struct chat_packet *
+chat_packet_new_text_frame(const struct chat_packet *text)
+{
+	return chat_packet_new_frame("", 0, text->data, text->size - 1);
+}
+
+/** Keep the text packet and its frame, if any, in the room's history. */
+static void
+chat_reactor_remember(struct chat_reactor *reactor, struct chat_room *room,
+		      struct chat_packet *text, struct chat_packet *frame)
+{
+	uint32_t size = reactor->server->history_size;
+	if (size == 0)
+		return;
+	if (room->history == NULL) {
+		room->history = malloc(size * sizeof(room->history[0]));
+		if (room->history == NULL)
+			abort();
+	}
+	struct chat_history_item *item;
+	if (room->history_count == size) {
+		/* The oldest is replaced. */
+		item = &room->history[room->history_head];
+		room->history_head = (room->history_head + 1) % size;
+		chat_packet_unref(item->text);
+		if (item->frame != NULL)
+			chat_packet_unref(item->frame);
+	} else {
+		item = &room->history[(room->history_head +
+				       room->history_count++) % size];
+	}
+	chat_packet_ref(text);
+	item->text = text;
+	if (frame != NULL)
+		chat_packet_ref(frame);
+	item->frame = frame;
+}
+
+/**
+ * Queue the room's history to the peer which has joined it. The
+ * newest which fit the budget, so the join itself never overflows.
+ */
+static void
+chat_reactor_send_history(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	struct chat_room *room = peer->room;
+	uint32_t size = reactor->server->history_size;
+	size_t budget = reactor->server->output_budget;
+	bool is_binary = peer->mode == CHAT_PEER_BINARY;
+	uint32_t first = room->history_count;
+	size_t total = peer->output.size;
+	while (first > 0) {
+		const struct chat_history_item *item =
+			&room->history[(room->history_head + first - 1) % size];
+		/* A frame is a bit bigger, but close enough. */
+		size_t item_size = item->text->size;
+		if (budget > 0 && total + item_size > budget)
+			break;
+		total += item_size;
+		--first;
+	}
+	for (uint32_t i = first; i < room->history_count; ++i) {
+		struct chat_history_item *item =
+			&room->history[(room->history_head + i) % size];
+		if (!is_binary) {
+			chat_reactor_queue(reactor, peer, item->text);
+			continue;
+		}
+		if (item->frame == NULL)
+			item->frame = chat_packet_new_text_frame(item->text);
+		chat_reactor_queue(reactor, peer, item->frame);
+	}
+}
+
+/**
+ * Queue the text packet to all the room's peers but the author. The
+ * binary peers share a frame of it, made on the first need. Both are
+ * kept in the room's history.
+ */
+static void
+chat_reactor_send_all(struct chat_reactor *reactor, struct chat_room *room,
+		      struct chat_peer *author, struct chat_packet *packet,
+		      uint64_t seq)
+{
+	size_t budget = reactor->server->output_budget;
+	struct chat_packet *frame = NULL;
+	struct chat_peer *peer, *tmp;
+	rlist_foreach_entry_safe(peer, &room->members, in_room, tmp) {
+		if (peer == author)
+			continue;
+		/* Takes it from the multicast group. */
+		if (peer->multicast_seq != 0 && seq >= peer->multicast_seq)
+			continue;
+		if (peer->mode != CHAT_PEER_BINARY) {
+			chat_reactor_queue(reactor, peer, packet);
+		} else {
+			if (frame == NULL)
+				frame = chat_packet_new_text_frame(packet);
+			chat_reactor_queue(reactor, peer, frame);
+		}
+		if (budget > 0 && peer->output.size > budget)
+			chat_reactor_overflow(reactor, peer);
+	}
+	chat_reactor_remember(reactor, room, packet, frame);
+	if (frame != NULL)
+		chat_packet_unref(frame);
+}
+
+/** Hand the broadcast over to the reactor's thread. */
+static void
+chat_reactor_post(struct chat_reactor *reactor, const struct chat_room *room,
+		  const struct chat_packet *packet, uint64_t seq)
+{
+	struct chat_post *post = malloc(sizeof(*post) + packet->size +
+					room->name_size);
+	if (post == NULL)
+		abort();
+	post->seq = seq;
+	post->data_size = packet->size;
+	post->room_size = room->name_size;
+	memcpy(post->data, packet->data, packet->size);
+	memcpy(post->data + packet->size, room->name, room->name_size);
+	struct chat_post *head = __atomic_load_n(&reactor->inbox,
+		__ATOMIC_RELAXED);
+	do {
+		post->next = head;
+	} while (!__atomic_compare_exchange_n(&reactor->inbox, &head, post,
+					      true, __ATOMIC_SEQ_CST,
+					      __ATOMIC_RELAXED));
+	/* The reactor is woken up once per batch. */
+	if (head == NULL)
+		chat_wake_signal(&reactor->wake);
+}
+
+/** Queue the broadcasts posted by the other reactors. */
+static void
+chat_reactor_take_inbox(struct chat_reactor *reactor)
+{
+	/* Cleared before, so a post after the take signals again. */
+	chat_wake_clear(&reactor->wake);
+	struct chat_post *post = __atomic_exchange_n(&reactor->inbox, NULL,
+						     __ATOMIC_SEQ_CST);
+	/* Reverse, to send them in the order of the posts. */
+	struct chat_post *taken = NULL;
+	while (post != NULL) {
+		struct chat_post *next = post->next;
+		post->next = taken;
+		taken = post;
+		post = next;
+	}
+	bool has_history = reactor->server->history_size > 0;
+	while (taken != NULL) {
+		struct chat_post *next = taken->next;
+		const char *name = taken->data + taken->data_size;
+		/* For the history, even the rooms without members here. */
+		struct chat_room *room = has_history ?
+			chat_reactor_room_take(reactor, name, taken->room_size) :
+			chat_reactor_room_get(reactor, name, taken->room_size);
+		if (room != NULL &&
+		    (has_history || !rlist_empty(&room->members))) {
+			struct chat_packet *packet = chat_packet_new(
+				taken->data, taken->data_size);
+			chat_reactor_send_all(reactor, room, NULL, packet,
+					      taken->seq);
+			chat_packet_unref(packet);
+		}
+		free(taken);
+		taken = next;
+	}
+}
+
+/**
+ * Send the lobby message to the group, once for all the peers taking
+ * it from there, and keep it for the resends.
+ *
+ * @return Its number.
+ */
+static uint64_t
+chat_multicast_send(struct chat_multicast *m, const struct chat_packet *packet)
+{
+	uint32_t size = CHAT_MULTICAST_HEADER_SIZE + packet->size;
+	struct chat_datagram *dgram = malloc(sizeof(*dgram) + size);
+	if (dgram == NULL)
+		abort();
+	dgram->size = size;
+	memcpy(dgram->data + CHAT_MULTICAST_HEADER_SIZE, packet->data,
+	       packet->size);
+	pthread_mutex_lock(&m->mutex);
+	uint64_t seq = m->next_seq++;
+	dgram->seq = seq;
+	for (int i = 0; i < CHAT_MULTICAST_HEADER_SIZE; ++i)
+		dgram->data[i] = (char)(seq >> (56 - 8 * i));
+	/* Too big for a datagram, just the number to ask for it. */
+	if (size > CHAT_MULTICAST_DATAGRAM_MAX)
+		size = CHAT_MULTICAST_HEADER_SIZE;
+	/* A lost one is a gap for the peers to NACK. */
+	sendto(m->socket, dgram->data, size, MSG_DONTWAIT,
+	       (struct sockaddr *)&m->group, sizeof(m->group));
+	struct chat_datagram **slot = &m->sent[seq % m->sent_size];
+	free(*slot);
+	*slot = dgram;
+	chat_stat_add(&m->sent_count, 1);
+	pthread_mutex_unlock(&m->mutex);
+	return seq;
+}
+
+/** The answer to a NACK, see CHAT_NACK_COMMAND. */
+static struct chat_packet *
+chat_multicast_resend(struct chat_multicast *m, uint64_t seq)
+{
+	char head[64];
+	pthread_mutex_lock(&m->mutex);
+	const struct chat_datagram *dgram = m->sent[seq % m->sent_size];
+	if (dgram == NULL || dgram->seq != seq) {
+		pthread_mutex_unlock(&m->mutex);
+		int len = snprintf(head, sizeof(head),
+				   CHAT_LOST_COMMAND " %" PRIu64 "\n", seq);
+		return chat_packet_new(head, len);
+	}
+	int len = snprintf(head, sizeof(head), CHAT_RESEND_COMMAND " %" PRIu64
+			   " ", seq);
+	uint32_t size = dgram->size - CHAT_MULTICAST_HEADER_SIZE;
+	char *data = malloc(len + size);
+	if (data == NULL)
+		abort();
+	memcpy(data, head, len);
+	memcpy(data + len, dgram->data + CHAT_MULTICAST_HEADER_SIZE, size);
+	chat_stat_add(&m->resent_count, 1);
+	pthread_mutex_unlock(&m->mutex);
+	struct chat_packet *packet = chat_packet_new(data, len + size);
+	free(data);
+	return packet;
+}
+
+/**
+ * Queue the message to all but the author in the author's room, as
+ * one shared packet, and a copy of it for each other reactor.
+ */
+static void
+chat_reactor_broadcast(struct chat_reactor *reactor, struct chat_peer *author,
+		       const char *data, size_t size)
+{
+	struct chat_packet *packet = chat_packet_new(data, size + 1);
+	/* The terminating zero becomes the delimiter. */
+	packet->data[size] = '\n';
+	struct chat_server *server = reactor->server;
+	uint64_t seq = 0;
+	if (server->multicast != NULL && author->room == reactor->lobby)
+		seq = chat_multicast_send(server->multicast, packet);
+	chat_reactor_send_all(reactor, author->room, author, packet, seq);
+	for (int i = 0; i < server->reactor_count; ++i) {
+		struct chat_reactor *other = &server->reactors[i];
+		if (other != reactor)
+			chat_reactor_post(other, author->room, packet, seq);
+	}
+	chat_packet_unref(packet);
+}
+
+/**
+ * Do the message if it is a command of the multicast, see
+ * CHAT_MULTICAST_COMMAND.
+ *
+ * @retval Whether it was one.
+ */
+static bool
+chat_reactor_multicast_command(struct chat_reactor *reactor,
+			       struct chat_peer *peer, const char *data,
+			       size_t size)
+{
+	struct chat_multicast *m = reactor->server->multicast;
+	if (m == NULL)
+		return false;
+	struct chat_packet *packet;
+	if (size == CHAT_MULTICAST_COMMAND_SIZE &&
+	    memcmp(data, CHAT_MULTICAST_COMMAND, size) == 0) {
+		/* The other rooms are never multicast. */
+		if (peer->room != reactor->lobby)
+			return true;
+		pthread_mutex_lock(&m->mutex);
+		peer->multicast_seq = m->next_seq;
+		pthread_mutex_unlock(&m->mutex);
+		char group[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &m->group.sin_addr, group, sizeof(group));
+		char answer[128];
+		int len = snprintf(answer, sizeof(answer),
+				   CHAT_MULTICAST_COMMAND " %s:%u %" PRIu64 "\n",
+				   group, ntohs(m->group.sin_port),
+				   peer->multicast_seq);
+		packet = chat_packet_new(answer, len);
+	} else if (size > CHAT_NACK_COMMAND_SIZE + 1 &&
+		   memcmp(data, CHAT_NACK_COMMAND " ",
+			  CHAT_NACK_COMMAND_SIZE + 1) == 0) {
+		uint64_t seq = 0;
+		for (size_t i = CHAT_NACK_COMMAND_SIZE + 1; i < size; ++i) {
+			if (data[i] < '0' || data[i] > '9')
+				return false;
+			seq = seq * 10 + (data[i] - '0');
+		}
+		packet = chat_multicast_resend(m, seq);
+	} else {
+		return false;
+	}
+	if (peer->mode == CHAT_PEER_BINARY) {
+		struct chat_packet *frame = chat_packet_new_text_frame(packet);
+		chat_packet_unref(packet);
+		packet = frame;
+	}
+	chat_reactor_queue(reactor, peer, packet);
+	chat_packet_unref(packet);
+	return true;
+}
+
+/**
+ * Do the message if it is a command.
+ *
+ * @retval Whether it was one.
+ */
+static bool
+chat_reactor_command(struct chat_reactor *reactor, struct chat_peer *peer,
+		     const char *data, size_t size)
+{
+	if (chat_reactor_multicast_command(reactor, peer, data, size))
+		return true;
+	if (size < CHAT_JOIN_COMMAND_SIZE ||
+	    memcmp(data, CHAT_JOIN_COMMAND, CHAT_JOIN_COMMAND_SIZE) != 0)
+		return false;
+	const char *name = data + CHAT_JOIN_COMMAND_SIZE;
+	size_t name_size = size - CHAT_JOIN_COMMAND_SIZE;
+	if (name_size > 0) {
+		/* "/joined" is a message, not a join. */
+		if (*name != ' ')
+			return false;
+		++name;
+		--name_size;
+	}
+	if (name_size <= CHAT_ROOM_NAME_MAX) {
+		chat_reactor_join_room(reactor, peer,
+			chat_reactor_room_take(reactor, name, name_size));
+		chat_reactor_send_history(reactor, peer);
+	}
+	return true;
+}
+
+/** Give the message to the server's user. */
+static void
+chat_reactor_deliver(struct chat_reactor *reactor, struct chat_message *msg)
+{
+	struct chat_server *server = reactor->server;
+	if (server->thread_count == 0) {
+		chat_message_queue_push(&server->messages, msg);
+		return;
+	}
+	struct chat_message *head = __atomic_load_n(&server->incoming,
+		__ATOMIC_RELAXED);
+	do {
+		msg->next = head;
+	} while (!__atomic_compare_exchange_n(&server->incoming, &head, msg,
+					      true, __ATOMIC_SEQ_CST,
+					      __ATOMIC_RELAXED));
+	if (head == NULL)
+		chat_wake_signal(&server->incoming_wake);
+}
+
+static struct chat_peer *
+chat_reactor_add_peer(struct chat_reactor *reactor, int fd)
+{
+	struct chat_peer *peer = malloc(sizeof(*peer));
+	if (peer == NULL)
+		abort();
+	peer->socket = fd;
+	peer->mode = CHAT_PEER_NEW;
+	chat_input_create(&peer->input);
+	chat_packet_queue_create(&peer->output);
+	peer->is_writable = true;
+	peer->is_backpressured = false;
+	peer->is_receiving = false;
+	peer->send = NULL;
+	peer->request_count = 0;
+	rlist_create(&peer->in_flush);
+	rlist_add_tail_entry(&reactor->peers, peer, in_peers);
+	peer->room = NULL;
+	peer->multicast_seq = 0;
+	peer->is_handshaking = chat_server_is_tls(reactor->server);
+#if CHAT_USE_TLS
+	peer->ssl = NULL;
+	if (peer->is_handshaking) {
+		/* Enters the lobby after the handshake. */
+		peer->ssl = SSL_new(reactor->server->tls);
+		if (peer->ssl == NULL || SSL_set_fd(peer->ssl, fd) != 1)
+			abort();
+		SSL_set_accept_state(peer->ssl);
+		return peer;
+	}
+#endif
+	chat_reactor_join_room(reactor, peer, reactor->lobby);
+	chat_reactor_send_history(reactor, peer);
+	return peer;
+}
+
+static void
+chat_reactor_accept(struct chat_reactor *reactor)
+{
+	while (true) {
+#if defined(SOCK_NONBLOCK) && !defined(SO_NOSIGPIPE)
+		/* All the setup there is, without a call per peer. */
+		int fd = accept4(reactor->socket, NULL, NULL,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+		int fd = accept(reactor->socket, NULL, NULL);
+#endif
+		if (fd < 0) {
+			/*
+			 * EAGAIN is the end of the edge. On any other error
+			 * the rest waits for the next connect.
+			 */
+			return;
+		}
+#if !defined(SOCK_NONBLOCK) || defined(SO_NOSIGPIPE)
+		chat_socket_setup(fd);
+#endif
+		struct chat_peer *peer = chat_reactor_add_peer(reactor, fd);
+		chat_reactor_poll_add(reactor, fd, peer, true);
+	}
+}
+
+/**
+ * Take the messages out of the peer's input. Then close it, if the
+ * receive has failed or has got the end.
+ */
+static void
+chat_reactor_parse(struct chat_reactor *reactor, struct chat_peer *peer,
+		   int rc)
+{
+	if (peer->mode == CHAT_PEER_NEW) {
+		bool is_framed;
+		switch (chat_input_take_hello(&peer->input, &is_framed)) {
+		case 0:
+			break;
+		case 1:
+			goto end;
+		default:
+			chat_reactor_close_peer(reactor, peer);
+			return;
+		}
+		if (!is_framed) {
+			peer->mode = CHAT_PEER_TEXT;
+		} else {
+			peer->mode = CHAT_PEER_BINARY;
+			/* Confirmed after the text sent to it so far. */
+			struct chat_packet *ack = chat_packet_new(
+				CHAT_FRAME_HELLO, CHAT_FRAME_HELLO_SIZE);
+			chat_reactor_queue(reactor, peer, ack);
+			chat_packet_unref(ack);
+		}
+	}
+	/* What has come before a close is still delivered. */
+	struct chat_message *msg;
+	if (peer->mode == CHAT_PEER_TEXT) {
+		while ((msg = chat_input_next(&peer->input,
+					      reactor->message_pool)) != NULL) {
+			size_t size = strlen(msg->data);
+			if (chat_reactor_command(reactor, peer, msg->data,
+						 size)) {
+				chat_message_delete(msg);
+				continue;
+			}
+			chat_reactor_broadcast(reactor, peer, msg->data, size);
+			chat_reactor_deliver(reactor, msg);
+		}
+	} else {
+		uint32_t size;
+		while (chat_input_next_frame(&peer->input,
+					     reactor->message_pool, &msg,
+					     &size) == 0) {
+			if (msg == NULL)
+				goto end;
+			/* Like the empty lines. */
+			if (size == 0 || chat_reactor_command(reactor, peer,
+							     msg->data, size)) {
+				chat_message_delete(msg);
+				continue;
+			}
+			chat_reactor_broadcast(reactor, peer, msg->data, size);
+			chat_reactor_deliver(reactor, msg);
+		}
+		rc = -1;
+	}
+end:
+	if (rc != 0)
+		chat_reactor_close_peer(reactor, peer);
+}
+
+#if CHAT_USE_TLS
+
+/** Like chat_input_recv(), but decrypted in user space. */
+static int
+chat_peer_tls_recv(struct chat_peer *peer)
+{
+	char buf[CHAT_TLS_READ_SIZE];
+	while (true) {
+		int rc = SSL_read(peer->ssl, buf, sizeof(buf));
+		if (rc > 0) {
+			chat_input_append(&peer->input, buf, rc);
+			continue;
+		}
+		int err = SSL_get_error(peer->ssl, rc);
+		ERR_clear_error();
+		return err == SSL_ERROR_WANT_READ ||
+		       err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+	}
+}
+
+#endif /* CHAT_USE_TLS */
+
+static void
+chat_reactor_read(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	TRACE_BEGIN("chat_read", peer->socket);
+	int rc;
+#if CHAT_USE_TLS
+	if (peer->ssl != NULL)
+		rc = chat_peer_tls_recv(peer);
+	else
+#endif
+		rc = chat_input_recv(&peer->input, peer->socket);
+	chat_reactor_parse(reactor, peer, rc);
+	TRACE_END("chat_read");
+}
+
+#if CHAT_USE_TLS
+
+/**
+ * Go on with the peer's handshake, on any event of it. When done,
+ * the peer enters the lobby. The output is never encrypted in user
+ * space, so a peer the kernel can not send for is closed. The input
+ * is decrypted by the SSL object if the kernel does not do that.
+ */
+static void
+chat_reactor_handshake(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	int rc = SSL_do_handshake(peer->ssl);
+	if (rc != 1) {
+		int err = SSL_get_error(peer->ssl, rc);
+		ERR_clear_error();
+		if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+			chat_reactor_close_peer(reactor, peer);
+		return;
+	}
+	if (!BIO_get_ktls_send(SSL_get_wbio(peer->ssl))) {
+		chat_reactor_close_peer(reactor, peer);
+		return;
+	}
+	if (BIO_get_ktls_recv(SSL_get_rbio(peer->ssl))) {
+		/* The socket's own now. Nothing is read ahead by it. */
+		SSL_free(peer->ssl);
+		peer->ssl = NULL;
+	}
+	peer->is_handshaking = false;
+	chat_reactor_join_room(reactor, peer, reactor->lobby);
+	chat_reactor_send_history(reactor, peer);
+	/* The input could have come right after the handshake. */
+	chat_reactor_read(reactor, peer);
+}
+
+#endif /* CHAT_USE_TLS */
+
+static bool
+chat_reactor_is_throttled(const struct chat_reactor *reactor,
+			  const struct chat_peer *peer)
+{
+	return peer->is_backpressured &&
+	       reactor->server->output_policy == CHAT_OUTPUT_THROTTLE;
+}
+
+#if CHAT_USE_IO_URING
+
+/**
+ * What a completion is of. In the low bits of its data, the peers
+ * and the reactors are aligned.
+ */
+enum chat_uring_op {
+	CHAT_URING_ACCEPT,
+	CHAT_URING_WAKE,
+	CHAT_URING_RECV,
+	CHAT_URING_SEND,
+	/** The cancels, nothing to do on them. */
+	CHAT_URING_CANCEL,
+	CHAT_URING_OP_MASK = 7,
+};
+
+static inline uint64_t
+chat_uring_data(void *ptr, int op)
+{
+	return (uint64_t)(uintptr_t)ptr | op;
+}
+
+/** Multishot, so till an error or the end. */
+static void
+chat_reactor_uring_recv(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	chat_uring_prep_recv(reactor->uring, peer->socket,
+			     chat_uring_data(peer, CHAT_URING_RECV));
+	peer->is_receiving = true;
+	++peer->request_count;
+	++reactor->request_count;
+}
+
+#endif /* CHAT_USE_IO_URING */
+
+/** Read the peer again, after a throttle. */
+static void
+chat_reactor_resume(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	if (reactor->uring == NULL) {
+		/* Could have got its input edge while it was not read. */
+		chat_reactor_read(reactor, peer);
+		return;
+	}
+#if CHAT_USE_IO_URING
+	/* The input got before the cancel of the receive. */
+	chat_reactor_parse(reactor, peer, 0);
+	if (peer->socket >= 0 && !peer->is_receiving)
+		chat_reactor_uring_recv(reactor, peer);
+#endif
+}
+
+/** All the output is sent. */
+static void
+chat_reactor_output_sent(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	--reactor->output_peer_count;
+	if (!peer->is_backpressured)
+		return;
+	peer->is_backpressured = false;
+	chat_stat_add(&reactor->backpressure_peer_count, -1);
+	/* Its new output is flushed by the same update. */
+	if (reactor->server->output_policy == CHAT_OUTPUT_THROTTLE)
+		chat_reactor_resume(reactor, peer);
+}
+
+/** Send the new output to the peers, which are writable. */
+static void
+chat_reactor_flush(struct chat_reactor *reactor)
+{
+	while (!rlist_empty(&reactor->flush_peers)) {
+		struct chat_peer *peer = rlist_shift_entry(
+			&reactor->flush_peers, struct chat_peer, in_flush);
+		if (!peer->is_writable)
+			continue;
+		TRACE_BEGIN("chat_write", peer->socket);
+		int rc = chat_packet_queue_send(&peer->output, peer->socket,
+						&reactor->send_stats);
+		TRACE_END("chat_write");
+		if (rc != 0) {
+			chat_reactor_close_peer(reactor, peer);
+			continue;
+		}
+		if (!chat_packet_queue_is_empty(&peer->output)) {
+			peer->is_writable = false;
+			continue;
+		}
+		chat_reactor_output_sent(reactor, peer);
+	}
+}
+
+#if CHAT_USE_IO_URING
+
+static void
+chat_reactor_uring_accept(struct chat_reactor *reactor)
+{
+	chat_uring_prep_accept(reactor->uring, reactor->socket,
+			       chat_uring_data(NULL, CHAT_URING_ACCEPT));
+	++reactor->request_count;
+}
+
+static void
+chat_reactor_uring_wake(struct chat_reactor *reactor)
+{
+	chat_uring_prep_poll(reactor->uring, reactor->wake.read_fd,
+			     chat_uring_data(reactor, CHAT_URING_WAKE));
+	++reactor->request_count;
+}
+
+/**
+ * Send the new output of the peers, which have no send in flight.
+ * The ones with it are sent to at its completion.
+ */
+static void
+chat_reactor_uring_flush(struct chat_reactor *reactor)
+{
+	while (!rlist_empty(&reactor->flush_peers)) {
+		struct chat_peer *peer = rlist_shift_entry(
+			&reactor->flush_peers, struct chat_peer, in_flush);
+		struct chat_packet_queue *queue = &peer->output;
+		if (queue->in_flight > 0 || chat_packet_queue_is_empty(queue))
+			continue;
+		uint32_t count = queue->count;
+		if (count > CHAT_URING_SEND_BATCH)
+			count = CHAT_URING_SEND_BATCH;
+		struct chat_peer_send *send = peer->send;
+		if (send == NULL || send->capacity < count) {
+			uint32_t capacity = send == NULL ? 4 : send->capacity;
+			while (capacity < count)
+				capacity *= 2;
+			/* Not in flight, so free to move. */
+			send = realloc(send, sizeof(*send) +
+				       capacity * sizeof(send->iov[0]));
+			if (send == NULL)
+				abort();
+			send->capacity = capacity;
+			peer->send = send;
+		}
+		count = chat_packet_queue_iov(queue, send->iov, count);
+		memset(&send->msg, 0, sizeof(send->msg));
+		send->msg.msg_iov = send->iov;
+		send->msg.msg_iovlen = count;
+		/* The rest follows right at the completion. */
+		int flags = MSG_NOSIGNAL;
+		if (count < queue->count)
+			flags |= MSG_MORE;
+		chat_uring_prep_sendmsg(reactor->uring, peer->socket,
+					&send->msg, flags,
+					chat_uring_data(peer, CHAT_URING_SEND));
+		queue->in_flight = count;
+		++peer->request_count;
+		++reactor->request_count;
+		struct chat_send_stats *stats = &reactor->send_stats;
+		__atomic_store_n(&stats->call_count, stats->call_count + 1,
+				 __ATOMIC_RELAXED);
+	}
+}
+
+static void
+chat_reactor_uring_on_recv(struct chat_reactor *reactor,
+			   struct chat_peer *peer,
+			   const struct io_uring_cqe *cqe)
+{
+	struct chat_uring *ring = reactor->uring;
+	TRACE_INSTANT("chat_recv", cqe->res);
+	if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+		peer->is_receiving = false;
+	if ((cqe->flags & IORING_CQE_F_BUFFER) != 0) {
+		uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (peer->socket >= 0 && cqe->res > 0) {
+			chat_input_append(&peer->input,
+					  chat_uring_buf(ring, id), cqe->res);
+		}
+		chat_uring_buf_return(ring, id);
+	}
+	if (peer->socket < 0)
+		return;
+	if (cqe->res > 0) {
+		/* Kept in the input, till the output is sent. */
+		if (chat_reactor_is_throttled(reactor, peer)) {
+			if (peer->is_receiving) {
+				chat_uring_prep_cancel(ring,
+					chat_uring_data(peer, CHAT_URING_RECV),
+					chat_uring_data(NULL,
+							CHAT_URING_CANCEL));
+			}
+			return;
+		}
+		chat_reactor_parse(reactor, peer, 0);
+	} else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+		/* The end, or an error. */
+		chat_reactor_parse(reactor, peer, -1);
+		return;
+	}
+	/* Out of the buffers, or has stopped for some other reason. */
+	if (peer->socket >= 0 && !peer->is_receiving &&
+	    !chat_reactor_is_throttled(reactor, peer))
+		chat_reactor_uring_recv(reactor, peer);
+}
+
+static void
+chat_reactor_uring_on_send(struct chat_reactor *reactor,
+			   struct chat_peer *peer,
+			   const struct io_uring_cqe *cqe)
+{
+	struct chat_packet_queue *queue = &peer->output;
+	TRACE_INSTANT("chat_sent", cqe->res);
+	queue->in_flight = 0;
+	if (peer->socket < 0)
+		return;
+	if (cqe->res < 0) {
+		if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+			chat_reactor_flush_later(reactor, peer);
+			return;
+		}
+		chat_reactor_close_peer(reactor, peer);
+		return;
+	}
+	chat_packet_queue_advance(queue, cqe->res, &reactor->send_stats);
+	if (!chat_packet_queue_is_empty(queue))
+		chat_reactor_flush_later(reactor, peer);
+	else
+		chat_reactor_output_sent(reactor, peer);
+}
+
+static void
+chat_reactor_uring_complete(struct chat_reactor *reactor,
+			    const struct io_uring_cqe *cqe, bool *is_woken)
+{
+	int op = cqe->user_data & CHAT_URING_OP_MASK;
+	void *ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)
+					CHAT_URING_OP_MASK);
+	bool is_done = (cqe->flags & IORING_CQE_F_MORE) == 0;
+	if (op == CHAT_URING_CANCEL)
+		return;
+	if (is_done)
+		--reactor->request_count;
+	struct chat_peer *peer = ptr;
+	switch (op) {
+	case CHAT_URING_ACCEPT:
+		if (cqe->res >= 0) {
+			if (reactor->is_closing) {
+				close(cqe->res);
+			} else {
+				peer = chat_reactor_add_peer(reactor,
+							     cqe->res);
+				chat_reactor_uring_recv(reactor, peer);
+			}
+		}
+		if (is_done && !reactor->is_closing)
+			chat_reactor_uring_accept(reactor);
+		break;
+	case CHAT_URING_WAKE:
+		*is_woken = true;
+		if (is_done && !reactor->is_closing)
+			chat_reactor_uring_wake(reactor);
+		break;
+	case CHAT_URING_RECV:
+		if (is_done)
+			--peer->request_count;
+		chat_reactor_uring_on_recv(reactor, peer, cqe);
+		break;
+	case CHAT_URING_SEND:
+		--peer->request_count;
+		chat_reactor_uring_on_send(reactor, peer, cqe);
+		break;
+	}
+}
+
+/** Like the poll one, but on the completions. */
+static int
+chat_reactor_uring_update(struct chat_reactor *reactor, double timeout)
+{
+	struct chat_uring *ring = reactor->uring;
+	/* The last update has submitted all. */
+	if (chat_uring_peek(ring) == NULL &&
+	    chat_uring_enter(ring, timeout) != 0) {
+		if (errno == EINTR)
+			return CHAT_ERR_TIMEOUT;
+		return CHAT_ERR_SYS;
+	}
+	bool is_woken = false;
+	int count = 0;
+	struct io_uring_cqe *cqe;
+	while ((cqe = chat_uring_peek(ring)) != NULL) {
+		/* A copy, the handling can fill the ring more. */
+		struct io_uring_cqe copy = *cqe;
+		chat_uring_advance(ring);
+		chat_reactor_uring_complete(reactor, &copy, &is_woken);
+		++count;
+	}
+	if (count == 0)
+		return CHAT_ERR_TIMEOUT;
+	if (is_woken)
+		chat_reactor_take_inbox(reactor);
+	chat_reactor_uring_flush(reactor);
+	chat_reactor_free_closed(reactor);
+	/* Submitted now, not to wait for them with the next update. */
+	if (chat_uring_flush(ring) != 0 && errno != EINTR)
+		return CHAT_ERR_SYS;
+	return 0;
+}
+
+/**
+ * Wait for the requests in flight, with all the peers closed. So
+ * the kernel is done with their memory.
+ */
+static void
+chat_reactor_uring_drain(struct chat_reactor *reactor)
+{
+	struct chat_uring *ring = reactor->uring;
+	reactor->is_closing = true;
+	uint64_t cancel = chat_uring_data(NULL, CHAT_URING_CANCEL);
+	chat_uring_prep_cancel(ring, chat_uring_data(NULL, CHAT_URING_ACCEPT),
+			       cancel);
+	if (reactor->server->thread_count > 0) {
+		uint64_t wake = chat_uring_data(reactor, CHAT_URING_WAKE);
+		chat_uring_prep_cancel(ring, wake, cancel);
+	}
+	/* Each takes a moment, but still a limit for a stuck one. */
+	for (int i = 0; i < 1000 && reactor->request_count > 0; ++i) {
+		if (chat_uring_enter(ring, 0.01) != 0 && errno != EINTR)
+			break;
+		bool is_woken;
+		struct io_uring_cqe *cqe;
+		while ((cqe = chat_uring_peek(ring)) != NULL) {
+			struct io_uring_cqe copy = *cqe;
+			chat_uring_advance(ring);
+			chat_reactor_uring_complete(reactor, &copy, &is_woken);
+		}
+	}
+	/* The rest are cancelled by the close of the ring. */
+	chat_uring_destroy(ring);
+	free(ring);
+	reactor->uring = NULL;
+	struct chat_peer *peer;
+	rlist_foreach_entry(peer, &reactor->closed_peers, in_peers)
+		peer->request_count = 0;
+}
+
+#endif /* CHAT_USE_IO_URING */
+
+static int
+chat_reactor_update(struct chat_reactor *reactor, double timeout)
+{
+#if CHAT_USE_IO_URING
+	if (reactor->uring != NULL)
+		return chat_reactor_uring_update(reactor, timeout);
+#endif
+	int count = chat_reactor_poll_wait(reactor, timeout);
+	if (count < 0)
+		return errno == EINTR ? CHAT_ERR_TIMEOUT : CHAT_ERR_SYS;
+	if (count == 0)
+		return CHAT_ERR_TIMEOUT;
+	bool is_woken = false;
+	for (int i = 0; i < count; ++i) {
+		bool is_input, is_output;
+		void *ptr = chat_reactor_event(reactor, i, &is_input,
+					       &is_output);
+		if (ptr == NULL) {
+			chat_reactor_accept(reactor);
+			continue;
+		}
+		if (ptr == reactor) {
+			is_woken = true;
+			continue;
+		}
+		struct chat_peer *peer = ptr;
+		if (peer->socket < 0)
+			continue;
+#if CHAT_USE_TLS
+		if (peer->is_handshaking) {
+			chat_reactor_handshake(reactor, peer);
+			continue;
+		}
+#endif
+		if (is_output) {
+			peer->is_writable = true;
+			if (!chat_packet_queue_is_empty(&peer->output))
+				chat_reactor_flush_later(reactor, peer);
+		}
+		if (is_input && !chat_reactor_is_throttled(reactor, peer))
+			chat_reactor_read(reactor, peer);
+	}
+	/*
+	 * After the accepts of the batch. So the clients connected
+	 * before a message was read from another reactor's peer get it
+	 * too, like with one reactor.
+	 */
+	if (is_woken)
+		chat_reactor_take_inbox(reactor);
+	chat_reactor_flush(reactor);
+	chat_reactor_free_closed(reactor);
+	return 0;
+}
+
+static void *
+chat_reactor_f(void *arg)
+{
+	struct chat_reactor *reactor = arg;
+	struct chat_server *server = reactor->server;
+	/* Owned by the thread taking from it. */
+	reactor->message_pool = chat_message_pool_new();
+	while (!__atomic_load_n(&server->is_stopped, __ATOMIC_SEQ_CST))
+		chat_reactor_update(reactor, -1);
+	chat_message_pool_delete(reactor->message_pool);
 	return NULL;
 }
 
+/**
+ * Move the messages of the reactor threads to the queue to pop.
+ *
+ * @retval Whether there were any.
+ */
+static bool
+chat_server_take_incoming(struct chat_server *server)
+{
+	chat_wake_clear(&server->incoming_wake);
+	struct chat_message *msg = __atomic_exchange_n(&server->incoming,
+		NULL, __ATOMIC_SEQ_CST);
+	if (msg == NULL)
+		return false;
+	/* Reverse, to pop them in the order of the receipt. */
+	struct chat_message *taken = NULL;
+	while (msg != NULL) {
+		struct chat_message *next = msg->next;
+		msg->next = taken;
+		taken = msg;
+		msg = next;
+	}
+	while (taken != NULL) {
+		struct chat_message *next = taken->next;
+		chat_message_queue_push(&server->messages, taken);
+		taken = next;
+	}
+	return true;
+}
+
 int
 chat_server_update(struct chat_server *server, double timeout)
 {
-	/*
-	 * 1) Wait on epoll/kqueue/poll for update on any socket.
-	 * 2) Handle the update.
-	 * 2.1) If the update was on listen-socket, then you probably need to
-	 *     call accept() on it - a new client wants to join.
-	 * 2.2) If the update was on a client-socket, then you might want to
-	 *     read/write on it.
-	 */
-	(void)server;
-	(void)timeout;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (server->reactor_count == 0)
+		return CHAT_ERR_NOT_STARTED;
+	if (server->thread_count == 0)
+		return chat_reactor_update(&server->reactors[0], timeout);
+	/* The threads do all the rest. */
+	if (chat_server_take_incoming(server))
+		return 0;
+	struct pollfd pfd;
+	pfd.fd = server->incoming_wake.read_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	int ms = -1;
+	if (timeout >= 0) {
+		double value = timeout * 1000;
+		ms = value >= INT32_MAX ? INT32_MAX : (int)value;
+		if (ms < value)
+			++ms;
+	}
+	int rc = poll(&pfd, 1, ms);
+	if (rc < 0)
+		return errno == EINTR ? CHAT_ERR_TIMEOUT : CHAT_ERR_SYS;
+	if (rc == 0 || !chat_server_take_incoming(server))
+		return CHAT_ERR_TIMEOUT;
+	return 0;
 }
 
 int
 chat_server_get_descriptor(const struct chat_server *server)
 {
-#if NEED_SERVER_FEED
-	/* IMPLEMENT THIS FUNCTION if want +5 points. */
-
+	if (server->reactor_count == 0)
+		return -1;
 	/*
-	 * Server has multiple sockets - own and from connected clients. Hence
-	 * you can't return a socket here. But if you are using epoll/kqueue,
-	 * then you can return their descriptor. These descriptors can be polled
-	 * just like sockets and will return an event when any of their owned
-	 * descriptors has any events.
-	 *
-	 * For example, assume you created an epoll descriptor and added to
-	 * there a listen-socket and a few client-sockets. Now if you will call
-	 * poll() on the epoll's descriptor, then on return from poll() you can
-	 * be sure epoll_wait() can return something useful for some of those
-	 * sockets.
+	 * The epoll or kqueue descriptor is readable when there are
+	 * events on any of the sockets, and the ring when there are
+	 * completions. With the threads only the received messages are
+	 * left to wait for.
 	 */
+	if (server->thread_count == 0) {
+		const struct chat_reactor *reactor = &server->reactors[0];
+#if CHAT_USE_IO_URING
+		if (reactor->uring != NULL)
+			return reactor->uring->fd;
 #endif
-	(void)server;
-	return -1;
+		return reactor->poll_fd;
+	}
+	return server->incoming_wake.read_fd;
 }
 
 int
 chat_server_get_socket(const struct chat_server *server)
 {
-	return server->socket;
+	if (server->reactor_count == 0)
+		return -1;
+	return server->reactors[0].socket;
 }
 
 int
 chat_server_get_events(const struct chat_server *server)
 {
-	/*
-	 * IMPLEMENT THIS FUNCTION - add OUTPUT event if has non-empty output
-	 * buffer in any of the client-sockets.
-	 */
-	(void)server;
-	return CHAT_EVENT_INPUT;
+	if (server->reactor_count == 0)
+		return 0;
+	int events = CHAT_EVENT_INPUT;
+	/* The ring's sends are done by the kernel, no need to wait. */
+	if (server->thread_count == 0 && server->reactors[0].uring == NULL &&
+	    server->reactors[0].output_peer_count > 0)
+		events |= CHAT_EVENT_OUTPUT;
+	return events;
 }
 
 int
@@ -141,3 +2368,32 @@ chat_server_feed(struct chat_server *server, const char *msg, uint32_t msg_size)
 	(void)msg_size;
 	return CHAT_ERR_NOT_IMPLEMENTED;
 }
+
+void
+chat_server_get_stats(const struct chat_server *server,
+		      struct chat_server_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i < server->reactor_count; ++i) {
+		const struct chat_send_stats *s =
+			&server->reactors[i].send_stats;
+		stats->send_count += __atomic_load_n(&s->call_count,
+						     __ATOMIC_RELAXED);
+		stats->sent_message_count += __atomic_load_n(&s->packet_count,
+							     __ATOMIC_RELAXED);
+		const struct chat_reactor *r = &server->reactors[i];
+		stats->backpressure_peer_count += __atomic_load_n(
+			&r->backpressure_peer_count, __ATOMIC_RELAXED);
+		stats->dropped_message_count += __atomic_load_n(
+			&r->dropped_message_count, __ATOMIC_RELAXED);
+		stats->dropped_peer_count += __atomic_load_n(
+			&r->dropped_peer_count, __ATOMIC_RELAXED);
+	}
+	const struct chat_multicast *m = server->multicast;
+	if (m != NULL) {
+		stats->multicast_message_count = __atomic_load_n(
+			&m->sent_count, __ATOMIC_RELAXED);
+		stats->resent_message_count = __atomic_load_n(
+			&m->resent_count, __ATOMIC_RELAXED);
+	}
+}
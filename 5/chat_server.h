@@ -1,9 +1,100 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct chat_server;
 
+/** Counters since the server's creation. */
+struct chat_server_stats {
+	/** Send calls to the peers' sockets. */
+	uint64_t send_count;
+	/** Messages sent out to the peers, each receiver counted. */
+	uint64_t sent_message_count;
+	/**
+	 * Peers, which have exceeded the output budget and have not
+	 * sent out all the output since then. Not a total, but now.
+	 */
+	uint64_t backpressure_peer_count;
+	/** Messages dropped from the outputs over the budget. */
+	uint64_t dropped_message_count;
+	/** Peers disconnected for the outputs over the budget. */
+	uint64_t dropped_peer_count;
+	/** Lobby messages sent to the multicast group, each once. */
+	uint64_t multicast_message_count;
+	/** Messages sent again for the NACKs of the multicast peers. */
+	uint64_t resent_message_count;
+};
+
+/** What to do with a peer, which output has exceeded the budget. */
+enum chat_output_policy {
+	/** Drop its oldest messages, not sent in part yet. */
+	CHAT_OUTPUT_DROP_OLDEST,
+	/** Close the peer. */
+	CHAT_OUTPUT_DISCONNECT,
+	/**
+	 * Stop reading from the peer till all its output is sent. For
+	 * the clients flooding the chat while not reading it. Its
+	 * output still grows by the others' messages.
+	 */
+	CHAT_OUTPUT_THROTTLE,
+};
+
+/** How the server waits for and does the socket IO. */
+enum chat_server_backend {
+	/** Io_uring where the kernel has it, the poll one otherwise. */
+	CHAT_BACKEND_AUTO,
+	/** Epoll on Linux, kqueue on the BSDs and macOS. */
+	CHAT_BACKEND_POLL,
+	/**
+	 * Io_uring, Linux 6.0 and newer. Multishot accepts and
+	 * receives into the buffers picked by the kernel, and async
+	 * sends, so a busy lobby needs no send and receive calls.
+	 */
+	CHAT_BACKEND_IO_URING,
+};
+
+/**
+ * Options of the TCP sockets of the server, all off by default. Set
+ * on the listening socket before the listen, and the accepted peers
+ * inherit them, so they cost no calls per peer.
+ */
+struct chat_server_tcp_options {
+	/**
+	 * TCP_NODELAY. Send the small messages right away, not waiting
+	 * for the ACKs of the previous ones. For the latency.
+	 */
+	bool no_delay;
+	/** SO_SNDBUF of the peers in bytes, 0 for the system's default. */
+	int send_buffer_size;
+	/** SO_RCVBUF of the peers in bytes, 0 for the system's default. */
+	int receive_buffer_size;
+	/**
+	 * TCP_DEFER_ACCEPT in seconds, 0 for none. A client is accepted
+	 * by its first data, not by its connect. So the ones which only
+	 * listen are accepted late, after the timeout.
+	 */
+	int defer_accept_timeout;
+	/**
+	 * SO_BUSY_POLL in microseconds, 0 for none. How long a receive
+	 * spins on the device queue before sleeping. Linux allows it
+	 * only with CAP_NET_ADMIN.
+	 */
+	int busy_poll_timeout;
+};
+
+/** Multicast of the lobby, see CHAT_MULTICAST_COMMAND. */
+struct chat_server_multicast_options {
+	/** IPv4 group, like "239.255.0.1". */
+	const char *group;
+	uint16_t port;
+	/** Address of the interface to send from, NULL for the default. */
+	const char *interface_addr;
+	/** Last messages kept for the resends, 0 for the default. */
+	uint32_t resend_count;
+};
+
 /**
  * Create a new chat server. No bind, no listen, just allocate and
  * initialize it.
@@ -15,6 +106,153 @@ chat_server_new(void);
 void
 chat_server_delete(struct chat_server *server);
 
+/**
+ * Serve the clients from the given number of threads, 0 by default.
+ * Then each thread has its own socket listening on the same port,
+ * with SO_REUSEPORT, and serves the clients accepted by it. The
+ * updates only take the messages received by the threads, so the
+ * server's descriptor is readable when there are such.
+ *
+ * @param server Chat server.
+ * @param count Thread count, 0 to serve in the updates.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the count is negative.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - no SO_REUSEPORT on this system.
+ */
+int
+chat_server_set_thread_count(struct chat_server *server, int count);
+
+/**
+ * Limit the bytes queued to be sent to one peer, so one stuck
+ * client can not make the server hold all the chat for it. No limit
+ * by default.
+ *
+ * @param server Chat server.
+ * @param size Budget of the output bytes per peer, 0 for no limit.
+ * @param policy What to do when a peer is over the budget.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - no such policy.
+ */
+int
+chat_server_set_output_budget(struct chat_server *server, size_t size,
+			      enum chat_output_policy policy);
+
+/**
+ * Keep the last messages of each room, and queue them to each peer
+ * joining it, before the new ones. So a client gets the recent chat
+ * of the lobby right at the connect, and of a room at the join. The
+ * kept messages are the same shared packets as the broadcasts, and
+ * go out by the same batched sends, so none are copied. Only the
+ * newest ones that fit the output budget are queued. None are kept
+ * by default.
+ *
+ * A room with kept messages is never freed, even when nobody is in
+ * it, so each reactor keeps them for all the rooms ever used.
+ *
+ * @param server Chat server.
+ * @param count Messages kept per room, 0 for none.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_history_size(struct chat_server *server, uint32_t count);
+
+/**
+ * Serve the clients over TLS. The handshake is done in user space,
+ * then the kernel (kTLS) takes over the records, so the broadcasts
+ * stay shared by all the peers and go out by the same batched sends
+ * as the plain text. A peer the kernel can not encrypt for is closed
+ * right after the handshake. The reactors use the poll backend, the
+ * handshake needs the readiness events. The clients talk text or
+ * framing inside TLS, like without it, so `openssl s_client` works
+ * as one.
+ *
+ * @param server Chat server.
+ * @param cert_file PEM file with the certificate chain.
+ * @param key_file PEM file with the private key.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - can not load the certificate or
+ *       the key, or they do not match.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - built without CHAT_USE_TLS.
+ */
+int
+chat_server_set_tls(struct chat_server *server, const char *cert_file,
+		    const char *key_file);
+
+/**
+ * Relay the lobby to a multicast group. Each lobby message is sent
+ * to the group once, numbered, and the peers which have asked for it
+ * take the lobby from there instead of their TCP connections. So the
+ * cost of a message does not grow with such peers, for the LAN game
+ * lobbies of hundreds of peers. The last messages are kept to resend
+ * the gaps over TCP, on NACKs. The other rooms are not affected.
+ *
+ * @param server Chat server.
+ * @param options Options, copied.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - not an IPv4 multicast group, a
+ *       zero port, or a bad interface address.
+ */
+int
+chat_server_set_multicast(struct chat_server *server,
+			  const struct chat_server_multicast_options *options);
+
+/**
+ * Set the options of the TCP sockets.
+ *
+ * @param server Chat server.
+ * @param options Options, copied.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - a negative size or timeout.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - no deferred accept or busy poll
+ *       on this system.
+ */
+int
+chat_server_set_tcp_options(struct chat_server *server,
+			    const struct chat_server_tcp_options *options);
+
+/**
+ * Choose the backend, CHAT_BACKEND_AUTO by default. Where a ring
+ * can not be created at the listen, like for the limit of the
+ * locked memory, the server falls back to the poll backend.
+ *
+ * @param server Chat server.
+ * @param backend Backend to use.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - no such backend.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - no io_uring on this system.
+ */
+int
+chat_server_set_backend(struct chat_server *server,
+			enum chat_server_backend backend);
+
+/**
+ * The backend in use since the listen, or the chosen one before.
+ * Never CHAT_BACKEND_AUTO after the listen.
+ */
+enum chat_server_backend
+chat_server_get_backend(const struct chat_server *server);
+
 /**
  * Try to listen for new clients on the given port.
  *
@@ -25,7 +263,8 @@ chat_server_delete(struct chat_server *server);
  * @retval !=0 Error code.
  *     - CHAT_ERR_PORT_BUSY - the port is already busy.
  *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
- *     - CHAT_ERR_SYS - a system error, check errno.
+ *     - CHAT_ERR_SYS - a system error, check errno. Like EPERM for
+ *       the busy poll.
  */
 int
 chat_server_listen(struct chat_server *server, uint16_t port);
@@ -104,3 +343,8 @@ chat_server_get_events(const struct chat_server *server);
 int
 chat_server_feed(struct chat_server *server, const char *msg,
 		 uint32_t msg_size);
+
+/** Get the server's counters. */
+void
+chat_server_get_stats(const struct chat_server *server,
+		      struct chat_server_stats *stats);
@@ -36,6 +36,24 @@ main(int argc, char **argv)
 		return -1;
 	}
 	struct chat_server *serv = chat_server_new();
+	/* Optionally, the threads to serve the clients from. */
+	if (argc > 2) {
+		rc = chat_server_set_thread_count(serv, atoi(argv[2]));
+		if (rc != 0) {
+			printf("Couldn't set the threads: %d\n", rc);
+			chat_server_delete(serv);
+			return -1;
+		}
+	}
+	/* Optionally, the certificate and the key to serve over TLS. */
+	if (argc > 4) {
+		rc = chat_server_set_tls(serv, argv[3], argv[4]);
+		if (rc != 0) {
+			printf("Couldn't set TLS: %d\n", rc);
+			chat_server_delete(serv);
+			return -1;
+		}
+	}
 	rc = chat_server_listen(serv, port);
 	if (rc != 0) {
 		printf("Couldn't listen: %d\n", rc);
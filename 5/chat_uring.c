@@ -0,0 +1,316 @@
+#include "chat_uring.h"
+
+#if CHAT_USE_IO_URING
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int
+chat_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+chat_uring_register(int fd, unsigned opcode, void *arg, unsigned count)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static int
+chat_uring_sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+		     unsigned flags, void *arg, size_t arg_size)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, arg, arg_size);
+}
+
+/**
+ * The probe shows the opcodes, not their flags. The multishot
+ * receive has come in the same release as the zero-copy send, so
+ * that one stands for it.
+ */
+static bool
+chat_uring_check_kernel(void)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = chat_uring_setup(4, &params);
+	if (fd < 0)
+		return false;
+	bool res = false;
+	size_t size = sizeof(struct io_uring_probe) +
+		256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if (probe == NULL)
+		abort();
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0 &&
+	    (params.features & IORING_FEAT_EXT_ARG) != 0 &&
+	    chat_uring_register(fd, IORING_REGISTER_PROBE, probe,
+				256) == 0 &&
+	    probe->last_op >= IORING_OP_SEND_ZC) {
+		res = (probe->ops[IORING_OP_SEND_ZC].flags &
+		       IO_URING_OP_SUPPORTED) != 0;
+	}
+	free(probe);
+	close(fd);
+	return res;
+}
+
+bool
+chat_uring_is_supported(void)
+{
+	/* 0 unknown, 1 no, 2 yes. Same result for all the threads. */
+	static int is_supported = 0;
+	int value = __atomic_load_n(&is_supported, __ATOMIC_RELAXED);
+	if (value == 0) {
+		value = chat_uring_check_kernel() ? 2 : 1;
+		__atomic_store_n(&is_supported, value, __ATOMIC_RELAXED);
+	}
+	return value == 2;
+}
+
+static int
+chat_uring_create_bufs(struct chat_uring *ring, unsigned count,
+		       unsigned size)
+{
+	ring->buf_count = count;
+	ring->buf_size = size;
+	ring->buf_tail = 0;
+	ring->buf_ring_size = count * sizeof(struct io_uring_buf);
+	/* Page aligned, as the kernel wants it. */
+	ring->buf_ring = mmap(NULL, ring->buf_ring_size,
+			      PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buf_ring == MAP_FAILED)
+		return -1;
+	ring->bufs = malloc((size_t)count * size);
+	if (ring->bufs == NULL)
+		abort();
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+	reg.ring_entries = count;
+	reg.bgid = CHAT_URING_BUF_GROUP;
+	if (chat_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg,
+				1) != 0) {
+		munmap(ring->buf_ring, ring->buf_ring_size);
+		free(ring->bufs);
+		return -1;
+	}
+	for (unsigned i = 0; i < count; ++i)
+		chat_uring_buf_return(ring, i);
+	return 0;
+}
+
+int
+chat_uring_create(struct chat_uring *ring, unsigned entries,
+		  unsigned buf_count, unsigned buf_size)
+{
+	memset(ring, 0, sizeof(*ring));
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	/*
+	 * Each peer can have a receive and a send in flight, so the
+	 * completions can come in bursts way bigger than the requests.
+	 */
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP |
+		       IORING_SETUP_SUBMIT_ALL;
+	params.cq_entries = entries * 8;
+	ring->fd = chat_uring_setup(entries, &params);
+	if (ring->fd < 0)
+		return -1;
+	size_t sq_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+	ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd,
+			   IORING_OFF_SQ_RING);
+	if (ring->rings == MAP_FAILED)
+		goto close_fd;
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto unmap_rings;
+	char *p = ring->rings;
+	ring->sq_head = (unsigned *)(p + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(p + params.sq_off.tail);
+	ring->sq_array = (unsigned *)(p + params.sq_off.array);
+	ring->sq_mask = *(unsigned *)(p + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->cq_head = (unsigned *)(p + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(p + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(p + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(p + params.cq_off.cqes);
+	if (chat_uring_create_bufs(ring, buf_count, buf_size) != 0)
+		goto unmap_sqes;
+	return 0;
+
+unmap_sqes:
+	munmap(ring->sqes, ring->sqes_size);
+unmap_rings:
+	munmap(ring->rings, ring->rings_size);
+close_fd:
+	close(ring->fd);
+	ring->fd = -1;
+	return -1;
+}
+
+void
+chat_uring_destroy(struct chat_uring *ring)
+{
+	/* Closed first, so the kernel is done with the buffers. */
+	close(ring->fd);
+	munmap(ring->buf_ring, ring->buf_ring_size);
+	free(ring->bufs);
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->rings, ring->rings_size);
+}
+
+static int
+chat_uring_submit(struct chat_uring *ring, unsigned min_complete,
+		  unsigned flags, void *arg, size_t arg_size)
+{
+	int rc = chat_uring_sys_enter(ring->fd, ring->to_submit,
+				      min_complete, flags, arg, arg_size);
+	if (rc >= 0) {
+		/* With SUBMIT_ALL the failed ones get their completions. */
+		ring->to_submit -= rc;
+	}
+	return rc;
+}
+
+struct io_uring_sqe *
+chat_uring_get_sqe(struct chat_uring *ring)
+{
+	unsigned tail = *ring->sq_tail;
+	while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+	       ring->sq_entries) {
+		if (chat_uring_submit(ring, 0, 0, NULL, 0) < 0 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			abort();
+	}
+	unsigned index = tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	/* The kernel sees it at the next enter, filled by then. */
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++ring->to_submit;
+	return sqe;
+}
+
+int
+chat_uring_enter(struct chat_uring *ring, double timeout)
+{
+	if (timeout == 0) {
+		/* Runs the kernel's pending work, posting completions. */
+		return chat_uring_submit(ring, 0, IORING_ENTER_GETEVENTS, NULL,
+					 0) < 0 ? -1 : 0;
+	}
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	struct __kernel_timespec ts;
+	if (timeout > 0) {
+		ts.tv_sec = (long long)timeout;
+		ts.tv_nsec = (long long)((timeout - ts.tv_sec) * 1000000000);
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+	int rc = chat_uring_submit(ring, 1, IORING_ENTER_GETEVENTS |
+				   IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if (rc < 0 && errno == ETIME)
+		return 0;
+	return rc < 0 ? -1 : 0;
+}
+
+int
+chat_uring_flush(struct chat_uring *ring)
+{
+	if (ring->to_submit == 0)
+		return 0;
+	return chat_uring_submit(ring, 0, 0, NULL, 0) < 0 ? -1 : 0;
+}
+
+void
+chat_uring_buf_return(struct chat_uring *ring, uint16_t id)
+{
+	struct io_uring_buf *buf =
+		&ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+	buf->addr = (uint64_t)(uintptr_t)chat_uring_buf(ring, id);
+	buf->len = ring->buf_size;
+	buf->bid = id;
+	++ring->buf_tail;
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail,
+			 __ATOMIC_RELEASE);
+}
+
+void
+chat_uring_prep_accept(struct chat_uring *ring, int fd, uint64_t data)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	/* Blocking, the ring never waits in the calls anyway. */
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = data;
+}
+
+void
+chat_uring_prep_recv(struct chat_uring *ring, int fd, uint64_t data)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = CHAT_URING_BUF_GROUP;
+	sqe->user_data = data;
+}
+
+void
+chat_uring_prep_sendmsg(struct chat_uring *ring, int fd,
+			const struct msghdr *msg, int flags, uint64_t data)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)msg;
+	sqe->len = 1;
+	sqe->msg_flags = flags;
+	sqe->user_data = data;
+}
+
+void
+chat_uring_prep_poll(struct chat_uring *ring, int fd, uint64_t data)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = data;
+}
+
+void
+chat_uring_prep_cancel(struct chat_uring *ring, uint64_t target,
+		       uint64_t data)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = data;
+}
+
+#endif /* CHAT_USE_IO_URING */
@@ -0,0 +1,146 @@
+#pragma once
+
+/**
+ * A thin io_uring wrapper, on the raw system calls: the rings, the
+ * requests the server needs, and a ring of the buffers the kernel
+ * picks from for the receives. Linux only, and only where the
+ * kernel headers have the multishot requests.
+ */
+
+#ifndef CHAT_USE_IO_URING
+#ifdef __linux__
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define CHAT_USE_IO_URING 1
+#endif
+#endif
+#endif
+#ifndef CHAT_USE_IO_URING
+#define CHAT_USE_IO_URING 0
+#endif
+
+#if CHAT_USE_IO_URING
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct msghdr;
+
+struct chat_uring {
+	int fd;
+	/** Both rings, in one mapping. */
+	void *rings;
+	size_t rings_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	/** Requests filled since the last enter. */
+	unsigned to_submit;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	/** Receive buffers, all of the same size. */
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	char *bufs;
+	unsigned buf_count;
+	unsigned buf_size;
+	uint16_t buf_tail;
+};
+
+/** The buffer group of the receives. */
+enum {
+	CHAT_URING_BUF_GROUP = 0,
+};
+
+/**
+ * Whether the kernel has all the server needs: multishot accepts
+ * and receives, the buffer rings, and the waits with a timeout.
+ * Checked once.
+ */
+bool
+chat_uring_is_supported(void);
+
+/**
+ * @retval 0 Success.
+ * @retval -1 Not supported, or out of the locked memory.
+ */
+int
+chat_uring_create(struct chat_uring *ring, unsigned entries,
+		  unsigned buf_count, unsigned buf_size);
+
+void
+chat_uring_destroy(struct chat_uring *ring);
+
+/** A zeroed request to fill. Submits the filled ones if none left. */
+struct io_uring_sqe *
+chat_uring_get_sqe(struct chat_uring *ring);
+
+/**
+ * Submit the filled requests, and wait for a completion for the
+ * timeout, in seconds, or forever if negative.
+ *
+ * @retval 0 Success, or timed out.
+ * @retval -1 Error, check errno.
+ */
+int
+chat_uring_enter(struct chat_uring *ring, double timeout);
+
+/** Submit the filled requests, if any. */
+int
+chat_uring_flush(struct chat_uring *ring);
+
+/** The next completion, or NULL. */
+static inline struct io_uring_cqe *
+chat_uring_peek(struct chat_uring *ring)
+{
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+/** Done with the completion got by the peek. */
+static inline void
+chat_uring_advance(struct chat_uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1,
+			 __ATOMIC_RELEASE);
+}
+
+static inline const char *
+chat_uring_buf(const struct chat_uring *ring, uint16_t id)
+{
+	return ring->bufs + (size_t)id * ring->buf_size;
+}
+
+/** Give the buffer back to the kernel. */
+void
+chat_uring_buf_return(struct chat_uring *ring, uint16_t id);
+
+void
+chat_uring_prep_accept(struct chat_uring *ring, int fd, uint64_t data);
+
+void
+chat_uring_prep_recv(struct chat_uring *ring, int fd, uint64_t data);
+
+void
+chat_uring_prep_sendmsg(struct chat_uring *ring, int fd,
+			const struct msghdr *msg, int flags, uint64_t data);
+
+void
+chat_uring_prep_poll(struct chat_uring *ring, int fd, uint64_t data);
+
+/** Cancel the requests with the given data. */
+void
+chat_uring_prep_cancel(struct chat_uring *ring, uint64_t target,
+		       uint64_t data);
+
+#endif /* CHAT_USE_IO_URING */
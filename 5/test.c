@@ -7,6 +7,12 @@
 #include <pthread.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <unistd.h>
+
+#if CHAT_USE_TLS
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#endif
 
 enum {
 	TEST_MSG_ID_LEN = 64,
@@ -128,6 +134,14 @@ client_consume_events(struct chat_client *c)
 	unit_fail_if(rc != CHAT_ERR_TIMEOUT);
 }
 
+/** Send all the fed messages. */
+static void
+client_flush(struct chat_client *c)
+{
+	while ((chat_client_get_events(c) & CHAT_EVENT_OUTPUT) != 0)
+		unit_fail_if(chat_client_update(c, -1) != 0);
+}
+
 static struct chat_message *
 client_pop_next_blocking(struct chat_client *c, struct chat_server *s)
 {
@@ -677,6 +691,1039 @@ test_server_feed(void)
 #endif
 }
 
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	struct chat_server_stats stats;
+	chat_server_get_stats(s, &stats);
+	unit_check(stats.send_count == 0 && stats.sent_message_count == 0,
+		   "no sends");
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	server_consume_events(s);
+
+	int count = 100;
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(chat_client_feed(c1, "msg\n", 4) != 0);
+	while ((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) != 0)
+		unit_fail_if(chat_client_update(c1, -1) != 0);
+	for (int i = 0; i < count; ++i) {
+		struct chat_message *msg = client_pop_next_blocking(c2, s);
+		unit_fail_if(strcmp(msg->data, "msg") != 0);
+		chat_message_delete(msg);
+	}
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+	chat_server_get_stats(s, &stats);
+	unit_check(stats.sent_message_count == (uint64_t)count,
+		   "each receiver counted");
+	unit_check(stats.send_count > 0 &&
+		   stats.send_count <= stats.sent_message_count,
+		   "sends are batched");
+
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_thread_count(s, -1) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "bad thread count");
+	unit_check(chat_server_set_thread_count(s, 4) == 0, "4 threads");
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_thread_count(s, 2) ==
+		   CHAT_ERR_ALREADY_STARTED, "no threads after listen");
+	unit_check(chat_server_get_events(s) == CHAT_EVENT_INPUT,
+		   "waits for messages");
+	uint16_t port = server_get_port(s);
+
+	enum { client_count = 8, msg_count = 50 };
+	struct chat_client *clients[client_count];
+	for (int i = 0; i < client_count; ++i) {
+		clients[i] = chat_client_new("c");
+		unit_fail_if(chat_client_connect(clients[i],
+						 make_addr_str(port)) != 0);
+	}
+	/*
+	 * The threads accept on their own. But once a message of the
+	 * last one is seen by all, everyone is in.
+	 */
+	struct chat_client *last = clients[client_count - 1];
+	unit_fail_if(chat_client_feed(last, "ready\n", 6) != 0);
+	while ((chat_client_get_events(last) & CHAT_EVENT_OUTPUT) != 0)
+		unit_fail_if(chat_client_update(last, -1) != 0);
+	struct chat_message *msg;
+	for (int i = 0; i < client_count - 1; ++i) {
+		msg = client_pop_next_blocking(clients[i], s);
+		unit_fail_if(strcmp(msg->data, "ready") != 0);
+		chat_message_delete(msg);
+	}
+	for (int i = 0; i < client_count; ++i) {
+		for (int j = 0; j < msg_count; ++j) {
+			unit_fail_if(chat_client_feed(clients[i], "msg\n",
+						      4) != 0);
+		}
+	}
+	int received[client_count] = {0};
+	int server_received = 0;
+	bool is_done = false;
+	while (!is_done) {
+		is_done = true;
+		for (int i = 0; i < client_count; ++i) {
+			int rc = chat_client_update(clients[i], 0);
+			unit_fail_if(rc != 0 && rc != CHAT_ERR_TIMEOUT);
+			struct chat_client *c = clients[i];
+			while ((msg = chat_client_pop_next(c)) != NULL) {
+				unit_fail_if(strcmp(msg->data, "msg") != 0);
+				chat_message_delete(msg);
+				++received[i];
+			}
+			if (received[i] < (client_count - 1) * msg_count)
+				is_done = false;
+		}
+		int rc = chat_server_update(s, 0);
+		unit_fail_if(rc != 0 && rc != CHAT_ERR_TIMEOUT);
+		while ((msg = chat_server_pop_next(s)) != NULL) {
+			chat_message_delete(msg);
+			++server_received;
+		}
+	}
+	bool is_exact = true;
+	for (int i = 0; i < client_count; ++i)
+		is_exact = is_exact && received[i] ==
+			   (client_count - 1) * msg_count;
+	unit_check(is_exact, "each client got all the others' messages");
+	while (server_received < client_count * msg_count + 1) {
+		unit_fail_if(chat_server_update(s, -1) != 0);
+		while ((msg = chat_server_pop_next(s)) != NULL) {
+			chat_message_delete(msg);
+			++server_received;
+		}
+	}
+	unit_check(server_received == client_count * msg_count + 1,
+		   "server got all messages");
+	struct chat_server_stats stats;
+	chat_server_get_stats(s, &stats);
+	unit_check(stats.sent_message_count == (uint64_t)(client_count - 1) *
+		   (client_count * msg_count + 1), "stats of all threads");
+
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(clients[i]);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_output_budget(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_output_budget(s, 1000, 100) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "bad policy");
+	unit_fail_if(chat_server_set_output_budget(s, 1000,
+		     CHAT_OUTPUT_DROP_OLDEST) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_output_budget(s, 0,
+		   CHAT_OUTPUT_DROP_OLDEST) == CHAT_ERR_ALREADY_STARTED,
+		   "no budget change after listen");
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	server_consume_events(s);
+	/*
+	 * Read by the server in one go, so much more than the budget
+	 * is queued to the other client before a send.
+	 */
+	int count = 100;
+	char buf[128];
+	memset(buf, 'x', sizeof(buf));
+	for (int i = 0; i < count; ++i) {
+		sprintf(buf, "%03d", i);
+		buf[3] = 'x';
+		buf[sizeof(buf) - 1] = '\n';
+		unit_fail_if(chat_client_feed(c1, buf, sizeof(buf)) != 0);
+	}
+	while ((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) != 0)
+		unit_fail_if(chat_client_update(c1, -1) != 0);
+	int received = 0;
+	int last = -1;
+	bool is_ordered = true;
+	while (last != count - 1) {
+		struct chat_message *msg = client_pop_next_blocking(c2, s);
+		int id = atoi(msg->data);
+		is_ordered = is_ordered && id > last;
+		last = id;
+		++received;
+		chat_message_delete(msg);
+	}
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+	unit_check(is_ordered, "the newest messages are kept in order");
+	struct chat_server_stats stats;
+	chat_server_get_stats(s, &stats);
+	unit_check(received < count && stats.dropped_message_count ==
+		   (uint64_t)(count - received), "the oldest are dropped");
+	unit_check(stats.backpressure_peer_count == 0,
+		   "no backpressure once sent");
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+
+	s = chat_server_new();
+	unit_fail_if(chat_server_set_output_budget(s, 1000,
+		     CHAT_OUTPUT_DISCONNECT) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	port = server_get_port(s);
+	c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	server_consume_events(s);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(chat_client_feed(c1, buf, sizeof(buf)) != 0);
+	while ((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) != 0)
+		unit_fail_if(chat_client_update(c1, -1) != 0);
+	while (chat_client_get_events(c2) != 0) {
+		chat_server_update(s, 0);
+		chat_client_update(c2, 0);
+	}
+	while ((msg = chat_client_pop_next(c2)) != NULL)
+		chat_message_delete(msg);
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+	chat_server_get_stats(s, &stats);
+	unit_check(stats.dropped_peer_count == 1, "the slow one is dropped");
+	unit_check(chat_client_get_events(c1) != 0, "the other stays");
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+
+	s = chat_server_new();
+	unit_fail_if(chat_server_set_output_budget(s, 1000,
+		     CHAT_OUTPUT_THROTTLE) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	port = server_get_port(s);
+	c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	server_consume_events(s);
+	/*
+	 * Till the socket buffers to c2 are full, and then more than
+	 * they can ever grow to, so some always waits in the server.
+	 */
+	uint32_t big_size = 64 * 1024;
+	char *big = malloc(big_size);
+	memset(big, 'y', big_size);
+	big[big_size - 1] = '\n';
+	int big_count = 0;
+	do {
+		unit_fail_if(chat_client_feed(c1, big, big_size) != 0);
+		++big_count;
+		for (int i = 0; i < 10; ++i) {
+			chat_client_update(c1, 0);
+			chat_server_update(s, 0);
+		}
+		chat_server_get_stats(s, &stats);
+	} while (stats.backpressure_peer_count == 0);
+	for (int i = 0; i < 100; ++i, ++big_count)
+		unit_fail_if(chat_client_feed(c1, big, big_size) != 0);
+	while ((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) != 0) {
+		chat_client_update(c1, 0);
+		chat_server_update(s, 0);
+	}
+	unit_fail_if(chat_client_feed(c2, "hi\n", 3) != 0);
+	while ((chat_client_get_events(c2) & CHAT_EVENT_OUTPUT) != 0)
+		unit_fail_if(chat_client_update(c2, -1) != 0);
+	server_consume_events(s);
+	client_consume_events(c1);
+	unit_check(chat_client_pop_next(c1) == NULL,
+		   "the throttled one is not read");
+	for (int i = 0; i < big_count; ++i) {
+		msg = client_pop_next_blocking(c2, s);
+		unit_fail_if(strlen(msg->data) != big_size - 1);
+		chat_message_delete(msg);
+	}
+	msg = client_pop_next_blocking(c1, s);
+	unit_check(strcmp(msg->data, "hi") == 0, "read once all is sent");
+	chat_message_delete(msg);
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+	chat_server_get_stats(s, &stats);
+	unit_check(stats.backpressure_peer_count == 0 &&
+		   stats.dropped_message_count == 0, "nothing is dropped");
+	free(big);
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_framing(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_set_framing(c1, CHAT_FRAMING_BINARY) != 0);
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	unit_check(chat_client_set_framing(c1, CHAT_FRAMING_TEXT) ==
+		   CHAT_ERR_ALREADY_STARTED, "framing is set before connect");
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	struct chat_client *c3 = chat_client_new("c3");
+	unit_fail_if(chat_client_set_framing(c3, CHAT_FRAMING_BINARY) != 0);
+	unit_fail_if(chat_client_connect(c3, make_addr_str(port)) != 0);
+	server_consume_events(s);
+	/* The binary clients have not sent their hellos yet. */
+	unit_fail_if(chat_client_feed(c2, "before\n", 7) != 0);
+	client_flush(c2);
+	server_consume_events(s);
+
+	struct chat_message *msg = client_pop_next_blocking(c1, s);
+	unit_check(strcmp(msg->data, "before") == 0, "text before hello");
+	chat_message_delete(msg);
+	unit_fail_if(chat_client_feed(c2, "after\n", 6) != 0);
+	client_flush(c2);
+	msg = client_pop_next_blocking(c1, s);
+	unit_check(strcmp(msg->data, "after") == 0, "frame after hello");
+	chat_message_delete(msg);
+	/* Trimmed and the empty ones skipped, like the text. */
+	unit_fail_if(chat_client_feed(c1, "  a b \n\n  \n", 11) != 0);
+	client_flush(c1);
+	msg = client_pop_next_blocking(c2, s);
+	unit_check(strcmp(msg->data, "a b") == 0, "binary to text");
+	chat_message_delete(msg);
+
+	int size = 1024 * 1024;
+	char *big = malloc(size + 1);
+	for (int i = 0; i < size; ++i)
+		big[i] = 'a' + i % ('z' - 'a' + 1);
+	big[size] = '\n';
+	unit_fail_if(chat_client_feed(c1, big, size / 2) != 0);
+	unit_fail_if(chat_client_feed(c1, big + size / 2,
+				      size + 1 - size / 2) != 0);
+	big[size] = 0;
+	/* Not all at once, the receivers are read in between. */
+	while ((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) != 0) {
+		chat_client_update(c1, 0);
+		chat_server_update(s, 0);
+		chat_client_update(c2, 0);
+		chat_client_update(c3, 0);
+	}
+	msg = client_pop_next_blocking(c2, s);
+	unit_check(strcmp(msg->data, big) == 0, "big to text");
+	chat_message_delete(msg);
+	const char *expected[] = {"before", "after", "a b", big};
+	bool is_ok = true;
+	for (int i = 0; i < 4; ++i) {
+		msg = client_pop_next_blocking(c3, s);
+		is_ok = is_ok && strcmp(msg->data, expected[i]) == 0;
+		chat_message_delete(msg);
+	}
+	unit_check(is_ok, "late hello gets all");
+	unit_check(chat_client_pop_next(c1) == NULL, "not to the author");
+	for (int i = 0; i < 4; ++i) {
+		msg = chat_server_pop_next(s);
+		unit_fail_if(msg == NULL);
+		is_ok = is_ok && strcmp(msg->data, expected[i]) == 0;
+		chat_message_delete(msg);
+	}
+	unit_check(is_ok, "server gets all");
+
+	free(big);
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_client_delete(c3);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_messages_outlive_server(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1,
+		make_addr_str(server_get_port(s))) != 0);
+	int size = 10000;
+	char *big = malloc(size + 1);
+	memset(big, 'b', size);
+	big[size] = '\n';
+	unit_fail_if(chat_client_feed(c1, "small\n", 6) != 0);
+	unit_fail_if(chat_client_feed(c1, big, size + 1) != 0);
+	big[size] = 0;
+	/* A reused one in between. */
+	struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+	chat_message_delete(msg);
+	unit_fail_if(chat_client_feed(c1, "again\n", 7) != 0);
+	struct chat_message *msgs[2];
+	msgs[0] = server_pop_next_blocking_from(s, c1);
+	msgs[1] = server_pop_next_blocking_from(s, c1);
+	chat_client_delete(c1);
+	chat_server_delete(s);
+
+	unit_check(strcmp(msgs[0]->data, big) == 0, "big message");
+	unit_check(strcmp(msgs[1]->data, "again") == 0, "small message");
+	chat_message_delete(msgs[0]);
+	chat_message_delete(msgs[1]);
+	free(big);
+
+	unit_test_finish();
+}
+
+static void
+test_backends(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_get_backend(s) == CHAT_BACKEND_AUTO,
+		   "auto by default");
+	unit_check(chat_server_set_backend(s, 100) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "no such backend");
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_get_backend(s) != CHAT_BACKEND_AUTO,
+		   "resolved at listen");
+	unit_check(chat_server_set_backend(s, CHAT_BACKEND_POLL) ==
+		   CHAT_ERR_ALREADY_STARTED, "too late to switch");
+	chat_server_delete(s);
+
+	enum chat_server_backend backends[] = {
+		CHAT_BACKEND_POLL, CHAT_BACKEND_IO_URING,
+	};
+	int size = 100000;
+	char *big = malloc(size + 1);
+	memset(big, 'x', size);
+	big[size] = '\n';
+	for (int bi = 0; bi < 2; ++bi) {
+		s = chat_server_new();
+		int rc = chat_server_set_backend(s, backends[bi]);
+		if (rc == CHAT_ERR_NOT_IMPLEMENTED) {
+			chat_server_delete(s);
+			continue;
+		}
+		unit_fail_if(rc != 0);
+		unit_fail_if(chat_server_listen(s, 0) != 0);
+		unit_fail_if(chat_server_get_backend(s) != backends[bi]);
+		uint16_t port = server_get_port(s);
+		struct chat_client *c1 = chat_client_new("c1");
+		unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+		struct chat_client *c2 = chat_client_new("c2");
+		unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+		struct chat_client *c3 = chat_client_new("c3");
+		unit_fail_if(chat_client_connect(c3, make_addr_str(port)) != 0);
+		server_consume_events(s);
+		/* The one leaving must not break the sends to the others. */
+		chat_client_delete(c3);
+
+		unit_fail_if(chat_client_feed(c1, "hello\n", 6) != 0);
+		unit_fail_if(chat_client_feed(c1, big, size + 1) != 0);
+		struct chat_message *msgs[2];
+		for (int i = 0; i < 2; ++i) {
+			while ((msgs[i] = chat_client_pop_next(c2)) == NULL) {
+				chat_client_update(c1, 0);
+				chat_server_update(s, 0);
+				chat_client_update(c2, 0);
+			}
+		}
+		unit_check(strcmp(msgs[0]->data, "hello") == 0, "small one");
+		unit_check(strlen(msgs[1]->data) == (size_t)size, "big one");
+		chat_message_delete(msgs[0]);
+		chat_message_delete(msgs[1]);
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(s)) != NULL)
+			chat_message_delete(msg);
+
+		chat_client_delete(c1);
+		chat_client_delete(c2);
+		chat_server_delete(s);
+	}
+	free(big);
+
+	unit_test_finish();
+}
+
+static void
+test_connect(void)
+{
+	unit_test_start();
+
+	/* A port nobody listens on. */
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	unit_fail_if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0);
+	socklen_t len = sizeof(addr);
+	unit_fail_if(getsockname(fd, (struct sockaddr *)&addr, &len) != 0);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_check(chat_client_connect(c1, "localhost") == CHAT_ERR_NO_ADDR,
+		   "no port");
+	unit_check(chat_client_connect(c1,
+		make_addr_str(ntohs(addr.sin_port))) == CHAT_ERR_SYS,
+		"refused");
+	unit_check(chat_client_get_descriptor(c1) < 0, "no socket");
+	close(fd);
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_client_connect(c1,
+		make_addr_str(server_get_port(s))) == 0, "connect after fail");
+	/* Many small feeds, all sent by one update. */
+	for (int i = 0; i < 100; ++i)
+		unit_fail_if(chat_client_feed(c1, "m", 1) != 0);
+	unit_fail_if(chat_client_feed(c1, "\n", 1) != 0);
+	unit_check(chat_client_update(c1, -1) == 0, "update");
+	unit_check((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) == 0,
+		   "all sent");
+	struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+	unit_check(strlen(msg->data) == 100, "one message");
+	chat_message_delete(msg);
+	chat_client_delete(c1);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_tcp_options(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	struct chat_server_tcp_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.send_buffer_size = -1;
+	unit_check(chat_server_set_tcp_options(s, &opts) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "negative size");
+	opts.send_buffer_size = 64 * 1024;
+	opts.receive_buffer_size = 64 * 1024;
+	opts.no_delay = true;
+	unit_check(chat_server_set_tcp_options(s, &opts) == 0, "set");
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_tcp_options(s, &opts) ==
+		   CHAT_ERR_ALREADY_STARTED, "too late to set");
+	int fd = chat_server_get_socket(s);
+	int value = 0;
+	socklen_t len = sizeof(value);
+	unit_fail_if(getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &value, &len) != 0);
+	unit_check(value >= 64 * 1024, "receive buffer");
+
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1,
+		make_addr_str(server_get_port(s))) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2,
+		make_addr_str(server_get_port(s))) != 0);
+	server_consume_events(s);
+	unit_fail_if(chat_client_feed(c1, "hello\n", 6) != 0);
+	client_flush(c1);
+	struct chat_message *msg = client_pop_next_blocking(c2, s);
+	unit_check(strcmp(msg->data, "hello") == 0, "delivered");
+	chat_message_delete(msg);
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_rooms_feed(struct chat_server *s, struct chat_client *c,
+		const char *data, const char *last)
+{
+	unit_fail_if(chat_client_feed(c, data, strlen(data)) != 0);
+	client_flush(c);
+	/* The last line is a message, so the lines before are done. */
+	struct chat_message *msg = server_pop_next_blocking_from(s, c);
+	unit_fail_if(strcmp(msg->data, last) != 0);
+	chat_message_delete(msg);
+}
+
+static void
+test_rooms_expect(struct chat_server *s, struct chat_client *c,
+		  const char *data, const char *what)
+{
+	struct chat_message *msg = client_pop_next_blocking(c, s);
+	unit_check(strcmp(msg->data, data) == 0, what);
+	chat_message_delete(msg);
+}
+
+static void
+test_rooms(void)
+{
+	unit_test_start();
+
+	for (int thread_count = 0; thread_count <= 2; thread_count += 2) {
+		struct chat_server *s = chat_server_new();
+		unit_fail_if(chat_server_set_thread_count(s,
+							  thread_count) != 0);
+		unit_fail_if(chat_server_listen(s, 0) != 0);
+		const char *addr = make_addr_str(server_get_port(s));
+		struct chat_client *c1 = chat_client_new("c1");
+		unit_fail_if(chat_client_connect(c1, addr) != 0);
+		struct chat_client *c2 = chat_client_new("c2");
+		unit_fail_if(chat_client_connect(c2, addr) != 0);
+		struct chat_client *c3 = chat_client_new("c3");
+		unit_fail_if(chat_client_connect(c3, addr) != 0);
+		chat_server_update(s, 0);
+
+		test_rooms_feed(s, c1, "/join a\nc1 joined\n", "c1 joined");
+		test_rooms_feed(s, c2, "/join a\nc2 joined\n", "c2 joined");
+		test_rooms_expect(s, c1, "c2 joined", "same room");
+		test_rooms_feed(s, c3, "to lobby\n", "to lobby");
+		test_rooms_feed(s, c1, "to a\n", "to a");
+		test_rooms_expect(s, c2, "to a", "not the other room");
+		test_rooms_feed(s, c2, "/join\nc2 back\n", "c2 back");
+		test_rooms_expect(s, c3, "c2 back", "back in the lobby");
+		test_rooms_feed(s, c1, "/joined\n", "/joined");
+		char big[128];
+		int size = sprintf(big, "/join ");
+		memset(big + size, 'x', CHAT_ROOM_NAME_MAX + 1);
+		strcpy(big + size + CHAT_ROOM_NAME_MAX + 1, "\nc3 stays\n");
+		test_rooms_feed(s, c3, big, "c3 stays");
+		test_rooms_expect(s, c2, "c3 stays", "too long name");
+		unit_check(chat_client_pop_next(c2) == NULL, "no /joined");
+
+		chat_client_delete(c1);
+		chat_client_delete(c2);
+		chat_client_delete(c3);
+		chat_server_delete(s);
+	}
+
+	unit_test_finish();
+}
+
+/** Pop the messages till the one with the data, at most count. */
+static void
+test_history_expect_any(struct chat_server *s, struct chat_client *c,
+			const char *data, int count)
+{
+	bool is_found = false;
+	for (int i = 0; i < count && !is_found; ++i) {
+		struct chat_message *msg = client_pop_next_blocking(c, s);
+		is_found = strcmp(msg->data, data) == 0;
+		chat_message_delete(msg);
+	}
+	unit_check(is_found, "got it among the history");
+}
+
+/** Pop the count messages, which are the given ones in any order. */
+static void
+test_history_expect_set(struct chat_server *s, struct chat_client *c,
+			const char **datas, int count)
+{
+	bool is_ok = true;
+	uint32_t seen = 0;
+	for (int i = 0; i < count; ++i) {
+		struct chat_message *msg = client_pop_next_blocking(c, s);
+		int j = 0;
+		while (j < count && strcmp(msg->data, datas[j]) != 0)
+			++j;
+		if (j == count || (seen & (1u << j)) != 0)
+			is_ok = false;
+		else
+			seen |= 1u << j;
+		chat_message_delete(msg);
+	}
+	unit_check(is_ok, "the history in any order");
+}
+
+static void
+test_history(void)
+{
+	unit_test_start();
+
+	for (int thread_count = 0; thread_count <= 2; thread_count += 2) {
+		struct chat_server *s = chat_server_new();
+		unit_fail_if(chat_server_set_thread_count(s,
+							  thread_count) != 0);
+		unit_fail_if(chat_server_set_history_size(s, 3) != 0);
+		unit_fail_if(chat_server_listen(s, 0) != 0);
+		unit_check(chat_server_set_history_size(s, 3) ==
+			   CHAT_ERR_ALREADY_STARTED, "set after listen");
+		const char *addr = make_addr_str(server_get_port(s));
+		struct chat_client *c1 = chat_client_new("c1");
+		unit_fail_if(chat_client_connect(c1, addr) != 0);
+		chat_server_update(s, 0);
+		test_rooms_feed(s, c1, "m1\nm2\nm3\nm4\n", "m1");
+		for (int i = 2; i <= 4; ++i) {
+			struct chat_message *msg =
+				server_pop_next_blocking_from(s, c1);
+			chat_message_delete(msg);
+		}
+		struct chat_client *c2 = chat_client_new("c2");
+		unit_fail_if(chat_client_connect(c2, addr) != 0);
+		test_rooms_expect(s, c2, "m2", "the lobby's last 3 at connect");
+		test_rooms_expect(s, c2, "m3", "in order");
+		test_rooms_expect(s, c2, "m4", "the newest");
+
+		test_rooms_feed(s, c1, "/join a\na1\n", "a1");
+		test_rooms_feed(s, c2, "/join a\nc2 in a\n", "c2 in a");
+		test_rooms_expect(s, c2, "a1", "the room's at the join");
+		test_rooms_expect(s, c1, "c2 in a", "then the live ones");
+		unit_check(chat_client_pop_next(c1) == NULL, "no own history");
+
+		/* A rejoin gets the history again. */
+		test_rooms_feed(s, c1, "/join\nc1 back\n", "c1 back");
+		test_rooms_expect(s, c1, "m2", "the lobby's at the rejoin");
+		test_rooms_expect(s, c1, "m3", "the lobby's at the rejoin");
+		test_rooms_expect(s, c1, "m4", "the lobby's at the rejoin");
+		test_rooms_feed(s, c2, "/join\nc2 back\n", "c2 back");
+		test_rooms_expect(s, c1, "c2 back", "back in the lobby");
+		/*
+		 * The other reactors keep the posted messages in the order
+		 * of their arrival, not exactly of the sends.
+		 */
+		test_history_expect_any(s, c2, "c1 back", 4);
+		struct chat_client *c3 = chat_client_new("c3");
+		unit_fail_if(chat_client_connect(c3, addr) != 0);
+		const char *lobby[] = {"m4", "c1 back", "c2 back"};
+		test_history_expect_set(s, c3, lobby, 3);
+		/* A room with the history stays, even empty. */
+		test_rooms_feed(s, c3, "/join a\nc3 in a\n", "c3 in a");
+		const char *room[] = {"a1", "c2 in a"};
+		test_history_expect_set(s, c3, room, 2);
+		unit_check(chat_client_pop_next(c3) == NULL, "no more");
+
+		chat_client_delete(c1);
+		chat_client_delete(c2);
+		chat_client_delete(c3);
+		chat_server_delete(s);
+	}
+
+	unit_test_finish();
+}
+
+static void
+test_client_flush(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_check(chat_client_set_flush(c1, 1000, -1) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "negative delay");
+	unit_fail_if(chat_client_set_flush(c1, 1000, 10) != 0);
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	server_consume_events(s);
+	unit_check(chat_client_get_timeout(c1) < 0, "nothing held");
+
+	unit_fail_if(chat_client_feed(c1, "a\n", 2) != 0);
+	unit_check((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) == 0,
+		   "held below the threshold");
+	double timeout = chat_client_get_timeout(c1);
+	unit_check(timeout > 0 && timeout <= 10, "due in the delay");
+	char big[1001];
+	memset(big, 'b', 1000);
+	big[1000] = '\n';
+	unit_fail_if(chat_client_feed(c1, big, 1001) != 0);
+	unit_check((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) != 0,
+		   "due by the size");
+	unit_check(chat_client_get_timeout(c1) == 0, "no timeout");
+	client_flush(c1);
+	test_rooms_expect(s, c2, "a", "first");
+	struct chat_message *msg = client_pop_next_blocking(c2, s);
+	unit_check(strlen(msg->data) == 1000, "second");
+	chat_message_delete(msg);
+
+	/* The delay runs out while the updates wait. */
+	unit_fail_if(chat_client_set_flush(c1, 1 << 20, 0.05) != 0);
+	unit_fail_if(chat_client_feed(c1, "late\n", 5) != 0);
+	unit_check(chat_client_update(c1, 1) == 0, "woken up to send");
+	unit_check(chat_client_get_timeout(c1) < 0, "sent");
+	test_rooms_expect(s, c2, "late", "after the delay");
+	chat_client_delete(c1);
+
+	/* The lines cut in one pass, across the feeds. */
+	struct chat_client *c3 = chat_client_new("c3");
+	unit_fail_if(chat_client_set_framing(c3, CHAT_FRAMING_BINARY) != 0);
+	unit_fail_if(chat_client_connect(c3, make_addr_str(port)) != 0);
+	const char *parts[] = {"  he", "llo  \n\n wor", "ld\n\t\n", "x"};
+	for (int i = 0; i < 4; ++i) {
+		unit_fail_if(chat_client_feed(c3, parts[i],
+					      strlen(parts[i])) != 0);
+	}
+	client_flush(c3);
+	test_rooms_expect(s, c2, "hello", "trimmed across the feeds");
+	test_rooms_expect(s, c2, "world", "and the empty skipped");
+	unit_fail_if(chat_client_feed(c3, "y\n", 2) != 0);
+	client_flush(c3);
+	test_rooms_expect(s, c2, "xy", "the rest kept");
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+	chat_client_delete(c2);
+	chat_client_delete(c3);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_multicast_expect(int fd, uint64_t seq, const char *data,
+		      const char *what)
+{
+	char buf[CHAT_MULTICAST_DATAGRAM_MAX];
+	ssize_t rc = recv(fd, buf, sizeof(buf), 0);
+	unit_fail_if(rc < CHAT_MULTICAST_HEADER_SIZE);
+	uint64_t got = 0;
+	for (int i = 0; i < CHAT_MULTICAST_HEADER_SIZE; ++i)
+		got = got << 8 | (uint8_t)buf[i];
+	size_t size = strlen(data);
+	unit_check(got == seq &&
+		   (size_t)rc == CHAT_MULTICAST_HEADER_SIZE + size &&
+		   memcmp(buf + CHAT_MULTICAST_HEADER_SIZE, data, size) == 0,
+		   what);
+}
+
+static void
+test_multicast(void)
+{
+	unit_test_start();
+
+	/* The group's member, on the loopback. */
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	unit_fail_if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0);
+	socklen_t len = sizeof(addr);
+	unit_fail_if(getsockname(fd, (struct sockaddr *)&addr, &len) != 0);
+	struct ip_mreq mreq;
+	inet_pton(AF_INET, "239.255.0.1", &mreq.imr_multiaddr);
+	inet_pton(AF_INET, "127.0.0.1", &mreq.imr_interface);
+	unit_fail_if(setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+				sizeof(mreq)) != 0);
+	struct timeval timeout = {5, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	uint16_t group_port = ntohs(addr.sin_port);
+
+	struct chat_server *s = chat_server_new();
+	struct chat_server_multicast_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.group = "10.0.0.1";
+	opts.port = group_port;
+	unit_check(chat_server_set_multicast(s, &opts) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "not a group");
+	opts.group = "239.255.0.1";
+	opts.interface_addr = "127.0.0.1";
+	/* To see a message forgotten. */
+	opts.resend_count = 2;
+	unit_check(chat_server_set_multicast(s, &opts) == 0, "set");
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_multicast(s, &opts) ==
+		   CHAT_ERR_ALREADY_STARTED, "too late to set");
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	server_consume_events(s);
+
+	test_rooms_feed(s, c2, "/multicast\nc2 on\n", "c2 on");
+	char answer[128];
+	sprintf(answer, "/multicast 239.255.0.1:%u 1", group_port);
+	test_rooms_expect(s, c2, answer, "the group and the first number");
+	test_rooms_expect(s, c1, "c2 on", "the others by TCP");
+	test_multicast_expect(fd, 1, "c2 on\n", "own one to the group");
+
+	test_rooms_feed(s, c1, "m2\n", "m2");
+	int size = 2000;
+	char *big = malloc(size + 2);
+	memset(big, 'x', size);
+	big[size] = 0;
+	big[size + 1] = 0;
+	unit_fail_if(chat_client_feed(c1, big, size) != 0);
+	unit_fail_if(chat_client_feed(c1, "\n", 1) != 0);
+	client_flush(c1);
+	struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+	unit_fail_if(strcmp(msg->data, big) != 0);
+	chat_message_delete(msg);
+	test_rooms_feed(s, c1, "m4\n", "m4");
+	test_multicast_expect(fd, 2, "m2\n", "next number");
+	test_multicast_expect(fd, 3, "", "too big, only the number");
+	test_multicast_expect(fd, 4, "m4\n", "after the big one");
+
+	test_rooms_feed(s, c2, "/nack 3\n/nack 1\nc2 asks\n", "c2 asks");
+	/* Nothing of the lobby by TCP, only the answers. */
+	char *resend = malloc(size + 16);
+	sprintf(resend, "/resend 3 %s", big);
+	test_rooms_expect(s, c2, resend, "resent");
+	test_rooms_expect(s, c2, "/lost 1", "not kept");
+	test_rooms_expect(s, c1, "c2 asks", "asks of the lobby");
+	test_multicast_expect(fd, 5, "c2 asks\n", "the NACKs are not");
+
+	test_rooms_feed(s, c2, "/join\nc2 off\n", "c2 off");
+	test_rooms_expect(s, c1, "c2 off", "off");
+	test_rooms_feed(s, c1, "m7\n", "m7");
+	test_rooms_expect(s, c2, "m7", "by TCP after a join");
+
+	struct chat_server_stats stats;
+	chat_server_get_stats(s, &stats);
+	unit_check(stats.multicast_message_count == 7, "multicast count");
+	unit_check(stats.resent_message_count == 1, "resent count");
+
+	free(big);
+	free(resend);
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+	close(fd);
+
+	unit_test_finish();
+}
+
+#if CHAT_USE_TLS
+
+/** A self-signed certificate, written to the files. */
+static void
+test_tls_make_cert(const char *cert_file, const char *key_file)
+{
+	EVP_PKEY *key = EVP_EC_gen("P-256");
+	unit_fail_if(key == NULL);
+	X509 *cert = X509_new();
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+	X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+	X509_set_pubkey(cert, key);
+	X509_NAME *name = X509_get_subject_name(cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+				   (const unsigned char *)"localhost", -1, -1,
+				   0);
+	X509_set_issuer_name(cert, name);
+	unit_fail_if(X509_sign(cert, key, EVP_sha256()) == 0);
+	FILE *f = fopen(cert_file, "w");
+	unit_fail_if(f == NULL || PEM_write_X509(f, cert) != 1);
+	fclose(f);
+	f = fopen(key_file, "w");
+	unit_fail_if(f == NULL || PEM_write_PrivateKey(f, key, NULL, NULL, 0,
+						       NULL, NULL) != 1);
+	fclose(f);
+	X509_free(cert);
+	EVP_PKEY_free(key);
+}
+
+/** A blocking TLS connection, the server is served by its thread. */
+static SSL *
+test_tls_connect(SSL_CTX *ctx, uint16_t port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	unit_fail_if(connect(fd, (struct sockaddr *)&addr,
+			     sizeof(addr)) != 0);
+	SSL *ssl = SSL_new(ctx);
+	SSL_set_fd(ssl, fd);
+	unit_fail_if(SSL_connect(ssl) != 1);
+	return ssl;
+}
+
+static void
+test_tls_close(SSL *ssl)
+{
+	int fd = SSL_get_fd(ssl);
+	SSL_free(ssl);
+	close(fd);
+}
+
+#endif /* CHAT_USE_TLS */
+
+static void
+test_tls(void)
+{
+	unit_test_start();
+
+	const char *cert_file = "test_tls_cert.pem";
+	const char *key_file = "test_tls_key.pem";
+	struct chat_server *s = chat_server_new();
+#if !CHAT_USE_TLS
+	unit_check(chat_server_set_tls(s, cert_file, key_file) ==
+		   CHAT_ERR_NOT_IMPLEMENTED, "built without TLS");
+	chat_server_delete(s);
+#else
+	unit_check(chat_server_set_tls(s, "no_cert.pem", "no_key.pem") ==
+		   CHAT_ERR_INVALID_ARGUMENT, "no files");
+	test_tls_make_cert(cert_file, key_file);
+	unit_check(chat_server_set_tls(s, cert_file, key_file) == 0, "set");
+	unit_fail_if(chat_server_set_thread_count(s, 1) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_get_backend(s) == CHAT_BACKEND_POLL,
+		   "poll backend");
+	unit_check(chat_server_set_tls(s, cert_file, key_file) ==
+		   CHAT_ERR_ALREADY_STARTED, "too late to set");
+	uint16_t port = server_get_port(s);
+
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	SSL *c1 = test_tls_connect(ctx, port);
+	SSL *c2 = test_tls_connect(ctx, port);
+	char buf[64];
+	/* The same kernel as the server's, both have kTLS or neither. */
+	if (BIO_get_ktls_send(SSL_get_wbio(c1))) {
+		unit_fail_if(SSL_write(c1, "hello\n", 6) != 6);
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(s)) == NULL)
+			chat_server_update(s, -1);
+		unit_check(strcmp(msg->data, "hello") == 0, "received");
+		chat_message_delete(msg);
+		int rc = SSL_read(c2, buf, sizeof(buf));
+		unit_check(rc == 6 && memcmp(buf, "hello\n", 6) == 0,
+			   "broadcast over kTLS");
+	} else {
+		unit_check(SSL_read(c1, buf, sizeof(buf)) <= 0,
+			   "closed without kTLS");
+	}
+	test_tls_close(c1);
+	test_tls_close(c2);
+	SSL_CTX_free(ctx);
+	chat_server_delete(s);
+	unlink(cert_file);
+	unlink(key_file);
+#endif
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -700,6 +1747,19 @@ main(int argc, char **argv)
 	test_stress();
 	test_big_author();
 	test_server_feed();
+	test_stats();
+	test_threads();
+	test_output_budget();
+	test_framing();
+	test_messages_outlive_server();
+	test_backends();
+	test_connect();
+	test_tcp_options();
+	test_rooms();
+	test_history();
+	test_tls();
+	test_multicast();
+	test_client_flush();
 
 	unit_test_finish();
 	return 0;
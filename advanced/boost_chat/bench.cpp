@@ -0,0 +1,249 @@
+#include "chat.h"
+#include "chat_client.h"
+#include "chat_server.h"
+
+#include <algorithm>
+#include <atomic>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <chrono>
+#include <cstdio>
+#include <new>
+#include <thread>
+
+// Each client sends to all the others, the server consumes everything too. The same
+// load is run with the peers on strands of a shared context and with the peers on the
+// shards, for each thread count, so the numbers can be compared side by side.
+//
+// The latency is from the feed to the receipt by another client, including the time
+// in the queues. Without a rate all the messages are fed at once, so it is mostly the
+// queueing. With a rate, the clients feed a message each per 1/rate of a second. The allocations are all the operator new calls in the process during
+// the run, divided by the count of the sent messages.
+
+static std::atomic<uint64_t> bench_alloc_count{0};
+
+void*
+operator new(
+	size_t size)
+{
+	bench_alloc_count.fetch_add(1, std::memory_order_relaxed);
+	void* res = malloc(size == 0 ? 1 : size);
+	if (res == nullptr)
+		throw std::bad_alloc();
+	return res;
+}
+
+void
+operator delete(
+	void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void
+operator delete(
+	void* ptr,
+	size_t /* size */) noexcept
+{
+	free(ptr);
+}
+
+static uint64_t
+bench_now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+struct bench_cfg final
+{
+	uint32_t m_thread_count;
+	// 0 means the peers are on strands of the main context.
+	uint32_t m_shard_count;
+	uint32_t m_client_count;
+	uint32_t m_msg_count;
+	uint32_t m_msg_size;
+	// Messages per second of each client, 0 for as fast as possible.
+	uint32_t m_rate;
+};
+
+struct bench_result final
+{
+	double m_msgs_per_sec;
+	uint32_t m_p50_us;
+	uint32_t m_p99_us;
+	double m_allocs_per_msg;
+};
+
+struct bench_receiver final
+{
+	std::unique_ptr<chat_client> m_cli;
+	// Only touched by the receipt callbacks, which go one at a time.
+	std::vector<uint32_t> m_latencies;
+	// Captures just the receiver, so its copies fit into std::function without
+	// allocations of their own.
+	chat_client_on_msg_f m_on_msg;
+	std::atomic<uint64_t>* m_delivered;
+	uint64_t m_expected;
+	event* m_done;
+};
+
+static uint32_t
+bench_percentile(
+	const std::vector<uint32_t>& values,
+	double p)
+{
+	if (values.empty())
+		return 0;
+	return values[(size_t)(p / 100 * (values.size() - 1))];
+}
+
+static chat_errcode
+bench_connect(
+	chat_client& cli,
+	uint16_t port)
+{
+	event ev;
+	chat_errcode err;
+	cli.connect_async("localhost:" + std::to_string(port), [&](chat_errcode res) {
+		err = res;
+		ev.send();
+	});
+	ev.recv();
+	return err;
+}
+
+static bench_result
+bench_run(
+	const bench_cfg& cfg)
+{
+	boost::asio::io_context ctx;
+	boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work(
+		ctx.get_executor());
+	// In the sharded mode the peers have own threads, the main context only serves
+	// the clients and the server's requests.
+	uint32_t ctx_thread_count = cfg.m_shard_count == 0 ? cfg.m_thread_count : 1;
+	std::vector<std::thread> threads;
+	for (uint32_t i = 0; i < ctx_thread_count; ++i)
+		threads.emplace_back([&ctx]() { ctx.run(); });
+
+	bench_result res;
+	{
+	chat_server server(ctx, cfg.m_shard_count);
+	if (server.start(0) != CHAT_ERR_NONE)
+		abort();
+	std::vector<bench_receiver> clis(cfg.m_client_count);
+	const uint64_t expected = (uint64_t)cfg.m_client_count *
+		(cfg.m_client_count - 1) * cfg.m_msg_count;
+	std::atomic<uint64_t> delivered{0};
+	event done;
+	for (uint32_t i = 0; i < cfg.m_client_count; ++i) {
+		bench_receiver& r = clis[i];
+		r.m_cli = std::make_unique<chat_client>(ctx, "c" + std::to_string(i));
+		if (bench_connect(*r.m_cli, server.port()) != CHAT_ERR_NONE)
+			abort();
+		r.m_latencies.reserve((size_t)(cfg.m_client_count - 1) * cfg.m_msg_count);
+		r.m_delivered = &delivered;
+		r.m_expected = expected;
+		r.m_done = &done;
+		r.m_on_msg = [&r](chat_errcode err, std::unique_ptr<chat_message> msg) {
+			if (err != CHAT_ERR_NONE)
+				return;
+			uint64_t sent = strtoull(msg->m_data.c_str(), nullptr, 10);
+			r.m_latencies.push_back((uint32_t)((bench_now_ns() - sent) / 1000));
+			if (r.m_delivered->fetch_add(1) + 1 == r.m_expected)
+				r.m_done->send();
+			r.m_cli->recv_async(chat_client_on_msg_f(r.m_on_msg));
+		};
+		r.m_cli->recv_async(chat_client_on_msg_f(r.m_on_msg));
+	}
+	// The server gets all the messages as well and must not pile them up.
+	uint64_t server_left = (uint64_t)cfg.m_client_count * cfg.m_msg_count;
+	event server_done;
+	chat_server_on_batch_f on_batch = [&](chat_errcode err,
+		chat_server_msgs msgs) {
+		if (err != CHAT_ERR_NONE)
+			return;
+		server_left -= msgs.size();
+		if (server_left == 0)
+			server_done.send();
+		else
+			server.recv_batch_async(1024, chat_server_on_batch_f(on_batch));
+	};
+	server.recv_batch_async(1024, chat_server_on_batch_f(on_batch));
+	// Let the clients introduce themselves before the measurement.
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	uint64_t alloc_start = bench_alloc_count.load();
+	uint64_t start = bench_now_ns();
+	std::string msg;
+	for (uint32_t i = 0; i < cfg.m_msg_count; ++i) {
+		if (cfg.m_rate != 0) {
+			std::this_thread::sleep_until(std::chrono::steady_clock::time_point(
+				std::chrono::nanoseconds(start + i * 1000000000ull / cfg.m_rate)));
+		}
+		for (bench_receiver& r : clis) {
+			msg = std::to_string(bench_now_ns());
+			msg.resize(std::max<size_t>(cfg.m_msg_size, msg.size() + 1), 'x');
+			msg.back() = '\n';
+			r.m_cli->feed_async(msg);
+		}
+	}
+	done.recv();
+	server_done.recv();
+	uint64_t duration = bench_now_ns() - start;
+	uint64_t alloc_count = bench_alloc_count.load() - alloc_start;
+
+	std::vector<uint32_t> latencies;
+	latencies.reserve(expected);
+	for (bench_receiver& r : clis)
+		latencies.insert(latencies.end(), r.m_latencies.begin(), r.m_latencies.end());
+	std::sort(latencies.begin(), latencies.end());
+	res.m_msgs_per_sec = (double)expected * 1000000000 / duration;
+	res.m_p50_us = bench_percentile(latencies, 50);
+	res.m_p99_us = bench_percentile(latencies, 99);
+	res.m_allocs_per_msg = (double)alloc_count / cfg.m_client_count / cfg.m_msg_count;
+	}
+	work.reset();
+	for (std::thread& t : threads)
+		t.join();
+	return res;
+}
+
+int
+main(
+	int argc,
+	char** argv)
+{
+	bench_cfg cfg;
+	cfg.m_client_count = argc > 1 ? atoi(argv[1]) : 8;
+	cfg.m_msg_count = argc > 2 ? atoi(argv[2]) : 5000;
+	cfg.m_msg_size = argc > 3 ? atoi(argv[3]) : 64;
+	cfg.m_rate = argc > 4 ? atoi(argv[4]) : 0;
+	if (cfg.m_client_count < 2 or cfg.m_msg_count == 0) {
+		printf("Usage: %s [clients >= 2] [messages per client] [message size] "
+			"[rate per client]\n", argv[0]);
+		return -1;
+	}
+	printf("%u clients, %u messages each, %u bytes, ", cfg.m_client_count,
+		cfg.m_msg_count, cfg.m_msg_size);
+	if (cfg.m_rate == 0)
+		printf("all at once");
+	else
+		printf("%u per second each", cfg.m_rate);
+	printf(", every message goes to all the other clients\n");
+	printf("threads  mode     delivered/s  p50 us  p99 us  allocs/msg\n");
+	for (uint32_t thread_count : {1, 2, 4, 8}) {
+		for (bool is_sharded : {false, true}) {
+			cfg.m_thread_count = thread_count;
+			cfg.m_shard_count = is_sharded ? thread_count : 0;
+			bench_result res = bench_run(cfg);
+			printf("%7u  %-7s  %11.0lf  %6u  %6u  %10.2lf\n", thread_count,
+				is_sharded ? "shards" : "strands", res.m_msgs_per_sec, res.m_p50_us,
+				res.m_p99_us, res.m_allocs_per_msg);
+		}
+	}
+	return 0;
+}
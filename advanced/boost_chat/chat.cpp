@@ -1,5 +1,7 @@
 #include "chat.h"
 
+#include <cctype>
+
 event::event() : m_is_set(false) {}
 
 void
@@ -7,6 +9,7 @@ event::send()
 {
 	std::unique_lock lock(m_mutex);
 	m_is_set = true;
+	m_cond.notify_all();
 }
 
 void
@@ -16,3 +19,16 @@ event::recv()
 	while (not m_is_set)
 		m_cond.wait(lock);
 }
+
+std::string_view
+chat_trim(
+	std::string_view text)
+{
+	size_t begin = 0;
+	size_t end = text.length();
+	while (begin < end and isspace((unsigned char)text[begin]))
+		++begin;
+	while (end > begin and isspace((unsigned char)text[end - 1]))
+		--end;
+	return text.substr(begin, end - begin);
+}
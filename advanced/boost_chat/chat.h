@@ -1,12 +1,20 @@
 #pragma once
 
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 
 enum
 {
 	CHAT_RECV_BUF_SIZE = 128,
+	// Enough for the handlers of a socket operation with the strand around it.
+	CHAT_HANDLER_MEMORY_SIZE = 1024,
+	// Enough for a std::function and for a coroutine's handler with its executor.
+	CHAT_RECV_CB_SIZE = 192,
 };
 
 enum chat_errcode
@@ -32,6 +40,206 @@ struct chat_message
 	// <YOUR CODE IF NEEDED>
 };
 
+// What a coroutine receives instead of the callback arguments.
+using chat_recv_result = std::tuple<chat_errcode, std::unique_ptr<chat_message>>;
+
+// The text without the spaces on both sides.
+std::string_view
+chat_trim(
+	std::string_view text);
+
+// Memory for the handlers of one kind of asynchronous operations, reused by each next
+// one. Those go one at a time, like the receipts of a socket, so one block is enough.
+// When it is busy or too small, the heap is used. The operation's handler is freed
+// before its callback runs, so the next operation started in the callback finds the
+// block free again.
+class chat_handler_memory final
+{
+public:
+	chat_handler_memory() : m_is_used(false) {}
+	chat_handler_memory(const chat_handler_memory&) = delete;
+	chat_handler_memory& operator=(const chat_handler_memory&) = delete;
+
+	void*
+	allocate(
+		size_t size)
+	{
+		if (not m_is_used and size <= sizeof(m_storage)) {
+			m_is_used = true;
+			return &m_storage;
+		}
+		return ::operator new(size);
+	}
+
+	void
+	deallocate(
+		void* ptr)
+	{
+		if (ptr == &m_storage) {
+			m_is_used = false;
+			return;
+		}
+		::operator delete(ptr);
+	}
+
+private:
+	std::aligned_storage_t<CHAT_HANDLER_MEMORY_SIZE> m_storage;
+	bool m_is_used;
+};
+
+template <typename T>
+class chat_handler_allocator final
+{
+public:
+	using value_type = T;
+
+	explicit chat_handler_allocator(
+		chat_handler_memory& mem) : m_mem(&mem) {}
+
+	template <typename U>
+	chat_handler_allocator(
+		const chat_handler_allocator<U>& other) : m_mem(other.m_mem) {}
+
+	T*
+	allocate(
+		size_t count) { return static_cast<T*>(m_mem->allocate(sizeof(T) * count)); }
+
+	void
+	deallocate(
+		T* ptr,
+		size_t /* count */) { m_mem->deallocate(ptr); }
+
+	template <typename U>
+	bool
+	operator==(
+		const chat_handler_allocator<U>& other) const { return m_mem == other.m_mem; }
+
+	template <typename U>
+	bool
+	operator!=(
+		const chat_handler_allocator<U>& other) const { return m_mem != other.m_mem; }
+
+private:
+	chat_handler_memory* m_mem;
+
+	template <typename U>
+	friend class chat_handler_allocator;
+};
+
+// A handler which has its memory in the given block. Boost finds the allocator by the
+// nested type and get_allocator(), for the operation and for the strand around it.
+template <typename Handler>
+class chat_alloc_handler final
+{
+public:
+	using allocator_type = chat_handler_allocator<Handler>;
+
+	chat_alloc_handler(
+		chat_handler_memory& mem,
+		Handler&& handler) : m_mem(&mem), m_handler(std::move(handler)) {}
+
+	allocator_type
+	get_allocator() const noexcept { return allocator_type(*m_mem); }
+
+	template <typename... Args>
+	void
+	operator()(
+		Args&&... args) { m_handler(std::forward<Args>(args)...); }
+
+private:
+	chat_handler_memory* m_mem;
+	Handler m_handler;
+};
+
+template <typename Handler>
+inline chat_alloc_handler<std::decay_t<Handler>>
+chat_make_alloc_handler(
+	chat_handler_memory& mem,
+	Handler&& handler)
+{
+	return chat_alloc_handler<std::decay_t<Handler>>(mem, std::forward<Handler>(handler));
+}
+
+// A view of the buffers, so a write operation doesn't copy the vector of them. Not
+// final, Boost detects the buffer sequences by deriving from them.
+template <typename Buffer>
+struct chat_buffer_view
+{
+	using value_type = Buffer;
+	using const_iterator = const Buffer*;
+
+	explicit chat_buffer_view(
+		const std::vector<Buffer>& bufs)
+		: m_begin(bufs.data()), m_end(bufs.data() + bufs.size()) {}
+
+	const_iterator
+	begin() const { return m_begin; }
+
+	const_iterator
+	end() const { return m_end; }
+
+	const_iterator m_begin;
+	const_iterator m_end;
+};
+
+// The callback of one receipt request, called once. Stored inline when it is small
+// enough, so the requests can be reused without heap allocations.
+class chat_recv_cb final
+{
+public:
+	chat_recv_cb() : m_obj(nullptr), m_call(nullptr), m_destroy(nullptr) {}
+	chat_recv_cb(const chat_recv_cb&) = delete;
+	chat_recv_cb& operator=(const chat_recv_cb&) = delete;
+	~chat_recv_cb() { reset(); }
+
+	template <typename F>
+	void
+	emplace(
+		F&& f)
+	{
+		using T = std::decay_t<F>;
+		reset();
+		if (sizeof(T) <= sizeof(m_storage) and alignof(T) <= alignof(decltype(m_storage)))
+			m_obj = new (&m_storage) T(std::forward<F>(f));
+		else
+			m_obj = new T(std::forward<F>(f));
+		m_call = [](void* obj, chat_errcode err, std::unique_ptr<chat_message>&& msg) {
+			(*static_cast<T*>(obj))(err, std::move(msg));
+		};
+		m_destroy = [](void* obj, bool is_inline) {
+			if (is_inline)
+				static_cast<T*>(obj)->~T();
+			else
+				delete static_cast<T*>(obj);
+		};
+	}
+
+	// The callback is destroyed right after the call.
+	void
+	operator()(
+		chat_errcode err,
+		std::unique_ptr<chat_message> msg)
+	{
+		m_call(m_obj, err, std::move(msg));
+		reset();
+	}
+
+	void
+	reset()
+	{
+		if (m_obj == nullptr)
+			return;
+		m_destroy(m_obj, m_obj == &m_storage);
+		m_obj = nullptr;
+	}
+
+private:
+	std::aligned_storage_t<CHAT_RECV_CB_SIZE> m_storage;
+	void* m_obj;
+	void (*m_call)(void*, chat_errcode, std::unique_ptr<chat_message>&&);
+	void (*m_destroy)(void*, bool);
+};
+
 struct event
 {
 public:
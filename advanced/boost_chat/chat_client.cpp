@@ -4,15 +4,19 @@
 #include <boost/asio/bind_executor.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/io_context_strand.hpp>
+#include <boost/asio/connect.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/executor_work_guard.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/write.hpp>
+#include <cstring>
 #include <list>
+#include <mutex>
 
 struct chat_client_request final
 {
-	chat_client_request(
-		chat_client_on_msg_f&& cb) : m_cb(std::move(cb)) {}
-
-	chat_client_on_msg_f m_cb;
+	chat_recv_cb m_cb;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -34,10 +38,19 @@ public:
 	recv_async(
 		chat_client_on_msg_f&& cb);
 
+	// The handler is of an asio operation, called in its own executor.
+	template <typename Handler>
+	void
+	recv_async_handler(
+		Handler&& handler);
+
 	void
 	feed_async(
 		std::string_view text);
 
+	void
+	stop();
+
 private:
 	void
 	priv_in_strand_on_resolve(
@@ -50,9 +63,14 @@ private:
 		const boost::system::error_code& err,
 		chat_client_on_connect_f&& cb);
 
+	template <typename F>
 	void
 	priv_in_strand_on_new_request(
-		std::unique_ptr<chat_client_request> req);
+		F&& cb);
+
+	void
+	priv_in_strand_serve_requests(
+		chat_errcode err);
 
 	void
 	priv_in_strand_recv();
@@ -63,8 +81,7 @@ private:
 		std::size_t size);
 
 	void
-	priv_in_strand_on_new_feed(
-		std::string_view text);
+	priv_in_strand_on_new_feed();
 
 	void
 	priv_in_strand_send();
@@ -74,26 +91,60 @@ private:
 		const boost::system::error_code& err,
 		std::size_t size);
 
+	void
+	priv_in_strand_close(
+		chat_errcode err);
+
 	// Strand "serializes" all callbacks associated with it. It means the strand will
 	// invoke them one by one, never in more than one thread at a time. That in turn
 	// means, that inside strand callbacks you don't need to protect its data with any
 	// mutexes.
 	boost::asio::io_context::strand m_strand;
 	boost::asio::ip::tcp::socket m_sock;
+	// The receipts, the sendings and the feed posts go one at a time each, so every next
+	// one reuses the handler memory of the previous one.
+	chat_handler_memory m_recv_mem;
+	chat_handler_memory m_send_mem;
+	chat_handler_memory m_feed_mem;
 
 	// Requests which are waiting for data.
-	std::list<std::unique_ptr<chat_client_request>> m_reqs;
+	std::list<chat_client_request> m_reqs;
+	// The served requests, for the next ones. They are moved between the lists without
+	// allocations.
+	std::list<chat_client_request> m_free_reqs;
 	// Full messages waiting to be delivered to requests.
 	std::list<std::unique_ptr<chat_message>> m_in_msgs;
-	// Input buffer for reading the next incoming messages.
+	// Input buffer for reading the next incoming messages. The received data is in
+	// [m_in_pos, m_in_size), the rest is free space for the next receipts.
 	std::string m_in_buf;
-	// Output buffer for prearing the next outgoing messages.
+	size_t m_in_pos;
+	size_t m_in_size;
+	// Where the search of the next line end continues from.
+	size_t m_in_scan;
+	// Each message comes as two lines, the author and the data.
+	std::unique_ptr<chat_message> m_in_msg;
+	// The outgoing data. m_out_buf is being sent with one write and stays unchanged
+	// until it ends. The data fed meanwhile is appended to m_out_next and goes with the
+	// next write, all at once. They are swapped, so both keep their capacity. Starts
+	// with the name, the first line the server expects.
 	std::string m_out_buf;
+	std::string m_out_next;
+	// The feeds from any thread are appended here. Only the first one since the strand
+	// took them posts it, the others just wait to be taken with it.
+	std::mutex m_feed_mutex;
+	std::string m_feed_in;
+	bool m_is_feed_posted;
+	// The feeds taken by the strand. Swapped with m_feed_in.
+	std::string m_feed_taken;
+	// The fed data not ended with a new line yet.
+	std::string m_feed_buf;
+	bool m_is_connected;
+	bool m_is_sending;
+	// The error for all the next requests, once the connection is closed.
+	chat_errcode m_close_err;
 
 	boost::asio::ip::tcp::resolver m_resolver;
 	const std::string m_name;
-
-	// <YOUR CODE IF NEEDED>
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -108,7 +159,7 @@ chat_client::chat_client(
 
 chat_client::~chat_client()
 {
-	// <YOUR CODE IF NEEDED>
+	m_conn->stop();
 }
 
 void
@@ -126,6 +177,18 @@ chat_client::recv_async(
 	m_conn->recv_async(std::move(cb));
 }
 
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+boost::asio::awaitable<chat_recv_result>
+chat_client::co_recv()
+{
+	return boost::asio::async_initiate<const boost::asio::use_awaitable_t<>&,
+		void(chat_errcode, std::unique_ptr<chat_message>)>(
+		[conn = m_conn](auto&& handler) {
+		conn->recv_async_handler(std::move(handler));
+	}, boost::asio::use_awaitable);
+}
+#endif
+
 void
 chat_client::feed_async(
 	std::string_view text)
@@ -140,49 +203,74 @@ chat_client_peer::chat_client_peer(
 	std::string_view name)
 	: m_strand(ioCtx)
 	, m_sock(ioCtx)
+	, m_in_pos(0)
+	, m_in_size(0)
+	, m_in_scan(0)
+	, m_is_feed_posted(false)
+	, m_is_connected(false)
+	, m_is_sending(false)
+	, m_close_err(CHAT_ERR_NONE)
 	, m_resolver(ioCtx)
 	, m_name(name)
 {
-	// <YOUR CODE IF NEEDED>
+	m_out_next.append(m_name).append(1, '\n');
 }
 
 chat_client_peer::~chat_client_peer()
 {
-	for (std::unique_ptr<chat_client_request>& r : m_reqs)
-		r->m_cb(CHAT_ERR_CANCELED, {});
+	for (chat_client_request& r : m_reqs)
+		r.m_cb(CHAT_ERR_CANCELED, {});
 	m_reqs.clear();
-
-	// <YOUR CODE IF NEEDED>
 }
 
 void
 chat_client_peer::connect_async(
-	std::string_view /* endpoint */,
-	chat_client_on_connect_f&& /* cb */)
+	std::string_view endpoint,
+	chat_client_on_connect_f&& cb)
 {
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Extract host and port from the endpoint string.
-	//
-	// 2) Start resolving them to an IP:
-	// m_resolver.async_resolve(host, port, boost::asio::bind_executor(m_strand,
-	//	[ref = shared_from_this(), this, cb = std::move(cb)](
-	//		const boost::system::error_code& err,
-	//		boost::asio::ip::tcp::resolver::results_type results) {
-	//	priv_in_strand_on_resolve(err, std::move(cb), results);
-	// }));
+	size_t pos = endpoint.rfind(':');
+	if (pos == std::string_view::npos) {
+		boost::asio::post(m_strand, [cb = std::move(cb)]() {
+			cb(CHAT_ERR_INVALID_ARGUMENT);
+		});
+		return;
+	}
+	std::string host(endpoint.substr(0, pos));
+	std::string port(endpoint.substr(pos + 1));
+	m_resolver.async_resolve(host, port, boost::asio::bind_executor(m_strand,
+		[ref = shared_from_this(), this, cb = std::move(cb)](
+			const boost::system::error_code& err,
+			boost::asio::ip::tcp::resolver::results_type results) mutable {
+		priv_in_strand_on_resolve(err, std::move(cb), results);
+	}));
 }
 
 void
 chat_client_peer::recv_async(
 	chat_client_on_msg_f&& cb)
 {
-	std::unique_ptr<chat_client_request> req =
-		std::make_unique<chat_client_request>(std::move(cb));
 	boost::asio::post(m_strand,
-		[ref = shared_from_this(), req = std::move(req), this]() mutable {
-		priv_in_strand_on_new_request(std::move(req));
+		[ref = shared_from_this(), cb = std::move(cb), this]() mutable {
+		priv_in_strand_on_new_request(std::move(cb));
+	});
+}
+
+template <typename Handler>
+void
+chat_client_peer::recv_async_handler(
+	Handler&& handler)
+{
+	boost::asio::post(m_strand, [ref = shared_from_this(), this,
+		handler = std::move(handler)]() mutable {
+		// The handler's executor must not run out of work while it waits.
+		priv_in_strand_on_new_request([work = boost::asio::make_work_guard(handler),
+			handler = std::move(handler)](chat_errcode err,
+			std::unique_ptr<chat_message> msg) mutable {
+			boost::asio::dispatch(work.get_executor(), [handler = std::move(handler), err,
+				msg = std::move(msg)]() mutable {
+				handler(err, std::move(msg));
+			});
+		});
 	});
 }
 
@@ -190,162 +278,262 @@ void
 chat_client_peer::feed_async(
 	std::string_view text)
 {
-	boost::asio::post(m_strand, std::bind(
-		&chat_client_peer::priv_in_strand_on_new_feed, shared_from_this(),
-		std::string(text)));
+	{
+		std::lock_guard lock(m_feed_mutex);
+		m_feed_in.append(text);
+		if (m_is_feed_posted)
+			return;
+		m_is_feed_posted = true;
+	}
+	// The strand frees the handler before taking the feeds under the mutex, so the next
+	// post finds the memory free.
+	boost::asio::post(m_strand, chat_make_alloc_handler(m_feed_mem, std::bind(
+		&chat_client_peer::priv_in_strand_on_new_feed, shared_from_this())));
+}
+
+void
+chat_client_peer::stop()
+{
+	boost::asio::post(m_strand, [ref = shared_from_this(), this]() {
+		priv_in_strand_close(CHAT_ERR_CANCELED);
+	});
 }
 
 void
 chat_client_peer::priv_in_strand_on_resolve(
-	const boost::system::error_code& /* err */,
-	chat_client_on_connect_f&& /* cb */,
-	boost::asio::ip::tcp::resolver::results_type /* results */)
+	const boost::system::error_code& err,
+	chat_client_on_connect_f&& cb,
+	boost::asio::ip::tcp::resolver::results_type results)
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Choose one of the results (it is an array).
-	// 2) Do
-	// m_sock.async_connect(endpoint, boost::asio::bind_executor(m_strand,
-	//	[ref = shared_from_this(), this, cb = std::move(cb)](
-	//		const boost::system::error_code& err) {
-	//	priv_in_strand_on_connect(err, std::move(cb));
-	// }));
+	if (m_close_err != CHAT_ERR_NONE) {
+		cb(m_close_err);
+		return;
+	}
+	if (err) {
+		cb(CHAT_ERR_NO_ADDR);
+		return;
+	}
+	// Tries the addresses one by one until one of them connects.
+	boost::asio::async_connect(m_sock, results, boost::asio::bind_executor(m_strand,
+		[ref = shared_from_this(), this, cb = std::move(cb)](
+			const boost::system::error_code& err,
+			const boost::asio::ip::tcp::endpoint&) mutable {
+		priv_in_strand_on_connect(err, std::move(cb));
+	}));
 }
 
 void
 chat_client_peer::priv_in_strand_on_connect(
-	const boost::system::error_code& /* err */,
-	chat_client_on_connect_f&& /* cb */)
+	const boost::system::error_code& err,
+	chat_client_on_connect_f&& cb)
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
+	if (m_close_err != CHAT_ERR_NONE) {
+		cb(m_close_err);
+		return;
+	}
+	if (err) {
+		cb(CHAT_ERR_SYS);
+		return;
+	}
+	m_is_connected = true;
+	priv_in_strand_send();
+	// The messages are received regardless of the requests, so the server never waits
+	// for this client to read.
+	priv_in_strand_recv();
+	cb(CHAT_ERR_NONE);
 }
 
+template <typename F>
 void
 chat_client_peer::priv_in_strand_on_new_request(
-	std::unique_ptr<chat_client_request> req)
+	F&& cb)
 {
 	assert(m_strand.running_in_this_thread());
-	if (not m_reqs.empty()) {
-		// Older requests are not served yet. Means we need to wait for them to be served
-		// to preserve the FIFO order.
-		m_reqs.emplace_back(std::move(req));
-		return;
-	}
-	if (not m_in_msgs.empty()) {
-		// Already have data to return. Then just return it.
-		req->m_cb(CHAT_ERR_NONE, std::move(m_in_msgs.front()));
+	if (m_free_reqs.empty())
+		m_free_reqs.emplace_back();
+	// The requests are served in the FIFO order. When there are ready messages or the
+	// connection is closed, the older requests are already served, so this one goes
+	// right away. Otherwise it waits for the receipt, which is always in progress
+	// while connected.
+	m_reqs.splice(m_reqs.end(), m_free_reqs, m_free_reqs.begin());
+	m_reqs.back().m_cb.emplace(std::forward<F>(cb));
+	priv_in_strand_serve_requests(m_close_err);
+}
+
+void
+chat_client_peer::priv_in_strand_serve_requests(
+	chat_errcode err)
+{
+	assert(m_strand.running_in_this_thread());
+	while (not m_reqs.empty() and not m_in_msgs.empty()) {
+		std::unique_ptr<chat_message> msg = std::move(m_in_msgs.front());
 		m_in_msgs.pop_front();
+		m_free_reqs.splice(m_free_reqs.begin(), m_reqs, m_reqs.begin());
+		m_free_reqs.front().m_cb(CHAT_ERR_NONE, std::move(msg));
+	}
+	if (err == CHAT_ERR_NONE)
 		return;
+	while (not m_reqs.empty()) {
+		m_free_reqs.splice(m_free_reqs.begin(), m_reqs, m_reqs.begin());
+		m_free_reqs.front().m_cb(err, {});
 	}
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// No ready messages. It means you need to receive some new ones.
-	//
-	// 1) Save the request for serving it later.
-	// m_reqs.emplace_back(std::move(req));
-	//
-	// 2) priv_in_strand_recv();
 }
 
 void
 chat_client_peer::priv_in_strand_recv()
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Ensure you have enough space in m_in_buf. Reserve at least CHAT_RECV_BUF_SIZE.
-	// Grow it x2 when need more.
-	//
-	// 2) Receive more data.
-	// uint8_t* buf = m_in_buf.data() + m_in_buf.length();
-	// size_t size = m_in_buf.capacity() - m_in_buf.length();
-	// m_sock.async_receive(boost::asio::buffer(buf, size),
-	//	boost::asio::bind_executor(strand_,
-	//		std::bind(&chat_client_peer::priv_in_strand_on_recv, shared_from_this(),
-	//		std::placeholder::_1, std::placeholders::_2)));
+	if (m_close_err != CHAT_ERR_NONE)
+		return;
+	// Move the unparsed rest to the beginning when more space is needed, and grow x2
+	// when it is still not enough.
+	if (m_in_buf.size() - m_in_size < CHAT_RECV_BUF_SIZE and m_in_pos > 0) {
+		memmove(m_in_buf.data(), m_in_buf.data() + m_in_pos, m_in_size - m_in_pos);
+		m_in_size -= m_in_pos;
+		m_in_scan -= m_in_pos;
+		m_in_pos = 0;
+	}
+	if (m_in_buf.size() - m_in_size < CHAT_RECV_BUF_SIZE) {
+		m_in_buf.resize(std::max<size_t>(m_in_buf.size() * 2,
+			CHAT_RECV_BUF_SIZE));
+	}
+	m_sock.async_receive(boost::asio::buffer(m_in_buf.data() + m_in_size,
+		m_in_buf.size() - m_in_size), boost::asio::bind_executor(m_strand,
+		chat_make_alloc_handler(m_recv_mem, std::bind(
+		&chat_client_peer::priv_in_strand_on_recv, shared_from_this(),
+		std::placeholders::_1, std::placeholders::_2))));
 }
 
 void
 chat_client_peer::priv_in_strand_on_recv(
-	const boost::system::error_code& /* err */,
-	std::size_t /* size */)
+	const boost::system::error_code& err,
+	std::size_t size)
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Start considering the newly received bytes.
-	// m_in_buf.resize(m_in_buf.length() + size);
-	//
-	// 2) Parse the buffer trying to extract complete messages. Put each extracted one
-	// into m_in_msgs.
-	//
-	// 3) Hand the received messages from m_in_msgs to pending requests in m_reqs.
-	//
-	// 4) Keep receiving until you get at least one full message.
-	//
-	// In your code you might make m_in_buf more efficient.
+	if (m_close_err != CHAT_ERR_NONE)
+		return;
+	if (err) {
+		priv_in_strand_close(CHAT_ERR_SYS);
+		return;
+	}
+	m_in_size += size;
+	const char* data = m_in_buf.data();
+	const char* end;
+	while ((end = static_cast<const char*>(memchr(data + m_in_scan, '\n',
+		m_in_size - m_in_scan))) != nullptr) {
+		size_t line_end = end - data;
+		std::string_view line(data + m_in_pos, line_end - m_in_pos);
+		m_in_pos = m_in_scan = line_end + 1;
+		if (not m_in_msg) {
+			m_in_msg = std::make_unique<chat_message>();
+			m_in_msg->m_author = line;
+			continue;
+		}
+		m_in_msg->m_data = line;
+		m_in_msgs.emplace_back(std::move(m_in_msg));
+	}
+	m_in_scan = m_in_size;
+	if (m_in_pos == m_in_size)
+		m_in_pos = m_in_size = m_in_scan = 0;
+	priv_in_strand_serve_requests(CHAT_ERR_NONE);
+	priv_in_strand_recv();
 }
 
 void
-chat_client_peer::priv_in_strand_on_new_feed(
-	std::string_view /* text */)
+chat_client_peer::priv_in_strand_on_new_feed()
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Append the data to the pending output buffer m_out_buf.
-	// 2) priv_in_strand_send();
+	{
+		std::lock_guard lock(m_feed_mutex);
+		std::swap(m_feed_in, m_feed_taken);
+		m_is_feed_posted = false;
+	}
+	// All the feeds since the last time are handled as one, it is the same stream.
+	std::string& text = m_feed_taken;
+	// Usually the feeds are whole lines, already clean. Then the fed data is sent as
+	// is, without copying when nothing else is queued.
+	if (m_feed_buf.empty() and not text.empty() and text.back() == '\n') {
+		std::string_view rest = text;
+		size_t end;
+		while ((end = rest.find('\n')) != std::string_view::npos) {
+			std::string_view line = rest.substr(0, end);
+			if (line.empty() or chat_trim(line).size() != line.size())
+				break;
+			rest.remove_prefix(end + 1);
+		}
+		if (rest.empty()) {
+			if (m_out_next.empty())
+				std::swap(m_out_next, text);
+			else
+				m_out_next.append(text);
+			text.clear();
+			priv_in_strand_send();
+			return;
+		}
+	}
+	size_t pos = m_feed_buf.length();
+	m_feed_buf.append(text);
+	text.clear();
+	size_t begin = 0;
+	size_t end;
+	while ((end = m_feed_buf.find('\n', pos)) != std::string::npos) {
+		std::string_view line = chat_trim(std::string_view(
+			m_feed_buf.data() + begin, end - begin));
+		begin = pos = end + 1;
+		if (not line.empty())
+			m_out_next.append(line).append(1, '\n');
+	}
+	m_feed_buf.erase(0, begin);
+	priv_in_strand_send();
 }
 
 void
 chat_client_peer::priv_in_strand_send()
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// If the buffer m_out_buf contains a complete message, then send it using
-	// m_sock.async_send(boost::asio::buffer(m_out_buf.data(), m_out_buf.length()),
-	//	boost::asio::bind_executor(m_strand,
-	//		std::bind(&chat_client_peer::priv_in_strand_on_send, shared_from_this(),
-	//			std::placeholders::_1, std::placeholders::_2)));
-	//
-	// You don't have to send whole messages. Could send the parts right away if your
-	// protocol is fine with that. But you might need to send full ones if you encode them
-	// anyhow. For example, prefix each message with its total size to make receipt on the
-	// other end more optimal.
-	//
-	// When m_out_buf is needed (only if you are sending full messages), you should keep
-	// it valid and unchanged until the sending is complete. Which means you might need a
-	// second buffer where you would store newer messages while the older ones are being
-	// sent.
+	if (not m_is_connected or m_close_err != CHAT_ERR_NONE)
+		return;
+	if (m_is_sending or m_out_next.empty())
+		return;
+	// One contiguous buffer, so the write is one syscall however many feeds it has.
+	std::swap(m_out_buf, m_out_next);
+	m_is_sending = true;
+	boost::asio::async_write(m_sock, boost::asio::buffer(m_out_buf),
+		boost::asio::bind_executor(m_strand, chat_make_alloc_handler(m_send_mem,
+		std::bind(&chat_client_peer::priv_in_strand_on_send, shared_from_this(),
+		std::placeholders::_1, std::placeholders::_2))));
 }
 
 void
 chat_client_peer::priv_in_strand_on_send(
-	const boost::system::error_code& /* err */,
+	const boost::system::error_code& err,
 	std::size_t /* size */)
 {
 	assert(m_strand.running_in_this_thread());
+	m_is_sending = false;
+	if (m_close_err != CHAT_ERR_NONE)
+		return;
+	if (err) {
+		priv_in_strand_close(CHAT_ERR_SYS);
+		return;
+	}
+	// All is sent, async_write doesn't stop on the partial writes.
+	m_out_buf.clear();
+	priv_in_strand_send();
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// Be careful about partial writes. The sent size might be < m_out_buf.length(). Then
-	// you must send the rest again. Keep sending as long as you have something to send.
+void
+chat_client_peer::priv_in_strand_close(
+	chat_errcode err)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_close_err != CHAT_ERR_NONE)
+		return;
+	m_close_err = err;
+	m_resolver.cancel();
+	boost::system::error_code ignore;
+	m_sock.close(ignore);
+	priv_in_strand_serve_requests(err);
 }
@@ -2,6 +2,9 @@
 
 #include "chat.h"
 
+// Boost 1.74 awaitable.hpp uses std::exchange without including it.
+#include <utility>
+#include <boost/asio/awaitable.hpp>
 #include <functional>
 #include <memory>
 
@@ -27,6 +30,13 @@ public:
 	recv_async(
 		chat_client_on_msg_f&& c);
 
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+	// Same as recv_async(), for a coroutine. It is resumed in its own executor, not in
+	// the client's strand.
+	boost::asio::awaitable<chat_recv_result>
+	co_recv();
+#endif
+
 	void
 	feed_async(
 		std::string_view text);
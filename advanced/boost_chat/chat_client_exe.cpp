@@ -5,7 +5,6 @@
 #include <boost/asio/io_context_strand.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/posix/stream_descriptor.hpp>
-#include <boost/asio/read.hpp>
 #include <iostream>
 
 class chat_client_app final
@@ -57,8 +56,12 @@ chat_client_app::chat_client_app(
 	, m_input(m_ioctx, dup(STDIN_FILENO))
 	, m_res(0)
 {
-	m_cli.connect_async(endpoint, boost::asio::bind_executor(m_strand,
-		std::bind(&chat_client_app::priv_on_connect, this, std::placeholders::_1)));
+	// The callbacks are type-erased and lose their executors. So they are posted to
+	// the strand explicitly.
+	m_cli.connect_async(endpoint, [this](chat_errcode err) {
+		boost::asio::post(m_strand, std::bind(&chat_client_app::priv_on_connect, this,
+			err));
+	});
 }
 
 int
@@ -73,16 +76,19 @@ void
 chat_client_app::priv_recv_next()
 {
 	assert(m_strand.running_in_this_thread());
-	m_cli.recv_async(boost::asio::bind_executor(m_strand,
-		std::bind(&chat_client_app::priv_on_recv, this, std::placeholders::_1,
-			std::placeholders::_2)));
+	m_cli.recv_async([this](chat_errcode err, std::unique_ptr<chat_message> msg) {
+		boost::asio::post(m_strand, [this, err, msg = std::move(msg)]() mutable {
+			priv_on_recv(err, std::move(msg));
+		});
+	});
 }
 
 void
 chat_client_app::priv_read_next()
 {
 	assert(m_strand.running_in_this_thread());
-	boost::asio::async_read(m_input, boost::asio::buffer(m_in_buf, CHAT_RECV_BUF_SIZE),
+	// Some, not all. Otherwise a short line would wait for more input.
+	m_input.async_read_some(boost::asio::buffer(m_in_buf, CHAT_RECV_BUF_SIZE),
 		boost::asio::bind_executor(m_strand,
 			std::bind(&chat_client_app::priv_on_input, this, std::placeholders::_1,
 				std::placeholders::_2)));
@@ -115,7 +121,7 @@ chat_client_app::priv_on_recv(
 		m_ioctx.stop();
 		return;
 	}
-	std::cout << msg->m_author << ": " << msg->m_data;
+	std::cout << msg->m_author << ": " << msg->m_data << '\n';
 	priv_recv_next();
 }
 
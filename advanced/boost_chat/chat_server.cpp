@@ -2,11 +2,23 @@
 #include "chat_server.h"
 
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/executor_work_guard.hpp>
 #include <boost/asio/io_context.hpp>
-#include <boost/asio/io_context_strand.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/write.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <list>
+#include <optional>
+#include <thread>
+#include <vector>
+
+using chat_strand = boost::asio::strand<boost::asio::io_context::executor_type>;
 
 enum chat_server_state
 {
@@ -21,12 +33,136 @@ enum chat_server_peer_state
 	CHAT_SERVER_PEER_STATE_STOPPED,
 };
 
+// The peers send the messages as lines, the first one being the author's name. To
+// the peers the server sends each message as two lines, the author and the data.
+static const char *const chat_server_author = "server";
+
+// Whether the current thread runs the handlers of the executor. Which is either a
+// strand or a context run by a single thread. The type is checked explicitly, because
+// target() of some boost versions doesn't.
+static bool
+chat_server_is_in(
+	const boost::asio::any_io_executor& exec)
+{
+	if (exec.target_type() == typeid(chat_strand))
+		return exec.target<chat_strand>()->running_in_this_thread();
+	return exec.target<boost::asio::io_context::executor_type>()->
+		running_in_this_thread();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Messages of one author, ready to be sent to the peers. Shared by all the shards.
+struct chat_server_batch final
+{
+	// The peers don't get their own messages. 0 for the server's messages.
+	uint64_t m_author_id;
+	std::string m_data;
+};
+
+using chat_server_batch_ptr = std::shared_ptr<const chat_server_batch>;
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// The counters of one shard's peers. Those on the shared context run in parallel,
+// hence the atomics. But the pinned shards never share them, and the peers of one
+// shard at least don't contend with the other shards.
+struct chat_server_stats final
+{
+	void
+	add_handler_time(
+		uint64_t ns);
+
+	void
+	add_queued(
+		uint64_t bytes);
+
+	std::atomic<uint64_t> m_bytes_in{0};
+	std::atomic<uint64_t> m_bytes_out{0};
+	std::atomic<uint64_t> m_msgs_routed{0};
+	std::atomic<uint64_t> m_max_queued_bytes{0};
+	std::atomic<uint64_t> m_handler_count{0};
+	std::atomic<uint64_t> m_handler_total_ns{0};
+	std::atomic<uint64_t> m_handler_max_ns{0};
+};
+
+static void
+chat_atomic_max(
+	std::atomic<uint64_t>& value,
+	uint64_t candidate)
+{
+	uint64_t old = value.load(std::memory_order_relaxed);
+	while (old < candidate and not value.compare_exchange_weak(old, candidate,
+		std::memory_order_relaxed)) {
+	}
+}
+
+void
+chat_server_stats::add_handler_time(
+	uint64_t ns)
+{
+	m_handler_count.fetch_add(1, std::memory_order_relaxed);
+	m_handler_total_ns.fetch_add(ns, std::memory_order_relaxed);
+	chat_atomic_max(m_handler_max_ns, ns);
+}
+
+void
+chat_server_stats::add_queued(
+	uint64_t bytes)
+{
+	chat_atomic_max(m_max_queued_bytes, bytes);
+}
+
+// Adds the time from the construction to the destruction, so each return of the
+// handler is covered.
+class chat_server_handler_timer final
+{
+public:
+	chat_server_handler_timer(
+		chat_server_stats& stats)
+		: m_stats(stats)
+		, m_start(std::chrono::steady_clock::now())
+	{
+	}
+
+	~chat_server_handler_timer()
+	{
+		m_stats.add_handler_time(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - m_start).count());
+	}
+
+private:
+	chat_server_stats& m_stats;
+	const std::chrono::steady_clock::time_point m_start;
+};
+
+// A connection to the metrics endpoint. Gets one response and is closed.
+struct chat_server_metrics_conn final
+{
+	chat_server_metrics_conn(
+		const chat_strand& strand)
+		: m_sock(strand)
+	{
+	}
+
+	boost::asio::ip::tcp::socket m_sock;
+	// The request is read, but not looked at.
+	char m_in_buf[1024];
+	std::string m_out;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+class chat_server_shard;
+
 class chat_server_peer final : public std::enable_shared_from_this<chat_server_peer>
 {
 public:
 	chat_server_peer(
 		boost::asio::ip::tcp::socket&& sock,
-		std::shared_ptr<chat_server_ctx> server);
+		std::shared_ptr<chat_server_ctx> server,
+		chat_server_shard& shard,
+		uint64_t id);
 	~chat_server_peer();
 
 	void
@@ -37,12 +173,12 @@ public:
 
 	void
 	feed_async(
-		std::string_view text);
+		chat_server_batch_ptr batch);
 
 private:
 	void
 	priv_in_strand_on_new_feed(
-		std::string&& text);
+		const chat_server_batch_ptr& batch);
 
 	void
 	priv_in_strand_recv();
@@ -63,28 +199,145 @@ private:
 	void
 	priv_in_strand_stop();
 
-	chat_server_peer_state m_state;
+	// Starts an operation with the handler in the given memory and running in the
+	// peer's strand.
+	template <typename Handler, typename Initiate>
+	void
+	priv_in_strand_start_io(
+		chat_handler_memory& mem,
+		Handler&& handler,
+		Initiate&& initiate);
 
-	boost::asio::io_context::strand m_strand;
+	chat_server_peer_state m_state;
+	const uint64_t m_id;
+
+	// Serializes the peer's handlers. Either an own strand on the shared context, or
+	// the shard's context itself when it is run by just one thread.
+	const boost::asio::any_io_executor m_exec;
+	// The same strand, not hidden behind any_io_executor. The I/O handlers are bound
+	// to it directly, because the type-erased executor gets copied for each handler
+	// and drops the handler's allocator. None when the shard is pinned, then the
+	// handlers run in the socket's own executor, which is the shard's context.
+	std::optional<chat_strand> m_strand;
 	boost::asio::ip::tcp::socket m_sock;
-	std::shared_ptr<chat_server_ctx> m_server;
-
+	// The receipts and the sendings go one at a time each, so every next one reuses the
+	// handler memory of the previous one.
+	chat_handler_memory m_recv_mem;
+	chat_handler_memory m_send_mem;
+	// Weak, because the server owns the shards and they own the peers. Once the
+	// server is gone, so is the shard.
+	std::weak_ptr<chat_server_ctx> m_server;
+	chat_server_shard& m_shard;
+	// The peer's place in the shard's list, for removal in constant time.
+	std::list<std::shared_ptr<chat_server_peer>>::iterator m_shard_pos;
+
+	// Received data is in [m_in_pos, m_in_size) of m_in_buf. The rest of the buffer is
+	// free space for the next receipts.
 	std::string m_in_buf;
-	std::string m_out_buf;
+	size_t m_in_pos;
+	size_t m_in_size;
+	// Where the search of the next line end continues from.
+	size_t m_in_scan;
+	// The trimmed non-empty lines of the last receipt, right in m_in_buf. Kept for the
+	// capacity.
+	std::vector<std::string_view> m_in_lines;
+	// The first line of the peer.
+	std::string m_name;
+	bool m_has_name;
+
+	// The batches are shared by all the peers and never copied. Being sent are these,
+	// all with one write, and they stay unchanged until the sending ends.
+	std::vector<chat_server_batch_ptr> m_out_bufs;
+	std::vector<boost::asio::const_buffer> m_out_seq;
+	// Fed while the sending is in progress.
+	std::vector<chat_server_batch_ptr> m_out_next;
+	bool m_is_sending;
+	// Of all the batches in m_out_bufs and m_out_next.
+	uint64_t m_out_queued;
+
+	friend chat_server_shard;
+};
 
-	// <YOUR CODE IF NEEDED>
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// A group of peers served by the same executor. Each peer stays in one shard for its
+// entire life. In the sharded mode each shard has an own context run by an own thread,
+// and the messages cross the shards in batches, one post per shard for each batch.
+class chat_server_shard final
+{
+public:
+	// A shard on the shared context, with its peers in their own strands.
+	chat_server_shard(
+		boost::asio::io_context& ioCtx);
+	// A shard with an own context and thread.
+	chat_server_shard();
+	~chat_server_shard();
+
+	boost::asio::io_context&
+	context() { return m_ioctx; }
+
+	const boost::asio::any_io_executor&
+	executor() const { return m_exec; }
+
+	// Whether the peers share the shard's thread instead of having own strands.
+	bool
+	is_pinned() const { return m_own_ctx != nullptr; }
+
+	// Can be read from any thread, so it might be already stale. Good enough to skip
+	// the shards which have nobody to deliver to.
+	uint32_t
+	peer_count() const { return m_peer_count.load(std::memory_order_acquire); }
+
+	// Wait for the own thread to finish, once there is no more work. Then run the
+	// handlers left from the other shards, which could post here any time.
+	void
+	join();
 
-	friend chat_server_ctx;
+	size_t
+	poll_rest();
+
+	chat_server_stats&
+	stats() { return m_stats; }
+
+	// All the rest is called in the shard's executor only. The callers post there
+	// themselves, each with a reference to the server, which owns the shards.
+	void
+	in_strand_add_peer(
+		std::shared_ptr<chat_server_peer> peer);
+
+	void
+	in_strand_remove_peer(
+		chat_server_peer& peer);
+
+	void
+	in_strand_broadcast(
+		const chat_server_batch_ptr& batch);
+
+	void
+	in_strand_stop();
+
+private:
+	std::unique_ptr<boost::asio::io_context> m_own_ctx;
+	boost::asio::io_context& m_ioctx;
+	const boost::asio::any_io_executor m_exec;
+	std::optional<boost::asio::executor_work_guard<
+		boost::asio::io_context::executor_type>> m_work;
+	std::thread m_thread;
+
+	bool m_is_stopped;
+	std::list<std::shared_ptr<chat_server_peer>> m_peers;
+	std::atomic<uint32_t> m_peer_count;
+	chat_server_stats m_stats;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
 struct chat_server_request final
 {
-	chat_server_request(
-		chat_server_on_msg_f&& cb) : m_cb(std::move(cb)) {}
-
-	chat_server_on_msg_f m_cb;
+	chat_recv_cb m_cb;
+	// A batch request when not empty.
+	chat_server_on_batch_f m_batch_cb;
+	size_t m_batch_max;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -93,7 +346,8 @@ class chat_server_ctx final : public std::enable_shared_from_this<chat_server_ct
 {
 public:
 	chat_server_ctx(
-		boost::asio::io_context& ioCtx);
+		boost::asio::io_context& ioCtx,
+		uint32_t shard_count);
 	~chat_server_ctx();
 
 	chat_errcode
@@ -106,62 +360,135 @@ public:
 	void
 	stop();
 
+	// Wait for the own threads of the shards. Must be called after stop() and not
+	// from the shards.
+	void
+	join();
+
 	void
 	recv_async(
 		chat_server_on_msg_f&& cb);
 
+	void
+	recv_batch_async(
+		size_t max,
+		chat_server_on_batch_f&& cb);
+
+	// The handler is of an asio operation, called in its own executor.
+	template <typename Handler>
+	void
+	recv_async_handler(
+		Handler&& handler);
+
 	void
 	feed_async(
 		std::string_view text);
 
+	chat_server_metrics
+	metrics() const;
+
+	chat_errcode
+	start_metrics(
+		uint16_t port);
+
+	uint16_t
+	metrics_port() const;
+
 private:
+	// The acceptors are of the same shards, and are used only in their executors.
 	void
-	priv_in_strand_accept();
+	priv_in_strand_accept(
+		size_t shard_idx);
 
 	void
 	priv_in_strand_on_accept(
-		const boost::system::error_code& err,
-		boost::asio::ip::tcp::socket sock);
+		size_t shard_idx,
+		const boost::system::error_code& err);
 
 	void
 	priv_in_strand_stop();
 
+	template <typename F>
 	void
 	priv_in_strand_on_new_request(
-		std::unique_ptr<chat_server_request> req);
+		F&& cb);
 
 	void
-	priv_peer_on_recv(
-		std::unique_ptr<chat_message> msg);
+	priv_in_strand_on_new_batch_request(
+		size_t max,
+		chat_server_on_batch_f&& cb);
+
+	chat_server_request&
+	priv_in_strand_new_request();
 
 	void
-	priv_in_strand_peer_on_recv(
-		std::unique_ptr<chat_message> msg);
+	priv_peer_on_recv(
+		std::list<std::unique_ptr<chat_message>>&& msgs,
+		chat_server_batch_ptr batch,
+		chat_server_shard& shard);
 
 	void
-	priv_peer_on_close(
-		std::shared_ptr<chat_server_peer> peer);
+	priv_in_strand_peer_on_recv(
+		std::list<std::unique_ptr<chat_message>>&& msgs);
 
+	// The author's shard is null for the server's own messages. Otherwise it is the
+	// current executor.
 	void
-	priv_in_strand_peer_on_close(
-		std::shared_ptr<chat_server_peer> peer);
+	priv_broadcast(
+		const chat_server_batch_ptr& batch,
+		chat_server_shard* author_shard);
 
 	void
 	priv_in_strand_on_new_feed(
 		std::string_view text);
 
-	chat_server_state m_state;
+	void
+	priv_in_strand_serve_requests();
 
-	boost::asio::io_context::strand m_strand;
-	boost::asio::ip::tcp::acceptor m_sock;
-	uint16_t m_port;
+	// The metrics endpoint is served in m_strand.
+	void
+	priv_in_strand_metrics_accept();
 
-	std::list<std::shared_ptr<chat_server_peer>> m_peers;
+	void
+	priv_in_strand_on_metrics_accept(
+		std::list<chat_server_metrics_conn>::iterator conn,
+		const boost::system::error_code& err);
+
+	void
+	priv_in_strand_on_metrics_request(
+		std::list<chat_server_metrics_conn>::iterator conn,
+		const boost::system::error_code& err);
 
-	std::list<std::unique_ptr<chat_server_request>> m_reqs;
+	void
+	priv_in_strand_on_metrics_sent(
+		std::list<chat_server_metrics_conn>::iterator conn);
+
+	// The listening state belongs to the first shard.
+	chat_server_state m_state;
+	std::vector<std::unique_ptr<chat_server_shard>> m_shards;
+	// The shards accept in parallel.
+	std::atomic<uint64_t> m_next_peer_id;
+
+	// For the user's requests and the messages to them.
+	chat_strand m_strand;
+	// One per shard, all on the same port with SO_REUSEPORT. The kernel spreads the
+	// new connections between them, and each one accepts right into its shard.
+	std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> m_acceptors;
+	uint16_t m_port;
+
+	std::list<chat_server_request> m_reqs;
+	// The served requests, for the next ones. They are moved between the lists without
+	// allocations.
+	std::list<chat_server_request> m_free_reqs;
 	std::list<std::unique_ptr<chat_message>> m_in_msgs;
+	// The server's own input not ended with a new line yet.
+	std::string m_feed_buf;
+	// The messages of the server's own input. The peers' ones are in the shards.
+	std::atomic<uint64_t> m_fed_msg_count;
 
-	// <YOUR CODE IF NEEDED>
+	std::unique_ptr<boost::asio::ip::tcp::acceptor> m_metrics_acceptor;
+	uint16_t m_metrics_port;
+	std::list<chat_server_metrics_conn> m_metrics_conns;
 
 	friend chat_server_peer;
 };
@@ -170,16 +497,21 @@ private:
 
 chat_server::chat_server(
 	boost::asio::io_context& ioCtx)
-	: m_ctx(std::make_shared<chat_server_ctx>(ioCtx))
+	: chat_server(ioCtx, 0)
+{
+}
+
+chat_server::chat_server(
+	boost::asio::io_context& ioCtx,
+	uint32_t shard_count)
+	: m_ctx(std::make_shared<chat_server_ctx>(ioCtx, shard_count))
 {
-	// <YOUR CODE IF NEEDED>
 }
 
 chat_server::~chat_server()
 {
 	m_ctx->stop();
-
-	// <YOUR CODE IF NEEDED>
+	m_ctx->join();
 }
 
 chat_errcode
@@ -202,6 +534,26 @@ chat_server::recv_async(
 	m_ctx->recv_async(std::move(cb));
 }
 
+void
+chat_server::recv_batch_async(
+	size_t max,
+	chat_server_on_batch_f&& cb)
+{
+	m_ctx->recv_batch_async(max, std::move(cb));
+}
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+boost::asio::awaitable<chat_recv_result>
+chat_server::co_recv()
+{
+	return boost::asio::async_initiate<const boost::asio::use_awaitable_t<>&,
+		void(chat_errcode, std::unique_ptr<chat_message>)>(
+		[ctx = m_ctx](auto&& handler) {
+		ctx->recv_async_handler(std::move(handler));
+	}, boost::asio::use_awaitable);
+}
+#endif
+
 void
 chat_server::feed_async(
 	std::string_view text)
@@ -209,190 +561,459 @@ chat_server::feed_async(
 	m_ctx->feed_async(text);
 }
 
+chat_server_metrics
+chat_server::metrics() const
+{
+	return m_ctx->metrics();
+}
+
+chat_errcode
+chat_server::start_metrics(
+	uint16_t port)
+{
+	return m_ctx->start_metrics(port);
+}
+
+uint16_t
+chat_server::metrics_port() const
+{
+	return m_ctx->metrics_port();
+}
+
+std::string
+chat_server_metrics_to_text(
+	const chat_server_metrics& metrics)
+{
+	std::string res;
+	auto add = [&res](const char* name, uint64_t value) {
+		res.append(name).append(1, ' ').append(std::to_string(value)).append(1, '\n');
+	};
+	add("chat_peers", metrics.m_peer_count);
+	add("chat_bytes_in", metrics.m_bytes_in);
+	add("chat_bytes_out", metrics.m_bytes_out);
+	add("chat_msgs_routed", metrics.m_msgs_routed);
+	add("chat_max_queued_bytes", metrics.m_max_queued_bytes);
+	add("chat_handler_count", metrics.m_handler_count);
+	add("chat_handler_total_ns", metrics.m_handler_total_ns);
+	add("chat_handler_max_ns", metrics.m_handler_max_ns);
+	return res;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 chat_server_peer::chat_server_peer(
 	boost::asio::ip::tcp::socket&& sock,
-	std::shared_ptr<chat_server_ctx> server)
+	std::shared_ptr<chat_server_ctx> server,
+	chat_server_shard& shard,
+	uint64_t id)
 	: m_state(CHAT_SERVER_PEER_STATE_CONNECTED)
-	, m_strand(sock.get_executor().context())
+	, m_id(id)
+	, m_exec(shard.is_pinned() ? shard.executor() :
+		boost::asio::any_io_executor(boost::asio::make_strand(shard.context())))
+	, m_strand(shard.is_pinned() ? std::nullopt :
+		std::make_optional(*m_exec.target<chat_strand>()))
 	, m_sock(std::move(sock))
 	, m_server(std::move(server))
+	, m_shard(shard)
+	, m_in_pos(0)
+	, m_in_size(0)
+	, m_in_scan(0)
+	, m_has_name(false)
+	, m_is_sending(false)
+	, m_out_queued(0)
 {
 }
 
 chat_server_peer::~chat_server_peer()
 {
-	// <YOUR CODE IF NEEDED>
 }
 
 void
 chat_server_peer::start()
 {
-	boost::asio::post(m_strand, std::bind(&chat_server_peer::priv_in_strand_recv,
+	boost::asio::post(m_exec, std::bind(&chat_server_peer::priv_in_strand_recv,
 		shared_from_this()));
 }
 
 void
 chat_server_peer::stop()
 {
-	boost::asio::post(m_strand, std::bind(&chat_server_peer::priv_in_strand_stop,
+	boost::asio::post(m_exec, std::bind(&chat_server_peer::priv_in_strand_stop,
 		shared_from_this()));
 }
 
 void
 chat_server_peer::feed_async(
-	std::string_view text)
+	chat_server_batch_ptr batch)
 {
-	boost::asio::post(m_strand, [ref = shared_from_this(), this,
-		text = std::string(text)]() mutable {
-		priv_in_strand_on_new_feed(std::move(text));
+	boost::asio::post(m_exec, [ref = shared_from_this(), this,
+		batch = std::move(batch)]() {
+		priv_in_strand_on_new_feed(batch);
 	});
 }
 
 void
 chat_server_peer::priv_in_strand_on_new_feed(
-	std::string&& /* text */)
+	const chat_server_batch_ptr& batch)
 {
-	assert(m_strand.running_in_this_thread());
+	assert(chat_server_is_in(m_exec));
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+		return;
+	m_out_next.push_back(batch);
+	m_out_queued += batch->m_data.size();
+	m_shard.stats().add_queued(m_out_queued);
+	priv_in_strand_send();
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+void
+chat_server_peer::priv_in_strand_recv()
+{
+	assert(chat_server_is_in(m_exec));
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+		return;
+	// Move the unparsed rest to the beginning when more space is needed, and grow x2
+	// when it is still not enough.
+	if (m_in_buf.size() - m_in_size < CHAT_RECV_BUF_SIZE and m_in_pos > 0) {
+		memmove(m_in_buf.data(), m_in_buf.data() + m_in_pos, m_in_size - m_in_pos);
+		m_in_size -= m_in_pos;
+		m_in_scan -= m_in_pos;
+		m_in_pos = 0;
+	}
+	if (m_in_buf.size() - m_in_size < CHAT_RECV_BUF_SIZE) {
+		m_in_buf.resize(std::max<size_t>(m_in_buf.size() * 2,
+			CHAT_RECV_BUF_SIZE));
+	}
+	boost::asio::mutable_buffer buf = boost::asio::buffer(m_in_buf.data() + m_in_size,
+		m_in_buf.size() - m_in_size);
+	priv_in_strand_start_io(m_recv_mem, std::bind(
+		&chat_server_peer::priv_in_strand_on_recv, shared_from_this(),
+		std::placeholders::_1, std::placeholders::_2), [this, buf](auto&& handler) {
+		m_sock.async_receive(buf, std::move(handler));
+	});
+}
 
-	// 1) Append the data to the pending output buffer m_out_buf.
-	// 2) priv_in_strand_send();
+void
+chat_server_peer::priv_in_strand_on_recv(
+	const boost::system::error_code& err,
+	std::size_t size)
+{
+	assert(chat_server_is_in(m_exec));
+	chat_server_handler_timer timer(m_shard.stats());
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+		return;
+	if (err) {
+		priv_in_strand_stop();
+		return;
+	}
+	m_shard.stats().m_bytes_in.fetch_add(size, std::memory_order_relaxed);
+	m_in_size += size;
+	// The lines are found first, so the batch is built in one allocation of the exact
+	// size.
+	m_in_lines.clear();
+	size_t batch_size = 0;
+	const char* data = m_in_buf.data();
+	const char* end;
+	while ((end = static_cast<const char*>(memchr(data + m_in_scan, '\n',
+		m_in_size - m_in_scan))) != nullptr) {
+		size_t line_end = end - data;
+		std::string_view line = chat_trim(std::string_view(data + m_in_pos,
+			line_end - m_in_pos));
+		m_in_pos = m_in_scan = line_end + 1;
+		if (not m_has_name) {
+			m_name = line;
+			m_has_name = true;
+			continue;
+		}
+		if (line.empty())
+			continue;
+		m_in_lines.push_back(line);
+		batch_size += m_name.size() + line.size() + 2;
+	}
+	m_in_scan = m_in_size;
+	if (m_in_pos == m_in_size)
+		m_in_pos = m_in_size = m_in_scan = 0;
+	// All the messages of this receipt go to the other peers as one batch.
+	std::list<std::unique_ptr<chat_message>> msgs;
+	std::shared_ptr<chat_server_batch> batch;
+	if (not m_in_lines.empty()) {
+		batch = std::make_shared<chat_server_batch>();
+		batch->m_author_id = m_id;
+		batch->m_data.reserve(batch_size);
+	}
+	for (std::string_view line : m_in_lines) {
+		batch->m_data.append(m_name).append(1, '\n').append(line).append(1, '\n');
+		std::unique_ptr<chat_message> msg = std::make_unique<chat_message>();
+		msg->m_author = m_name;
+		msg->m_data = line;
+		msgs.emplace_back(std::move(msg));
+	}
+	if (batch) {
+		std::shared_ptr<chat_server_ctx> server = m_server.lock();
+		if (not server) {
+			priv_in_strand_stop();
+			return;
+		}
+		m_shard.stats().m_msgs_routed.fetch_add(m_in_lines.size(),
+			std::memory_order_relaxed);
+		server->priv_peer_on_recv(std::move(msgs), std::move(batch), m_shard);
+	}
+	priv_in_strand_recv();
 }
 
 void
-chat_server_peer::priv_in_strand_recv()
+chat_server_peer::priv_in_strand_send()
 {
-	assert(m_strand.running_in_this_thread());
+	assert(chat_server_is_in(m_exec));
 	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
 		return;
+	if (m_is_sending or m_out_next.empty())
+		return;
+	// The next feeds go to the other queue.
+	std::swap(m_out_bufs, m_out_next);
+	for (const chat_server_batch_ptr& b : m_out_bufs)
+		m_out_seq.emplace_back(boost::asio::buffer(b->m_data));
+	m_is_sending = true;
+	priv_in_strand_start_io(m_send_mem, std::bind(
+		&chat_server_peer::priv_in_strand_on_send, shared_from_this(),
+		std::placeholders::_1, std::placeholders::_2), [this](auto&& handler) {
+		boost::asio::async_write(m_sock, chat_buffer_view(m_out_seq),
+			std::move(handler));
+	});
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+void
+chat_server_peer::priv_in_strand_on_send(
+	const boost::system::error_code& err,
+	std::size_t size)
+{
+	assert(chat_server_is_in(m_exec));
+	chat_server_handler_timer timer(m_shard.stats());
+	m_is_sending = false;
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+		return;
+	if (err) {
+		priv_in_strand_stop();
+		return;
+	}
+	// All is sent, async_write doesn't stop on the partial writes.
+	m_shard.stats().m_bytes_out.fetch_add(size, std::memory_order_relaxed);
+	m_out_queued -= size;
+	m_out_bufs.clear();
+	m_out_seq.clear();
+	priv_in_strand_send();
+}
 
-	// 1) Ensure you have enough space in m_in_buf. Reserve at least CHAT_RECV_BUF_SIZE.
-	// Grow it x2 when need more.
-	//
-	// 2) Receive more data.
-	// uint8_t* buf = m_in_buf.data() + m_in_buf.length();
-	// size_t size = m_in_buf.capacity() - m_in_buf.length();
-	// m_sock.async_receive(boost::asio::buffer(buf, size),
-	//	boost::asio::bind_executor(strand_,
-	//		std::bind(&chat_server_peer::priv_in_strand_on_recv, shared_from_this(),
-	//		std::placeholder::_1, std::placeholders::_2)));
+template <typename Handler, typename Initiate>
+void
+chat_server_peer::priv_in_strand_start_io(
+	chat_handler_memory& mem,
+	Handler&& handler,
+	Initiate&& initiate)
+{
+	if (m_strand) {
+		initiate(boost::asio::bind_executor(*m_strand, chat_make_alloc_handler(mem,
+			std::forward<Handler>(handler))));
+		return;
+	}
+	initiate(chat_make_alloc_handler(mem, std::forward<Handler>(handler)));
 }
 
 void
-chat_server_peer::priv_in_strand_on_recv(
-	const boost::system::error_code& /* err */,
-	std::size_t /* size */)
+chat_server_peer::priv_in_strand_stop()
 {
-	assert(m_strand.running_in_this_thread());
+	assert(chat_server_is_in(m_exec));
+	if (m_state != CHAT_SERVER_PEER_STATE_CONNECTED)
+		return;
+	m_state = CHAT_SERVER_PEER_STATE_STOPPED;
+	boost::system::error_code err;
+	m_sock.close(err);
+	std::shared_ptr<chat_server_ctx> server = m_server.lock();
+	if (not server)
+		return;
+	boost::asio::post(m_shard.executor(), [server = std::move(server),
+		ref = shared_from_this(), this]() {
+		m_shard.in_strand_remove_peer(*this);
+	});
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+chat_server_shard::chat_server_shard(
+	boost::asio::io_context& ioCtx)
+	: m_ioctx(ioCtx)
+	, m_exec(boost::asio::make_strand(ioCtx))
+	, m_is_stopped(false)
+	, m_peer_count(0)
+{
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+chat_server_shard::chat_server_shard()
+	// The hint lets the context drop the locks, it is run by one thread only.
+	: m_own_ctx(std::make_unique<boost::asio::io_context>(1))
+	, m_ioctx(*m_own_ctx)
+	, m_exec(m_own_ctx->get_executor())
+	, m_work(m_own_ctx->get_executor())
+	, m_is_stopped(false)
+	, m_peer_count(0)
+{
+	m_thread = std::thread([this]() { m_ioctx.run(); });
+}
 
-	// 1) Start considering the newly received bytes.
-	// m_in_buf.resize(m_in_buf.length() + size);
-	//
-	// 2) Parse the buffer trying to extract complete messages. Send each extracted one
-	// to the server: m_server->priv_peer_on_recv(msg).
-	//
-	// 3) Keep receiving infinitely.
-	//
-	// In your code you might make m_in_buf more efficient.
+chat_server_shard::~chat_server_shard()
+{
+	assert(not m_thread.joinable());
 }
 
 void
-chat_server_peer::priv_in_strand_send()
+chat_server_shard::join()
 {
-	assert(m_strand.running_in_this_thread());
-	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+	if (not is_pinned())
 		return;
+	m_work.reset();
+	m_thread.join();
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// If the buffer m_out_buf contains a complete message, then send it using
-	// m_sock.async_send(boost::asio::buffer(m_out_buf.data(), m_out_buf.length()),
-	//	boost::asio::bind_executor(m_strand,
-	//		std::bind(&chat_server_peer::priv_in_strand_on_send, shared_from_this(),
-	//			std::placeholders::_1, std::placeholders::_2)));
-	//
-	// You don't have to send whole messages. Could send the parts right away if your
-	// protocol is fine with that. But you might need to send full ones if you encode them
-	// anyhow. For example, prefix each message with its total size to make receipt on the
-	// other end more optimal.
-	//
-	// When m_out_buf is needed (only if you are sending full messages), you should keep
-	// it valid and unchanged until the sending is complete. Which means you might need a
-	// second buffer where you would store newer messages while the older ones are being
-	// sent.
+size_t
+chat_server_shard::poll_rest()
+{
+	if (not is_pinned())
+		return 0;
+	m_ioctx.restart();
+	return m_ioctx.poll();
 }
 
 void
-chat_server_peer::priv_in_strand_on_send(
-	const boost::system::error_code& /* err */,
-	std::size_t /* size */)
+chat_server_shard::in_strand_add_peer(
+	std::shared_ptr<chat_server_peer> peer)
 {
-	assert(m_strand.running_in_this_thread());
+	assert(chat_server_is_in(m_exec));
+	if (m_is_stopped)
+		return;
+	m_peers.emplace_back(peer);
+	peer->m_shard_pos = std::prev(m_peers.end());
+	m_peer_count.store(m_peers.size(), std::memory_order_release);
+	peer->start();
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+void
+chat_server_shard::in_strand_remove_peer(
+	chat_server_peer& peer)
+{
+	assert(chat_server_is_in(m_exec));
+	// The stopped shard has forgotten all its peers already.
+	if (m_is_stopped)
+		return;
+	m_peers.erase(peer.m_shard_pos);
+	m_peer_count.store(m_peers.size(), std::memory_order_release);
+}
 
-	// Be careful about partial writes. The sent size might be < m_out_buf.length(). Then
-	// you must send the rest again. Keep sending as long as you have something to send.
+void
+chat_server_shard::in_strand_broadcast(
+	const chat_server_batch_ptr& batch)
+{
+	assert(chat_server_is_in(m_exec));
+	for (std::shared_ptr<chat_server_peer>& p : m_peers) {
+		if (p->m_id == batch->m_author_id)
+			continue;
+		// The pinned peers are in this very thread, no need to post.
+		if (is_pinned())
+			p->priv_in_strand_on_new_feed(batch);
+		else
+			p->feed_async(batch);
+	}
 }
 
 void
-chat_server_peer::priv_in_strand_stop()
+chat_server_shard::in_strand_stop()
 {
-	assert(m_strand.running_in_this_thread());
-	if (m_state != CHAT_SERVER_PEER_STATE_CONNECTED)
+	assert(chat_server_is_in(m_exec));
+	if (m_is_stopped)
 		return;
-	m_state = CHAT_SERVER_PEER_STATE_CONNECTED;
-	m_sock.close();
-	m_server->priv_peer_on_close(shared_from_this());
-	m_server.reset();
+	m_is_stopped = true;
+	for (std::shared_ptr<chat_server_peer>& p : m_peers)
+		p->stop();
+	m_peers.clear();
+	m_peer_count.store(0, std::memory_order_release);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
 chat_server_ctx::chat_server_ctx(
-	boost::asio::io_context& ioCtx)
+	boost::asio::io_context& ioCtx,
+	uint32_t shard_count)
 	: m_state(CHAT_SERVER_STATE_NEW)
-	, m_strand(ioCtx)
-	, m_sock(ioCtx)
+	, m_shards([&]() {
+		std::vector<std::unique_ptr<chat_server_shard>> res;
+		if (shard_count == 0)
+			res.emplace_back(std::make_unique<chat_server_shard>(ioCtx));
+		for (uint32_t i = 0; i < shard_count; ++i)
+			res.emplace_back(std::make_unique<chat_server_shard>());
+		return res;
+	}())
+	, m_next_peer_id(1)
+	, m_strand(boost::asio::make_strand(ioCtx))
+	, m_port(0)
+	, m_fed_msg_count(0)
+	, m_metrics_port(0)
 {
-	// <YOUR CODE IF NEEDED>
 }
 
 chat_server_ctx::~chat_server_ctx()
 {
-	// <YOUR CODE IF NEEDED>
 }
 
 chat_errcode
 chat_server_ctx::start(
 	uint16_t port)
 {
-	assert(m_state == CHAT_SERVER_STATE_NEW);
-	// <YOUR CODE IF NEEDED>
-	//
-	// You need to handle errors without throwing exceptions and return them
-	// gracefully.
-	//
-	boost::asio::ip::tcp::endpoint endpoint;
-	endpoint.port(port);
-	m_sock.bind(endpoint);
-	m_port = m_sock.local_endpoint().port();
-	m_sock.listen();
+	if (m_state != CHAT_SERVER_STATE_NEW)
+		return CHAT_ERR_ALREADY_STARTED;
+	using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET,
+		SO_REUSEPORT>;
+	boost::system::error_code err;
+	std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> acceptors;
+	for (std::unique_ptr<chat_server_shard>& s : m_shards) {
+		acceptors.emplace_back(std::make_unique<boost::asio::ip::tcp::acceptor>(
+			s->context()));
+		boost::asio::ip::tcp::acceptor& sock = *acceptors.back();
+		// The first one takes the port if it is 0, the others join it.
+		boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(),
+			acceptors.size() == 1 ? port : m_port);
+		sock.open(endpoint.protocol(), err);
+		if (err)
+			return CHAT_ERR_SYS;
+		sock.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true), err);
+		if (err)
+			return CHAT_ERR_SYS;
+		if (m_shards.size() > 1) {
+			sock.set_option(reuse_port(true), err);
+			if (err)
+				return CHAT_ERR_SYS;
+		}
+		// The accepts are drained until there are no more.
+		sock.non_blocking(true, err);
+		if (err)
+			return CHAT_ERR_SYS;
+		sock.bind(endpoint, err);
+		if (err == boost::asio::error::address_in_use)
+			return CHAT_ERR_PORT_BUSY;
+		if (err)
+			return CHAT_ERR_SYS;
+		m_port = sock.local_endpoint(err).port();
+		if (err)
+			return CHAT_ERR_SYS;
+	}
+	for (std::unique_ptr<boost::asio::ip::tcp::acceptor>& sock : acceptors) {
+		sock->listen(boost::asio::socket_base::max_listen_connections, err);
+		if (err)
+			return CHAT_ERR_SYS;
+	}
+	m_acceptors = std::move(acceptors);
 	m_state = CHAT_SERVER_STATE_LISTEN;
-	boost::asio::post(m_strand, std::bind(
-		&chat_server_ctx::priv_in_strand_accept, shared_from_this()));
+	for (size_t i = 0; i < m_shards.size(); ++i) {
+		boost::asio::post(m_shards[i]->executor(), std::bind(
+			&chat_server_ctx::priv_in_strand_accept, shared_from_this(), i));
+	}
 	return CHAT_ERR_NONE;
 }
 
@@ -406,19 +1027,62 @@ chat_server_ctx::port() const
 void
 chat_server_ctx::stop()
 {
-	boost::asio::post(m_strand, std::bind(
+	boost::asio::post(m_shards[0]->executor(), std::bind(
 		&chat_server_ctx::priv_in_strand_stop, shared_from_this()));
 }
 
+void
+chat_server_ctx::join()
+{
+	for (std::unique_ptr<chat_server_shard>& s : m_shards)
+		s->join();
+	// The shards could post to each other after some of them have finished. Nothing
+	// starts new work after the stop, so these are just the leftovers.
+	size_t count;
+	do {
+		count = 0;
+		for (std::unique_ptr<chat_server_shard>& s : m_shards)
+			count += s->poll_rest();
+	} while (count > 0);
+}
+
 void
 chat_server_ctx::recv_async(
 	chat_server_on_msg_f&& cb)
 {
-	std::unique_ptr<chat_server_request> req =
-		std::make_unique<chat_server_request>(std::move(cb));
 	boost::asio::post(m_strand,
-		[ref = shared_from_this(), req = std::move(req), this]() mutable {
-		priv_in_strand_on_new_request(std::move(req));
+		[ref = shared_from_this(), cb = std::move(cb), this]() mutable {
+		priv_in_strand_on_new_request(std::move(cb));
+	});
+}
+
+void
+chat_server_ctx::recv_batch_async(
+	size_t max,
+	chat_server_on_batch_f&& cb)
+{
+	boost::asio::post(m_strand,
+		[ref = shared_from_this(), max, cb = std::move(cb), this]() mutable {
+		priv_in_strand_on_new_batch_request(max, std::move(cb));
+	});
+}
+
+template <typename Handler>
+void
+chat_server_ctx::recv_async_handler(
+	Handler&& handler)
+{
+	boost::asio::post(m_strand, [ref = shared_from_this(), this,
+		handler = std::move(handler)]() mutable {
+		// The handler's executor must not run out of work while it waits.
+		priv_in_strand_on_new_request([work = boost::asio::make_work_guard(handler),
+			handler = std::move(handler)](chat_errcode err,
+			std::unique_ptr<chat_message> msg) mutable {
+			boost::asio::dispatch(work.get_executor(), [handler = std::move(handler), err,
+				msg = std::move(msg)]() mutable {
+				handler(err, std::move(msg));
+			});
+		});
 	});
 }
 
@@ -430,23 +1094,94 @@ chat_server_ctx::feed_async(
 		shared_from_this(), std::string(text)));
 }
 
+chat_server_metrics
+chat_server_ctx::metrics() const
+{
+	chat_server_metrics res = {};
+	res.m_msgs_routed = m_fed_msg_count.load(std::memory_order_relaxed);
+	for (const std::unique_ptr<chat_server_shard>& s : m_shards) {
+		const chat_server_stats& st = s->stats();
+		res.m_peer_count += s->peer_count();
+		res.m_bytes_in += st.m_bytes_in.load(std::memory_order_relaxed);
+		res.m_bytes_out += st.m_bytes_out.load(std::memory_order_relaxed);
+		res.m_msgs_routed += st.m_msgs_routed.load(std::memory_order_relaxed);
+		res.m_max_queued_bytes = std::max(res.m_max_queued_bytes,
+			st.m_max_queued_bytes.load(std::memory_order_relaxed));
+		res.m_handler_count += st.m_handler_count.load(std::memory_order_relaxed);
+		res.m_handler_total_ns += st.m_handler_total_ns.load(
+			std::memory_order_relaxed);
+		res.m_handler_max_ns = std::max(res.m_handler_max_ns,
+			st.m_handler_max_ns.load(std::memory_order_relaxed));
+	}
+	return res;
+}
+
+chat_errcode
+chat_server_ctx::start_metrics(
+	uint16_t port)
+{
+	if (m_state != CHAT_SERVER_STATE_LISTEN)
+		return CHAT_ERR_NOT_STARTED;
+	if (m_metrics_acceptor)
+		return CHAT_ERR_ALREADY_STARTED;
+	// The sockets get the strand as their executor, so all the handlers run in it.
+	std::unique_ptr<boost::asio::ip::tcp::acceptor> sock =
+		std::make_unique<boost::asio::ip::tcp::acceptor>(m_strand);
+	boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
+	boost::system::error_code err;
+	sock->open(endpoint.protocol(), err);
+	if (err)
+		return CHAT_ERR_SYS;
+	sock->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true), err);
+	if (err)
+		return CHAT_ERR_SYS;
+	sock->bind(endpoint, err);
+	if (err == boost::asio::error::address_in_use)
+		return CHAT_ERR_PORT_BUSY;
+	if (err)
+		return CHAT_ERR_SYS;
+	sock->listen(boost::asio::socket_base::max_listen_connections, err);
+	if (err)
+		return CHAT_ERR_SYS;
+	m_metrics_port = sock->local_endpoint(err).port();
+	if (err)
+		return CHAT_ERR_SYS;
+	m_metrics_acceptor = std::move(sock);
+	boost::asio::post(m_strand, std::bind(
+		&chat_server_ctx::priv_in_strand_metrics_accept, shared_from_this()));
+	return CHAT_ERR_NONE;
+}
+
+uint16_t
+chat_server_ctx::metrics_port() const
+{
+	assert(m_metrics_acceptor);
+	return m_metrics_port;
+}
+
 void
-chat_server_ctx::priv_in_strand_accept()
+chat_server_ctx::priv_in_strand_accept(
+	size_t shard_idx)
 {
-	assert(m_strand.running_in_this_thread());
-	assert(m_state == CHAT_SERVER_STATE_LISTEN);
-	m_sock.async_accept(boost::asio::bind_executor(m_strand, std::bind(
-		&chat_server_ctx::priv_in_strand_on_accept, shared_from_this(),
-		std::placeholders::_1, std::placeholders::_2)));
+	chat_server_shard& shard = *m_shards[shard_idx];
+	assert(chat_server_is_in(shard.executor()));
+	// Waits for readiness only, the accepts themselves are done in a batch.
+	m_acceptors[shard_idx]->async_wait(boost::asio::ip::tcp::acceptor::wait_read,
+		boost::asio::bind_executor(shard.executor(), std::bind(
+		&chat_server_ctx::priv_in_strand_on_accept, shared_from_this(), shard_idx,
+		std::placeholders::_1)));
 }
 
 void
 chat_server_ctx::priv_in_strand_on_accept(
-	const boost::system::error_code& err,
-	boost::asio::ip::tcp::socket sock)
+	size_t shard_idx,
+	const boost::system::error_code& err)
 {
-	assert(m_strand.running_in_this_thread());
-	if (m_state == CHAT_SERVER_STATE_STOPPED)
+	chat_server_shard& shard = *m_shards[shard_idx];
+	boost::asio::ip::tcp::acceptor& acceptor = *m_acceptors[shard_idx];
+	assert(chat_server_is_in(shard.executor()));
+	// Closed by the stop, which is done in this executor too.
+	if (err == boost::asio::error::operation_aborted or not acceptor.is_open())
 		return;
 	if (err) {
 		std::cout << "Chat server accept error: boost " << err << '\n';
@@ -455,98 +1190,272 @@ chat_server_ctx::priv_in_strand_on_accept(
 		abort();
 		return;
 	}
-	std::shared_ptr<chat_server_peer> peer = std::make_shared<chat_server_peer>(
-		std::move(sock), shared_from_this());
-	peer->start();
-	m_peers.emplace_back(std::move(peer));
-	priv_in_strand_accept();
+	// Takes all the pending connections before waiting again. The socket is created
+	// right in the context of this shard.
+	while (true) {
+		boost::system::error_code accept_err;
+		boost::asio::ip::tcp::socket sock = acceptor.accept(shard.context(),
+			accept_err);
+		if (accept_err == boost::asio::error::would_block or
+			accept_err == boost::asio::error::try_again)
+			break;
+		// The client has gone before it was accepted.
+		if (accept_err == boost::asio::error::connection_aborted)
+			continue;
+		if (accept_err) {
+			std::cout << "Chat server accept error: boost " << accept_err << '\n';
+			abort();
+			return;
+		}
+		shard.in_strand_add_peer(std::make_shared<chat_server_peer>(std::move(sock),
+			shared_from_this(), shard, m_next_peer_id.fetch_add(1)));
+	}
+	priv_in_strand_accept(shard_idx);
 }
 
 void
 chat_server_ctx::priv_in_strand_stop()
 {
-	assert(m_strand.running_in_this_thread());
-	if (m_state != CHAT_SERVER_STATE_LISTEN)
+	assert(chat_server_is_in(m_shards[0]->executor()));
+	if (m_state == CHAT_SERVER_STATE_STOPPED)
 		return;
 	m_state = CHAT_SERVER_STATE_STOPPED;
-	m_sock.close();
-	for (std::shared_ptr<chat_server_peer>& p : m_peers)
-		p->stop();
-	m_peers.clear();
+	for (size_t i = 0; i < m_shards.size(); ++i) {
+		boost::asio::post(m_shards[i]->executor(), [ref = shared_from_this(), this,
+			i]() {
+			if (i < m_acceptors.size()) {
+				boost::system::error_code err;
+				m_acceptors[i]->close(err);
+			}
+			m_shards[i]->in_strand_stop();
+		});
+	}
+	boost::asio::post(m_strand, [ref = shared_from_this(), this]() {
+		boost::system::error_code err;
+		if (m_metrics_acceptor)
+			m_metrics_acceptor->close(err);
+		// Their handlers are aborted and free them.
+		for (chat_server_metrics_conn& c : m_metrics_conns)
+			c.m_sock.close(err);
+	});
 }
 
+template <typename F>
 void
 chat_server_ctx::priv_in_strand_on_new_request(
-	std::unique_ptr<chat_server_request> req)
+	F&& cb)
 {
 	assert(m_strand.running_in_this_thread());
-	if (not m_reqs.empty() or m_in_msgs.empty()) {
-		m_reqs.emplace_back(std::move(req));
+	priv_in_strand_new_request().m_cb.emplace(std::forward<F>(cb));
+	priv_in_strand_serve_requests();
+}
+
+void
+chat_server_ctx::priv_in_strand_on_new_batch_request(
+	size_t max,
+	chat_server_on_batch_f&& cb)
+{
+	assert(m_strand.running_in_this_thread());
+	if (max == 0) {
+		cb(CHAT_ERR_INVALID_ARGUMENT, {});
 		return;
 	}
-	// Already have data to return. Then just return it.
-	req->m_cb(CHAT_ERR_NONE, std::move(m_in_msgs.front()));
-	m_in_msgs.pop_front();
+	chat_server_request& req = priv_in_strand_new_request();
+	req.m_batch_cb = std::move(cb);
+	req.m_batch_max = max;
+	priv_in_strand_serve_requests();
+}
+
+chat_server_request&
+chat_server_ctx::priv_in_strand_new_request()
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_free_reqs.empty())
+		m_free_reqs.emplace_back();
+	m_reqs.splice(m_reqs.end(), m_free_reqs, m_free_reqs.begin());
+	return m_reqs.back();
 }
 
 void
 chat_server_ctx::priv_peer_on_recv(
-	std::unique_ptr<chat_message> msg)
+	std::list<std::unique_ptr<chat_message>>&& msgs,
+	chat_server_batch_ptr batch,
+	chat_server_shard& shard)
 {
+	priv_broadcast(batch, &shard);
 	boost::asio::post(m_strand, [ref = shared_from_this(), this,
-		msg = std::move(msg)]() mutable {
-		priv_in_strand_peer_on_recv(std::move(msg));
+		msgs = std::move(msgs)]() mutable {
+		priv_in_strand_peer_on_recv(std::move(msgs));
 	});
 }
 
 void
 chat_server_ctx::priv_in_strand_peer_on_recv(
-	std::unique_ptr<chat_message> msg)
+	std::list<std::unique_ptr<chat_message>>&& msgs)
 {
 	assert(m_strand.running_in_this_thread());
-	m_in_msgs.emplace_back(std::move(msg));
+	m_in_msgs.splice(m_in_msgs.end(), msgs);
+	priv_in_strand_serve_requests();
+}
 
-	// <YOUR CODE IF NEEDED>
-	//
-	// Serve the pending receive-requests if there are any.
+void
+chat_server_ctx::priv_broadcast(
+	const chat_server_batch_ptr& batch,
+	chat_server_shard* author_shard)
+{
+	// This is the path of a message with one recipient too. A message is copied
+	// just once, into the batch which its recipients write by reference, so writing
+	// from the author's receive buffer would save no copy and would hold that buffer
+	// till the write ends. What a lone recipient costs is the post to every shard,
+	// so the shards with nobody to deliver to are skipped.
+	for (std::unique_ptr<chat_server_shard>& s : m_shards) {
+		// A peer added concurrently with the check could miss the batch. But it
+		// could not have seen the batch's messages sent before it joined anyway.
+		uint32_t count = s->peer_count();
+		if (s.get() == author_shard) {
+			// The author is counted, it is removed only after it stops receiving.
+			if (count <= 1)
+				continue;
+			// Already in the right thread. Deliver right away, not via a post which
+			// would allocate and wait for its turn in the queue.
+			if (s->is_pinned()) {
+				s->in_strand_broadcast(batch);
+				continue;
+			}
+		} else if (count == 0) {
+			continue;
+		}
+		boost::asio::post(s->executor(), [ref = shared_from_this(), s = s.get(),
+			batch]() {
+			s->in_strand_broadcast(batch);
+		});
+	}
 }
 
 void
-chat_server_ctx::priv_peer_on_close(
-	std::shared_ptr<chat_server_peer> peer)
+chat_server_ctx::priv_in_strand_on_new_feed(
+	std::string_view text)
 {
-	boost::asio::post(m_strand, [ref = shared_from_this(), this,
-		peer = std::move(peer)]() mutable {
-		priv_in_strand_peer_on_close(std::move(peer));
-	});
+	assert(m_strand.running_in_this_thread());
+	size_t pos = m_feed_buf.length();
+	m_feed_buf.append(text);
+	std::shared_ptr<chat_server_batch> batch;
+	size_t begin = 0;
+	size_t end;
+	while ((end = m_feed_buf.find('\n', pos)) != std::string::npos) {
+		std::string_view line = chat_trim(std::string_view(m_feed_buf.data() + begin,
+			end - begin));
+		begin = pos = end + 1;
+		if (line.empty())
+			continue;
+		if (not batch) {
+			batch = std::make_shared<chat_server_batch>();
+			batch->m_author_id = 0;
+		}
+		m_fed_msg_count.fetch_add(1, std::memory_order_relaxed);
+		batch->m_data.append(chat_server_author).append(1, '\n').append(line).
+			append(1, '\n');
+	}
+	m_feed_buf.erase(0, begin);
+	if (batch)
+		priv_broadcast(batch, nullptr);
 }
 
 void
-chat_server_ctx::priv_in_strand_peer_on_close(
-	std::shared_ptr<chat_server_peer> peer)
+chat_server_ctx::priv_in_strand_serve_requests()
 {
 	assert(m_strand.running_in_this_thread());
-	for (auto it = m_peers.begin(); it != m_peers.end(); ++it) {
-		if (*it == peer) {
-			m_peers.erase(it);
-			return;
+	while (not m_reqs.empty() and not m_in_msgs.empty()) {
+		m_free_reqs.splice(m_free_reqs.begin(), m_reqs, m_reqs.begin());
+		chat_server_request& req = m_free_reqs.front();
+		if (not req.m_batch_cb) {
+			std::unique_ptr<chat_message> msg = std::move(m_in_msgs.front());
+			m_in_msgs.pop_front();
+			req.m_cb(CHAT_ERR_NONE, std::move(msg));
+			continue;
+		}
+		chat_server_msgs msgs;
+		msgs.reserve(std::min(req.m_batch_max, m_in_msgs.size()));
+		while (msgs.size() < req.m_batch_max and not m_in_msgs.empty()) {
+			msgs.emplace_back(std::move(m_in_msgs.front()));
+			m_in_msgs.pop_front();
 		}
+		chat_server_on_batch_f cb = std::move(req.m_batch_cb);
+		req.m_batch_cb = nullptr;
+		cb(CHAT_ERR_NONE, std::move(msgs));
 	}
-	if (m_state == CHAT_SERVER_STATE_STOPPED)
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void
+chat_server_ctx::priv_in_strand_metrics_accept()
+{
+	assert(m_strand.running_in_this_thread());
+	if (not m_metrics_acceptor->is_open())
 		return;
-	// Unreachable. If it is reachable, then you have a bug.
-	abort();
+	m_metrics_conns.emplace_back(m_strand);
+	std::list<chat_server_metrics_conn>::iterator conn = std::prev(m_metrics_conns.end());
+	m_metrics_acceptor->async_accept(conn->m_sock, std::bind(
+		&chat_server_ctx::priv_in_strand_on_metrics_accept, shared_from_this(), conn,
+		std::placeholders::_1));
 }
 
 void
-chat_server_ctx::priv_in_strand_on_new_feed(
-	std::string_view text)
+chat_server_ctx::priv_in_strand_on_metrics_accept(
+	std::list<chat_server_metrics_conn>::iterator conn,
+	const boost::system::error_code& err)
 {
 	assert(m_strand.running_in_this_thread());
-	for (std::shared_ptr<chat_server_peer>& p : m_peers)
-		p->feed_async(text);
+	if (err) {
+		m_metrics_conns.erase(conn);
+		if (err == boost::asio::error::operation_aborted or
+			not m_metrics_acceptor->is_open())
+			return;
+		// Unlike the chat itself, the server can live without its metrics.
+		if (err != boost::asio::error::connection_aborted) {
+			std::cout << "Chat server metrics accept error: boost " << err << '\n';
+			boost::system::error_code close_err;
+			m_metrics_acceptor->close(close_err);
+			return;
+		}
+		priv_in_strand_metrics_accept();
+		return;
+	}
+	// Whatever the request is, it is read before the response. Otherwise closing the
+	// socket with unread data would reset the connection, and the client could lose the
+	// response.
+	conn->m_sock.async_read_some(boost::asio::buffer(conn->m_in_buf), std::bind(
+		&chat_server_ctx::priv_in_strand_on_metrics_request, shared_from_this(), conn,
+		std::placeholders::_1));
+	priv_in_strand_metrics_accept();
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////
+void
+chat_server_ctx::priv_in_strand_on_metrics_request(
+	std::list<chat_server_metrics_conn>::iterator conn,
+	const boost::system::error_code& err)
+{
+	assert(m_strand.running_in_this_thread());
+	if (err) {
+		m_metrics_conns.erase(conn);
+		return;
+	}
+	std::string body = chat_server_metrics_to_text(metrics());
+	conn->m_out.append("HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+		"Content-Length: ").append(std::to_string(body.size())).append("\r\n\r\n").
+		append(body);
+	boost::asio::async_write(conn->m_sock, boost::asio::buffer(conn->m_out), std::bind(
+		&chat_server_ctx::priv_in_strand_on_metrics_sent, shared_from_this(), conn));
+}
 
-//////////////////////////////////////////////////////////////////////////////////////////
+void
+chat_server_ctx::priv_in_strand_on_metrics_sent(
+	std::list<chat_server_metrics_conn>::iterator conn)
+{
+	assert(m_strand.running_in_this_thread());
+	boost::system::error_code err;
+	conn->m_sock.shutdown(boost::asio::ip::tcp::socket::shutdown_send, err);
+	conn->m_sock.close(err);
+	m_metrics_conns.erase(conn);
+}
@@ -2,19 +2,59 @@
 
 #include "chat.h"
 
+// Boost 1.74 awaitable.hpp uses std::exchange without including it.
+#include <utility>
+#include <boost/asio/awaitable.hpp>
 #include <functional>
+#include <string>
+#include <vector>
 
 namespace boost { namespace asio { class io_context; } }
 
 class chat_server_ctx;
 
 using chat_server_on_msg_f = std::function<void(chat_errcode err, std::unique_ptr<chat_message> msg)>;
+using chat_server_msgs = std::vector<std::unique_ptr<chat_message>>;
+using chat_server_on_batch_f = std::function<void(chat_errcode err, chat_server_msgs msgs)>;
+
+// All since the start, except the peer count.
+struct chat_server_metrics final
+{
+	// Connected right now.
+	uint64_t m_peer_count;
+	// Of the peers' sockets.
+	uint64_t m_bytes_in;
+	uint64_t m_bytes_out;
+	// The messages of the peers and of the server, each counted once regardless of how
+	// many peers it was sent to.
+	uint64_t m_msgs_routed;
+	// The most bytes ever waiting for a single peer to take them, the ones being sent
+	// included. A slow reader shows up here.
+	uint64_t m_max_queued_bytes;
+	// How long the peers' receipt and sending handlers took to run.
+	uint64_t m_handler_count;
+	uint64_t m_handler_total_ns;
+	uint64_t m_handler_max_ns;
+};
+
+// One "name value" line per counter.
+std::string
+chat_server_metrics_to_text(
+	const chat_server_metrics& metrics);
 
 class chat_server final
 {
 public:
 	chat_server(
 		boost::asio::io_context& ioCtx);
+	// The sharded mode. The server runs the peers on its own shard_count contexts,
+	// each in its own thread, and pins every peer to one of them on accept. So the
+	// peers need no strands and their handlers never migrate between threads. The
+	// given context still serves the requests of the user. 0 means no shards, all
+	// on the given context.
+	chat_server(
+		boost::asio::io_context& ioCtx,
+		uint32_t shard_count);
 	~chat_server();
 
 	chat_errcode
@@ -28,10 +68,40 @@ public:
 	recv_async(
 		chat_server_on_msg_f&& cb);
 
+	// Up to max messages at once, all the received ones. Waits while there are none,
+	// like recv_async(). The requests of both kinds are served in their order.
+	void
+	recv_batch_async(
+		size_t max,
+		chat_server_on_batch_f&& cb);
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+	// Same as recv_async(), for a coroutine. It is resumed in its own executor, not in
+	// the server's one. Unlike the callbacks, the requests of the coroutines don't
+	// allocate anything once the server has got enough of them for reuse.
+	boost::asio::awaitable<chat_recv_result>
+	co_recv();
+#endif
+
 	void
 	feed_async(
 		std::string_view text);
 
+	// Can be called from any thread. The counters are read one by one, so they might
+	// be slightly out of sync with each other.
+	chat_server_metrics
+	metrics() const;
+
+	// A plain HTTP endpoint on the given context, answering each connection with the
+	// metrics as text and closing it. For scraping. 0 means any free port. Only after
+	// start(), and from the same thread.
+	chat_errcode
+	start_metrics(
+		uint16_t port);
+
+	uint16_t
+	metrics_port() const;
+
 private:
 	const std::shared_ptr<chat_server_ctx> m_ctx;
 };
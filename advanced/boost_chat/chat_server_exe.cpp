@@ -5,14 +5,15 @@
 #include <boost/asio/io_context_strand.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/posix/stream_descriptor.hpp>
-#include <boost/asio/read.hpp>
 #include <iostream>
 
 class chat_server_app final
 {
 public:
 	chat_server_app(
-		uint16_t port);
+		uint16_t port,
+		uint32_t shard_count,
+		uint16_t metrics_port);
 
 	int
 	run();
@@ -61,13 +62,17 @@ port_from_str(const char *str, uint16_t *port)
 }
 
 chat_server_app::chat_server_app(
-	uint16_t port)
+	uint16_t port,
+	uint32_t shard_count,
+	uint16_t metrics_port)
 	: m_strand(m_ioctx)
-	, m_server(m_ioctx)
+	, m_server(m_ioctx, shard_count)
 	, m_input(m_ioctx, dup(STDIN_FILENO))
 	, m_res(0)
 {
 	m_server.start(port);
+	if (metrics_port != 0 and m_server.start_metrics(metrics_port) != CHAT_ERR_NONE)
+		std::cout << "Couldn't start the metrics on port " << metrics_port << '\n';
 	boost::asio::post(m_strand, std::bind(&chat_server_app::priv_recv_next, this));
 	boost::asio::post(m_strand, std::bind(&chat_server_app::priv_read_next, this));
 }
@@ -84,16 +89,21 @@ void
 chat_server_app::priv_recv_next()
 {
 	assert(m_strand.running_in_this_thread());
-	m_server.recv_async(boost::asio::bind_executor(m_strand,
-		std::bind(&chat_server_app::priv_on_recv, this, std::placeholders::_1,
-			std::placeholders::_2)));
+	// The callback is type-erased and loses its executor. So it is posted to the
+	// strand explicitly.
+	m_server.recv_async([this](chat_errcode err, std::unique_ptr<chat_message> msg) {
+		boost::asio::post(m_strand, [this, err, msg = std::move(msg)]() mutable {
+			priv_on_recv(err, std::move(msg));
+		});
+	});
 }
 
 void
 chat_server_app::priv_read_next()
 {
 	assert(m_strand.running_in_this_thread());
-	boost::asio::async_read(m_input, boost::asio::buffer(m_in_buf, CHAT_RECV_BUF_SIZE),
+	// Some, not all. Otherwise a short line would wait for more input.
+	m_input.async_read_some(boost::asio::buffer(m_in_buf, CHAT_RECV_BUF_SIZE),
 		boost::asio::bind_executor(m_strand,
 			std::bind(&chat_server_app::priv_on_input, this, std::placeholders::_1,
 				std::placeholders::_2)));
@@ -111,7 +121,7 @@ chat_server_app::priv_on_recv(
 		m_ioctx.stop();
 		return;
 	}
-	std::cout << msg->m_author << ": " << msg->m_data;
+	std::cout << msg->m_author << ": " << msg->m_data << '\n';
 	priv_recv_next();
 }
 
@@ -140,7 +150,8 @@ int
 main(int argc, char **argv)
 {
 	if (argc < 2) {
-		std::cout << "Expected a port to listen on\n";
+		std::cout << "Expected a port to listen on, and optionally a shard count and "
+			"a port for the metrics\n";
 		return -1;
 	}
 	uint16_t port = 0;
@@ -149,6 +160,14 @@ main(int argc, char **argv)
 		std::cout << "Invalid port\n";
 		return -1;
 	}
-	chat_server_app app(port);
+	// No shards by default, all on one context and thread.
+	uint32_t shard_count = argc >= 3 ? (uint32_t)atoi(argv[2]) : 0;
+	// Scraped with any HTTP client, like curl localhost:<port>.
+	uint16_t metrics_port = 0;
+	if (argc >= 4 and port_from_str(argv[3], &metrics_port) != 0) {
+		std::cout << "Invalid metrics port\n";
+		return -1;
+	}
+	chat_server_app app(port, shard_count, metrics_port);
 	return app.run();
 }
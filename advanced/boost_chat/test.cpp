@@ -3,8 +3,13 @@
 #include "chat_server.h"
 #include "unitpp.h"
 
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
 #include <boost/asio/executor_work_guard.hpp>
 #include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
 #include <thread>
 
 enum
@@ -67,7 +72,7 @@ struct test_msg final
 		memset(m_data.data(), '0', TEST_MSG_ID_LEN);
 		for (size_t i = TEST_MSG_ID_LEN; i < len; ++i)
 			m_data[i] = 'a' + i % ('z' - 'a' + 1);
-		m_data[len] = '\n';
+		m_data[len - 1] = '\n';
 	}
 
 	void
@@ -197,6 +202,17 @@ test_trivial()
 		unit_check(rc == CHAT_ERR_NONE, "start");
 	}
 	//
+	// Delete the sharded server without and after listen.
+	//
+	{
+		chat_server server(core.backend(), 3);
+	}
+	{
+		chat_server server(core.backend(), 3);
+		chat_errcode rc = server.start(0);
+		unit_check(rc == CHAT_ERR_NONE, "start sharded");
+	}
+	//
 	// Delete the client right away.
 	//
 	{
@@ -354,7 +370,7 @@ test_multi_feed()
 }
 
 static void
-test_multi_client(void)
+test_feed_burst()
 {
 	unit_test_start();
 
@@ -363,6 +379,51 @@ test_multi_client(void)
 
 	chat_server server(core.backend());
 	unit_assert(server.start(0) == CHAT_ERR_NONE);
+	//
+	// The feeds before the connection are all sent together, cut into lines the same
+	// as one feed. Half of them come in parts, the rest as the whole lines.
+	//
+	chat_client cli(core.backend(), "c1");
+	const uint32_t count = 1000;
+	for (uint32_t i = 0; i < count; ++i) {
+		if (i % 2 == 0) {
+			cli.feed_async(std::to_string(i));
+			cli.feed_async(" \n");
+		} else {
+			cli.feed_async(std::to_string(i) + "\n");
+		}
+	}
+	unit_assert(client_connect_blocking(
+		cli, make_addr_str(server.port())) == CHAT_ERR_NONE);
+	//
+	// The burst after the connection goes while the first writes are in progress.
+	//
+	for (uint32_t i = count; i < 2 * count; ++i)
+		cli.feed_async(std::to_string(i) + "\n");
+
+	uint32_t next = 0;
+	bool is_ok = true;
+	while (next < 2 * count) {
+		std::unique_ptr<chat_message> msg = server_recv_blocking(server);
+		is_ok = is_ok and msg->m_author == "c1" and
+			msg->m_data == std::to_string(next);
+		++next;
+	}
+	unit_check(is_ok, "data and order");
+}
+
+static void
+test_multi_client(
+	uint32_t shard_count)
+{
+	unit_test_start();
+	unit_msg("shard count " << shard_count);
+
+	io_core core;
+	core.start(3);
+
+	chat_server server(core.backend(), shard_count);
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
 	std::string endpoint = make_addr_str(server.port());
 
 	uint32_t client_count = 20;
@@ -373,7 +434,7 @@ test_multi_client(void)
 
 	unit_msg("Connect clients");
 	std::vector<std::unique_ptr<chat_client>> clis;
-	clis.resize(client_count);
+	clis.reserve(client_count);
 	for (uint32_t i = 0; i < client_count; ++i) {
 		clis.emplace_back(std::make_unique<chat_client>(
 			core.backend(), "cli_" + std::to_string(i)));
@@ -468,6 +529,128 @@ test_stress_worker_f(
 	}
 }
 
+static void
+test_few_peers()
+{
+	unit_test_start();
+	// Most of the shards are empty and the peers might share one or sit on different
+	// ones. The messages must get through either way. A new peer is known to the
+	// server once its message is received, and only then surely gets the messages of
+	// the others.
+	io_core core;
+	core.start(3);
+
+	chat_server server(core.backend(), 4);
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+
+	chat_client cli1(core.backend(), "c1");
+	unit_assert(client_connect_blocking(
+		cli1, make_addr_str(server.port())) == CHAT_ERR_NONE);
+	cli1.feed_async("msg1\n");
+	unit_check(server_recv_blocking(server)->m_data == "msg1", "server got msg1");
+
+	chat_client cli2(core.backend(), "c2");
+	unit_assert(client_connect_blocking(
+		cli2, make_addr_str(server.port())) == CHAT_ERR_NONE);
+	cli2.feed_async("msg2\n");
+	unit_check(server_recv_blocking(server)->m_data == "msg2", "server got msg2");
+	std::unique_ptr<chat_message> rsp = client_recv_blocking(cli1);
+	unit_check(rsp->m_data == "msg2" and rsp->m_author == "c2", "c1 got msg2");
+
+	cli1.feed_async("msg3\n");
+	unit_check(server_recv_blocking(server)->m_data == "msg3", "server got msg3");
+	rsp = client_recv_blocking(cli2);
+	unit_check(rsp->m_data == "msg3" and rsp->m_author == "c1", "c2 got msg3");
+
+	chat_client cli3(core.backend(), "c3");
+	unit_assert(client_connect_blocking(
+		cli3, make_addr_str(server.port())) == CHAT_ERR_NONE);
+	cli3.feed_async("msg4\n");
+	unit_check(server_recv_blocking(server)->m_data == "msg4", "server got msg4");
+	unit_check(client_recv_blocking(cli1)->m_data == "msg4", "c1 got msg4");
+	unit_check(client_recv_blocking(cli2)->m_data == "msg4", "c2 got msg4");
+
+	cli1.feed_async("msg5\n");
+	unit_check(server_recv_blocking(server)->m_data == "msg5", "server got msg5");
+	unit_check(client_recv_blocking(cli2)->m_data == "msg5", "c2 got msg5");
+	unit_check(client_recv_blocking(cli3)->m_data == "msg5", "c3 got msg5");
+}
+
+static void
+test_metrics()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(3);
+
+	chat_server server(core.backend(), 2);
+	unit_check(server.start_metrics(0) == CHAT_ERR_NOT_STARTED, "not started");
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+	unit_check(server.start_metrics(0) == CHAT_ERR_NONE, "start metrics");
+	unit_check(server.start_metrics(0) == CHAT_ERR_ALREADY_STARTED, "started twice");
+
+	// Nobody else to get it yet.
+	chat_client cli1(core.backend(), "c1");
+	unit_assert(client_connect_blocking(
+		cli1, make_addr_str(server.port())) == CHAT_ERR_NONE);
+	cli1.feed_async("msg1\n");
+	server_recv_blocking(server);
+
+	chat_client cli2(core.backend(), "c2");
+	unit_assert(client_connect_blocking(
+		cli2, make_addr_str(server.port())) == CHAT_ERR_NONE);
+	cli2.feed_async("msg2\n");
+	server_recv_blocking(server);
+	client_recv_blocking(cli1);
+
+	cli1.feed_async("msg3\nmsg4\n");
+	server_recv_blocking(server);
+	server_recv_blocking(server);
+	server.feed_async("msg5\n");
+	for (int i = 0; i < 3; ++i)
+		client_recv_blocking(cli2);
+	client_recv_blocking(cli1);
+	//
+	// The sending ends are counted after the clients get the data, so wait for them.
+	//
+	// "c2\nmsg2\n", "c1\nmsg3\n", "c1\nmsg4\n", "server\nmsg5\n" twice.
+	uint64_t bytes_out = 8 * 3 + 12 * 2;
+	chat_server_metrics m;
+	for (int i = 0; i < 1000; ++i) {
+		m = server.metrics();
+		if (m.m_bytes_out == bytes_out)
+			break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	unit_check(m.m_bytes_out == bytes_out, "bytes out");
+	unit_check(m.m_peer_count == 2, "peer count");
+	// Each name line and the messages.
+	unit_check(m.m_bytes_in == 3 * 2 + 5 * 4, "bytes in");
+	unit_check(m.m_msgs_routed == 5, "msgs routed");
+	unit_check(m.m_max_queued_bytes >= 12, "max queued");
+	unit_check(m.m_handler_count > 0 and m.m_handler_max_ns > 0 and
+		m.m_handler_total_ns >= m.m_handler_max_ns, "handler time");
+	//
+	// Scrape like an HTTP client would.
+	//
+	boost::asio::io_context ctx;
+	boost::asio::ip::tcp::socket sock(ctx);
+	sock.connect(boost::asio::ip::tcp::endpoint(
+		boost::asio::ip::address_v4::loopback(), server.metrics_port()));
+	boost::asio::write(sock, boost::asio::buffer(std::string_view(
+		"GET /metrics HTTP/1.0\r\n\r\n")));
+	std::string rsp;
+	boost::system::error_code err;
+	boost::asio::read(sock, boost::asio::dynamic_buffer(rsp), err);
+	unit_check(err == boost::asio::error::eof, "response is closed");
+	unit_check(rsp.starts_with("HTTP/1.0 200 OK\r\n"), "response status");
+	std::string body = chat_server_metrics_to_text(server.metrics());
+	unit_check(rsp.ends_with("\r\n\r\n" + body), "response body");
+	unit_check(body.find("chat_peers 2\n") != std::string::npos and
+		body.find("chat_msgs_routed 5\n") != std::string::npos, "body values");
+}
+
 static void
 test_stress()
 {
@@ -561,7 +744,7 @@ test_big_author()
 
 	cli1.feed_async(body);
 	std::unique_ptr<chat_message> rsp = server_recv_blocking(server);
-	body[body_len] = 0;
+	body.resize(body_len);
 	unit_check(rsp->m_data == body, "msg data");
 	unit_check(rsp->m_author == author1, "msg author");
 
@@ -570,6 +753,155 @@ test_big_author()
 	unit_check(rsp->m_author == author1, "msg author");
 }
 
+static void
+test_batch()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(3);
+
+	chat_server server(core.backend());
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+
+	chat_client cli(core.backend(), "c1");
+	unit_assert(client_connect_blocking(
+		cli, make_addr_str(server.port())) == CHAT_ERR_NONE);
+
+	event zero_ev;
+	chat_errcode err = CHAT_ERR_NONE;
+	server.recv_batch_async(0, [&](chat_errcode err_res, chat_server_msgs) {
+		err = err_res;
+		zero_ev.send();
+	});
+	zero_ev.recv();
+	unit_check(err == CHAT_ERR_INVALID_ARGUMENT, "zero max");
+	//
+	// All the messages come with one feed, so they are received together.
+	//
+	const uint32_t count = 100;
+	const uint32_t max = 30;
+	std::string feed;
+	for (uint32_t i = 0; i < count; ++i)
+		feed.append(std::to_string(i)).append(1, '\n');
+	cli.feed_async(feed);
+
+	uint32_t next = 0;
+	size_t max_size = 0;
+	bool is_ok = true;
+	while (next < count) {
+		event ev;
+		chat_server_msgs msgs;
+		server.recv_batch_async(max, [&](chat_errcode err_res,
+			chat_server_msgs msgs_res) {
+			err = err_res;
+			msgs = std::move(msgs_res);
+			ev.send();
+		});
+		ev.recv();
+		unit_assert(err == CHAT_ERR_NONE);
+		unit_assert(not msgs.empty() and msgs.size() <= max);
+		max_size = std::max(max_size, msgs.size());
+		for (std::unique_ptr<chat_message>& msg : msgs) {
+			is_ok = is_ok and msg->m_author == "c1" and
+				msg->m_data == std::to_string(next);
+			++next;
+		}
+	}
+	unit_check(next == count, "got all");
+	unit_check(is_ok, "data and order");
+	unit_check(max_size > 1, "batched");
+	//
+	// The single requests are served in order with the batch ones.
+	//
+	cli.feed_async("a\nb\nc\n");
+	chat_server_msgs msgs;
+	event batch_ev;
+	server.recv_batch_async(2, [&](chat_errcode, chat_server_msgs msgs_res) {
+		msgs = std::move(msgs_res);
+		batch_ev.send();
+	});
+	std::unique_ptr<chat_message> msg = server_recv_blocking(server);
+	batch_ev.recv();
+	unit_check(not msgs.empty() and msgs[0]->m_data == "a", "batch is first");
+	unit_check(msg->m_data == (msgs.size() == 1 ? "b" : "c"), "single is next");
+}
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+
+static void
+test_coroutines()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(3);
+
+	chat_server server(core.backend());
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+
+	chat_client cli1(core.backend(), "c1");
+	unit_assert(client_connect_blocking(
+		cli1, make_addr_str(server.port())) == CHAT_ERR_NONE);
+	chat_client cli2(core.backend(), "c2");
+	unit_assert(client_connect_blocking(
+		cli2, make_addr_str(server.port())) == CHAT_ERR_NONE);
+	//
+	// The coroutines run in their own context, not in the chat's one.
+	//
+	boost::asio::io_context coro_ctx;
+	boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work(
+		coro_ctx.get_executor());
+	std::thread coro_thread([&]() { coro_ctx.run(); });
+	const std::thread::id coro_thread_id = coro_thread.get_id();
+
+	const uint32_t count = 1000;
+	uint32_t server_count = 0;
+	uint32_t client_count = 0;
+	bool is_data_ok = true;
+	bool is_thread_ok = true;
+	event server_ev;
+	event client_ev;
+	boost::asio::co_spawn(coro_ctx,
+		[&]() -> boost::asio::awaitable<void> {
+		for (uint32_t i = 0; i < count; ++i) {
+			auto [err, msg] = co_await server.co_recv();
+			is_thread_ok = is_thread_ok and
+				std::this_thread::get_id() == coro_thread_id;
+			is_data_ok = is_data_ok and err == CHAT_ERR_NONE and
+				msg->m_author == "c1" and msg->m_data == std::to_string(i);
+			++server_count;
+		}
+		server_ev.send();
+	}, boost::asio::detached);
+	boost::asio::co_spawn(coro_ctx,
+		[&]() -> boost::asio::awaitable<void> {
+		for (uint32_t i = 0; i < count; ++i) {
+			auto [err, msg] = co_await cli2.co_recv();
+			is_thread_ok = is_thread_ok and
+				std::this_thread::get_id() == coro_thread_id;
+			is_data_ok = is_data_ok and err == CHAT_ERR_NONE and
+				msg->m_author == "c1" and msg->m_data == std::to_string(i);
+			++client_count;
+		}
+		client_ev.send();
+	}, boost::asio::detached);
+
+	unit_msg("send messages");
+	for (uint32_t i = 0; i < count; ++i)
+		cli1.feed_async(std::to_string(i) + "\n");
+	server_ev.recv();
+	client_ev.recv();
+	work.reset();
+	coro_thread.join();
+	unit_check(server_count == count, "server got all");
+	unit_check(client_count == count, "client got all");
+	unit_check(is_data_ok, "data and order");
+	unit_check(is_thread_ok, "resumed in own context");
+}
+
+#endif
+
 int
 main(void)
 {
@@ -579,8 +911,16 @@ main(void)
 	test_basic();
 	test_big_messages();
 	test_multi_feed();
-	test_multi_client();
+	test_feed_burst();
+	test_multi_client(0);
+	test_multi_client(3);
+	test_few_peers();
+	test_metrics();
 	test_stress();
 	test_big_author();
+	test_batch();
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+	test_coroutines();
+#endif
 	return 0;
 }
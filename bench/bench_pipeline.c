@@ -0,0 +1,573 @@
+/*
+ * The homeworks as one system: the chat server takes the messages in,
+ * the bus routes them, the thread pool processes them, and userfs
+ * stores them. Which of them limits the whole?
+ *
+ *     clients -> chat server -> corobus -> thread pool -> userfs
+ *                                                  |
+ *                  completion collector <----------+
+ *
+ * A load thread runs the chat clients, each in a room of its own so
+ * the server does not broadcast anything. A message carries the time
+ * it was fed at. The main thread runs the coroutines: the ingest one
+ * waits for the server's descriptor, updates the server, and sends
+ * each popped message into a bus channel. The routers take them out
+ * in batches, pick the room file, and push the tasks into the pool.
+ * A worker hashes the message the given number of rounds, which is
+ * the "processing", and appends it to the room's file in userfs. The
+ * collector waits for the pool's completion fd and joins the tasks.
+ *
+ * Each message gets a timestamp at every hand-over, so its time is
+ * split into the stages:
+ *
+ *     chat       from the feed in the client till popped from the
+ *                server, the sockets and the server's parsing;
+ *     bus        till a router took it from the channel;
+ *     pool queue till a worker started it;
+ *     process    the hashing;
+ *     userfs     the write;
+ *     complete   till the collector joined it.
+ *
+ * For each stage the mean, p50 and p99, and the mean number of the
+ * messages in it, by Little's law: the sum of their times in the
+ * stage over the run time. The stage where they pile up is the one
+ * which limits the rest. Also the peak depths seen by the bus channel
+ * and the pool themselves.
+ *
+ * Arguments, all optional: [clients] [messages per client]
+ * [message size] [pool threads] [process rounds] [rate]. The rate is
+ * of all the clients together, messages per second, 0 for as fast as
+ * they can. Without a rate the clients outrun the server, and the
+ * chat stage is the sockets' buffers filling up. A rate below the
+ * limit shows the latencies of a system which keeps up.
+ */
+#include "chat.h"
+#include "chat_client.h"
+#include "chat_server.h"
+#include "corobus.h"
+#include "libcoro.h"
+#include "thread_pool.h"
+#include "userfs.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	BENCH_CLIENT_COUNT = 8,
+	BENCH_MSG_COUNT = 20000,
+	BENCH_MSG_SIZE = 64,
+	BENCH_THREAD_COUNT = 4,
+	BENCH_ROUND_COUNT = 1,
+	/** Messages a client feeds at once, before sending them. */
+	BENCH_FEED_BATCH = 32,
+	BENCH_ROUTER_COUNT = 2,
+	BENCH_BUS_SIZE = 1024,
+	/** Tasks pushed into the pool and taken from it at once. */
+	BENCH_TASK_BATCH = 64,
+	BENCH_MSG_SIZE_MAX = 4000,
+};
+
+/** The timestamps of a message, one per hand-over. */
+enum bench_point {
+	BENCH_FED,
+	BENCH_POPPED,
+	BENCH_ROUTED,
+	BENCH_STARTED,
+	BENCH_PROCESSED,
+	BENCH_STORED,
+	BENCH_COLLECTED,
+	BENCH_POINT_COUNT,
+};
+
+static const char *bench_stage_names[] = {
+	"chat", "bus", "pool queue", "process", "userfs", "complete",
+};
+
+struct bench_ctx;
+
+/** A message on its way through the pipeline. */
+struct bench_rec {
+	struct bench_ctx *ctx;
+	struct chat_message *msg;
+	struct thread_task *task;
+	int room;
+	uint64_t hash;
+	uint64_t t[BENCH_POINT_COUNT];
+};
+
+struct bench_room {
+	int fd;
+	/** Where the next message of the room is written. */
+	size_t offset;
+};
+
+struct bench_ctx {
+	int client_count;
+	int msg_count;
+	int msg_size;
+	int thread_count;
+	int round_count;
+	double rate;
+	int total;
+	uint16_t port;
+	struct chat_server *server;
+	struct coro_bus *bus;
+	int channel;
+	struct thread_pool *pool;
+	struct bench_room *rooms;
+	struct bench_rec *recs;
+	/** Messages popped from the server, and joined in the pool. */
+	int popped_count;
+	int collected_count;
+	uint64_t push_retry_count;
+	int error_count;
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+	printf("Error: %s failed: %s\n", what, strerror(errno));
+	exit(-1);
+}
+
+static int
+bench_cmp_u64(const void *l, const void *r)
+{
+	uint64_t a = *(const uint64_t *)l;
+	uint64_t b = *(const uint64_t *)r;
+	return a < b ? -1 : a > b;
+}
+
+/** Feed the clients' messages, at the rate if there is one. */
+static void *
+bench_load_f(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	int count = ctx->client_count;
+	struct chat_client **clis = calloc(count, sizeof(*clis));
+	int *sent = calloc(count, sizeof(*sent));
+	struct pollfd *pfds = calloc(count, sizeof(*pfds));
+	int *pfd_clis = calloc(count, sizeof(*pfd_clis));
+	bench_check(clis != NULL && sent != NULL && pfds != NULL &&
+		pfd_clis != NULL, "calloc");
+	char addr[64];
+	sprintf(addr, "127.0.0.1:%u", ctx->port);
+	char line[BENCH_MSG_SIZE_MAX + 64];
+	for (int i = 0; i < count; ++i) {
+		clis[i] = chat_client_new("bench");
+		bench_check(chat_client_connect(clis[i], addr) == 0,
+			"connect");
+		int len = sprintf(line, "%s pipe%d\n", CHAT_JOIN_COMMAND, i);
+		bench_check(chat_client_feed(clis[i], line, len) == 0,
+			"feed");
+	}
+	uint64_t start = bench_now_ns();
+	int total_sent = 0;
+	while (true) {
+		int pfd_count = 0;
+		bool is_done = true;
+		uint64_t wait_ns = 0;
+		for (int i = 0; i < count; ++i) {
+			struct chat_client *cli = clis[i];
+			bool is_pending = (chat_client_get_events(cli) &
+				CHAT_EVENT_OUTPUT) != 0;
+			if (!is_pending && sent[i] < ctx->msg_count) {
+				int n = ctx->msg_count - sent[i];
+				if (n > BENCH_FEED_BATCH)
+					n = BENCH_FEED_BATCH;
+				if (ctx->rate > 0) {
+					/* Not ahead of the schedule. */
+					uint64_t due = start + (uint64_t)
+						((total_sent + n) * 1e9 /
+						ctx->rate);
+					uint64_t now = bench_now_ns();
+					if (due > now) {
+						if (wait_ns == 0 ||
+						    due - now < wait_ns)
+							wait_ns = due - now;
+						n = 0;
+					}
+				}
+				uint64_t now = bench_now_ns();
+				for (int j = 0; j < n; ++j) {
+					int len = sprintf(line, "%" PRIu64
+						" %d-%d ", now, i, sent[i] + j);
+					for (; len < ctx->msg_size; ++len)
+						line[len] = 'a' + len % 26;
+					line[len++] = '\n';
+					bench_check(chat_client_feed(cli, line,
+						len) == 0, "feed");
+				}
+				sent[i] += n;
+				total_sent += n;
+				if (n > 0)
+					chat_client_update(cli, 0);
+				is_pending = (chat_client_get_events(cli) &
+					CHAT_EVENT_OUTPUT) != 0;
+			}
+			if (is_pending) {
+				pfds[pfd_count].fd =
+					chat_client_get_descriptor(cli);
+				pfds[pfd_count].events = POLLOUT;
+				pfd_clis[pfd_count++] = i;
+			}
+			is_done = is_done && !is_pending &&
+				sent[i] == ctx->msg_count;
+		}
+		if (is_done)
+			break;
+		if (pfd_count == 0) {
+			/* Only the rate holds them back. */
+			struct timespec ts = {0, (long)wait_ns};
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		int timeout = wait_ns == 0 ? -1 : (int)(wait_ns / 1000000);
+		int rc = poll(pfds, pfd_count, timeout);
+		bench_check(rc >= 0 || errno == EINTR, "poll");
+		for (int i = 0; i < pfd_count; ++i) {
+			if (pfds[i].revents != 0)
+				chat_client_update(clis[pfd_clis[i]], 0);
+		}
+	}
+	/* The clients stay till the server has popped all. */
+	while (__atomic_load_n(&ctx->popped_count, __ATOMIC_ACQUIRE) <
+	       ctx->total)
+		usleep(1000);
+	for (int i = 0; i < count; ++i)
+		chat_client_delete(clis[i]);
+	free(clis);
+	free(sent);
+	free(pfds);
+	free(pfd_clis);
+	return NULL;
+}
+
+/** Take the messages from the server into the bus. */
+static void *
+bench_ingest_f(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	struct chat_server *server = ctx->server;
+	while (ctx->popped_count < ctx->total) {
+		/*
+		 * The update goes first: the ring's descriptor is not
+		 * readable till its first requests are submitted.
+		 */
+		int rc = chat_server_update(server, 0);
+		bench_check(rc == 0 || rc == CHAT_ERR_TIMEOUT, "update");
+		if (rc == CHAT_ERR_TIMEOUT) {
+			int events = chat_server_get_events(server);
+			int fd_events = 0;
+			if (events & CHAT_EVENT_INPUT)
+				fd_events |= CORO_FD_READ;
+			if (events & CHAT_EVENT_OUTPUT)
+				fd_events |= CORO_FD_WRITE;
+			bench_check(coro_wait_fd(chat_server_get_descriptor(
+				server), fd_events, -1) >= 0, "coro_wait_fd");
+			continue;
+		}
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(server)) != NULL) {
+			struct bench_rec *rec = &ctx->recs[ctx->popped_count];
+			rec->t[BENCH_POPPED] = bench_now_ns();
+			/* The client's time is the first in the text. */
+			rec->t[BENCH_FED] = strtoull(msg->data, NULL, 10);
+			rec->ctx = ctx;
+			rec->msg = msg;
+			__atomic_store_n(&ctx->popped_count,
+				ctx->popped_count + 1, __ATOMIC_RELEASE);
+			bench_check(coro_bus_send_msg(ctx->bus, ctx->channel,
+				&rec) == 0, "send");
+		}
+		/* The routers and the collector share the thread. */
+		coro_yield();
+	}
+	/* The routers stop at a NULL each. */
+	for (int i = 0; i < BENCH_ROUTER_COUNT; ++i) {
+		struct bench_rec *stop = NULL;
+		bench_check(coro_bus_send_msg(ctx->bus, ctx->channel,
+			&stop) == 0, "send");
+	}
+	return NULL;
+}
+
+/** A pool task: process a message, and store it in its room's file. */
+static void *
+bench_process_f(void *arg)
+{
+	struct bench_rec *rec = arg;
+	struct bench_ctx *ctx = rec->ctx;
+	rec->t[BENCH_STARTED] = bench_now_ns();
+	const char *data = rec->msg->data;
+	size_t size = strlen(data);
+	/* FNV-1a, each round over the previous one's result too. */
+	uint64_t hash = 14695981039346656037ULL;
+	for (int r = 0; r < ctx->round_count; ++r) {
+		for (size_t i = 0; i < size; ++i)
+			hash = (hash ^ (uint8_t)data[i]) * 1099511628211ULL;
+	}
+	rec->hash = hash;
+	rec->t[BENCH_PROCESSED] = bench_now_ns();
+	struct bench_room *room = &ctx->rooms[rec->room];
+	size_t offset = __atomic_fetch_add(&room->offset, size,
+		__ATOMIC_RELAXED);
+	if (ufs_pwrite(room->fd, data, size, offset) != (ssize_t)size)
+		__atomic_add_fetch(&ctx->error_count, 1, __ATOMIC_RELAXED);
+	rec->t[BENCH_STORED] = bench_now_ns();
+	chat_message_delete(rec->msg);
+	rec->msg = NULL;
+	return rec;
+}
+
+/** Push the routed tasks, waiting while the pool is full. */
+static void
+bench_push(struct bench_ctx *ctx, struct thread_task **tasks, int count)
+{
+	while (true) {
+		int rc = thread_pool_push_tasks(ctx->pool, tasks, count);
+		if (rc == 0)
+			return;
+		bench_check(rc == TPOOL_ERR_TOO_MANY_TASKS, "push");
+		++ctx->push_retry_count;
+		coro_sleep(0.0005);
+	}
+}
+
+/** Take the messages from the bus, and route them into the pool. */
+static void *
+bench_router_f(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	bool is_stopped = false;
+	while (!is_stopped) {
+		struct thread_task *tasks[BENCH_TASK_BATCH];
+		int count = 0;
+		struct bench_rec *rec;
+		bench_check(coro_bus_recv_msg(ctx->bus, ctx->channel,
+			&rec) == 0, "recv");
+		do {
+			if (rec == NULL) {
+				is_stopped = true;
+				break;
+			}
+			rec->t[BENCH_ROUTED] = bench_now_ns();
+			/* "<time> <client>-<seq> ..." */
+			const char *p = strchr(rec->msg->data, ' ');
+			bench_check(p != NULL, "parse");
+			rec->room = atoi(p + 1) % ctx->client_count;
+			thread_task_new(&rec->task, bench_process_f, rec);
+			thread_task_notify(rec->task);
+			tasks[count++] = rec->task;
+		} while (count < BENCH_TASK_BATCH &&
+			 coro_bus_try_recv_msg(ctx->bus, ctx->channel,
+				&rec) == 0);
+		if (count > 0)
+			bench_push(ctx, tasks, count);
+	}
+	return NULL;
+}
+
+/** Join the finished tasks. */
+static void *
+bench_collect_f(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	int fd = thread_pool_completion_fd(ctx->pool);
+	bench_check(fd >= 0, "completion_fd");
+	while (ctx->collected_count < ctx->total) {
+		struct thread_task *tasks[BENCH_TASK_BATCH];
+		int count = thread_pool_take_completions(ctx->pool, tasks,
+			BENCH_TASK_BATCH);
+		if (count == 0) {
+			bench_check(coro_wait_fd(fd, CORO_FD_READ, -1) >= 0,
+				"coro_wait_fd");
+			continue;
+		}
+		uint64_t now = bench_now_ns();
+		for (int i = 0; i < count; ++i) {
+			void *res;
+			bench_check(thread_task_join(tasks[i], &res) == 0,
+				"join");
+			thread_task_delete(tasks[i]);
+			struct bench_rec *rec = res;
+			rec->t[BENCH_COLLECTED] = now;
+		}
+		ctx->collected_count += count;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void
+bench_report(struct bench_ctx *ctx, uint64_t duration)
+{
+	int total = ctx->total;
+	uint64_t *times = malloc(sizeof(*times) * total);
+	bench_check(times != NULL, "malloc");
+	printf("stage        mean us   p50 us   p99 us   mean depth\n");
+	double worst_mean = 0;
+	int worst = 0;
+	for (int s = 0; s <= BENCH_COLLECTED; ++s) {
+		/* The last one is the whole way. */
+		int from = s < BENCH_COLLECTED ? s : BENCH_FED;
+		int to = s < BENCH_COLLECTED ? s + 1 : BENCH_COLLECTED;
+		uint64_t sum = 0;
+		for (int i = 0; i < total; ++i) {
+			const struct bench_rec *rec = &ctx->recs[i];
+			times[i] = rec->t[to] - rec->t[from];
+			sum += times[i];
+		}
+		qsort(times, total, sizeof(times[0]), bench_cmp_u64);
+		double mean = (double)sum / total / 1000;
+		const char *name = s < BENCH_COLLECTED ?
+			bench_stage_names[s] : "end-to-end";
+		printf("%-11s %8.1lf %8.1lf %8.1lf %12.1lf\n", name, mean,
+			times[total / 2] / 1000.0,
+			times[(uint64_t)total * 99 / 100] / 1000.0,
+			(double)sum / duration);
+		if (s < BENCH_COLLECTED && mean > worst_mean) {
+			worst_mean = mean;
+			worst = s;
+		} else if (s == BENCH_COLLECTED) {
+			printf("the slowest stage: %s, %.0lf%% of the "
+				"end-to-end time\n", bench_stage_names[worst],
+				worst_mean * 100 / mean);
+		}
+	}
+	free(times);
+
+	struct coro_bus_channel_stats bus_stats;
+	bench_check(coro_bus_channel_stats(ctx->bus, ctx->channel,
+		&bus_stats) == 0, "channel_stats");
+	printf("bus channel: peak %zu of %zu, the ingest waited for it "
+		"%" PRIu64 " times, %.1lf ms\n", bus_stats.size_max,
+		bus_stats.size_limit, bus_stats.send_wait_count,
+		bus_stats.send_wait_ns / 1e6);
+	struct thread_pool_stats pool_stats;
+	thread_pool_get_stats(ctx->pool, &pool_stats);
+	printf("pool: peak queue %d, %d threads, mean wait %.1lf us, "
+		"mean run %.1lf us, %" PRIu64 " pushes retried\n",
+		pool_stats.peak_queue_depth, pool_stats.thread_count,
+		pool_stats.wait_ns_sum / 1000.0 / total,
+		pool_stats.run_ns_sum / 1000.0 / total,
+		ctx->push_retry_count);
+}
+
+static int
+bench_arg(int argc, char **argv, int index, int def)
+{
+	return argc > index ? atoi(argv[index]) : def;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.client_count = bench_arg(argc, argv, 1, BENCH_CLIENT_COUNT);
+	ctx.msg_count = bench_arg(argc, argv, 2, BENCH_MSG_COUNT);
+	ctx.msg_size = bench_arg(argc, argv, 3, BENCH_MSG_SIZE);
+	ctx.thread_count = bench_arg(argc, argv, 4, BENCH_THREAD_COUNT);
+	ctx.round_count = bench_arg(argc, argv, 5, BENCH_ROUND_COUNT);
+	ctx.rate = argc > 6 ? atof(argv[6]) : 0;
+	if (ctx.client_count <= 0 || ctx.msg_count <= 0 ||
+	    ctx.msg_size <= 0 || ctx.msg_size > BENCH_MSG_SIZE_MAX ||
+	    ctx.thread_count <= 0 || ctx.thread_count > TPOOL_MAX_THREADS ||
+	    ctx.round_count < 0 || ctx.rate < 0) {
+		printf("Usage: %s [clients] [messages per client] "
+			"[message size] [pool threads] [process rounds] "
+			"[rate]\n", argv[0]);
+		return -1;
+	}
+	ctx.total = ctx.client_count * ctx.msg_count;
+	ctx.recs = calloc(ctx.total, sizeof(*ctx.recs));
+	ctx.rooms = calloc(ctx.client_count, sizeof(*ctx.rooms));
+	bench_check(ctx.recs != NULL && ctx.rooms != NULL, "calloc");
+	for (int i = 0; i < ctx.client_count; ++i) {
+		char name[32];
+		sprintf(name, "pipe%d", i);
+		ctx.rooms[i].fd = ufs_open(name, UFS_CREATE | UFS_READ_WRITE);
+		bench_check(ctx.rooms[i].fd >= 0, "ufs_open");
+	}
+
+	ctx.server = chat_server_new();
+	bench_check(chat_server_listen(ctx.server, 0) == 0, "listen");
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	bench_check(getsockname(chat_server_get_socket(ctx.server),
+		(struct sockaddr *)&addr, &len) == 0, "getsockname");
+	ctx.port = ntohs(addr.sin_port);
+	struct thread_pool_attr attr;
+	thread_pool_attr_create(&attr);
+	attr.is_timed = true;
+	bench_check(thread_pool_new_ex(ctx.thread_count, &attr,
+		&ctx.pool) == 0, "thread_pool_new");
+
+	coro_sched_init();
+	ctx.bus = coro_bus_new();
+	ctx.channel = coro_bus_channel_open_ex(ctx.bus, BENCH_BUS_SIZE,
+		sizeof(struct bench_rec *));
+	bench_check(ctx.channel >= 0, "channel_open");
+	struct coro *coros[BENCH_ROUTER_COUNT + 2];
+	coros[0] = coro_new(bench_ingest_f, &ctx);
+	coros[1] = coro_new(bench_collect_f, &ctx);
+	for (int i = 0; i < BENCH_ROUTER_COUNT; ++i)
+		coros[i + 2] = coro_new(bench_router_f, &ctx);
+
+	pthread_t load;
+	bench_check(pthread_create(&load, NULL, bench_load_f, &ctx) == 0,
+		"pthread_create");
+	coro_sched_run();
+	for (int i = 0; i < BENCH_ROUTER_COUNT + 2; ++i)
+		coro_join(coros[i]);
+	pthread_join(load, NULL);
+	bench_check(ctx.error_count == 0, "ufs_pwrite");
+	uint64_t first = ctx.recs[0].t[BENCH_FED];
+	uint64_t last = 0;
+	for (int i = 0; i < ctx.total; ++i) {
+		const struct bench_rec *rec = &ctx.recs[i];
+		if (rec->t[BENCH_FED] < first)
+			first = rec->t[BENCH_FED];
+		if (rec->t[BENCH_COLLECTED] > last)
+			last = rec->t[BENCH_COLLECTED];
+	}
+	printf("%d clients x %d messages of %d bytes, %d pool threads, "
+		"%d rounds\n", ctx.client_count, ctx.msg_count, ctx.msg_size,
+		ctx.thread_count, ctx.round_count);
+	printf("throughput: %.0lf messages per second\n",
+		ctx.total * 1e9 / (last - first));
+	bench_report(&ctx, last - first);
+
+	coro_bus_delete(ctx.bus);
+	coro_sched_destroy();
+	thread_pool_delete(ctx.pool);
+	chat_server_delete(ctx.server);
+	for (int i = 0; i < ctx.client_count; ++i)
+		ufs_close(ctx.rooms[i].fd);
+	ufs_destroy();
+	free(ctx.rooms);
+	free(ctx.recs);
+	return 0;
+}
@@ -0,0 +1,338 @@
+/*
+ * Bonus tasks (5) and (7), the atomics and the cache lines, extended
+ * with the layouts and the operations the counters can choose from.
+ *
+ * - store: task (5). The threads increment a shared counter until the
+ *   limit, each iteration also does an atomic store of the given memory
+ *   order into a shared value. Time per 1000 iterations in total;
+ * - counters: task (7). Each thread increments its own counter, the
+ *   counters are packed next to each other, or padded to 64 or 128
+ *   bytes. 128 because some CPUs prefetch the cache lines in pairs.
+ *   Time per 1000 increments of one thread;
+ * - fetch_add vs CAS: the threads increment a shared counter with
+ *   __atomic_fetch_add() or with a compare-and-swap loop, like the
+ *   updates which can't be a single instruction. Time per increment
+ *   in total;
+ * - fences: one thread does stores to its own memory, plain, with a
+ *   seq_cst fence after each, or seq_cst stores. Time per store.
+ *
+ * Build and run, see also `make bench`:
+ *
+ *   gcc -O2 -I utils utils/bench.c bonus/bench_atomic.c \
+ *       -o bench_atomic -lpthread
+ *   ./bench_atomic [thread counts, 1 2 4 by default]
+ */
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum {
+	BENCH_STORE_COUNT = 10000000,
+	BENCH_COUNTER_COUNT = 10000000,
+	BENCH_SHARED_COUNT = 10000000,
+	BENCH_FENCE_COUNT = 10000000,
+	BENCH_MAX_THREAD_COUNT = 64,
+	/** The biggest padding of the counters. */
+	BENCH_MAX_STRIDE = 128,
+};
+
+typedef void (*bench_worker_f)(void *arg, int idx);
+
+/**
+ * Threads started at once and waited for. The time of the creation is
+ * not counted.
+ */
+struct bench_threads {
+	pthread_barrier_t barrier;
+	bench_worker_f worker;
+	void *arg;
+};
+
+struct bench_thread {
+	struct bench_threads *threads;
+	int idx;
+	pthread_t id;
+};
+
+static void *
+bench_thread_f(void *arg)
+{
+	struct bench_thread *t = arg;
+	pthread_barrier_wait(&t->threads->barrier);
+	t->threads->worker(t->threads->arg, t->idx);
+	return NULL;
+}
+
+/** Run the worker in the threads, each gets the arg and its index. */
+static void
+bench_threads_run(int count, bench_worker_f worker, void *arg)
+{
+	struct bench_threads threads;
+	struct bench_thread list[BENCH_MAX_THREAD_COUNT];
+	threads.worker = worker;
+	threads.arg = arg;
+	bench_pause();
+	pthread_barrier_init(&threads.barrier, NULL, count + 1);
+	for (int i = 0; i < count; ++i) {
+		list[i].threads = &threads;
+		list[i].idx = i;
+		if (pthread_create(&list[i].id, NULL, bench_thread_f,
+				   &list[i]) != 0)
+			abort();
+	}
+	bench_resume();
+	pthread_barrier_wait(&threads.barrier);
+	for (int i = 0; i < count; ++i)
+		pthread_join(list[i].id, NULL);
+	bench_pause();
+	pthread_barrier_destroy(&threads.barrier);
+	bench_resume();
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct bench_store {
+	int thread_count;
+	int order;
+	uint64_t counter;
+	/** On its own cache line, not to share it with the counter. */
+	uint64_t value __attribute__((aligned(64)));
+};
+
+/** The orders must be the constants to compile into the stores. */
+#define BENCH_STORE_LOOP(s, order) do {					\
+	volatile uint64_t random_on_stack = rand();			\
+	while (__atomic_add_fetch(&(s)->counter, 1, __ATOMIC_RELAXED) <	\
+	       BENCH_STORE_COUNT)					\
+		__atomic_store_n(&(s)->value, random_on_stack, order);	\
+} while (0)
+
+static void
+bench_store_worker_f(void *arg, int idx)
+{
+	(void)idx;
+	struct bench_store *s = arg;
+	switch (s->order) {
+	case __ATOMIC_RELAXED:
+		BENCH_STORE_LOOP(s, __ATOMIC_RELAXED);
+		break;
+	case __ATOMIC_RELEASE:
+		BENCH_STORE_LOOP(s, __ATOMIC_RELEASE);
+		break;
+	case __ATOMIC_SEQ_CST:
+		BENCH_STORE_LOOP(s, __ATOMIC_SEQ_CST);
+		break;
+	default:
+		abort();
+	}
+}
+
+static uint64_t
+bench_store_f(void *arg)
+{
+	struct bench_store *s = arg;
+	s->counter = 0;
+	bench_threads_run(s->thread_count, bench_store_worker_f, s);
+	return BENCH_STORE_COUNT / 1000;
+}
+
+static void
+bench_stores(int thread_count)
+{
+	const int orders[] = {__ATOMIC_RELAXED, __ATOMIC_RELEASE,
+			      __ATOMIC_SEQ_CST};
+	const char *const names[] = {"relaxed", "release", "seq_cst"};
+	char title[128];
+	for (int i = 0; i < 3; ++i) {
+		struct bench_store s;
+		s.thread_count = thread_count;
+		s.order = orders[i];
+		snprintf(title, sizeof(title), "store %s, %d threads, ns per "
+			 "1000 iterations", names[i], thread_count);
+		bench_run(title, bench_store_f, &s, NULL);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct bench_counters {
+	int thread_count;
+	/** Bytes from one counter to the next. */
+	int stride;
+	char *mem;
+};
+
+static void
+bench_counter_worker_f(void *arg, int idx)
+{
+	struct bench_counters *c = arg;
+	uint64_t *counter = (uint64_t *)(c->mem + c->stride * idx);
+	for (int i = 0; i < BENCH_COUNTER_COUNT; ++i)
+		__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+bench_counters_f(void *arg)
+{
+	struct bench_counters *c = arg;
+	bench_threads_run(c->thread_count, bench_counter_worker_f, c);
+	return BENCH_COUNTER_COUNT / 1000;
+}
+
+static void
+bench_counters(int thread_count)
+{
+	const int strides[] = {sizeof(uint64_t), 64, 128};
+	char title[128];
+	char *mem = aligned_alloc(BENCH_MAX_STRIDE,
+				  BENCH_MAX_STRIDE * BENCH_MAX_THREAD_COUNT);
+	if (mem == NULL)
+		abort();
+	for (int i = 0; i < 3; ++i) {
+		struct bench_counters c;
+		c.thread_count = thread_count;
+		c.stride = strides[i];
+		c.mem = mem;
+		snprintf(title, sizeof(title), "counters %d bytes apart, %d "
+			 "threads, ns per 1000 increments", c.stride,
+			 thread_count);
+		bench_run(title, bench_counters_f, &c, NULL);
+	}
+	free(mem);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct bench_shared {
+	int thread_count;
+	bool use_cas;
+	uint64_t counter;
+};
+
+static void
+bench_shared_worker_f(void *arg, int idx)
+{
+	(void)idx;
+	struct bench_shared *s = arg;
+	int count = BENCH_SHARED_COUNT / s->thread_count;
+	if (!s->use_cas) {
+		for (int i = 0; i < count; ++i)
+			__atomic_fetch_add(&s->counter, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	for (int i = 0; i < count; ++i) {
+		uint64_t old = __atomic_load_n(&s->counter, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&s->counter, &old, old + 1,
+						    true, __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED))
+			;
+	}
+}
+
+static uint64_t
+bench_shared_f(void *arg)
+{
+	struct bench_shared *s = arg;
+	s->counter = 0;
+	bench_threads_run(s->thread_count, bench_shared_worker_f, s);
+	uint64_t total = BENCH_SHARED_COUNT / s->thread_count *
+		s->thread_count;
+	if (s->counter != total) {
+		fprintf(stderr, "lost increments: %llu of %llu\n",
+			(unsigned long long)s->counter,
+			(unsigned long long)total);
+		exit(-1);
+	}
+	return total;
+}
+
+static void
+bench_shared(int thread_count)
+{
+	char title[128];
+	for (int i = 0; i < 2; ++i) {
+		struct bench_shared s;
+		s.thread_count = thread_count;
+		s.use_cas = i == 1;
+		snprintf(title, sizeof(title), "shared counter %s, %d threads, "
+			 "ns per increment", s.use_cas ? "CAS loop" :
+			 "fetch_add", thread_count);
+		bench_run(title, bench_shared_f, &s, NULL);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+static volatile uint64_t bench_fence_value;
+
+static uint64_t
+bench_plain_store_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < BENCH_FENCE_COUNT; ++i)
+		bench_fence_value = i;
+	return BENCH_FENCE_COUNT;
+}
+
+static uint64_t
+bench_fence_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < BENCH_FENCE_COUNT; ++i) {
+		bench_fence_value = i;
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	return BENCH_FENCE_COUNT;
+}
+
+static uint64_t
+bench_seq_cst_store_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < BENCH_FENCE_COUNT; ++i)
+		__atomic_store_n(&bench_fence_value, i, __ATOMIC_SEQ_CST);
+	return BENCH_FENCE_COUNT;
+}
+
+static void
+bench_fences(void)
+{
+	bench_run("plain store, ns per store", bench_plain_store_f, NULL,
+		  NULL);
+	bench_run("store and seq_cst fence, ns per store", bench_fence_f,
+		  NULL, NULL);
+	bench_run("seq_cst store, ns per store", bench_seq_cst_store_f, NULL,
+		  NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+	int thread_counts[BENCH_MAX_THREAD_COUNT] = {1, 2, 4};
+	int count = 3;
+	if (argc > 1) {
+		count = 0;
+		for (int i = 1; i < argc; ++i) {
+			int n = atoi(argv[i]);
+			if (n < 1 || n > BENCH_MAX_THREAD_COUNT ||
+			    count == BENCH_MAX_THREAD_COUNT) {
+				fprintf(stderr, "Thread count must be in "
+					"[1, %d]\n", BENCH_MAX_THREAD_COUNT);
+				return -1;
+			}
+			thread_counts[count++] = n;
+		}
+	}
+	for (int i = 0; i < count; ++i)
+		bench_stores(thread_counts[i]);
+	for (int i = 0; i < count; ++i)
+		bench_counters(thread_counts[i]);
+	for (int i = 0; i < count; ++i)
+		bench_shared(thread_counts[i]);
+	bench_fences();
+	return 0;
+}
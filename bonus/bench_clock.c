@@ -0,0 +1,254 @@
+/*
+ * Bonus task (1), the cost of getting the time. Per one call of:
+ *
+ * - clock_gettime() with each clock, through the vDSO, which is how
+ *   libc calls it. The coarse clocks only read the time of the last
+ *   tick, the others also read the clock source;
+ * - clock_gettime() forced through the syscall path, which the vDSO
+ *   falls back to when the clock source can't be read in userspace,
+ *   like on some VMs;
+ * - the CPU's own counter, rdtsc and rdtscp on x86, cntvct_el0 on
+ *   arm64. rdtscp waits for the previous instructions to finish;
+ * - clock_gettime(CLOCK_MONOTONIC) called by N threads at once.
+ *
+ * The clock source is printed first, with "tsc" the vDSO reads the
+ * counter, with "kvm-clock" or "hpet" it might be way slower.
+ *
+ * Build and run, see also `make bench`:
+ *
+ *   gcc -O2 -I utils utils/bench.c bonus/bench_clock.c \
+ *       -o bench_clock -lpthread
+ *   ./bench_clock [thread counts, 1 2 4 by default]
+ */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+enum {
+	BENCH_CALL_COUNT = 10000000,
+	/** The syscalls are much slower, no need to wait that long. */
+	BENCH_SYSCALL_CALL_COUNT = 1000000,
+	BENCH_MAX_THREAD_COUNT = 64,
+};
+
+/** Not to let the compiler throw the loops away. */
+static volatile uint64_t bench_sum;
+
+struct bench_clock {
+	const char *name;
+	clockid_t id;
+};
+
+static const struct bench_clock bench_clocks[] = {
+	{"CLOCK_REALTIME", CLOCK_REALTIME},
+	{"CLOCK_MONOTONIC", CLOCK_MONOTONIC},
+#if defined(CLOCK_MONOTONIC_RAW)
+	{"CLOCK_MONOTONIC_RAW", CLOCK_MONOTONIC_RAW},
+#endif
+#if defined(CLOCK_REALTIME_COARSE)
+	{"CLOCK_REALTIME_COARSE", CLOCK_REALTIME_COARSE},
+#endif
+#if defined(CLOCK_MONOTONIC_COARSE)
+	{"CLOCK_MONOTONIC_COARSE", CLOCK_MONOTONIC_COARSE},
+#endif
+#if defined(CLOCK_BOOTTIME)
+	{"CLOCK_BOOTTIME", CLOCK_BOOTTIME},
+#endif
+};
+
+static uint64_t
+bench_vdso_f(void *arg)
+{
+	clockid_t id = *(const clockid_t *)arg;
+	uint64_t sum = 0;
+	for (int i = 0; i < BENCH_CALL_COUNT; ++i) {
+		struct timespec ts;
+		clock_gettime(id, &ts);
+		sum += ts.tv_nsec;
+	}
+	bench_sum += sum;
+	return BENCH_CALL_COUNT;
+}
+
+#if defined(__linux__)
+
+static uint64_t
+bench_syscall_f(void *arg)
+{
+	clockid_t id = *(const clockid_t *)arg;
+	uint64_t sum = 0;
+	for (int i = 0; i < BENCH_SYSCALL_CALL_COUNT; ++i) {
+		struct timespec ts;
+		syscall(SYS_clock_gettime, id, &ts);
+		sum += ts.tv_nsec;
+	}
+	bench_sum += sum;
+	return BENCH_SYSCALL_CALL_COUNT;
+}
+
+#endif /* defined(__linux__) */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static uint64_t
+bench_rdtsc_f(void *arg)
+{
+	(void)arg;
+	uint64_t sum = 0;
+	for (int i = 0; i < BENCH_CALL_COUNT; ++i)
+		sum += __rdtsc();
+	bench_sum += sum;
+	return BENCH_CALL_COUNT;
+}
+
+static uint64_t
+bench_rdtscp_f(void *arg)
+{
+	(void)arg;
+	uint64_t sum = 0;
+	unsigned aux;
+	for (int i = 0; i < BENCH_CALL_COUNT; ++i)
+		sum += __rdtscp(&aux);
+	bench_sum += sum;
+	return BENCH_CALL_COUNT;
+}
+
+#elif defined(__aarch64__)
+
+static uint64_t
+bench_cntvct_f(void *arg)
+{
+	(void)arg;
+	uint64_t sum = 0;
+	for (int i = 0; i < BENCH_CALL_COUNT; ++i) {
+		uint64_t v;
+		__asm__ volatile("mrs %0, cntvct_el0" : "=r"(v));
+		sum += v;
+	}
+	bench_sum += sum;
+	return BENCH_CALL_COUNT;
+}
+
+#endif
+
+static void *
+bench_worker_f(void *arg)
+{
+	int count = *(const int *)arg;
+	uint64_t sum = 0;
+	for (int i = 0; i < count; ++i) {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		sum += ts.tv_nsec;
+	}
+	bench_sum += sum;
+	return NULL;
+}
+
+/**
+ * Each thread does its own BENCH_CALL_COUNT calls, so the result is
+ * the time of a call as seen by a thread. It stays flat while there
+ * are enough cores and the calls don't contend on anything.
+ */
+static uint64_t
+bench_threads_f(void *arg)
+{
+	int thread_count = *(const int *)arg;
+	int count = BENCH_CALL_COUNT;
+	pthread_t threads[BENCH_MAX_THREAD_COUNT];
+	for (int i = 0; i < thread_count; ++i) {
+		if (pthread_create(&threads[i], NULL, bench_worker_f,
+				   &count) != 0)
+			abort();
+	}
+	for (int i = 0; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	return BENCH_CALL_COUNT;
+}
+
+static void
+bench_print_clocksource(void)
+{
+#if defined(__linux__)
+	const char *path =
+		"/sys/devices/system/clocksource/clocksource0/current_clocksource";
+	FILE *f = fopen(path, "r");
+	char name[64];
+	if (f != NULL && fscanf(f, "%63s", name) == 1)
+		fprintf(stderr, "Clock source: %s\n", name);
+	if (f != NULL)
+		fclose(f);
+#endif
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_print_clocksource();
+	char title[128];
+	int clock_count = sizeof(bench_clocks) / sizeof(bench_clocks[0]);
+	for (int i = 0; i < clock_count; ++i) {
+		const struct bench_clock *c = &bench_clocks[i];
+		struct timespec res;
+		clock_getres(c->id, &res);
+		fprintf(stderr, "%s resolution: %ld ns\n", c->name,
+			(long)(res.tv_sec * 1000000000 + res.tv_nsec));
+	}
+	for (int i = 0; i < clock_count; ++i) {
+		const struct bench_clock *c = &bench_clocks[i];
+		snprintf(title, sizeof(title), "clock_gettime(%s), ns per call",
+			 c->name);
+		bench_run(title, bench_vdso_f, (void *)&c->id, NULL);
+	}
+#if defined(__linux__)
+	for (int i = 0; i < clock_count; ++i) {
+		const struct bench_clock *c = &bench_clocks[i];
+		snprintf(title, sizeof(title), "syscall clock_gettime(%s), ns "
+			 "per call", c->name);
+		bench_run(title, bench_syscall_f, (void *)&c->id, NULL);
+	}
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	bench_run("rdtsc, ns per call", bench_rdtsc_f, NULL, NULL);
+	bench_run("rdtscp, ns per call", bench_rdtscp_f, NULL, NULL);
+#elif defined(__aarch64__)
+	bench_run("cntvct_el0, ns per call", bench_cntvct_f, NULL, NULL);
+#endif
+	int default_counts[] = {1, 2, 4};
+	int thread_counts[BENCH_MAX_THREAD_COUNT];
+	int count = 0;
+	for (int i = 1; i < argc && count < BENCH_MAX_THREAD_COUNT; ++i) {
+		int n = atoi(argv[i]);
+		if (n < 1 || n > BENCH_MAX_THREAD_COUNT) {
+			fprintf(stderr, "Thread count must be in [1, %d]\n",
+				BENCH_MAX_THREAD_COUNT);
+			return -1;
+		}
+		thread_counts[count++] = n;
+	}
+	if (count == 0) {
+		count = sizeof(default_counts) / sizeof(default_counts[0]);
+		for (int i = 0; i < count; ++i)
+			thread_counts[i] = default_counts[i];
+	}
+	for (int i = 0; i < count; ++i) {
+		snprintf(title, sizeof(title), "clock_gettime(CLOCK_MONOTONIC) "
+			 "in %d threads, ns per call", thread_counts[i]);
+		bench_run(title, bench_threads_f, &thread_counts[i], NULL);
+	}
+	return 0;
+}
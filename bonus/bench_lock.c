@@ -0,0 +1,426 @@
+/*
+ * Bonus task (3), lock/unlock in N threads, extended to a matrix of
+ * the locks by the thread counts by the critical section lengths.
+ * The threads together do BENCH_LOCK_COUNT locks, the result is the
+ * time per one lock/unlock pair. The critical section is a number of
+ * increments of a shared counter, which is checked afterwards.
+ *
+ * The locks:
+ * - mutex: pthread_mutex_t, what 4/thread_pool.c uses;
+ * - spin_cas: the full barrier CAS loop, lecture_examples/6_threads/
+ *   7_spin_lock.c;
+ * - spin_tas: test-and-set with acquire/release, 8_6_spinlock_acq_rel.c;
+ * - spin_ttas: spins on a plain load with a CPU pause, and only then
+ *   tries the test-and-set, so the waiters don't bounce the cache line;
+ * - spin_sleep: test-and-set, after 1000 failures usleep(10). Like in
+ *   utils/heap_help;
+ * - futex: 8_futex.c, which does the wake syscall on each unlock;
+ * - futex3: the futex with the third state "locked with waiters",
+ *   from Drepper's "Futexes Are Tricky". No syscalls without
+ *   contention;
+ * - ticket: a fair FIFO spinlock, the waiters spin on one counter;
+ * - mcs: a queue spinlock, each waiter spins on its own node.
+ *
+ * With more threads than cores the spinlocks burn the time slices of
+ * the preempted holders, the sleeping locks don't.
+ *
+ * Build and run, see also `make bench`:
+ *
+ *   gcc -O2 -I utils utils/bench.c bonus/bench_lock.c \
+ *       -o bench_lock -lpthread
+ *   ./bench_lock [thread counts, 1 2 4 8 by default]
+ */
+#define _GNU_SOURCE
+
+#include "bench.h"
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum {
+	BENCH_LOCK_COUNT = 1000000,
+	BENCH_MAX_THREAD_COUNT = 64,
+	BENCH_SPIN_SLEEP_TRIES = 1000,
+	BENCH_SPIN_SLEEP_US = 10,
+};
+
+static inline void
+bench_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+/** Per thread state of a lock, only MCS needs it. */
+struct bench_mcs_node {
+	struct bench_mcs_node *next;
+	bool is_locked;
+};
+
+/** All the locks in one, each lock type uses its own members. */
+struct bench_lock {
+	pthread_mutex_t mutex;
+	bool flag;
+	int futex;
+	uint32_t ticket_next;
+	uint32_t ticket_owner;
+	struct bench_mcs_node *mcs_tail;
+};
+
+////////////////////////////////////////////////////////////////////////////
+
+static inline void
+mutex_lock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	pthread_mutex_lock(&l->mutex);
+}
+
+static inline void
+mutex_unlock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	pthread_mutex_unlock(&l->mutex);
+}
+
+static inline void
+spin_cas_lock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	while (!__sync_bool_compare_and_swap(&l->flag, 0, 1))
+		;
+}
+
+static inline void
+spin_cas_unlock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	__sync_bool_compare_and_swap(&l->flag, 1, 0);
+}
+
+static inline void
+spin_tas_lock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	while (__atomic_test_and_set(&l->flag, __ATOMIC_ACQUIRE))
+		;
+}
+
+static inline void
+spin_tas_unlock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	__atomic_clear(&l->flag, __ATOMIC_RELEASE);
+}
+
+static inline void
+spin_ttas_lock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	while (__atomic_test_and_set(&l->flag, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&l->flag, __ATOMIC_RELAXED))
+			bench_cpu_relax();
+	}
+}
+
+#define spin_ttas_unlock spin_tas_unlock
+
+static inline void
+spin_sleep_lock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	while (true) {
+		for (int i = 0; i < BENCH_SPIN_SLEEP_TRIES; ++i) {
+			if (!__atomic_test_and_set(&l->flag, __ATOMIC_SEQ_CST))
+				return;
+		}
+		usleep(BENCH_SPIN_SLEEP_US);
+	}
+}
+
+static inline void
+spin_sleep_unlock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	__atomic_clear(&l->flag, __ATOMIC_SEQ_CST);
+}
+
+static inline void
+bench_futex_wait(int *futex, int val)
+{
+	syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void
+bench_futex_wake(int *futex)
+{
+	syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static inline void
+futex_lock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	while (__sync_val_compare_and_swap(&l->futex, 0, 1) != 0)
+		bench_futex_wait(&l->futex, 1);
+}
+
+static inline void
+futex_unlock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	__sync_bool_compare_and_swap(&l->futex, 1, 0);
+	bench_futex_wake(&l->futex);
+}
+
+/** 0 - free, 1 - locked, 2 - locked and maybe someone waits. */
+static inline void
+futex3_lock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	int c = 0;
+	if (__atomic_compare_exchange_n(&l->futex, &c, 1, false,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	if (c != 2)
+		c = __atomic_exchange_n(&l->futex, 2, __ATOMIC_ACQUIRE);
+	while (c != 0) {
+		bench_futex_wait(&l->futex, 2);
+		c = __atomic_exchange_n(&l->futex, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static inline void
+futex3_unlock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	if (__atomic_fetch_sub(&l->futex, 1, __ATOMIC_RELEASE) == 1)
+		return;
+	__atomic_store_n(&l->futex, 0, __ATOMIC_RELEASE);
+	bench_futex_wake(&l->futex);
+}
+
+static inline void
+ticket_lock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	uint32_t ticket = __atomic_fetch_add(&l->ticket_next, 1,
+					     __ATOMIC_RELAXED);
+	while (__atomic_load_n(&l->ticket_owner, __ATOMIC_ACQUIRE) != ticket)
+		bench_cpu_relax();
+}
+
+static inline void
+ticket_unlock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	(void)n;
+	/* Only the owner writes it, no need for an atomic increment. */
+	__atomic_store_n(&l->ticket_owner, l->ticket_owner + 1,
+			 __ATOMIC_RELEASE);
+}
+
+static inline void
+mcs_lock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	n->next = NULL;
+	n->is_locked = true;
+	struct bench_mcs_node *prev = __atomic_exchange_n(&l->mcs_tail, n,
+							  __ATOMIC_ACQ_REL);
+	if (prev == NULL)
+		return;
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&n->is_locked, __ATOMIC_ACQUIRE))
+		bench_cpu_relax();
+}
+
+static inline void
+mcs_unlock(struct bench_lock *l, struct bench_mcs_node *n)
+{
+	struct bench_mcs_node *next = __atomic_load_n(&n->next,
+						      __ATOMIC_ACQUIRE);
+	if (next == NULL) {
+		struct bench_mcs_node *self = n;
+		if (__atomic_compare_exchange_n(&l->mcs_tail, &self, NULL,
+						false, __ATOMIC_RELEASE,
+						__ATOMIC_RELAXED))
+			return;
+		/* A new waiter is linking itself. */
+		while ((next = __atomic_load_n(&n->next,
+					       __ATOMIC_ACQUIRE)) == NULL)
+			bench_cpu_relax();
+	}
+	__atomic_store_n(&next->is_locked, false, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct bench_lock_run {
+	struct bench_lock lock;
+	pthread_barrier_t barrier;
+	int thread_count;
+	int cs_len;
+	/** Locks per thread. */
+	int count;
+	/** Accessed only under the lock. */
+	volatile uint64_t counter;
+};
+
+/** A worker per lock, so the lock calls are inlined. */
+#define BENCH_LOCK_WORKER(name)						\
+static void *								\
+bench_##name##_f(void *arg)						\
+{									\
+	struct bench_lock_run *r = arg;					\
+	struct bench_mcs_node node;					\
+	pthread_barrier_wait(&r->barrier);				\
+	for (int i = 0; i < r->count; ++i) {				\
+		name##_lock(&r->lock, &node);				\
+		for (int j = 0; j < r->cs_len; ++j)			\
+			r->counter = r->counter + 1;			\
+		name##_unlock(&r->lock, &node);				\
+	}								\
+	return NULL;							\
+}
+
+BENCH_LOCK_WORKER(mutex)
+BENCH_LOCK_WORKER(spin_cas)
+BENCH_LOCK_WORKER(spin_tas)
+BENCH_LOCK_WORKER(spin_ttas)
+BENCH_LOCK_WORKER(spin_sleep)
+BENCH_LOCK_WORKER(futex)
+BENCH_LOCK_WORKER(futex3)
+BENCH_LOCK_WORKER(ticket)
+BENCH_LOCK_WORKER(mcs)
+
+struct bench_lock_type {
+	const char *name;
+	void *(*worker)(void *);
+	/**
+	 * The lock is handed to the waiters in order. With more threads
+	 * than cores, the next one is often preempted, and each handoff
+	 * waits for a time slice. Such runs take forever and are skipped.
+	 */
+	bool is_fifo_spin;
+};
+
+static const struct bench_lock_type bench_lock_types[] = {
+	{"mutex", bench_mutex_f, false},
+	{"spin_cas", bench_spin_cas_f, false},
+	{"spin_tas", bench_spin_tas_f, false},
+	{"spin_ttas", bench_spin_ttas_f, false},
+	{"spin_sleep", bench_spin_sleep_f, false},
+	{"futex", bench_futex_f, false},
+	{"futex3", bench_futex3_f, false},
+	{"ticket", bench_ticket_f, true},
+	{"mcs", bench_mcs_f, true},
+};
+
+struct bench_case {
+	const struct bench_lock_type *type;
+	int thread_count;
+	int cs_len;
+};
+
+static uint64_t
+bench_lock_f(void *arg)
+{
+	const struct bench_case *c = arg;
+	struct bench_lock_run r;
+	bench_pause();
+	pthread_mutex_init(&r.lock.mutex, NULL);
+	r.lock.flag = false;
+	r.lock.futex = 0;
+	r.lock.ticket_next = 0;
+	r.lock.ticket_owner = 0;
+	r.lock.mcs_tail = NULL;
+	r.thread_count = c->thread_count;
+	r.cs_len = c->cs_len;
+	r.count = BENCH_LOCK_COUNT / c->thread_count;
+	r.counter = 0;
+	pthread_barrier_init(&r.barrier, NULL, c->thread_count + 1);
+	pthread_t threads[BENCH_MAX_THREAD_COUNT];
+	for (int i = 0; i < c->thread_count; ++i) {
+		if (pthread_create(&threads[i], NULL, c->type->worker,
+				   &r) != 0)
+			abort();
+	}
+	bench_resume();
+	pthread_barrier_wait(&r.barrier);
+	for (int i = 0; i < c->thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	bench_pause();
+	uint64_t total = (uint64_t)r.count * c->thread_count;
+	uint64_t expected = total * c->cs_len;
+	if (r.counter != expected) {
+		fprintf(stderr, "%s is broken, counter %llu, expected %llu\n",
+			c->type->name, (unsigned long long)r.counter,
+			(unsigned long long)expected);
+		exit(-1);
+	}
+	pthread_barrier_destroy(&r.barrier);
+	pthread_mutex_destroy(&r.lock.mutex);
+	bench_resume();
+	return total;
+}
+
+/** All the locks with the given threads and critical section. */
+static void
+bench_locks(int thread_count, int cs_len)
+{
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	const int type_count = sizeof(bench_lock_types) /
+		sizeof(bench_lock_types[0]);
+	char title[128];
+	for (int i = 0; i < type_count; ++i) {
+		struct bench_case c;
+		c.type = &bench_lock_types[i];
+		c.thread_count = thread_count;
+		c.cs_len = cs_len;
+		if (c.type->is_fifo_spin && thread_count > cpu_count) {
+			fprintf(stderr, "%s, %d threads: skipped, more threads "
+				"than %ld CPUs\n", c.type->name, thread_count,
+				cpu_count);
+			continue;
+		}
+		snprintf(title, sizeof(title), "%s, %d threads, critical "
+			 "section %d, ns per lock", c.type->name, thread_count,
+			 cs_len);
+		bench_run(title, bench_lock_f, &c, NULL);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	int thread_counts[BENCH_MAX_THREAD_COUNT] = {1, 2, 4, 8};
+	int thread_count_count = 4;
+	if (argc > 1) {
+		thread_count_count = 0;
+		for (int i = 1; i < argc; ++i) {
+			int n = atoi(argv[i]);
+			if (n < 1 || n > BENCH_MAX_THREAD_COUNT ||
+			    thread_count_count == BENCH_MAX_THREAD_COUNT) {
+				fprintf(stderr, "Thread count must be in "
+					"[1, %d]\n", BENCH_MAX_THREAD_COUNT);
+				return -1;
+			}
+			thread_counts[thread_count_count++] = n;
+		}
+	}
+	const int cs_lens[] = {1, 10, 100};
+	const int cs_len_count = sizeof(cs_lens) / sizeof(cs_lens[0]);
+	for (int l = 0; l < cs_len_count; ++l) {
+		for (int t = 0; t < thread_count_count; ++t)
+			bench_locks(thread_counts[t], cs_lens[l]);
+	}
+	return 0;
+}
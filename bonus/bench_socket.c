@@ -0,0 +1,665 @@
+/*
+ * Bonus task (2), socket throughput, extended with the ways to push
+ * the data into a socket other than send(). A sender thread pushes
+ * the total size in packs, a receiver thread gets it all with recv()
+ * of the pack size. Per run are taken MB per second and the CPU time
+ * of the whole process per GB, user plus system. The operations of the
+ * harness are megabytes, so its ops/s are MB/s.
+ *
+ * - send: a send() per pack;
+ * - writev: a writev() of BENCH_IOV_COUNT packs;
+ * - splice: vmsplice() of a pack into a pipe, then splice() from the
+ *   pipe into the socket. The pages are not copied into the pipe;
+ * - sendfile: sendfile() from a memfd, no user buffer at all;
+ * - zerocopy: send() with MSG_ZEROCOPY, the completions are collected
+ *   from the socket's error queue. TCP only. On loopback the kernel
+ *   copies anyway, the run shows the cost of the bookkeeping;
+ * - io_uring: linked IORING_OP_SEND batches on one side and
+ *   IORING_OP_RECV on the other;
+ * - SO_SNDBUF sweep: send() with the buffers of the both sides set.
+ *   The sizes above net.core.wmem_max/rmem_max are cut by the kernel,
+ *   the actual ones are in the titles.
+ *
+ * The sockets are blocking, each side has its own thread. The data is
+ * not checked, the send buffer is reused before its zero-copy
+ * completion, fine for the throughput. Linux only.
+ *
+ * Build and run, see also `make bench`:
+ *
+ *   gcc -O2 -I utils utils/bench.c bonus/bench_socket.c \
+ *       -o bench_socket -lpthread
+ *   ./bench_socket [total MB, 512 by default]
+ */
+#define _GNU_SOURCE
+
+#include "bench.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+enum {
+	BENCH_MB = 1024 * 1024,
+	BENCH_DEFAULT_TOTAL_MB = 512,
+	BENCH_IOV_COUNT = 16,
+	/** The memfd for sendfile() is sent over and over. */
+	BENCH_FILE_SIZE = 4 * BENCH_MB,
+	/** Zero-copy sends not completed yet, before waiting for them. */
+	BENCH_ZEROCOPY_MAX_INFLIGHT = 256,
+	/** Sends in one submission, and the ring size. */
+	BENCH_URING_BATCH = 16,
+	/** The CPU times of the last runs kept for the stats. */
+	BENCH_MAX_CPU_RUNS = 64,
+};
+
+enum bench_transport {
+	BENCH_TRANSPORT_UNIX,
+	BENCH_TRANSPORT_TCP,
+};
+
+enum bench_mode {
+	BENCH_MODE_SEND,
+	BENCH_MODE_WRITEV,
+	BENCH_MODE_SPLICE,
+	BENCH_MODE_SENDFILE,
+	BENCH_MODE_ZEROCOPY,
+	BENCH_MODE_URING,
+};
+
+static const char *const bench_transport_names[] = {"unix", "tcp"};
+static const char *const bench_mode_names[] = {
+	"send", "writev", "splice", "sendfile", "zerocopy", "io_uring",
+};
+
+struct bench_socket {
+	enum bench_transport transport;
+	enum bench_mode mode;
+	size_t pack_size;
+	/** SO_SNDBUF and SO_RCVBUF to set, 0 to keep the defaults. */
+	int buf_size;
+	/** The buffer size the kernel actually set. */
+	int real_buf_size;
+	uint64_t total;
+	int fd_send;
+	int fd_recv;
+	char *buf_send;
+	char *buf_recv;
+	/** CPU ms per GB, by the run index modulo the size. */
+	double cpu_ms_per_gb[BENCH_MAX_CPU_RUNS];
+	int run_count;
+};
+
+static void
+bench_die(const char *what)
+{
+	fprintf(stderr, "%s: %s\n", what, strerror(errno));
+	exit(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Minimal io_uring, only what the bench needs.
+
+struct bench_uring {
+	int fd;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static int
+bench_uring_create(struct bench_uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -1;
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_SQ_RING);
+	ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_CQ_RING);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED ||
+	    ring->sqes == MAP_FAILED)
+		bench_die("io_uring mmap");
+	char *sq = ring->sq_ptr;
+	char *cq = ring->cq_ptr;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+static void
+bench_uring_destroy(struct bench_uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+static bool
+bench_uring_is_supported(void)
+{
+	struct bench_uring ring;
+	if (bench_uring_create(&ring, 1) != 0)
+		return false;
+	bench_uring_destroy(&ring);
+	return true;
+}
+
+/** Queue a send or a recv, the ring is never overfilled by the bench. */
+static void
+bench_uring_prep(struct bench_uring *ring, int opcode, int fd, void *buf,
+		 size_t size, int msg_flags, int sqe_flags)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = size;
+	sqe->msg_flags = msg_flags;
+	sqe->flags = sqe_flags;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Submit the queued requests and wait for all of them. Returns the sum
+ * of the positive results, the failed and cancelled ones are skipped.
+ */
+static uint64_t
+bench_uring_submit_and_wait(struct bench_uring *ring, unsigned count)
+{
+	if (syscall(__NR_io_uring_enter, ring->fd, count, count,
+		    IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		bench_die("io_uring_enter");
+	uint64_t res = 0;
+	unsigned head = *ring->cq_head;
+	for (unsigned i = 0; i < count; ++i, ++head) {
+		if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+			bench_die("io_uring lost a completion");
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		if (cqe->res > 0) {
+			res += cqe->res;
+		} else if (cqe->res != -ECANCELED && cqe->res != 0) {
+			fprintf(stderr, "io_uring: %s\n",
+				strerror(-cqe->res));
+		}
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return res;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// The senders. Each sends exactly the total size.
+
+static void
+bench_send_plain(struct bench_socket *b)
+{
+	uint64_t left = b->total;
+	while (left > 0) {
+		size_t size = left < b->pack_size ? left : b->pack_size;
+		ssize_t rc = send(b->fd_send, b->buf_send, size, 0);
+		if (rc < 0)
+			bench_die("send");
+		left -= rc;
+	}
+}
+
+static void
+bench_send_writev(struct bench_socket *b)
+{
+	struct iovec iov[BENCH_IOV_COUNT];
+	uint64_t left = b->total;
+	while (left > 0) {
+		int count = 0;
+		uint64_t batch = 0;
+		for (; count < BENCH_IOV_COUNT && batch < left; ++count) {
+			size_t size = b->pack_size;
+			if (size > left - batch)
+				size = left - batch;
+			iov[count].iov_base = b->buf_send +
+				count * b->pack_size;
+			iov[count].iov_len = size;
+			batch += size;
+		}
+		ssize_t rc = writev(b->fd_send, iov, count);
+		if (rc < 0)
+			bench_die("writev");
+		left -= rc;
+		/* A partial write, send the rest of the batch plainly. */
+		for (uint64_t sent = rc; sent < batch;) {
+			rc = send(b->fd_send, b->buf_send + sent, batch - sent,
+				  0);
+			if (rc < 0)
+				bench_die("send");
+			sent += rc;
+			left -= rc;
+		}
+	}
+}
+
+static void
+bench_send_splice(struct bench_socket *b)
+{
+	int pipefd[2];
+	if (pipe(pipefd) != 0)
+		bench_die("pipe");
+	uint64_t left = b->total;
+	while (left > 0) {
+		size_t size = left < b->pack_size ? left : b->pack_size;
+		struct iovec iov = {b->buf_send, size};
+		ssize_t in = vmsplice(pipefd[1], &iov, 1, 0);
+		if (in < 0)
+			bench_die("vmsplice");
+		for (ssize_t out = 0; out < in;) {
+			ssize_t rc = splice(pipefd[0], NULL, b->fd_send, NULL,
+					    in - out, SPLICE_F_MOVE |
+					    SPLICE_F_MORE);
+			if (rc < 0)
+				bench_die("splice");
+			out += rc;
+		}
+		left -= in;
+	}
+	close(pipefd[0]);
+	close(pipefd[1]);
+}
+
+static void
+bench_send_sendfile(struct bench_socket *b)
+{
+	int fd = memfd_create("bench_socket", 0);
+	if (fd < 0)
+		bench_die("memfd_create");
+	for (size_t done = 0; done < BENCH_FILE_SIZE; done += b->pack_size) {
+		if (write(fd, b->buf_send, b->pack_size) < 0)
+			bench_die("write");
+	}
+	uint64_t left = b->total;
+	off_t offset = 0;
+	while (left > 0) {
+		size_t size = left < b->pack_size ? left : b->pack_size;
+		if (offset + size > BENCH_FILE_SIZE)
+			offset = 0;
+		ssize_t rc = sendfile(b->fd_send, fd, &offset, size);
+		if (rc < 0)
+			bench_die("sendfile");
+		left -= rc;
+	}
+	close(fd);
+}
+
+/** Collect the zero-copy completions, returns how many sends are done. */
+static uint32_t
+bench_zerocopy_reap(int fd)
+{
+	uint32_t res = 0;
+	while (true) {
+		char control[128];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return res;
+			bench_die("recvmsg errqueue");
+		}
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+		     cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err *err =
+				(struct sock_extended_err *)CMSG_DATA(cm);
+			if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			/* The range of the send numbers, inclusive. */
+			res += err->ee_data - err->ee_info + 1;
+		}
+	}
+}
+
+/** The error queue is signaled as POLLERR, which needs no request. */
+static void
+bench_zerocopy_wait(int fd)
+{
+	struct pollfd pfd = {fd, 0, 0};
+	if (poll(&pfd, 1, -1) < 0)
+		bench_die("poll");
+}
+
+static void
+bench_send_zerocopy(struct bench_socket *b)
+{
+	int one = 1;
+	if (setsockopt(b->fd_send, SOL_SOCKET, SO_ZEROCOPY, &one,
+		       sizeof(one)) != 0)
+		bench_die("SO_ZEROCOPY");
+	uint64_t left = b->total;
+	uint64_t inflight = 0;
+	while (left > 0) {
+		size_t size = left < b->pack_size ? left : b->pack_size;
+		ssize_t rc = send(b->fd_send, b->buf_send, size, MSG_ZEROCOPY);
+		bool must_wait = false;
+		if (rc >= 0) {
+			left -= rc;
+			++inflight;
+		} else if (errno == ENOBUFS) {
+			/* Out of the locked memory for the pinned pages. */
+			must_wait = true;
+		} else {
+			bench_die("send zerocopy");
+		}
+		inflight -= bench_zerocopy_reap(b->fd_send);
+		while (inflight > 0 && (must_wait ||
+		       inflight > BENCH_ZEROCOPY_MAX_INFLIGHT)) {
+			bench_zerocopy_wait(b->fd_send);
+			inflight -= bench_zerocopy_reap(b->fd_send);
+			must_wait = false;
+		}
+	}
+	while (inflight > 0) {
+		bench_zerocopy_wait(b->fd_send);
+		inflight -= bench_zerocopy_reap(b->fd_send);
+	}
+}
+
+static void
+bench_send_uring(struct bench_socket *b)
+{
+	struct bench_uring ring;
+	if (bench_uring_create(&ring, BENCH_URING_BATCH) != 0)
+		bench_die("io_uring_setup");
+	uint64_t left = b->total;
+	while (left > 0) {
+		unsigned count = 0;
+		uint64_t batch = 0;
+		for (; count < BENCH_URING_BATCH && batch < left; ++count) {
+			size_t size = b->pack_size;
+			if (size > left - batch)
+				size = left - batch;
+			batch += size;
+			/*
+			 * Linked, so they go in order. MSG_WAITALL makes a
+			 * short send retried instead of breaking the link.
+			 */
+			int flags = count + 1 < BENCH_URING_BATCH &&
+				batch < left ? IOSQE_IO_LINK : 0;
+			bench_uring_prep(&ring, IORING_OP_SEND, b->fd_send,
+					 b->buf_send, size, MSG_WAITALL, flags);
+		}
+		left -= bench_uring_submit_and_wait(&ring, count);
+	}
+	bench_uring_destroy(&ring);
+}
+
+static void *
+bench_recv_f(void *arg)
+{
+	struct bench_socket *b = arg;
+	struct bench_uring ring;
+	bool use_uring = b->mode == BENCH_MODE_URING;
+	if (use_uring && bench_uring_create(&ring, 1) != 0)
+		bench_die("io_uring_setup");
+	uint64_t left = b->total;
+	while (left > 0) {
+		size_t size = left < b->pack_size ? left : b->pack_size;
+		if (use_uring) {
+			bench_uring_prep(&ring, IORING_OP_RECV, b->fd_recv,
+					 b->buf_recv, size, 0, 0);
+			left -= bench_uring_submit_and_wait(&ring, 1);
+			continue;
+		}
+		ssize_t rc = recv(b->fd_recv, b->buf_recv, size, 0);
+		if (rc < 0)
+			bench_die("recv");
+		if (rc == 0) {
+			fprintf(stderr, "recv: unexpected EOF\n");
+			exit(-1);
+		}
+		left -= rc;
+	}
+	if (use_uring)
+		bench_uring_destroy(&ring);
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+static void
+bench_socket_pair(struct bench_socket *b)
+{
+	int fds[2];
+	if (b->transport == BENCH_TRANSPORT_UNIX) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+			bench_die("socketpair");
+	} else {
+		int lfd = socket(AF_INET, SOCK_STREAM, 0);
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof(addr);
+		if (lfd < 0 ||
+		    bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+		    listen(lfd, 1) != 0 ||
+		    getsockname(lfd, (struct sockaddr *)&addr, &len) != 0)
+			bench_die("listen");
+		fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+		if (fds[0] < 0 || connect(fds[0], (struct sockaddr *)&addr,
+					  sizeof(addr)) != 0)
+			bench_die("connect");
+		fds[1] = accept(lfd, NULL, NULL);
+		if (fds[1] < 0)
+			bench_die("accept");
+		close(lfd);
+	}
+	b->fd_send = fds[0];
+	b->fd_recv = fds[1];
+	if (b->buf_size == 0)
+		return;
+	if (setsockopt(b->fd_send, SOL_SOCKET, SO_SNDBUF, &b->buf_size,
+		       sizeof(b->buf_size)) != 0 ||
+	    setsockopt(b->fd_recv, SOL_SOCKET, SO_RCVBUF, &b->buf_size,
+		       sizeof(b->buf_size)) != 0)
+		bench_die("setsockopt");
+	socklen_t len = sizeof(b->real_buf_size);
+	if (getsockopt(b->fd_send, SOL_SOCKET, SO_SNDBUF, &b->real_buf_size,
+		       &len) != 0)
+		bench_die("getsockopt");
+}
+
+static uint64_t
+bench_cpu_ns(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ((uint64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) *
+		1000000000 + ((uint64_t)ru.ru_utime.tv_usec +
+			      ru.ru_stime.tv_usec) * 1000;
+}
+
+/** The ops are megabytes, so the ops per second are MB/s. */
+static uint64_t
+bench_socket_f(void *arg)
+{
+	struct bench_socket *b = arg;
+	bench_pause();
+	bench_socket_pair(b);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, bench_recv_f, b) != 0)
+		abort();
+	bench_resume();
+	uint64_t cpu_start = bench_cpu_ns();
+	switch (b->mode) {
+	case BENCH_MODE_SEND:
+		bench_send_plain(b);
+		break;
+	case BENCH_MODE_WRITEV:
+		bench_send_writev(b);
+		break;
+	case BENCH_MODE_SPLICE:
+		bench_send_splice(b);
+		break;
+	case BENCH_MODE_SENDFILE:
+		bench_send_sendfile(b);
+		break;
+	case BENCH_MODE_ZEROCOPY:
+		bench_send_zerocopy(b);
+		break;
+	case BENCH_MODE_URING:
+		bench_send_uring(b);
+		break;
+	default:
+		abort();
+	}
+	pthread_join(thread, NULL);
+	uint64_t cpu = bench_cpu_ns() - cpu_start;
+	b->cpu_ms_per_gb[b->run_count++ % BENCH_MAX_CPU_RUNS] =
+		cpu / 1000000.0 * 1024 * BENCH_MB / b->total;
+	bench_pause();
+	close(b->fd_send);
+	close(b->fd_recv);
+	bench_resume();
+	return b->total / BENCH_MB;
+}
+
+static void
+bench_socket(struct bench_socket *b)
+{
+	size_t buf_size = b->pack_size * BENCH_IOV_COUNT;
+	b->buf_send = malloc(buf_size);
+	b->buf_recv = malloc(b->pack_size);
+	if (b->buf_send == NULL || b->buf_recv == NULL)
+		abort();
+	memset(b->buf_send, 'x', buf_size);
+	b->run_count = 0;
+	b->real_buf_size = 0;
+	char title[128];
+	int len = snprintf(title, sizeof(title), "%s, %s, pack %zu",
+			   bench_transport_names[b->transport],
+			   bench_mode_names[b->mode], b->pack_size);
+	if (b->buf_size != 0) {
+		/* To get the real size into the title. */
+		bench_socket_pair(b);
+		close(b->fd_send);
+		close(b->fd_recv);
+		len += snprintf(title + len, sizeof(title) - len,
+				", SO_SNDBUF %d (got %d)", b->buf_size,
+				b->real_buf_size);
+	}
+	snprintf(title + len, sizeof(title) - len, ", ns per MB");
+	struct bench_stats stats;
+	bench_run(title, bench_socket_f, b, &stats);
+	int count = stats.run_count;
+	if (count > BENCH_MAX_CPU_RUNS)
+		count = BENCH_MAX_CPU_RUNS;
+	double cpu[BENCH_MAX_CPU_RUNS];
+	for (int i = 0; i < count; ++i) {
+		int run = b->run_count - count + i;
+		cpu[i] = b->cpu_ms_per_gb[run % BENCH_MAX_CPU_RUNS];
+	}
+	bench_stats_create(&stats, cpu, count);
+	snprintf(title + len, sizeof(title) - len, ", CPU ms per GB");
+	bench_print(title, &stats);
+	free(b->buf_send);
+	free(b->buf_recv);
+}
+
+int
+main(int argc, char **argv)
+{
+	int total_mb = BENCH_DEFAULT_TOTAL_MB;
+	if (argc > 1 && (total_mb = atoi(argv[1])) <= 0) {
+		fprintf(stderr, "Usage: %s [total MB]\n", argv[0]);
+		return -1;
+	}
+	struct bench_socket b;
+	memset(&b, 0, sizeof(b));
+	b.total = (uint64_t)total_mb * BENCH_MB;
+	const size_t packs[] = {512, 1024, 16 * 1024, 48 * 1024};
+	const int pack_count = sizeof(packs) / sizeof(packs[0]);
+	bool has_uring = bench_uring_is_supported();
+	if (!has_uring)
+		fprintf(stderr, "io_uring is not supported, skipped\n");
+	for (int t = BENCH_TRANSPORT_UNIX; t <= BENCH_TRANSPORT_TCP; ++t) {
+		b.transport = t;
+		for (int m = BENCH_MODE_SEND; m <= BENCH_MODE_URING; ++m) {
+			if (m == BENCH_MODE_ZEROCOPY &&
+			    t != BENCH_TRANSPORT_TCP)
+				continue;
+			if (m == BENCH_MODE_URING && !has_uring)
+				continue;
+			b.mode = m;
+			for (int i = 0; i < pack_count; ++i) {
+				b.pack_size = packs[i];
+				bench_socket(&b);
+			}
+		}
+	}
+	const int buf_sizes[] = {64 * 1024, 256 * 1024, 1024 * 1024,
+				 4 * 1024 * 1024};
+	const int buf_count = sizeof(buf_sizes) / sizeof(buf_sizes[0]);
+	b.mode = BENCH_MODE_SEND;
+	b.pack_size = 16 * 1024;
+	for (int t = BENCH_TRANSPORT_UNIX; t <= BENCH_TRANSPORT_TCP; ++t) {
+		b.transport = t;
+		for (int i = 0; i < buf_count; ++i) {
+			b.buf_size = buf_sizes[i];
+			bench_socket(&b);
+		}
+	}
+	return 0;
+}
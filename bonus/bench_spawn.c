@@ -0,0 +1,158 @@
+/*
+ * Bonus task (4), the cost of a thread, next to the things used in
+ * the homeworks instead of the threads. All in ns per one round trip
+ * from the start to the result picked up, so they fit one chart, for
+ * example with BENCH_FORMAT=csv:
+ *
+ * - pthread: pthread_create() and pthread_join() of an empty thread;
+ * - thread pool: thread_pool_push_task() and thread_task_join() of an
+ *   empty task of 4/, the same task each time, into a pool of 1 or 4
+ *   workers. The workers are sleeping between the tasks, so each push
+ *   is also a wakeup;
+ * - libcoro spawn: coro_new() and coro_join() of an empty coroutine of
+ *   1/, done by another coroutine. The stacks come from the pool;
+ * - libcoro yield: two coroutines do coro_yield() in turns, per one
+ *   yield. A round of the scheduler is 2 yields and 3 switches, the
+ *   last one back to the scheduler;
+ * - iocoro spawn: an IOCoroutine of examples/cpp20_coroutines started
+ *   and finished, the frames come from the pool. See
+ *   bench_spawn_iocoro.cpp;
+ * - iocoro resume: a suspended IOCoroutine resumed till its next
+ *   suspension, per one resume.
+ *
+ * Build and run, see also `make bench`:
+ *
+ *   cd bonus && make bench_spawn && ./bench_spawn
+ */
+#include "bench.h"
+#include "libcoro.h"
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum {
+	BENCH_THREAD_COUNT = 10000,
+	BENCH_POOL_TASK_COUNT = 100000,
+	BENCH_CORO_SPAWN_COUNT = 100000,
+	BENCH_CORO_YIELD_COUNT = 1000000,
+};
+
+/** The iocoro benches, in C++. */
+void
+bench_iocoro(void);
+
+static void *
+bench_empty_f(void *arg)
+{
+	return arg;
+}
+
+static uint64_t
+bench_pthread_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < BENCH_THREAD_COUNT; ++i) {
+		pthread_t id;
+		if (pthread_create(&id, NULL, bench_empty_f, NULL) != 0)
+			abort();
+		pthread_join(id, NULL);
+	}
+	return BENCH_THREAD_COUNT;
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+static uint64_t
+bench_pool_f(void *arg)
+{
+	struct thread_pool *pool = arg;
+	struct thread_task *task;
+	bench_pause();
+	if (thread_task_new(&task, bench_empty_f, NULL) != 0)
+		abort();
+	bench_resume();
+	for (int i = 0; i < BENCH_POOL_TASK_COUNT; ++i) {
+		void *result;
+		if (thread_pool_push_task(pool, task) != 0 ||
+		    thread_task_join(task, &result) != 0)
+			abort();
+	}
+	bench_pause();
+	thread_task_delete(task);
+	bench_resume();
+	return BENCH_POOL_TASK_COUNT;
+}
+
+static void
+bench_pool(int thread_count)
+{
+	struct thread_pool *pool;
+	char title[128];
+	if (thread_pool_new(thread_count, &pool) != 0)
+		abort();
+	snprintf(title, sizeof(title), "thread pool of %d, ns per push and "
+		 "join", thread_count);
+	bench_run(title, bench_pool_f, pool, NULL);
+	thread_pool_delete(pool);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_coro_spawner_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < BENCH_CORO_SPAWN_COUNT; ++i)
+		coro_join(coro_new(bench_empty_f, NULL));
+	return NULL;
+}
+
+static uint64_t
+bench_coro_spawn_f(void *arg)
+{
+	(void)arg;
+	struct coro *c = coro_new(bench_coro_spawner_f, NULL);
+	coro_sched_run();
+	coro_join(c);
+	return BENCH_CORO_SPAWN_COUNT;
+}
+
+static void *
+bench_coro_yield_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < BENCH_CORO_YIELD_COUNT / 2; ++i)
+		coro_yield();
+	return NULL;
+}
+
+static uint64_t
+bench_coro_pingpong_f(void *arg)
+{
+	(void)arg;
+	struct coro *c1 = coro_new(bench_coro_yield_f, NULL);
+	struct coro *c2 = coro_new(bench_coro_yield_f, NULL);
+	coro_sched_run();
+	coro_join(c1);
+	coro_join(c2);
+	return BENCH_CORO_YIELD_COUNT;
+}
+
+int
+main(void)
+{
+	bench_run("pthread, ns per create and join", bench_pthread_f, NULL,
+		  NULL);
+	bench_pool(1);
+	bench_pool(4);
+	coro_sched_init();
+	bench_run("libcoro, ns per coro_new and coro_join",
+		  bench_coro_spawn_f, NULL, NULL);
+	bench_run("libcoro, ns per coro_yield", bench_coro_pingpong_f, NULL,
+		  NULL);
+	coro_sched_destroy();
+	bench_iocoro();
+	return 0;
+}
@@ -0,0 +1,85 @@
+// The iocoro part of bench_spawn.c, the coroutines of examples/cpp20_coroutines. No core
+// is needed, the coroutines here are resumed right by the bench.
+//
+#include "bench.h"
+#include "iocoro.h"
+
+#include <coroutine>
+#include <cstdint>
+#include <cstdlib>
+
+static constexpr uint64_t theSpawnCount = 1'000'000;
+static constexpr uint64_t theResumeCount = 10'000'000;
+
+extern "C" void
+bench_iocoro();
+
+// Not to let the compiler throw the loops away.
+static volatile uint64_t theSum;
+
+// Suspends the coroutine and gives its handle to the bench, which resumes it.
+struct BenchSuspend
+{
+	bool
+	await_ready() const noexcept { return false; }
+
+	void
+	await_suspend(
+		std::coroutine_handle<> coro) noexcept { *myCoro = coro; }
+
+	void
+	await_resume() noexcept {}
+
+	std::coroutine_handle<> *myCoro;
+};
+
+static IOCoroutine
+benchEmpty(
+	uint64_t i)
+{
+	theSum = theSum + i;
+	co_return;
+}
+
+static uint64_t
+benchSpawn(
+	void *)
+{
+	for (uint64_t i = 0; i < theSpawnCount; ++i)
+		benchEmpty(i);
+	return theSpawnCount;
+}
+
+static IOCoroutine
+benchSuspender(
+	std::coroutine_handle<> *coro,
+	uint64_t count)
+{
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		co_await BenchSuspend{coro};
+		theSum = theSum + i;
+	}
+}
+
+static uint64_t
+benchResume(
+	void *)
+{
+	std::coroutine_handle<> coro;
+	// Suspended right away, the last resume finishes it.
+	benchSuspender(&coro, theResumeCount);
+	for (uint64_t i = 0; i < theResumeCount; ++i)
+		coro.resume();
+	return theResumeCount;
+}
+
+void
+bench_iocoro()
+{
+	bench_run("iocoro, ns per IOCoroutine start and finish", benchSpawn, nullptr,
+		nullptr);
+	bench_run("iocoro, ns per resume", benchResume, nullptr, nullptr);
+	if (IOCoroutinePromise::theCount.load(std::memory_order_relaxed) != 0)
+		abort();
+}
@@ -0,0 +1,137 @@
+#include "coro_blocking.h"
+
+#include "libcoro.h"
+#include "rlist.h"
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+enum {
+	/** Completions taken from the pool at once. */
+	CORO_BLOCKING_BATCH = 64,
+};
+
+struct coro_blocking_call {
+	coro_blocking_f func;
+	void *arg;
+	void *result;
+	struct coro *coro;
+	bool is_done;
+	/** In the waiters of the thread, till is_done. */
+	struct rlist link;
+};
+
+struct coro_blocking {
+	struct thread_pool *pool;
+	/** Completion eventfd of the pool. */
+	int fd;
+	/** The call whose coroutine waits for the fd, or NULL. */
+	struct coro_blocking_call *poller;
+	/** The calls not finished yet. */
+	struct rlist waiters;
+};
+
+static __thread struct coro_blocking *coro_blocking = NULL;
+static __thread struct coro_blocking coro_blocking_storage;
+
+void
+coro_blocking_init(struct thread_pool *pool)
+{
+	assert(coro_blocking == NULL);
+	struct coro_blocking *b = &coro_blocking_storage;
+	b->pool = pool;
+	b->fd = thread_pool_completion_fd(pool);
+	assert(b->fd >= 0);
+	b->poller = NULL;
+	rlist_create(&b->waiters);
+	coro_blocking = b;
+}
+
+void
+coro_blocking_destroy(void)
+{
+	assert(coro_blocking != NULL);
+	assert(rlist_empty(&coro_blocking->waiters));
+	coro_blocking = NULL;
+}
+
+static void *
+coro_blocking_task_f(void *arg)
+{
+	struct coro_blocking_call *call = arg;
+	call->result = call->func(call->arg);
+	return call;
+}
+
+/** Take the finished tasks and wake up their coroutines. */
+static void
+coro_blocking_take(struct coro_blocking *b)
+{
+	struct thread_task *tasks[CORO_BLOCKING_BATCH];
+	int count;
+	do {
+		count = thread_pool_take_completions(b->pool, tasks,
+						     CORO_BLOCKING_BATCH);
+		for (int i = 0; i < count; ++i) {
+			void *res;
+			int rc = thread_task_join(tasks[i], &res);
+			assert(rc == 0);
+			thread_task_delete(tasks[i]);
+			struct coro_blocking_call *call = res;
+			call->is_done = true;
+			rlist_del_entry(call, link);
+			if (call != b->poller)
+				coro_wakeup(call->coro);
+		}
+	} while (count == CORO_BLOCKING_BATCH);
+}
+
+/** Wait in the poller of the engine till the own task is done. */
+static void
+coro_blocking_poll(struct coro_blocking *b, struct coro_blocking_call *call)
+{
+	b->poller = call;
+	while (!call->is_done) {
+		int rc = coro_wait_fd(b->fd, CORO_FD_READ, -1);
+		assert(rc >= 0);
+		(void)rc;
+		coro_blocking_take(b);
+	}
+	b->poller = NULL;
+	/* The others would sleep forever without somebody in the poller. */
+	if (!rlist_empty(&b->waiters)) {
+		struct coro_blocking_call *next = rlist_first_entry(
+			&b->waiters, struct coro_blocking_call, link);
+		coro_wakeup(next->coro);
+	}
+}
+
+void *
+coro_run_blocking(coro_blocking_f func, void *arg)
+{
+	struct coro_blocking *b = coro_blocking;
+	assert(b != NULL);
+	struct coro_blocking_call call;
+	call.func = func;
+	call.arg = arg;
+	call.result = NULL;
+	call.coro = coro_this();
+	call.is_done = false;
+	struct thread_task *task;
+	thread_task_new(&task, coro_blocking_task_f, &call);
+	thread_task_notify(task);
+	if (thread_pool_push_task(b->pool, task) != 0) {
+		thread_task_delete(task);
+		return func(arg);
+	}
+	rlist_add_tail_entry(&b->waiters, &call, link);
+	while (!call.is_done) {
+		if (b->poller == NULL)
+			coro_blocking_poll(b, &call);
+		else
+			coro_suspend();
+	}
+	return call.result;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+/**
+ * Blocking calls made from the libcoro coroutines without blocking the
+ * engine. The call goes into a thread pool of 4/ as a task, and the
+ * coroutine sleeps till it is done, while the others run. The pool
+ * signals the completions via its eventfd, which the engine polls as
+ * any other descriptor in coro_wait_fd(). So the engine keeps serving
+ * its sockets and timers, or sleeps in the poller when there is
+ * nothing else to do.
+ *
+ * One of the waiting coroutines is the one in the poller, and wakes up
+ * the others as their tasks finish. When it is done itself, it hands
+ * the poller to a next one. No extra coroutine is needed.
+ */
+
+struct thread_pool;
+
+typedef void *(*coro_blocking_f)(void *);
+
+/**
+ * Start making the blocking calls from the coroutines of the calling
+ * thread, on the given pool. The completions of the pool must not be
+ * used by anybody else.
+ */
+void
+coro_blocking_init(struct thread_pool *pool);
+
+/**
+ * Stop making the blocking calls in this thread. No calls must be
+ * running. The pool stays the caller's.
+ */
+void
+coro_blocking_destroy(void);
+
+/**
+ * Call @a func with @a arg in a thread of the pool, and return its
+ * result. The current coroutine sleeps meanwhile, and the other ones
+ * run. When the pool is full, the function is called right here, as
+ * the last resort, blocking the engine.
+ */
+void *
+coro_run_blocking(coro_blocking_f func, void *arg);
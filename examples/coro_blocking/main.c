@@ -0,0 +1,128 @@
+#include "coro_blocking.h"
+
+#include "libcoro.h"
+#include "thread_pool.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The callers make blocking calls of 100 ms each, while a ticker
+ * coroutine wants to run every 10 ms. Done right in the coroutines,
+ * the calls stall the ticker, and take the sum of their times. On the
+ * pool they run in parallel, and the ticker doesn't notice them.
+ */
+
+enum {
+	CALLER_COUNT = 8,
+	THREAD_COUNT = 4,
+	CALL_MS = 100,
+	TICK_MS = 10,
+};
+
+static bool is_running;
+static int tick_count;
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *
+blocking_f(void *arg)
+{
+	usleep(CALL_MS * 1000);
+	return (void *)((intptr_t)arg * 2);
+}
+
+static void *
+ticker_f(void *arg)
+{
+	(void)arg;
+	while (is_running) {
+		coro_sleep(TICK_MS / 1000.0);
+		++tick_count;
+	}
+	return NULL;
+}
+
+struct caller {
+	intptr_t id;
+	bool is_offloaded;
+	intptr_t result;
+};
+
+static void *
+call_f(void *arg)
+{
+	struct caller *c = arg;
+	void *res;
+	if (c->is_offloaded)
+		res = coro_run_blocking(blocking_f, (void *)c->id);
+	else
+		res = blocking_f((void *)c->id);
+	c->result = (intptr_t)res;
+	return NULL;
+}
+
+static void *
+main_f(void *arg)
+{
+	bool is_offloaded = *(bool *)arg;
+	struct caller callers[CALLER_COUNT];
+	struct coro *coros[CALLER_COUNT];
+	is_running = true;
+	tick_count = 0;
+	struct coro *ticker = coro_new(ticker_f, NULL);
+	/* Let the ticker start. */
+	coro_yield();
+	uint64_t start = now_ms();
+	for (int i = 0; i < CALLER_COUNT; ++i) {
+		callers[i].id = i;
+		callers[i].is_offloaded = is_offloaded;
+		coros[i] = coro_new(call_f, &callers[i]);
+	}
+	for (int i = 0; i < CALLER_COUNT; ++i)
+		coro_join(coros[i]);
+	uint64_t duration = now_ms() - start;
+	is_running = false;
+	coro_join(ticker);
+	for (int i = 0; i < CALLER_COUNT; ++i) {
+		if (callers[i].result != callers[i].id * 2) {
+			printf("wrong result of call %d\n", i);
+			exit(-1);
+		}
+	}
+	printf("%s: %d calls of %d ms took %d ms, the ticker ran %d times "
+	       "of %d\n", is_offloaded ? "on the pool" : "in the coroutines",
+	       CALLER_COUNT, CALL_MS, (int)duration, tick_count,
+	       (int)(duration / TICK_MS));
+	return NULL;
+}
+
+int
+main(void)
+{
+	struct thread_pool *pool;
+	if (thread_pool_new(THREAD_COUNT, &pool) != 0)
+		return -1;
+	coro_sched_init();
+	coro_blocking_init(pool);
+	bool modes[] = {false, true};
+	for (int i = 0; i < 2; ++i) {
+		struct coro *c = coro_new(main_f, &modes[i]);
+		coro_sched_run();
+		coro_join(c);
+	}
+	coro_blocking_destroy();
+	coro_sched_destroy();
+	thread_pool_delete(pool);
+	return 0;
+}
@@ -0,0 +1,696 @@
+#pragma once
+
+#include "iocoro.h"
+
+#include <cassert>
+#include <coroutine>
+#include <cstdlib>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
+
+// Channels of corobus from 1/ made for the C++ coroutines. A bus has bounded channels,
+// which can be used from the coroutines of any cores. The operations go one message or
+// a batch at a time, and a broadcast sends to all the channels of the bus at once.
+//
+// The whole operation is done under the bus's mutex, by whoever can do it. A waiting
+// receiver gets the messages right into its awaitable, and a waiting sender has its
+// messages taken from there, by the other side. Then the waiter is posted into its own
+// core, the same as with co_await core.asyncPost(), and continues in the core's next
+// roll. So nothing is resumed inside of the other side's co_await, while holding the
+// mutex, or in a wrong thread. The waiters are linked right via their awaitables, and
+// the messages are stored in a ring allocated with the channel, so no operation
+// allocates memory.
+//
+// The awaiting coroutine has to be in a core's thread.
+//
+
+template <typename T>
+class IOBus;
+template <typename T>
+class IOBusChannel;
+template <typename T>
+struct IOBusWaiters;
+
+enum IOBusOpType
+{
+	IO_BUS_OP_SEND,
+	IO_BUS_OP_RECV,
+	IO_BUS_OP_BROADCAST,
+};
+
+// A pending operation, the base of all the awaitables of a bus. The messages it sends
+// are taken from its data, the received ones are put there, or into the optional in a
+// single receipt.
+//
+template <typename T>
+struct IOBusOp
+{
+	IOBusOp(
+		const IOBusOp&) = delete;
+	IOBusOp& operator=(
+		const IOBusOp&) = delete;
+
+	// Everything is done under the mutex, in await_suspend().
+	bool
+	await_ready() const noexcept { return false; }
+
+	// False when the operation is done right away and the coroutine goes on.
+	bool
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+protected:
+	IOBusOp(
+		IOBus<T> &bus,
+		IOBusChannel<T> *channel,
+		IOBusOpType type,
+		T *data,
+		size_t count);
+
+	IOBusOp(
+		IOBusChannel<T> &channel,
+		IOBusOpType type,
+		T *data,
+		size_t count,
+		std::optional<T> *one = nullptr);
+
+	size_t myDone;
+
+private:
+	// The messages left to send, or the space left for them.
+	size_t
+	left() const { return myCount - myDone; }
+
+	void
+	put(
+		T &&value);
+
+	// Resume the waiter in its core.
+	void
+	complete() { myPost.await_suspend(myCoro); }
+
+	static IOCore&
+	currentCore();
+
+	IOBus<T> &myBus;
+	// Null in a broadcast.
+	IOBusChannel<T> *myChannel;
+	const IOBusOpType myType;
+	T *myData;
+	size_t myCount;
+	std::optional<T> *myOne;
+	std::coroutine_handle<> myCoro;
+	AsyncPost myPost;
+	IOBusOp *myNext;
+
+	friend IOBus<T>;
+	friend IOBusChannel<T>;
+	friend IOBusWaiters<T>;
+};
+
+template <typename T>
+struct IOBusSend final : public IOBusOp<T>
+{
+	IOBusSend(
+		IOBusChannel<T> &channel,
+		T &&value);
+
+	// False when the channel is closed.
+	bool
+	await_resume() const noexcept { return this->myDone != 0; }
+
+private:
+	T myValue;
+};
+
+template <typename T>
+struct IOBusSendv final : public IOBusOp<T>
+{
+	IOBusSendv(
+		IOBusChannel<T> &channel,
+		std::span<T> values);
+
+	// How many of the first values are sent, moved out of the span. 0 when the channel
+	// is closed.
+	size_t
+	await_resume() const noexcept { return this->myDone; }
+};
+
+template <typename T>
+struct IOBusRecv final : public IOBusOp<T>
+{
+	IOBusRecv(
+		IOBusChannel<T> &channel);
+
+	// Empty when the channel is closed and has nothing left.
+	std::optional<T>
+	await_resume() { return std::move(myRes); }
+
+private:
+	std::optional<T> myRes;
+};
+
+template <typename T>
+struct IOBusRecvv final : public IOBusOp<T>
+{
+	IOBusRecvv(
+		IOBusChannel<T> &channel,
+		std::span<T> values);
+
+	// How many of the first values in the span are received. 0 when the channel is
+	// closed and has nothing left.
+	size_t
+	await_resume() const noexcept { return this->myDone; }
+};
+
+template <typename T>
+struct IOBusBroadcast final : public IOBusOp<T>
+{
+	IOBusBroadcast(
+		IOBus<T> &bus,
+		T &&value);
+
+	// False when the bus has no open channels.
+	bool
+	await_resume() const noexcept { return this->myDone != 0; }
+
+private:
+	T myValue;
+};
+
+// A queue of the waiters, linked via their awaitables.
+//
+template <typename T>
+struct IOBusWaiters
+{
+	IOBusOp<T> *
+	first() const { return myHead; }
+
+	void
+	push(
+		IOBusOp<T> *op);
+
+	IOBusOp<T> *
+	pop();
+
+	IOBusOp<T> *myHead = nullptr;
+	IOBusOp<T> *myTail = nullptr;
+};
+
+// A bounded channel in a bus. The senders wait when it is full, the receivers wait when
+// it is empty. Capacity 0 makes each send wait for a receiver. A batch is sent or
+// received as far as it fits, and waits only when nothing does.
+//
+template <typename T>
+class IOBusChannel
+{
+public:
+	IOBusChannel(
+		IOBus<T> &bus,
+		size_t capacity);
+	// Nobody can wait on it. The messages left in it are lost.
+	~IOBusChannel();
+
+	IOBusChannel(
+		const IOBusChannel&) = delete;
+	IOBusChannel& operator=(
+		const IOBusChannel&) = delete;
+
+	IOBusSend<T>
+	send(
+		T value) { return IOBusSend<T>(*this, std::move(value)); }
+
+	IOBusSendv<T>
+	sendv(
+		std::span<T> values) { return IOBusSendv<T>(*this, values); }
+
+	IOBusRecv<T>
+	recv() { return IOBusRecv<T>(*this); }
+
+	IOBusRecvv<T>
+	recvv(
+		std::span<T> values) { return IOBusRecvv<T>(*this, values); }
+
+	// The waiting senders fail, the waiting receivers get nothing. The messages already
+	// in the channel still can be received. The broadcasts skip the closed channels.
+	void
+	close();
+
+	size_t
+	size() const;
+
+private:
+	bool
+	trySend(
+		IOBusOp<T> &op);
+
+	bool
+	tryRecv(
+		IOBusOp<T> &op);
+
+	// One message of a broadcast. The channel must have space or a receiver for it.
+	void
+	deliver(
+		const T &value);
+
+	bool
+	canDeliver() const { return mySize < myRing.size() || myReceivers.first() != nullptr; }
+
+	// Move the messages of the waiting senders into the free space.
+	void
+	serveSenders();
+
+	// A receiver given only a part of its batch is done with it, not to wait forever.
+	void
+	finishReceiver();
+
+	void
+	finishSender();
+
+	IOBus<T> &myBus;
+	std::vector<std::optional<T>> myRing;
+	size_t myHead;
+	size_t mySize;
+	bool myIsClosed;
+	IOBusWaiters<T> mySenders;
+	IOBusWaiters<T> myReceivers;
+	IOBusChannel *myPrev;
+	IOBusChannel *myNext;
+
+	friend IOBus<T>;
+	friend IOBusOp<T>;
+};
+
+// The channels of a bus and the broadcasts to them. The bus must outlive its channels.
+//
+template <typename T>
+class IOBus
+{
+public:
+	IOBus() = default;
+	~IOBus() { assert(myChannels == nullptr && myBroadcasts.first() == nullptr); }
+
+	IOBus(
+		const IOBus&) = delete;
+	IOBus& operator=(
+		const IOBus&) = delete;
+
+	// Send a copy of the value to each open channel. When any of them is full, nothing
+	// is sent until all have space.
+	IOBusBroadcast<T>
+	broadcast(
+		T value) { return IOBusBroadcast<T>(*this, std::move(value)); }
+
+private:
+	bool
+	tryBroadcast(
+		IOBusOp<T> &op);
+
+	// Do the waiting broadcasts which can proceed now.
+	void
+	serveBroadcasts();
+
+	std::mutex myMutex;
+	IOBusChannel<T> *myChannels = nullptr;
+	IOBusWaiters<T> myBroadcasts;
+
+	friend IOBusChannel<T>;
+	friend IOBusOp<T>;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+IOBusOp<T>::IOBusOp(
+	IOBus<T> &bus,
+	IOBusChannel<T> *channel,
+	IOBusOpType type,
+	T *data,
+	size_t count)
+	: myDone(0)
+	, myBus(bus)
+	, myChannel(channel)
+	, myType(type)
+	, myData(data)
+	, myCount(count)
+	, myOne(nullptr)
+	, myPost(currentCore())
+	, myNext(nullptr)
+{
+}
+
+template <typename T>
+IOBusOp<T>::IOBusOp(
+	IOBusChannel<T> &channel,
+	IOBusOpType type,
+	T *data,
+	size_t count,
+	std::optional<T> *one)
+	: IOBusOp(channel.myBus, &channel, type, data, count)
+{
+	myOne = one;
+}
+
+template <typename T>
+IOCore&
+IOBusOp<T>::currentCore()
+{
+	IOCore *core = IOCore::current();
+	assert(core != nullptr);
+	return *core;
+}
+
+template <typename T>
+void
+IOBusOp<T>::put(
+	T &&value)
+{
+	if (myOne != nullptr)
+		myOne->emplace(std::move(value));
+	else
+		myData[myDone] = std::move(value);
+	++myDone;
+}
+
+template <typename T>
+bool
+IOBusOp<T>::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	myCoro = coro;
+	std::lock_guard<std::mutex> lock(myBus.myMutex);
+	switch (myType)
+	{
+	case IO_BUS_OP_SEND:
+		if (myChannel->trySend(*this))
+			return false;
+		myChannel->mySenders.push(this);
+		return true;
+	case IO_BUS_OP_RECV:
+		if (myChannel->tryRecv(*this))
+			return false;
+		myChannel->myReceivers.push(this);
+		// An unbuffered channel can take a broadcast now. This receiver could get
+		// it and be posted already, it is fine.
+		myBus.serveBroadcasts();
+		return true;
+	case IO_BUS_OP_BROADCAST:
+		// The broadcasts go in their order.
+		if (myBus.myBroadcasts.first() == nullptr && myBus.tryBroadcast(*this))
+			return false;
+		myBus.myBroadcasts.push(this);
+		return true;
+	}
+	abort();
+}
+
+template <typename T>
+IOBusSend<T>::IOBusSend(
+	IOBusChannel<T> &channel,
+	T &&value)
+	: IOBusOp<T>(channel, IO_BUS_OP_SEND, &myValue, 1)
+	, myValue(std::move(value))
+{
+}
+
+template <typename T>
+IOBusSendv<T>::IOBusSendv(
+	IOBusChannel<T> &channel,
+	std::span<T> values)
+	: IOBusOp<T>(channel, IO_BUS_OP_SEND, values.data(), values.size())
+{
+}
+
+template <typename T>
+IOBusRecv<T>::IOBusRecv(
+	IOBusChannel<T> &channel)
+	: IOBusOp<T>(channel, IO_BUS_OP_RECV, nullptr, 1, &myRes)
+{
+}
+
+template <typename T>
+IOBusRecvv<T>::IOBusRecvv(
+	IOBusChannel<T> &channel,
+	std::span<T> values)
+	: IOBusOp<T>(channel, IO_BUS_OP_RECV, values.data(), values.size())
+{
+}
+
+template <typename T>
+IOBusBroadcast<T>::IOBusBroadcast(
+	IOBus<T> &bus,
+	T &&value)
+	: IOBusOp<T>(bus, nullptr, IO_BUS_OP_BROADCAST, &myValue, 1)
+	, myValue(std::move(value))
+{
+}
+
+template <typename T>
+void
+IOBusWaiters<T>::push(
+	IOBusOp<T> *op)
+{
+	op->myNext = nullptr;
+	if (myTail == nullptr)
+		myHead = op;
+	else
+		myTail->myNext = op;
+	myTail = op;
+}
+
+template <typename T>
+IOBusOp<T> *
+IOBusWaiters<T>::pop()
+{
+	IOBusOp<T> *op = myHead;
+	if (op == nullptr)
+		return nullptr;
+	myHead = op->myNext;
+	if (myHead == nullptr)
+		myTail = nullptr;
+	return op;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+IOBusChannel<T>::IOBusChannel(
+	IOBus<T> &bus,
+	size_t capacity)
+	: myBus(bus)
+	, myRing(capacity)
+	, myHead(0)
+	, mySize(0)
+	, myIsClosed(false)
+	, myPrev(nullptr)
+{
+	std::lock_guard<std::mutex> lock(bus.myMutex);
+	myNext = bus.myChannels;
+	if (myNext != nullptr)
+		myNext->myPrev = this;
+	bus.myChannels = this;
+}
+
+template <typename T>
+IOBusChannel<T>::~IOBusChannel()
+{
+	std::lock_guard<std::mutex> lock(myBus.myMutex);
+	assert(mySenders.first() == nullptr && myReceivers.first() == nullptr);
+	if (myPrev != nullptr)
+		myPrev->myNext = myNext;
+	else
+		myBus.myChannels = myNext;
+	if (myNext != nullptr)
+		myNext->myPrev = myPrev;
+	// The broadcasts could wait just for this one.
+	myBus.serveBroadcasts();
+}
+
+template <typename T>
+void
+IOBusChannel<T>::close()
+{
+	std::lock_guard<std::mutex> lock(myBus.myMutex);
+	myIsClosed = true;
+	while (IOBusOp<T> *op = myReceivers.pop())
+		op->complete();
+	while (IOBusOp<T> *op = mySenders.pop())
+		op->complete();
+	myBus.serveBroadcasts();
+}
+
+template <typename T>
+size_t
+IOBusChannel<T>::size() const
+{
+	std::lock_guard<std::mutex> lock(myBus.myMutex);
+	return mySize;
+}
+
+template <typename T>
+bool
+IOBusChannel<T>::trySend(
+	IOBusOp<T> &op)
+{
+	if (myIsClosed)
+		return true;
+	// A receiver waits only when the channel is empty. Give it the messages directly.
+	while (op.left() > 0)
+	{
+		IOBusOp<T> *r = myReceivers.first();
+		if (r == nullptr)
+			break;
+		r->put(std::move(op.myData[op.myDone++]));
+		if (r->left() == 0)
+		{
+			myReceivers.pop();
+			r->complete();
+		}
+	}
+	finishReceiver();
+	while (op.left() > 0 && mySize < myRing.size())
+	{
+		myRing[(myHead + mySize) % myRing.size()].emplace(
+			std::move(op.myData[op.myDone++]));
+		++mySize;
+	}
+	return op.myDone > 0;
+}
+
+template <typename T>
+bool
+IOBusChannel<T>::tryRecv(
+	IOBusOp<T> &op)
+{
+	size_t oldSize = mySize;
+	while (op.left() > 0 && mySize > 0)
+	{
+		std::optional<T> &slot = myRing[myHead];
+		op.put(std::move(*slot));
+		slot.reset();
+		myHead = (myHead + 1) % myRing.size();
+		--mySize;
+	}
+	// Without the space the messages go from hand to hand.
+	while (op.left() > 0)
+	{
+		IOBusOp<T> *s = mySenders.first();
+		if (s == nullptr)
+			break;
+		op.put(std::move(s->myData[s->myDone++]));
+		if (s->left() == 0)
+		{
+			mySenders.pop();
+			s->complete();
+		}
+	}
+	serveSenders();
+	if (mySize < oldSize)
+		myBus.serveBroadcasts();
+	return op.myDone > 0 || myIsClosed;
+}
+
+template <typename T>
+void
+IOBusChannel<T>::deliver(
+	const T &value)
+{
+	IOBusOp<T> *r = myReceivers.first();
+	if (r == nullptr)
+	{
+		assert(mySize < myRing.size());
+		myRing[(myHead + mySize) % myRing.size()].emplace(value);
+		++mySize;
+		return;
+	}
+	r->put(T(value));
+	myReceivers.pop();
+	r->complete();
+}
+
+template <typename T>
+void
+IOBusChannel<T>::serveSenders()
+{
+	while (mySize < myRing.size())
+	{
+		IOBusOp<T> *s = mySenders.first();
+		if (s == nullptr)
+			break;
+		myRing[(myHead + mySize) % myRing.size()].emplace(
+			std::move(s->myData[s->myDone++]));
+		++mySize;
+		if (s->left() == 0)
+		{
+			mySenders.pop();
+			s->complete();
+		}
+	}
+	finishSender();
+}
+
+template <typename T>
+void
+IOBusChannel<T>::finishReceiver()
+{
+	IOBusOp<T> *r = myReceivers.first();
+	if (r != nullptr && r->myDone > 0)
+	{
+		myReceivers.pop();
+		r->complete();
+	}
+}
+
+template <typename T>
+void
+IOBusChannel<T>::finishSender()
+{
+	IOBusOp<T> *s = mySenders.first();
+	if (s != nullptr && s->myDone > 0)
+	{
+		mySenders.pop();
+		s->complete();
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+bool
+IOBus<T>::tryBroadcast(
+	IOBusOp<T> &op)
+{
+	bool hasOpen = false;
+	for (IOBusChannel<T> *ch = myChannels; ch != nullptr; ch = ch->myNext)
+	{
+		if (ch->myIsClosed)
+			continue;
+		if (!ch->canDeliver())
+			return false;
+		hasOpen = true;
+	}
+	if (!hasOpen)
+		return true;
+	for (IOBusChannel<T> *ch = myChannels; ch != nullptr; ch = ch->myNext)
+	{
+		if (!ch->myIsClosed)
+			ch->deliver(*op.myData);
+	}
+	op.myDone = 1;
+	return true;
+}
+
+template <typename T>
+void
+IOBus<T>::serveBroadcasts()
+{
+	while (IOBusOp<T> *op = myBroadcasts.first())
+	{
+		if (!tryBroadcast(*op))
+			return;
+		myBroadcasts.pop();
+		op->complete();
+	}
+}
@@ -1,19 +1,364 @@
 #include "iocoro.h"
 
+#include <algorithm>
 #include <cassert>
+#include <csignal>
+#include <cstdlib>
 #include <cstring>
+#include <linux/errqueue.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <new>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 static constexpr int theEpollBatchSize = 128;
+static constexpr uint32_t theUringEntryCount = 1024;
+// The completions carry a pointer with the kind of the submission in the low bits.
+static constexpr uint64_t theUringTagOp = 0;
+static constexpr uint64_t theUringTagAccept = 1;
+static constexpr uint64_t theUringTagWakeup = 2;
+static constexpr uint64_t theUringTagCancel = 3;
+static constexpr uint64_t theUringTagMask = 3;
+static constexpr size_t theFrameClassStep = 64;
+static constexpr size_t theFrameClassCount = 16;
+// Per thread and class. Enough for the coroutines of a lot of connections, and still
+// frees the memory after a spike.
+static constexpr uint32_t theFrameCacheMaxCount = 4096;
 
+static uint64_t
+ioNowMs();
+
+static uint64_t
+ioNowUs();
+
+std::atomic_uint64_t IOFramePool::theAllocCount{0};
+std::atomic_uint64_t IOFramePool::theHitCount{0};
 std::atomic_int IOCoroutinePromise::theCount{0};
+std::atomic_int IOCoroutinePromise::theWaiterCount{0};
+std::atomic_uint32_t IOCoroutinePromise::theDoneEpoch{0};
 std::atomic_int IOTask::theCount{0};
+thread_local IOCore *IOCore::theCurrent = nullptr;
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+struct IOFrame
+{
+	IOFrame *myNext;
+};
+
+struct IOFrameCache
+{
+	IOFrameCache() = default;
+	~IOFrameCache();
+
+	void
+	flushStats();
+
+	IOFrame *myFrames[theFrameClassCount] = {};
+	uint32_t myCounts[theFrameClassCount] = {};
+	uint64_t myAllocCount = 0;
+	uint64_t myHitCount = 0;
+	// The frames freed after the thread's cache is gone go right to free().
+	bool myIsDestroyed = false;
+};
+
+static thread_local IOFrameCache theFrameCache;
+
+IOFrameCache::~IOFrameCache()
+{
+	flushStats();
+	for (IOFrame *&f : myFrames)
+	{
+		while (f != nullptr)
+		{
+			IOFrame *next = f->myNext;
+			free(f);
+			f = next;
+		}
+	}
+	myIsDestroyed = true;
+}
+
+void
+IOFrameCache::flushStats()
+{
+	IOFramePool::theAllocCount.fetch_add(myAllocCount, std::memory_order_relaxed);
+	IOFramePool::theHitCount.fetch_add(myHitCount, std::memory_order_relaxed);
+	myAllocCount = 0;
+	myHitCount = 0;
+}
+
+static inline size_t
+ioFrameClass(
+	size_t size)
+{
+	return (size - 1) / theFrameClassStep;
+}
+
+void *
+IOFramePool::allocate(
+	size_t size)
+{
+	assert(size > 0);
+	IOFrameCache &cache = theFrameCache;
+	size_t idx = ioFrameClass(size);
+	++cache.myAllocCount;
+	if (idx < theFrameClassCount && cache.myFrames[idx] != nullptr)
+	{
+		++cache.myHitCount;
+		IOFrame *f = cache.myFrames[idx];
+		cache.myFrames[idx] = f->myNext;
+		--cache.myCounts[idx];
+		return f;
+	}
+	// The whole class size, to be reusable by any frame of the class.
+	if (idx < theFrameClassCount)
+		size = (idx + 1) * theFrameClassStep;
+	void *res = malloc(size);
+	if (res == nullptr)
+		throw std::bad_alloc();
+	return res;
+}
+
+void
+IOFramePool::deallocate(
+	void *ptr,
+	size_t size)
+{
+	IOFrameCache &cache = theFrameCache;
+	size_t idx = ioFrameClass(size);
+	if (idx >= theFrameClassCount || cache.myIsDestroyed ||
+		cache.myCounts[idx] >= theFrameCacheMaxCount)
+	{
+		free(ptr);
+		return;
+	}
+	IOFrame *f = (IOFrame *)ptr;
+	f->myNext = cache.myFrames[idx];
+	cache.myFrames[idx] = f;
+	++cache.myCounts[idx];
+}
+
+void
+IOFramePool::flushStats()
+{
+	theFrameCache.flushStats();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// A bare io_uring on the raw syscalls. The rings are shared with the kernel: the core
+// fills the submission queue and drains the completion queue, all in its thread.
+//
+struct IOUring
+{
+	IOUring() = default;
+	~IOUring();
+
+	// False when the kernel lacks anything the core needs.
+	bool
+	create(
+		uint32_t entryCount);
+
+	// A zeroed submission entry. When the queue is full, it is flushed into the kernel
+	// first.
+	io_uring_sqe *
+	getSqe();
+
+	// Submit the filled entries and wait for the given count of completions, but no
+	// longer than the timeout. -1 means infinity.
+	int
+	enter(
+		uint32_t waitCount,
+		int timeout);
+
+	bool
+	popCqe(
+		io_uring_cqe *cqe);
+
+	int myFd = -1;
+	void *myRing = MAP_FAILED;
+	size_t myRingSize = 0;
+	io_uring_sqe *mySqes = (io_uring_sqe *)MAP_FAILED;
+	size_t mySqesSize = 0;
+	uint32_t *mySqHead = nullptr;
+	uint32_t *mySqTail = nullptr;
+	uint32_t *mySqArray = nullptr;
+	uint32_t mySqMask = 0;
+	uint32_t mySqEntryCount = 0;
+	// Filled but not yet visible to the kernel.
+	uint32_t mySqLocalTail = 0;
+	uint32_t *myCqHead = nullptr;
+	uint32_t *myCqTail = nullptr;
+	io_uring_cqe *myCqes = nullptr;
+	uint32_t myCqMask = 0;
+};
+
+IOUring::~IOUring()
+{
+	if (mySqes != MAP_FAILED)
+		munmap(mySqes, mySqesSize);
+	if (myRing != MAP_FAILED)
+		munmap(myRing, myRingSize);
+	if (myFd >= 0)
+		close(myFd);
+}
+
+bool
+IOUring::create(
+	uint32_t entryCount)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	// The completions are handled in the core's thread anyway. No need to interrupt it
+	// for them.
+	params.flags = IORING_SETUP_COOP_TASKRUN;
+	myFd = syscall(__NR_io_uring_setup, entryCount, &params);
+	if (myFd < 0 && errno == EINVAL)
+	{
+		params.flags = 0;
+		myFd = syscall(__NR_io_uring_setup, entryCount, &params);
+	}
+	if (myFd < 0)
+		return false;
+	// The timeouts of the waits, and the completions kept on an overflow.
+	uint32_t features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG |
+		IORING_FEAT_NODROP;
+	if ((params.features & features) != features)
+		return false;
+	myRingSize = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+		params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+	myRing = mmap(nullptr, myRingSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, myFd, IORING_OFF_SQ_RING);
+	if (myRing == MAP_FAILED)
+		return false;
+	mySqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	mySqes = (io_uring_sqe *)mmap(nullptr, mySqesSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, myFd, IORING_OFF_SQES);
+	if (mySqes == MAP_FAILED)
+		return false;
+	char *ring = (char *)myRing;
+	mySqHead = (uint32_t *)(ring + params.sq_off.head);
+	mySqTail = (uint32_t *)(ring + params.sq_off.tail);
+	mySqArray = (uint32_t *)(ring + params.sq_off.array);
+	mySqMask = *(uint32_t *)(ring + params.sq_off.ring_mask);
+	mySqEntryCount = params.sq_entries;
+	mySqLocalTail = *mySqTail;
+	myCqHead = (uint32_t *)(ring + params.cq_off.head);
+	myCqTail = (uint32_t *)(ring + params.cq_off.tail);
+	myCqes = (io_uring_cqe *)(ring + params.cq_off.cqes);
+	myCqMask = *(uint32_t *)(ring + params.cq_off.ring_mask);
+	return true;
+}
+
+io_uring_sqe *
+IOUring::getSqe()
+{
+	if (mySqLocalTail - __atomic_load_n(mySqHead, __ATOMIC_ACQUIRE) == mySqEntryCount)
+	{
+		int rc = enter(0, -1);
+		assert(rc > 0);
+		MAYBE_UNUSED(rc);
+	}
+	uint32_t idx = mySqLocalTail & mySqMask;
+	mySqArray[idx] = idx;
+	io_uring_sqe *sqe = &mySqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	++mySqLocalTail;
+	return sqe;
+}
+
+int
+IOUring::enter(
+	uint32_t waitCount,
+	int timeout)
+{
+	__atomic_store_n(mySqTail, mySqLocalTail, __ATOMIC_RELEASE);
+	// The kernel moves the head as it takes the entries.
+	uint32_t submitCount = mySqLocalTail - __atomic_load_n(mySqHead, __ATOMIC_ACQUIRE);
+	uint32_t flags = 0;
+	__kernel_timespec ts;
+	io_uring_getevents_arg arg;
+	void *argPtr = nullptr;
+	size_t argSize = 0;
+	if (waitCount > 0)
+	{
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout >= 0)
+		{
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1'000'000;
+			memset(&arg, 0, sizeof(arg));
+			arg.sigmask_sz = _NSIG / 8;
+			arg.ts = (uint64_t)&ts;
+			flags |= IORING_ENTER_EXT_ARG;
+			argPtr = &arg;
+			argSize = sizeof(arg);
+		}
+	}
+	return syscall(__NR_io_uring_enter, myFd, submitCount, waitCount, flags, argPtr,
+		argSize);
+}
+
+bool
+IOUring::popCqe(
+	io_uring_cqe *cqe)
+{
+	// Only the core moves the head.
+	uint32_t head = *myCqHead;
+	if (head == __atomic_load_n(myCqTail, __ATOMIC_ACQUIRE))
+		return false;
+	*cqe = myCqes[head & myCqMask];
+	// Freed before handling, so the handlers can submit and even flush.
+	__atomic_store_n(myCqHead, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void
+IOCoroutinePromise::waitAllDone()
+{
+	theWaiterCount.fetch_add(1, std::memory_order_seq_cst);
+	// The epoch is taken before the check. If the count drops to zero right after,
+	// the epoch is changed and the wait returns at once.
+	uint32_t epoch = theDoneEpoch.load(std::memory_order_seq_cst);
+	while (theCount.load(std::memory_order_seq_cst) != 0)
+	{
+		theDoneEpoch.wait(epoch, std::memory_order_seq_cst);
+		epoch = theDoneEpoch.load(std::memory_order_seq_cst);
+	}
+	theWaiterCount.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+void
+IOCoroutinePromise::notifyAllDone()
+{
+	theDoneEpoch.fetch_add(1, std::memory_order_seq_cst);
+	theDoneEpoch.notify_all();
+}
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-AsyncOperation::AsyncOperation(IOTask *sub)
+AsyncOperation::AsyncOperation(
+	IOTask *sub,
+	IOEventBit event)
 	: myTask(sub)
+	, myEvent(event)
+	, myIsDone(false)
+	, myIsSubmitted(false)
+	, myErr(0)
+	, myCancelErr(0)
 {
 }
 
@@ -21,9 +366,113 @@ bool
 AsyncOperation::await_suspend(
 	std::coroutine_handle<> coro)
 {
-	assert(myTask->myAsyncOp == nullptr);
+	// The drain has cancelled all the waits, and the new ones are cancelled right
+	// away.
+	if (myTask->myCore.isDraining())
+	{
+		myIsDone = true;
+		myErr = ECANCELED;
+		return false;
+	}
+	AsyncOperation*& op = slot();
+	assert(op == nullptr);
 	myCoro = coro;
-	myTask->myAsyncOp = this;
+	op = this;
+	if (myTask->myCore.myUring != nullptr)
+		myTask->myCore.uringSubmit(this);
+	return true;
+}
+
+bool
+AsyncOperation::cancel(
+	int err)
+{
+	assert(!myIsDone);
+	if (myIsSubmitted)
+	{
+		// The kernel might be writing into the buffer right now.
+		myCancelErr = err;
+		myTask->myCore.uringCancel((uint64_t)this);
+		return false;
+	}
+	AsyncOperation*& op = slot();
+	if (op == this)
+		op = nullptr;
+	myIsDone = true;
+	myErr = err;
+	return true;
+}
+
+void
+AsyncOperation::onSubmit(
+	io_uring_sqe *sqe)
+{
+	// Only the operations which aren't submitted on their own don't override it.
+	assert(false);
+	MAYBE_UNUSED(sqe);
+}
+
+void
+AsyncOperation::onUringCompletion(
+	int res,
+	uint32_t flags)
+{
+	// The notification of a zero-copy send carries no result, it only releases the
+	// buffer.
+	if ((flags & IORING_CQE_F_NOTIF) == 0)
+	{
+		if (res >= 0 && !onComplete(res))
+		{
+			myTask->myCore.uringPush(this);
+			return;
+		}
+		if (res == -ECANCELED && myCancelErr != 0)
+			myErr = myCancelErr;
+		else if (res < 0)
+			myErr = -res;
+		if ((flags & IORING_CQE_F_MORE) != 0)
+			return;
+	}
+	if (myIsSubmitted)
+	{
+		myIsSubmitted = false;
+		--myTask->myUringOpCount;
+	}
+	AsyncOperation*& op = slot();
+	if (op == this)
+		op = nullptr;
+	myIsDone = true;
+	myCoro.resume();
+}
+
+void
+AsyncOperation::onError(
+	int err)
+{
+	assert(!myIsDone);
+	myIsDone = true;
+	myErr = err;
+}
+
+AsyncOperation*&
+AsyncOperation::slot()
+{
+	return myEvent == IO_EVENT_READ ? myTask->myReadOp : myTask->myWriteOp;
+}
+
+bool
+AsyncOperation::resumeIfDone()
+{
+	if (!myIsDone)
+	{
+		// Could be a spurious wakeup.
+		if (myTask->myState != IO_TASK_STATE_DELETING)
+			return false;
+		// Cancellation.
+		myIsDone = true;
+		myErr = ECANCELED;
+	}
+	myCoro.resume();
 	return true;
 }
 
@@ -33,7 +482,7 @@ AsyncRecv::AsyncRecv(
 	IOTask *sub,
 	void *data,
 	size_t size)
-	: AsyncOperation(sub)
+	: AsyncOperation(sub, IO_EVENT_READ)
 	, myData(data)
 	, mySize(size)
 	, myRes(-1)
@@ -46,34 +495,52 @@ AsyncRecv::execute()
 {
 	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
 		return;
-	myRes = recv(myTask->myFd, myData, mySize, 0);
-	if (myRes >= 0)
+	ssize_t rc;
+	do
+		rc = recv(myTask->myFd, myData, mySize, 0);
+	while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+	{
+		if (errno != EWOULDBLOCK && errno != EAGAIN)
+		{
+			onError(errno);
+			return;
+		}
+		// The event is consumed, no more data to read. Wait for a new event.
+		myTask->myEventsReady &= ~IO_EVENT_READ;
 		return;
-	assert(errno == EWOULDBLOCK);
-	// The event is consumed, no more data to read. Wait for a new event.
-	myTask->myEventsReady &= ~IO_EVENT_READ;
+	}
+	myIsDone = true;
+	myRes = rc;
+	// The socket is drained. Epoll is edge-triggered, so it will report the next data.
+	// No need to try and fail with EWOULDBLOCK first. EOF is kept ready, it stays so.
+	if (rc > 0 && (size_t)rc < mySize)
+		myTask->myEventsReady &= ~IO_EVENT_READ;
 }
 
 bool
 AsyncRecv::onIOEvent()
 {
-	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+	execute();
+	return resumeIfDone();
+}
+
+void
+AsyncRecv::onSubmit(
+	io_uring_sqe *sqe)
+{
+	sqe->fd = myTask->myFd;
+	sqe->addr = (uint64_t)myData;
+	sqe->len = mySize;
+	if (myTask->myCore.isInRegisteredBuffer(myData, mySize))
 	{
-		if (myTask->myState == IO_TASK_STATE_DELETING)
-		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
-			return true;
-		}
-		return false;
+		// The same as recv() without flags. The pages are mapped into the kernel once.
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->off = (uint64_t)-1;
+		sqe->buf_index = 0;
+		return;
 	}
-	execute();
-	// Could be a spurious wakeup.
-	if (myRes < 0)
-		return false;
-	myCoro.resume();
-	return true;
+	sqe->opcode = IORING_OP_RECV;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -82,7 +549,7 @@ AsyncSend::AsyncSend(
 	IOTask *sub,
 	const void *data,
 	size_t size)
-	: AsyncOperation(sub)
+	: AsyncOperation(sub, IO_EVENT_WRITE)
 	, myData(data)
 	, mySize(size)
 	, myRes(-1)
@@ -95,43 +562,324 @@ AsyncSend::execute()
 {
 	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
 		return;
-	myRes = send(myTask->myFd, myData, mySize, 0);
-	if (myRes >= 0)
+	ssize_t rc;
+	do
+		rc = send(myTask->myFd, myData, mySize, MSG_NOSIGNAL);
+	while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+	{
+		if (errno != EWOULDBLOCK && errno != EAGAIN)
+		{
+			onError(errno);
+			return;
+		}
+		// Can't write anymore. Need to wait for a new write-event.
+		myTask->myEventsReady &= ~IO_EVENT_WRITE;
 		return;
-	assert(errno == EWOULDBLOCK);
-	// Can't write anymore. Need to wait for a new write-event.
-	myTask->myEventsReady &= ~IO_EVENT_WRITE;
+	}
+	myIsDone = true;
+	myRes = rc;
+	// The socket buffer is full, the next send would fail.
+	if ((size_t)rc < mySize)
+		myTask->myEventsReady &= ~IO_EVENT_WRITE;
 }
 
 bool
 AsyncSend::onIOEvent()
+{
+	execute();
+	return resumeIfDone();
+}
+
+void
+AsyncSend::onSubmit(
+	io_uring_sqe *sqe)
+{
+	// The fixed buffer writes have no flags, and would raise SIGPIPE. So the sends only
+	// go through the plain buffers.
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = myTask->myFd;
+	sqe->addr = (uint64_t)myData;
+	sqe->len = mySize;
+	sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static size_t
+ioVecsSize(
+	const iovec *vecs,
+	int count)
+{
+	size_t res = 0;
+	for (int i = 0; i < count; ++i)
+		res += vecs[i].iov_len;
+	return res;
+}
+
+AsyncSendv::AsyncSendv(
+	IOTask *sub,
+	const iovec *vecs,
+	int count)
+	: AsyncOperation(sub, IO_EVENT_WRITE)
+	, mySize(ioVecsSize(vecs, count))
+	, myRes(-1)
+{
+	memset(&myMsg, 0, sizeof(myMsg));
+	myMsg.msg_iov = (iovec *)vecs;
+	myMsg.msg_iovlen = count;
+	execute();
+}
+
+void
+AsyncSendv::execute()
 {
 	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
+		return;
+	ssize_t rc;
+	do
+		rc = sendmsg(myTask->myFd, &myMsg, MSG_NOSIGNAL);
+	while (rc < 0 && errno == EINTR);
+	if (rc < 0)
 	{
-		if (myTask->myState == IO_TASK_STATE_DELETING)
+		if (errno != EWOULDBLOCK && errno != EAGAIN)
 		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
-			return true;
+			onError(errno);
+			return;
 		}
-		return false;
+		myTask->myEventsReady &= ~IO_EVENT_WRITE;
+		return;
 	}
+	myIsDone = true;
+	myRes = rc;
+	if ((size_t)rc < mySize)
+		myTask->myEventsReady &= ~IO_EVENT_WRITE;
+}
+
+bool
+AsyncSendv::onIOEvent()
+{
+	execute();
+	return resumeIfDone();
+}
+
+void
+AsyncSendv::onSubmit(
+	io_uring_sqe *sqe)
+{
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = myTask->myFd;
+	sqe->addr = (uint64_t)&myMsg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncSendFile::AsyncSendFile(
+	IOTask *sub,
+	int fd,
+	off_t offset,
+	size_t size)
+	: AsyncOperation(sub, IO_EVENT_WRITE)
+	, myFileFd(fd)
+	, myOffset(offset)
+	, mySize(size)
+	, myRes(-1)
+{
 	execute();
-	// Could be a spurious wakeup.
-	if (myRes < 0)
+}
+
+void
+AsyncSendFile::execute()
+{
+	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
+		return;
+	ssize_t rc;
+	do
+		rc = sendfile(myTask->myFd, myFileFd, &myOffset, mySize);
+	while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+	{
+		if (errno != EWOULDBLOCK && errno != EAGAIN)
+		{
+			onError(errno);
+			return;
+		}
+		myTask->myEventsReady &= ~IO_EVENT_WRITE;
+		return;
+	}
+	// A short result doesn't mean the socket is full. It could be the file's end.
+	myIsDone = true;
+	myRes = rc;
+}
+
+bool
+AsyncSendFile::onIOEvent()
+{
+	execute();
+	return resumeIfDone();
+}
+
+void
+AsyncSendFile::onSubmit(
+	io_uring_sqe *sqe)
+{
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = myTask->myFd;
+	sqe->poll32_events = POLLOUT;
+}
+
+bool
+AsyncSendFile::onComplete(
+	int res)
+{
+	// Any event means the syscall won't block. Even an error, which it would return.
+	MAYBE_UNUSED(res);
+	ssize_t rc;
+	do
+		rc = sendfile(myTask->myFd, myFileFd, &myOffset, mySize);
+	while (rc < 0 && errno == EINTR);
+	if (rc < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
 		return false;
-	myCoro.resume();
+	if (rc < 0)
+		myErr = errno;
+	myRes = rc;
 	return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+AsyncSendZeroCopy::AsyncSendZeroCopy(
+	IOTask *sub,
+	const void *data,
+	size_t size)
+	: AsyncOperation(sub, IO_EVENT_WRITE)
+	, myData(data)
+	, mySize(size)
+	, mySeq(0)
+	, myIsSent(false)
+	, myRes(-1)
+{
+	execute();
+}
+
+void
+AsyncSendZeroCopy::execute()
+{
+	if (myIsSent)
+	{
+		checkRelease();
+		return;
+	}
+	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
+		return;
+	IOTask *task = myTask;
+	if (task->myZeroCopyState == IO_ZERO_COPY_STATE_UNKNOWN)
+	{
+		int value = 1;
+		int rc = setsockopt(task->myFd, SOL_SOCKET, SO_ZEROCOPY, &value,
+			sizeof(value));
+		task->myZeroCopyState = rc == 0 ? IO_ZERO_COPY_STATE_ON :
+			IO_ZERO_COPY_STATE_UNSUPPORTED;
+	}
+	int flags = MSG_NOSIGNAL;
+	if (task->myZeroCopyState == IO_ZERO_COPY_STATE_ON)
+		flags |= MSG_ZEROCOPY;
+	ssize_t rc;
+	do
+		rc = send(task->myFd, myData, mySize, flags);
+	while (rc < 0 && errno == EINTR);
+	// No memory to pin the pages, then copy.
+	if (rc < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY) != 0)
+	{
+		flags &= ~MSG_ZEROCOPY;
+		do
+			rc = send(task->myFd, myData, mySize, flags);
+		while (rc < 0 && errno == EINTR);
+	}
+	if (rc < 0)
+	{
+		if (errno != EWOULDBLOCK && errno != EAGAIN)
+		{
+			onError(errno);
+			return;
+		}
+		task->myEventsReady &= ~IO_EVENT_WRITE;
+		return;
+	}
+	myRes = rc;
+	if ((size_t)rc < mySize)
+		task->myEventsReady &= ~IO_EVENT_WRITE;
+	if ((flags & MSG_ZEROCOPY) == 0)
+	{
+		myIsDone = true;
+		return;
+	}
+	myIsSent = true;
+	mySeq = task->myZeroCopySeq++;
+	// The notification might be there already, then there won't be an event for it.
+	checkRelease();
+}
+
+void
+AsyncSendZeroCopy::checkRelease()
+{
+	char control[128];
+	while (true)
+	{
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		ssize_t rc = recvmsg(myTask->myFd, &msg, MSG_ERRQUEUE);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return;
+		for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr;
+			cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+				!(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			const sock_extended_err *err = (const sock_extended_err *)CMSG_DATA(cm);
+			if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			// The released sends are an inclusive range up to ee_data. Only one send
+			// at a time waits, so it is the last one.
+			if ((int32_t)(err->ee_data - mySeq) >= 0)
+				myIsDone = true;
+		}
+	}
+}
+
+bool
+AsyncSendZeroCopy::onIOEvent()
+{
+	execute();
+	return resumeIfDone();
+}
+
+void
+AsyncSendZeroCopy::onSubmit(
+	io_uring_sqe *sqe)
+{
+	// The result comes first, and the buffer's release is the second completion.
+	sqe->opcode = IORING_OP_SEND_ZC;
+	sqe->fd = myTask->myFd;
+	sqe->addr = (uint64_t)myData;
+	sqe->len = mySize;
+	sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 AsyncAccept::AsyncAccept(
 	IOTask *sub,
 	sockaddr *addr,
 	socklen_t *size)
-	: AsyncOperation(sub)
+	: AsyncOperation(sub, IO_EVENT_READ)
 	, myAddr(addr)
 	, mySize(size)
 	, myRes(-1)
@@ -142,35 +890,68 @@ AsyncAccept::AsyncAccept(
 void
 AsyncAccept::execute()
 {
+	// Taken by io_uring before anyone has been waiting.
+	if (!myTask->myAccepted.empty())
+	{
+		int fd = myTask->myAccepted.front();
+		myTask->myAccepted.pop_front();
+		myIsDone = true;
+		onComplete(fd);
+		return;
+	}
 	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
 		return;
-	myRes = accept(myTask->myFd, myAddr, mySize);
-	if (myRes >= 0)
+	int rc;
+	// The clients which have gone before being accepted are skipped.
+	do
+		rc = accept(myTask->myFd, myAddr, mySize);
+	while (rc < 0 && (errno == EINTR || errno == ECONNABORTED));
+	if (rc < 0)
+	{
+		if (errno != EWOULDBLOCK && errno != EAGAIN)
+		{
+			onError(errno);
+			return;
+		}
+		// Can't accept anymore. Need to wait for a new read-event.
+		myTask->myEventsReady &= ~IO_EVENT_READ;
 		return;
-	assert(errno == EWOULDBLOCK);
-	// Can't accept anymore. Need to wait for a new read-event.
-	myTask->myEventsReady &= ~IO_EVENT_READ;
+	}
+	myIsDone = true;
+	myRes = rc;
+}
+
+bool
+AsyncAccept::onIOEvent()
+{
+	execute();
+	return resumeIfDone();
+}
+
+bool
+AsyncAccept::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	if (myTask->myCore.myUring == nullptr || myTask->myCore.isDraining())
+		return AsyncOperation::await_suspend(coro);
+	AsyncOperation*& op = slot();
+	assert(op == nullptr);
+	myCoro = coro;
+	op = this;
+	if (!myTask->myIsAcceptArmed)
+		myTask->myCore.uringArmAccept(myTask);
+	return true;
 }
 
 bool
-AsyncAccept::onIOEvent()
+AsyncAccept::onComplete(
+	int res)
 {
-	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
-	{
-		if (myTask->myState == IO_TASK_STATE_DELETING)
-		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
-			return true;
-		}
-		return false;
-	}
-	execute();
-	// Could be a spurious wakeup.
-	if (myRes < 0)
-		return false;
-	myCoro.resume();
+	myRes = res;
+	// The multishot accept doesn't fill the address, because the completions don't
+	// match the waits.
+	if (myAddr != nullptr && getpeername(res, myAddr, mySize) != 0)
+		*mySize = 0;
 	return true;
 }
 
@@ -180,10 +961,14 @@ AsyncConnect::AsyncConnect(
 	IOTask *sub,
 	const sockaddr *addr,
 	socklen_t size)
-	: AsyncOperation(sub)
-	, myIsDone(false)
+	: AsyncOperation(sub, IO_EVENT_WRITE)
+	, myAddr(addr)
+	, mySize(size)
 	, myRes(-1)
 {
+	// Io_uring connects when the operation is submitted.
+	if (myTask->myCore.backend() == IO_CORE_BACKEND_URING)
+		return;
 	int rc = connect(myTask->myFd, addr, size);
 	if (rc == 0)
 	{
@@ -192,8 +977,12 @@ AsyncConnect::AsyncConnect(
 		myRes = 0;
 		return;
 	}
+	if (errno != EINPROGRESS)
+	{
+		onError(errno);
+		return;
+	}
 	// Connect is started. When the socket gets writable, it means the connect is done.
-	assert(errno == EINPROGRESS);
 	// Apparently, it is not writable yet.
 	myTask->myEventsReady &= ~IO_EVENT_WRITE;
 }
@@ -201,22 +990,68 @@ AsyncConnect::AsyncConnect(
 bool
 AsyncConnect::onIOEvent()
 {
-	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
+	if ((myTask->myEventsReady & IO_EVENT_WRITE) != 0)
 	{
-		if (myTask->myState == IO_TASK_STATE_DELETING)
+		// Writable doesn't mean connected. It could be a failure as well.
+		int err = 0;
+		socklen_t len = sizeof(err);
+		int rc = getsockopt(myTask->myFd, SOL_SOCKET, SO_ERROR, &err, &len);
+		assert(rc == 0);
+		MAYBE_UNUSED(rc);
+		if (err != 0)
+		{
+			onError(err);
+		}
+		else
 		{
-			// Cancellation.
 			myIsDone = true;
-			myRes = -1;
-			myCoro.resume();
-			return true;
+			myRes = 0;
 		}
-		return false;
 	}
-	myIsDone = true;
-	myRes = 0;
-	myCoro.resume();
-	return true;
+	return resumeIfDone();
+}
+
+void
+AsyncConnect::onSubmit(
+	io_uring_sqe *sqe)
+{
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = myTask->myFd;
+	sqe->addr = (uint64_t)myAddr;
+	sqe->off = mySize;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+bool
+AsyncSleep::await_ready() const noexcept
+{
+	return myTimeout.count() <= 0 || myCore.isDraining();
+}
+
+void
+AsyncSleep::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	myTimer.myCoro = coro;
+	myTimer.myOp = nullptr;
+	myCore.addTimer(&myTimer, myTimeout);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+bool
+AsyncPost::await_ready() const noexcept
+{
+	return IOCore::current() == &myCore;
+}
+
+void
+AsyncPost::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	myCoro = coro;
+	myCore.post(this);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -226,10 +1061,18 @@ IOTask::IOTask(
 	int fd)
 	: myState(IO_TASK_STATE_NEW)
 	, myFd(fd)
-	, myIdx(-1)
+	, myGeneration(0)
 	, myEventsReady(0)
-	, myAsyncOp(nullptr)
+	, myReadOp(nullptr)
+	, myWriteOp(nullptr)
 	, myCore(core)
+	, myUringOpCount(0)
+	, myIsAcceptArmed(false)
+	, myZeroCopyState(IO_ZERO_COPY_STATE_UNKNOWN)
+	, myZeroCopySeq(0)
+	, myNextToAdd(nullptr)
+	, myNextToDelete(nullptr)
+	, myIsClosed(false)
 {
 	LOG_DEBUG("IOTask create");
 	theCount.fetch_add(1, std::memory_order_relaxed);
@@ -241,11 +1084,21 @@ IOTask::~IOTask()
 	theCount.fetch_sub(1, std::memory_order_relaxed);
 	assert(myState == IO_TASK_STATE_DELETING);
 	assert(myFd >= 0);
-	assert(myAsyncOp == nullptr);
+	assert(myReadOp == nullptr);
+	assert(myWriteOp == nullptr);
+	assert(myUringOpCount == 0);
+	assert(myAccepted.empty());
 	int rc = ::close(myFd);
 	assert(rc == 0);
 }
 
+IOTaskId
+IOTask::id() const
+{
+	assert(myState != IO_TASK_STATE_NEW);
+	return {myFd, myGeneration};
+}
+
 void
 IOTask::close()
 {
@@ -254,34 +1107,123 @@ IOTask::close()
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-IOCore::IOCore()
-	: myFd(epoll_create1(0))
+IOCore::IOCore(
+	IOCoreBackend backend)
+	: myEventSub(nullptr)
+	, myFd(-1)
+	, myUringWakeupValue(0)
+	, myIsUringWakeupArmed(false)
+	, myUringDroppedCount(0)
+	, myBufferData(nullptr)
+	, myBufferSize(0)
+	, myTaskCount(0)
 {
 	LOG_DEBUG("IOCore create");
 	myIsStopped = false;
+	myIsDraining = false;
+	myIsDrained = false;
+	myIsWakeupPending = false;
+	memset(myTimerWheel, 0, sizeof(myTimerWheel));
+	memset(myTimerWheelBits, 0, sizeof(myTimerWheelBits));
+	myTimerTickMs = ioNowMs();
+	myTimerCount = 0;
+	mySpinBudgetUs = 0;
+	if (backend == IO_CORE_BACKEND_URING)
+	{
+		myUring = std::make_unique<IOUring>();
+		if (!myUring->create(theUringEntryCount))
+		{
+			LOG_DEBUG("IOCore io_uring is not supported, fallback to epoll");
+			myUring.reset();
+		}
+	}
 	// Eventfd is used to wakeup from epoll_wait() for handling non-kernel events. For
 	// example, to let IOCore know, that there are new or deleting tasks to process.
+	// Io_uring reads it as any other fd.
 	myEventFd = eventfd(0, EFD_NONBLOCK);
+	if (myUring != nullptr)
+		return;
+	myFd = epoll_create1(0);
 	myEventSub = subscribe(myEventFd);
 }
 
 IOCore::~IOCore()
 {
 	LOG_DEBUG("IOCore destroy");
-	unsubscribe(myEventSub);
+	if (myEventSub != nullptr)
+		unsubscribe(myEventSub);
 	myEventSub = nullptr;
-	myEventFd = -1;
 	processQueues();
-	assert(myTasks.empty());
-	assert(myQueue.empty());
-	assert(myFd >= 0);
-	int rc = close(myFd);
+	assert(myTaskCount == 0);
+	assert(myNewTasks.isEmpty());
+	assert(myDeletedTasks.isEmpty());
+	assert(myPosted.isEmpty());
+	assert(myTimerCount == 0);
+	if (myUring == nullptr)
+	{
+		// The eventfd is closed by its task.
+		myEventFd = -1;
+		assert(myFd >= 0);
+		int rc = close(myFd);
+		assert(rc == 0);
+		return;
+	}
+	// The kernel owns the memory of the submissions until they are completed.
+	if (myIsUringWakeupArmed)
+		uringCancel((uint64_t)this | theUringTagWakeup);
+	while (myIsUringWakeupArmed || myUringDroppedCount != 0)
+	{
+		int rc = myUring->enter(1, -1);
+		assert(rc >= 0 || errno == EINTR);
+		MAYBE_UNUSED(rc);
+		io_uring_cqe cqe;
+		while (myUring->popCqe(&cqe))
+			uringComplete(cqe.user_data, cqe.res, cqe.flags);
+	}
+	myUring.reset();
+	int rc = close(myEventFd);
 	assert(rc == 0);
+	MAYBE_UNUSED(rc);
+	myEventFd = -1;
+}
+
+bool
+IOCore::registerBuffer(
+	void *data,
+	size_t size)
+{
+	assert(myBufferData == nullptr);
+	if (myUring == nullptr)
+		return false;
+	iovec iov;
+	iov.iov_base = data;
+	iov.iov_len = size;
+	int rc = syscall(__NR_io_uring_register, myUring->myFd, IORING_REGISTER_BUFFERS,
+		&iov, 1);
+	if (rc != 0)
+		return false;
+	myBufferData = data;
+	myBufferSize = size;
+	return true;
+}
+
+bool
+IOCore::isInRegisteredBuffer(
+	const void *data,
+	size_t size) const
+{
+	const char *begin = (const char *)myBufferData;
+	const char *pos = (const char *)data;
+	return begin != nullptr && pos >= begin && pos + size <= begin + myBufferSize;
 }
 
 void
 IOCore::wakeup()
 {
+	// The core resets the flag before taking the queues. So either it sees the new
+	// items, or the flag is already reset and this is the first push after it.
+	if (myIsWakeupPending.exchange(true, std::memory_order_seq_cst))
+		return;
 	uint64_t val = 1;
 	ssize_t rc = write(myEventFd, &val, sizeof(val));
 	assert(rc == sizeof(val));
@@ -291,14 +1233,9 @@ IOTask *
 IOCore::subscribe(
 	int fd)
 {
-	std::unique_lock lock(myMutex);
-	for (IOTask *s : myTasks)
-		assert(s->myFd != fd);
-	for (IOTask *s : myQueue)
-		assert(s->myFd != fd);
+	// A duplicate fd is caught by the table, when the task is added.
 	IOTask *s = new IOTask(*this, fd);
-	myQueue.push_back(s);
-	mySize.fetch_add(1, std::memory_order_relaxed);
+	myNewTasks.push(s);
 	wakeup();
 	return s;
 }
@@ -307,27 +1244,97 @@ void
 IOCore::unsubscribe(
 	IOTask *s)
 {
-	std::unique_lock lock(myMutex);
-	for (IOTask *is : myQueue)
-		assert(is != s);
-	assert(myTasks[s->myIdx] == s);
-	assert(s->myState == IO_TASK_STATE_WORKING);
-	s->myState = IO_TASK_STATE_DELETING;
-	myQueue.push_back(s);
-	mySize.fetch_add(1, std::memory_order_relaxed);
+	bool wasClosed = s->myIsClosed.exchange(true, std::memory_order_relaxed);
+	assert(!wasClosed);
+	MAYBE_UNUSED(wasClosed);
+	myDeletedTasks.push(s);
+	wakeup();
+}
+
+IOTask *
+IOCore::find(
+	int fd) const
+{
+	if (fd < 0 || (size_t)fd >= myTaskSlots.size())
+		return nullptr;
+	return myTaskSlots[fd].myTask;
+}
+
+IOTask *
+IOCore::find(
+	IOTaskId id) const
+{
+	if (id.myFd < 0 || (size_t)id.myFd >= myTaskSlots.size())
+		return nullptr;
+	const IOTaskSlot &slot = myTaskSlots[id.myFd];
+	if (slot.myGeneration != id.myGeneration)
+		return nullptr;
+	return slot.myTask;
+}
+
+void
+IOCore::post(
+	AsyncPost *op)
+{
+	myPosted.push(op);
 	wakeup();
 }
 
 void
 IOCore::roll()
 {
+	assert(theCurrent == nullptr);
+	theCurrent = this;
 	processQueues();
+	// The clock is only needed for the timers.
+	int timeout = myTimerCount == 0 ? -1 : timerTimeout(ioNowMs());
+	if (mySpinBudgetUs != 0 && timeout != 0)
+	{
+		timeout = rollSpin(timeout);
+		if (timeout != 0)
+			rollBackend(timeout);
+	}
+	else
+	{
+		rollBackend(timeout);
+	}
+	if (myTimerCount != 0)
+		processTimers(ioNowMs());
+	theCurrent = nullptr;
+}
+
+int
+IOCore::rollSpin(
+	int timeout)
+{
+	uint64_t start = ioNowUs();
+	uint64_t limit = mySpinBudgetUs;
+	if (timeout > 0 && (uint64_t)timeout * 1000 < limit)
+		limit = (uint64_t)timeout * 1000;
+	uint64_t spent;
+	do
+	{
+		if (rollBackend(0) != 0)
+			return 0;
+		spent = ioNowUs() - start;
+	} while (spent < limit);
+	if (timeout < 0)
+		return -1;
+	// The rest rounded up, so the timers are not woken up too early.
+	uint64_t spentMs = (spent + 999) / 1000;
+	return spentMs >= (uint64_t)timeout ? 0 : timeout - spentMs;
+}
+
+int
+IOCore::rollEpoll(
+	int timeout)
+{
 	epoll_event evs[theEpollBatchSize];
-	int rc = epoll_wait(myFd, evs, theEpollBatchSize, -1);
+	int rc = epoll_wait(myFd, evs, theEpollBatchSize, timeout);
 	if (rc < 0 && errno == EINTR)
-		return;
+		return 0;
 	assert(rc >= 0);
-	LOG_THIS_DEBUG(IOCore, roll, rc << " events");
+	LOG_THIS_DEBUG(IOCore, rollEpoll, rc << " events");
 	for (int i = 0; i < rc; ++i)
 	{
 		epoll_event& ev = evs[i];
@@ -337,7 +1344,10 @@ IOCore::roll()
 			mask |= IO_EVENT_READ;
 		if ((ev.events & EPOLLOUT) != 0)
 			mask |= IO_EVENT_WRITE;
-		assert((ev.events & ~(EPOLLIN | EPOLLOUT)) == 0);
+		// A closed or failed socket is ready for everything. The operations get the
+		// error from their syscalls.
+		if ((ev.events & (EPOLLHUP | EPOLLERR)) != 0)
+			mask |= IO_EVENT_READ | IO_EVENT_WRITE;
 		assert(mask != 0);
 		const char *eventStr = "[empty]";
 		if ((mask & IO_EVENT_READ) && (mask & IO_EVENT_WRITE))
@@ -352,73 +1362,545 @@ IOCore::roll()
 		{
 			eventStr = "[write]";
 		}
-		LOG_THIS_DEBUG(IOCore, roll, "event " << i << ": " << eventStr);
+		LOG_THIS_DEBUG(IOCore, rollEpoll, "event " << i << ": " << eventStr);
 		s->myEventsReady |= mask;
-		AsyncOperation* op = s->myAsyncOp;
-		if (op != nullptr)
+		// Each ready event wakes up its own operation. The reader might close the task
+		// but the deletion is deferred to the queues, so the task stays valid here.
+		if (mask & IO_EVENT_READ)
+			dispatch(s->myReadOp);
+		if (mask & IO_EVENT_WRITE)
+			dispatch(s->myWriteOp);
+	}
+	return rc;
+}
+
+int
+IOCore::rollUring(
+	int timeout)
+{
+	if (!myIsUringWakeupArmed)
+	{
+		io_uring_sqe *sqe = myUring->getSqe();
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = myEventFd;
+		sqe->addr = (uint64_t)&myUringWakeupValue;
+		sqe->len = sizeof(myUringWakeupValue);
+		sqe->user_data = (uint64_t)this | theUringTagWakeup;
+		myIsUringWakeupArmed = true;
+	}
+	// One syscall for all the submissions since the last roll and for the wait. Even a
+	// spin asks for a completion with a zero timeout, because the deferred completions
+	// are only posted by the waits.
+	int rc = myUring->enter(1, timeout);
+	// A timeout, a signal, or the kernel is busy flushing an overflow. Anyway, the
+	// completions which are there can be handled.
+	assert(rc >= 0 || errno == ETIME || errno == EINTR || errno == EBUSY);
+	MAYBE_UNUSED(rc);
+	io_uring_cqe cqe;
+	int count = 0;
+	for (; myUring->popCqe(&cqe); ++count)
+		uringComplete(cqe.user_data, cqe.res, cqe.flags);
+	return count;
+}
+
+void
+IOCore::dispatch(
+	AsyncOperation *&slot)
+{
+	AsyncOperation* op = slot;
+	if (op == nullptr)
+		return;
+	// Nullify in case the coroutine would try to start a new async operation.
+	slot = nullptr;
+	// Restore it back in case the handling didn't work. For example, due to a spurious
+	// wakeup.
+	if (!op->onIOEvent())
+		slot = op;
+}
+
+void
+IOCore::uringSubmit(
+	AsyncOperation *op)
+{
+	assert(((uint64_t)op & theUringTagMask) == 0);
+	uringPush(op);
+	op->myIsSubmitted = true;
+	++op->myTask->myUringOpCount;
+}
+
+void
+IOCore::uringPush(
+	AsyncOperation *op)
+{
+	io_uring_sqe *sqe = myUring->getSqe();
+	op->onSubmit(sqe);
+	sqe->user_data = (uint64_t)op | theUringTagOp;
+}
+
+void
+IOCore::uringArmAccept(
+	IOTask *s)
+{
+	assert(!s->myIsAcceptArmed);
+	// One submission produces a completion per client, until an error.
+	io_uring_sqe *sqe = myUring->getSqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = s->myFd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = (uint64_t)s | theUringTagAccept;
+	s->myIsAcceptArmed = true;
+	++s->myUringOpCount;
+}
+
+void
+IOCore::uringCancel(
+	uint64_t userData)
+{
+	// Not found when already completed. Either way, the target gets its completion.
+	io_uring_sqe *sqe = myUring->getSqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = userData;
+	sqe->user_data = theUringTagCancel;
+}
+
+void
+IOCore::uringDrop(
+	IOTask *s)
+{
+	AsyncOperation *ops[] = {s->myReadOp, s->myWriteOp};
+	for (AsyncOperation *op : ops)
+	{
+		if (op == nullptr)
+			continue;
+		LOG_THIS_DEBUG(IOCore, uringDrop, "cancel " << op);
+		// Not submitted is only the accept waiting for the multishot one.
+		if (op->myIsSubmitted)
+			uringCancel((uint64_t)op);
+		else
+			op->onUringCompletion(-ECANCELED, 0);
+	}
+	if (s->myIsAcceptArmed)
+		uringCancel((uint64_t)s | theUringTagAccept);
+	for (int fd : s->myAccepted)
+		close(fd);
+	s->myAccepted.clear();
+	if (s->myUringOpCount == 0)
+		delete s;
+	else
+		++myUringDroppedCount;
+}
+
+void
+IOCore::uringComplete(
+	uint64_t userData,
+	int res,
+	uint32_t flags)
+{
+	void *ptr = (void *)(userData & ~theUringTagMask);
+	IOTask *s;
+	switch (userData & theUringTagMask)
+	{
+	case theUringTagOp:
+	{
+		AsyncOperation *op = (AsyncOperation *)ptr;
+		s = op->myTask;
+		LOG_THIS_DEBUG(IOCore, uringComplete, "op " << op << ": " << res);
+		// The coroutine is resumed, and the op is gone after it.
+		op->onUringCompletion(res, flags);
+		break;
+	}
+	case theUringTagAccept:
+	{
+		s = (IOTask *)ptr;
+		LOG_THIS_DEBUG(IOCore, uringComplete, "accept " << s << ": " << res);
+		if ((flags & IORING_CQE_F_MORE) == 0)
 		{
-			// Nullify in case the coroutine would try to start a new async operation.
-			s->myAsyncOp = nullptr;
-			// Restore it back in case the handling didn't work. For example, due to a
-			// spurious wakeup.
-			if (!op->onIOEvent())
-				s->myAsyncOp = op;
+			s->myIsAcceptArmed = false;
+			--s->myUringOpCount;
 		}
+		AsyncOperation *op = s->myReadOp;
+		if (op != nullptr)
+			op->onUringCompletion(res, 0);
+		else if (res >= 0 && s->myState == IO_TASK_STATE_DELETING)
+			close(res);
+		else if (res >= 0)
+			s->myAccepted.push_back(res);
+		// An error nobody waits for is dropped. The next accept submits a new one.
+		break;
+	}
+	case theUringTagWakeup:
+		myIsUringWakeupArmed = false;
+		return;
+	default:
+		assert((userData & theUringTagMask) == theUringTagCancel);
+		return;
+	}
+	if (s->myState == IO_TASK_STATE_DELETING && s->myUringOpCount == 0)
+	{
+		--myUringDroppedCount;
+		delete s;
 	}
 }
 
 void
-IOCore::processQueues()
+IOCore::addTimer(
+	IOTimer *timer,
+	std::chrono::milliseconds timeout)
+{
+	assert(theCurrent == this || theCurrent == nullptr);
+	assert(timeout.count() >= 0);
+	uint64_t nowMs = ioNowMs();
+	// The empty wheel isn't processed, so it could be far behind.
+	if (myTimerCount == 0)
+		myTimerTickMs = nowMs;
+	uint64_t deadline = nowMs + timeout.count();
+	// The slot of this tick could be processed already.
+	if (deadline <= myTimerTickMs)
+		deadline = myTimerTickMs + 1;
+	uint32_t idx = deadline % theTimerWheelSize;
+	timer->myDeadlineMs = deadline;
+	timer->myPrev = nullptr;
+	timer->myNext = myTimerWheel[idx];
+	if (timer->myNext != nullptr)
+		timer->myNext->myPrev = timer;
+	myTimerWheel[idx] = timer;
+	myTimerWheelBits[idx / 64] |= 1ull << (idx % 64);
+	timer->myIsArmed = true;
+	++myTimerCount;
+}
+
+void
+IOCore::removeTimer(
+	IOTimer *timer)
 {
-	if (mySize.load(std::memory_order_relaxed) == 0)
+	if (!timer->myIsArmed)
 		return;
-	std::unique_lock lock(myMutex);
-	if (myQueue.empty())
+	uint32_t idx = timer->myDeadlineMs % theTimerWheelSize;
+	if (timer->myPrev != nullptr)
+		timer->myPrev->myNext = timer->myNext;
+	else
+		myTimerWheel[idx] = timer->myNext;
+	if (timer->myNext != nullptr)
+		timer->myNext->myPrev = timer->myPrev;
+	if (myTimerWheel[idx] == nullptr)
+		myTimerWheelBits[idx / 64] &= ~(1ull << (idx % 64));
+	timer->myIsArmed = false;
+	--myTimerCount;
+}
+
+void
+IOCore::processTimers(
+	uint64_t nowMs)
+{
+	if (nowMs <= myTimerTickMs)
 		return;
-	for (IOTask *s : myQueue)
+	// After a long pause each slot is visited once.
+	uint64_t tickCount = std::min<uint64_t>(nowMs - myTimerTickMs, theTimerWheelSize);
+	myTimerTickMs = nowMs;
+	for (uint64_t tick = nowMs - tickCount + 1; tick <= nowMs; ++tick)
+	{
+		uint32_t idx = tick % theTimerWheelSize;
+		IOTimer *timer = myTimerWheel[idx];
+		while (timer != nullptr)
+		{
+			IOTimer *next = timer->myNext;
+			if (timer->myDeadlineMs <= nowMs)
+			{
+				// The resumed coroutine can add new timers, but they are never due
+				// within this tick, and it doesn't touch the other timers.
+				removeTimer(timer);
+				// A submitted operation is only done with its completion, which
+				// resumes the coroutine then.
+				if (timer->myOp == nullptr || timer->myOp->cancel(ETIMEDOUT))
+					timer->myCoro.resume();
+			}
+			timer = next;
+		}
+	}
+}
+
+int
+IOCore::timerTimeout(
+	uint64_t nowMs) const
+{
+	assert(myTimerCount > 0);
+	if (nowMs > myTimerTickMs)
+	{
+		// Some slots are due already.
+		uint32_t idx = (myTimerTickMs + 1) % theTimerWheelSize;
+		if ((myTimerWheelBits[idx / 64] & (1ull << (idx % 64))) != 0)
+			return 0;
+	}
+	// The nearest non-empty slot after the processed ones. Its timers might be of a
+	// later round, then the core just wakes up once more than needed.
+	uint32_t start = (myTimerTickMs + 1) % theTimerWheelSize;
+	for (uint32_t i = 0; i < theTimerWheelSize / 64 + 1; ++i)
+	{
+		uint32_t wordIdx = (start / 64 + i) % (theTimerWheelSize / 64);
+		uint64_t word = myTimerWheelBits[wordIdx];
+		// The first word is only looked at from the start slot, the last one only
+		// before it.
+		if (i == 0)
+			word &= ~0ull << (start % 64);
+		else if (i == theTimerWheelSize / 64)
+			word &= (1ull << (start % 64)) - 1;
+		if (word == 0)
+			continue;
+		uint32_t idx = wordIdx * 64 + __builtin_ctzll(word);
+		uint64_t distance = (idx + theTimerWheelSize - start) % theTimerWheelSize;
+		uint64_t tick = myTimerTickMs + 1 + distance;
+		return tick <= nowMs ? 0 : (int)(tick - nowMs);
+	}
+	assert(false);
+	return -1;
+}
+
+void
+IOCore::processDrain()
+{
+	myIsDrained = true;
+	LOG_THIS_DEBUG(IOCore, processDrain, "cancel " << myTaskCount << " tasks");
+	// The resumed coroutines can't start new waits anymore, and their unsubscriptions
+	// and the subscriptions are queued. So the table stays the same meanwhile.
+	for (IOTaskSlot &slot : myTaskSlots)
 	{
-		if (s->myState == IO_TASK_STATE_NEW)
+		IOTask *s = slot.myTask;
+		if (s == nullptr)
+			continue;
+		AsyncOperation *ops[] = {s->myReadOp, s->myWriteOp};
+		for (AsyncOperation *op : ops)
 		{
-			LOG_THIS_DEBUG(IOCore, processQueues, "add " << s);
-			s->myState = IO_TASK_STATE_WORKING;
-			// Assume that in a new socket all the events are there. The task will clear
-			// those which are not really available yet.
-			s->myEventsReady = IO_EVENT_READ | IO_EVENT_WRITE;
-			s->myIdx = myTasks.size();
-			epoll_event ev;
-			memset(&ev, 0, sizeof(ev));
-			ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-			ev.data.ptr = (void *)s;
-			int rc = epoll_ctl(myFd, EPOLL_CTL_ADD, s->myFd, &ev);
-			assert(rc == 0);
-			myTasks.push_back(s);
+			// A submitted operation is resumed by its completion.
+			if (op != nullptr && op->cancel(ECANCELED))
+				op->myCoro.resume();
 		}
-		else if (s->myState == IO_TASK_STATE_DELETING)
+		if (s->myIsAcceptArmed)
+			uringCancel((uint64_t)s | theUringTagAccept);
+	}
+	if (myTimerCount == 0)
+		return;
+	// Only the sleeps are left to wake up. The timers of the operations are removed
+	// when the operations end.
+	for (IOTimer *&head : myTimerWheel)
+	{
+		IOTimer *timer = head;
+		while (timer != nullptr)
 		{
-			assert(myTasks.size() > s->myIdx);
-			assert(myTasks[s->myIdx] == s);
-			assert(s->myFd >= 0);
-			LOG_THIS_DEBUG(IOCore, processQueues, "drop " << s);
-			// Cyclic deletion, for O(1).
-			myTasks.back()->myIdx = s->myIdx;
-			myTasks[s->myIdx] = myTasks.back();
-			int rc = epoll_ctl(myFd, EPOLL_CTL_DEL, s->myFd, nullptr);
-			assert(rc == 0);
-			if (s->myAsyncOp != nullptr)
+			IOTimer *next = timer->myNext;
+			if (timer->myOp == nullptr)
 			{
-				LOG_THIS_DEBUG(IOCore, processQueues, "cancel " << s);
-				s->myEventsReady = 0;
-				s->myAsyncOp->onIOEvent();
-				s->myAsyncOp = nullptr;
+				removeTimer(timer);
+				timer->myCoro.resume();
 			}
-			delete s;
-			myTasks.resize(myTasks.size() - 1);
+			timer = next;
 		}
-		else
+	}
+}
+
+void
+IOCore::processQueues()
+{
+	myIsWakeupPending.store(false, std::memory_order_seq_cst);
+	// Seen after the flag reset, so the drain request isn't missed.
+	if (!myIsDrained && isDraining())
+		processDrain();
+	if (myNewTasks.isEmpty() && myDeletedTasks.isEmpty() && myPosted.isEmpty())
+		return;
+	// A task is pushed for deletion only after its addition, and the coroutines are
+	// posted after subscribing the tasks they are going to use. Taking the queues in
+	// this order ensures all these additions are taken as well.
+	IOTask *deleted = myDeletedTasks.popAll();
+	AsyncPost *posted = myPosted.popAll();
+	IOTask *added = myNewTasks.popAll();
+	while (added != nullptr)
+	{
+		IOTask *s = added;
+		added = s->myNextToAdd;
+		assert(s->myState == IO_TASK_STATE_NEW);
+		LOG_THIS_DEBUG(IOCore, processQueues, "add " << s);
+		s->myState = IO_TASK_STATE_WORKING;
+		assert(s->myFd >= 0);
+		if ((size_t)s->myFd >= myTaskSlots.size())
+		{
+			myTaskSlots.resize(std::max<size_t>(s->myFd + 1, myTaskSlots.size() * 2),
+				IOTaskSlot{nullptr, 0});
+		}
+		IOTaskSlot &slot = myTaskSlots[s->myFd];
+		assert(slot.myTask == nullptr);
+		slot.myTask = s;
+		s->myGeneration = ++slot.myGeneration;
+		++myTaskCount;
+		// Io_uring doesn't need the readiness. The operations never find the events
+		// ready and go right to the kernel.
+		if (myUring != nullptr)
+			continue;
+		// Assume that in a new socket all the events are there. The task will clear
+		// those which are not really available yet.
+		s->myEventsReady = IO_EVENT_READ | IO_EVENT_WRITE;
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = (void *)s;
+		int rc = epoll_ctl(myFd, EPOLL_CTL_ADD, s->myFd, &ev);
+		assert(rc == 0);
+	}
+	while (deleted != nullptr)
+	{
+		IOTask *s = deleted;
+		deleted = s->myNextToDelete;
+		assert(s->myState == IO_TASK_STATE_WORKING);
+		assert(myTaskSlots[s->myFd].myTask == s);
+		LOG_THIS_DEBUG(IOCore, processQueues, "drop " << s);
+		s->myState = IO_TASK_STATE_DELETING;
+		// The fd is only closed with the task, so it can't get a new task before the
+		// old one's completions in io_uring are done.
+		myTaskSlots[s->myFd].myTask = nullptr;
+		--myTaskCount;
+		if (myUring != nullptr)
+		{
+			uringDrop(s);
+			continue;
+		}
+		int rc = epoll_ctl(myFd, EPOLL_CTL_DEL, s->myFd, nullptr);
+		assert(rc == 0);
+		// Both slots are emptied before any resumption, so neither coroutine would see
+		// a stale operation of the other one.
+		AsyncOperation* readOp = s->myReadOp;
+		AsyncOperation* writeOp = s->myWriteOp;
+		s->myReadOp = nullptr;
+		s->myWriteOp = nullptr;
+		s->myEventsReady = 0;
+		if (readOp != nullptr)
+		{
+			LOG_THIS_DEBUG(IOCore, processQueues, "cancel read " << s);
+			readOp->onIOEvent();
+		}
+		if (writeOp != nullptr)
 		{
-			assert(false);
+			LOG_THIS_DEBUG(IOCore, processQueues, "cancel write " << s);
+			writeOp->onIOEvent();
 		}
+		delete s;
+	}
+	// Those posting again get into the next roll.
+	while (posted != nullptr)
+	{
+		AsyncPost *op = posted;
+		posted = op->myNext;
+		// The resumed coroutine destroys the op.
+		op->myCoro.resume();
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t
+ioNowMs()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000 + t.tv_nsec / 1'000'000;
+}
+
+static uint64_t
+ioNowUs()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1'000'000 + t.tv_nsec / 1000;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOCorePool::IOCorePool(
+	uint32_t coreCount,
+	IOCoreBackend backend)
+	: myNext(0)
+	, myFirstCpu(-1)
+{
+	assert(coreCount > 0);
+	for (uint32_t i = 0; i < coreCount; ++i)
+		myCores.push_back(std::make_unique<IOCore>(backend));
+}
+
+IOCorePool::~IOCorePool()
+{
+	stop();
+}
+
+void
+IOCorePool::start()
+{
+	assert(myThreads.empty());
+	uint32_t cpuCount = std::max(std::thread::hardware_concurrency(), 1u);
+	for (std::unique_ptr<IOCore> &core : myCores)
+	{
+		myThreads.emplace_back([&core = *core]() {
+			while (!core.isStopped())
+				core.roll();
+		});
+		if (myFirstCpu < 0)
+			continue;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET((myFirstCpu + myThreads.size() - 1) % cpuCount, &set);
+		// Not fatal. The core works the same, only with a worse latency.
+		int rc = pthread_setaffinity_np(myThreads.back().native_handle(), sizeof(set),
+			&set);
+		if (rc != 0)
+			LOG_DEBUG("IOCorePool failed to pin a thread: " << strerror(rc));
 	}
-	myQueue.clear();
-	mySize.store(myTasks.size(), std::memory_order_relaxed);
+}
+
+void
+IOCorePool::setSpinBudget(
+	std::chrono::microseconds budget)
+{
+	assert(myThreads.empty());
+	for (std::unique_ptr<IOCore> &core : myCores)
+		core->setSpinBudget(budget);
+}
+
+void
+IOCorePool::pinThreads(
+	uint32_t firstCpu)
+{
+	assert(myThreads.empty());
+	myFirstCpu = firstCpu;
+}
+
+void
+IOCorePool::drain()
+{
+	assert(!myThreads.empty());
+	for (std::unique_ptr<IOCore> &core : myCores)
+		core->drain();
+	IOCoroutinePromise::waitAllDone();
+	stop();
+}
+
+void
+IOCorePool::stop()
+{
+	for (std::unique_ptr<IOCore> &core : myCores)
+		core->stop();
+	for (std::thread &t : myThreads)
+		t.join();
+	myThreads.clear();
+}
+
+IOCore&
+IOCorePool::nextCore()
+{
+	return *myCores[myNext.fetch_add(1, std::memory_order_relaxed) % myCores.size()];
+}
+
+IOCore&
+IOCorePool::coreByFd(
+	int fd)
+{
+	assert(fd >= 0);
+	// The fds are reused from the lowest free one, so they are dense and don't need
+	// real hashing.
+	return *myCores[fd % myCores.size()];
 }
@@ -1,12 +1,20 @@
 #pragma once
 
 #include <atomic>
+#include <cassert>
+#include <chrono>
 #include <coroutine>
+#include <deque>
 #include <iostream>
-#include <mutex>
+#include <memory>
+#include <optional>
 #include <sstream>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #define MAYBE_UNUSED(...) ((void)sizeof(1, ##__VA_ARGS__))
@@ -30,6 +38,8 @@
 
 class IOCore;
 class IOTask;
+struct IOUring;
+struct io_uring_sqe;
 
 enum IOEventBit
 {
@@ -37,6 +47,22 @@ enum IOEventBit
 	IO_EVENT_WRITE = 2,
 };
 
+enum IOCoreBackend
+{
+	// Readiness. Epoll tells when a socket is ready, then the syscall is done.
+	IO_CORE_BACKEND_EPOLL,
+	// Completion. The operations are submitted into io_uring and the kernel does the
+	// syscalls by itself.
+	IO_CORE_BACKEND_URING,
+};
+
+enum IOZeroCopyState
+{
+	IO_ZERO_COPY_STATE_UNKNOWN,
+	IO_ZERO_COPY_STATE_ON,
+	IO_ZERO_COPY_STATE_UNSUPPORTED,
+};
+
 enum IOTaskState
 {
 	IO_TASK_STATE_NEW,
@@ -46,6 +72,87 @@ enum IOTaskState
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// Intrusive lock-free stack, multi-producer single-consumer. The producers push one by
+// one, and the consumer takes all at once. The items are never popped individually, so
+// there is no ABA problem.
+//
+template <typename T, T *T::*Next>
+class IOMPSCStack
+{
+public:
+	IOMPSCStack() : myHead(nullptr) {}
+
+	void
+	push(
+		T *item)
+	{
+		T *head = myHead.load(std::memory_order_relaxed);
+		do
+			item->*Next = head;
+		while (!myHead.compare_exchange_weak(head, item, std::memory_order_seq_cst,
+			std::memory_order_relaxed));
+	}
+
+	// Returns the items in the order of their pushes, linked via Next.
+	T *
+	popAll()
+	{
+		T *item = myHead.exchange(nullptr, std::memory_order_seq_cst);
+		T *res = nullptr;
+		while (item != nullptr)
+		{
+			T *next = item->*Next;
+			item->*Next = res;
+			res = item;
+			item = next;
+		}
+		return res;
+	}
+
+	bool
+	isEmpty() const { return myHead.load(std::memory_order_relaxed) == nullptr; }
+
+private:
+	std::atomic<T *> myHead;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Coroutine frames, cached in the threads by size classes. A frame freed in another
+// thread, like after a move to another core, goes to that thread's cache. Some too big
+// frames and those over the cache limit are just malloc-ed and freed.
+//
+struct IOFramePool
+{
+	static void *
+	allocate(
+		size_t size);
+
+	static void
+	deallocate(
+		void *ptr,
+		size_t size);
+
+	// Add the current thread's counters to the total ones. Is done automatically on a
+	// thread exit.
+	static void
+	flushStats();
+
+	static uint64_t
+	allocCount() { return theAllocCount.load(std::memory_order_relaxed); }
+
+	// The allocations served without malloc.
+	static uint64_t
+	hitCount() { return theHitCount.load(std::memory_order_relaxed); }
+
+private:
+	static std::atomic_uint64_t theAllocCount;
+	static std::atomic_uint64_t theHitCount;
+	friend struct IOFrameCache;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 struct IOCoroutinePromise;
 
 // C++20 coroutine has to be inherited from std::coroutine_handle with a promise type
@@ -87,7 +194,7 @@ struct IOCoroutinePromise
 	~IOCoroutinePromise()
 	{
 		LOG_DEBUG("IOCoroutinePromise destroy " << this);
-		theCount.fetch_sub(1, std::memory_order_relaxed);
+		onDestroy();
 	}
 
 	IOCoroutine
@@ -105,21 +212,62 @@ struct IOCoroutinePromise
 	void
 	unhandled_exception() { abort(); }
 
+	// The frame of the coroutine, promise included. The compiler passes the frame size
+	// to the deletion too, so the pool doesn't need to store it.
+	static void *
+	operator new(
+		size_t size) { return IOFramePool::allocate(size); }
+
+	static void
+	operator delete(
+		void *ptr,
+		size_t size) { IOFramePool::deallocate(ptr, size); }
+
+	// Block until no coroutines are left. Sleeps on a futex, woken up only by the last
+	// one destroyed.
+	static void
+	waitAllDone();
+
+	// For the other promise types counted here as well.
+	static void
+	onDestroy()
+	{
+		if (theCount.fetch_sub(1, std::memory_order_seq_cst) == 1 &&
+			theWaiterCount.load(std::memory_order_seq_cst) != 0)
+			notifyAllDone();
+	}
+
 	// Keep track of the promise count to ensure there are no memory leaks.
 	static std::atomic_int theCount;
+
+private:
+	static void
+	notifyAllDone();
+
+	// The waiters are rare, so the last coroutine usually doesn't make any syscalls.
+	static std::atomic_int theWaiterCount;
+	// Bumped each time the count drops to zero while anybody waits.
+	static std::atomic_uint32_t theDoneEpoch;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
 struct AsyncOperation
 {
+	// The event is the one the operation waits for. A task can have one operation
+	// waiting for each, so one coroutine can read while another one writes.
 	AsyncOperation(
-		IOTask *sub);
+		IOTask *sub,
+		IOEventBit event);
 	AsyncOperation(
 		const AsyncOperation&) = delete;
 	AsyncOperation& operator=(
 		const AsyncOperation&) = delete;
 
+	// Is called by co_await before suspension just in case the suspension is not needed.
+	bool
+	await_ready() const noexcept { return myIsDone; }
+
 	// co_await takes an argument - an awaitable object. The object has to define certain
 	// methods, including await_suspend(), invoked right after the coroutine has been
 	// stopped.
@@ -127,13 +275,68 @@ struct AsyncOperation
 	await_suspend(
 		std::coroutine_handle<> coro);
 
+	IOTask *
+	task() const { return myTask; }
+
+	// Complete the pending operation with the error, without resuming the coroutine.
+	// The caller does that, if true is returned. Otherwise the operation is in the
+	// kernel, and is only done with its completion, which resumes the coroutine then.
+	bool
+	cancel(
+		int err);
+
 private:
 	virtual bool
 	onIOEvent() = 0;
 
+	// Fill the io_uring submission.
+	virtual void
+	onSubmit(
+		io_uring_sqe *sqe);
+
+	// Take the successful result of the submission. False means the operation isn't
+	// done yet and has to be submitted again.
+	virtual bool
+	onComplete(
+		int res) = 0;
+
+	// The submission is completed with a result or -errno, and the completion flags.
+	// Resumes the coroutine, unless the kernel still has more to report.
+	void
+	onUringCompletion(
+		int res,
+		uint32_t flags);
+
+
 protected:
+	// The task's slot for the operations waiting for the same event.
+	AsyncOperation*&
+	slot();
+
+	// The syscall has failed with errno. Either it wasn't ready after all, and the
+	// event is consumed, or the operation is done with an error.
+	void
+	onError(
+		int err);
+
+	// Resume the coroutine if the operation is done, or cancel it if the task is being
+	// deleted. Returns whether the coroutine was resumed.
+	bool
+	resumeIfDone();
+
+	// Sets errno for the failed operations, when the coroutine takes the result.
+	void
+	restoreError() { if (myErr != 0) errno = myErr; }
+
 	IOTask *const myTask;
+	const IOEventBit myEvent;
 	std::coroutine_handle<> myCoro;
+	bool myIsDone;
+	// Is in io_uring and can't be dropped until completed.
+	bool myIsSubmitted;
+	int myErr;
+	// The error to report when the submission gets cancelled by a timeout.
+	int myCancelErr;
 
 	friend IOCore;
 };
@@ -151,13 +354,9 @@ struct AsyncRecv final : public AsyncOperation
 	AsyncRecv& operator=(
 		const AsyncRecv&) = delete;
 
-	// Is called by co_await before suspension just in case the suspension is not needed.
-	bool
-	await_ready() const noexcept { return myRes >= 0; }
-
-	// What co_await will return.
+	// What co_await will return. -1 for an error or cancellation, with errno set.
 	ssize_t
-	await_resume() { return myRes; }
+	await_resume() { restoreError(); return myRes; }
 
 private:
 	void
@@ -166,6 +365,14 @@ private:
 	bool
 	onIOEvent() final;
 
+	void
+	onSubmit(
+		io_uring_sqe *sqe) final;
+
+	bool
+	onComplete(
+		int res) final { myRes = res; return true; }
+
 	void *const myData;
 	const size_t mySize;
 	ssize_t myRes;
@@ -184,21 +391,158 @@ struct AsyncSend final : public AsyncOperation
 	AsyncSend& operator=(
 		const AsyncSend&) = delete;
 
+	ssize_t
+	await_resume() { restoreError(); return myRes; }
+
+private:
+	void
+	execute();
+
+	bool
+	onIOEvent() final;
+
+	void
+	onSubmit(
+		io_uring_sqe *sqe) final;
+
+	bool
+	onComplete(
+		int res) final { myRes = res; return true; }
+
+	const void *const myData;
+	const size_t mySize;
+	ssize_t myRes;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Send of the multiple buffers in one syscall. The same partial results as for a send.
+//
+struct AsyncSendv final : public AsyncOperation
+{
+	AsyncSendv(
+		IOTask *sub,
+		const iovec *vecs,
+		int count);
+	AsyncSendv(
+		const AsyncSendv&) = delete;
+	AsyncSendv& operator=(
+		const AsyncSendv&) = delete;
+
+	ssize_t
+	await_resume() { restoreError(); return myRes; }
+
+private:
+	void
+	execute();
+
+	bool
+	onIOEvent() final;
+
+	void
+	onSubmit(
+		io_uring_sqe *sqe) final;
+
 	bool
-	await_ready() const noexcept { return myRes >= 0; }
+	onComplete(
+		int res) final { myRes = res; return true; }
+
+	// Kept in the op, io_uring reads it when the operation is submitted.
+	msghdr myMsg;
+	const size_t mySize;
+	ssize_t myRes;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Send of a file's range right from the page cache. Returns how much was sent, could
+// be less than the size.
+//
+struct AsyncSendFile final : public AsyncOperation
+{
+	AsyncSendFile(
+		IOTask *sub,
+		int fd,
+		off_t offset,
+		size_t size);
+	AsyncSendFile(
+		const AsyncSendFile&) = delete;
+	AsyncSendFile& operator=(
+		const AsyncSendFile&) = delete;
 
 	ssize_t
-	await_resume() { return myRes; }
+	await_resume() { restoreError(); return myRes; }
+
+private:
+	void
+	execute();
+
+	bool
+	onIOEvent() final;
+
+	// Io_uring has no sendfile. It waits for the socket to be writable and the
+	// syscall is done in place.
+	void
+	onSubmit(
+		io_uring_sqe *sqe) final;
+
+	bool
+	onComplete(
+		int res) final;
+
+	const int myFileFd;
+	off_t myOffset;
+	const size_t mySize;
+	ssize_t myRes;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// A send without copying the data into the kernel. The coroutine is resumed only when
+// the kernel is done with the buffer, so it can be reused right away. Makes sense for
+// the big buffers, the notifications cost more than copying of the small ones. The
+// sockets not supporting it do a usual send. When cancelled, the data still might go
+// from the buffer after the resumption.
+//
+struct AsyncSendZeroCopy final : public AsyncOperation
+{
+	AsyncSendZeroCopy(
+		IOTask *sub,
+		const void *data,
+		size_t size);
+	AsyncSendZeroCopy(
+		const AsyncSendZeroCopy&) = delete;
+	AsyncSendZeroCopy& operator=(
+		const AsyncSendZeroCopy&) = delete;
+
+	ssize_t
+	await_resume() { restoreError(); return myRes; }
 
 private:
 	void
 	execute();
 
+	// Read the notifications from the socket's error queue. Done when the last send is
+	// released.
+	void
+	checkRelease();
+
 	bool
 	onIOEvent() final;
 
+	void
+	onSubmit(
+		io_uring_sqe *sqe) final;
+
+	bool
+	onComplete(
+		int res) final { myRes = res; return true; }
+
 	const void *const myData;
 	const size_t mySize;
+	// The kernel's counter of the zero-copy sends on the socket, for this one.
+	uint32_t mySeq;
+	bool myIsSent;
 	ssize_t myRes;
 };
 
@@ -215,11 +559,13 @@ struct AsyncAccept final : public AsyncOperation
 	AsyncAccept& operator=(
 		const AsyncAccept&) = delete;
 
+	// In io_uring the accepts are multishot, one for all the awaits on the task.
 	bool
-	await_ready() const noexcept { return myRes >= 0; }
+	await_suspend(
+		std::coroutine_handle<> coro);
 
 	int
-	await_resume() { return myRes; }
+	await_resume() { restoreError(); return myRes; }
 
 private:
 	void
@@ -228,6 +574,10 @@ private:
 	bool
 	onIOEvent() final;
 
+	bool
+	onComplete(
+		int res) final;
+
 	sockaddr *const myAddr;
 	socklen_t *const mySize;
 	int myRes;
@@ -246,22 +596,113 @@ struct AsyncConnect final : public AsyncOperation
 	AsyncConnect& operator=(
 		const AsyncConnect&) = delete;
 
-	bool
-	await_ready() const noexcept { return myIsDone; }
-
 	int
-	await_resume() { return myRes; }
+	await_resume() { restoreError(); return myRes; }
 
 private:
 	bool
 	onIOEvent() final;
 
-	bool myIsDone;
+	void
+	onSubmit(
+		io_uring_sqe *sqe) final;
+
+	bool
+	onComplete(
+		int res) final { myRes = res; return true; }
+
+	// Only used by io_uring, which connects when the operation is submitted.
+	const sockaddr *const myAddr;
+	const socklen_t mySize;
 	int myRes;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// A deadline in the core's timer wheel. Lives right in the awaitable which waits for it.
+struct IOTimer
+{
+	uint64_t myDeadlineMs;
+	std::coroutine_handle<> myCoro;
+	// The operation to cancel with ETIMEDOUT before resuming, if any.
+	AsyncOperation *myOp;
+	IOTimer *myPrev;
+	IOTimer *myNext;
+	bool myIsArmed;
+};
+
+struct AsyncSleep final
+{
+	AsyncSleep(
+		IOCore &core,
+		std::chrono::milliseconds timeout) : myCore(core), myTimeout(timeout) {}
+	AsyncSleep(
+		const AsyncSleep&) = delete;
+	AsyncSleep& operator=(
+		const AsyncSleep&) = delete;
+
+	// Sleeps are cut short by the drain of the core.
+	bool
+	await_ready() const noexcept;
+
+	void
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+	void
+	await_resume() noexcept {}
+
+private:
+	IOCore &myCore;
+	const std::chrono::milliseconds myTimeout;
+	IOTimer myTimer;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Moves the coroutine to the thread of the given core. When already there, doesn't even
+// suspend.
+struct AsyncPost final
+{
+	AsyncPost(
+		IOCore &core) : myCore(core) {}
+	AsyncPost(
+		const AsyncPost&) = delete;
+	AsyncPost& operator=(
+		const AsyncPost&) = delete;
+
+	bool
+	await_ready() const noexcept;
+
+	void
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+	void
+	await_resume() noexcept {}
+
+private:
+	IOCore &myCore;
+	// The awaitable lives in the suspended coroutine, so it is the queue's node itself.
+	std::coroutine_handle<> myCoro;
+	AsyncPost *myNext;
+
+	friend IOCore;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Identifies a task in its core, and is safe to keep after the task is gone. An fd
+// alone isn't enough for that, because the fds get reused.
+//
+struct IOTaskId
+{
+	int myFd;
+	uint32_t myGeneration;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 class IOTask
 {
 public:
@@ -277,6 +718,10 @@ public:
 	IOCore&
 	core() { return myCore; }
 
+	// Only in the core's thread, after the task is added there.
+	IOTaskId
+	id() const;
+
 	//////////////////////////////////////////////
 	// Those all are arguments for co_await.
 	//
@@ -286,6 +731,15 @@ public:
 	AsyncSend
 	asyncSend(const void *data, size_t size) { return AsyncSend(this, data, size); }
 
+	AsyncSendv
+	asyncSendv(const iovec *vecs, int count) { return AsyncSendv(this, vecs, count); }
+
+	AsyncSendFile
+	asyncSendFile(int fd, off_t offset, size_t size) { return AsyncSendFile(this, fd, offset, size); }
+
+	AsyncSendZeroCopy
+	asyncSendZeroCopy(const void *data, size_t size) { return AsyncSendZeroCopy(this, data, size); }
+
 	AsyncAccept
 	asyncAccept(sockaddr *addr, socklen_t *size) { return AsyncAccept(this, addr, size); }
 
@@ -299,40 +753,102 @@ public:
 private:
 	IOTaskState myState;
 	const int myFd;
-	int myIdx;
+	// Of the fd's slot in the core, taken when the task is added.
+	uint32_t myGeneration;
 	// Mask of events which are ready for consumption.
 	int myEventsReady;
-	// Currently waiting async operation blocked by a co_await. Coroutine can't be blocked
-	// more than once at a time, which means the current operation can only be one.
-	AsyncOperation* myAsyncOp;
+	// Currently waiting async operations blocked by a co_await. A coroutine can't be
+	// blocked more than once at a time, but the reader and the writer can be different
+	// coroutines. Hence an operation per event. Two readers at once would be a bug.
+	AsyncOperation* myReadOp;
+	AsyncOperation* myWriteOp;
 	IOCore &myCore;
+	// The submissions in io_uring. The deleted task stays until they are completed,
+	// because the kernel still uses the fd and the memory.
+	uint32_t myUringOpCount;
+	bool myIsAcceptArmed;
+	// Accepted by the multishot accept, when nobody has been waiting.
+	std::deque<int> myAccepted;
+	// SO_ZEROCOPY is turned on with the first zero-copy send. Then the kernel numbers
+	// the sends, and the next one gets this number.
+	IOZeroCopyState myZeroCopyState;
+	uint32_t myZeroCopySeq;
+	// A task can be in both queues at once, when it is unsubscribed right after the
+	// subscription.
+	IOTask *myNextToAdd;
+	IOTask *myNextToDelete;
+	std::atomic_bool myIsClosed;
 
 	friend AsyncAccept;
 	friend AsyncConnect;
 	friend AsyncOperation;
 	friend AsyncRecv;
 	friend AsyncSend;
+	friend AsyncSendFile;
+	friend AsyncSendZeroCopy;
+	friend AsyncSendv;
 	friend IOCore;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// A working task of an fd. The generation is bumped by each new task of the fd.
+//
+struct IOTaskSlot
+{
+	IOTask *myTask;
+	uint32_t myGeneration;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 // Event loop + IO operations with C++ coroutine support.
 //
 struct IOCore
 {
-	IOCore();
+	// When io_uring is not available, the core falls back to epoll.
+	IOCore(
+		IOCoreBackend backend = IO_CORE_BACKEND_EPOLL);
 	~IOCore();
 
+	IOCoreBackend
+	backend() const { return myUring == nullptr ? IO_CORE_BACKEND_EPOLL :
+		IO_CORE_BACKEND_URING; }
+
+	// In io_uring the kernel maps the buffer once, and the receipts into it don't need
+	// to pin the pages each time. One buffer per core, registered before any receipts
+	// into it. Returns false when not supported by the backend.
+	bool
+	registerBuffer(
+		void *data,
+		size_t size);
+
+	bool
+	isInRegisteredBuffer(
+		const void *data,
+		size_t size) const;
+
 	void
 	wakeup();
 
+	// Only makes the rolling thread quit. The coroutines stay where they are.
 	void
 	stop() { myIsStopped.store(true, std::memory_order_relaxed); wakeup(); }
 
 	bool
 	isStopped() const { return myIsStopped.load(std::memory_order_relaxed); }
 
+	// Can be called from any thread. The next roll cancels all the waiting operations
+	// and sleeps with ECANCELED, including the accepts. The new ones fail right away,
+	// except those having their result ready without waiting. The coroutines then are
+	// supposed to close their tasks and finish. The waits outside of the core, like the
+	// channels, are not affected.
+	void
+	drain() { myIsDraining.store(true, std::memory_order_relaxed); wakeup(); }
+
+	bool
+	isDraining() const { return myIsDraining.load(std::memory_order_relaxed); }
+
 	// Create a new task for async operations on the given fd.
 	IOTask *
 	subscribe(
@@ -344,24 +860,953 @@ struct IOCore
 	unsubscribe(
 		IOTask *s);
 
+	// The working task of the fd, in the core's thread. Null when there is none.
+	IOTask *
+	find(
+		int fd) const;
+
+	// Null when the task is gone, even if the fd has a new one.
+	IOTask *
+	find(
+		IOTaskId id) const;
+
+	// For co_await. After it the coroutine is in the core's thread and can use the
+	// core's tasks. The coroutine is resumed during the next roll.
+	AsyncPost
+	asyncPost() { return AsyncPost(*this); }
+
 	// Get all pending events from the kernel and handle them. Can only be done in one
 	// thread at a time.
 	void
 	roll();
 
+	// Before blocking, the roll polls the kernel without a wait for up to the budget.
+	// It burns the CPU, but an event coming within the budget is handled without a
+	// sleep and a wakeup of the thread. Best with the thread pinned to an own CPU. Zero
+	// by default, which means the roll blocks right away. Only for the core's thread,
+	// or before it is started.
+	void
+	setSpinBudget(
+		std::chrono::microseconds budget) { mySpinBudgetUs = budget.count(); }
+
+	// The core rolling in the current thread, if any.
+	static IOCore *
+	current() { return theCurrent; }
+
+	// For co_await, in the core's thread.
+	AsyncSleep
+	sleep(
+		std::chrono::milliseconds timeout) { return AsyncSleep(*this, timeout); }
+
+	// The timers are only used in the core's thread. That includes the removal, which
+	// does nothing when the timer has already expired.
+	void
+	addTimer(
+		IOTimer *timer,
+		std::chrono::milliseconds timeout);
+
+	void
+	removeTimer(
+		IOTimer *timer);
+
+	static constexpr uint32_t theTimerWheelSize = 1024;
+
 private:
+	void
+	post(
+		AsyncPost *op);
+
 	void
 	processQueues();
 
-	int myEventFd;
-	IOTask *myEventSub;
+	// Wake up the operation waiting in the slot, if any.
+	static void
+	dispatch(
+		AsyncOperation *&slot);
+
+	// Wait for the events for up to the timeout, -1 for infinity, and handle them.
+	// Returns the count of the handled events.
+	int
+	rollBackend(
+		int timeout) { return myUring != nullptr ? rollUring(timeout) :
+		rollEpoll(timeout); }
+
+	int
+	rollEpoll(
+		int timeout);
+
+	int
+	rollUring(
+		int timeout);
+
+	// Poll with zero timeouts until there are events or the budget or the timeout is
+	// spent. Returns the timeout left for the blocking wait, or 0 when the events were
+	// handled.
+	int
+	rollSpin(
+		int timeout);
+
+	void
+	uringSubmit(
+		AsyncOperation *op);
+
+	// Put the op's submission into the ring. Also used when it needs another round
+	// after a completion.
+	void
+	uringPush(
+		AsyncOperation *op);
+
+	void
+	uringArmAccept(
+		IOTask *s);
+
+	void
+	uringCancel(
+		uint64_t userData);
+
+	// Cancel all the submissions of the deleted task. It is freed when none are left.
+	void
+	uringDrop(
+		IOTask *s);
+
+	void
+	uringComplete(
+		uint64_t userData,
+		int res,
+		uint32_t flags);
+
+	// Fire the timers expired by the given time.
+	void
+	processTimers(
+		uint64_t nowMs);
+
+	// Cancel everything waiting in the core, once the drain is requested.
+	void
+	processDrain();
+
+	// For epoll_wait(). -1 when there are no timers.
+	int
+	timerTimeout(
+		uint64_t nowMs) const;
+
+	int myEventFd;
+	IOTask *myEventSub;
 	int myFd;
 	std::atomic_bool myIsStopped;
+	std::atomic_bool myIsDraining;
+	// The existing waits are cancelled. Only used in the core's thread.
+	bool myIsDrained;
+	// The proactor backend, if used. Then the eventfd is read by the ring, not epoll.
+	std::unique_ptr<IOUring> myUring;
+	uint64_t myUringWakeupValue;
+	bool myIsUringWakeupArmed;
+	// Deleted tasks waiting for their submissions to complete.
+	uint32_t myUringDroppedCount;
+	void *myBufferData;
+	size_t myBufferSize;
+
+	// Set by the first push since the last processing, so the others don't write to
+	// the eventfd again.
+	std::atomic_bool myIsWakeupPending;
+	// Tasks currently in work, indexed by their fds. Only used in the core's thread.
+	// The fds are dense, so the table is not much bigger than the count of them.
+	std::vector<IOTaskSlot> myTaskSlots;
+	uint32_t myTaskCount;
+	// Incoming tasks and coroutines, pushed from any thread.
+	IOMPSCStack<IOTask, &IOTask::myNextToAdd> myNewTasks;
+	IOMPSCStack<IOTask, &IOTask::myNextToDelete> myDeletedTasks;
+	IOMPSCStack<AsyncPost, &AsyncPost::myNext> myPosted;
+
+	// A hashed wheel with one millisecond slots. The timers further than a revolution
+	// away are in the same slots and just wait for their round. The bitmap of the
+	// non-empty slots gives the nearest deadline fast.
+	IOTimer *myTimerWheel[theTimerWheelSize];
+	uint64_t myTimerWheelBits[theTimerWheelSize / 64];
+	// All the slots up to this tick are processed.
+	uint64_t myTimerTickMs;
+	uint32_t myTimerCount;
+	uint64_t mySpinBudgetUs;
+
+	static thread_local IOCore *theCurrent;
+
+	friend AsyncAccept;
+	friend AsyncOperation;
+	friend AsyncPost;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Wraps an operation of a task. When the operation doesn't complete in time, it is
+// cancelled and returns -1 with ETIMEDOUT. The operation object is a temporary of the
+// same co_await expression, so it lives until the end of the wait.
+//
+template <typename Op>
+struct AsyncWithTimeout final
+{
+	AsyncWithTimeout(
+		Op &op,
+		std::chrono::milliseconds timeout) : myOp(op), myTimeout(timeout) {}
+	AsyncWithTimeout(
+		const AsyncWithTimeout&) = delete;
+	AsyncWithTimeout& operator=(
+		const AsyncWithTimeout&) = delete;
+
+	bool
+	await_ready() const noexcept { return myOp.await_ready(); }
+
+	bool
+	await_suspend(
+		std::coroutine_handle<> coro)
+	{
+		myTimer.myCoro = coro;
+		myTimer.myOp = &myOp;
+		myOp.task()->core().addTimer(&myTimer, myTimeout);
+		return myOp.await_suspend(coro);
+	}
+
+	auto
+	await_resume()
+	{
+		// Done before the deadline, or cancelled by the task deletion.
+		if (myTimer.myIsArmed)
+			myOp.task()->core().removeTimer(&myTimer);
+		return myOp.await_resume();
+	}
+
+private:
+	Op &myOp;
+	const std::chrono::milliseconds myTimeout;
+	IOTimer myTimer;
+};
+
+template <typename Op>
+AsyncWithTimeout<Op>
+withTimeout(
+	Op &&op,
+	std::chrono::milliseconds timeout) { return AsyncWithTimeout<Op>(op, timeout); }
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+struct IOLazyPromiseBase;
+template <typename T>
+struct IOLazyPromise;
+
+// A coroutine with a result, which only starts when awaited. The awaiter is suspended
+// until the result is there. Owns the frame.
+//
+// The awaiter starts it with a plain resume(), and isn't suspended at all when it
+// completes right away. Then the stack is back where it was, and long loops of such
+// awaits don't grow it. Symmetric transfer would do the same only when compiled into a
+// tail call, which GCC doesn't do without optimizations.
+//
+template <typename T = void>
+class IOLazy
+{
+public:
+	using promise_type = IOLazyPromise<T>;
+
+	IOLazy(
+		IOLazy &&other) noexcept : myCoro(std::exchange(other.myCoro, nullptr)) {}
+	IOLazy(
+		const IOLazy&) = delete;
+	IOLazy& operator=(
+		const IOLazy&) = delete;
+	~IOLazy() { if (myCoro) myCoro.destroy(); }
+
+	bool
+	await_ready() const noexcept { return false; }
+
+	bool
+	await_suspend(
+		std::coroutine_handle<> awaiter) noexcept;
+
+	T
+	await_resume() { return myCoro.promise().result(); }
+
+private:
+	explicit IOLazy(
+		std::coroutine_handle<promise_type> coro) : myCoro(coro) {}
+
+	std::coroutine_handle<promise_type> myCoro;
+
+	friend promise_type;
+};
+
+// On co_return the lazy coroutine stays suspended, the frame has the result. The awaiter
+// is resumed, unless it is still starting the coroutine and will just go on then.
+//
+struct IOLazyFinalizer
+{
+	bool
+	await_ready() noexcept { return false; }
+
+	void
+	await_resume() noexcept {}
+
+	template <typename P>
+	std::coroutine_handle<>
+	await_suspend(
+		std::coroutine_handle<P> coro) noexcept
+	{
+		auto &promise = coro.promise();
+		if (promise.myIsHalfDone.exchange(true, std::memory_order_acq_rel))
+			return promise.myAwaiter;
+		return std::noop_coroutine();
+	}
+};
+
+struct IOLazyPromiseBase
+{
+	// Counted as the other coroutines, so the leaks are visible the same way.
+	IOLazyPromiseBase()
+	{
+		IOCoroutinePromise::theCount.fetch_add(1, std::memory_order_relaxed);
+	}
+	~IOLazyPromiseBase() { IOCoroutinePromise::onDestroy(); }
+
+	std::suspend_always
+	initial_suspend() noexcept { return {}; }
+
+	IOLazyFinalizer
+	final_suspend() noexcept { return {}; }
+
+	void
+	unhandled_exception() { abort(); }
+
+	static void *
+	operator new(
+		size_t size) { return IOFramePool::allocate(size); }
+
+	static void
+	operator delete(
+		void *ptr,
+		size_t size) { IOFramePool::deallocate(ptr, size); }
+
+	// Set when started. A lazy coroutine can only be awaited once.
+	std::coroutine_handle<> myAwaiter;
+	// The coroutine can complete in another thread while the awaiter is still in
+	// await_suspend(). The second one of them to get here resumes the awaiter.
+	std::atomic_bool myIsHalfDone{false};
+};
+
+template <typename T>
+struct IOLazyPromise : public IOLazyPromiseBase
+{
+	IOLazy<T>
+	get_return_object()
+	{
+		return IOLazy<T>(std::coroutine_handle<IOLazyPromise>::from_promise(*this));
+	}
+
+	void
+	return_value(
+		T value) { myResult.emplace(std::move(value)); }
+
+	T
+	result() { return std::move(*myResult); }
+
+	std::optional<T> myResult;
+};
+
+template <>
+struct IOLazyPromise<void> : public IOLazyPromiseBase
+{
+	IOLazy<void>
+	get_return_object()
+	{
+		return IOLazy<void>(std::coroutine_handle<IOLazyPromise>::from_promise(*this));
+	}
+
+	void
+	return_void() {}
+
+	void
+	result() {}
+};
+
+template <typename T>
+bool
+IOLazy<T>::await_suspend(
+	std::coroutine_handle<> awaiter) noexcept
+{
+	promise_type &promise = myCoro.promise();
+	assert(!promise.myAwaiter);
+	promise.myAwaiter = awaiter;
+	myCoro.resume();
+	// Not suspended, if already completed.
+	return !promise.myIsHalfDone.exchange(true, std::memory_order_acq_rel);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// The lazy coroutines of whenAll() and whenAny() are awaited each by an own driver
+// coroutine. The drivers share this state. It is refcounted by them and the awaiter,
+// because in whenAny() the drivers can outlive the awaiter's wait. The coroutines must
+// complete in the awaiter's thread, the state isn't protected.
+//
+struct IOWhenState
+{
+	// Returns the coroutine to switch to.
+	std::coroutine_handle<>
+	onDriverDone(
+		uint32_t idx);
+
+	void
+	unref() { if (--myRefCount == 0) myDelete(this); }
+
+	uint32_t myRefCount;
+	// The drivers still running.
+	uint32_t myLeft;
+	// Of the driver done first. Only whenAny() needs it.
+	uint32_t myFirstIdx;
+	bool myIsAny;
+	// The awaiter is suspended and the drivers are to resume it.
+	bool myIsWaiting;
+	std::coroutine_handle<> myAwaiter;
+	void (*myDelete)(IOWhenState *);
+};
+
+struct IOWhenDriverPromise;
+
+struct IOWhenDriver : std::coroutine_handle<IOWhenDriverPromise>
+{
+	using promise_type = IOWhenDriverPromise;
+};
+
+// Destroys the driver and switches to the awaiter, if this is the driver it waits for.
+//
+struct IOWhenDriverFinalizer
+{
+	bool
+	await_ready() noexcept { return false; }
+
+	void
+	await_resume() noexcept {}
+
+	std::coroutine_handle<>
+	await_suspend(
+		std::coroutine_handle<IOWhenDriverPromise> coro) noexcept;
+};
+
+struct IOWhenDriverPromise
+{
+	IOWhenDriverPromise()
+	{
+		IOCoroutinePromise::theCount.fetch_add(1, std::memory_order_relaxed);
+	}
+	~IOWhenDriverPromise() { IOCoroutinePromise::onDestroy(); }
+
+	IOWhenDriver
+	get_return_object() { return {IOWhenDriver::from_promise(*this)}; }
+
+	std::suspend_always
+	initial_suspend() noexcept { return {}; }
+
+	IOWhenDriverFinalizer
+	final_suspend() noexcept { return {}; }
+
+	void
+	return_void() {}
+
+	void
+	unhandled_exception() { abort(); }
+
+	static void *
+	operator new(
+		size_t size) { return IOFramePool::allocate(size); }
+
+	static void
+	operator delete(
+		void *ptr,
+		size_t size) { IOFramePool::deallocate(ptr, size); }
+
+	IOWhenState *myState;
+	uint32_t myIdx;
+};
+
+inline std::coroutine_handle<>
+IOWhenState::onDriverDone(
+	uint32_t idx)
+{
+	--myLeft;
+	if (myFirstIdx == UINT32_MAX)
+		myFirstIdx = idx;
+	std::coroutine_handle<> next = std::noop_coroutine();
+	if (myIsWaiting && (myIsAny || myLeft == 0))
+	{
+		myIsWaiting = false;
+		next = myAwaiter;
+	}
+	// The awaiter still has its reference, if it is the next.
+	unref();
+	return next;
+}
+
+inline std::coroutine_handle<>
+IOWhenDriverFinalizer::await_suspend(
+	std::coroutine_handle<IOWhenDriverPromise> coro) noexcept
+{
+	IOWhenState *state = coro.promise().myState;
+	uint32_t idx = coro.promise().myIdx;
+	coro.destroy();
+	return state->onDriverDone(idx);
+}
+
+// The result of a void coroutine, to be stored alongside the others.
+//
+struct IOVoid {};
+
+template <typename T>
+using IOWhenValue = std::conditional_t<std::is_void_v<T>, IOVoid, T>;
+
+template <typename T>
+IOWhenDriver
+ioWhenDrive(
+	IOLazy<T> &task,
+	std::optional<IOWhenValue<T>> &res)
+{
+	if constexpr (std::is_void_v<T>)
+	{
+		co_await task;
+		res.emplace();
+	}
+	else
+	{
+		res.emplace(co_await task);
+	}
+}
+
+template <typename T>
+struct IOWhenTypedState final : public IOWhenState
+{
+	IOWhenTypedState(
+		std::vector<IOLazy<T>> &&tasks,
+		bool isAny);
+
+	std::vector<IOLazy<T>> myTasks;
+	std::vector<std::optional<IOWhenValue<T>>> myResults;
+	std::vector<IOWhenDriver> myDrivers;
+};
+
+template <typename T>
+IOWhenTypedState<T>::IOWhenTypedState(
+	std::vector<IOLazy<T>> &&tasks,
+	bool isAny)
+	: myTasks(std::move(tasks))
+	, myResults(myTasks.size())
+{
+	uint32_t count = myTasks.size();
+	myRefCount = count + 1;
+	myLeft = count;
+	myFirstIdx = UINT32_MAX;
+	myIsAny = isAny;
+	myIsWaiting = false;
+	myDelete = [](IOWhenState *s) { delete static_cast<IOWhenTypedState *>(s); };
+	myDrivers.reserve(count);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		IOWhenDriver driver = ioWhenDrive<T>(myTasks[i], myResults[i]);
+		driver.promise().myState = this;
+		driver.promise().myIdx = i;
+		myDrivers.push_back(driver);
+	}
+}
+
+// Starts all the drivers, one by one, and suspends the awaiter until they are done. Or
+// until the first one is done, in whenAny().
+//
+struct IOWhenStart
+{
+	bool
+	await_ready() noexcept { return false; }
+
+	void
+	await_resume() noexcept {}
+
+	bool
+	await_suspend(
+		std::coroutine_handle<> awaiter);
+
+	IOWhenState *myState;
+	// The drivers are only touched before they are started. After that they can be
+	// gone any moment.
+	IOWhenDriver *myDrivers;
+	uint32_t myCount;
+};
+
+inline bool
+IOWhenStart::await_suspend(
+	std::coroutine_handle<> awaiter)
+{
+	myState->myAwaiter = awaiter;
+	// The drivers done right away don't resume the awaiter, it is still here.
+	for (uint32_t i = 0; i < myCount; ++i)
+		myDrivers[i].resume();
+	if (myState->myLeft == 0 || (myState->myIsAny && myState->myFirstIdx != UINT32_MAX))
+		return false;
+	myState->myIsWaiting = true;
+	return true;
+}
+
+// Run the coroutines concurrently, and get all their results in the same order.
+template <typename T>
+IOLazy<std::conditional_t<std::is_void_v<T>, void, std::vector<IOWhenValue<T>>>>
+whenAll(
+	std::vector<IOLazy<T>> tasks)
+{
+	IOWhenTypedState<T> *state = new IOWhenTypedState<T>(std::move(tasks), false);
+	co_await IOWhenStart{state, state->myDrivers.data(),
+		(uint32_t)state->myDrivers.size()};
+	if constexpr (std::is_void_v<T>)
+	{
+		state->unref();
+		co_return;
+	}
+	else
+	{
+		std::vector<T> res;
+		res.reserve(state->myResults.size());
+		for (std::optional<T> &r : state->myResults)
+			res.push_back(std::move(*r));
+		state->unref();
+		co_return res;
+	}
+}
+
+// Run the coroutines concurrently, and get the index of the first one done, with its
+// result. The others are not cancelled. They keep running, and their results are
+// dropped.
+template <typename T>
+IOLazy<std::conditional_t<std::is_void_v<T>, size_t, std::pair<size_t, IOWhenValue<T>>>>
+whenAny(
+	std::vector<IOLazy<T>> tasks)
+{
+	assert(!tasks.empty());
+	IOWhenTypedState<T> *state = new IOWhenTypedState<T>(std::move(tasks), true);
+	co_await IOWhenStart{state, state->myDrivers.data(),
+		(uint32_t)state->myDrivers.size()};
+	size_t idx = state->myFirstIdx;
+	if constexpr (std::is_void_v<T>)
+	{
+		state->unref();
+		co_return idx;
+	}
+	else
+	{
+		std::pair<size_t, T> res(idx, std::move(*state->myResults[idx]));
+		state->unref();
+		co_return res;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+class IOChannel;
+template <typename T>
+struct IOChannelRecv;
+
+// The waiting senders and receivers of a channel are in the lists of their awaitables.
+//
+template <typename T>
+struct IOChannelSend
+{
+	IOChannelSend(
+		IOChannel<T> &channel,
+		T &&value) : myChannel(channel), myValue(std::move(value)), myRes(false) {}
+	IOChannelSend(
+		const IOChannelSend&) = delete;
+	IOChannelSend& operator=(
+		const IOChannelSend&) = delete;
+
+	bool
+	await_ready();
+
+	void
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+	// False when the channel is closed.
+	bool
+	await_resume() { return myRes; }
+
+private:
+	IOChannel<T> &myChannel;
+	T myValue;
+	bool myRes;
+	std::coroutine_handle<> myCoro;
+	IOChannelSend *myNext;
+
+	friend IOChannel<T>;
+	friend IOChannelRecv<T>;
+};
+
+template <typename T>
+struct IOChannelRecv
+{
+	IOChannelRecv(
+		IOChannel<T> &channel) : myChannel(channel) {}
+	IOChannelRecv(
+		const IOChannelRecv&) = delete;
+	IOChannelRecv& operator=(
+		const IOChannelRecv&) = delete;
+
+	bool
+	await_ready();
+
+	void
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+	// Empty when the channel is closed and has nothing left.
+	std::optional<T>
+	await_resume() { return std::move(myRes); }
+
+private:
+	IOChannel<T> &myChannel;
+	std::optional<T> myRes;
+	std::coroutine_handle<> myCoro;
+	IOChannelRecv *myNext;
+
+	friend IOChannel<T>;
+	friend IOChannelSend<T>;
+};
+
+// A bounded queue between the coroutines of one thread. The senders wait when it is
+// full, the receivers wait when it is empty. Capacity 0 makes each send wait for a
+// receiver. The waiter is resumed right by the coroutine which has unblocked it, and
+// gets the thread back after the resumed one is suspended again.
+//
+template <typename T>
+class IOChannel
+{
+public:
+	IOChannel(
+		size_t capacity) : myCapacity(capacity), myIsClosed(false) {}
+	~IOChannel() { assert(mySendHead == nullptr && myRecvHead == nullptr); }
+
+	IOChannel(
+		const IOChannel&) = delete;
+	IOChannel& operator=(
+		const IOChannel&) = delete;
+
+	IOChannelSend<T>
+	send(
+		T value) { return IOChannelSend<T>(*this, std::move(value)); }
+
+	IOChannelRecv<T>
+	recv() { return IOChannelRecv<T>(*this); }
+
+	// The waiting senders fail, the waiting receivers get nothing. The values already
+	// in the channel still can be received.
+	void
+	close();
+
+	size_t
+	size() const { return myQueue.size(); }
+
+private:
+	template <typename W>
+	static void
+	push(
+		W *&head,
+		W *&tail,
+		W *w);
+
+	template <typename W>
+	static W *
+	pop(
+		W *&head,
+		W *&tail);
+
+	std::deque<T> myQueue;
+	const size_t myCapacity;
+	bool myIsClosed;
+	IOChannelSend<T> *mySendHead = nullptr;
+	IOChannelSend<T> *mySendTail = nullptr;
+	IOChannelRecv<T> *myRecvHead = nullptr;
+	IOChannelRecv<T> *myRecvTail = nullptr;
+
+	friend IOChannelSend<T>;
+	friend IOChannelRecv<T>;
+};
+
+template <typename T>
+bool
+IOChannelSend<T>::await_ready()
+{
+	IOChannel<T> &ch = myChannel;
+	if (ch.myIsClosed)
+		return true;
+	myRes = true;
+	// A receiver waits only when the channel is empty. Give it the value directly.
+	IOChannelRecv<T> *r = IOChannel<T>::pop(ch.myRecvHead, ch.myRecvTail);
+	if (r != nullptr)
+	{
+		r->myRes.emplace(std::move(myValue));
+		r->myCoro.resume();
+		return true;
+	}
+	if (ch.myQueue.size() < ch.myCapacity)
+	{
+		ch.myQueue.push_back(std::move(myValue));
+		return true;
+	}
+	myRes = false;
+	return false;
+}
+
+template <typename T>
+void
+IOChannelSend<T>::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	myCoro = coro;
+	IOChannel<T>::push(myChannel.mySendHead, myChannel.mySendTail, this);
+}
+
+template <typename T>
+bool
+IOChannelRecv<T>::await_ready()
+{
+	IOChannel<T> &ch = myChannel;
+	IOChannelSend<T> *s = IOChannel<T>::pop(ch.mySendHead, ch.mySendTail);
+	if (!ch.myQueue.empty())
+	{
+		myRes.emplace(std::move(ch.myQueue.front()));
+		ch.myQueue.pop_front();
+		// The place is free now, the first waiting sender takes it.
+		if (s != nullptr)
+		{
+			ch.myQueue.push_back(std::move(s->myValue));
+			s->myRes = true;
+			s->myCoro.resume();
+		}
+		return true;
+	}
+	if (s != nullptr)
+	{
+		// Without a capacity the values go from hand to hand.
+		myRes.emplace(std::move(s->myValue));
+		s->myRes = true;
+		s->myCoro.resume();
+		return true;
+	}
+	return ch.myIsClosed;
+}
+
+template <typename T>
+void
+IOChannelRecv<T>::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	myCoro = coro;
+	IOChannel<T>::push(myChannel.myRecvHead, myChannel.myRecvTail, this);
+}
+
+template <typename T>
+void
+IOChannel<T>::close()
+{
+	myIsClosed = true;
+	// The resumed ones can't wait on the closed channel again, so the lists only
+	// shrink.
+	while (IOChannelRecv<T> *r = pop(myRecvHead, myRecvTail))
+		r->myCoro.resume();
+	while (IOChannelSend<T> *s = pop(mySendHead, mySendTail))
+		s->myCoro.resume();
+}
+
+template <typename T>
+template <typename W>
+void
+IOChannel<T>::push(
+	W *&head,
+	W *&tail,
+	W *w)
+{
+	w->myNext = nullptr;
+	if (tail == nullptr)
+		head = w;
+	else
+		tail->myNext = w;
+	tail = w;
+}
+
+template <typename T>
+template <typename W>
+W *
+IOChannel<T>::pop(
+	W *&head,
+	W *&tail)
+{
+	W *w = head;
+	if (w == nullptr)
+		return nullptr;
+	head = w->myNext;
+	if (head == nullptr)
+		tail = nullptr;
+	return w;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Multiple cores, each with an own epoll or io_uring and thread. A task stays in one
+// core for all its life, and its coroutines have to operate on it from the core's
+// thread. For that they can co_await core.asyncPost() when they are not there yet.
+//
+class IOCorePool
+{
+public:
+	IOCorePool(
+		uint32_t coreCount,
+		IOCoreBackend backend = IO_CORE_BACKEND_EPOLL);
+	~IOCorePool();
 
-	std::mutex myMutex;
-	// Tasks currently in work.
-	std::vector<IOTask *> myTasks;
-	// Incoming tasks. New and deleting ones.
-	std::vector<IOTask *> myQueue;
-	std::atomic_uint64_t mySize;
+	// Start the threads. The cores can be used before that, the posted coroutines and
+	// the subscribed tasks just wait.
+	void
+	start();
+
+	// Stop the cores and join their threads.
+	void
+	stop();
+
+	// Drain all the cores and wait until there are no coroutines left at all, then
+	// stop. The threads must be started.
+	void
+	drain();
+
+	// For all the cores. Before the start.
+	void
+	setSpinBudget(
+		std::chrono::microseconds budget);
+
+	// Pin the thread of core i to the CPU firstCpu + i, wrapping around the count of
+	// the CPUs. Before the start. A spinning core should not share its CPU.
+	void
+	pinThreads(
+		uint32_t firstCpu);
+
+	uint32_t
+	size() const { return myCores.size(); }
+
+	IOCore&
+	core(uint32_t idx) { return *myCores[idx]; }
+
+	// Round-robin. Spreads the tasks evenly regardless of their fds.
+	IOCore&
+	nextCore();
+
+	// The same fd always gets the same core.
+	IOCore&
+	coreByFd(
+		int fd);
+
+private:
+	std::vector<std::unique_ptr<IOCore>> myCores;
+	std::vector<std::thread> myThreads;
+	std::atomic_uint32_t myNext;
+	// -1 when the threads are not pinned.
+	int myFirstCpu;
 };
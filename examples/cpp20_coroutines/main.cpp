@@ -1,29 +1,44 @@
+#include "iobus.h"
 #include "iocoro.h"
 
+#include <algorithm>
 #include <cassert>
 #include <condition_variable>
 #include <cstring>
 #include <ctime>
 #include <fcntl.h>
 #include <iostream>
+#include <mutex>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <thread>
 #include <unistd.h>
+#include <vector>
 
-static constexpr uint64_t theRequestTargetCount = 50;
+static constexpr uint64_t theRequestTargetCount = 1000;
 static constexpr int theClientCount = 100;
+static constexpr uint32_t theMaxCoreCount = 8;
 
 static uint64_t
 getUsec();
 
-static void
-ioCoreRunF(
-	IOCore &core);
+static const char *
+backendName(
+	IOCoreBackend backend);
 
 static void
 makeFdNonblock(
 	int fd);
 
+static void
+makeTcpPair(
+	int *socks);
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 class Context
@@ -60,7 +75,7 @@ struct Client
 
 	void
 	connectAndRun(
-		IOCore &core,
+		IOCorePool &pool,
 		uint16_t port);
 
 	void
@@ -90,9 +105,10 @@ struct Server
 		const std::shared_ptr<Context>& ctx);
 	~Server();
 
+	// Accepts in the first core and spreads the peers over all of them.
 	uint16_t
 	bindAndListenAndRun(
-		IOCore &core);
+		IOCorePool &pool);
 
 	void
 	stop();
@@ -102,51 +118,772 @@ private:
 	coroRun();
 
 	IOTask *myTask;
+	IOCorePool *myPool;
 	const std::shared_ptr<Context> myContext;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
 static int
-run()
+run(
+	uint32_t coreCount,
+	IOCoreBackend backend)
 {
 	std::shared_ptr<Context> context = std::make_shared<Context>();
 
-	IOCore serverCore;
-	std::cout << "start server" << std::endl;
+	uint64_t frameAllocCount = IOFramePool::allocCount();
+	uint64_t frameHitCount = IOFramePool::hitCount();
+
+	IOCorePool serverPool(coreCount, backend);
 	Server server(context);
-	uint16_t port = server.bindAndListenAndRun(serverCore);
-	std::thread serverThread(ioCoreRunF, std::ref(serverCore));
+	uint16_t port = server.bindAndListenAndRun(serverPool);
+	serverPool.start();
 
-	std::cout << "start clients" << std::endl;
-	IOCore clientCore;
+	IOCorePool clientPool(coreCount, backend);
 	for (int i = 0; i < theClientCount; ++i)
-		(new Client(context))->connectAndRun(clientCore, port);
+		(new Client(context))->connectAndRun(clientPool, port);
 
-	std::cout << "wait for the load to pass" << std::endl;
 	uint64_t t1 = getUsec();
-	std::thread clientThread(ioCoreRunF, std::ref(clientCore));
+	clientPool.start();
 	context->waitClientsFinish();
-	clientCore.stop();
-	clientThread.join();
+	clientPool.stop();
 	uint64_t t2 = getUsec();
-	std::cout << "Took " << (t2 - t1) / 1000.0 << " ms" << std::endl;
+	uint64_t requestCount = theClientCount * theRequestTargetCount;
+	std::cout << backendName(backend) << ", " << coreCount << " cores: took " <<
+		(t2 - t1) / 1000.0 << " ms, " << (uint64_t)(requestCount * 1'000'000.0 /
+		(t2 - t1)) << " requests/s" << std::endl;
 
-	std::cout << "wait for the server to stop" << std::endl;
 	server.stop();
 	context->waitServerFinish();
-	serverCore.stop();
-	serverThread.join();
+	serverPool.stop();
+	// The pools' threads have flushed their counters on exit, the main thread has to do
+	// it explicitly.
+	IOFramePool::flushStats();
+	frameAllocCount = IOFramePool::allocCount() - frameAllocCount;
+	frameHitCount = IOFramePool::hitCount() - frameHitCount;
+	std::cout << "    " << frameAllocCount << " coroutine frames, " <<
+		frameHitCount * 100 / frameAllocCount << "% from the pool" << std::endl;
 	return 0;
 }
 
+// Short coroutines one after another, like a request handler per request. All but the
+// first frame are taken from the pool.
+static void
+runSpawns()
+{
+	constexpr uint64_t count = 1'000'000;
+	// The frames of the earlier runs, created in this thread, aren't counted.
+	IOFramePool::flushStats();
+	uint64_t frameAllocCount = IOFramePool::allocCount();
+	uint64_t frameHitCount = IOFramePool::hitCount();
+	uint64_t sum = 0;
+	uint64_t t1 = getUsec();
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		[](uint64_t *sum, uint64_t i) -> IOCoroutine {
+			*sum += i;
+			co_return;
+		}(&sum, i);
+	}
+	uint64_t t2 = getUsec();
+	assert(sum == count * (count - 1) / 2);
+	IOFramePool::flushStats();
+	frameAllocCount = IOFramePool::allocCount() - frameAllocCount;
+	frameHitCount = IOFramePool::hitCount() - frameHitCount;
+	std::cout << count << " coroutine spawns: " << (t2 - t1) * 1000.0 / count <<
+		" ns each, " << frameHitCount * 100 / frameAllocCount << "% from the pool" <<
+		std::endl;
+}
+
+// An idle connection gets a timeout, and a live one gets its data in time.
+static void
+runTimeouts(
+	IOCoreBackend backend)
+{
+	IOCore core(backend);
+	int socks[2];
+	int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, socks);
+	assert(rc == 0);
+	makeFdNonblock(socks[0]);
+	makeFdNonblock(socks[1]);
+	IOTask *task = core.subscribe(socks[0]);
+	bool isDone = false;
+	[](IOCore *core, IOTask *task, int peer, bool *isDone) -> IOCoroutine {
+		co_await core->asyncPost();
+		uint64_t t1 = getUsec();
+		co_await core->sleep(std::chrono::milliseconds(20));
+		uint64_t t2 = getUsec();
+		assert(t2 - t1 >= 19'000);
+		char data;
+		ssize_t rc = co_await withTimeout(task->asyncRecv(&data, 1),
+			std::chrono::milliseconds(50));
+		uint64_t t3 = getUsec();
+		assert(rc == -1 && errno == ETIMEDOUT);
+		assert(t3 - t2 >= 49'000);
+		// The cancelled receipt must not get anything, the next one gets all.
+		rc = send(peer, "x", 1, 0);
+		assert(rc == 1);
+		rc = co_await withTimeout(task->asyncRecv(&data, 1),
+			std::chrono::milliseconds(1000));
+		assert(rc == 1 && data == 'x');
+		std::cout << backendName(core->backend()) << ": slept " << (t2 - t1) / 1000.0 <<
+			" ms, idle receipt timed out after " << (t3 - t2) / 1000.0 << " ms" <<
+			std::endl;
+		*isDone = true;
+		co_return;
+	}(&core, task, socks[1], &isDone);
+	while (!isDone)
+		core.roll();
+	task->close();
+	rc = close(socks[1]);
+	assert(rc == 0);
+}
+
+// A ping-pong of one byte over TCP between two cores, each in its own thread pinned to
+// its own CPU. The round trips are measured one by one. With the spin budget the cores
+// poll the kernel for a while before sleeping, so a reply arriving within the budget
+// doesn't have to wake up a sleeping thread.
+static void
+runLatency(
+	IOCoreBackend backend,
+	std::chrono::microseconds spinBudget)
+{
+	static constexpr uint32_t count = 20'000;
+	// On a shared CPU the spinning cores would only take the time from each other.
+	if (spinBudget.count() != 0 && std::thread::hardware_concurrency() < 2)
+	{
+		std::cout << backendName(backend) << ", spin: skipped, needs 2 CPUs" <<
+			std::endl;
+		return;
+	}
+	IOCorePool pool(2, backend);
+	pool.setSpinBudget(spinBudget);
+	pool.pinThreads(0);
+	int socks[2];
+	makeTcpPair(socks);
+	int one = 1;
+	int rc = setsockopt(socks[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	assert(rc == 0);
+	rc = setsockopt(socks[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	assert(rc == 0);
+	IOTask *task = pool.core(0).subscribe(socks[0]);
+	IOTask *echo = pool.core(1).subscribe(socks[1]);
+	std::vector<uint64_t> rtts;
+	rtts.reserve(count);
+	[](IOCore *core, IOTask *task, std::vector<uint64_t> *rtts) -> IOCoroutine {
+		co_await core->asyncPost();
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			char data = (char)i;
+			uint64_t t1 = getUsec();
+			ssize_t rc = co_await task->asyncSend(&data, 1);
+			assert(rc == 1);
+			rc = co_await task->asyncRecv(&data, 1);
+			assert(rc == 1 && data == (char)i);
+			rtts->push_back(getUsec() - t1);
+		}
+		task->close();
+		co_return;
+	}(&pool.core(0), task, &rtts);
+	[](IOCore *core, IOTask *echo) -> IOCoroutine {
+		co_await core->asyncPost();
+		char data;
+		while (co_await echo->asyncRecv(&data, 1) == 1)
+		{
+			ssize_t rc = co_await echo->asyncSend(&data, 1);
+			assert(rc == 1);
+		}
+		echo->close();
+		co_return;
+	}(&pool.core(1), echo);
+	pool.start();
+	IOCoroutinePromise::waitAllDone();
+	pool.stop();
+	assert(rtts.size() == count);
+	std::sort(rtts.begin(), rtts.end());
+	std::cout << backendName(backend) << ", " << (spinBudget.count() == 0 ?
+		std::string("blocking") : "spin " + std::to_string(spinBudget.count()) +
+		" us") << ": round trip p50 " << rtts[count / 2] << " us, p99 " <<
+		rtts[count * 99 / 100] << " us, p99.9 " << rtts[count * 999 / 1000] <<
+		" us, max " << rtts.back() << " us" << std::endl;
+}
+
+// One coroutine streams the data into a socket while another one reads the echo from the
+// same socket. The data is far bigger than the socket buffers, so the writer blocks
+// until the reader makes space, both waiting on the one task at the same time.
+static void
+runDuplex(
+	IOCoreBackend backend)
+{
+	static constexpr size_t total = 4 * 1024 * 1024;
+	static constexpr size_t chunk = 64 * 1024;
+	IOCore core(backend);
+	// The receipts of the echo go into the registered memory, when supported.
+	std::vector<char> recvBuf(chunk);
+	core.registerBuffer(recvBuf.data(), recvBuf.size());
+	int socks[2];
+	int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, socks);
+	assert(rc == 0);
+	makeFdNonblock(socks[0]);
+	makeFdNonblock(socks[1]);
+	IOTask *task = core.subscribe(socks[0]);
+	IOTask *echo = core.subscribe(socks[1]);
+	int doneCount = 0;
+	uint64_t t1 = getUsec();
+	[](IOTask *task, int *doneCount) -> IOCoroutine {
+		std::vector<char> data(chunk);
+		for (size_t sent = 0; sent < total;)
+		{
+			for (size_t i = 0; i < chunk; ++i)
+				data[i] = (char)(sent + i);
+			size_t size = std::min(chunk, total - sent);
+			size_t offset = 0;
+			while (offset < size)
+			{
+				ssize_t rc = co_await task->asyncSend(data.data() + offset,
+					size - offset);
+				assert(rc > 0);
+				offset += rc;
+			}
+			sent += size;
+		}
+		++*doneCount;
+		co_return;
+	}(task, &doneCount);
+	[](IOTask *task, char *data, int *doneCount) -> IOCoroutine {
+		size_t received = 0;
+		while (received < total)
+		{
+			ssize_t rc = co_await task->asyncRecv(data, chunk);
+			assert(rc > 0);
+			for (ssize_t i = 0; i < rc; ++i)
+				assert(data[i] == (char)(received + i));
+			received += rc;
+		}
+		++*doneCount;
+		co_return;
+	}(task, recvBuf.data(), &doneCount);
+	[](IOTask *echo, int *doneCount) -> IOCoroutine {
+		std::vector<char> data(chunk);
+		size_t received = 0;
+		while (received < total)
+		{
+			ssize_t rc = co_await echo->asyncRecv(data.data(), chunk);
+			assert(rc > 0);
+			received += rc;
+			size_t offset = 0;
+			while (offset < (size_t)rc)
+			{
+				ssize_t rc2 = co_await echo->asyncSend(data.data() + offset,
+					rc - offset);
+				assert(rc2 > 0);
+				offset += rc2;
+			}
+		}
+		++*doneCount;
+		co_return;
+	}(echo, &doneCount);
+	while (doneCount != 3)
+		core.roll();
+	uint64_t t2 = getUsec();
+	std::cout << backendName(core.backend()) << ": full-duplex echo of " <<
+		total / 1024 / 1024 << " MB: " << total * 1'000'000.0 / (t2 - t1) / 1024 / 1024 <<
+		" MB/s" << std::endl;
+	task->close();
+	echo->close();
+}
+
+// The same payload sent by the plain sends, the vectored ones, sendfile from a file with
+// the same data, and the zero-copy sends. The receiver checks the data and measures each
+// part.
+static void
+runSends(
+	IOCoreBackend backend)
+{
+	static constexpr size_t total = 16 * 1024 * 1024;
+	static constexpr size_t chunk = 256 * 1024;
+	static constexpr int vecCount = 4;
+	static constexpr int methodCount = 4;
+	IOCore core(backend);
+	int socks[2];
+	makeTcpPair(socks);
+	IOTask *out = core.subscribe(socks[0]);
+	IOTask *in = core.subscribe(socks[1]);
+	std::vector<char> data(total);
+	for (size_t i = 0; i < total; ++i)
+		data[i] = (char)i;
+	int file = memfd_create("iocoro", 0);
+	assert(file >= 0);
+	ssize_t rc = write(file, data.data(), total);
+	assert(rc == (ssize_t)total);
+	uint64_t times[methodCount + 1];
+	bool isDone = false;
+	times[0] = getUsec();
+	[](IOTask *in, uint64_t *times, bool *isDone) -> IOCoroutine {
+		std::vector<char> buf(chunk);
+		size_t received = 0;
+		while (received < total * methodCount)
+		{
+			// Each part is measured up to its last byte.
+			size_t size = std::min(chunk, total - received % total);
+			ssize_t rc = co_await in->asyncRecv(buf.data(), size);
+			assert(rc > 0);
+			for (ssize_t i = 0; i < rc; ++i)
+				assert(buf[i] == (char)(received + i));
+			received += rc;
+			if (received % total == 0)
+				times[received / total] = getUsec();
+		}
+		*isDone = true;
+		co_return;
+	}(in, times, &isDone);
+	[](IOTask *out, const char *data, int file) -> IOCoroutine {
+		for (size_t sent = 0; sent < total;)
+		{
+			ssize_t rc = co_await out->asyncSend(data + sent,
+				std::min(chunk, total - sent));
+			assert(rc > 0);
+			sent += rc;
+		}
+		for (size_t sent = 0; sent < total;)
+		{
+			iovec vecs[vecCount];
+			int count = 0;
+			for (size_t pos = sent; count < vecCount && pos < total; ++count)
+			{
+				vecs[count].iov_base = (void *)(data + pos);
+				vecs[count].iov_len = std::min(chunk / vecCount, total - pos);
+				pos += vecs[count].iov_len;
+			}
+			ssize_t rc = co_await out->asyncSendv(vecs, count);
+			assert(rc > 0);
+			sent += rc;
+		}
+		for (size_t sent = 0; sent < total;)
+		{
+			ssize_t rc = co_await out->asyncSendFile(file, sent, total - sent);
+			assert(rc > 0);
+			sent += rc;
+		}
+		for (size_t sent = 0; sent < total;)
+		{
+			ssize_t rc = co_await out->asyncSendZeroCopy(data + sent,
+				std::min(chunk, total - sent));
+			assert(rc > 0);
+			sent += rc;
+		}
+		co_return;
+	}(out, data.data(), file);
+	while (!isDone)
+		core.roll();
+	const char *names[methodCount] = {"send", "sendv", "sendfile", "zero-copy"};
+	std::cout << backendName(core.backend()) << ": " << total / 1024 / 1024 <<
+		" MB by";
+	for (int i = 0; i < methodCount; ++i)
+	{
+		std::cout << (i == 0 ? " " : ", ") << names[i] << " " <<
+			(uint64_t)(total * 1'000'000.0 / (times[i + 1] - times[i]) / 1024 / 1024) <<
+			" MB/s";
+	}
+	std::cout << std::endl;
+	out->close();
+	in->close();
+	rc = close(file);
+	assert(rc == 0);
+}
+
+// Many tasks subscribed and then unsubscribed, again and again, like short connections.
+// Each round also checks the lookups by fd and that the old ids are stale.
+static void
+runChurn(
+	IOCoreBackend backend)
+{
+	static constexpr uint32_t targetCount = 100'000;
+	static constexpr int roundCount = 5;
+	// As many fds as allowed, up to the target.
+	rlimit limit;
+	int rc = getrlimit(RLIMIT_NOFILE, &limit);
+	assert(rc == 0);
+	limit.rlim_cur = limit.rlim_max;
+	rc = setrlimit(RLIMIT_NOFILE, &limit);
+	assert(rc == 0);
+	uint32_t count = std::min<uint64_t>(targetCount, limit.rlim_cur - 100);
+	IOCore core(backend);
+	std::vector<IOTask *> tasks(count);
+	std::vector<IOTaskId> ids(count);
+	uint64_t duration = 0;
+	for (int round = 0; round < roundCount; ++round)
+	{
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			int fd = eventfd(0, EFD_NONBLOCK);
+			assert(fd >= 0);
+			tasks[i] = core.subscribe(fd);
+		}
+		uint64_t t1 = getUsec();
+		core.roll();
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			IOTask *task = tasks[i];
+			assert(core.find(ids[i]) == nullptr);
+			ids[i] = task->id();
+			assert(core.find(ids[i]) == task);
+			assert(core.find(ids[i].myFd) == task);
+			task->close();
+		}
+		core.roll();
+		duration += getUsec() - t1;
+		for (uint32_t i = 0; i < count; ++i)
+			assert(core.find(ids[i]) == nullptr);
+	}
+	std::cout << backendName(core.backend()) << ": churn of " << count << " tasks: " <<
+		duration * 1000.0 / count / roundCount << " ns per subscribe and unsubscribe" <<
+		std::endl;
+}
+
+// The parents await their children. A long line of the children completing right away
+// doesn't grow the stack. Then the children run concurrently, and pass the data via a
+// channel.
+static void
+runStructured(
+	IOCoreBackend backend)
+{
+	static constexpr uint64_t chainCount = 1'000'000;
+	static constexpr uint64_t itemCount = 100'000;
+	IOCore core(backend);
+	bool isDone = false;
+	// The lazy coroutine is started by a plain one, which owns it.
+	[](IOLazy<void> body) -> IOCoroutine {
+		co_await body;
+	}([](IOCore *core, bool *isDone) -> IOLazy<void> {
+		co_await core->asyncPost();
+		// Sequential.
+		uint64_t t1 = getUsec();
+		uint64_t sum = 0;
+		for (uint64_t i = 0; i < chainCount; ++i)
+		{
+			sum += co_await [](uint64_t i) -> IOLazy<uint64_t> {
+				co_return i;
+			}(i);
+		}
+		uint64_t t2 = getUsec();
+		assert(sum == chainCount * (chainCount - 1) / 2);
+		// Concurrent, all done in the time of the longest.
+		auto sleeper = [](IOCore *core, uint32_t ms) -> IOLazy<uint32_t> {
+			co_await core->sleep(std::chrono::milliseconds(ms));
+			co_return ms;
+		};
+		std::vector<IOLazy<uint32_t>> tasks;
+		for (uint32_t ms : {10, 20, 30})
+			tasks.push_back(sleeper(core, ms));
+		uint64_t t3 = getUsec();
+		std::vector<uint32_t> res = co_await whenAll(std::move(tasks));
+		uint64_t t4 = getUsec();
+		assert((res == std::vector<uint32_t>{10, 20, 30}));
+		assert(t4 - t3 >= 29'000);
+		// The first one done wins, the other one still finishes later.
+		tasks.clear();
+		tasks.push_back(sleeper(core, 50));
+		tasks.push_back(sleeper(core, 10));
+		std::pair<size_t, uint32_t> first = co_await whenAny(std::move(tasks));
+		uint64_t t5 = getUsec();
+		assert(first.first == 1 && first.second == 10);
+		assert(t5 - t4 < 50'000);
+		// Ping-pong via a bounded channel. The producer waits when it is full.
+		IOChannel<uint64_t> channel(16);
+		std::vector<IOLazy<void>> sides;
+		sides.push_back([](IOChannel<uint64_t> *channel) -> IOLazy<void> {
+			for (uint64_t i = 0; i < itemCount; ++i)
+			{
+				bool ok = co_await channel->send(i);
+				assert(ok);
+			}
+			channel->close();
+		}(&channel));
+		sides.push_back([](IOChannel<uint64_t> *channel) -> IOLazy<void> {
+			uint64_t next = 0;
+			while (std::optional<uint64_t> item = co_await channel->recv())
+				assert(*item == next++);
+			assert(next == itemCount);
+		}(&channel));
+		co_await whenAll(std::move(sides));
+		uint64_t t6 = getUsec();
+		std::cout << backendName(core->backend()) << ": " << chainCount <<
+			" awaited children: " << (t2 - t1) * 1000.0 / chainCount << " ns each, " <<
+			"whenAll of 10-30 ms: " << (t4 - t3) / 1000.0 << " ms, whenAny of 10 and " <<
+			"50 ms: " << (t5 - t4) / 1000.0 << " ms, channel: " <<
+			(t6 - t5) * 1000.0 / itemCount << " ns per item" << std::endl;
+		*isDone = true;
+	}(&core, &isDone));
+	while (!isDone)
+		core.roll();
+	// The whenAny() loser is still sleeping.
+	uint64_t t1 = getUsec();
+	while (IOCoroutinePromise::theCount.load(std::memory_order_relaxed) != 0)
+		core.roll();
+	assert(getUsec() - t1 < 50'000);
+}
+
+// The channels of a bus: one message at a time, batches, and broadcasts. A waiter is
+// resumed by its core, also when the other side is in another core's thread.
+static void
+runBus(
+	IOCoreBackend backend)
+{
+	static constexpr uint64_t itemCount = 100'000;
+	static constexpr uint32_t subscriberCount = 3;
+	IOCore core(backend);
+	bool isDone = false;
+	[](IOLazy<void> body) -> IOCoroutine {
+		co_await body;
+	}([](IOCore *core, bool *isDone) -> IOLazy<void> {
+		co_await core->asyncPost();
+		IOBus<uint64_t> bus;
+		// One by one. The producer waits when the channel is full.
+		uint64_t t1 = getUsec();
+		{
+			IOBusChannel<uint64_t> channel(bus, 16);
+			std::vector<IOLazy<void>> sides;
+			sides.push_back([](IOBusChannel<uint64_t> *channel) -> IOLazy<void> {
+				for (uint64_t i = 0; i < itemCount; ++i)
+				{
+					bool ok = co_await channel->send(i);
+					assert(ok);
+				}
+				channel->close();
+			}(&channel));
+			sides.push_back([](IOBusChannel<uint64_t> *channel) -> IOLazy<void> {
+				uint64_t next = 0;
+				while (std::optional<uint64_t> item = co_await channel->recv())
+					assert(*item == next++);
+				assert(next == itemCount);
+				bool ok = co_await channel->send(0);
+				assert(!ok);
+			}(&channel));
+			co_await whenAll(std::move(sides));
+		}
+		// In batches of different sizes, each takes what fits.
+		uint64_t t2 = getUsec();
+		{
+			IOBusChannel<uint64_t> channel(bus, 100);
+			std::vector<IOLazy<void>> sides;
+			sides.push_back([](IOBusChannel<uint64_t> *channel) -> IOLazy<void> {
+				uint64_t batch[64];
+				for (uint64_t i = 0; i < itemCount;)
+				{
+					size_t count = std::min<uint64_t>(64, itemCount - i);
+					for (size_t j = 0; j < count; ++j)
+						batch[j] = i + j;
+					size_t sent = co_await channel->sendv(std::span(batch, count));
+					assert(sent > 0);
+					i += sent;
+				}
+				channel->close();
+			}(&channel));
+			sides.push_back([](IOBusChannel<uint64_t> *channel) -> IOLazy<void> {
+				uint64_t batch[48];
+				uint64_t next = 0;
+				while (size_t count = co_await channel->recvv(std::span(batch)))
+				{
+					for (size_t j = 0; j < count; ++j)
+						assert(batch[j] == next++);
+				}
+				assert(next == itemCount);
+			}(&channel));
+			co_await whenAll(std::move(sides));
+		}
+		// Each subscriber gets all the broadcasts in order, and the broadcaster waits
+		// for the slowest one.
+		uint64_t t3 = getUsec();
+		{
+			std::vector<std::unique_ptr<IOBusChannel<uint64_t>>> channels;
+			std::vector<IOLazy<void>> sides;
+			for (uint32_t i = 0; i < subscriberCount; ++i)
+			{
+				channels.push_back(std::make_unique<IOBusChannel<uint64_t>>(bus,
+					i == 0 ? 0 : 4 * i));
+				sides.push_back([](IOBusChannel<uint64_t> *channel) -> IOLazy<void> {
+					uint64_t next = 0;
+					while (std::optional<uint64_t> item = co_await channel->recv())
+						assert(*item == next++);
+					assert(next == itemCount);
+				}(channels.back().get()));
+			}
+			sides.push_back([](IOBus<uint64_t> *bus,
+				std::vector<std::unique_ptr<IOBusChannel<uint64_t>>> *channels)
+				-> IOLazy<void> {
+				for (uint64_t i = 0; i < itemCount; ++i)
+				{
+					bool ok = co_await bus->broadcast(i);
+					assert(ok);
+				}
+				for (std::unique_ptr<IOBusChannel<uint64_t>> &channel : *channels)
+					channel->close();
+				bool ok = co_await bus->broadcast(0);
+				assert(!ok);
+			}(&bus, &channels));
+			co_await whenAll(std::move(sides));
+		}
+		uint64_t t4 = getUsec();
+		std::cout << backendName(core->backend()) << ": bus channel: " <<
+			(t2 - t1) * 1000.0 / itemCount << " ns per message, in batches: " <<
+			(t3 - t2) * 1000.0 / itemCount << " ns, broadcast to " << subscriberCount <<
+			": " << (t4 - t3) * 1000.0 / itemCount << " ns" << std::endl;
+		// Here the coroutine was resumed by a post, before the roll's poll. Which then
+		// would wait forever, nothing else is left to wake it up. A timer ends the roll.
+		co_await core->sleep(std::chrono::milliseconds(1));
+		*isDone = true;
+	}(&core, &isDone));
+	while (!isDone)
+		core.roll();
+
+	// The sides are in different threads.
+	IOCorePool pool(2, backend);
+	IOBus<uint64_t> bus;
+	IOBusChannel<uint64_t> channel(bus, 16);
+	std::atomic_bool isReceived{false};
+	[](IOCore *core, IOBusChannel<uint64_t> *channel) -> IOCoroutine {
+		co_await core->asyncPost();
+		for (uint64_t i = 0; i < itemCount; ++i)
+		{
+			bool ok = co_await channel->send(i);
+			assert(ok);
+		}
+		channel->close();
+	}(&pool.core(0), &channel);
+	[](IOCore *core, IOBusChannel<uint64_t> *channel,
+		std::atomic_bool *isReceived) -> IOCoroutine {
+		co_await core->asyncPost();
+		uint64_t next = 0;
+		while (std::optional<uint64_t> item = co_await channel->recv())
+			assert(*item == next++);
+		assert(next == itemCount);
+		isReceived->store(true);
+	}(&pool.core(1), &channel, &isReceived);
+	uint64_t t1 = getUsec();
+	pool.start();
+	while (!isReceived.load())
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	uint64_t t2 = getUsec();
+	pool.stop();
+	std::cout << backendName(backend) << ": bus channel between 2 cores: " <<
+		(t2 - t1) * 1000.0 / itemCount << " ns per message" << std::endl;
+}
+
+// Many coroutines parked in the receipts, the accepts and the sleeps, and then the pool
+// is drained. All are woken up with ECANCELED and finish, without the pool waiting for
+// any deadlines.
+static void
+runDrain(
+	IOCoreBackend backend)
+{
+	static constexpr uint32_t sleeperCount = 100'000;
+	rlimit limit;
+	int rc = getrlimit(RLIMIT_NOFILE, &limit);
+	assert(rc == 0);
+	uint32_t pairCount = std::min<uint64_t>(5'000, (limit.rlim_cur - 100) / 2);
+	IOCorePool pool(2, backend);
+	std::atomic_uint32_t parkedCount{0};
+	std::atomic_uint32_t cancelledCount{0};
+	auto reader = [](IOCore *core, IOTask *task, std::atomic_uint32_t *parkedCount,
+		std::atomic_uint32_t *cancelledCount) -> IOCoroutine {
+		co_await core->asyncPost();
+		char data;
+		parkedCount->fetch_add(1);
+		ssize_t rc = co_await withTimeout(task->asyncRecv(&data, 1),
+			std::chrono::hours(1));
+		assert(rc == -1 && errno == ECANCELED);
+		task->close();
+		cancelledCount->fetch_add(1);
+	};
+	for (uint32_t i = 0; i < pairCount; ++i)
+	{
+		int socks[2];
+		rc = socketpair(AF_UNIX, SOCK_STREAM, 0, socks);
+		assert(rc == 0);
+		for (int sock : socks)
+		{
+			makeFdNonblock(sock);
+			IOCore &core = pool.nextCore();
+			reader(&core, core.subscribe(sock), &parkedCount, &cancelledCount);
+		}
+	}
+	int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	assert(listener >= 0);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	rc = bind(listener, (sockaddr *)&addr, sizeof(addr));
+	assert(rc == 0);
+	rc = listen(listener, 128);
+	assert(rc == 0);
+	IOCore &acceptCore = pool.nextCore();
+	[](IOCore *core, IOTask *task, std::atomic_uint32_t *parkedCount,
+		std::atomic_uint32_t *cancelledCount) -> IOCoroutine {
+		co_await core->asyncPost();
+		parkedCount->fetch_add(1);
+		int rc = co_await task->asyncAccept(nullptr, nullptr);
+		assert(rc == -1 && errno == ECANCELED);
+		task->close();
+		cancelledCount->fetch_add(1);
+	}(&acceptCore, acceptCore.subscribe(listener), &parkedCount, &cancelledCount);
+	for (uint32_t i = 0; i < sleeperCount; ++i)
+	{
+		[](IOCore *core, std::atomic_uint32_t *parkedCount,
+			std::atomic_uint32_t *cancelledCount) -> IOCoroutine {
+			co_await core->asyncPost();
+			parkedCount->fetch_add(1);
+			co_await core->sleep(std::chrono::hours(1));
+			assert(core->isDraining());
+			cancelledCount->fetch_add(1);
+		}(&pool.nextCore(), &parkedCount, &cancelledCount);
+	}
+	uint32_t total = pairCount * 2 + 1 + sleeperCount;
+	pool.start();
+	while (parkedCount.load() != total)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	uint64_t t1 = getUsec();
+	pool.drain();
+	uint64_t t2 = getUsec();
+	assert(cancelledCount.load() == total);
+	assert(IOCoroutinePromise::theCount.load(std::memory_order_relaxed) == 0);
+	std::cout << backendName(pool.core(0).backend()) << ": drain of " << total <<
+		" coroutines: " << (t2 - t1) / 1000.0 << " ms" << std::endl;
+}
+
 int main()
 {
-	int rc = run();
+	IOCoreBackend backends[] = {IO_CORE_BACKEND_EPOLL, IO_CORE_BACKEND_URING};
+	for (IOCoreBackend backend : backends)
+	{
+		runDuplex(backend);
+		runSends(backend);
+		runTimeouts(backend);
+		runChurn(backend);
+		runStructured(backend);
+		runBus(backend);
+		runDrain(backend);
+		runLatency(backend, std::chrono::microseconds(0));
+		runLatency(backend, std::chrono::microseconds(100));
+	}
+	runSpawns();
+	// The same echo load, the server and the clients each on the given count of cores.
+	std::cout << theClientCount << " clients, " << theRequestTargetCount <<
+		" requests each" << std::endl;
+	for (IOCoreBackend backend : backends)
+	{
+		for (uint32_t coreCount = 1; coreCount <= theMaxCoreCount; coreCount *= 2)
+		{
+			int rc = run(coreCount, backend);
+			if (rc != 0)
+				return rc;
+		}
+	}
 	assert(Client::theCount.load(std::memory_order_relaxed) == 0);
 	assert(IOCoroutinePromise::theCount.load(std::memory_order_relaxed) == 0);
 	assert(IOTask::theCount.load(std::memory_order_relaxed) == 0);
-	return rc;
+	return 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -159,11 +896,11 @@ getUsec()
 	return t.tv_sec * 1'000'000 + t.tv_nsec / 1000;
 }
 
-static void
-ioCoreRunF(IOCore &core)
+static const char *
+backendName(
+	IOCoreBackend backend)
 {
-	while (!core.isStopped())
-		core.roll();
+	return backend == IO_CORE_BACKEND_URING ? "io_uring" : "epoll";
 }
 
 static void
@@ -176,6 +913,35 @@ makeFdNonblock(
 	assert(rc == 0);
 }
 
+static void
+makeTcpPair(
+	int *socks)
+{
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	assert(listener >= 0);
+	int rc = bind(listener, (sockaddr *)&addr, len);
+	assert(rc == 0);
+	rc = listen(listener, 1);
+	assert(rc == 0);
+	rc = getsockname(listener, (sockaddr *)&addr, &len);
+	assert(rc == 0);
+	socks[0] = socket(AF_INET, SOCK_STREAM, 0);
+	assert(socks[0] >= 0);
+	rc = connect(socks[0], (sockaddr *)&addr, len);
+	assert(rc == 0);
+	socks[1] = accept(listener, nullptr, nullptr);
+	assert(socks[1] >= 0);
+	rc = close(listener);
+	assert(rc == 0);
+	makeFdNonblock(socks[0]);
+	makeFdNonblock(socks[1]);
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 void
@@ -235,7 +1001,7 @@ Client::~Client()
 
 void
 Client::connectAndRun(
-	IOCore &core,
+	IOCorePool &pool,
 	uint16_t port)
 {
 	LOG_THIS_DEBUG(Client, connect, "");
@@ -243,7 +1009,7 @@ Client::connectAndRun(
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
 	assert(sock >= 0);
 	makeFdNonblock(sock);
-	myTask = core.subscribe(sock);
+	myTask = pool.coreByFd(sock).subscribe(sock);
 
 	// Lambda capture won't work with a coroutine. The coro also captures things but only
 	// the arguments. It can't capture the lambda's captures alongside. This leads to the
@@ -252,6 +1018,8 @@ Client::connectAndRun(
 	// the lambda object is destroyed, and that would lead to use-after-free.
 	[](Client* self, uint16_t port) -> IOCoroutine {
 		LOG_OBJ_DEBUG(Client, self, coroConnectAndRun, "");
+		// The task can only be used in its core's thread.
+		co_await self->myTask->core().asyncPost();
 		sockaddr_in addr;
 		memset(&addr, 0, sizeof(addr));
 		addr.sin_family = AF_INET;
@@ -282,6 +1050,8 @@ IOCoroutine
 Client::coroRun()
 {
 	LOG_THIS_DEBUG(Client, coroRun, "");
+	// The server's peers are created in the accepting core, not always their own.
+	co_await myTask->core().asyncPost();
 	for (uint32_t i = 0; i < theRequestTargetCount; ++i)
 	{
 		uint8_t data;
@@ -305,6 +1075,7 @@ Client::coroRun()
 Server::Server(
 	const std::shared_ptr<Context>& ctx)
 	: myTask(nullptr)
+	, myPool(nullptr)
 	, myContext(ctx)
 {
 }
@@ -316,7 +1087,7 @@ Server::~Server()
 
 uint16_t
 Server::bindAndListenAndRun(
-	IOCore &core)
+	IOCorePool &pool)
 {
 	sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
@@ -334,7 +1105,8 @@ Server::bindAndListenAndRun(
 	rc = listen(sock, SOMAXCONN);
 	assert(rc == 0);
 	makeFdNonblock(sock);
-	myTask = core.subscribe(sock);
+	myPool = &pool;
+	myTask = pool.core(0).subscribe(sock);
 	LOG_THIS_DEBUG(Server, bindAndListen, myTask);
 
 	rc = getsockname(sock, (sockaddr *)&addr, &len);
@@ -356,6 +1128,7 @@ IOCoroutine
 Server::coroRun()
 {
 	IOTask *task = myTask;
+	co_await task->core().asyncPost();
 	while (true)
 	{
 		LOG_THIS_DEBUG(Server, coroRun, "accept start");
@@ -366,7 +1139,7 @@ Server::coroRun()
 		if (sock < 0)
 			break;
 		LOG_THIS_DEBUG(Server, coroRun, "new client, " << sock);
-		(new Client(myContext))->wrapAndRun(task->core(), sock);
+		(new Client(myContext))->wrapAndRun(myPool->nextCore(), sock);
 	}
 	myContext->onServerFinish();
 	co_return;
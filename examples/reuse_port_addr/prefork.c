@@ -0,0 +1,342 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <assert.h>
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <linux/filter.h>
+
+/*
+ * Prefork server. The master process creates one listening socket per
+ * worker, all on the same port with SO_REUSEPORT, and forks a worker
+ * per socket. The kernel spreads the new connections between the
+ * sockets, and each worker serves the ones of its socket: echoes all
+ * what it gets, with epoll.
+ *
+ * The sockets belong to the master, the workers only inherit them.
+ * So a worker can be replaced without losing anything: a new one is
+ * started on the same socket, then the old one stops accepting,
+ * serves its connections till they are closed, and exits. The
+ * connections waiting in the queue of the socket are never dropped,
+ * which would be the case if each worker had its own socket and
+ * closed it on exit.
+ *
+ * With 'steer' a classic BPF program is attached to the socket group.
+ * It returns the index of the socket for the CPU, which has received
+ * the connection, and the workers are pinned to their CPUs. Then a
+ * connection is handled on the same CPU where its packets come. The
+ * index of a socket in the group is the order of its bind(). The
+ * sockets are never closed while the server works, so the indexes
+ * never change.
+ *
+ * $> ./prefork [worker count] [steer]
+ * $> kill -HUP <master pid>   # Replace all the workers one by one.
+ * A crashed worker is restarted. SIGINT or SIGTERM stop the server.
+ */
+
+enum {
+	MAX_WORKERS = 64,
+	EVENT_BATCH = 128,
+	BUF_SIZE = 4096,
+};
+
+struct slot {
+	int sock;
+	int cpu;
+	/* The serving worker. */
+	pid_t pid;
+	/* The replaced one, finishing its connections, or 0. */
+	pid_t old_pid;
+};
+
+static struct slot slots[MAX_WORKERS];
+static int slot_count;
+static volatile sig_atomic_t is_stopped;
+
+static int
+create_server(void)
+{
+	struct sockaddr_in in;
+	memset(&in, 0, sizeof(in));
+	in.sin_family = AF_INET;
+	inet_aton("127.0.0.1", &in.sin_addr);
+	in.sin_port = htons(3333);
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	assert(s >= 0);
+	int rc, value = 1;
+	rc = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(int));
+	assert(rc == 0);
+	rc = setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(int));
+	assert(rc == 0);
+	if (bind(s, (struct sockaddr *) &in, sizeof(in)) != 0) {
+		printf("bind error: %s\n", strerror(errno));
+		close(s);
+		return -1;
+	}
+	if (listen(s, SOMAXCONN) < 0) {
+		printf("listen error: %s\n", strerror(errno));
+		close(s);
+		return -1;
+	}
+	/* Shared by the old and the new worker, both can accept. */
+	rc = fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	assert(rc == 0);
+	return s;
+}
+
+/* The socket of the group to take a new connection: cpu % count. */
+static int
+attach_steering(int sock, int count)
+{
+	struct sock_filter code[] = {
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+		{BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned)count},
+		{BPF_RET | BPF_A, 0, 0, 0},
+	};
+	struct sock_fprog prog;
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+		       sizeof(prog)) != 0) {
+		printf("steering error: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void
+on_stop(int signo)
+{
+	(void) signo;
+	is_stopped = 1;
+}
+
+static int
+echo(int fd)
+{
+	char buf[BUF_SIZE];
+	while (true) {
+		ssize_t size = recv(fd, buf, sizeof(buf), 0);
+		if (size == 0)
+			return -1;
+		if (size < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		/* The peers are small, a partial send is not handled. */
+		if (send(fd, buf, size, MSG_NOSIGNAL) != size)
+			return -1;
+	}
+}
+
+static void
+worker(struct slot *slot, int idx, const sigset_t *orig_mask)
+{
+	if (slot->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(slot->cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) != 0)
+			printf("worker %d: affinity error: %s\n", idx,
+			       strerror(errno));
+	}
+	/*
+	 * SIGTERM is blocked except inside epoll_pwait(), so it can't
+	 * come between the check of the flag and the wait.
+	 */
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_stop;
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGCHLD, SIG_DFL);
+	sigset_t wait_mask = *orig_mask;
+	sigdelset(&wait_mask, SIGTERM);
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	for (int i = 0; i < slot_count; ++i) {
+		if (&slots[i] != slot)
+			close(slots[i].sock);
+	}
+
+	int ep = epoll_create1(0);
+	assert(ep >= 0);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = slot->sock;
+	int rc = epoll_ctl(ep, EPOLL_CTL_ADD, slot->sock, &ev);
+	assert(rc == 0);
+	printf("worker %d: started, pid %d\n", idx, (int) getpid());
+	int conn_count = 0;
+	bool is_accepting = true;
+	struct epoll_event events[EVENT_BATCH];
+	while (is_accepting || conn_count > 0) {
+		if (is_stopped && is_accepting) {
+			/* The socket stays open in the master and the others. */
+			epoll_ctl(ep, EPOLL_CTL_DEL, slot->sock, NULL);
+			close(slot->sock);
+			is_accepting = false;
+			printf("worker %d: stopped accepting, pid %d, %d "
+			       "connections left\n", idx, (int) getpid(),
+			       conn_count);
+			continue;
+		}
+		int count = epoll_pwait(ep, events, EVENT_BATCH, -1,
+					&wait_mask);
+		if (count < 0) {
+			assert(errno == EINTR);
+			continue;
+		}
+		for (int i = 0; i < count; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == slot->sock && is_accepting) {
+				int c;
+				while ((c = accept4(slot->sock, NULL, NULL,
+						    SOCK_NONBLOCK)) >= 0) {
+					ev.events = EPOLLIN;
+					ev.data.fd = c;
+					rc = epoll_ctl(ep, EPOLL_CTL_ADD, c, &ev);
+					assert(rc == 0);
+					++conn_count;
+					printf("worker %d: accepted on cpu %d\n",
+					       idx, sched_getcpu());
+				}
+				continue;
+			}
+			if (echo(fd) != 0) {
+				close(fd);
+				--conn_count;
+			}
+		}
+	}
+	printf("worker %d: exited, pid %d\n", idx, (int) getpid());
+	exit(0);
+}
+
+static pid_t
+start_worker(int idx, const sigset_t *orig_mask)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		printf("fork error: %s\n", strerror(errno));
+		return -1;
+	}
+	if (pid == 0)
+		worker(&slots[idx], idx, orig_mask);
+	return pid;
+}
+
+static void
+reap_workers(const sigset_t *orig_mask)
+{
+	pid_t pid;
+	int status;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (int i = 0; i < slot_count; ++i) {
+			struct slot *s = &slots[i];
+			if (pid == s->old_pid) {
+				s->old_pid = 0;
+				break;
+			}
+			if (pid != s->pid)
+				continue;
+			printf("master: worker %d died, status %d, restarting\n",
+			       i, status);
+			s->pid = start_worker(i, orig_mask);
+			break;
+		}
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	/* The workers print into the same stdout, line by line. */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	slot_count = argc > 1 ? atoi(argv[1]) : 4;
+	bool is_steered = argc > 2 && strcmp(argv[2], "steer") == 0;
+	int cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (slot_count < 1 || slot_count > MAX_WORKERS) {
+		printf("worker count must be in [1, %d]\n", MAX_WORKERS);
+		return -1;
+	}
+	if (is_steered && slot_count != cpu_count) {
+		printf("steering needs a worker per CPU: %d\n", cpu_count);
+		return -1;
+	}
+	for (int i = 0; i < slot_count; ++i) {
+		struct slot *s = &slots[i];
+		s->sock = create_server();
+		if (s->sock < 0)
+			return -1;
+		s->cpu = is_steered ? i : -1;
+		s->pid = 0;
+		s->old_pid = 0;
+	}
+	if (is_steered && attach_steering(slots[0].sock, slot_count) != 0)
+		return -1;
+	printf("master: pid %d, %d workers%s\n", (int) getpid(), slot_count,
+	       is_steered ? ", steered by CPU" : "");
+
+	sigset_t mask, orig_mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, &orig_mask);
+	for (int i = 0; i < slot_count; ++i)
+		slots[i].pid = start_worker(i, &orig_mask);
+	while (true) {
+		int signo;
+		sigwait(&mask, &signo);
+		if (signo == SIGCHLD) {
+			reap_workers(&orig_mask);
+			continue;
+		}
+		if (signo == SIGHUP) {
+			printf("master: replacing the workers\n");
+			for (int i = 0; i < slot_count; ++i) {
+				struct slot *s = &slots[i];
+				if (s->old_pid != 0) {
+					printf("master: worker %d is still "
+					       "being replaced\n", i);
+					continue;
+				}
+				/* The new one first, the socket is never idle. */
+				pid_t pid = start_worker(i, &orig_mask);
+				if (pid < 0)
+					continue;
+				s->old_pid = s->pid;
+				s->pid = pid;
+				kill(s->old_pid, SIGTERM);
+			}
+			continue;
+		}
+		break;
+	}
+	printf("master: stopping\n");
+	for (int i = 0; i < slot_count; ++i) {
+		if (slots[i].pid > 0)
+			kill(slots[i].pid, SIGTERM);
+		if (slots[i].old_pid > 0)
+			kill(slots[i].old_pid, SIGTERM);
+	}
+	while (wait(NULL) > 0)
+		;
+	for (int i = 0; i < slot_count; ++i)
+		close(slots[i].sock);
+	return 0;
+}
@@ -0,0 +1,186 @@
+#include "ufs_async.h"
+
+#include "thread_pool.h"
+
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * A file of 100 MB is written and read back in requests of 16 MB,
+ * first by the plain calls, then by the async ones on a pool. The
+ * completions are taken from the fd of the context, except a few
+ * requests with the callbacks, and one reading past the file end.
+ */
+
+enum {
+	THREAD_COUNT = 4,
+	FILE_SIZE = 100 * 1024 * 1024,
+	REQUEST_SIZE = 16 * 1024 * 1024,
+	REQUEST_COUNT = (FILE_SIZE + REQUEST_SIZE - 1) / REQUEST_SIZE,
+};
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+check(int is_ok, const char *what)
+{
+	if (!is_ok) {
+		printf("failed: %s\n", what);
+		exit(-1);
+	}
+}
+
+static void
+on_done_f(struct ufs_aio *aio)
+{
+	__atomic_add_fetch((int *)aio->arg, 1, __ATOMIC_RELEASE);
+}
+
+/** Wait for @a count requests completed into the fd of the context. */
+static void
+wait_taken(struct ufs_aio_ctx *ctx, int count)
+{
+	while (count > 0) {
+		struct pollfd pfd = {ufs_aio_fd(ctx), POLLIN, 0};
+		check(poll(&pfd, 1, -1) == 1, "poll");
+		struct ufs_aio *aios[REQUEST_COUNT];
+		int taken = ufs_aio_take(ctx, aios, REQUEST_COUNT);
+		for (int i = 0; i < taken; ++i) {
+			struct ufs_aio *aio = aios[i];
+			size_t expected = FILE_SIZE - aio->offset;
+			if (expected > aio->size)
+				expected = aio->size;
+			check(aio->result == (ssize_t)expected, "async result");
+		}
+		count -= taken;
+	}
+}
+
+static void
+make_requests(struct ufs_aio *aios, int fd, char *buf)
+{
+	for (int i = 0; i < REQUEST_COUNT; ++i) {
+		struct ufs_aio *aio = &aios[i];
+		memset(aio, 0, sizeof(*aio));
+		aio->fd = fd;
+		aio->offset = (size_t)i * REQUEST_SIZE;
+		aio->buf = buf + aio->offset;
+		aio->size = REQUEST_SIZE;
+		if (aio->offset + aio->size > FILE_SIZE)
+			aio->size = FILE_SIZE - aio->offset;
+		/* A few go via the callback. */
+		if (i % 3 == 0)
+			aio->cb = on_done_f;
+	}
+}
+
+static void
+run_async(struct ufs_aio_ctx *ctx, struct ufs_aio *aios, int is_write)
+{
+	int done_count = 0;
+	int cb_count = 0;
+	for (int i = 0; i < REQUEST_COUNT; ++i) {
+		cb_count += aios[i].cb != NULL;
+		aios[i].arg = aios[i].cb != NULL ? &done_count : NULL;
+		if (is_write)
+			ufs_write_async(ctx, &aios[i]);
+		else
+			ufs_read_async(ctx, &aios[i]);
+	}
+	wait_taken(ctx, REQUEST_COUNT - cb_count);
+	while (__atomic_load_n(&done_count, __ATOMIC_ACQUIRE) != cb_count)
+		sched_yield();
+	for (int i = 0; i < REQUEST_COUNT; ++i)
+		check(aios[i].result == (ssize_t)aios[i].size, "callback result");
+}
+
+int
+main(void)
+{
+	struct thread_pool *pool;
+	if (thread_pool_new(THREAD_COUNT, &pool) != 0)
+		return -1;
+	struct ufs_aio_ctx *ctx = ufs_aio_ctx_new(pool, 0);
+	check(ctx != NULL, "context");
+	char *src = malloc(FILE_SIZE);
+	char *dst = malloc(FILE_SIZE);
+	check(src != NULL && dst != NULL, "buffers");
+	for (size_t i = 0; i < FILE_SIZE; ++i)
+		src[i] = i * 31 + i / 4096;
+	struct ufs_aio aios[REQUEST_COUNT];
+
+	int fd = ufs_open("sync", UFS_CREATE | UFS_READ_WRITE);
+	check(fd >= 0, "open");
+	uint64_t t1 = now_us();
+	for (size_t off = 0; off < FILE_SIZE; off += REQUEST_SIZE) {
+		size_t size = FILE_SIZE - off < REQUEST_SIZE ?
+			      FILE_SIZE - off : REQUEST_SIZE;
+		check(ufs_pwrite(fd, src + off, size, off) == (ssize_t)size,
+		      "pwrite");
+	}
+	uint64_t t2 = now_us();
+	for (size_t off = 0; off < FILE_SIZE; off += REQUEST_SIZE) {
+		size_t size = FILE_SIZE - off < REQUEST_SIZE ?
+			      FILE_SIZE - off : REQUEST_SIZE;
+		check(ufs_pread(fd, dst + off, size, off) == (ssize_t)size,
+		      "pread");
+	}
+	uint64_t t3 = now_us();
+	check(memcmp(src, dst, FILE_SIZE) == 0, "sync data");
+	ufs_close(fd);
+	printf("plain calls: write %d MB/s, read %d MB/s\n",
+	       (int)((uint64_t)FILE_SIZE / (t2 - t1)),
+	       (int)((uint64_t)FILE_SIZE / (t3 - t2)));
+
+	memset(dst, 0, FILE_SIZE);
+	fd = ufs_open("async", UFS_CREATE | UFS_READ_WRITE);
+	check(fd >= 0, "open");
+	make_requests(aios, fd, src);
+	t1 = now_us();
+	run_async(ctx, aios, 1);
+	t2 = now_us();
+	make_requests(aios, fd, dst);
+	run_async(ctx, aios, 0);
+	t3 = now_us();
+	check(memcmp(src, dst, FILE_SIZE) == 0, "async data");
+	printf("async on %d threads: write %d MB/s, read %d MB/s\n",
+	       THREAD_COUNT, (int)((uint64_t)FILE_SIZE / (t2 - t1)),
+	       (int)((uint64_t)FILE_SIZE / (t3 - t2)));
+
+	/* Past the end it is short, and a bad descriptor fails. */
+	struct ufs_aio *taken;
+	struct ufs_aio aio;
+	memset(&aio, 0, sizeof(aio));
+	aio.fd = fd;
+	aio.buf = dst;
+	aio.offset = FILE_SIZE - 100;
+	aio.size = 5 * 1024 * 1024;
+	ufs_read_async(ctx, &aio);
+	wait_taken(ctx, 1);
+	check(aio.result == 100, "short read");
+	aio.fd = 12345;
+	ufs_read_async(ctx, &aio);
+	struct pollfd pfd = {ufs_aio_fd(ctx), POLLIN, 0};
+	check(poll(&pfd, 1, -1) == 1, "poll");
+	check(ufs_aio_take(ctx, &taken, 1) == 1 && taken == &aio, "take");
+	check(aio.result == -1 && aio.error == UFS_ERR_NO_FILE, "bad fd");
+
+	ufs_close(fd);
+	ufs_aio_ctx_delete(ctx);
+	thread_pool_delete(pool);
+	ufs_destroy();
+	free(src);
+	free(dst);
+	return 0;
+}
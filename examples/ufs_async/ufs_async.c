@@ -0,0 +1,225 @@
+#include "ufs_async.h"
+
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+enum {
+	/** Tasks pushed into the pool at once. */
+	UFS_AIO_PUSH_BATCH = 64,
+	UFS_AIO_CHUNK_SIZE = 1024 * 1024,
+};
+
+struct ufs_aio_chunk {
+	struct ufs_aio *aio;
+	size_t offset;
+	size_t size;
+};
+
+struct ufs_aio_ctx {
+	struct thread_pool *pool;
+	size_t chunk_size;
+	/** Readable while the list below is not empty. */
+	int fd;
+	pthread_mutex_t mutex;
+	/** Completed requests without a callback, the oldest first. */
+	struct ufs_aio *head;
+	struct ufs_aio *tail;
+};
+
+struct ufs_aio_ctx *
+ufs_aio_ctx_new(struct thread_pool *pool, size_t chunk_size)
+{
+	struct ufs_aio_ctx *ctx = malloc(sizeof(*ctx));
+	if (ctx == NULL)
+		return NULL;
+	ctx->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ctx->fd < 0) {
+		free(ctx);
+		return NULL;
+	}
+	ctx->pool = pool;
+	ctx->chunk_size = chunk_size != 0 ? chunk_size : UFS_AIO_CHUNK_SIZE;
+	pthread_mutex_init(&ctx->mutex, NULL);
+	ctx->head = NULL;
+	ctx->tail = NULL;
+	return ctx;
+}
+
+void
+ufs_aio_ctx_delete(struct ufs_aio_ctx *ctx)
+{
+	assert(ctx->head == NULL);
+	close(ctx->fd);
+	pthread_mutex_destroy(&ctx->mutex);
+	free(ctx);
+}
+
+int
+ufs_aio_fd(const struct ufs_aio_ctx *ctx)
+{
+	return ctx->fd;
+}
+
+int
+ufs_aio_take(struct ufs_aio_ctx *ctx, struct ufs_aio **aios, int count)
+{
+	int taken = 0;
+	pthread_mutex_lock(&ctx->mutex);
+	while (taken < count && ctx->head != NULL) {
+		aios[taken++] = ctx->head;
+		ctx->head = ctx->head->next;
+	}
+	if (ctx->head == NULL) {
+		ctx->tail = NULL;
+		/* Under the mutex, so a next completion signals it again. */
+		eventfd_t value;
+		eventfd_read(ctx->fd, &value);
+	}
+	pthread_mutex_unlock(&ctx->mutex);
+	return taken;
+}
+
+static void
+ufs_aio_complete(struct ufs_aio *aio)
+{
+	free(aio->chunks);
+	aio->chunks = NULL;
+	if (aio->error != UFS_ERR_NO_ERR)
+		aio->result = -1;
+	else
+		aio->result = aio->end - aio->offset;
+	if (aio->cb != NULL) {
+		aio->cb(aio);
+		return;
+	}
+	struct ufs_aio_ctx *ctx = aio->ctx;
+	aio->next = NULL;
+	pthread_mutex_lock(&ctx->mutex);
+	if (ctx->tail == NULL) {
+		ctx->head = aio;
+		eventfd_write(ctx->fd, 1);
+	} else {
+		ctx->tail->next = aio;
+	}
+	ctx->tail = aio;
+	pthread_mutex_unlock(&ctx->mutex);
+}
+
+/** Each chunk and the submitter hold a reference. */
+static void
+ufs_aio_unref(struct ufs_aio *aio)
+{
+	if (__atomic_sub_fetch(&aio->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		ufs_aio_complete(aio);
+}
+
+static void
+ufs_aio_chunk_run(struct ufs_aio_chunk *chunk)
+{
+	struct ufs_aio *aio = chunk->aio;
+	char *buf = aio->buf + (chunk->offset - aio->offset);
+	ssize_t rc;
+	if (aio->is_write)
+		rc = ufs_pwrite(aio->fd, buf, chunk->size, chunk->offset);
+	else
+		rc = ufs_pread(aio->fd, buf, chunk->size, chunk->offset);
+	if (rc < 0) {
+		enum ufs_error_code expected = UFS_ERR_NO_ERR;
+		__atomic_compare_exchange_n(&aio->error, &expected, ufs_errno(),
+					    false, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED);
+	} else if ((size_t)rc < chunk->size) {
+		/* The result ends at the first short chunk. */
+		size_t end = chunk->offset + rc;
+		size_t old = __atomic_load_n(&aio->end, __ATOMIC_RELAXED);
+		while (end < old &&
+		       !__atomic_compare_exchange_n(&aio->end, &old, end, true,
+						    __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED));
+	}
+	ufs_aio_unref(aio);
+}
+
+static void *
+ufs_aio_task_f(void *arg)
+{
+	ufs_aio_chunk_run(arg);
+	return NULL;
+}
+
+static void
+ufs_aio_submit(struct ufs_aio_ctx *ctx, struct ufs_aio *aio, int is_write)
+{
+	aio->ctx = ctx;
+	aio->is_write = is_write;
+	aio->result = 0;
+	aio->error = UFS_ERR_NO_ERR;
+	aio->end = aio->offset + aio->size;
+	aio->next = NULL;
+	size_t step = ctx->chunk_size;
+	size_t first = aio->offset / step;
+	/* An empty request still checks the descriptor. */
+	int count = 1;
+	if (aio->size > 0)
+		count = (aio->end - 1) / step - first + 1;
+	aio->chunks = malloc(sizeof(*aio->chunks) * count);
+	if (aio->chunks == NULL) {
+		/* As the last resort, the whole request is done right here. */
+		struct ufs_aio_chunk whole = {aio, aio->offset, aio->size};
+		aio->pending = 2;
+		ufs_aio_chunk_run(&whole);
+		ufs_aio_unref(aio);
+		return;
+	}
+	struct ufs_aio_chunk *chunks = aio->chunks;
+	aio->pending = count + 1;
+	size_t offset = aio->offset;
+	for (int i = 0; i < count; ++i) {
+		size_t end = (first + i + 1) * step;
+		if (end > aio->end)
+			end = aio->end;
+		chunks[i].aio = aio;
+		chunks[i].offset = offset;
+		chunks[i].size = end - offset;
+		offset = end;
+	}
+	int i = 0;
+	while (i < count) {
+		struct thread_task *tasks[UFS_AIO_PUSH_BATCH];
+		int n = count - i;
+		if (n > UFS_AIO_PUSH_BATCH)
+			n = UFS_AIO_PUSH_BATCH;
+		for (int j = 0; j < n; ++j)
+			thread_task_new(&tasks[j], ufs_aio_task_f, &chunks[i + j]);
+		if (thread_pool_push_tasks(ctx->pool, tasks, n) != 0) {
+			for (int j = 0; j < n; ++j)
+				thread_task_delete(tasks[j]);
+			break;
+		}
+		/* The submitter's reference keeps the chunks alive. */
+		for (int j = 0; j < n; ++j)
+			thread_task_detach(tasks[j]);
+		i += n;
+	}
+	/* The pool is full. */
+	for (; i < count; ++i)
+		ufs_aio_chunk_run(&chunks[i]);
+	ufs_aio_unref(aio);
+}
+
+void
+ufs_read_async(struct ufs_aio_ctx *ctx, struct ufs_aio *aio)
+{
+	ufs_aio_submit(ctx, aio, 0);
+}
+
+void
+ufs_write_async(struct ufs_aio_ctx *ctx, struct ufs_aio *aio)
+{
+	ufs_aio_submit(ctx, aio, 1);
+}
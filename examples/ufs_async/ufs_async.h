@@ -0,0 +1,107 @@
+#pragma once
+
+#include "userfs.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Asynchronous reads and writes of the UserFS files from 3/, done in
+ * a thread pool of 4/. A request is split into the chunks by the
+ * offsets in the file, aligned to the chunk size, and each chunk is
+ * a ufs_pread() or ufs_pwrite() in its own task. So a big read is
+ * copied by all the threads in parallel. The writes of one file are
+ * serialized by its write lock, so the chunks of a write only run
+ * in parallel with the calls on the other files, but the caller
+ * still doesn't wait for the copying.
+ *
+ * The request is not atomic as a whole, only its chunks are. A
+ * concurrent write to the same range can be seen by a read in some
+ * of the chunks and not in the others.
+ */
+
+struct thread_pool;
+struct ufs_aio;
+struct ufs_aio_ctx;
+struct ufs_aio_chunk;
+
+typedef void (*ufs_aio_f)(struct ufs_aio *aio);
+
+/**
+ * A request. The caller fills the parameters, and keeps the request
+ * and the buffer alive till it completes.
+ */
+struct ufs_aio {
+	/** File descriptor from ufs_open(). */
+	int fd;
+	/** Buffer to read into or to write. */
+	char *buf;
+	size_t size;
+	/** Offset in the file, the descriptor's position is unused. */
+	size_t offset;
+	/**
+	 * Called in the thread which finishes the request, it can be
+	 * a worker or the submitter, even before the submit returns.
+	 * NULL to get the request from ufs_aio_take() instead.
+	 */
+	ufs_aio_f cb;
+	void *arg;
+
+	/**
+	 * How many bytes were read or written, as by ufs_pread() and
+	 * ufs_pwrite(). A read ends at the first chunk which ends
+	 * short. -1 if any chunk has failed, then @a error is its
+	 * ufs_errno().
+	 */
+	ssize_t result;
+	enum ufs_error_code error;
+
+	/** Private. */
+	struct ufs_aio_ctx *ctx;
+	struct ufs_aio_chunk *chunks;
+	int is_write;
+	int pending;
+	size_t end;
+	struct ufs_aio *next;
+};
+
+/**
+ * Create a context of the requests running on @a pool. The pool
+ * stays the caller's. The chunks are @a chunk_size bytes, 0 means
+ * 1 MB, the max block size of UserFS by default.
+ * @retval NULL No memory or no eventfd.
+ */
+struct ufs_aio_ctx *
+ufs_aio_ctx_new(struct thread_pool *pool, size_t chunk_size);
+
+/** Delete the context. No requests must be running. */
+void
+ufs_aio_ctx_delete(struct ufs_aio_ctx *ctx);
+
+/**
+ * Start reading into @a aio->buf. The request always completes, the
+ * errors are in its result. When the pool is full, the chunks are
+ * copied right in the calling thread, as the last resort.
+ */
+void
+ufs_read_async(struct ufs_aio_ctx *ctx, struct ufs_aio *aio);
+
+/** Start writing @a aio->buf, same as ufs_read_async(). */
+void
+ufs_write_async(struct ufs_aio_ctx *ctx, struct ufs_aio *aio);
+
+/**
+ * The eventfd of the context, readable while there are completed
+ * requests without a callback to take by ufs_aio_take().
+ */
+int
+ufs_aio_fd(const struct ufs_aio_ctx *ctx);
+
+/**
+ * Take up to @a count of the completed requests without a callback,
+ * the first completed first. The fd stays readable till all are
+ * taken.
+ * @retval Number of the requests taken.
+ */
+int
+ufs_aio_take(struct ufs_aio_ctx *ctx, struct ufs_aio **aios, int count);
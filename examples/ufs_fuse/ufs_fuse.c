@@ -0,0 +1,886 @@
+#define _GNU_SOURCE
+
+#include "userfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fuse.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * UserFS from 3/ mounted via FUSE, to be measured by the usual tools
+ * like dd and fio, next to tmpfs. The daemon speaks the FUSE protocol
+ * on /dev/fuse itself, so it needs only the kernel headers, and mounts
+ * by mount(2), which takes root.
+ *
+ * A read is replied right from the blocks of the file. The spans are
+ * put into a pipe with vmsplice(), which only takes the references of
+ * the pages, and the pipe is spliced into /dev/fuse. So there is no
+ * copy in the daemon on the way, and the kernel copies the data once,
+ * into the reader's pages.
+ */
+
+enum {
+	/** Bucket count of the node table, a power of 2. */
+	NODE_TABLE_SIZE = 4096,
+	/** The biggest write and read, if the kernel allows. */
+	UFS_FUSE_MAX_PAGES = 256,
+	UFS_FUSE_PAGE_SIZE = 4096,
+	UFS_FUSE_THREAD_COUNT = 4,
+	/** The blocks are at least 512 bytes. */
+	UFS_FUSE_MIN_BLOCK = 512,
+};
+
+/** How long the kernel can keep the names and the sizes, seconds. */
+static const uint64_t ufs_fuse_timeout = 1;
+
+static int fuse_fd = -1;
+static bool is_debug = false;
+/** Set by the INIT, the kernel takes the replies from a pipe. */
+static bool can_splice = false;
+static uint32_t max_write = 32 * UFS_FUSE_PAGE_SIZE;
+
+/**
+ * A path known to the kernel by an inode number, which is the address
+ * of the node. UserFS works by the paths, and the FUSE calls are by
+ * the numbers. A node lives while the kernel has lookups of it. There
+ * are no renames, so the path of a node never changes.
+ */
+struct node {
+	char *path;
+	uint32_t hash;
+	uint64_t lookup_count;
+	struct node *next;
+};
+
+static struct node node_root = {"", 0, 1, NULL};
+
+static struct {
+	pthread_mutex_t mutex;
+	struct node *buckets[NODE_TABLE_SIZE];
+} node_table = {PTHREAD_MUTEX_INITIALIZER, {NULL}};
+
+static uint32_t
+node_hash(const char *path)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (; *path != 0; ++path) {
+		h ^= (unsigned char)*path;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct node *
+node_of(uint64_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return &node_root;
+	return (struct node *)(uintptr_t)ino;
+}
+
+static uint64_t
+node_ino(const struct node *n)
+{
+	if (n == &node_root)
+		return FUSE_ROOT_ID;
+	return (uint64_t)(uintptr_t)n;
+}
+
+/** Path of the child @a name of the directory @a parent, malloc'ed. */
+static char *
+node_child_path(uint64_t parent, const char *name)
+{
+	const char *dir = node_of(parent)->path;
+	size_t dir_size = strlen(dir);
+	size_t name_size = strlen(name);
+	char *path = malloc(dir_size + name_size + 2);
+	memcpy(path, dir, dir_size);
+	path[dir_size] = '/';
+	memcpy(path + dir_size + 1, name, name_size + 1);
+	return path;
+}
+
+/** Node of the path with one more lookup. Takes the path. */
+static struct node *
+node_lookup(char *path)
+{
+	uint32_t hash = node_hash(path);
+	pthread_mutex_lock(&node_table.mutex);
+	struct node **bucket =
+		&node_table.buckets[hash & (NODE_TABLE_SIZE - 1)];
+	struct node *n = *bucket;
+	while (n != NULL && (n->hash != hash || strcmp(n->path, path) != 0))
+		n = n->next;
+	if (n == NULL) {
+		n = malloc(sizeof(*n));
+		n->path = path;
+		n->hash = hash;
+		n->lookup_count = 0;
+		n->next = *bucket;
+		*bucket = n;
+		path = NULL;
+	}
+	++n->lookup_count;
+	pthread_mutex_unlock(&node_table.mutex);
+	free(path);
+	return n;
+}
+
+static void
+node_forget(uint64_t ino, uint64_t count)
+{
+	struct node *n = node_of(ino);
+	if (n == &node_root)
+		return;
+	pthread_mutex_lock(&node_table.mutex);
+	n->lookup_count -= count;
+	if (n->lookup_count > 0) {
+		pthread_mutex_unlock(&node_table.mutex);
+		return;
+	}
+	struct node **i =
+		&node_table.buckets[n->hash & (NODE_TABLE_SIZE - 1)];
+	while (*i != n)
+		i = &(*i)->next;
+	*i = n->next;
+	pthread_mutex_unlock(&node_table.mutex);
+	free(n->path);
+	free(n);
+}
+
+/** The errno of the last failed UserFS call. */
+static int
+ufs_fuse_errno(void)
+{
+	switch (ufs_errno()) {
+	case UFS_ERR_NO_FILE:
+		return ENOENT;
+	case UFS_ERR_NO_MEM:
+		return ENOSPC;
+	case UFS_ERR_NO_PERMISSION:
+		return EBADF;
+	case UFS_ERR_EXISTS:
+		return EEXIST;
+	case UFS_ERR_NOT_EMPTY:
+		return ENOTEMPTY;
+	default:
+		return EIO;
+	}
+}
+
+/**
+ * A thread reading the requests. Each has its own buffer, and its
+ * own pipe for the spliced replies.
+ */
+struct ufs_fuse_worker {
+	pthread_t thread;
+	char *buf;
+	size_t buf_size;
+	/** Read and write ends, -1 if the splice is not used. */
+	int pipe[2];
+	/** How many pages the pipe can hold. */
+	size_t pipe_pages;
+	/** The reply of a read, the header and the spans. */
+	struct iovec *iov;
+	/** Same, eaten by vmsplice(). */
+	struct iovec *splice_iov;
+	struct ufs_span *spans;
+	size_t span_capacity;
+};
+
+/** Send a reply, @a iov[0] is left for the header. */
+static void
+ufs_fuse_reply_iov(uint64_t unique, int error, struct iovec *iov, int count)
+{
+	struct fuse_out_header out;
+	out.len = sizeof(out);
+	for (int i = 1; i < count; ++i)
+		out.len += iov[i].iov_len;
+	out.error = -error;
+	out.unique = unique;
+	iov[0].iov_base = &out;
+	iov[0].iov_len = sizeof(out);
+	/* ENOENT means the request was interrupted, and is fine. */
+	if (writev(fuse_fd, iov, count) < 0 && errno != ENOENT &&
+	    errno != ENODEV)
+		perror("ufs_fuse: reply");
+}
+
+static void
+ufs_fuse_reply(uint64_t unique, const void *data, size_t size)
+{
+	struct iovec iov[2];
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = size;
+	ufs_fuse_reply_iov(unique, 0, iov, size > 0 ? 2 : 1);
+}
+
+static void
+ufs_fuse_reply_err(uint64_t unique, int error)
+{
+	struct iovec iov[1];
+	ufs_fuse_reply_iov(unique, error, iov, 1);
+}
+
+static int
+ufs_fuse_stat(uint64_t ino, struct fuse_attr *attr)
+{
+	struct ufs_attr a;
+	if (ufs_getattr(node_of(ino)->path, &a) != 0)
+		return ufs_fuse_errno();
+	memset(attr, 0, sizeof(*attr));
+	attr->ino = ino;
+	attr->mode = a.is_dir ? S_IFDIR | 0755 : S_IFREG | 0644;
+	attr->nlink = a.is_dir ? 2 : 1;
+	attr->uid = getuid();
+	attr->gid = getgid();
+	attr->size = a.size;
+	attr->blocks = (a.size + 511) / 512;
+	attr->blksize = UFS_FUSE_PAGE_SIZE;
+	return 0;
+}
+
+/** Fill the entry of a child, and count the lookup. */
+static int
+ufs_fuse_entry(uint64_t parent, const char *name, struct fuse_entry_out *e)
+{
+	struct node *n = node_lookup(node_child_path(parent, name));
+	memset(e, 0, sizeof(*e));
+	int rc = ufs_fuse_stat(node_ino(n), &e->attr);
+	if (rc != 0) {
+		node_forget(node_ino(n), 1);
+		return rc;
+	}
+	e->nodeid = node_ino(n);
+	e->entry_valid = ufs_fuse_timeout;
+	e->attr_valid = ufs_fuse_timeout;
+	return 0;
+}
+
+static void
+ufs_fuse_reply_entry(uint64_t unique, uint64_t parent, const char *name)
+{
+	struct fuse_entry_out e;
+	int rc = ufs_fuse_entry(parent, name, &e);
+	if (rc != 0)
+		ufs_fuse_reply_err(unique, rc);
+	else
+		ufs_fuse_reply(unique, &e, sizeof(e));
+}
+
+static void
+ufs_fuse_init(const struct fuse_in_header *in, const struct fuse_init_in *arg)
+{
+	if (arg->major != FUSE_KERNEL_VERSION) {
+		fprintf(stderr, "ufs_fuse: kernel protocol %u.%u is not "
+			"supported\n", arg->major, arg->minor);
+		ufs_fuse_reply_err(in->unique, EPROTO);
+		return;
+	}
+	struct fuse_init_out out;
+	memset(&out, 0, sizeof(out));
+	out.major = FUSE_KERNEL_VERSION;
+	out.minor = FUSE_KERNEL_MINOR_VERSION;
+	out.max_readahead = arg->max_readahead;
+	out.flags = arg->flags & (FUSE_ASYNC_READ | FUSE_BIG_WRITES |
+		FUSE_PARALLEL_DIROPS | FUSE_MAX_PAGES);
+	if ((out.flags & FUSE_MAX_PAGES) != 0) {
+		out.max_pages = UFS_FUSE_MAX_PAGES;
+		max_write = UFS_FUSE_MAX_PAGES * UFS_FUSE_PAGE_SIZE;
+	}
+	out.max_write = max_write;
+	out.max_background = 64;
+	out.congestion_threshold = 48;
+	out.time_gran = 1;
+	can_splice = (arg->flags & FUSE_SPLICE_WRITE) != 0;
+	ufs_fuse_reply(in->unique, &out, sizeof(out));
+}
+
+/** Only the size can be set, the rest is ignored. */
+static void
+ufs_fuse_setattr(const struct fuse_in_header *in,
+	const struct fuse_setattr_in *arg)
+{
+	if ((arg->valid & FATTR_SIZE) != 0) {
+		bool has_fh = (arg->valid & FATTR_FH) != 0;
+		int fd = has_fh ? (int)arg->fh :
+			ufs_open(node_of(in->nodeid)->path, UFS_WRITE_ONLY);
+		int rc = fd < 0 ? -1 : ufs_resize(fd, arg->size);
+		int err = rc != 0 ? ufs_fuse_errno() : 0;
+		if (!has_fh && fd >= 0)
+			ufs_close(fd);
+		if (rc != 0) {
+			ufs_fuse_reply_err(in->unique, err);
+			return;
+		}
+	}
+	struct fuse_attr_out out;
+	memset(&out, 0, sizeof(out));
+	int rc = ufs_fuse_stat(in->nodeid, &out.attr);
+	if (rc != 0) {
+		ufs_fuse_reply_err(in->unique, rc);
+		return;
+	}
+	out.attr_valid = ufs_fuse_timeout;
+	ufs_fuse_reply(in->unique, &out, sizeof(out));
+}
+
+static int
+ufs_fuse_open_flags(int flags)
+{
+	switch (flags & O_ACCMODE) {
+	case O_RDONLY:
+		return UFS_READ_ONLY;
+	case O_WRONLY:
+		return UFS_WRITE_ONLY;
+	default:
+		return UFS_READ_WRITE;
+	}
+}
+
+static void
+ufs_fuse_open(const struct fuse_in_header *in, const struct fuse_open_in *arg)
+{
+	int fd = ufs_open(node_of(in->nodeid)->path,
+		ufs_fuse_open_flags(arg->flags));
+	if (fd < 0) {
+		ufs_fuse_reply_err(in->unique, ufs_fuse_errno());
+		return;
+	}
+	struct fuse_open_out out;
+	memset(&out, 0, sizeof(out));
+	out.fh = fd;
+	ufs_fuse_reply(in->unique, &out, sizeof(out));
+}
+
+static void
+ufs_fuse_create(const struct fuse_in_header *in,
+	const struct fuse_create_in *arg)
+{
+	const char *name = (const char *)(arg + 1);
+	char *path = node_child_path(in->nodeid, name);
+	int fd = ufs_open(path, ufs_fuse_open_flags(arg->flags) | UFS_CREATE);
+	free(path);
+	if (fd < 0) {
+		ufs_fuse_reply_err(in->unique, ufs_fuse_errno());
+		return;
+	}
+	struct {
+		struct fuse_entry_out entry;
+		struct fuse_open_out open;
+	} out;
+	int rc = ufs_fuse_entry(in->nodeid, name, &out.entry);
+	if (rc != 0) {
+		ufs_close(fd);
+		ufs_fuse_reply_err(in->unique, rc);
+		return;
+	}
+	memset(&out.open, 0, sizeof(out.open));
+	out.open.fh = fd;
+	ufs_fuse_reply(in->unique, &out, sizeof(out));
+}
+
+/** Pages of the pipe taken by the memory, vmsplice() splits by them. */
+static size_t
+ufs_fuse_page_count(const void *data, size_t size)
+{
+	uintptr_t begin = (uintptr_t)data / UFS_FUSE_PAGE_SIZE;
+	uintptr_t end = ((uintptr_t)data + size - 1) / UFS_FUSE_PAGE_SIZE;
+	return end - begin + 1;
+}
+
+/**
+ * Move the reply into the pipe and splice it into the device. Fails
+ * without a trace in the pipe, so the reply can be written instead.
+ */
+static int
+ufs_fuse_splice(struct ufs_fuse_worker *w, int count, size_t size)
+{
+	size_t pages = 0;
+	for (int i = 0; i < count; ++i)
+		pages += ufs_fuse_page_count(w->iov[i].iov_base,
+			w->iov[i].iov_len);
+	if (pages > w->pipe_pages)
+		return -1;
+	struct iovec *iov = w->splice_iov;
+	memcpy(iov, w->iov, count * sizeof(iov[0]));
+	size_t in_pipe = 0;
+	while (in_pipe < size) {
+		ssize_t rc = vmsplice(w->pipe[1], iov, count, 0);
+		if (rc <= 0)
+			goto drain;
+		in_pipe += rc;
+		for (; count > 0 && (size_t)rc >= iov->iov_len; --count) {
+			rc -= iov->iov_len;
+			++iov;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	ssize_t rc = splice(w->pipe[0], NULL, fuse_fd, NULL, size,
+		SPLICE_F_MOVE);
+	if (rc == (ssize_t)size)
+		return 0;
+	/* The kernel takes all or nothing. */
+	if (rc < 0 && (errno == ENOENT || errno == ENODEV))
+		return 0;
+drain:
+	while (in_pipe > 0) {
+		ssize_t rc = read(w->pipe[0], w->buf,
+			in_pipe < w->buf_size ? in_pipe : w->buf_size);
+		if (rc <= 0)
+			abort();
+		in_pipe -= rc;
+	}
+	return -1;
+}
+
+/**
+ * The reply is the spans of the file's blocks. They hold the blocks
+ * till the kernel has taken the data, even if the file is written or
+ * deleted meanwhile.
+ */
+static void
+ufs_fuse_read(struct ufs_fuse_worker *w, const struct fuse_in_header *in,
+	const struct fuse_read_in *arg)
+{
+	size_t size = arg->size;
+	size_t max_count = size / UFS_FUSE_MIN_BLOCK + 2;
+	if (max_count > w->span_capacity) {
+		w->span_capacity = max_count;
+		w->spans = realloc(w->spans, max_count * sizeof(w->spans[0]));
+		w->iov = realloc(w->iov, (max_count + 1) * sizeof(w->iov[0]));
+		w->splice_iov = realloc(w->splice_iov,
+			(max_count + 1) * sizeof(w->iov[0]));
+	}
+	size_t count = 0;
+	size_t done = 0;
+	int err = 0;
+	while (done < size && count < max_count) {
+		ssize_t rc = ufs_pread_span(arg->fh, size - done,
+			arg->offset + done, &w->spans[count]);
+		if (rc <= 0) {
+			err = rc < 0 ? ufs_fuse_errno() : 0;
+			break;
+		}
+		w->iov[count + 1].iov_base = (void *)w->spans[count].data;
+		w->iov[count + 1].iov_len = rc;
+		done += rc;
+		++count;
+	}
+	struct fuse_out_header out;
+	out.len = sizeof(out) + done;
+	out.error = 0;
+	out.unique = in->unique;
+	w->iov[0].iov_base = &out;
+	w->iov[0].iov_len = sizeof(out);
+	if (err != 0) {
+		ufs_fuse_reply_err(in->unique, err);
+	} else if (count + 1 > IOV_MAX) {
+		/* Too many small blocks for one call, rare. */
+		char *copy = malloc(done);
+		size_t pos = 0;
+		for (size_t i = 0; i < count; ++i) {
+			memcpy(copy + pos, w->iov[i + 1].iov_base,
+			       w->iov[i + 1].iov_len);
+			pos += w->iov[i + 1].iov_len;
+		}
+		ufs_fuse_reply(in->unique, copy, done);
+		free(copy);
+	} else if (!can_splice || w->pipe[0] < 0 ||
+		   ufs_fuse_splice(w, count + 1, out.len) != 0) {
+		if (is_debug)
+			fprintf(stderr, "ufs_fuse: read %zu written\n", done);
+		if (writev(fuse_fd, w->iov, count + 1) < 0 &&
+		    errno != ENOENT && errno != ENODEV)
+			perror("ufs_fuse: reply");
+	} else if (is_debug) {
+		fprintf(stderr, "ufs_fuse: read %zu spliced\n", done);
+	}
+	for (size_t i = 0; i < count; ++i)
+		ufs_span_release(&w->spans[i]);
+}
+
+static void
+ufs_fuse_write(const struct fuse_in_header *in,
+	const struct fuse_write_in *arg)
+{
+	ssize_t rc = ufs_pwrite(arg->fh, (const char *)(arg + 1), arg->size,
+		arg->offset);
+	if (rc < 0) {
+		ufs_fuse_reply_err(in->unique, ufs_fuse_errno());
+		return;
+	}
+	struct fuse_write_out out;
+	memset(&out, 0, sizeof(out));
+	out.size = rc;
+	ufs_fuse_reply(in->unique, &out, sizeof(out));
+}
+
+static void
+ufs_fuse_mkdir(const struct fuse_in_header *in,
+	const struct fuse_mkdir_in *arg)
+{
+	const char *name = (const char *)(arg + 1);
+	char *path = node_child_path(in->nodeid, name);
+	int rc = ufs_mkdir(path);
+	free(path);
+	if (rc != 0)
+		ufs_fuse_reply_err(in->unique, ufs_fuse_errno());
+	else
+		ufs_fuse_reply_entry(in->unique, in->nodeid, name);
+}
+
+/** Unlink or rmdir of the child @a name. */
+static void
+ufs_fuse_remove(const struct fuse_in_header *in, const char *name,
+	int (*remove_f)(const char *))
+{
+	char *path = node_child_path(in->nodeid, name);
+	int rc = remove_f(path);
+	free(path);
+	ufs_fuse_reply_err(in->unique, rc != 0 ? ufs_fuse_errno() : 0);
+}
+
+/** A listing of a directory, the entries by their offsets. */
+struct ufs_fuse_dir {
+	struct ufs_dir *dir;
+	size_t count;
+	struct ufs_dirent entries[];
+};
+
+static void
+ufs_fuse_opendir(const struct fuse_in_header *in)
+{
+	struct ufs_dir *dir = ufs_opendir(node_of(in->nodeid)->path);
+	if (dir == NULL) {
+		ufs_fuse_reply_err(in->unique, ufs_fuse_errno());
+		return;
+	}
+	size_t capacity = 16;
+	struct ufs_fuse_dir *d = malloc(sizeof(*d) +
+		capacity * sizeof(d->entries[0]));
+	d->dir = dir;
+	d->count = 0;
+	struct ufs_dirent entry;
+	while (ufs_readdir(dir, &entry) == 1) {
+		if (d->count == capacity) {
+			capacity *= 2;
+			d = realloc(d, sizeof(*d) +
+				capacity * sizeof(d->entries[0]));
+		}
+		d->entries[d->count++] = entry;
+	}
+	struct fuse_open_out out;
+	memset(&out, 0, sizeof(out));
+	out.fh = (uintptr_t)d;
+	ufs_fuse_reply(in->unique, &out, sizeof(out));
+}
+
+static void
+ufs_fuse_readdir(struct ufs_fuse_worker *w, const struct fuse_in_header *in,
+	const struct fuse_read_in *arg)
+{
+	struct ufs_fuse_dir *d = (struct ufs_fuse_dir *)(uintptr_t)arg->fh;
+	size_t size = arg->size < w->buf_size ? arg->size : w->buf_size;
+	uint64_t unique = in->unique;
+	size_t i = arg->offset;
+	/* The request is not needed any more, its buffer is reused. */
+	char *buf = w->buf;
+	size_t used = 0;
+	for (; i < d->count; ++i) {
+		const char *name = d->entries[i].name;
+		size_t name_size = strlen(name);
+		struct fuse_dirent de;
+		size_t entry_size = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET +
+			name_size);
+		if (entry_size > size - used)
+			break;
+		/* Only the type is used, the rest is from a lookup. */
+		de.ino = node_hash(name) | 2;
+		de.off = i + 1;
+		de.namelen = name_size;
+		de.type = d->entries[i].is_dir ? S_IFDIR >> 12 : S_IFREG >> 12;
+		memcpy(buf + used, &de, FUSE_NAME_OFFSET);
+		memcpy(buf + used + FUSE_NAME_OFFSET, name, name_size);
+		memset(buf + used + FUSE_NAME_OFFSET + name_size, 0,
+			entry_size - FUSE_NAME_OFFSET - name_size);
+		used += entry_size;
+	}
+	ufs_fuse_reply(unique, buf, used);
+}
+
+static void
+ufs_fuse_statfs(const struct fuse_in_header *in)
+{
+	struct fuse_statfs_out out;
+	memset(&out, 0, sizeof(out));
+	out.st.bsize = UFS_FUSE_PAGE_SIZE;
+	out.st.frsize = UFS_FUSE_PAGE_SIZE;
+	out.st.namelen = NAME_MAX;
+	ufs_fuse_reply(in->unique, &out, sizeof(out));
+}
+
+static void
+ufs_fuse_handle(struct ufs_fuse_worker *w, const struct fuse_in_header *in)
+{
+	const void *arg = in + 1;
+	if (is_debug) {
+		fprintf(stderr, "ufs_fuse: unique %llu, opcode %u, node %llx\n",
+			(unsigned long long)in->unique, in->opcode,
+			(unsigned long long)in->nodeid);
+	}
+	switch (in->opcode) {
+	case FUSE_INIT:
+		ufs_fuse_init(in, arg);
+		break;
+	case FUSE_DESTROY:
+		ufs_fuse_reply_err(in->unique, 0);
+		break;
+	case FUSE_LOOKUP:
+		ufs_fuse_reply_entry(in->unique, in->nodeid, arg);
+		break;
+	case FUSE_FORGET:
+		node_forget(in->nodeid,
+			((const struct fuse_forget_in *)arg)->nlookup);
+		break;
+	case FUSE_BATCH_FORGET: {
+		const struct fuse_batch_forget_in *batch = arg;
+		const struct fuse_forget_one *one =
+			(const struct fuse_forget_one *)(batch + 1);
+		for (uint32_t i = 0; i < batch->count; ++i)
+			node_forget(one[i].nodeid, one[i].nlookup);
+		break;
+	}
+	case FUSE_GETATTR: {
+		struct fuse_attr_out out;
+		memset(&out, 0, sizeof(out));
+		int rc = ufs_fuse_stat(in->nodeid, &out.attr);
+		out.attr_valid = ufs_fuse_timeout;
+		if (rc != 0)
+			ufs_fuse_reply_err(in->unique, rc);
+		else
+			ufs_fuse_reply(in->unique, &out, sizeof(out));
+		break;
+	}
+	case FUSE_SETATTR:
+		ufs_fuse_setattr(in, arg);
+		break;
+	case FUSE_OPEN:
+		ufs_fuse_open(in, arg);
+		break;
+	case FUSE_CREATE:
+		ufs_fuse_create(in, arg);
+		break;
+	case FUSE_READ:
+		ufs_fuse_read(w, in, arg);
+		break;
+	case FUSE_WRITE:
+		ufs_fuse_write(in, arg);
+		break;
+	case FUSE_RELEASE:
+		ufs_close(((const struct fuse_release_in *)arg)->fh);
+		ufs_fuse_reply_err(in->unique, 0);
+		break;
+	case FUSE_FLUSH:
+	case FUSE_FSYNC:
+	case FUSE_FSYNCDIR:
+	case FUSE_ACCESS:
+		ufs_fuse_reply_err(in->unique, 0);
+		break;
+	case FUSE_UNLINK:
+		ufs_fuse_remove(in, arg, ufs_delete);
+		break;
+	case FUSE_MKDIR:
+		ufs_fuse_mkdir(in, arg);
+		break;
+	case FUSE_RMDIR:
+		ufs_fuse_remove(in, arg, ufs_rmdir);
+		break;
+	case FUSE_OPENDIR:
+		ufs_fuse_opendir(in);
+		break;
+	case FUSE_READDIR:
+		ufs_fuse_readdir(w, in, arg);
+		break;
+	case FUSE_RELEASEDIR: {
+		const struct fuse_release_in *rel = arg;
+		struct ufs_fuse_dir *d = (struct ufs_fuse_dir *)(uintptr_t)
+			rel->fh;
+		ufs_closedir(d->dir);
+		free(d);
+		ufs_fuse_reply_err(in->unique, 0);
+		break;
+	}
+	case FUSE_STATFS:
+		ufs_fuse_statfs(in);
+		break;
+	case FUSE_INTERRUPT:
+		/* The calls are short, they are just let finish. */
+		break;
+	default:
+		ufs_fuse_reply_err(in->unique, ENOSYS);
+		break;
+	}
+}
+
+static void *
+ufs_fuse_worker_f(void *arg)
+{
+	struct ufs_fuse_worker *w = arg;
+	while (true) {
+		ssize_t rc = read(fuse_fd, w->buf, w->buf_size);
+		if (rc < 0) {
+			/* An interrupted request, or a signal. */
+			if (errno == ENOENT || errno == EINTR || errno == EAGAIN)
+				continue;
+			if (errno != ENODEV)
+				perror("ufs_fuse: read");
+			break;
+		}
+		if ((size_t)rc < sizeof(struct fuse_in_header))
+			continue;
+		ufs_fuse_handle(w, (const struct fuse_in_header *)w->buf);
+	}
+	/* Unmounted, the main thread is waiting for a signal. */
+	kill(getpid(), SIGTERM);
+	return NULL;
+}
+
+static void
+ufs_fuse_worker_create(struct ufs_fuse_worker *w)
+{
+	memset(w, 0, sizeof(*w));
+	/* The kernel wants the room for the biggest write. */
+	w->buf_size = UFS_FUSE_MAX_PAGES * UFS_FUSE_PAGE_SIZE +
+		FUSE_MIN_READ_BUFFER;
+	w->buf = malloc(w->buf_size);
+	w->pipe[0] = -1;
+	w->pipe[1] = -1;
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) != 0)
+		return;
+	/*
+	 * The biggest read with its header, else the biggest pipe of
+	 * fs.pipe-max-size, 1MB by default, else the default one.
+	 */
+	int size = fcntl(fds[0], F_SETPIPE_SZ,
+		(UFS_FUSE_MAX_PAGES + 1) * UFS_FUSE_PAGE_SIZE);
+	if (size < 0) {
+		size = fcntl(fds[0], F_SETPIPE_SZ,
+			UFS_FUSE_MAX_PAGES * UFS_FUSE_PAGE_SIZE);
+	}
+	if (size < 0)
+		size = fcntl(fds[0], F_GETPIPE_SZ);
+	w->pipe[0] = fds[0];
+	w->pipe[1] = fds[1];
+	w->pipe_pages = size / UFS_FUSE_PAGE_SIZE;
+}
+
+static void
+ufs_fuse_worker_destroy(struct ufs_fuse_worker *w)
+{
+	if (w->pipe[0] >= 0) {
+		close(w->pipe[0]);
+		close(w->pipe[1]);
+	}
+	free(w->buf);
+	free(w->iov);
+	free(w->splice_iov);
+	free(w->spans);
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-d] [-s] [-t threads] <mountpoint>\n",
+		name);
+}
+
+int
+main(int argc, char **argv)
+{
+	int thread_count = UFS_FUSE_THREAD_COUNT;
+	int opt;
+	while ((opt = getopt(argc, argv, "dst:")) != -1) {
+		switch (opt) {
+		case 'd':
+			is_debug = true;
+			break;
+		case 's':
+			thread_count = 1;
+			break;
+		case 't':
+			thread_count = atoi(optarg);
+			if (thread_count > 0)
+				break;
+			/* Fallthrough. */
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	const char *mountpoint = argv[optind];
+	fuse_fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (fuse_fd < 0) {
+		perror("ufs_fuse: open /dev/fuse");
+		return 1;
+	}
+	char opts[256];
+	snprintf(opts, sizeof(opts), "fd=%d,rootmode=%o,user_id=%u,"
+		 "group_id=%u,default_permissions,allow_other", fuse_fd,
+		 S_IFDIR, getuid(), getgid());
+	if (mount("ufs", mountpoint, "fuse.ufs", MS_NOSUID | MS_NODEV,
+		  opts) != 0) {
+		perror("ufs_fuse: mount");
+		close(fuse_fd);
+		return 1;
+	}
+	/* Only the main thread takes the signals, to unmount. */
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	struct ufs_fuse_worker *workers = malloc(thread_count *
+		sizeof(workers[0]));
+	for (int i = 0; i < thread_count; ++i) {
+		ufs_fuse_worker_create(&workers[i]);
+		if (pthread_create(&workers[i].thread, NULL, ufs_fuse_worker_f,
+				   &workers[i]) != 0)
+			abort();
+	}
+	int sig;
+	sigwait(&signals, &sig);
+	/* The workers see ENODEV, once the kernel drops the mount. */
+	if (umount2(mountpoint, MNT_DETACH) != 0 && errno != EINVAL)
+		perror("ufs_fuse: umount");
+	for (int i = 0; i < thread_count; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		ufs_fuse_worker_destroy(&workers[i]);
+	}
+	free(workers);
+	close(fuse_fd);
+	ufs_destroy();
+	return 0;
+}
@@ -0,0 +1,442 @@
+/*
+ * The daemon of 9_daemon.c, which can be restarted or upgraded without
+ * dropping the clients. Besides the TCP server it listens on a UNIX
+ * control socket. A new instance of the daemon, maybe a new binary,
+ * connects there first. The old instance sends it the listening socket
+ * and all the client sockets with SCM_RIGHTS, waits for a confirmation
+ * and exits. The connections stay alive, a client notices nothing,
+ * and there is no storm of reconnects after each upgrade.
+ *
+ * SIGHUP makes the daemon do it to itself: it starts the binary from
+ * its path again, which is handy when the binary was just replaced.
+ *
+ * The kernel only duplicates the descriptors. Anything of a connection
+ * kept in the user space would have to be sent too. The protocol here
+ * is a number per request, and a half read one is lost.
+ *
+ *   gcc 10_handoff_daemon.c -o daemon
+ *   ./daemon log.txt /tmp/daemon.sock	# Start.
+ *   ./9_client				# Connect, send some numbers.
+ *   ./daemon log.txt /tmp/daemon.sock	# Replace, the client works on.
+ *   kill -HUP <pid>			# The same, by the daemon itself.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+enum {
+	/* Descriptors per message, the kernel allows up to 253. */
+	HANDOFF_BATCH = 64,
+	/* How long the old instance waits for the new one. */
+	HANDOFF_TIMEOUT_MS = 5000,
+};
+
+static volatile sig_atomic_t is_restart_requested = 0;
+
+static void
+on_hup(int signo)
+{
+	(void) signo;
+	is_restart_requested = 1;
+}
+
+static int
+interact(int client_sock)
+{
+	int buffer = 0;
+	ssize_t size = read(client_sock, &buffer, sizeof(buffer));
+	if (size <= 0)
+		return (int) size;
+	printf("Received %d\n", buffer);
+	buffer++;
+	size = write(client_sock, &buffer, sizeof(buffer));
+	if (size > 0)
+		printf("Sent %d\n", buffer);
+	return (int) size;
+}
+
+static int
+daemonize(const char *log_file)
+{
+	if (fork() > 0)
+		exit(0);
+	/* Appended, the instances write into the same log one by one. */
+	int fd = open(log_file, O_CREAT | O_WRONLY | O_APPEND, S_IRWXU);
+	if (fd == -1) {
+		printf("open error\n");
+		return -1;
+	}
+	int rc = dup2(fd, STDOUT_FILENO);
+	close(fd);
+	if (rc == -1) {
+		printf("dup error\n");
+		return -1;
+	}
+	close(STDIN_FILENO);
+	close(STDERR_FILENO);
+	return setsid();
+}
+
+static void
+ctl_addr_create(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+}
+
+static int
+server_create(void)
+{
+	int server = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (server == -1) {
+		printf("socket error = %s\n", strerror(errno));
+		return -1;
+	}
+	int value = 1;
+	setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(12345);
+	inet_aton("127.0.0.1", &addr.sin_addr);
+	if (bind(server, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		printf("bind error = %s\n", strerror(errno));
+		close(server);
+		return -1;
+	}
+	if (listen(server, 128) == -1) {
+		printf("listen error = %s\n", strerror(errno));
+		close(server);
+		return -1;
+	}
+	return server;
+}
+
+/*
+ * The path is taken over from the old instance, if any. It still has
+ * its control socket open, but won't accept anything on it anymore.
+ */
+static int
+ctl_create(const char *path)
+{
+	int ctl = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (ctl == -1) {
+		printf("socket error = %s\n", strerror(errno));
+		return -1;
+	}
+	struct sockaddr_un addr;
+	ctl_addr_create(&addr, path);
+	unlink(path);
+	if (bind(ctl, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+	    listen(ctl, 1) != 0) {
+		printf("control socket error = %s\n", strerror(errno));
+		close(ctl);
+		return -1;
+	}
+	return ctl;
+}
+
+/*
+ * Each message is the count of the descriptors in it, and the
+ * descriptors. A message with less than a full batch is the last one.
+ */
+static int
+fds_send(int sock, const int *fds, int count)
+{
+	int sent = 0;
+	while (1) {
+		int batch = count - sent;
+		if (batch > HANDOFF_BATCH)
+			batch = HANDOFF_BATCH;
+		char control[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))];
+		memset(control, 0, sizeof(control));
+		struct iovec iov;
+		iov.iov_base = &batch;
+		iov.iov_len = sizeof(batch);
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (batch > 0) {
+			msg.msg_control = control;
+			msg.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+			memcpy(CMSG_DATA(cmsg), fds + sent,
+			       batch * sizeof(int));
+		}
+		if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(batch))
+			return -1;
+		sent += batch;
+		if (batch < HANDOFF_BATCH)
+			return 0;
+	}
+}
+
+/* Returns the count of the received descriptors, into the new *fds. */
+static int
+fds_recv(int sock, int **fds)
+{
+	int count = 0;
+	*fds = NULL;
+	while (1) {
+		int batch = 0;
+		char control[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))];
+		struct iovec iov;
+		iov.iov_base = &batch;
+		iov.iov_len = sizeof(batch);
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) !=
+		    sizeof(batch) || (msg.msg_flags & MSG_CTRUNC) != 0)
+			goto error;
+		int got = 0;
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS)
+			got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (got != batch)
+			goto error;
+		*fds = realloc(*fds, (count + batch) * sizeof(int));
+		memcpy(*fds + count, CMSG_DATA(cmsg), batch * sizeof(int));
+		count += batch;
+		if (batch < HANDOFF_BATCH)
+			return count;
+	}
+error:
+	printf("handoff receive error\n");
+	for (int i = 0; i < count; ++i)
+		close((*fds)[i]);
+	free(*fds);
+	*fds = NULL;
+	return -1;
+}
+
+/*
+ * Take the sockets from the running instance. Returns their count, 0
+ * if there is no instance, or -1 on an error. The listening one goes
+ * first.
+ */
+static int
+handoff_take(const char *path, int **fds)
+{
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		return -1;
+	struct sockaddr_un addr;
+	ctl_addr_create(&addr, path);
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		int err = errno;
+		close(sock);
+		if (err == ENOENT || err == ECONNREFUSED)
+			return 0;
+		printf("control connect error = %s\n", strerror(err));
+		return -1;
+	}
+	int count = fds_recv(sock, fds);
+	char ack = 1;
+	if (count > 0 && write(sock, &ack, sizeof(ack)) != sizeof(ack)) {
+		for (int i = 0; i < count; ++i)
+			close((*fds)[i]);
+		free(*fds);
+		count = -1;
+	}
+	close(sock);
+	return count;
+}
+
+/*
+ * Give the sockets to a new instance. Returns 0 when it has confirmed
+ * and this one must exit, otherwise it goes on serving.
+ */
+static int
+handoff_give(int ctl, const struct pollfd *pfds, int pfd_count)
+{
+	int sock = accept4(ctl, NULL, NULL, SOCK_CLOEXEC);
+	if (sock == -1)
+		return -1;
+	printf("Handing off %d clients\n", pfd_count - 2);
+	fflush(stdout);
+	/* pfds[0] is the control socket, it stays here. */
+	int *fds = malloc((pfd_count - 1) * sizeof(int));
+	for (int i = 1; i < pfd_count; ++i)
+		fds[i - 1] = pfds[i].fd;
+	int rc = fds_send(sock, fds, pfd_count - 1);
+	free(fds);
+	struct pollfd pfd = {.fd = sock, .events = POLLIN};
+	char ack = 0;
+	if (rc != 0 || poll(&pfd, 1, HANDOFF_TIMEOUT_MS) != 1 ||
+	    read(sock, &ack, sizeof(ack)) != sizeof(ack)) {
+		printf("Handoff failed, serving on\n");
+		rc = -1;
+	}
+	close(sock);
+	return rc;
+}
+
+/* Start the binary once again, it will take the sockets over. */
+static void
+restart_self(char **argv)
+{
+	char path[1024];
+	ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if (len < 0) {
+		printf("readlink error = %s\n", strerror(errno));
+		return;
+	}
+	path[len] = 0;
+	/*
+	 * A replaced binary shows up as "path (deleted)", the new one is
+	 * at the path itself.
+	 */
+	const char *suffix = " (deleted)";
+	size_t suffix_len = strlen(suffix);
+	if ((size_t) len > suffix_len &&
+	    strcmp(path + len - suffix_len, suffix) == 0)
+		path[len - suffix_len] = 0;
+	printf("Restarting %s\n", path);
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		execv(path, argv);
+		printf("exec error = %s\n", strerror(errno));
+		exit(-1);
+	}
+	if (pid < 0)
+		printf("fork error = %s\n", strerror(errno));
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 3) {
+		printf("Usage: %s <log file> <control socket path>\n", argv[0]);
+		return -1;
+	}
+	const char *ctl_path = argv[2];
+	if (daemonize(argv[1]) == -1) {
+		printf("error 1 = %s\n", strerror(errno));
+		return -1;
+	}
+	/* The restarts fork, and nobody waits for the children. */
+	signal(SIGCHLD, SIG_IGN);
+	printf("Started, pid %d\n", (int) getpid());
+	int *fds = NULL;
+	int fd_count = handoff_take(ctl_path, &fds);
+	if (fd_count < 0)
+		return -1;
+	if (fd_count == 0) {
+		fds = malloc(sizeof(int));
+		fds[0] = server_create();
+		if (fds[0] == -1)
+			return -1;
+		fd_count = 1;
+	} else {
+		printf("Took over %d clients\n", fd_count - 1);
+	}
+	int ctl = ctl_create(ctl_path);
+	if (ctl == -1)
+		return -1;
+	/* The control socket, the server, the clients. */
+	int pfd_count = fd_count + 1;
+	struct pollfd *pfds = malloc(pfd_count * sizeof(pfds[0]));
+	pfds[0].fd = ctl;
+	pfds[0].events = POLLIN;
+	for (int i = 0; i < fd_count; ++i) {
+		pfds[i + 1].fd = fds[i];
+		pfds[i + 1].events = POLLIN;
+	}
+	free(fds);
+	int server = pfds[1].fd;
+
+	/* SIGHUP comes only inside ppoll(), not between the check and it. */
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_hup;
+	sigaction(SIGHUP, &sa, NULL);
+	sigset_t mask, wait_mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigprocmask(SIG_BLOCK, &mask, &wait_mask);
+	sigdelset(&wait_mask, SIGHUP);
+	struct timespec timeout = {.tv_sec = 2, .tv_nsec = 0};
+	while (1) {
+		fflush(stdout);
+		if (is_restart_requested) {
+			is_restart_requested = 0;
+			restart_self(argv);
+		}
+		int nfds = ppoll(pfds, pfd_count, &timeout, &wait_mask);
+		if (nfds == 0) {
+			printf("Timeout\n");
+			continue;
+		}
+		if (nfds == -1) {
+			if (errno == EINTR)
+				continue;
+			printf("error 3 = %s\n", strerror(errno));
+			break;
+		}
+		if ((pfds[0].revents & POLLIN) != 0) {
+			if (handoff_give(ctl, pfds, pfd_count) == 0) {
+				printf("Handed off, exiting\n");
+				break;
+			}
+			continue;
+		}
+		if ((pfds[1].revents & POLLIN) != 0) {
+			int client_sock = accept4(server, NULL, NULL,
+						  SOCK_CLOEXEC);
+			if (client_sock == -1) {
+				printf("error 4 = %s\n", strerror(errno));
+				break;
+			}
+			printf("New client\n");
+			pfd_count++;
+			pfds = realloc(pfds, pfd_count * sizeof(pfds[0]));
+			pfds[pfd_count - 1].fd = client_sock;
+			pfds[pfd_count - 1].events = POLLIN;
+			pfds[pfd_count - 1].revents = 0;
+		}
+		for (int i = 2; i < pfd_count; ++i) {
+			short mask = POLLIN | POLLHUP | POLLERR;
+			if ((pfds[i].revents & mask) == 0)
+				continue;
+			int rc = interact(pfds[i].fd);
+			if (rc > 0)
+				continue;
+			if (rc == -1)
+				printf("error 5 = %s\n", strerror(errno));
+			else
+				printf("Client disconnected\n");
+			close(pfds[i].fd);
+			pfds[i--] = pfds[--pfd_count];
+		}
+	}
+	/*
+	 * After a handoff the other instance holds the same sockets, so
+	 * closing them here affects nobody.
+	 */
+	for (int i = 0; i < pfd_count; ++i)
+		close(pfds[i].fd);
+	free(pfds);
+	fflush(stdout);
+	return 0;
+}
@@ -0,0 +1,385 @@
+/*
+ * External sort of a file of int32 numbers, the grown up version of
+ * 1_simple_sort.c, 2_parallel_sort.c and 3_mem_sort.c:
+ *
+ * - the input is not read with fscanf(), it is mmap'ed. The numbers
+ *   are binary, see the 'gen' mode;
+ * - the file is split into runs, which the forked workers take one by
+ *   one and sort with a radix sort into a temporary file, also
+ *   mmap'ed. The runs are much smaller than the file, so a worker
+ *   needs a bounded amount of memory however big the file is;
+ * - the parent waits for the runs on a futex in the shared memory,
+ *   instead of spinning on a flag. The futex is not private, because
+ *   it is shared by the processes;
+ * - then the runs are merged with a heap of their heads, and the
+ *   result is streamed into the output file by big writes.
+ *
+ *   gcc 16_ext_sort.c
+ *   ./a.out gen in.bin 536870912     # 2 GB of random numbers.
+ *   ./a.out sort in.bin out.bin [workers] [run size in numbers]
+ *   ./a.out check out.bin
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_RUN_SIZE (32 * 1024 * 1024)
+#define WRITE_BUF_SIZE (1024 * 1024)
+
+/* Lives in MAP_SHARED memory, seen by all the processes. */
+struct shared {
+	/* Index of the next run to sort. */
+	uint64_t next_run;
+	/* Count of the sorted runs, the futex word. */
+	uint32_t done_count;
+};
+
+struct run {
+	const int32_t *pos;
+	const int32_t *end;
+};
+
+static void
+die(const char *what)
+{
+	perror(what);
+	exit(-1);
+}
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void
+futex_wait(uint32_t *word, uint32_t value)
+{
+	syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+static void
+futex_wake(uint32_t *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * LSD radix sort by bytes. The sign bit is flipped, so the negative
+ * numbers go first. A pass where all the numbers have the same byte
+ * is skipped. The result is in data, tmp is of the same size.
+ */
+static void
+radix_sort(int32_t *data, int32_t *tmp, uint64_t size)
+{
+	uint64_t counts[4][256];
+	memset(counts, 0, sizeof(counts));
+	for (uint64_t i = 0; i < size; ++i) {
+		uint32_t key = (uint32_t)data[i] ^ 0x80000000;
+		for (int b = 0; b < 4; ++b)
+			++counts[b][(key >> (b * 8)) & 0xff];
+	}
+	int32_t *src = data;
+	int32_t *dst = tmp;
+	for (int b = 0; b < 4; ++b) {
+		uint64_t *count = counts[b];
+		uint32_t first = ((uint32_t)src[0] ^ 0x80000000) >> (b * 8);
+		if (count[first & 0xff] == size)
+			continue;
+		uint64_t offset = 0;
+		for (int i = 0; i < 256; ++i) {
+			uint64_t c = count[i];
+			count[i] = offset;
+			offset += c;
+		}
+		for (uint64_t i = 0; i < size; ++i) {
+			uint32_t key = (uint32_t)src[i] ^ 0x80000000;
+			dst[count[(key >> (b * 8)) & 0xff]++] = src[i];
+		}
+		int32_t *t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != data)
+		memcpy(data, src, size * sizeof(*data));
+}
+
+static void
+sorter(struct shared *shared, const int32_t *in, int32_t *runs,
+       uint64_t size, uint64_t run_size, uint64_t run_count)
+{
+	int32_t *tmp = malloc(run_size * sizeof(*tmp));
+	if (tmp == NULL)
+		die("malloc");
+	while (1) {
+		uint64_t i = __atomic_fetch_add(&shared->next_run, 1,
+						__ATOMIC_RELAXED);
+		if (i >= run_count)
+			break;
+		uint64_t begin = i * run_size;
+		uint64_t count = size - begin < run_size ?
+				 size - begin : run_size;
+		memcpy(runs + begin, in + begin, count * sizeof(*in));
+		radix_sort(runs + begin, tmp, count);
+		/* The parent sees the run after it sees the new count. */
+		__atomic_add_fetch(&shared->done_count, 1, __ATOMIC_RELEASE);
+		futex_wake(&shared->done_count);
+	}
+	free(tmp);
+}
+
+static void
+heap_sift_down(struct run *heap, int size, int i)
+{
+	struct run top = heap[i];
+	while (1) {
+		int child = i * 2 + 1;
+		if (child >= size)
+			break;
+		if (child + 1 < size && *heap[child + 1].pos < *heap[child].pos)
+			++child;
+		if (*top.pos <= *heap[child].pos)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = top;
+}
+
+static void
+write_all(int fd, const void *data, size_t size)
+{
+	const char *pos = data;
+	while (size > 0) {
+		ssize_t rc = write(fd, pos, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			die("write");
+		}
+		pos += rc;
+		size -= rc;
+	}
+}
+
+static void
+merge(int fd, const int32_t *runs, uint64_t size, uint64_t run_size,
+      uint64_t run_count)
+{
+	struct run *heap = malloc(run_count * sizeof(*heap));
+	int32_t *buf = malloc(WRITE_BUF_SIZE);
+	if (heap == NULL || buf == NULL)
+		die("malloc");
+	int heap_size = 0;
+	for (uint64_t i = 0; i < run_count; ++i) {
+		uint64_t begin = i * run_size;
+		uint64_t end = size - begin < run_size ? size : begin + run_size;
+		heap[heap_size].pos = runs + begin;
+		heap[heap_size].end = runs + end;
+		++heap_size;
+	}
+	for (int i = heap_size / 2 - 1; i >= 0; --i)
+		heap_sift_down(heap, heap_size, i);
+	uint64_t buf_cap = WRITE_BUF_SIZE / sizeof(*buf);
+	uint64_t buf_size = 0;
+	while (heap_size > 0) {
+		buf[buf_size++] = *heap[0].pos++;
+		if (heap[0].pos == heap[0].end)
+			heap[0] = heap[--heap_size];
+		if (heap_size > 0)
+			heap_sift_down(heap, heap_size, 0);
+		if (buf_size == buf_cap) {
+			write_all(fd, buf, buf_size * sizeof(*buf));
+			buf_size = 0;
+		}
+	}
+	write_all(fd, buf, buf_size * sizeof(*buf));
+	free(buf);
+	free(heap);
+}
+
+static void *
+map_file(const char *name, uint64_t *size)
+{
+	int fd = open(name, O_RDONLY);
+	if (fd < 0)
+		die("open");
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		die("fstat");
+	*size = st.st_size / sizeof(int32_t);
+	if (*size == 0) {
+		close(fd);
+		return NULL;
+	}
+	void *res = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (res == MAP_FAILED)
+		die("mmap");
+	close(fd);
+	madvise(res, st.st_size, MADV_SEQUENTIAL);
+	return res;
+}
+
+static int
+sort_file(const char *in_name, const char *out_name, int worker_count,
+	  uint64_t run_size)
+{
+	double start = now_sec();
+	uint64_t size;
+	const int32_t *in = map_file(in_name, &size);
+	uint64_t bytes = size * sizeof(int32_t);
+	int out = open(out_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0)
+		die("open");
+	if (size == 0) {
+		close(out);
+		return 0;
+	}
+	/*
+	 * The sorted runs go into a file, not into anonymous memory, so
+	 * the kernel can write them out when they don't fit into RAM.
+	 * It is unlinked right away, and is gone with the last mapping.
+	 */
+	char tmp_name[] = "/tmp/ext_sort_XXXXXX";
+	int tmp = mkstemp(tmp_name);
+	if (tmp < 0)
+		die("mkstemp");
+	unlink(tmp_name);
+	if (ftruncate(tmp, bytes) != 0)
+		die("ftruncate");
+	int32_t *runs = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+			     MAP_SHARED, tmp, 0);
+	if (runs == MAP_FAILED)
+		die("mmap");
+	close(tmp);
+	struct shared *shared = mmap(NULL, sizeof(*shared),
+				     PROT_READ | PROT_WRITE,
+				     MAP_ANON | MAP_SHARED, -1, 0);
+	if (shared == MAP_FAILED)
+		die("mmap");
+	shared->next_run = 0;
+	shared->done_count = 0;
+	uint64_t run_count = (size + run_size - 1) / run_size;
+	if ((uint64_t)worker_count > run_count)
+		worker_count = run_count;
+	for (int i = 0; i < worker_count; ++i) {
+		pid_t pid = fork();
+		if (pid < 0)
+			die("fork");
+		if (pid == 0) {
+			sorter(shared, in, runs, size, run_size, run_count);
+			exit(0);
+		}
+	}
+	uint32_t done;
+	while ((done = __atomic_load_n(&shared->done_count,
+				       __ATOMIC_ACQUIRE)) < run_count)
+		futex_wait(&shared->done_count, done);
+	for (int i = 0; i < worker_count; ++i)
+		wait(NULL);
+	double sorted = now_sec();
+	printf("Sorted %llu runs of up to %llu numbers by %d workers: "
+	       "%.2lf s, %.0lf MB/s\n", (unsigned long long)run_count,
+	       (unsigned long long)run_size, worker_count, sorted - start,
+	       bytes / 1048576.0 / (sorted - start));
+	madvise(runs, bytes, MADV_SEQUENTIAL);
+	merge(out, runs, size, run_size, run_count);
+	if (fsync(out) != 0)
+		die("fsync");
+	close(out);
+	double end = now_sec();
+	printf("Merged: %.2lf s, %.0lf MB/s\n", end - sorted,
+	       bytes / 1048576.0 / (end - sorted));
+	printf("Total %.2lf GB: %.2lf s, %.0lf MB/s\n",
+	       bytes / 1073741824.0, end - start,
+	       bytes / 1048576.0 / (end - start));
+	munmap(runs, bytes);
+	munmap((void *)in, bytes);
+	munmap(shared, sizeof(*shared));
+	return 0;
+}
+
+static int
+gen_file(const char *name, uint64_t size)
+{
+	int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die("open");
+	int32_t *buf = malloc(WRITE_BUF_SIZE);
+	if (buf == NULL)
+		die("malloc");
+	uint64_t buf_cap = WRITE_BUF_SIZE / sizeof(*buf);
+	uint64_t state = time(NULL) | 1;
+	while (size > 0) {
+		uint64_t count = size < buf_cap ? size : buf_cap;
+		for (uint64_t i = 0; i < count; ++i) {
+			/* Xorshift, rand() is too slow for GBs. */
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			buf[i] = (int32_t)state;
+		}
+		write_all(fd, buf, count * sizeof(*buf));
+		size -= count;
+	}
+	free(buf);
+	close(fd);
+	return 0;
+}
+
+static int
+check_file(const char *name)
+{
+	uint64_t size;
+	const int32_t *data = map_file(name, &size);
+	for (uint64_t i = 1; i < size; ++i) {
+		if (data[i - 1] > data[i]) {
+			printf("Not sorted at %llu\n", (unsigned long long)i);
+			return -1;
+		}
+	}
+	printf("Sorted %llu numbers\n", (unsigned long long)size);
+	if (size > 0)
+		munmap((void *)data, size * sizeof(*data));
+	return 0;
+}
+
+int
+main(int argc, const char **argv)
+{
+	if (argc == 4 && strcmp(argv[1], "gen") == 0)
+		return gen_file(argv[2], strtoull(argv[3], NULL, 10));
+	if (argc == 3 && strcmp(argv[1], "check") == 0)
+		return check_file(argv[2]);
+	if (argc >= 4 && argc <= 6 && strcmp(argv[1], "sort") == 0) {
+		int worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+		uint64_t run_size = DEFAULT_RUN_SIZE;
+		if (argc >= 5)
+			worker_count = atoi(argv[4]);
+		if (argc == 6)
+			run_size = strtoull(argv[5], NULL, 10);
+		if (worker_count < 1 || run_size < 1) {
+			printf("Need at least one worker and one number per "
+			       "run\n");
+			return -1;
+		}
+		return sort_file(argv[2], argv[3], worker_count, run_size);
+	}
+	printf("Usage: %s gen <file> <count>\n"
+	       "       %s sort <in> <out> [workers] [run size]\n"
+	       "       %s check <file>\n", argv[0], argv[0], argv[0]);
+	return -1;
+}
@@ -0,0 +1,182 @@
+/*
+ * Single producer single consumer ring of messages in shared memory,
+ * for two processes. The replacement of the one-page handoff of
+ * 3_mem_sort.c with its volatile flags: many messages can be in the
+ * ring at once, the sides only synchronize on the positions, and an
+ * idle side sleeps on a futex instead of spinning with sched_yield().
+ *
+ * The positions only grow and wrap around as 32 bit numbers, the
+ * slot is the position modulo the slot count, which is a power of
+ * two. The producer owns the head, the consumer owns the tail, each
+ * on its own cache line.
+ *
+ * The sleeping is the same as in 8_futex.c, but a side sleeps on the
+ * position of the other one. Before that it sets its waiting flag and
+ * checks the position again. The other side changes the position,
+ * and then checks the flag. With the full barriers between on both
+ * sides, either the sleeper sees the new position, or the other side
+ * sees the flag and wakes it up.
+ */
+#define _GNU_SOURCE
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define SHM_RING_SPIN_COUNT 1000
+
+struct shm_ring_slot {
+	uint32_t size;
+	char data[];
+};
+
+struct shm_ring {
+	/* Written by the producer only. */
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t is_producer_waiting;
+	/* Written by the consumer only. */
+	uint32_t tail __attribute__((aligned(64)));
+	uint32_t is_consumer_waiting;
+	/* Constant after the creation. */
+	uint32_t slot_count __attribute__((aligned(64)));
+	uint32_t slot_size;
+	char slots[] __attribute__((aligned(64)));
+};
+
+static inline void
+shm_ring_futex_wait(uint32_t *word, uint32_t value)
+{
+	/* Not FUTEX_PRIVATE, the memory is shared by the processes. */
+	syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+static inline void
+shm_ring_futex_wake(uint32_t *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Create a ring in shared anonymous memory, before fork(). The slot
+ * count must be a power of two, a message is at most max_msg_size.
+ * For not related processes the same can be placed into shm_open()
+ * memory.
+ */
+static inline struct shm_ring *
+shm_ring_new(uint32_t slot_count, uint32_t max_msg_size)
+{
+	if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0)
+		return NULL;
+	uint32_t slot_size = sizeof(struct shm_ring_slot) + max_msg_size;
+	slot_size = (slot_size + 63) & ~63u;
+	size_t size = sizeof(struct shm_ring) + (size_t)slot_size * slot_count;
+	struct shm_ring *ring = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				     MAP_ANON | MAP_SHARED, -1, 0);
+	if (ring == MAP_FAILED)
+		return NULL;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->is_producer_waiting = 0;
+	ring->is_consumer_waiting = 0;
+	ring->slot_count = slot_count;
+	ring->slot_size = slot_size;
+	return ring;
+}
+
+static inline void
+shm_ring_delete(struct shm_ring *ring)
+{
+	munmap(ring, sizeof(*ring) + (size_t)ring->slot_size *
+	       ring->slot_count);
+}
+
+static inline uint32_t
+shm_ring_max_msg_size(const struct shm_ring *ring)
+{
+	return ring->slot_size - sizeof(struct shm_ring_slot);
+}
+
+static inline struct shm_ring_slot *
+shm_ring_slot(struct shm_ring *ring, uint32_t pos)
+{
+	return (struct shm_ring_slot *)(ring->slots + (size_t)ring->slot_size *
+					(pos & (ring->slot_count - 1)));
+}
+
+/*
+ * Wait until the position of the other side is not equal to the given
+ * value any more. Spins a bit first, because the other side is often
+ * right in the middle of a message.
+ */
+static inline uint32_t
+shm_ring_wait(uint32_t *pos, uint32_t *is_waiting, uint32_t old)
+{
+	uint32_t cur;
+	for (int i = 0; i < SHM_RING_SPIN_COUNT; ++i) {
+		cur = __atomic_load_n(pos, __ATOMIC_ACQUIRE);
+		if (cur != old)
+			return cur;
+	}
+	while (1) {
+		__atomic_store_n(is_waiting, 1, __ATOMIC_SEQ_CST);
+		cur = __atomic_load_n(pos, __ATOMIC_SEQ_CST);
+		if (cur != old)
+			break;
+		shm_ring_futex_wait(pos, old);
+	}
+	__atomic_store_n(is_waiting, 0, __ATOMIC_RELAXED);
+	return cur;
+}
+
+/* Publish the new own position, wake the other side if it sleeps. */
+static inline void
+shm_ring_publish(uint32_t *pos, uint32_t *is_other_waiting, uint32_t value)
+{
+	__atomic_store_n(pos, value, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(is_other_waiting, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(is_other_waiting, 0, __ATOMIC_RELAXED);
+		shm_ring_futex_wake(pos);
+	}
+}
+
+/* Send a message, blocks while the ring is full. */
+static inline bool
+shm_ring_send(struct shm_ring *ring, const void *data, uint32_t size)
+{
+	if (size > shm_ring_max_msg_size(ring))
+		return false;
+	uint32_t head = ring->head;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	while (head - tail == ring->slot_count) {
+		tail = shm_ring_wait(&ring->tail, &ring->is_producer_waiting,
+				     tail);
+	}
+	struct shm_ring_slot *slot = shm_ring_slot(ring, head);
+	slot->size = size;
+	memcpy(slot->data, data, size);
+	shm_ring_publish(&ring->head, &ring->is_consumer_waiting, head + 1);
+	return true;
+}
+
+/*
+ * Receive a message into the buffer of at least the max message size,
+ * blocks while the ring is empty. Returns the message size.
+ */
+static inline uint32_t
+shm_ring_recv(struct shm_ring *ring, void *data)
+{
+	uint32_t tail = ring->tail;
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+		head = shm_ring_wait(&ring->head, &ring->is_consumer_waiting,
+				     head);
+	}
+	struct shm_ring_slot *slot = shm_ring_slot(ring, tail);
+	uint32_t size = slot->size;
+	memcpy(data, slot->data, size);
+	shm_ring_publish(&ring->tail, &ring->is_producer_waiting, tail + 1);
+	return size;
+}
@@ -0,0 +1,214 @@
+/*
+ * Messages from one process to another through the shared memory ring
+ * of 17_shm_ring.h, against the kernel channels of the other examples
+ * here: a pipe, a socketpair, and a SysV message queue. The child
+ * sends, the parent receives and checks the order.
+ *
+ *   gcc 18_shm_ring_bench.c
+ *   ./a.out [message count]
+ */
+#include "17_shm_ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/* SysV messages can't be bigger than msgmax, 8192 by default. */
+#define MAX_MSG_SIZE 4096
+#define RING_SLOT_COUNT 256
+
+enum channel_type {
+	CHANNEL_SHM_RING,
+	CHANNEL_PIPE,
+	CHANNEL_SOCKETPAIR,
+	CHANNEL_MSG_QUEUE,
+	CHANNEL_TYPE_MAX,
+};
+
+static const char *channel_names[] = {
+	"shm ring", "pipe", "socketpair", "msg queue",
+};
+
+struct channel {
+	enum channel_type type;
+	struct shm_ring *ring;
+	int fds[2];
+	int queue_id;
+};
+
+struct msg_buf {
+	long type;
+	char data[MAX_MSG_SIZE];
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+channel_create(struct channel *ch, enum channel_type type)
+{
+	ch->type = type;
+	int rc = 0;
+	switch (type) {
+	case CHANNEL_SHM_RING:
+		ch->ring = shm_ring_new(RING_SLOT_COUNT, MAX_MSG_SIZE);
+		rc = ch->ring == NULL ? -1 : 0;
+		break;
+	case CHANNEL_PIPE:
+		rc = pipe(ch->fds);
+		break;
+	case CHANNEL_SOCKETPAIR:
+		rc = socketpair(AF_UNIX, SOCK_STREAM, 0, ch->fds);
+		break;
+	case CHANNEL_MSG_QUEUE:
+		ch->queue_id = msgget(IPC_PRIVATE, IPC_CREAT | 0600);
+		rc = ch->queue_id;
+		break;
+	default:
+		abort();
+	}
+	if (rc < 0) {
+		perror("channel create");
+		exit(-1);
+	}
+}
+
+static void
+channel_delete(struct channel *ch)
+{
+	switch (ch->type) {
+	case CHANNEL_SHM_RING:
+		shm_ring_delete(ch->ring);
+		break;
+	case CHANNEL_PIPE:
+	case CHANNEL_SOCKETPAIR:
+		close(ch->fds[0]);
+		close(ch->fds[1]);
+		break;
+	case CHANNEL_MSG_QUEUE:
+		msgctl(ch->queue_id, IPC_RMID, NULL);
+		break;
+	default:
+		abort();
+	}
+}
+
+/* The pipe and the socket are streams, the messages are glued. */
+static void
+fd_io_full(int fd, char *data, size_t size, bool is_write)
+{
+	while (size > 0) {
+		ssize_t rc = is_write ? write(fd, data, size) :
+			     read(fd, data, size);
+		if (rc <= 0) {
+			perror("io");
+			exit(-1);
+		}
+		data += rc;
+		size -= rc;
+	}
+}
+
+static void
+channel_send(struct channel *ch, struct msg_buf *msg, uint32_t size)
+{
+	switch (ch->type) {
+	case CHANNEL_SHM_RING:
+		shm_ring_send(ch->ring, msg->data, size);
+		break;
+	case CHANNEL_PIPE:
+	case CHANNEL_SOCKETPAIR:
+		fd_io_full(ch->fds[1], msg->data, size, true);
+		break;
+	case CHANNEL_MSG_QUEUE:
+		msg->type = 1;
+		if (msgsnd(ch->queue_id, msg, size, 0) != 0) {
+			perror("msgsnd");
+			exit(-1);
+		}
+		break;
+	default:
+		abort();
+	}
+}
+
+static void
+channel_recv(struct channel *ch, struct msg_buf *msg, uint32_t size)
+{
+	switch (ch->type) {
+	case CHANNEL_SHM_RING:
+		if (shm_ring_recv(ch->ring, msg->data) != size)
+			abort();
+		break;
+	case CHANNEL_PIPE:
+	case CHANNEL_SOCKETPAIR:
+		fd_io_full(ch->fds[0], msg->data, size, false);
+		break;
+	case CHANNEL_MSG_QUEUE:
+		if (msgrcv(ch->queue_id, msg, size, 0, 0) != size) {
+			perror("msgrcv");
+			exit(-1);
+		}
+		break;
+	default:
+		abort();
+	}
+}
+
+static void
+bench(enum channel_type type, uint32_t size, uint64_t count)
+{
+	struct channel ch;
+	struct msg_buf msg;
+	memset(&msg, 0, sizeof(msg));
+	channel_create(&ch, type);
+	uint64_t start = now_ns();
+	pid_t pid = fork();
+	if (pid == 0) {
+		for (uint64_t i = 0; i < count; ++i) {
+			memcpy(msg.data, &i, sizeof(i));
+			channel_send(&ch, &msg, size);
+		}
+		/* Not exit(), it would flush the stdout copy again. */
+		_exit(0);
+	}
+	for (uint64_t i = 0; i < count; ++i) {
+		channel_recv(&ch, &msg, size);
+		uint64_t seq;
+		memcpy(&seq, msg.data, sizeof(seq));
+		if (seq != i) {
+			printf("Got message %llu instead of %llu\n",
+			       (unsigned long long)seq, (unsigned long long)i);
+			exit(-1);
+		}
+	}
+	waitpid(pid, NULL, 0);
+	double sec = (now_ns() - start) / 1000000000.0;
+	printf("%-10s %4u bytes: %9.0lf msg/s, %6.0lf MB/s\n",
+	       channel_names[type], size, count / sec,
+	       count * size / 1048576.0 / sec);
+	channel_delete(&ch);
+}
+
+int
+main(int argc, const char **argv)
+{
+	uint64_t count = 1000000;
+	if (argc > 1)
+		count = strtoull(argv[1], NULL, 10);
+	const uint32_t sizes[] = {64, MAX_MSG_SIZE};
+	for (int i = 0; i < 2; ++i) {
+		for (int t = 0; t < CHANNEL_TYPE_MAX; ++t)
+			bench(t, sizes[i], count);
+	}
+	return 0;
+}
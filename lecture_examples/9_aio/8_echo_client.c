@@ -0,0 +1,259 @@
+/*
+ * The load for 8_echo_server.c, grown from 4_client.c. Opens many
+ * connections, and each of them in a loop sends a request and waits
+ * for all of it to come back. The time from the send to the end of
+ * the echo is the latency of the request. At the end prints requests
+ * per second and the latency percentiles.
+ *
+ * One thread waits for all the connections, on epoll on Linux and on
+ * poll otherwise. The client takes CPU too, so on few cores it is a
+ * part of what is measured.
+ *
+ *   gcc 8_echo_client.c -o client
+ *   ./client [connections] [seconds] [request size] [port]
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
+
+#define MAX_REQUEST_SIZE 16384
+#define EVENT_BATCH 1024
+
+struct client {
+	int fd;
+	/* Bytes of the echo got back so far. */
+	int received;
+	uint64_t sent_ns;
+};
+
+static struct client *clients;
+static int client_count;
+static int request_size;
+static char request[MAX_REQUEST_SIZE];
+
+/* Latencies of all the requests, in ns. */
+static uint64_t *latencies;
+static uint64_t latency_count;
+static uint64_t latency_cap;
+
+static void
+die(const char *what)
+{
+	printf("%s error = %s\n", what, strerror(errno));
+	exit(-1);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+latency_add(uint64_t ns)
+{
+	if (latency_count == latency_cap) {
+		latency_cap = latency_cap == 0 ? 1024 * 1024 : latency_cap * 2;
+		latencies = realloc(latencies,
+				    latency_cap * sizeof(*latencies));
+		if (latencies == NULL)
+			die("realloc");
+	}
+	latencies[latency_count++] = ns;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t l = *(const uint64_t *)a;
+	uint64_t r = *(const uint64_t *)b;
+	return l < r ? -1 : l > r;
+}
+
+static void
+client_send(struct client *c)
+{
+	c->received = 0;
+	c->sent_ns = now_ns();
+	/* Small, fits into the empty socket buffer at once. */
+	if (send(c->fd, request, request_size, MSG_NOSIGNAL) != request_size)
+		die("send");
+}
+
+/* Read the echo. Returns 1 when a request is done. */
+static int
+client_recv(struct client *c)
+{
+	static char buf[MAX_REQUEST_SIZE];
+	ssize_t rc = recv(c->fd, buf, request_size - c->received, 0);
+	if (rc == 0) {
+		printf("Server closed the connection\n");
+		exit(-1);
+	}
+	if (rc < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		die("recv");
+	}
+	c->received += rc;
+	if (c->received < request_size)
+		return 0;
+	latency_add(now_ns() - c->sent_ns);
+	return 1;
+}
+
+#if defined(__linux__)
+
+static int ep;
+
+static void
+wait_create(void)
+{
+	ep = epoll_create1(0);
+	if (ep < 0)
+		die("epoll_create");
+	for (int i = 0; i < client_count; ++i) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &clients[i];
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, clients[i].fd, &ev) != 0)
+			die("epoll_ctl");
+	}
+}
+
+/* Wait for the readable clients, returns how many are put into res. */
+static int
+wait_ready(struct client **res)
+{
+	static struct epoll_event events[EVENT_BATCH];
+	int count = epoll_wait(ep, events, EVENT_BATCH, 1000);
+	if (count < 0) {
+		if (errno == EINTR)
+			return 0;
+		die("epoll_wait");
+	}
+	for (int i = 0; i < count; ++i)
+		res[i] = events[i].data.ptr;
+	return count;
+}
+
+#else /* !defined(__linux__) */
+
+static struct pollfd *pfds;
+
+static void
+wait_create(void)
+{
+	pfds = malloc(client_count * sizeof(*pfds));
+	if (pfds == NULL)
+		die("malloc");
+	for (int i = 0; i < client_count; ++i) {
+		pfds[i].fd = clients[i].fd;
+		pfds[i].events = POLLIN;
+	}
+}
+
+static int
+wait_ready(struct client **res)
+{
+	int rc = poll(pfds, client_count, 1000);
+	if (rc < 0) {
+		if (errno == EINTR)
+			return 0;
+		die("poll");
+	}
+	int count = 0;
+	for (int i = 0; i < client_count && count < EVENT_BATCH; ++i) {
+		if (pfds[i].revents != 0)
+			res[count++] = &clients[i];
+	}
+	return count;
+}
+
+#endif /* !defined(__linux__) */
+
+int
+main(int argc, const char **argv)
+{
+	client_count = argc > 1 ? atoi(argv[1]) : 100;
+	int seconds = argc > 2 ? atoi(argv[2]) : 5;
+	request_size = argc > 3 ? atoi(argv[3]) : 64;
+	int port = argc > 4 ? atoi(argv[4]) : 12345;
+	if (client_count < 1 || seconds < 1 || request_size < 1 ||
+	    request_size > MAX_REQUEST_SIZE) {
+		printf("Usage: %s [connections] [seconds] [request size <= %d] "
+		       "[port]\n", argv[0], MAX_REQUEST_SIZE);
+		return -1;
+	}
+	memset(request, 'x', request_size);
+	clients = calloc(client_count, sizeof(*clients));
+	if (clients == NULL)
+		die("calloc");
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	inet_aton("127.0.0.1", &addr.sin_addr);
+	for (int i = 0; i < client_count; ++i) {
+		int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (fd < 0)
+			die("socket");
+		if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+			die("connect");
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		clients[i].fd = fd;
+	}
+	wait_create();
+	/*
+	 * All the requests are sent at once, then each connection sends
+	 * the next one right when the previous is done.
+	 */
+	uint64_t start = now_ns();
+	uint64_t deadline = start + seconds * 1000000000ull;
+	for (int i = 0; i < client_count; ++i)
+		client_send(&clients[i]);
+	static struct client *ready[EVENT_BATCH];
+	uint64_t now = start;
+	while (now < deadline) {
+		int count = wait_ready(ready);
+		for (int i = 0; i < count; ++i) {
+			if (client_recv(ready[i]))
+				client_send(ready[i]);
+		}
+		now = now_ns();
+	}
+	double sec = (now - start) / 1000000000.0;
+	qsort(latencies, latency_count, sizeof(*latencies), cmp_u64);
+	if (latency_count == 0) {
+		printf("No requests done\n");
+		return -1;
+	}
+	printf("%d connections, %d bytes: %.0lf req/s, p50 %.1lf us, "
+	       "p99 %.1lf us, max %.1lf us\n", client_count, request_size,
+	       latency_count / sec,
+	       latencies[latency_count / 2] / 1000.0,
+	       latencies[latency_count * 99 / 100] / 1000.0,
+	       latencies[latency_count - 1] / 1000.0);
+	for (int i = 0; i < client_count; ++i)
+		close(clients[i].fd);
+	free(clients);
+	free(latencies);
+	return 0;
+}
@@ -0,0 +1,602 @@
+/*
+ * The servers of 4_server_select.c - 7_server_epoll.c as one echo
+ * server, where the way to wait for the events is chosen by the
+ * first argument:
+ *
+ * - select: the fd sets are rebuilt and scanned each time, and an fd
+ *   can't be >= FD_SETSIZE, usually 1024;
+ * - poll: an array of all the fds, scanned each time;
+ * - epoll-lt: level triggered epoll, one recv and send per event;
+ * - epoll-et: edge triggered, each socket is added once for both
+ *   directions, and must be read until EAGAIN on each event;
+ * - kqueue: on Mac and BSD;
+ * - io_uring: on Linux. Not the readiness, but the completions: the
+ *   recv and send themselves are submitted to the kernel.
+ *
+ * Each connection gets back all the bytes it sends, in the same
+ * order. The load is given by 8_echo_client.c.
+ *
+ *   gcc 8_echo_server.c -o server
+ *   ./server <backend> [port]
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+	defined(__OpenBSD__)
+#include <sys/event.h>
+#define HAVE_KQUEUE 1
+#endif
+
+#define BUF_SIZE 16384
+#define EVENT_BATCH 1024
+
+enum conn_want {
+	WANT_CLOSE,
+	WANT_READ,
+	WANT_WRITE,
+};
+
+struct conn {
+	int fd;
+	/* What the backend waits for now. */
+	enum conn_want want;
+	/* Received and not yet sent back. */
+	int size;
+	int sent;
+	char buf[BUF_SIZE];
+};
+
+static int server_fd;
+/* Connections by fd, for the backends which only give the fds. */
+static struct conn **conns;
+static int conns_cap;
+
+static void
+die(const char *what)
+{
+	printf("%s error = %s\n", what, strerror(errno));
+	exit(-1);
+}
+
+static void
+make_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+		die("fcntl");
+}
+
+static struct conn *
+conn_new(int fd)
+{
+	if (fd >= conns_cap) {
+		close(fd);
+		return NULL;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	struct conn *c = malloc(sizeof(*c));
+	if (c == NULL)
+		die("malloc");
+	c->fd = fd;
+	c->want = WANT_READ;
+	c->size = 0;
+	c->sent = 0;
+	conns[fd] = c;
+	return c;
+}
+
+static void
+conn_delete(struct conn *c)
+{
+	conns[c->fd] = NULL;
+	close(c->fd);
+	free(c);
+}
+
+/*
+ * Accept a new connection, NULL when there are no more. In the
+ * non-blocking mode the readiness of the listening socket can be
+ * stale, so EAGAIN is fine.
+ */
+static struct conn *
+conn_accept(void)
+{
+	while (1) {
+		int fd = accept(server_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == ECONNABORTED || errno == EINTR)
+				return NULL;
+			die("accept");
+		}
+		make_nonblock(fd);
+		struct conn *c = conn_new(fd);
+		if (c != NULL)
+			return c;
+		printf("fd %d is too big for the backend, closed\n", fd);
+	}
+}
+
+/*
+ * Echo what is there. With is_drain the socket is read until EAGAIN,
+ * as edge triggered events require. Otherwise it is one recv, and the
+ * level triggered event comes again when there is more.
+ */
+static enum conn_want
+conn_process(struct conn *c, bool is_drain)
+{
+	bool is_read = false;
+	while (1) {
+		while (c->sent < c->size) {
+			ssize_t rc = send(c->fd, c->buf + c->sent,
+					  c->size - c->sent, MSG_NOSIGNAL);
+			if (rc < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return WANT_WRITE;
+				if (errno == EINTR)
+					continue;
+				return WANT_CLOSE;
+			}
+			c->sent += rc;
+		}
+		c->size = 0;
+		c->sent = 0;
+		if (is_read && !is_drain)
+			return WANT_READ;
+		ssize_t rc = recv(c->fd, c->buf, BUF_SIZE, 0);
+		if (rc == 0)
+			return WANT_CLOSE;
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return WANT_READ;
+			if (errno == EINTR)
+				continue;
+			return WANT_CLOSE;
+		}
+		c->size = rc;
+		is_read = true;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+static void
+run_select(void)
+{
+	if (conns_cap > FD_SETSIZE)
+		conns_cap = FD_SETSIZE;
+	fd_set rset;
+	fd_set wset;
+	while (1) {
+		FD_ZERO(&rset);
+		FD_ZERO(&wset);
+		FD_SET(server_fd, &rset);
+		int max_fd = server_fd;
+		for (int fd = 0; fd < conns_cap; ++fd) {
+			struct conn *c = conns[fd];
+			if (c == NULL)
+				continue;
+			FD_SET(fd, c->want == WANT_READ ? &rset : &wset);
+			if (fd > max_fd)
+				max_fd = fd;
+		}
+		int count = select(max_fd + 1, &rset, &wset, NULL, NULL);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			die("select");
+		}
+		if (FD_ISSET(server_fd, &rset)) {
+			while (conn_accept() != NULL)
+				;
+		}
+		for (int fd = 0; fd <= max_fd; ++fd) {
+			struct conn *c = conns[fd];
+			if (c == NULL || (!FD_ISSET(fd, &rset) &&
+					  !FD_ISSET(fd, &wset)))
+				continue;
+			c->want = conn_process(c, false);
+			if (c->want == WANT_CLOSE)
+				conn_delete(c);
+		}
+	}
+}
+
+static void
+run_poll(void)
+{
+	/* The listening socket is the first, the others are the conns. */
+	struct pollfd *fds = malloc(conns_cap * sizeof(*fds));
+	if (fds == NULL)
+		die("malloc");
+	int count = 1;
+	fds[0].fd = server_fd;
+	fds[0].events = POLLIN;
+	while (1) {
+		int rc = poll(fds, count, -1);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			die("poll");
+		}
+		for (int i = 1; i < count; ++i) {
+			if (fds[i].revents == 0)
+				continue;
+			struct conn *c = conns[fds[i].fd];
+			c->want = conn_process(c, false);
+			if (c->want == WANT_CLOSE) {
+				conn_delete(c);
+				/*
+				 * The last one takes the place, it is not
+				 * visited yet.
+				 */
+				fds[i--] = fds[--count];
+				continue;
+			}
+			fds[i].events = c->want == WANT_READ ? POLLIN : POLLOUT;
+		}
+		if (fds[0].revents != 0) {
+			struct conn *c;
+			while ((c = conn_accept()) != NULL) {
+				fds[count].fd = c->fd;
+				fds[count].events = POLLIN;
+				fds[count].revents = 0;
+				++count;
+			}
+		}
+	}
+}
+
+#if defined(__linux__)
+
+static void
+run_epoll(bool is_et)
+{
+	int ep = epoll_create1(0);
+	if (ep < 0)
+		die("epoll_create");
+	struct epoll_event ev;
+	ev.data.ptr = NULL;
+	ev.events = EPOLLIN;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, server_fd, &ev) != 0)
+		die("epoll_ctl");
+	struct epoll_event *events = malloc(EVENT_BATCH * sizeof(*events));
+	if (events == NULL)
+		die("malloc");
+	while (1) {
+		int count = epoll_wait(ep, events, EVENT_BATCH, -1);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			die("epoll_wait");
+		}
+		for (int i = 0; i < count; ++i) {
+			struct conn *c = events[i].data.ptr;
+			if (c == NULL) {
+				while ((c = conn_accept()) != NULL) {
+					ev.data.ptr = c;
+					ev.events = is_et ? EPOLLIN | EPOLLOUT |
+						EPOLLET : EPOLLIN;
+					if (epoll_ctl(ep, EPOLL_CTL_ADD, c->fd,
+						      &ev) != 0)
+						die("epoll_ctl");
+				}
+				continue;
+			}
+			enum conn_want want = conn_process(c, is_et);
+			if (want == WANT_CLOSE) {
+				/* Close removes it from the epoll. */
+				conn_delete(c);
+				continue;
+			}
+			if (is_et || want == c->want)
+				continue;
+			c->want = want;
+			ev.data.ptr = c;
+			ev.events = want == WANT_READ ? EPOLLIN : EPOLLOUT;
+			if (epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev) != 0)
+				die("epoll_ctl");
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Minimal io_uring by the raw syscalls, only what the server needs. Each
+// connection has one recv or send in flight, the accept is re-armed
+// after each completion.
+
+struct uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Queued and not yet submitted. */
+	unsigned to_submit;
+};
+
+static void
+uring_create(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		die("io_uring_setup");
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQ_RING);
+	char *cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED)
+		die("mmap");
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ring->to_submit = 0;
+}
+
+static void
+uring_enter(struct uring *ring, unsigned wait_count)
+{
+	while (syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+		       wait_count, wait_count > 0 ? IORING_ENTER_GETEVENTS : 0,
+		       NULL, 0) < 0) {
+		if (errno != EINTR)
+			die("io_uring_enter");
+	}
+	ring->to_submit = 0;
+}
+
+static void
+uring_prep(struct uring *ring, int opcode, int fd, void *buf, unsigned size,
+	   void *user_data)
+{
+	/* The connections can be more than the entries, submit the full. */
+	if (ring->to_submit == ring->sq_entries)
+		uring_enter(ring, 0);
+	unsigned tail = *ring->sq_tail;
+	unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = size;
+	sqe->msg_flags = opcode == IORING_OP_SEND ? MSG_NOSIGNAL : 0;
+	sqe->user_data = (uint64_t)(uintptr_t)user_data;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++ring->to_submit;
+}
+
+static void
+uring_prep_conn(struct uring *ring, struct conn *c)
+{
+	if (c->sent < c->size) {
+		uring_prep(ring, IORING_OP_SEND, c->fd, c->buf + c->sent,
+			   c->size - c->sent, c);
+	} else {
+		uring_prep(ring, IORING_OP_RECV, c->fd, c->buf, BUF_SIZE, c);
+	}
+}
+
+static void
+run_uring(void)
+{
+	struct uring ring;
+	uring_create(&ring, 4096);
+	uring_prep(&ring, IORING_OP_ACCEPT, server_fd, NULL, 0, NULL);
+	while (1) {
+		uring_enter(&ring, 1);
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe =
+				&ring.cqes[head & *ring.cq_mask];
+			struct conn *c = (struct conn *)(uintptr_t)
+				cqe->user_data;
+			int res = cqe->res;
+			if (c == NULL) {
+				if (res >= 0 && (c = conn_new(res)) != NULL)
+					uring_prep_conn(&ring, c);
+				else if (res >= 0)
+					printf("fd %d is too big, closed\n",
+					       res);
+				uring_prep(&ring, IORING_OP_ACCEPT, server_fd,
+					   NULL, 0, NULL);
+				continue;
+			}
+			if (res == -EINTR || res == -EAGAIN) {
+				uring_prep_conn(&ring, c);
+				continue;
+			}
+			if (res <= 0) {
+				conn_delete(c);
+				continue;
+			}
+			if (c->sent < c->size) {
+				c->sent += res;
+				if (c->sent == c->size) {
+					c->size = 0;
+					c->sent = 0;
+				}
+			} else {
+				c->size = res;
+			}
+			uring_prep_conn(&ring, c);
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+#endif /* defined(__linux__) */
+
+#if defined(HAVE_KQUEUE)
+
+static void
+run_kqueue(void)
+{
+	int kq = kqueue();
+	if (kq < 0)
+		die("kqueue");
+	struct kevent ev;
+	EV_SET(&ev, server_fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	if (kevent(kq, &ev, 1, NULL, 0, NULL) != 0)
+		die("kevent");
+	struct kevent *events = malloc(EVENT_BATCH * sizeof(*events));
+	if (events == NULL)
+		die("malloc");
+	while (1) {
+		int count = kevent(kq, NULL, 0, events, EVENT_BATCH, NULL);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			die("kevent");
+		}
+		for (int i = 0; i < count; ++i) {
+			struct conn *c = events[i].udata;
+			if (c == NULL) {
+				while ((c = conn_accept()) != NULL) {
+					EV_SET(&ev, c->fd, EVFILT_READ, EV_ADD,
+					       0, 0, c);
+					if (kevent(kq, &ev, 1, NULL, 0,
+						   NULL) != 0)
+						die("kevent");
+				}
+				continue;
+			}
+			enum conn_want want = conn_process(c, false);
+			if (want == WANT_CLOSE) {
+				conn_delete(c);
+				continue;
+			}
+			if (want == c->want)
+				continue;
+			/* One filter per direction, switch them. */
+			struct kevent change[2];
+			int old = c->want == WANT_READ ? EVFILT_READ :
+				  EVFILT_WRITE;
+			int new = want == WANT_READ ? EVFILT_READ :
+				  EVFILT_WRITE;
+			EV_SET(&change[0], c->fd, old, EV_DELETE, 0, 0, c);
+			EV_SET(&change[1], c->fd, new, EV_ADD, 0, 0, c);
+			if (kevent(kq, change, 2, NULL, 0, NULL) != 0)
+				die("kevent");
+			c->want = want;
+		}
+	}
+}
+
+#endif /* defined(HAVE_KQUEUE) */
+
+int
+main(int argc, const char **argv)
+{
+	const char *backends = "select, poll"
+#if defined(__linux__)
+		", epoll-lt, epoll-et, io_uring"
+#endif
+#if defined(HAVE_KQUEUE)
+		", kqueue"
+#endif
+		;
+	if (argc < 2) {
+		printf("Usage: %s <backend> [port]\nBackends: %s\n",
+		       argv[0], backends);
+		return -1;
+	}
+	int port = argc > 2 ? atoi(argv[2]) : 12345;
+	/* The limit of the fds is the limit of the connections. */
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+		die("getrlimit");
+	conns_cap = rl.rlim_cur;
+	conns = calloc(conns_cap, sizeof(*conns));
+	if (conns == NULL)
+		die("calloc");
+
+	server_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (server_fd == -1)
+		die("socket");
+	int one = 1;
+	setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	inet_aton("127.0.0.1", &addr.sin_addr);
+	if (bind(server_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+		die("bind");
+	if (listen(server_fd, SOMAXCONN) == -1)
+		die("listen");
+
+	const char *name = argv[1];
+	if (strcmp(name, "select") == 0) {
+		make_nonblock(server_fd);
+		run_select();
+	} else if (strcmp(name, "poll") == 0) {
+		make_nonblock(server_fd);
+		run_poll();
+#if defined(__linux__)
+	} else if (strcmp(name, "epoll-lt") == 0) {
+		make_nonblock(server_fd);
+		run_epoll(false);
+	} else if (strcmp(name, "epoll-et") == 0) {
+		make_nonblock(server_fd);
+		run_epoll(true);
+	} else if (strcmp(name, "io_uring") == 0) {
+		run_uring();
+#endif
+#if defined(HAVE_KQUEUE)
+	} else if (strcmp(name, "kqueue") == 0) {
+		make_nonblock(server_fd);
+		run_kqueue();
+#endif
+	} else {
+		printf("Unknown backend %s, known: %s\n", name, backends);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Bump arena. The allocations are carved one after another from big
+ * blocks and are never freed one by one. Instead the whole arena is
+ * reset, which keeps the blocks for the next round. For the memory of
+ * one request, one event loop iteration, one parsed message.
+ *
+ * heap_help sees only the blocks, so when it is linked in, the arena
+ * does a malloc() per allocation and free()s them on reset. Then the
+ * leaks and the stacks are reported per object, the same as without
+ * the arena, and the reset ones are trashed. ALLOC_USE_MALLOC set to 1
+ * or 0 forces it on or off, for example for ASAN.
+ */
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+};
+
+/** One object of the malloc() mode. */
+struct arena_obj {
+	struct arena_obj *next;
+};
+
+struct arena {
+	/** All the normal blocks, the used ones first. */
+	struct arena_block *blocks;
+	/** The block to allocate from, NULL when there are none yet. */
+	struct arena_block *cur;
+	/** The blocks of the allocations too big for a normal block. */
+	struct arena_block *big;
+	/** The objects of the malloc() mode. */
+	struct arena_obj *objs;
+	size_t block_size;
+	/** Bytes allocated since the last reset. */
+	size_t used;
+};
+
+enum {
+	/** Alignment of each allocation, enough for any type. */
+	ARENA_ALIGN = 16,
+	ARENA_MIN_BLOCK_SIZE = 4096,
+	ARENA_DEFAULT_BLOCK_SIZE = 64 * 1024,
+};
+
+#ifndef ALLOC_USE_MALLOC
+#if defined(__ELF__) && defined(__GNUC__)
+/** Defined only when heap_help is linked in. */
+uint64_t
+heaph_get_alloc_count(void) __attribute__((weak));
+#endif
+#endif /* ALLOC_USE_MALLOC */
+
+/**
+ * return TRUE if each allocation is a malloc() of its own
+ */
+static inline bool
+arena_use_malloc(void)
+{
+#if defined(ALLOC_USE_MALLOC)
+	return ALLOC_USE_MALLOC;
+#elif defined(__ELF__) && defined(__GNUC__)
+	return heaph_get_alloc_count != NULL;
+#else
+	return false;
+#endif
+}
+
+static inline size_t
+arena_align_up(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+/** Offset of the data in a block, or of an object in the malloc() mode. */
+#define ARENA_BLOCK_HEADER_SIZE arena_align_up(sizeof(struct arena_block))
+#define ARENA_OBJ_HEADER_SIZE arena_align_up(sizeof(struct arena_obj))
+
+/**
+ * init arena, block_size is the size of each block, 0 for the default
+ */
+static inline void
+arena_create(struct arena *arena, size_t block_size)
+{
+	if (block_size == 0)
+		block_size = ARENA_DEFAULT_BLOCK_SIZE;
+	else if (block_size < ARENA_MIN_BLOCK_SIZE)
+		block_size = ARENA_MIN_BLOCK_SIZE;
+	arena->blocks = NULL;
+	arena->cur = NULL;
+	arena->big = NULL;
+	arena->objs = NULL;
+	arena->block_size = block_size;
+	arena->used = 0;
+}
+
+static inline void
+arena_blocks_delete(struct arena_block *block)
+{
+	while (block != NULL) {
+		struct arena_block *next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
+static inline void
+arena_objs_delete(struct arena *arena)
+{
+	struct arena_obj *obj = arena->objs;
+	while (obj != NULL) {
+		struct arena_obj *next = obj->next;
+		free(obj);
+		obj = next;
+	}
+	arena->objs = NULL;
+}
+
+/**
+ * free all arena's memory, including the allocations made from it
+ */
+static inline void
+arena_destroy(struct arena *arena)
+{
+	arena_objs_delete(arena);
+	arena_blocks_delete(arena->big);
+	arena_blocks_delete(arena->blocks);
+	arena->blocks = NULL;
+	arena->cur = NULL;
+	arena->big = NULL;
+	arena->used = 0;
+}
+
+/**
+ * free all the allocations at once, the normal blocks are kept for
+ * reuse
+ */
+static inline void
+arena_reset(struct arena *arena)
+{
+	arena_objs_delete(arena);
+	arena_blocks_delete(arena->big);
+	arena->big = NULL;
+	for (struct arena_block *b = arena->blocks; b != NULL; b = b->next) {
+		if (b->used == 0)
+			break;
+		b->used = 0;
+	}
+	arena->cur = arena->blocks;
+	arena->used = 0;
+}
+
+static inline struct arena_block *
+arena_block_new(size_t size)
+{
+	struct arena_block *block = (struct arena_block *)
+		malloc(ARENA_BLOCK_HEADER_SIZE + size);
+	if (block == NULL)
+		return NULL;
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+static inline void *
+arena_block_data(struct arena_block *block)
+{
+	return (char *)block + ARENA_BLOCK_HEADER_SIZE;
+}
+
+static inline void *
+arena_alloc_malloc(struct arena *arena, size_t size)
+{
+	struct arena_obj *obj = (struct arena_obj *)
+		malloc(ARENA_OBJ_HEADER_SIZE + size);
+	if (obj == NULL)
+		return NULL;
+	obj->next = arena->objs;
+	arena->objs = obj;
+	arena->used += size;
+	return (char *)obj + ARENA_OBJ_HEADER_SIZE;
+}
+
+/** The slow path, when the current block is full. */
+static inline void *
+arena_alloc_slow(struct arena *arena, size_t size)
+{
+	if (size > arena->block_size / 2) {
+		/* Would waste most of a block, gets a block of its own. */
+		struct arena_block *block = arena_block_new(size);
+		if (block == NULL)
+			return NULL;
+		block->used = size;
+		block->next = arena->big;
+		arena->big = block;
+		arena->used += size;
+		return arena_block_data(block);
+	}
+	struct arena_block *cur = arena->cur;
+	if (cur != NULL && cur->next != NULL) {
+		/* Kept since a reset. */
+		cur = cur->next;
+	} else {
+		struct arena_block *block = arena_block_new(arena->block_size);
+		if (block == NULL)
+			return NULL;
+		if (cur == NULL) {
+			arena->blocks = block;
+		} else {
+			block->next = cur->next;
+			cur->next = block;
+		}
+		cur = block;
+	}
+	arena->cur = cur;
+	cur->used = size;
+	arena->used += size;
+	return arena_block_data(cur);
+}
+
+/**
+ * allocate size bytes aligned by ARENA_ALIGN, NULL when out of memory
+ */
+static inline void *
+arena_alloc(struct arena *arena, size_t size)
+{
+	if (size > SIZE_MAX / 2)
+		return NULL;
+	size = arena_align_up(size == 0 ? 1 : size);
+	if (arena_use_malloc())
+		return arena_alloc_malloc(arena, size);
+	struct arena_block *cur = arena->cur;
+	if (cur != NULL && cur->size - cur->used >= size) {
+		void *res = (char *)arena_block_data(cur) + cur->used;
+		cur->used += size;
+		arena->used += size;
+		return res;
+	}
+	return arena_alloc_slow(arena, size);
+}
+
+/**
+ * allocate an object of the type
+ */
+#define arena_alloc_object(arena, type)					\
+	((type *)arena_alloc((arena), sizeof(type)))
+
+/**
+ * allocate an array of count objects of the type
+ */
+#define arena_alloc_array(arena, type, count)				\
+	((type *)arena_alloc((arena), sizeof(type) * (count)))
+
+/**
+ * return bytes allocated since the last reset, aligned
+ */
+static inline size_t
+arena_used(const struct arena *arena)
+{
+	return arena->used;
+}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -0,0 +1,241 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
+#include "bench.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum bench_format {
+	BENCH_FORMAT_TEXT,
+	BENCH_FORMAT_CSV,
+	BENCH_FORMAT_JSON,
+};
+
+static struct {
+	bool is_init;
+	int run_count;
+	int warmup_count;
+	enum bench_format format;
+	bool is_header_printed;
+	/** Time of the current pause, 0 when not paused. */
+	uint64_t pause_start;
+	/** All the pauses of the current run. */
+	uint64_t pause_total;
+} bench;
+
+static int
+bench_env_int(const char *name, int def)
+{
+	const char *value = getenv(name);
+	if (value == NULL || *value == 0)
+		return def;
+	return atoi(value);
+}
+
+static void
+bench_pin(int cpu)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0)
+		fprintf(stderr, "bench: couldn't pin to CPU %d\n", cpu);
+#else
+	fprintf(stderr, "bench: CPU pinning is not supported, ignore %d\n",
+		cpu);
+#endif
+}
+
+static void
+bench_init(void)
+{
+	if (bench.is_init)
+		return;
+	bench.is_init = true;
+	bench.run_count = bench_env_int("BENCH_RUNS", 5);
+	if (bench.run_count <= 0)
+		bench.run_count = 1;
+	bench.warmup_count = bench_env_int("BENCH_WARMUP", 1);
+	if (bench.warmup_count < 0)
+		bench.warmup_count = 0;
+	int cpu = bench_env_int("BENCH_CPU", -1);
+	if (cpu >= 0)
+		bench_pin(cpu);
+	const char *format = getenv("BENCH_FORMAT");
+	if (format == NULL || strcmp(format, "text") == 0) {
+		bench.format = BENCH_FORMAT_TEXT;
+	} else if (strcmp(format, "csv") == 0) {
+		bench.format = BENCH_FORMAT_CSV;
+	} else if (strcmp(format, "json") == 0) {
+		bench.format = BENCH_FORMAT_JSON;
+	} else {
+		fprintf(stderr, "bench: unknown format %s\n", format);
+		bench.format = BENCH_FORMAT_TEXT;
+	}
+}
+
+uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+bench_pause(void)
+{
+	assert(bench.pause_start == 0);
+	bench.pause_start = bench_now_ns();
+}
+
+void
+bench_resume(void)
+{
+	assert(bench.pause_start != 0);
+	bench.pause_total += bench_now_ns() - bench.pause_start;
+	bench.pause_start = 0;
+}
+
+void
+bench_run(const char *title, bench_f func, void *arg,
+	  struct bench_stats *stats)
+{
+	bench_init();
+	int count = bench.run_count;
+	double *times = malloc(count * sizeof(times[0]));
+	if (times == NULL)
+		abort();
+	for (int i = -bench.warmup_count; i < count; ++i) {
+		bench.pause_total = 0;
+		uint64_t start = bench_now_ns();
+		uint64_t op_count = func(arg);
+		uint64_t duration = bench_now_ns() - start;
+		assert(bench.pause_start == 0);
+		duration -= bench.pause_total;
+		if (i < 0)
+			continue;
+		times[i] = op_count == 0 ? duration :
+			(double)duration / op_count;
+	}
+	struct bench_stats res;
+	bench_stats_create(&res, times, count);
+	free(times);
+	bench_print(title, &res);
+	if (stats != NULL)
+		*stats = res;
+}
+
+static int
+bench_cmp_double(const void *l, const void *r)
+{
+	double a = *(const double *)l;
+	double b = *(const double *)r;
+	return a < b ? -1 : a > b;
+}
+
+/** Median of the sorted values. */
+static double
+bench_median(const double *values, int count)
+{
+	if (count % 2 == 1)
+		return values[count / 2];
+	return (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+void
+bench_stats_create(struct bench_stats *stats, double *values, int count)
+{
+	assert(count > 0);
+	qsort(values, count, sizeof(values[0]), bench_cmp_double);
+	stats->run_count = count;
+	stats->min = values[0];
+	stats->max = values[count - 1];
+	stats->med = bench_median(values, count);
+	double *devs = malloc(count * sizeof(devs[0]));
+	if (devs == NULL)
+		abort();
+	for (int i = 0; i < count; ++i) {
+		double d = values[i] - stats->med;
+		devs[i] = d < 0 ? -d : d;
+	}
+	qsort(devs, count, sizeof(devs[0]), bench_cmp_double);
+	stats->mad = bench_median(devs, count);
+	free(devs);
+	stats->ops_per_sec = stats->med > 0 ? 1000000000 / stats->med : 0;
+}
+
+static void
+bench_print_csv_str(const char *str)
+{
+	putchar('"');
+	for (; *str != 0; ++str) {
+		if (*str == '"')
+			putchar('"');
+		putchar(*str);
+	}
+	putchar('"');
+}
+
+static void
+bench_print_json_str(const char *str)
+{
+	putchar('"');
+	for (; *str != 0; ++str) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+void
+bench_print(const char *title, const struct bench_stats *stats)
+{
+	bench_init();
+	switch (bench.format) {
+	case BENCH_FORMAT_TEXT:
+		printf("%s\n", title);
+		printf("    min: %.2lf\n", stats->min);
+		printf("    med: %.2lf\n", stats->med);
+		printf("    max: %.2lf\n", stats->max);
+		printf("    mad: %.2lf\n", stats->mad);
+		printf("    ops/s: %.0lf\n", stats->ops_per_sec);
+		break;
+	case BENCH_FORMAT_CSV:
+		if (!bench.is_header_printed) {
+			printf("title,runs,min_ns,med_ns,max_ns,mad_ns,"
+				"ops_per_sec\n");
+			bench.is_header_printed = true;
+		}
+		bench_print_csv_str(title);
+		printf(",%d,%.2lf,%.2lf,%.2lf,%.2lf,%.0lf\n", stats->run_count,
+			stats->min, stats->med, stats->max, stats->mad,
+			stats->ops_per_sec);
+		break;
+	case BENCH_FORMAT_JSON:
+		printf("{\"title\": ");
+		bench_print_json_str(title);
+		printf(", \"runs\": %d, \"min_ns\": %.2lf, \"med_ns\": %.2lf, "
+			"\"max_ns\": %.2lf, \"mad_ns\": %.2lf, "
+			"\"ops_per_sec\": %.0lf}\n", stats->run_count,
+			stats->min, stats->med, stats->max, stats->mad,
+			stats->ops_per_sec);
+		break;
+	default:
+		abort();
+	}
+	fflush(stdout);
+}
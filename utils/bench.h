@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Benchmarking harness. A bench is a function doing some operations
+ * and returning their count. It is run a few times for warm-up, then
+ * a few times measured. Per run is taken the time of one operation,
+ * and the runs are summarized with the statistics robust to the
+ * outliers: min, median, max, and the median absolute deviation.
+ *
+ * The settings are taken from the environment, so as not to clash
+ * with the own arguments of the benches:
+ *
+ * BENCH_RUNS - count of the measured runs, 5 by default.
+ * BENCH_WARMUP - count of the runs before them, 1 by default.
+ * BENCH_CPU - index of a CPU to pin the thread to before the runs.
+ *     Not pinned by default.
+ * BENCH_FORMAT - text, csv or json. The text is for people, the
+ *     others are a line per bench, for scripts. The json is one
+ *     object per line.
+ */
+
+struct bench_stats {
+	int run_count;
+	/** Nanoseconds per operation. */
+	double min;
+	double med;
+	double max;
+	/** Median absolute deviation from the median. */
+	double mad;
+	/** Operations per second, by the median. */
+	double ops_per_sec;
+};
+
+/** Run of a bench. Returns the count of the done operations. */
+typedef uint64_t (*bench_f)(void *arg);
+
+/** Monotonic time in nanoseconds. */
+uint64_t
+bench_now_ns(void);
+
+/**
+ * Run the bench with the warm-up and repetitions, print the result
+ * under the title. The stats can be NULL if not needed.
+ */
+void
+bench_run(const char *title, bench_f func, void *arg,
+	  struct bench_stats *stats);
+
+/**
+ * Exclude a part of the run from the measurement, like a
+ * preparation of the data.
+ */
+void
+bench_pause(void);
+
+void
+bench_resume(void);
+
+/**
+ * Summarize the nanoseconds per operation of the runs measured
+ * elsewhere. The values are reordered.
+ */
+void
+bench_stats_create(struct bench_stats *stats, double *values, int count);
+
+/** Print the stats under the title in the configured format. */
+void
+bench_print(const char *title, const struct bench_stats *stats);
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -0,0 +1,441 @@
+/*
+ * Microbenchmarks of the primitives of futex.h against the pthread
+ * ones doing the same.
+ *
+ * Mutex: the threads take turns incrementing a shared counter under
+ * futex_mutex or pthread_mutex_t, ns per lock.
+ *
+ * Semaphores: two threads pass a token back and forth through a pair
+ * of futex_sem or sem_t, ns per round trip.
+ *
+ * Event: the same ping-pong on a shared turn variable. One side sets
+ * it and wakes up the other one, by futex_event against a mutex with
+ * a condition variable.
+ *
+ * Latch: the waiters sleep till the main thread opens one, and report
+ * back. By futex_latch against a broadcast of a condition variable,
+ * the reports are futex_sem in both. ns per opening.
+ *
+ * Build:
+ *
+ *   gcc -O2 -I utils utils/bench.c utils/bench/bench_futex.c \
+ *       -o bench_futex -lpthread
+ */
+#include "bench.h"
+#include "futex.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum {
+	BENCH_LOCK_COUNT = 1000000,
+	BENCH_ROUND_COUNT = 100000,
+	BENCH_LATCH_COUNT = 10000,
+	BENCH_LATCH_WAITER_COUNT = 4,
+	BENCH_MAX_THREAD_COUNT = 16,
+};
+
+typedef void *(*bench_thread_f)(void *arg);
+
+/** Run the func in the threads and wait for them, not counting the start. */
+static void
+bench_threads_run(int count, bench_thread_f func, void *arg)
+{
+	pthread_t threads[BENCH_MAX_THREAD_COUNT];
+	for (int i = 0; i < count; ++i) {
+		bench_pause();
+		int rc = pthread_create(&threads[i], NULL, func, arg);
+		bench_resume();
+		if (rc != 0)
+			abort();
+	}
+	for (int i = 0; i < count; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct bench_mutex {
+	int thread_count;
+	struct futex_mutex futex_mutex;
+	pthread_mutex_t pthread_mutex;
+	uint64_t counter;
+};
+
+static void *
+bench_futex_mutex_worker_f(void *arg)
+{
+	struct bench_mutex *m = arg;
+	for (int i = 0; i < BENCH_LOCK_COUNT / m->thread_count; ++i) {
+		futex_mutex_lock(&m->futex_mutex);
+		++m->counter;
+		futex_mutex_unlock(&m->futex_mutex);
+	}
+	return NULL;
+}
+
+static void *
+bench_pthread_mutex_worker_f(void *arg)
+{
+	struct bench_mutex *m = arg;
+	for (int i = 0; i < BENCH_LOCK_COUNT / m->thread_count; ++i) {
+		pthread_mutex_lock(&m->pthread_mutex);
+		++m->counter;
+		pthread_mutex_unlock(&m->pthread_mutex);
+	}
+	return NULL;
+}
+
+static uint64_t
+bench_mutex_check(struct bench_mutex *m)
+{
+	uint64_t total = BENCH_LOCK_COUNT / m->thread_count * m->thread_count;
+	if (m->counter != total) {
+		fprintf(stderr, "lost increments: %llu of %llu\n",
+			(unsigned long long)m->counter,
+			(unsigned long long)total);
+		exit(-1);
+	}
+	return total;
+}
+
+static uint64_t
+bench_futex_mutex_f(void *arg)
+{
+	struct bench_mutex *m = arg;
+	m->counter = 0;
+	bench_threads_run(m->thread_count, bench_futex_mutex_worker_f, m);
+	return bench_mutex_check(m);
+}
+
+static uint64_t
+bench_pthread_mutex_f(void *arg)
+{
+	struct bench_mutex *m = arg;
+	m->counter = 0;
+	bench_threads_run(m->thread_count, bench_pthread_mutex_worker_f, m);
+	return bench_mutex_check(m);
+}
+
+static void
+bench_mutex(int thread_count)
+{
+	struct bench_mutex m;
+	char title[128];
+	m.thread_count = thread_count;
+	futex_mutex_create(&m.futex_mutex);
+	pthread_mutex_init(&m.pthread_mutex, NULL);
+	snprintf(title, sizeof(title), "futex_mutex, %d threads, ns per lock",
+		 thread_count);
+	bench_run(title, bench_futex_mutex_f, &m, NULL);
+	snprintf(title, sizeof(title), "pthread_mutex, %d threads, ns per lock",
+		 thread_count);
+	bench_run(title, bench_pthread_mutex_f, &m, NULL);
+	pthread_mutex_destroy(&m.pthread_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct bench_sem {
+	struct futex_sem futex_sems[2];
+	sem_t sems[2];
+};
+
+static void *
+bench_futex_sem_worker_f(void *arg)
+{
+	struct bench_sem *s = arg;
+	for (int i = 0; i < BENCH_ROUND_COUNT; ++i) {
+		futex_sem_wait(&s->futex_sems[0], NULL);
+		futex_sem_post(&s->futex_sems[1]);
+	}
+	return NULL;
+}
+
+static void *
+bench_posix_sem_worker_f(void *arg)
+{
+	struct bench_sem *s = arg;
+	for (int i = 0; i < BENCH_ROUND_COUNT; ++i) {
+		sem_wait(&s->sems[0]);
+		sem_post(&s->sems[1]);
+	}
+	return NULL;
+}
+
+static uint64_t
+bench_futex_sem_f(void *arg)
+{
+	struct bench_sem *s = arg;
+	pthread_t t;
+	bench_pause();
+	if (pthread_create(&t, NULL, bench_futex_sem_worker_f, s) != 0)
+		abort();
+	bench_resume();
+	for (int i = 0; i < BENCH_ROUND_COUNT; ++i) {
+		futex_sem_post(&s->futex_sems[0]);
+		futex_sem_wait(&s->futex_sems[1], NULL);
+	}
+	pthread_join(t, NULL);
+	return BENCH_ROUND_COUNT;
+}
+
+static uint64_t
+bench_posix_sem_f(void *arg)
+{
+	struct bench_sem *s = arg;
+	pthread_t t;
+	bench_pause();
+	if (pthread_create(&t, NULL, bench_posix_sem_worker_f, s) != 0)
+		abort();
+	bench_resume();
+	for (int i = 0; i < BENCH_ROUND_COUNT; ++i) {
+		sem_post(&s->sems[0]);
+		sem_wait(&s->sems[1]);
+	}
+	pthread_join(t, NULL);
+	return BENCH_ROUND_COUNT;
+}
+
+static void
+bench_sems(void)
+{
+	struct bench_sem s;
+	for (int i = 0; i < 2; ++i) {
+		futex_sem_create(&s.futex_sems[i], 0);
+		sem_init(&s.sems[i], 0, 0);
+	}
+	bench_run("futex_sem ping-pong, ns per round trip", bench_futex_sem_f,
+		  &s, NULL);
+	bench_run("sem_t ping-pong, ns per round trip", bench_posix_sem_f,
+		  &s, NULL);
+	for (int i = 0; i < 2; ++i)
+		sem_destroy(&s.sems[i]);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct bench_event {
+	/** Whose move it is, 0 or 1. */
+	uint32_t turn;
+	struct futex_event event;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static void
+bench_event_play(struct bench_event *e, uint32_t side)
+{
+	for (int i = 0; i < BENCH_ROUND_COUNT; ++i) {
+		while (true) {
+			uint32_t key = futex_event_prepare(&e->event);
+			if (__atomic_load_n(&e->turn, __ATOMIC_ACQUIRE) ==
+			    side) {
+				futex_event_cancel(&e->event);
+				break;
+			}
+			futex_event_wait(&e->event, key, NULL);
+		}
+		__atomic_store_n(&e->turn, 1 - side, __ATOMIC_RELEASE);
+		futex_event_notify_all(&e->event);
+	}
+}
+
+static void
+bench_cond_play(struct bench_event *e, uint32_t side)
+{
+	for (int i = 0; i < BENCH_ROUND_COUNT; ++i) {
+		pthread_mutex_lock(&e->mutex);
+		while (e->turn != side)
+			pthread_cond_wait(&e->cond, &e->mutex);
+		e->turn = 1 - side;
+		pthread_cond_signal(&e->cond);
+		pthread_mutex_unlock(&e->mutex);
+	}
+}
+
+static void *
+bench_event_worker_f(void *arg)
+{
+	bench_event_play(arg, 1);
+	return NULL;
+}
+
+static void *
+bench_cond_worker_f(void *arg)
+{
+	bench_cond_play(arg, 1);
+	return NULL;
+}
+
+static uint64_t
+bench_event_f(void *arg)
+{
+	struct bench_event *e = arg;
+	pthread_t t;
+	e->turn = 0;
+	bench_pause();
+	if (pthread_create(&t, NULL, bench_event_worker_f, e) != 0)
+		abort();
+	bench_resume();
+	bench_event_play(e, 0);
+	pthread_join(t, NULL);
+	return BENCH_ROUND_COUNT;
+}
+
+static uint64_t
+bench_cond_f(void *arg)
+{
+	struct bench_event *e = arg;
+	pthread_t t;
+	e->turn = 0;
+	bench_pause();
+	if (pthread_create(&t, NULL, bench_cond_worker_f, e) != 0)
+		abort();
+	bench_resume();
+	bench_cond_play(e, 0);
+	pthread_join(t, NULL);
+	return BENCH_ROUND_COUNT;
+}
+
+static void
+bench_events(void)
+{
+	struct bench_event e;
+	futex_event_create(&e.event);
+	pthread_mutex_init(&e.mutex, NULL);
+	pthread_cond_init(&e.cond, NULL);
+	bench_run("futex_event ping-pong, ns per round trip", bench_event_f,
+		  &e, NULL);
+	bench_run("pthread_cond ping-pong, ns per round trip", bench_cond_f,
+		  &e, NULL);
+	pthread_cond_destroy(&e.cond);
+	pthread_mutex_destroy(&e.mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct bench_latch {
+	struct futex_latch *latches;
+	struct futex_sem reports;
+	/** For the condition variable, count of the opened ones. */
+	uint32_t open_count;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static void *
+bench_latch_worker_f(void *arg)
+{
+	struct bench_latch *l = arg;
+	for (int i = 0; i < BENCH_LATCH_COUNT; ++i) {
+		futex_latch_wait(&l->latches[i], NULL);
+		futex_sem_post(&l->reports);
+	}
+	return NULL;
+}
+
+static void *
+bench_broadcast_worker_f(void *arg)
+{
+	struct bench_latch *l = arg;
+	for (uint32_t i = 0; i < BENCH_LATCH_COUNT; ++i) {
+		pthread_mutex_lock(&l->mutex);
+		while (l->open_count <= i)
+			pthread_cond_wait(&l->cond, &l->mutex);
+		pthread_mutex_unlock(&l->mutex);
+		futex_sem_post(&l->reports);
+	}
+	return NULL;
+}
+
+static void
+bench_latch_reports_wait(struct bench_latch *l)
+{
+	for (int i = 0; i < BENCH_LATCH_WAITER_COUNT; ++i)
+		futex_sem_wait(&l->reports, NULL);
+}
+
+static uint64_t
+bench_latch_f(void *arg)
+{
+	struct bench_latch *l = arg;
+	pthread_t threads[BENCH_LATCH_WAITER_COUNT];
+	bench_pause();
+	for (int i = 0; i < BENCH_LATCH_COUNT; ++i)
+		futex_latch_create(&l->latches[i]);
+	for (int i = 0; i < BENCH_LATCH_WAITER_COUNT; ++i) {
+		if (pthread_create(&threads[i], NULL, bench_latch_worker_f,
+				   l) != 0)
+			abort();
+	}
+	bench_resume();
+	for (int i = 0; i < BENCH_LATCH_COUNT; ++i) {
+		futex_latch_open(&l->latches[i]);
+		bench_latch_reports_wait(l);
+	}
+	for (int i = 0; i < BENCH_LATCH_WAITER_COUNT; ++i)
+		pthread_join(threads[i], NULL);
+	return BENCH_LATCH_COUNT;
+}
+
+static uint64_t
+bench_broadcast_f(void *arg)
+{
+	struct bench_latch *l = arg;
+	pthread_t threads[BENCH_LATCH_WAITER_COUNT];
+	bench_pause();
+	l->open_count = 0;
+	for (int i = 0; i < BENCH_LATCH_WAITER_COUNT; ++i) {
+		if (pthread_create(&threads[i], NULL, bench_broadcast_worker_f,
+				   l) != 0)
+			abort();
+	}
+	bench_resume();
+	for (int i = 0; i < BENCH_LATCH_COUNT; ++i) {
+		pthread_mutex_lock(&l->mutex);
+		++l->open_count;
+		pthread_cond_broadcast(&l->cond);
+		pthread_mutex_unlock(&l->mutex);
+		bench_latch_reports_wait(l);
+	}
+	for (int i = 0; i < BENCH_LATCH_WAITER_COUNT; ++i)
+		pthread_join(threads[i], NULL);
+	return BENCH_LATCH_COUNT;
+}
+
+static void
+bench_latches(void)
+{
+	struct bench_latch l;
+	l.latches = malloc(BENCH_LATCH_COUNT * sizeof(*l.latches));
+	if (l.latches == NULL)
+		abort();
+	futex_sem_create(&l.reports, 0);
+	pthread_mutex_init(&l.mutex, NULL);
+	pthread_cond_init(&l.cond, NULL);
+	char title[128];
+	snprintf(title, sizeof(title), "futex_latch, %d waiters, ns per "
+		 "opening", BENCH_LATCH_WAITER_COUNT);
+	bench_run(title, bench_latch_f, &l, NULL);
+	snprintf(title, sizeof(title), "pthread_cond broadcast, %d waiters, "
+		 "ns per opening", BENCH_LATCH_WAITER_COUNT);
+	bench_run(title, bench_broadcast_f, &l, NULL);
+	pthread_cond_destroy(&l.cond);
+	pthread_mutex_destroy(&l.mutex);
+	free(l.latches);
+}
+
+int
+main(void)
+{
+	const int thread_counts[] = {1, 2, 4};
+	for (int i = 0; i < 3; ++i)
+		bench_mutex(thread_counts[i]);
+	bench_sems();
+	bench_events();
+	bench_latches();
+	return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Microbenchmarks of the heap as a timer queue.
+ *
+ * Timer churn: the heap keeps a number of timers, and each round
+ * takes the earliest one and adds it back with a later deadline.
+ * Like the sleeping coroutines waking up and going to sleep again.
+ *
+ * Compared with a heap of the node pointers having the keys inside
+ * the nodes, how the timers are done in libcoro, and with an rlist
+ * sorted by the deadlines, fine only while the queue is short.
+ *
+ * Build:
+ *
+ *   gcc -O2 -I utils utils/bench.c utils/bench/bench_heap.c \
+ *       -o bench_heap
+ */
+#include "bench.h"
+#include "heap.h"
+#include "rlist.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum {
+	BENCH_ROUND_COUNT = 2000000,
+	BENCH_MAX_DELAY = 1000000,
+	/** Longer sorted lists take forever. */
+	BENCH_LIST_MAX_SIZE = 1000,
+};
+
+struct bench_timer {
+	struct heap_node node;
+	struct rlist link;
+	size_t pos;
+	uint64_t deadline;
+	/** Padding to be like a real object, not packed too dense. */
+	char payload[64];
+};
+
+/** Timers allocated one by one, in a random order. */
+static struct bench_timer **
+bench_timers_new(int count)
+{
+	struct bench_timer **res = malloc(count * sizeof(res[0]));
+	for (int i = 0; i < count; ++i) {
+		res[i] = malloc(sizeof(*res[i]));
+		heap_node_create(&res[i]->node);
+		res[i]->deadline = rand() % BENCH_MAX_DELAY;
+	}
+	for (int i = count - 1; i > 0; --i) {
+		int j = rand() % (i + 1);
+		struct bench_timer *tmp = res[i];
+		res[i] = res[j];
+		res[j] = tmp;
+	}
+	return res;
+}
+
+static void
+bench_timers_delete(struct bench_timer **timers, int count)
+{
+	for (int i = 0; i < count; ++i)
+		free(timers[i]);
+	free(timers);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+/** Heap of the timer pointers, which compares their deadlines. */
+struct bench_pheap {
+	struct bench_timer **timers;
+	size_t size;
+};
+
+static void
+bench_pheap_set(struct bench_pheap *h, size_t pos, struct bench_timer *t)
+{
+	h->timers[pos] = t;
+	t->pos = pos;
+}
+
+static void
+bench_pheap_up(struct bench_pheap *h, size_t pos)
+{
+	struct bench_timer *t = h->timers[pos];
+	while (pos > 0) {
+		size_t parent = (pos - 1) / 2;
+		struct bench_timer *p = h->timers[parent];
+		if (p->deadline <= t->deadline)
+			break;
+		bench_pheap_set(h, pos, p);
+		pos = parent;
+	}
+	bench_pheap_set(h, pos, t);
+}
+
+static void
+bench_pheap_down(struct bench_pheap *h, size_t pos)
+{
+	struct bench_timer *t = h->timers[pos];
+	while (1) {
+		size_t child = 2 * pos + 1;
+		if (child >= h->size)
+			break;
+		if (child + 1 < h->size && h->timers[child + 1]->deadline <
+		    h->timers[child]->deadline)
+			++child;
+		struct bench_timer *c = h->timers[child];
+		if (t->deadline <= c->deadline)
+			break;
+		bench_pheap_set(h, pos, c);
+		pos = child;
+	}
+	bench_pheap_set(h, pos, t);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+static void
+bench_list_insert(struct rlist *head, struct bench_timer *t)
+{
+	struct bench_timer *it;
+	rlist_foreach_entry_reverse(it, head, link) {
+		if (it->deadline <= t->deadline)
+			break;
+	}
+	rlist_add(&it->link, &t->link);
+}
+
+struct bench_queue {
+	struct bench_timer **timers;
+	int count;
+	/** Not to let the compiler throw the loops away. */
+	uint64_t sum;
+};
+
+static uint64_t
+bench_heap_f(void *arg)
+{
+	struct bench_queue *q = arg;
+	bench_pause();
+	srand(0);
+	struct heap heap;
+	heap_create(&heap);
+	for (int i = 0; i < q->count; ++i) {
+		struct bench_timer *t = q->timers[i];
+		if (heap_insert_entry(&heap, t, node, t->deadline) != 0)
+			abort();
+	}
+	bench_resume();
+	for (int i = 0; i < BENCH_ROUND_COUNT; ++i) {
+		uint64_t now = heap_first_key(&heap);
+		struct heap_node *n = heap_first(&heap);
+		q->sum += now;
+		heap_update(&heap, n, now + rand() % BENCH_MAX_DELAY);
+	}
+	bench_pause();
+	while (!heap_empty(&heap)) {
+		struct bench_timer *t = heap_first_entry(&heap,
+			struct bench_timer, node);
+		t->deadline = heap_first_key(&heap);
+		heap_shift(&heap);
+	}
+	heap_destroy(&heap);
+	bench_resume();
+	return BENCH_ROUND_COUNT;
+}
+
+static uint64_t
+bench_pheap_f(void *arg)
+{
+	struct bench_queue *q = arg;
+	bench_pause();
+	srand(0);
+	struct bench_pheap pheap;
+	pheap.timers = malloc(q->count * sizeof(pheap.timers[0]));
+	pheap.size = 0;
+	for (int i = 0; i < q->count; ++i) {
+		pheap.timers[pheap.size++] = q->timers[i];
+		bench_pheap_up(&pheap, pheap.size - 1);
+	}
+	bench_resume();
+	for (int i = 0; i < BENCH_ROUND_COUNT; ++i) {
+		struct bench_timer *t = pheap.timers[0];
+		uint64_t now = t->deadline;
+		q->sum += now;
+		t->deadline = now + rand() % BENCH_MAX_DELAY;
+		bench_pheap_down(&pheap, 0);
+	}
+	bench_pause();
+	free(pheap.timers);
+	bench_resume();
+	return BENCH_ROUND_COUNT;
+}
+
+static uint64_t
+bench_list_f(void *arg)
+{
+	struct bench_queue *q = arg;
+	bench_pause();
+	srand(0);
+	RLIST_HEAD(list);
+	for (int i = 0; i < q->count; ++i)
+		bench_list_insert(&list, q->timers[i]);
+	bench_resume();
+	for (int i = 0; i < BENCH_ROUND_COUNT; ++i) {
+		struct bench_timer *t = rlist_shift_entry(&list,
+			struct bench_timer, link);
+		uint64_t now = t->deadline;
+		q->sum += now;
+		t->deadline = now + rand() % BENCH_MAX_DELAY;
+		bench_list_insert(&list, t);
+	}
+	return BENCH_ROUND_COUNT;
+}
+
+static void
+bench_timers(int count)
+{
+	struct bench_queue q;
+	q.timers = bench_timers_new(count);
+	q.count = count;
+	q.sum = 0;
+	char title[128];
+	snprintf(title, sizeof(title), "Timer churn of %d, heap, ns per round",
+		count);
+	bench_run(title, bench_heap_f, &q, NULL);
+	snprintf(title, sizeof(title), "Timer churn of %d, pointer heap, ns "
+		"per round", count);
+	bench_run(title, bench_pheap_f, &q, NULL);
+	if (count <= BENCH_LIST_MAX_SIZE) {
+		snprintf(title, sizeof(title), "Timer churn of %d, sorted "
+			"rlist, ns per round", count);
+		bench_run(title, bench_list_f, &q, NULL);
+	}
+	bench_timers_delete(q.timers, count);
+	if (q.sum == 0)
+		printf("unreachable\n");
+}
+
+int
+main(void)
+{
+	bench_timers(16);
+	bench_timers(1000);
+	bench_timers(1000000);
+	return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * Microbenchmarks of the ring of pointers against rlist, both used
+ * as a FIFO of the objects allocated one by one.
+ *
+ * Churn: the queue is kept at a depth, and each round shifts the
+ * head and adds it back to the tail. The ring doesn't touch the
+ * objects for that, rlist has to write into three of them.
+ *
+ * Scan: a search of an object which is not in the queue. The ring
+ * compares the pointers in a row, rlist follows a link in each
+ * object.
+ *
+ * Build:
+ *
+ *   gcc -O2 -I utils utils/bench.c utils/bench/bench_ring.c \
+ *       -o bench_ring
+ */
+#include "bench.h"
+#include "ring.h"
+#include "rlist.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum {
+	BENCH_ROUND_COUNT = 10000000,
+	BENCH_SCAN_SIZE = 1 << 20,
+	BENCH_SCAN_COUNT = 10,
+};
+
+struct bench_entry {
+	struct rlist link;
+	uint64_t value;
+};
+
+/** Entries allocated one by one, in a random order. */
+static struct bench_entry **
+bench_entries_new(int count)
+{
+	struct bench_entry **res = malloc(count * sizeof(res[0]));
+	for (int i = 0; i < count; ++i) {
+		res[i] = malloc(sizeof(*res[i]));
+		res[i]->value = i;
+	}
+	for (int i = count - 1; i > 0; --i) {
+		int j = rand() % (i + 1);
+		struct bench_entry *tmp = res[i];
+		res[i] = res[j];
+		res[j] = tmp;
+	}
+	return res;
+}
+
+static void
+bench_entries_delete(struct bench_entry **entries, int count)
+{
+	for (int i = 0; i < count; ++i)
+		free(entries[i]);
+	free(entries);
+}
+
+struct bench_queue {
+	struct bench_entry **entries;
+	int count;
+	struct rlist head;
+	struct ring ring;
+	/** Searched and never found. */
+	struct bench_entry *missing;
+	/** Not to let the compiler throw the loops away. */
+	uint64_t sum;
+};
+
+static uint64_t
+bench_rlist_churn_f(void *arg)
+{
+	struct bench_queue *q = arg;
+	bench_pause();
+	rlist_create(&q->head);
+	for (int i = 0; i < q->count; ++i)
+		rlist_add_tail_entry(&q->head, q->entries[i], link);
+	bench_resume();
+	for (int i = 0; i < BENCH_ROUND_COUNT; ++i) {
+		struct bench_entry *e = rlist_shift_entry(&q->head,
+			struct bench_entry, link);
+		q->sum += (uintptr_t)e;
+		rlist_add_tail_entry(&q->head, e, link);
+	}
+	return BENCH_ROUND_COUNT;
+}
+
+static uint64_t
+bench_ring_churn_f(void *arg)
+{
+	struct bench_queue *q = arg;
+	bench_pause();
+	while (!ring_empty(&q->ring))
+		ring_shift(&q->ring);
+	for (int i = 0; i < q->count; ++i)
+		ring_add_tail(&q->ring, q->entries[i]);
+	bench_resume();
+	for (int i = 0; i < BENCH_ROUND_COUNT; ++i) {
+		struct bench_entry *e = ring_shift(&q->ring);
+		q->sum += (uintptr_t)e;
+		ring_add_tail(&q->ring, e);
+	}
+	return BENCH_ROUND_COUNT;
+}
+
+static void
+bench_queue_create(struct bench_queue *q, int count)
+{
+	q->entries = bench_entries_new(count);
+	q->count = count;
+	q->sum = 0;
+	rlist_create(&q->head);
+	ring_create(&q->ring, malloc(count * sizeof(void *)), count);
+	for (int i = 0; i < count; ++i) {
+		rlist_add_tail_entry(&q->head, q->entries[i], link);
+		ring_add_tail(&q->ring, q->entries[i]);
+	}
+	/* Otherwise the compiler knows it is nowhere in the queue. */
+	struct bench_entry *volatile missing = malloc(sizeof(*missing));
+	q->missing = missing;
+}
+
+static void
+bench_queue_destroy(struct bench_queue *q)
+{
+	if (q->sum == 0)
+		printf("unreachable\n");
+	free(q->missing);
+	free(q->ring.items);
+	bench_entries_delete(q->entries, q->count);
+}
+
+static void
+bench_churn(int depth)
+{
+	struct bench_queue q;
+	bench_queue_create(&q, depth);
+	char title[128];
+	snprintf(title, sizeof(title), "Churn at depth %d, rlist, ns per round",
+		depth);
+	bench_run(title, bench_rlist_churn_f, &q, NULL);
+	snprintf(title, sizeof(title), "Churn at depth %d, ring, ns per round",
+		depth);
+	bench_run(title, bench_ring_churn_f, &q, NULL);
+	bench_queue_destroy(&q);
+}
+
+static uint64_t
+bench_rlist_scan_f(void *arg)
+{
+	struct bench_queue *q = arg;
+	struct bench_entry *e;
+	for (int i = 0; i < BENCH_SCAN_COUNT; ++i) {
+		rlist_foreach_entry(e, &q->head, link)
+			q->sum += e != q->missing;
+	}
+	return (uint64_t)BENCH_SCAN_COUNT * q->count;
+}
+
+static uint64_t
+bench_ring_scan_f(void *arg)
+{
+	struct bench_queue *q = arg;
+	struct bench_entry *e;
+	uint32_t idx;
+	for (int i = 0; i < BENCH_SCAN_COUNT; ++i) {
+		ring_foreach(e, idx, &q->ring)
+			q->sum += e != q->missing;
+	}
+	return (uint64_t)BENCH_SCAN_COUNT * q->count;
+}
+
+static void
+bench_scan(void)
+{
+	struct bench_queue q;
+	bench_queue_create(&q, BENCH_SCAN_SIZE);
+	bench_run("Scan, rlist, ns per entry", bench_rlist_scan_f, &q, NULL);
+	bench_run("Scan, ring, ns per entry", bench_ring_scan_f, &q, NULL);
+	bench_queue_destroy(&q);
+}
+
+int
+main(void)
+{
+	bench_churn(16);
+	bench_churn(1 << 17);
+	bench_scan();
+	return 0;
+}
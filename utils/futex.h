@@ -0,0 +1,306 @@
+#pragma once
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Synchronization primitives of one 32 bit word each, on the Linux
+ * futexes, for the threads of one process:
+ *
+ * - futex_mutex: spins a bit, then sleeps. The unlock makes a syscall
+ *   only when somebody sleeps;
+ * - futex_event: an event count. A waiter takes a key, checks its
+ *   condition, and sleeps only if nothing was notified since the key.
+ *   So a condition of any shape can be waited for without a mutex;
+ * - futex_sem: a counting semaphore;
+ * - futex_latch: opened once, and then never blocks anybody.
+ *
+ * The deadlines are absolute, on CLOCK_MONOTONIC, NULL is no limit.
+ * Nothing allocates, and a zeroed object is an initialized one.
+ */
+
+enum {
+	/** Attempts of the mutex before the sleep. */
+	FUTEX_MUTEX_SPIN_COUNT = 100,
+};
+
+/**
+ * sleep while the word is equal to the value, or till the deadline.
+ * Can wake up spuriously. Returns ETIMEDOUT if the deadline has
+ * passed, otherwise 0.
+ */
+static inline int
+futex_wait(uint32_t *addr, uint32_t value, const struct timespec *deadline)
+{
+	if (syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, value,
+		    deadline, NULL, FUTEX_BITSET_MATCH_ANY) == 0)
+		return 0;
+	return errno == ETIMEDOUT ? ETIMEDOUT : 0;
+}
+
+/**
+ * wake up to count sleepers of the word
+ */
+static inline void
+futex_wake(uint32_t *addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+/** 0 - free, 1 - locked, 2 - locked and maybe somebody sleeps. */
+struct futex_mutex {
+	uint32_t state;
+};
+
+static inline void
+futex_mutex_create(struct futex_mutex *m)
+{
+	m->state = 0;
+}
+
+/**
+ * return TRUE if locked
+ */
+static inline bool
+futex_mutex_trylock(struct futex_mutex *m)
+{
+	uint32_t old = 0;
+	return __atomic_compare_exchange_n(&m->state, &old, 1, false,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void
+futex_mutex_lock(struct futex_mutex *m)
+{
+	if (futex_mutex_trylock(m))
+		return;
+	/* The owner is likely to be about to unlock, on another core. */
+	for (int i = 0; i < FUTEX_MUTEX_SPIN_COUNT; ++i) {
+		if (__atomic_load_n(&m->state, __ATOMIC_RELAXED) == 0 &&
+		    futex_mutex_trylock(m))
+			return;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+	/*
+	 * Taken with 2, because whether there are other sleepers isn't
+	 * known. At worst the unlock makes a needless syscall.
+	 */
+	while (__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0)
+		futex_wait(&m->state, 2, NULL);
+}
+
+static inline void
+futex_mutex_unlock(struct futex_mutex *m)
+{
+	if (__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) == 2)
+		futex_wake(&m->state, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct futex_event {
+	/** Bumped by each notification. The futex word. */
+	uint32_t seq;
+	/** Between the key and the end of the wait. */
+	uint32_t waiter_count;
+};
+
+static inline void
+futex_event_create(struct futex_event *e)
+{
+	e->seq = 0;
+	e->waiter_count = 0;
+}
+
+/**
+ * return key to wait with. Must be taken before the check of the
+ * condition, and then either waited or cancelled.
+ */
+static inline uint32_t
+futex_event_prepare(struct futex_event *e)
+{
+	__atomic_add_fetch(&e->waiter_count, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&e->seq, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * drop the key, when the condition is already true
+ */
+static inline void
+futex_event_cancel(struct futex_event *e)
+{
+	__atomic_sub_fetch(&e->waiter_count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * sleep till a notification after the key was taken, or the deadline.
+ * Returns immediately if there was one already. Returns ETIMEDOUT or
+ * 0, and the condition is to be checked again anyway.
+ */
+static inline int
+futex_event_wait(struct futex_event *e, uint32_t key,
+		 const struct timespec *deadline)
+{
+	int rc = 0;
+	while (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) == key) {
+		rc = futex_wait(&e->seq, key, deadline);
+		if (rc == ETIMEDOUT)
+			break;
+	}
+	__atomic_sub_fetch(&e->waiter_count, 1, __ATOMIC_RELAXED);
+	return rc;
+}
+
+/**
+ * wake up the waiters, after the condition was made true. No syscall
+ * if there are none.
+ */
+static inline void
+futex_event_notify_all(struct futex_event *e)
+{
+	__atomic_add_fetch(&e->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&e->waiter_count, __ATOMIC_SEQ_CST) != 0)
+		futex_wake(&e->seq, INT_MAX);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct futex_sem {
+	/** The futex word. */
+	uint32_t value;
+	uint32_t waiter_count;
+};
+
+static inline void
+futex_sem_create(struct futex_sem *s, uint32_t value)
+{
+	s->value = value;
+	s->waiter_count = 0;
+}
+
+/**
+ * return TRUE if the value was decremented
+ */
+static inline bool
+futex_sem_trywait(struct futex_sem *s)
+{
+	uint32_t v = __atomic_load_n(&s->value, __ATOMIC_RELAXED);
+	while (v != 0) {
+		if (__atomic_compare_exchange_n(&s->value, &v, v - 1, true,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * decrement the value, sleep while it is 0, not longer than till the
+ * deadline. Returns 0 or ETIMEDOUT.
+ */
+static inline int
+futex_sem_wait(struct futex_sem *s, const struct timespec *deadline)
+{
+	if (futex_sem_trywait(s))
+		return 0;
+	__atomic_add_fetch(&s->waiter_count, 1, __ATOMIC_SEQ_CST);
+	int rc = 0;
+	while (!futex_sem_trywait(s)) {
+		if (futex_wait(&s->value, 0, deadline) == ETIMEDOUT) {
+			/* The last chance, a post could come just now. */
+			rc = futex_sem_trywait(s) ? 0 : ETIMEDOUT;
+			break;
+		}
+	}
+	__atomic_sub_fetch(&s->waiter_count, 1, __ATOMIC_RELAXED);
+	return rc;
+}
+
+static inline void
+futex_sem_post(struct futex_sem *s)
+{
+	__atomic_add_fetch(&s->value, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->waiter_count, __ATOMIC_SEQ_CST) != 0)
+		futex_wake(&s->value, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+enum futex_latch_state {
+	FUTEX_LATCH_CLOSED = 0,
+	/** Closed, and maybe somebody sleeps. */
+	FUTEX_LATCH_WAITED,
+	FUTEX_LATCH_OPEN,
+};
+
+struct futex_latch {
+	uint32_t state;
+};
+
+static inline void
+futex_latch_create(struct futex_latch *l)
+{
+	l->state = FUTEX_LATCH_CLOSED;
+}
+
+/**
+ * return TRUE if opened
+ */
+static inline bool
+futex_latch_is_open(const struct futex_latch *l)
+{
+	return __atomic_load_n(&l->state, __ATOMIC_ACQUIRE) ==
+	       FUTEX_LATCH_OPEN;
+}
+
+/**
+ * sleep till the latch is opened, or the deadline. Returns 0 or
+ * ETIMEDOUT.
+ */
+static inline int
+futex_latch_wait(struct futex_latch *l, const struct timespec *deadline)
+{
+	uint32_t state = __atomic_load_n(&l->state, __ATOMIC_ACQUIRE);
+	while (state != FUTEX_LATCH_OPEN) {
+		if (state == FUTEX_LATCH_CLOSED &&
+		    !__atomic_compare_exchange_n(&l->state, &state,
+						 FUTEX_LATCH_WAITED, false,
+						 __ATOMIC_ACQUIRE,
+						 __ATOMIC_ACQUIRE))
+			continue;
+		if (futex_wait(&l->state, FUTEX_LATCH_WAITED,
+			       deadline) == ETIMEDOUT)
+			return futex_latch_is_open(l) ? 0 : ETIMEDOUT;
+		state = __atomic_load_n(&l->state, __ATOMIC_ACQUIRE);
+	}
+	return 0;
+}
+
+/**
+ * open the latch and wake up all the waiters. Only once.
+ */
+static inline void
+futex_latch_open(struct futex_latch *l)
+{
+	if (__atomic_exchange_n(&l->state, FUTEX_LATCH_OPEN,
+				__ATOMIC_RELEASE) == FUTEX_LATCH_WAITED)
+		futex_wake(&l->state, INT_MAX);
+}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -0,0 +1,281 @@
+#pragma once
+
+#include "rlist.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Intrusive binary min-heap by integer keys. For timers by their
+ * deadlines and for priorities.
+ *
+ * The keys are stored in the heap's array next to the node
+ * pointers, so the sifts compare the keys without touching the
+ * nodes. A node is only written to keep its position, which makes
+ * the deletion and the key update of any node O(log n).
+ */
+struct heap_node {
+	/** Index in the heap's array, HEAP_POS_NONE when not in it. */
+	size_t pos;
+};
+
+struct heap_item {
+	uint64_t key;
+	struct heap_node *node;
+};
+
+struct heap {
+	struct heap_item *items;
+	size_t size;
+	size_t capacity;
+};
+
+/** Position of a node which is not in a heap. */
+#define HEAP_POS_NONE SIZE_MAX
+
+enum {
+	HEAP_MIN_CAPACITY = 16,
+};
+
+/**
+ * init heap
+ */
+static inline void
+heap_create(struct heap *heap)
+{
+	heap->items = NULL;
+	heap->size = 0;
+	heap->capacity = 0;
+}
+
+/**
+ * free heap's memory, the nodes are not touched
+ */
+static inline void
+heap_destroy(struct heap *heap)
+{
+	free(heap->items);
+}
+
+/**
+ * init heap node as not included in any heap
+ */
+static inline void
+heap_node_create(struct heap_node *node)
+{
+	node->pos = HEAP_POS_NONE;
+}
+
+/**
+ * return TRUE if node is in a heap
+ */
+static inline int
+heap_node_is_in(const struct heap_node *node)
+{
+	return node->pos != HEAP_POS_NONE;
+}
+
+/**
+ * return count of nodes in the heap
+ */
+static inline size_t
+heap_size(const struct heap *heap)
+{
+	return heap->size;
+}
+
+/**
+ * return TRUE if heap is empty
+ */
+static inline int
+heap_empty(const struct heap *heap)
+{
+	return heap->size == 0;
+}
+
+static inline void
+heap_set(struct heap *heap, size_t pos, struct heap_item item)
+{
+	heap->items[pos] = item;
+	item.node->pos = pos;
+}
+
+static inline void
+heap_sift_up(struct heap *heap, size_t pos)
+{
+	struct heap_item item = heap->items[pos];
+	while (pos > 0) {
+		size_t parent = (pos - 1) / 2;
+		if (heap->items[parent].key <= item.key)
+			break;
+		heap_set(heap, pos, heap->items[parent]);
+		pos = parent;
+	}
+	heap_set(heap, pos, item);
+}
+
+static inline void
+heap_sift_down(struct heap *heap, size_t pos)
+{
+	struct heap_item item = heap->items[pos];
+	size_t size = heap->size;
+	while (1) {
+		size_t child = 2 * pos + 1;
+		if (child >= size)
+			break;
+		if (child + 1 < size &&
+		    heap->items[child + 1].key < heap->items[child].key)
+			++child;
+		if (item.key <= heap->items[child].key)
+			break;
+		heap_set(heap, pos, heap->items[child]);
+		pos = child;
+	}
+	heap_set(heap, pos, item);
+}
+
+/**
+ * add node to heap with the given key
+ * @retval 0 Success.
+ * @retval -1 Out of memory, the heap is not changed.
+ */
+static inline int
+heap_insert(struct heap *heap, struct heap_node *node, uint64_t key)
+{
+	assert(!heap_node_is_in(node));
+	if (heap->size == heap->capacity) {
+		size_t cap = heap->capacity * 2;
+		if (cap == 0)
+			cap = HEAP_MIN_CAPACITY;
+		struct heap_item *items = (struct heap_item *)realloc(
+			heap->items, cap * sizeof(items[0]));
+		if (items == NULL)
+			return -1;
+		heap->items = items;
+		heap->capacity = cap;
+	}
+	size_t pos = heap->size++;
+	heap->items[pos].key = key;
+	heap->items[pos].node = node;
+	heap_sift_up(heap, pos);
+	return 0;
+}
+
+/**
+ * return node with the min key, NULL if empty
+ */
+static inline struct heap_node *
+heap_first(const struct heap *heap)
+{
+	return heap->size == 0 ? NULL : heap->items[0].node;
+}
+
+/**
+ * return the min key
+ * @pre the heap is not empty
+ */
+static inline uint64_t
+heap_first_key(const struct heap *heap)
+{
+	assert(heap->size > 0);
+	return heap->items[0].key;
+}
+
+/**
+ * return key of the node
+ * @pre the node is in the heap
+ */
+static inline uint64_t
+heap_key(const struct heap *heap, const struct heap_node *node)
+{
+	assert(node->pos < heap->size && heap->items[node->pos].node == node);
+	return heap->items[node->pos].key;
+}
+
+/**
+ * delete node from heap
+ */
+static inline void
+heap_del(struct heap *heap, struct heap_node *node)
+{
+	size_t pos = node->pos;
+	assert(pos < heap->size && heap->items[pos].node == node);
+	node->pos = HEAP_POS_NONE;
+	struct heap_item last = heap->items[--heap->size];
+	if (last.node == node)
+		return;
+	heap_set(heap, pos, last);
+	heap_sift_up(heap, pos);
+	heap_sift_down(heap, last.node->pos);
+}
+
+/**
+ * remove node with the min key and return it
+ * @pre the heap is not empty
+ */
+static inline struct heap_node *
+heap_shift(struct heap *heap)
+{
+	struct heap_node *node = heap_first(heap);
+	assert(node != NULL);
+	heap_del(heap, node);
+	return node;
+}
+
+/**
+ * change key of the node, which is in the heap
+ */
+static inline void
+heap_update(struct heap *heap, struct heap_node *node, uint64_t key)
+{
+	size_t pos = node->pos;
+	assert(pos < heap->size && heap->items[pos].node == node);
+	uint64_t old = heap->items[pos].key;
+	heap->items[pos].key = key;
+	if (key < old)
+		heap_sift_up(heap, pos);
+	else
+		heap_sift_down(heap, pos);
+}
+
+/**
+ * return entry by heap node
+ */
+#define heap_entry(node, type, member)					\
+	rlist_entry(node, type, member)
+
+/**
+ * return entry with the min key
+ * @pre the heap is not empty
+ */
+#define heap_first_entry(heap, type, member)				\
+	heap_entry(heap_first(heap), type, member)
+
+/**
+ * Remove entry with the min key and return it
+ * @pre the heap is not empty
+ */
+#define heap_shift_entry(heap, type, member)				\
+	heap_entry(heap_shift(heap), type, member)
+
+/**
+ * add entry to heap with the given key
+ */
+#define heap_insert_entry(heap, item, member, key)			\
+	heap_insert((heap), &(item)->member, (key))
+
+/**
+ * delete entry from heap
+ */
+#define heap_del_entry(heap, item, member)				\
+	heap_del((heap), &(item)->member)
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -0,0 +1,122 @@
+// Stress of the heap help with a lot of live allocations. Build it with and
+// without the tool to see its overhead:
+//
+//   gcc -O2 bench.c heap_help.c -ldl -rdynamic -pthread -o bench_hh
+//   gcc -O2 bench.c -pthread -o bench
+//
+// Usage: ./bench [live count] [thread count]. The live allocations are split
+// between the threads. Each thread allocates its part, then replaces random
+// ones with new allocations as many times, then frees them in a random order.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct bench_thread {
+	pthread_t id;
+	size_t live_count;
+	unsigned seed;
+	void **live;
+	uint64_t alloc_ns;
+	uint64_t churn_ns;
+	uint64_t free_ns;
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t
+bench_rand(struct bench_thread *t, size_t limit)
+{
+	// rand_r() gives only 31 bits, not enough for millions of indexes.
+	size_t r = (size_t)rand_r(&t->seed) << 31 | (size_t)rand_r(&t->seed);
+	return r % limit;
+}
+
+static void *
+bench_thread_f(void *arg)
+{
+	struct bench_thread *t = arg;
+	size_t count = t->live_count;
+	uint64_t start = bench_now_ns();
+	for (size_t i = 0; i < count; ++i)
+		t->live[i] = malloc(16 + i % 256);
+	uint64_t end = bench_now_ns();
+	t->alloc_ns = end - start;
+
+	start = end;
+	for (size_t i = 0; i < count; ++i) {
+		size_t idx = bench_rand(t, count);
+		free(t->live[idx]);
+		t->live[idx] = malloc(16 + i % 256);
+	}
+	end = bench_now_ns();
+	t->churn_ns = end - start;
+
+	// Shuffle, so the frees don't go in the allocation order.
+	for (size_t i = count - 1; i > 0; --i) {
+		size_t j = bench_rand(t, i + 1);
+		void *tmp = t->live[i];
+		t->live[i] = t->live[j];
+		t->live[j] = tmp;
+	}
+	start = bench_now_ns();
+	for (size_t i = 0; i < count; ++i)
+		free(t->live[i]);
+	t->free_ns = bench_now_ns() - start;
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t live_count = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+	int thread_count = argc > 2 ? atoi(argv[2]) : 1;
+	if (thread_count <= 0 || live_count < (size_t)thread_count) {
+		printf("Usage: %s [live count] [thread count]\n", argv[0]);
+		return -1;
+	}
+	struct bench_thread *threads = calloc(thread_count, sizeof(*threads));
+	size_t per_thread = live_count / thread_count;
+	for (int i = 0; i < thread_count; ++i) {
+		struct bench_thread *t = &threads[i];
+		t->live_count = per_thread;
+		t->seed = i + 1;
+		t->live = calloc(per_thread, sizeof(*t->live));
+	}
+	for (int i = 0; i < thread_count; ++i) {
+		int rc = pthread_create(&threads[i].id, NULL, bench_thread_f,
+					&threads[i]);
+		if (rc != 0) {
+			printf("pthread_create() failed\n");
+			return -1;
+		}
+	}
+	uint64_t alloc_ns = 0;
+	uint64_t churn_ns = 0;
+	uint64_t free_ns = 0;
+	for (int i = 0; i < thread_count; ++i) {
+		struct bench_thread *t = &threads[i];
+		pthread_join(t->id, NULL);
+		alloc_ns += t->alloc_ns;
+		churn_ns += t->churn_ns;
+		free_ns += t->free_ns;
+		free(t->live);
+	}
+	free(threads);
+	// The times are per operation of a thread, averaged over the threads.
+	double op_count = (double)per_thread * thread_count;
+	printf("%zu live allocations, %d threads\n", per_thread * thread_count,
+	       thread_count);
+	printf("malloc  %8.1lf ns\n", alloc_ns / op_count);
+	printf("churn   %8.1lf ns per free + malloc\n", churn_ns / op_count);
+	printf("free    %8.1lf ns\n", free_ns / op_count);
+	return 0;
+}
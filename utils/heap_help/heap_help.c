@@ -24,6 +24,24 @@
 enum {
 	MAX_BACKTRACE_LEN = 64,
 	ALLOCATION_BATCH_SIZE = 1024,
+	// The allocations are spread between the shards by their addresses, so
+	// the threads rarely compete for the same lock.
+	ALLOCATION_SHARD_BITS = 6,
+	ALLOCATION_SHARD_COUNT = 1 << ALLOCATION_SHARD_BITS,
+	// Log2 of the initial size of a shard's table.
+	ALLOCATION_TABLE_MIN_BITS = 10,
+	// Free allocation objects cached by each thread. The cache takes and
+	// gives back half of that at once.
+	ALLOCATION_CACHE_SIZE = 64,
+	STACK_BATCH_SIZE = 256,
+	// Log2 of the bucket count of the unique stacks. The table doesn't
+	// grow, so it has to be big enough for any sane count of the call
+	// sites.
+	STACK_TABLE_BITS = 16,
+	// Powers of 2 from 16 bytes. The last one is for all the bigger sizes.
+	SIZE_CLASS_COUNT = 16,
+	PROFILE_REPORT_LIMIT = 20,
+	DIFF_REPORT_LIMIT = 10,
 };
 
 enum report_mode {
@@ -33,6 +51,9 @@ enum report_mode {
 	REPORT_MODE_LEAKS,
 	// Do not report anything.
 	REPORT_MODE_QUIET,
+	// Report the allocation sites, the most costly first. Then the leaks,
+	// like in the leaks mode.
+	REPORT_MODE_PROFILE,
 };
 
 enum backtrace_mode {
@@ -49,13 +70,45 @@ enum content_mode {
 	CONTENT_MODE_TRASH,
 };
 
-// Single allocation done on the heap by a user.
-struct allocation {
+// Unique backtrace of the allocations. Shared by all the allocations done
+// from the same place. Never deleted.
+struct stack {
 	void *trace[MAX_BACKTRACE_LEN];
 	int trace_size;
+	uint64_t hash;
+	// Next in the bucket.
+	struct stack *next;
+	// Filled at the report time.
+	bool is_resolved;
+	bool is_internal;
+	// Only collected in the profile mode. Atomic.
+	uint64_t alloc_count;
+	uint64_t alloc_size;
+	uint64_t live_size;
+	uint64_t peak_live_size;
+	uint64_t size_classes[SIZE_CLASS_COUNT];
+	// Only used by a diff of the snapshots, under the diff lock.
+	uint64_t diff_count;
+	uint64_t diff_size;
+	struct stack *diff_next;
+};
+
+struct stack_batch {
+	struct stack stacks[STACK_BATCH_SIZE];
+	int used;
+};
+
+// Single allocation done on the heap by a user.
+struct allocation {
+	// NULL when the stack isn't collected or the allocation wasn't sampled.
+	struct stack *stack;
 	int depth;
 	void *mem;
 	size_t size;
+	// Sequence number among all the allocations, the total allocation count
+	// before this one. Snapshots are compared against it.
+	uint64_t seq;
+	// Only used in the lists of the free allocation objects.
 	struct allocation *next;
 };
 
@@ -66,9 +119,25 @@ struct allocation_batch {
 	int used;
 };
 
+// A part of the allocations, with its own lock. Each one is on a separate
+// cache line so as the locks wouldn't interfere.
+struct allocation_shard {
+	bool lock;
+	// Open addressing with linear probing, keyed by the allocated memory
+	// address. Is kept at most half full. Lives in mmap() like the rest.
+	struct allocation **table;
+	// Log2 of the table size. 0 when there is no table yet.
+	int table_bits;
+	size_t count;
+} __attribute__((aligned(64)));
+
 struct symbol {
 	const char *file;
 	const char *name;
+	// From the symbol when it is known, otherwise from the file's base.
+	// Then addr2line can find the place in a binary built without
+	// -rdynamic, like when the tool is preloaded.
+	uintptr_t offset;
 };
 
 static bool init_lock = false;
@@ -79,6 +148,9 @@ static __thread int depth = 0;
 static enum report_mode report_mode = REPORT_MODE_LEAKS;
 static enum content_mode content_mode = CONTENT_MODE_ORIGINAL;
 static enum backtrace_mode backtrace_mode = BACKTRACE_ON;
+// Collect the stack for each N-th allocation of a thread.
+static uint32_t sample_rate = 1;
+static __thread uint32_t sample_counter = 0;
 
 // Before the original heap functions are retrieved, there is a dummy static
 // allocator working. It is needed because on some platforms the original
@@ -88,19 +160,39 @@ static int static_size = 0;
 static int static_used = 0;
 static uint8_t* static_buf = NULL;
 
-static bool allocs_lock = false;
+// The counters are atomic, not under any lock.
 static int64_t alloc_count = 0;
 static uint64_t alloc_count_total = 0;
-static struct allocation *allocs = NULL;
+static struct allocation_shard alloc_shards[ALLOCATION_SHARD_COUNT];
+static bool alloc_pool_lock = false;
 // Unused allocation objects. For re-use.
 static struct allocation *alloc_pool = NULL;
 // Freshly created allocation objects. Taken from here when the pool is empty.
 static struct allocation_batch *alloc_batch = NULL;
+// The objects of a thread's cache are lost when the thread exits. There is
+// no way to catch that without pthread. At most the cache size per thread.
+static __thread struct allocation *alloc_cache = NULL;
+static __thread int alloc_cache_count = 0;
+
+// The lookups and the insertions into the buckets are lock-free. The lock
+// is only for taking new stack objects from the batches.
+static struct stack **stack_table = NULL;
+static bool stack_batch_lock = false;
+static struct stack_batch *stack_batch = NULL;
+// A stack object taken but lost the race to another thread inserting the
+// same stack. Is used for the next new one.
+static __thread struct stack *stack_spare = NULL;
+// Only one diff at a time, they share the stacks' diff fields.
+static bool diff_lock = false;
 
 static void *(*default_malloc)(size_t) = NULL;
 static void (*default_free)(void *) = NULL;
 static void *(*default_calloc)(size_t, size_t) = NULL;
 static void *(*default_realloc)(void *, size_t) = NULL;
+static int (*default_posix_memalign)(void **, size_t, size_t) = NULL;
+static void *(*default_aligned_alloc)(size_t, size_t) = NULL;
+static void *(*default_memalign)(size_t, size_t) = NULL;
+static void *(*default_valloc)(size_t) = NULL;
 static char *(*default_strdup)(const char *) = NULL;
 static ssize_t (*default_getline)(char **, size_t *, FILE *) = NULL;
 static int (*default_getaddrinfo)(
@@ -167,6 +259,275 @@ alloc_is_static(const void *ptr)
 		ptr <= (void *)(static_buf + static_size);
 }
 
+static uint64_t
+alloc_hash(const void *ptr)
+{
+	// The low bits of the addresses are mostly the same due to alignment.
+	// The multiplication mixes all the bits into the high ones.
+	return (uint64_t)(uintptr_t)ptr * 0x9E3779B97F4A7C15ull;
+}
+
+static struct allocation_shard *
+alloc_shard(const void *ptr)
+{
+	return &alloc_shards[alloc_hash(ptr) >> (64 - ALLOCATION_SHARD_BITS)];
+}
+
+// The table position is taken from the hash bits right after those of the
+// shard.
+static size_t
+alloc_table_home(const struct allocation_shard *shard, const void *ptr)
+{
+	return (alloc_hash(ptr) << ALLOCATION_SHARD_BITS) >>
+		(64 - shard->table_bits);
+}
+
+static void
+alloc_table_put(struct allocation_shard *shard, struct allocation *a)
+{
+	size_t mask = ((size_t)1 << shard->table_bits) - 1;
+	size_t i = alloc_table_home(shard, a->mem);
+	while (shard->table[i] != NULL)
+		i = (i + 1) & mask;
+	shard->table[i] = a;
+}
+
+static void
+alloc_table_grow(struct allocation_shard *shard)
+{
+	struct allocation **old_table = shard->table;
+	size_t old_size = old_table == NULL ? 0 :
+		(size_t)1 << shard->table_bits;
+	int bits = old_table == NULL ? ALLOCATION_TABLE_MIN_BITS :
+		shard->table_bits + 1;
+	size_t size = (size_t)1 << bits;
+	// Anonymous mmap() gives zeroed memory, all the slots are empty.
+	struct allocation **table = mmap(NULL, size * sizeof(*table),
+		PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	heaph_assert(table != MAP_FAILED);
+	shard->table = table;
+	shard->table_bits = bits;
+	for (size_t i = 0; i < old_size; ++i) {
+		if (old_table[i] != NULL)
+			alloc_table_put(shard, old_table[i]);
+	}
+	if (old_table != NULL)
+		munmap(old_table, old_size * sizeof(*old_table));
+}
+
+static void
+alloc_table_add(struct allocation_shard *shard, struct allocation *a)
+{
+	if (shard->table == NULL ||
+	    (shard->count + 1) * 2 > (size_t)1 << shard->table_bits)
+		alloc_table_grow(shard);
+	alloc_table_put(shard, a);
+	++shard->count;
+}
+
+// Returns the slot of the allocation, or -1 when not found.
+static ssize_t
+alloc_table_find(const struct allocation_shard *shard, const void *ptr)
+{
+	if (shard->table == NULL)
+		return -1;
+	size_t mask = ((size_t)1 << shard->table_bits) - 1;
+	size_t i = alloc_table_home(shard, ptr);
+	struct allocation *a;
+	while ((a = shard->table[i]) != NULL) {
+		if (a->mem == ptr)
+			return i;
+		i = (i + 1) & mask;
+	}
+	return -1;
+}
+
+static void
+alloc_table_del(struct allocation_shard *shard, size_t i)
+{
+	// No tombstones. The next allocations of the same probe sequence are
+	// shifted back into the hole, so the lookups never need to skip the
+	// deleted slots.
+	size_t mask = ((size_t)1 << shard->table_bits) - 1;
+	size_t j = i;
+	while (true) {
+		j = (j + 1) & mask;
+		struct allocation *a = shard->table[j];
+		if (a == NULL)
+			break;
+		size_t home = alloc_table_home(shard, a->mem);
+		// Can move into the hole only if its home isn't cyclically
+		// between the hole and its current slot.
+		bool can_move = i <= j ? (home <= i || home > j) :
+			(home <= i && home > j);
+		if (can_move) {
+			shard->table[i] = a;
+			i = j;
+		}
+	}
+	shard->table[i] = NULL;
+	--shard->count;
+}
+
+static uint64_t
+stack_hash(void *const *trace, int size)
+{
+	uint64_t hash = (uint64_t)size;
+	for (int i = 0; i < size; ++i) {
+		hash ^= (uint64_t)(uintptr_t)trace[i];
+		hash *= 0x9E3779B97F4A7C15ull;
+	}
+	return hash ^ (hash >> 29);
+}
+
+// Find the stack in the bucket's list, from the given object until the other
+// one, not included.
+static struct stack *
+stack_find(struct stack *from, const struct stack *until, uint64_t hash,
+	   void *const *trace, int size)
+{
+	for (struct stack *s = from; s != until; s = s->next) {
+		if (s->hash == hash && s->trace_size == size &&
+		    memcmp(s->trace, trace, size * sizeof(trace[0])) == 0)
+			return s;
+	}
+	return NULL;
+}
+
+static struct stack *
+stack_new(void)
+{
+	struct stack *s = stack_spare;
+	if (s != NULL) {
+		stack_spare = NULL;
+		return s;
+	}
+	spinlock_acq(&stack_batch_lock);
+	struct stack_batch *batch = stack_batch;
+	if (batch == NULL || batch->used == STACK_BATCH_SIZE) {
+		batch = mmap(NULL, sizeof(*batch), PROT_READ | PROT_WRITE,
+			     MAP_ANON | MAP_PRIVATE, -1, 0);
+		heaph_assert(batch != MAP_FAILED);
+		batch->used = 0;
+		stack_batch = batch;
+	}
+	s = &batch->stacks[batch->used++];
+	spinlock_rel(&stack_batch_lock);
+	return s;
+}
+
+// The unique object of the given backtrace.
+static struct stack *
+stack_intern(void *const *trace, int size)
+{
+	uint64_t hash = stack_hash(trace, size);
+	struct stack **bucket = &stack_table[hash >> (64 - STACK_TABLE_BITS)];
+	struct stack *head = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+	struct stack *s = stack_find(head, NULL, hash, trace, size);
+	if (s != NULL)
+		return s;
+	struct stack *new_s = stack_new();
+	memcpy(new_s->trace, trace, size * sizeof(trace[0]));
+	new_s->trace_size = size;
+	new_s->hash = hash;
+	new_s->next = head;
+	while (!__atomic_compare_exchange_n(bucket, &new_s->next, new_s, false,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_ACQUIRE)) {
+		// Only the stacks inserted since the last attempt can be the
+		// same.
+		s = stack_find(new_s->next, head, hash, trace, size);
+		if (s != NULL) {
+			stack_spare = new_s;
+			return s;
+		}
+		head = new_s->next;
+	}
+	return new_s;
+}
+
+static int
+size_class(size_t size)
+{
+	if (size <= 16)
+		return 0;
+	int res = 64 - __builtin_clzll(size - 1) - 4;
+	return res < SIZE_CLASS_COUNT ? res : SIZE_CLASS_COUNT - 1;
+}
+
+static void
+stack_account_new(struct stack *s, size_t size)
+{
+	__atomic_add_fetch(&s->alloc_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->alloc_size, size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->size_classes[size_class(size)], 1,
+			   __ATOMIC_RELAXED);
+	uint64_t live = __atomic_add_fetch(&s->live_size, size,
+					   __ATOMIC_RELAXED);
+	uint64_t peak = __atomic_load_n(&s->peak_live_size, __ATOMIC_RELAXED);
+	while (live > peak &&
+	       !__atomic_compare_exchange_n(&s->peak_live_size, &peak, live,
+					    true, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED));
+}
+
+static void
+alloc_cache_refill(void)
+{
+	spinlock_acq(&alloc_pool_lock);
+	while (alloc_cache_count < ALLOCATION_CACHE_SIZE / 2) {
+		struct allocation *a = alloc_pool;
+		if (a != NULL) {
+			alloc_pool = a->next;
+		} else {
+			struct allocation_batch *batch = alloc_batch;
+			if (batch == NULL ||
+			    batch->used == ALLOCATION_BATCH_SIZE) {
+				batch = mmap(NULL, sizeof(*batch),
+					PROT_READ | PROT_WRITE,
+					MAP_ANON | MAP_PRIVATE, -1, 0);
+				heaph_assert(batch != MAP_FAILED);
+				batch->used = 0;
+				alloc_batch = batch;
+			}
+			a = &batch->allocs[batch->used++];
+		}
+		a->next = alloc_cache;
+		alloc_cache = a;
+		++alloc_cache_count;
+	}
+	spinlock_rel(&alloc_pool_lock);
+}
+
+static struct allocation *
+alloc_obj_new(void)
+{
+	if (alloc_cache == NULL)
+		alloc_cache_refill();
+	struct allocation *a = alloc_cache;
+	alloc_cache = a->next;
+	--alloc_cache_count;
+	return a;
+}
+
+static void
+alloc_obj_delete(struct allocation *a)
+{
+	a->next = alloc_cache;
+	alloc_cache = a;
+	if (++alloc_cache_count < ALLOCATION_CACHE_SIZE)
+		return;
+	spinlock_acq(&alloc_pool_lock);
+	while (alloc_cache_count > ALLOCATION_CACHE_SIZE / 2) {
+		a = alloc_cache;
+		alloc_cache = a->next;
+		--alloc_cache_count;
+		a->next = alloc_pool;
+		alloc_pool = a;
+	}
+	spinlock_rel(&alloc_pool_lock);
+}
+
 static void
 alloc_trace_new(void *ptr, size_t size)
 {
@@ -182,40 +543,28 @@ alloc_trace_new(void *ptr, size_t size)
 	heaph_assert(is_init_done);
 	if (is_exit_done)
 		return;
-	spinlock_acq(&allocs_lock);
-	struct allocation *a = alloc_pool;
-	if (a != NULL) {
-		alloc_pool = a->next;
-	} else {
-		if (alloc_batch == NULL ||
-		    alloc_batch->used == ALLOCATION_BATCH_SIZE) {
-			alloc_batch = mmap(NULL,
-				sizeof(*alloc_batch), PROT_READ | PROT_WRITE,
-				MAP_ANON | MAP_PRIVATE, -1, 0);
-			heaph_assert(alloc_batch != MAP_FAILED);
-			alloc_batch->used = 0;
-		} else {
-			heaph_assert(alloc_batch->used < ALLOCATION_BATCH_SIZE);
-		}
-		a = &alloc_batch->allocs[alloc_batch->used++];
-	}
-	spinlock_rel(&allocs_lock);
-
+	struct allocation *a = alloc_obj_new();
 	a->mem = ptr;
 	a->size = size;
+	a->seq = __atomic_fetch_add(&alloc_count_total, 1, __ATOMIC_RELAXED);
 	a->depth = depth;
-	if (depth == 1 && backtrace_mode == BACKTRACE_ON)
-		a->trace_size = backtrace(a->trace, MAX_BACKTRACE_LEN);
-	else
-		a->trace_size = 0;
-	heaph_assert(a->trace_size >= 0);
+	a->stack = NULL;
+	if (depth == 1 && backtrace_mode == BACKTRACE_ON &&
+	    ++sample_counter >= sample_rate) {
+		sample_counter = 0;
+		void *trace[MAX_BACKTRACE_LEN];
+		int trace_size = backtrace(trace, MAX_BACKTRACE_LEN);
+		heaph_assert(trace_size >= 0);
+		a->stack = stack_intern(trace, trace_size);
+		if (report_mode == REPORT_MODE_PROFILE)
+			stack_account_new(a->stack, size);
+	}
 
-	spinlock_acq(&allocs_lock);
-	a->next = allocs;
-	allocs = a;
-	++alloc_count;
-	++alloc_count_total;
-	spinlock_rel(&allocs_lock);
+	struct allocation_shard *shard = alloc_shard(ptr);
+	spinlock_acq(&shard->lock);
+	alloc_table_add(shard, a);
+	spinlock_rel(&shard->lock);
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
 }
 
 static size_t
@@ -228,29 +577,46 @@ alloc_untrace(void *ptr)
 	heaph_assert(is_init_done);
 	if (is_exit_done)
 		return 0;
-	spinlock_acq(&allocs_lock);
-	struct allocation *a = allocs;
-	struct allocation *prev = NULL;
-	while (a != NULL) {
-		if (a->mem == ptr) {
-			if (prev == NULL)
-				allocs = a->next;
-			else
-				prev->next = a->next;
-			a->next = alloc_pool;
-			alloc_pool = a;
-			int64_t new_count = --alloc_count;
-			spinlock_rel(&allocs_lock);
-
-			heaph_assert(new_count >= 0 && "freeing bad memory");
-			return a->size;
+	struct allocation_shard *shard = alloc_shard(ptr);
+	spinlock_acq(&shard->lock);
+	ssize_t i = alloc_table_find(shard, ptr);
+	if (i < 0) {
+		spinlock_rel(&shard->lock);
+		heaph_assert(!"freeing bad memory");
+		return 0;
+	}
+	struct allocation *a = shard->table[i];
+	alloc_table_del(shard, i);
+	size_t size = a->size;
+	if (a->stack != NULL && report_mode == REPORT_MODE_PROFILE) {
+		__atomic_sub_fetch(&a->stack->live_size, size,
+				   __ATOMIC_RELAXED);
+	}
+	spinlock_rel(&shard->lock);
+	alloc_obj_delete(a);
+
+	int64_t new_count = __atomic_sub_fetch(&alloc_count, 1,
+		__ATOMIC_RELAXED);
+	heaph_assert(new_count >= 0 && "freeing bad memory");
+	return size;
+}
+
+// Iterate over all the allocations of all the shards. Start with both the
+// indexes 0. The shards must be locked.
+static const struct allocation *
+alloc_next(int *shard_idx, size_t *slot_idx)
+{
+	for (; *shard_idx < ALLOCATION_SHARD_COUNT; ++*shard_idx) {
+		const struct allocation_shard *s = &alloc_shards[*shard_idx];
+		size_t size = s->table == NULL ? 0 : (size_t)1 << s->table_bits;
+		while (*slot_idx < size) {
+			const struct allocation *a = s->table[(*slot_idx)++];
+			if (a != NULL)
+				return a;
 		}
-		prev = a;
-		a = a->next;
+		*slot_idx = 0;
 	}
-	spinlock_rel(&allocs_lock);
-	heaph_assert(!"freeing bad memory");
-	return 0;
+	return NULL;
 }
 
 static const struct allocation *
@@ -263,17 +629,12 @@ alloc_find(void *ptr)
 	heaph_assert(is_init_done);
 	if (is_exit_done)
 		return NULL;
-	spinlock_acq(&allocs_lock);
-	struct allocation *a = allocs;
-	while (a != NULL) {
-		if (a->mem == ptr) {
-			spinlock_rel(&allocs_lock);
-			return a;
-		}
-		a = a->next;
-	}
-	spinlock_rel(&allocs_lock);
-	return NULL;
+	struct allocation_shard *shard = alloc_shard(ptr);
+	spinlock_acq(&shard->lock);
+	ssize_t i = alloc_table_find(shard, ptr);
+	const struct allocation *a = i < 0 ? NULL : shard->table[i];
+	spinlock_rel(&shard->lock);
+	return a;
 }
 
 static void
@@ -399,10 +760,135 @@ trace_resolve(void *const *addrs, int count, struct symbol *syms)
 		}
 		s->name = info.dli_sname;
 		s->file = info.dli_fname;
+		if (s->name != NULL) {
+			s->offset = (uintptr_t)addrs[i] -
+				(uintptr_t)info.dli_saddr;
+		} else {
+			s->offset = (uintptr_t)addrs[i] -
+				(uintptr_t)info.dli_fbase;
+		}
 	}
 	return failures;
 }
 
+static void
+symbol_print(int i, const struct symbol *s)
+{
+	if (s->name != NULL)
+		heaph_printf("%d - %s\n", i, s->name);
+	else if (s->file != NULL)
+		heaph_printf("%d - %s+0x%zx\n", i, s->file, (size_t)s->offset);
+	else
+		heaph_printf("%d - ?\n", i);
+}
+
+// Resolved once per unique stack, however many allocations have it.
+static bool
+stack_is_internal(struct stack *s, int64_t *fail_count)
+{
+	if (s->is_resolved)
+		return s->is_internal;
+	struct symbol syms[MAX_BACKTRACE_LEN];
+	*fail_count += trace_resolve(s->trace, s->trace_size, syms);
+	s->is_internal = trace_is_internal(syms, s->trace_size);
+	s->is_resolved = true;
+	return s->is_internal;
+}
+
+static uint64_t
+stack_alloc_size(const struct stack *s)
+{
+	return s->alloc_size;
+}
+
+static uint64_t
+stack_diff_size(const struct stack *s)
+{
+	return s->diff_size;
+}
+
+// Keep the top stacks sorted by the key, the biggest first. Can't use
+// qsort(), it might allocate.
+static void
+stack_top_add(struct stack **top, int *top_count, int limit, struct stack *s,
+	      uint64_t (*key)(const struct stack *))
+{
+	uint64_t value = key(s);
+	int pos = *top_count;
+	while (pos > 0 && key(top[pos - 1]) < value)
+		--pos;
+	if (pos == limit)
+		return;
+	if (*top_count < limit)
+		++*top_count;
+	memmove(&top[pos + 1], &top[pos],
+		(*top_count - 1 - pos) * sizeof(*top));
+	top[pos] = s;
+}
+
+static void
+stack_print(const struct stack *s)
+{
+	struct symbol syms[MAX_BACKTRACE_LEN];
+	trace_resolve(s->trace, s->trace_size, syms);
+	for (int i = 0; i < s->trace_size; ++i)
+		symbol_print(i, &syms[i]);
+}
+
+static void
+heaph_report_profile(void)
+{
+	// The top sites by the allocated bytes.
+	struct stack *top[PROFILE_REPORT_LIMIT];
+	int top_count = 0;
+	uint64_t site_count = 0;
+	for (size_t i = 0; i < (size_t)1 << STACK_TABLE_BITS; ++i) {
+		struct stack *s = __atomic_load_n(&stack_table[i],
+						  __ATOMIC_ACQUIRE);
+		for (; s != NULL; s = s->next) {
+			if (s->alloc_count == 0)
+				continue;
+			++site_count;
+			stack_top_add(top, &top_count, PROFILE_REPORT_LIMIT, s,
+				      stack_alloc_size);
+		}
+	}
+	heaph_printf("\n");
+	if (backtrace_mode == BACKTRACE_OFF) {
+		heaph_printf("HH: no profile without the backtraces\n");
+		return;
+	}
+	heaph_printf("HH: %llu allocation sites", (long long)site_count);
+	if (sample_rate > 1)
+		heaph_printf(", each %u-th allocation is sampled", sample_rate);
+	heaph_printf("\n");
+	for (int i = 0; i < top_count; ++i) {
+		struct stack *s = top[i];
+		heaph_printf("#### Site %d: %llu allocations, %llu bytes, "
+			     "peak live %llu bytes, live %llu bytes ####\n",
+			     i + 1, (long long)s->alloc_count,
+			     (long long)s->alloc_size,
+			     (long long)s->peak_live_size,
+			     (long long)s->live_size);
+		heaph_printf("sizes:");
+		for (int c = 0; c < SIZE_CLASS_COUNT; ++c) {
+			if (s->size_classes[c] == 0)
+				continue;
+			if (c == SIZE_CLASS_COUNT - 1)
+				heaph_printf(" >%llu", 16ull << (c - 1));
+			else
+				heaph_printf(" <=%llu", 16ull << c);
+			heaph_printf(": %llu", (long long)s->size_classes[c]);
+		}
+		heaph_printf("\n");
+		stack_print(s);
+	}
+	if ((uint64_t)top_count < site_count) {
+		heaph_printf("HH: only first %d sites are shown\n",
+			     top_count);
+	}
+}
+
 static void
 heaph_atexit(void)
 {
@@ -412,10 +898,16 @@ heaph_atexit(void)
 		return;
 	if (report_mode == REPORT_MODE_QUIET)
 		return;
-	spinlock_acq(&allocs_lock);
-	int64_t count = alloc_count;
+	if (report_mode == REPORT_MODE_PROFILE)
+		heaph_report_profile();
+	// All the shards are locked, so as the other threads wouldn't change
+	// them during the report.
+	for (int i = 0; i < ALLOCATION_SHARD_COUNT; ++i)
+		spinlock_acq(&alloc_shards[i].lock);
+	int64_t count = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
 	if (count == 0) {
-		spinlock_rel(&allocs_lock);
+		for (int i = 0; i < ALLOCATION_SHARD_COUNT; ++i)
+			spinlock_rel(&alloc_shards[i].lock);
 		if (report_mode == REPORT_MODE_VERBOSE) {
 			heaph_printf("\n");
 			heaph_printf("HH: found no leaks\n");
@@ -424,38 +916,49 @@ heaph_atexit(void)
 		}
 		return;
 	}
-	const struct allocation *a = allocs;
 	const int report_limit = 10;
 	int report_count = 0;
 	int64_t total_count = count;
 	uint64_t leak_size = 0;
 	int64_t total_fail_count = 0;
+	int64_t no_stack_count = 0;
 	struct symbol syms[MAX_BACKTRACE_LEN];
 	// People often do not write '\n' in the end of their program. That
 	// makes it harder to read HH output unless the latter prepends itself
 	// with a line wrap.
 	const char *prefix = "\n";
-	for (; a != NULL; a = a->next) {
+	int shard_idx = 0;
+	size_t slot_idx = 0;
+	const struct allocation *a;
+	while ((a = alloc_next(&shard_idx, &slot_idx)) != NULL) {
 		heaph_assert(count > 0);
 		if (a->depth > 1) {
 			--count;
 			continue;
 		}
-		total_fail_count += trace_resolve(a->trace, a->trace_size, syms);
-		bool is_internal = trace_is_internal(syms, a->trace_size);
+		struct stack *s = a->stack;
+		// Without a stack it can't be told if the leak is internal.
+		bool is_internal = s != NULL &&
+			stack_is_internal(s, &total_fail_count);
+		if (s == NULL)
+			++no_stack_count;
 		if (is_internal) {
 			--count;
 		} else if (report_count < report_limit) {
 			heaph_printf("%s", prefix), prefix = "";
 			heaph_printf("#### Leak %d (%zu bytes) ####\n",
 				     ++report_count, a->size);
-			for (int i = 0; i < a->trace_size; ++i)
-				heaph_printf("%d - %s\n", i, syms[i].name);
+			int trace_size = s == NULL ? 0 : s->trace_size;
+			if (trace_size > 0)
+				trace_resolve(s->trace, trace_size, syms);
+			for (int i = 0; i < trace_size; ++i)
+				symbol_print(i, &syms[i]);
 		}
 		if (!is_internal)
 			leak_size += a->size;
 	}
-	spinlock_rel(&allocs_lock);
+	for (int i = 0; i < ALLOCATION_SHARD_COUNT; ++i)
+		spinlock_rel(&alloc_shards[i].lock);
 
 	if (total_fail_count > 0) {
 		heaph_printf("\nHH: dladdr() failure %lld times\n",
@@ -476,6 +979,11 @@ heaph_atexit(void)
 		heaph_printf("HH: only first %d reports are shown\n",
 			     report_count);
 	}
+	if (no_stack_count != 0 && backtrace_mode == BACKTRACE_ON) {
+		heaph_printf("HH: %lld leaks are not sampled, have no stacks "
+			     "and might be internal\n",
+			     (long long)no_stack_count);
+	}
 	heaph_printf("HH: total allocation count - %llu\n",
 		     (long long)alloc_count_total);
 }
@@ -491,6 +999,12 @@ heaph_init(void)
 	void (*sym_free)(void *) = dlsym(RTLD_NEXT, "free");
 	void *(*sym_calloc)(size_t, size_t) = dlsym(RTLD_NEXT, "calloc");
 	void *(*sym_realloc)(void *, size_t) = dlsym(RTLD_NEXT, "realloc");
+	int (*sym_posix_memalign)(void **, size_t, size_t) =
+		dlsym(RTLD_NEXT, "posix_memalign");
+	void *(*sym_aligned_alloc)(size_t, size_t) =
+		dlsym(RTLD_NEXT, "aligned_alloc");
+	void *(*sym_memalign)(size_t, size_t) = dlsym(RTLD_NEXT, "memalign");
+	void *(*sym_valloc)(size_t) = dlsym(RTLD_NEXT, "valloc");
 	char *(*sym_strdup)(const char *) = dlsym(RTLD_NEXT, "strdup");
 	ssize_t (*sym_getline)(char **, size_t *, FILE *) =
 		dlsym(RTLD_NEXT, "getline");
@@ -504,6 +1018,10 @@ heaph_init(void)
 	default_free = sym_free;
 	default_calloc = sym_calloc;
 	default_realloc = sym_realloc;
+	default_posix_memalign = sym_posix_memalign;
+	default_aligned_alloc = sym_aligned_alloc;
+	default_memalign = sym_memalign;
+	default_valloc = sym_valloc;
 	default_strdup = sym_strdup;
 	default_getline = sym_getline;
 	default_getaddrinfo = sym_getaddrinfo;
@@ -517,6 +1035,8 @@ heaph_init(void)
 			report_mode = REPORT_MODE_LEAKS;
 		else if (strcmp(hh_report, "q") == 0)
 			report_mode = REPORT_MODE_QUIET;
+		else if (strcmp(hh_report, "p") == 0)
+			report_mode = REPORT_MODE_PROFILE;
 	}
 
 	const char *hh_content = getenv("HHCONTENT");
@@ -534,6 +1054,17 @@ heaph_init(void)
 		else if (strcmp(bt_mode, "off") == 0)
 			backtrace_mode = BACKTRACE_OFF;
 	}
+
+	const char *hh_sample = getenv("HHSAMPLE");
+	if (hh_sample != NULL) {
+		int rate = atoi(hh_sample);
+		if (rate > 0)
+			sample_rate = rate;
+	}
+	stack_table = mmap(NULL, sizeof(*stack_table) << STACK_TABLE_BITS,
+			   PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,
+			   -1, 0);
+	heaph_assert(stack_table != MAP_FAILED);
 	atexit(heaph_atexit);
 }
 
@@ -654,6 +1185,63 @@ realloc(void *ptr, size_t size)
 	return res;
 }
 
+// The aligned allocations are freed by the same free(). Without them being
+// traced that would be a free of an unknown memory. The preloaded tool sees
+// them from all the libraries, like the aligned operator new of C++.
+static void *
+aligned_trace_new(void *res, size_t size)
+{
+	if (res != NULL) {
+		alloc_trace_new(res, size);
+		if (content_mode == CONTENT_MODE_TRASH)
+			memset(res, '#', size);
+	}
+	return res;
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	heaph_touch();
+	++depth;
+	int rc = default_posix_memalign(memptr, alignment, size);
+	if (rc == 0)
+		aligned_trace_new(*memptr, size);
+	--depth;
+	return rc;
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	heaph_touch();
+	++depth;
+	void *res = aligned_trace_new(default_aligned_alloc(alignment, size),
+				      size);
+	--depth;
+	return res;
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+	heaph_touch();
+	++depth;
+	void *res = aligned_trace_new(default_memalign(alignment, size), size);
+	--depth;
+	return res;
+}
+
+void *
+valloc(size_t size)
+{
+	heaph_touch();
+	++depth;
+	void *res = aligned_trace_new(default_valloc(size), size);
+	--depth;
+	return res;
+}
+
 void
 free(void *ptr)
 {
@@ -699,8 +1287,98 @@ freeaddrinfo(struct addrinfo *ai)
 uint64_t
 heaph_get_alloc_count(void)
 {
-	spinlock_acq(&allocs_lock);
-	uint64_t res = alloc_count;
-	spinlock_rel(&allocs_lock);
-	return res;
+	return __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+}
+
+uint64_t
+heaph_get_alloc_count_total(void)
+{
+	return __atomic_load_n(&alloc_count_total, __ATOMIC_RELAXED);
+}
+
+uint64_t
+heaph_snapshot(void)
+{
+	return heaph_get_alloc_count_total();
+}
+
+uint64_t
+heaph_diff(uint64_t from, uint64_t to)
+{
+	heaph_touch();
+	heaph_assert(from <= to);
+	spinlock_acq(&diff_lock);
+	struct stack *stacks = NULL;
+	uint64_t count = 0;
+	uint64_t size = 0;
+	uint64_t no_stack_count = 0;
+	uint64_t no_stack_size = 0;
+	// Only collect under the shard locks. The printing below might
+	// allocate, and the allocations would need the shards.
+	for (int i = 0; i < ALLOCATION_SHARD_COUNT; ++i)
+		spinlock_acq(&alloc_shards[i].lock);
+	int shard_idx = 0;
+	size_t slot_idx = 0;
+	const struct allocation *a;
+	while ((a = alloc_next(&shard_idx, &slot_idx)) != NULL) {
+		if (a->depth > 1 || a->seq < from || a->seq >= to)
+			continue;
+		++count;
+		size += a->size;
+		struct stack *s = a->stack;
+		if (s == NULL) {
+			++no_stack_count;
+			no_stack_size += a->size;
+			continue;
+		}
+		if (s->diff_count++ == 0) {
+			s->diff_next = stacks;
+			stacks = s;
+		}
+		s->diff_size += a->size;
+	}
+	for (int i = 0; i < ALLOCATION_SHARD_COUNT; ++i)
+		spinlock_rel(&alloc_shards[i].lock);
+
+	struct stack *top[DIFF_REPORT_LIMIT];
+	int top_count = 0;
+	uint64_t site_count = 0;
+	for (struct stack *s = stacks; s != NULL; s = s->diff_next) {
+		++site_count;
+		stack_top_add(top, &top_count, DIFF_REPORT_LIMIT, s,
+			      stack_diff_size);
+	}
+	if (report_mode != REPORT_MODE_QUIET && count > 0) {
+		heaph_printf("\n");
+		heaph_printf("HH: %llu allocations (%llu bytes) from %llu "
+			     "sites are alive since the snapshot\n",
+			     (long long)count, (long long)size,
+			     (long long)site_count);
+		for (int i = 0; i < top_count; ++i) {
+			struct stack *s = top[i];
+			heaph_printf("#### Site %d: %llu allocations, "
+				     "%llu bytes ####\n", i + 1,
+				     (long long)s->diff_count,
+				     (long long)s->diff_size);
+			stack_print(s);
+		}
+		if ((uint64_t)top_count < site_count) {
+			heaph_printf("HH: only first %d sites are shown\n",
+				     top_count);
+		}
+		if (no_stack_count > 0) {
+			heaph_printf("HH: %llu allocations (%llu bytes) have "
+				     "no stacks\n", (long long)no_stack_count,
+				     (long long)no_stack_size);
+		}
+	}
+	while (stacks != NULL) {
+		struct stack *s = stacks;
+		stacks = s->diff_next;
+		s->diff_count = 0;
+		s->diff_size = 0;
+		s->diff_next = NULL;
+	}
+	spinlock_rel(&diff_lock);
+	return count;
 }
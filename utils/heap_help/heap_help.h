@@ -2,5 +2,32 @@
 
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 uint64_t
 heaph_get_alloc_count(void);
+
+/** All allocations done so far, including the freed ones. */
+uint64_t
+heaph_get_alloc_count_total(void);
+
+/**
+ * Mark of the allocations done so far. To be passed to heaph_diff() later.
+ */
+uint64_t
+heaph_snapshot(void);
+
+/**
+ * Print the allocations done between the two snapshots and still alive,
+ * grouped by their stacks, the most bytes first. Returns their count. A
+ * steady state code which doesn't grow the heap gets 0 between its
+ * snapshots.
+ */
+uint64_t
+heaph_diff(uint64_t from, uint64_t to);
+
+#ifdef __cplusplus
+}
+#endif
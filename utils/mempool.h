@@ -0,0 +1,322 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Pool of the objects of one size. The objects are carved from big
+ * chunks and the freed ones go to a free list, so an allocation is a
+ * pop and a free is a push. The chunks are only freed with the pool.
+ *
+ * The pool is shared by the threads under a mutex. A thread with many
+ * allocations takes a cache, which moves the objects from and to the
+ * pool in batches, so the mutex is taken once per a batch. A cache is
+ * used by one thread at a time, for example a thread_local one.
+ *
+ * heap_help sees only the chunks, so when it is linked in, the pool
+ * does a malloc() and a free() per object. Then the leaks and the
+ * stacks are reported per object, the same as without the pool, and
+ * the freed objects are trashed. ALLOC_USE_MALLOC set to 1 or 0 forces
+ * it on or off, for example for ASAN.
+ */
+struct mempool_chunk {
+	struct mempool_chunk *next;
+};
+
+/** A free object, the link is in its own memory. */
+struct mempool_free_obj {
+	struct mempool_free_obj *next;
+};
+
+struct mempool {
+	pthread_mutex_t mutex;
+	struct mempool_free_obj *free_list;
+	struct mempool_chunk *chunks;
+	/** The part of the newest chunk never allocated yet. */
+	char *fresh_pos;
+	char *fresh_end;
+	size_t obj_size;
+	size_t chunk_size;
+	/** Objects allocated and not freed, the caches included. */
+	size_t used_count;
+};
+
+struct mempool_cache {
+	struct mempool *pool;
+	struct mempool_free_obj *free_list;
+	uint32_t count;
+};
+
+enum {
+	/** Alignment of each object, enough for any type. */
+	MEMPOOL_ALIGN = 16,
+	/** A chunk fits at least that many objects. */
+	MEMPOOL_CHUNK_MIN_OBJ_COUNT = 32,
+	MEMPOOL_CHUNK_MIN_SIZE = 64 * 1024,
+	/** Objects to keep in a cache, half of it is moved at once. */
+	MEMPOOL_CACHE_SIZE = 64,
+	MEMPOOL_CACHE_BATCH = MEMPOOL_CACHE_SIZE / 2,
+};
+
+#ifndef ALLOC_USE_MALLOC
+#if defined(__ELF__) && defined(__GNUC__)
+/** Defined only when heap_help is linked in. */
+uint64_t
+heaph_get_alloc_count(void) __attribute__((weak));
+#endif
+#endif /* ALLOC_USE_MALLOC */
+
+/**
+ * return TRUE if each object is a malloc() of its own
+ */
+static inline bool
+mempool_use_malloc(void)
+{
+#if defined(ALLOC_USE_MALLOC)
+	return ALLOC_USE_MALLOC;
+#elif defined(__ELF__) && defined(__GNUC__)
+	return heaph_get_alloc_count != NULL;
+#else
+	return false;
+#endif
+}
+
+static inline size_t
+mempool_align_up(size_t size)
+{
+	return (size + MEMPOOL_ALIGN - 1) & ~(size_t)(MEMPOOL_ALIGN - 1);
+}
+
+/** Offset of the first object in a chunk. */
+#define MEMPOOL_CHUNK_HEADER_SIZE mempool_align_up(sizeof(struct mempool_chunk))
+
+/**
+ * init pool of the objects of obj_size bytes
+ */
+static inline void
+mempool_create(struct mempool *pool, size_t obj_size)
+{
+	if (obj_size < sizeof(struct mempool_free_obj))
+		obj_size = sizeof(struct mempool_free_obj);
+	pool->obj_size = mempool_align_up(obj_size);
+	size_t chunk_size = MEMPOOL_CHUNK_HEADER_SIZE +
+		pool->obj_size * MEMPOOL_CHUNK_MIN_OBJ_COUNT;
+	if (chunk_size < MEMPOOL_CHUNK_MIN_SIZE)
+		chunk_size = MEMPOOL_CHUNK_MIN_SIZE;
+	pool->chunk_size = chunk_size;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pool->free_list = NULL;
+	pool->chunks = NULL;
+	pool->fresh_pos = NULL;
+	pool->fresh_end = NULL;
+	pool->used_count = 0;
+}
+
+/**
+ * free all pool's memory, including the objects not freed yet. Not in
+ * the malloc() mode, where those are leaks.
+ */
+static inline void
+mempool_destroy(struct mempool *pool)
+{
+	struct mempool_chunk *chunk = pool->chunks;
+	while (chunk != NULL) {
+		struct mempool_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	pool->chunks = NULL;
+	pool->free_list = NULL;
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+/** Take an object from the pool, the mutex is locked. */
+static inline void *
+mempool_alloc_locked(struct mempool *pool)
+{
+	struct mempool_free_obj *obj = pool->free_list;
+	if (obj != NULL) {
+		pool->free_list = obj->next;
+		return obj;
+	}
+	if (pool->fresh_pos == pool->fresh_end) {
+		struct mempool_chunk *chunk = (struct mempool_chunk *)
+			malloc(pool->chunk_size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->next = pool->chunks;
+		pool->chunks = chunk;
+		char *begin = (char *)chunk + MEMPOOL_CHUNK_HEADER_SIZE;
+		size_t count = (pool->chunk_size - MEMPOOL_CHUNK_HEADER_SIZE) /
+			pool->obj_size;
+		pool->fresh_pos = begin;
+		pool->fresh_end = begin + count * pool->obj_size;
+	}
+	void *res = pool->fresh_pos;
+	pool->fresh_pos += pool->obj_size;
+	return res;
+}
+
+/**
+ * allocate an object, NULL when out of memory
+ */
+static inline void *
+mempool_alloc(struct mempool *pool)
+{
+	if (mempool_use_malloc()) {
+		void *res = malloc(pool->obj_size);
+		if (res != NULL)
+			__atomic_add_fetch(&pool->used_count, 1,
+					   __ATOMIC_RELAXED);
+		return res;
+	}
+	pthread_mutex_lock(&pool->mutex);
+	void *res = mempool_alloc_locked(pool);
+	if (res != NULL)
+		++pool->used_count;
+	pthread_mutex_unlock(&pool->mutex);
+	return res;
+}
+
+/**
+ * free an object of the pool
+ */
+static inline void
+mempool_free(struct mempool *pool, void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	if (mempool_use_malloc()) {
+		free(ptr);
+		__atomic_sub_fetch(&pool->used_count, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	struct mempool_free_obj *obj = (struct mempool_free_obj *)ptr;
+	pthread_mutex_lock(&pool->mutex);
+	obj->next = pool->free_list;
+	pool->free_list = obj;
+	--pool->used_count;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * return count of the objects out of the pool, the cached ones
+ * included. 0 when all the objects were freed and the caches flushed.
+ */
+static inline size_t
+mempool_used_count(struct mempool *pool)
+{
+	return __atomic_load_n(&pool->used_count, __ATOMIC_RELAXED);
+}
+
+/**
+ * init cache of the pool, empty
+ */
+static inline void
+mempool_cache_create(struct mempool_cache *cache, struct mempool *pool)
+{
+	cache->pool = pool;
+	cache->free_list = NULL;
+	cache->count = 0;
+}
+
+/** Move up to count objects from the cache to the pool. */
+static inline void
+mempool_cache_drain(struct mempool_cache *cache, uint32_t count)
+{
+	struct mempool *pool = cache->pool;
+	pthread_mutex_lock(&pool->mutex);
+	for (; count > 0 && cache->count > 0; --count) {
+		struct mempool_free_obj *obj = cache->free_list;
+		cache->free_list = obj->next;
+		--cache->count;
+		obj->next = pool->free_list;
+		pool->free_list = obj;
+		--pool->used_count;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * return all the cached objects to the pool. Must be called before the
+ * cache is dropped, for example at the thread exit.
+ */
+static inline void
+mempool_cache_flush(struct mempool_cache *cache)
+{
+	if (cache->count > 0)
+		mempool_cache_drain(cache, cache->count);
+}
+
+/** Take a batch of objects from the pool, the cache is empty. */
+static inline void *
+mempool_cache_alloc_slow(struct mempool_cache *cache)
+{
+	struct mempool *pool = cache->pool;
+	pthread_mutex_lock(&pool->mutex);
+	void *res = mempool_alloc_locked(pool);
+	if (res == NULL) {
+		pthread_mutex_unlock(&pool->mutex);
+		return NULL;
+	}
+	/* The batch is counted as used, until it comes back. */
+	while (cache->count < MEMPOOL_CACHE_BATCH) {
+		struct mempool_free_obj *obj = (struct mempool_free_obj *)
+			mempool_alloc_locked(pool);
+		if (obj == NULL)
+			break;
+		obj->next = cache->free_list;
+		cache->free_list = obj;
+		++cache->count;
+	}
+	pool->used_count += 1 + cache->count;
+	pthread_mutex_unlock(&pool->mutex);
+	return res;
+}
+
+/**
+ * allocate an object through the cache, NULL when out of memory
+ */
+static inline void *
+mempool_cache_alloc(struct mempool_cache *cache)
+{
+	if (mempool_use_malloc())
+		return mempool_alloc(cache->pool);
+	struct mempool_free_obj *obj = cache->free_list;
+	if (obj == NULL)
+		return mempool_cache_alloc_slow(cache);
+	cache->free_list = obj->next;
+	--cache->count;
+	return obj;
+}
+
+/**
+ * free an object of the cache's pool through the cache
+ */
+static inline void
+mempool_cache_free(struct mempool_cache *cache, void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	if (mempool_use_malloc()) {
+		mempool_free(cache->pool, ptr);
+		return;
+	}
+	if (cache->count == MEMPOOL_CACHE_SIZE)
+		mempool_cache_drain(cache, MEMPOOL_CACHE_BATCH);
+	struct mempool_free_obj *obj = (struct mempool_free_obj *)ptr;
+	obj->next = cache->free_list;
+	cache->free_list = obj;
+	++cache->count;
+}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
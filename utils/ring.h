@@ -0,0 +1,163 @@
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Bounded ring of pointers, a deque in one array. The items are
+ * next to each other in memory, so a traversal doesn't chase the
+ * pointers, and the items don't need a link inside. The memory is
+ * given by the user, the ring never allocates.
+ *
+ * The positions are the free running counters, wrapped by the mask
+ * only on access. So the size is just their difference, and a full
+ * ring is not confused with an empty one.
+ */
+struct ring {
+	void **items;
+	/** The capacity minus 1. The capacity is a power of 2. */
+	uint32_t mask;
+	/** Position of the first item. */
+	uint32_t head;
+	/** Position after the last item. */
+	uint32_t tail;
+};
+
+/**
+ * init ring on the user's array of the given capacity, a power of 2
+ */
+static inline void
+ring_create(struct ring *ring, void **items, uint32_t capacity)
+{
+	assert(capacity != 0 && (capacity & (capacity - 1)) == 0);
+	ring->items = items;
+	ring->mask = capacity - 1;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+/**
+ * return count of items in the ring
+ */
+static inline uint32_t
+ring_size(const struct ring *ring)
+{
+	return ring->tail - ring->head;
+}
+
+/**
+ * return max count of items in the ring
+ */
+static inline uint32_t
+ring_capacity(const struct ring *ring)
+{
+	return ring->mask + 1;
+}
+
+/**
+ * return TRUE if ring is empty
+ */
+static inline int
+ring_empty(const struct ring *ring)
+{
+	return ring->tail == ring->head;
+}
+
+/**
+ * return TRUE if ring is full
+ */
+static inline int
+ring_full(const struct ring *ring)
+{
+	return ring_size(ring) == ring_capacity(ring);
+}
+
+/**
+ * add item to ring head
+ * @pre the ring is not full
+ */
+static inline void
+ring_add(struct ring *ring, void *item)
+{
+	assert(!ring_full(ring));
+	ring->items[--ring->head & ring->mask] = item;
+}
+
+/**
+ * add item to ring tail
+ * @pre the ring is not full
+ */
+static inline void
+ring_add_tail(struct ring *ring, void *item)
+{
+	assert(!ring_full(ring));
+	ring->items[ring->tail++ & ring->mask] = item;
+}
+
+/**
+ * remove the first item and return it
+ * @pre the ring is not empty
+ */
+static inline void *
+ring_shift(struct ring *ring)
+{
+	assert(!ring_empty(ring));
+	return ring->items[ring->head++ & ring->mask];
+}
+
+/**
+ * remove the last item and return it
+ * @pre the ring is not empty
+ */
+static inline void *
+ring_shift_tail(struct ring *ring)
+{
+	assert(!ring_empty(ring));
+	return ring->items[--ring->tail & ring->mask];
+}
+
+/**
+ * return item by its index from the head
+ * @pre the index is less than the size
+ */
+static inline void *
+ring_get(const struct ring *ring, uint32_t idx)
+{
+	assert(idx < ring_size(ring));
+	return ring->items[(ring->head + idx) & ring->mask];
+}
+
+/**
+ * return first item
+ * @pre the ring is not empty
+ */
+static inline void *
+ring_first(const struct ring *ring)
+{
+	return ring_get(ring, 0);
+}
+
+/**
+ * return last item
+ * @pre the ring is not empty
+ */
+static inline void *
+ring_last(const struct ring *ring)
+{
+	return ring_get(ring, ring_size(ring) - 1);
+}
+
+/**
+ * foreach through all ring items by index
+ */
+#define ring_foreach(item, idx, ring)					\
+	for ((idx) = 0; (idx) < ring_size(ring) &&			\
+	     ((item) = ring_get((ring), (idx)), 1); ++(idx))
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "rlist.h"
+
+#include <stddef.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Singly linked tail queue. A FIFO with half the links of rlist
+ * and one pointer write less per push and pop. But the entries
+ * can't be removed from the middle, only from the head.
+ */
+struct stailq_entry {
+	struct stailq_entry *next;
+};
+
+struct stailq {
+	struct stailq_entry *first;
+	/** The next link of the last entry, or the first of the head. */
+	struct stailq_entry **last;
+};
+
+/**
+ * init queue head
+ */
+static inline void
+stailq_create(struct stailq *head)
+{
+	head->first = NULL;
+	head->last = &head->first;
+}
+
+/**
+ * return TRUE if queue is empty
+ */
+static inline int
+stailq_empty(const struct stailq *head)
+{
+	return head->first == NULL;
+}
+
+/**
+ * add item to queue head
+ */
+static inline void
+stailq_add(struct stailq *head, struct stailq_entry *item)
+{
+	if ((item->next = head->first) == NULL)
+		head->last = &item->next;
+	head->first = item;
+}
+
+/**
+ * add item to queue tail
+ */
+static inline void
+stailq_add_tail(struct stailq *head, struct stailq_entry *item)
+{
+	item->next = NULL;
+	*head->last = item;
+	head->last = &item->next;
+}
+
+/**
+ * remove the first item and return it
+ * @pre the queue is not empty
+ */
+static inline struct stailq_entry *
+stailq_shift(struct stailq *head)
+{
+	struct stailq_entry *shift = head->first;
+	if ((head->first = shift->next) == NULL)
+		head->last = &head->first;
+	return shift;
+}
+
+/**
+ * return first element, NULL if empty
+ */
+static inline struct stailq_entry *
+stailq_first(const struct stailq *head)
+{
+	return head->first;
+}
+
+/**
+ * return last element, NULL if empty
+ */
+static inline struct stailq_entry *
+stailq_last(const struct stailq *head)
+{
+	if (head->first == NULL)
+		return NULL;
+	/* The link is the first member, so it is the entry itself. */
+	return (struct stailq_entry *)head->last;
+}
+
+/**
+ * return next element, NULL for the last one
+ */
+static inline struct stailq_entry *
+stailq_next(const struct stailq_entry *item)
+{
+	return item->next;
+}
+
+/**
+ * move all items of queue src to the tail of queue dest
+ */
+static inline void
+stailq_concat(struct stailq *dest, struct stailq *src)
+{
+	if (src->first == NULL)
+		return;
+	*dest->last = src->first;
+	dest->last = src->last;
+	stailq_create(src);
+}
+
+/**
+ * queue head initializer
+ */
+#define STAILQ_HEAD_INITIALIZER(name) { NULL, &(name).first }
+
+/**
+ * allocate and init head of queue
+ */
+#define STAILQ_HEAD(name)	\
+	struct stailq name = STAILQ_HEAD_INITIALIZER(name)
+
+/**
+ * return entry by queue item
+ */
+#define stailq_entry(item, type, member)				\
+	rlist_entry(item, type, member)
+
+/**
+ * return entry by queue item, NULL if the item is NULL
+ */
+#define stailq_entry_safe(item, type, member) ({			\
+	struct stailq_entry *__item = (item);				\
+	__item == NULL ? NULL : stailq_entry(__item, type, member);	\
+})
+
+/**
+ * return first entry, NULL if empty
+ */
+#define stailq_first_entry(head, type, member)				\
+	stailq_entry_safe(stailq_first(head), type, member)
+
+/**
+ * return last entry, NULL if empty
+ */
+#define stailq_last_entry(head, type, member)				\
+	stailq_entry_safe(stailq_last(head), type, member)
+
+/**
+ * return next entry, NULL for the last one
+ */
+#define stailq_next_entry(item, member)					\
+	stailq_entry_safe(stailq_next(&(item)->member), typeof(*item),	\
+			  member)
+
+/**
+ * Remove one element from the queue and return it
+ * @pre the queue is not empty
+ */
+#define stailq_shift_entry(head, type, member)				\
+	stailq_entry(stailq_shift(head), type, member)
+
+/**
+ * add entry to queue
+ */
+#define stailq_add_entry(head, item, member)				\
+	stailq_add((head), &(item)->member)
+
+/**
+ * add entry to queue tail
+ */
+#define stailq_add_tail_entry(head, item, member)			\
+	stailq_add_tail((head), &(item)->member)
+
+/**
+ * foreach through all queue entries
+ */
+#define stailq_foreach_entry(item, head, member)			\
+	for (item = stailq_first_entry((head), typeof(*item), member);	\
+	     item != NULL;						\
+	     item = stailq_next_entry((item), member))
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -0,0 +1,153 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum {
+	/** Events per thread, a power of 2. 32 bytes each. */
+	TRACE_RING_SIZE = 1 << 16,
+	TRACE_RING_MASK = TRACE_RING_SIZE - 1,
+};
+
+struct trace_record {
+	uint64_t ts;
+	const char *name;
+	int64_t arg;
+	enum trace_phase phase;
+};
+
+/**
+ * Ring of a thread. Written only by its thread. Never freed, so the
+ * events of the exited threads are flushed too.
+ */
+struct trace_ring {
+	/** Next in the list of all the rings. */
+	struct trace_ring *next;
+	uint32_t tid;
+	/** Count of the events ever written. Atomic. */
+	uint64_t pos;
+	struct trace_record records[TRACE_RING_SIZE];
+};
+
+static struct trace_ring *trace_rings = NULL;
+static uint32_t trace_tid_last = 0;
+static bool trace_is_atexit_set = false;
+static __thread struct trace_ring *trace_this = NULL;
+
+static uint64_t
+trace_now_ns(void)
+{
+	struct timespec ts;
+	/* Not slewed by NTP, only the intervals matter. */
+#if defined(CLOCK_MONOTONIC_RAW)
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+trace_atexit(void)
+{
+	const char *path = getenv("TRACE_FILE");
+	if (path == NULL)
+		path = "trace.json";
+	if (trace_flush(path) != 0)
+		fprintf(stderr, "trace: couldn't write %s\n", path);
+}
+
+static struct trace_ring *
+trace_ring_new(void)
+{
+	struct trace_ring *ring = malloc(sizeof(*ring));
+	if (ring == NULL)
+		abort();
+	ring->pos = 0;
+	ring->tid = __atomic_add_fetch(&trace_tid_last, 1, __ATOMIC_RELAXED);
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring,
+					    true, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED));
+	if (!__atomic_test_and_set(&trace_is_atexit_set, __ATOMIC_RELAXED))
+		atexit(trace_atexit);
+	trace_this = ring;
+	return ring;
+}
+
+void
+trace_event(enum trace_phase phase, const char *name, int64_t arg)
+{
+	struct trace_ring *ring = trace_this;
+	if (ring == NULL)
+		ring = trace_ring_new();
+	uint64_t pos = ring->pos;
+	struct trace_record *r = &ring->records[pos & TRACE_RING_MASK];
+	r->ts = trace_now_ns();
+	r->name = name;
+	r->arg = arg;
+	r->phase = phase;
+	__atomic_store_n(&ring->pos, pos + 1, __ATOMIC_RELEASE);
+}
+
+/** The rings keep the latest events, some of them might be gone. */
+static uint64_t
+trace_ring_begin(uint64_t end)
+{
+	return end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+}
+
+int
+trace_flush(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	struct trace_ring *rings = __atomic_load_n(&trace_rings,
+						   __ATOMIC_ACQUIRE);
+	/* The times are from the first event, easier to read. */
+	uint64_t start = UINT64_MAX;
+	for (struct trace_ring *ring = rings; ring != NULL; ring = ring->next) {
+		uint64_t end = __atomic_load_n(&ring->pos, __ATOMIC_ACQUIRE);
+		if (end == 0)
+			continue;
+		uint64_t ts = ring->records[trace_ring_begin(end) &
+					    TRACE_RING_MASK].ts;
+		if (ts < start)
+			start = ts;
+	}
+	fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+	const char *sep = "\n";
+	for (struct trace_ring *ring = rings; ring != NULL; ring = ring->next) {
+		uint64_t end = __atomic_load_n(&ring->pos, __ATOMIC_ACQUIRE);
+		for (uint64_t i = trace_ring_begin(end); i < end; ++i) {
+			const struct trace_record *r =
+				&ring->records[i & TRACE_RING_MASK];
+			uint64_t ts = r->ts > start ? r->ts - start : 0;
+			fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"%c\", "
+				"\"ts\": %llu.%03llu, \"pid\": 1, \"tid\": %u",
+				sep, r->name, (char)r->phase,
+				(unsigned long long)(ts / 1000),
+				(unsigned long long)(ts % 1000), ring->tid);
+			if (r->phase == TRACE_PHASE_INSTANT)
+				fprintf(f, ", \"s\": \"t\"");
+			if (r->phase != TRACE_PHASE_END) {
+				fprintf(f, ", \"args\": {\"arg\": %lld}",
+					(long long)r->arg);
+			}
+			fprintf(f, "}");
+			sep = ",\n";
+		}
+	}
+	fprintf(f, "\n]}\n");
+	if (ferror(f) != 0) {
+		int err = errno;
+		fclose(f);
+		errno = err;
+		return -1;
+	}
+	return fclose(f) == 0 ? 0 : -1;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Tracing of the hot paths into a timeline. Each thread writes the
+ * events into its own ring, without locks and without formatting.
+ * At exit the rings are written as a Chrome trace JSON, to be opened
+ * in chrome://tracing or ui.perfetto.dev. The file is trace.json, or
+ * the one in the TRACE_FILE environment variable.
+ *
+ * The macros compile to nothing unless TRACE_ENABLE is 1, then
+ * trace.c must be built in too. Their names must be string literals,
+ * only the pointers are stored. When a ring is full, the oldest
+ * events are overwritten.
+ */
+#ifndef TRACE_ENABLE
+#define TRACE_ENABLE 0
+#endif
+
+enum trace_phase {
+	TRACE_PHASE_BEGIN = 'B',
+	TRACE_PHASE_END = 'E',
+	TRACE_PHASE_INSTANT = 'i',
+};
+
+/** Add the event to the thread's ring. */
+void
+trace_event(enum trace_phase phase, const char *name, int64_t arg);
+
+/**
+ * Write all the rings into the file. The events written by the other
+ * threads meanwhile might come out corrupted, so better call it when
+ * they are idle.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+trace_flush(const char *path);
+
+#if TRACE_ENABLE
+
+/** Start of a slice of the timeline, with an argument of it. */
+#define TRACE_BEGIN(name, arg)						\
+	trace_event(TRACE_PHASE_BEGIN, (name), (int64_t)(arg))
+
+/** End of the latest started slice of the thread. */
+#define TRACE_END(name)							\
+	trace_event(TRACE_PHASE_END, (name), 0)
+
+/** A point on the timeline. */
+#define TRACE_INSTANT(name, arg)					\
+	trace_event(TRACE_PHASE_INSTANT, (name), (int64_t)(arg))
+
+#else
+
+/* The arguments are not evaluated, but still count as used. */
+#define TRACE_BEGIN(name, arg) ((void)sizeof(arg))
+#define TRACE_END(name) ((void)0)
+#define TRACE_INSTANT(name, arg) ((void)sizeof(arg))
+
+#endif /* TRACE_ENABLE */
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -3,12 +3,142 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 
-#define unit_test_start() \
-	printf("\t-------- %s started --------\n", __func__)
+/**
+ * Each test between unit_test_start() and unit_test_finish() gets its
+ * wall time measured, to catch the performance regressions in the same
+ * run as the bugs. Set up by the environment variables:
+ *
+ * UNIT_TIME=1 - print the time of each test.
+ *
+ * UNIT_BASELINE_SAVE=<path> - write the times into the file, a line
+ * "<test> <ms>" per test.
+ *
+ * UNIT_BASELINE=<path> - compare the times with the ones in the file.
+ * A test slower than in the file by more than UNIT_SLOWDOWN percents,
+ * 50 by default, fails. The tests which took less than UNIT_MIN_MS, 10
+ * by default, are too noisy to compare and are skipped.
+ */
+enum {
+	UNIT_TIMER_MAX_DEPTH = 8,
+};
 
-#define unit_test_finish() \
-	printf("\t-------- %s done --------\n", __func__)
+struct unit_timer {
+	bool is_init;
+	bool is_printed;
+	const char *baseline;
+	FILE *save;
+	double slowdown;
+	double min_ms;
+	/** The tests can be nested, like main() running all the others. */
+	uint64_t starts[UNIT_TIMER_MAX_DEPTH];
+	int depth;
+};
+
+static inline struct unit_timer *
+unit_timer(void)
+{
+	static struct unit_timer timer;
+	return &timer;
+}
+
+static inline double
+unit_env_double(const char *name, double def)
+{
+	const char *value = getenv(name);
+	if (value == NULL || *value == 0)
+		return def;
+	return atof(value);
+}
+
+static inline uint64_t
+unit_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void
+unit_timer_start(void)
+{
+	struct unit_timer *t = unit_timer();
+	if (!t->is_init) {
+		t->is_init = true;
+		t->is_printed = unit_env_double("UNIT_TIME", 0) != 0;
+		t->baseline = getenv("UNIT_BASELINE");
+		const char *path = getenv("UNIT_BASELINE_SAVE");
+		if (path != NULL && (t->save = fopen(path, "w")) == NULL) {
+			printf("Couldn't open %s\n", path);
+			exit(-1);
+		}
+		t->slowdown = unit_env_double("UNIT_SLOWDOWN", 50);
+		t->min_ms = unit_env_double("UNIT_MIN_MS", 10);
+	}
+	if (t->depth < UNIT_TIMER_MAX_DEPTH)
+		t->starts[t->depth] = unit_now_ns();
+	++t->depth;
+}
+
+/** Time of the test in the baseline file, negative if not found. */
+static inline double
+unit_baseline_find(const char *path, const char *test)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		printf("Couldn't open %s\n", path);
+		exit(-1);
+	}
+	char name[256];
+	double ms;
+	double res = -1;
+	while (fscanf(f, "%255s %lf", name, &ms) == 2) {
+		if (strcmp(name, test) == 0)
+			res = ms;
+	}
+	fclose(f);
+	return res;
+}
+
+static inline void
+unit_timer_finish(const char *test)
+{
+	struct unit_timer *t = unit_timer();
+	if (t->depth == 0 || --t->depth >= UNIT_TIMER_MAX_DEPTH)
+		return;
+	double ms = (unit_now_ns() - t->starts[t->depth]) / 1000000.0;
+	if (t->is_printed)
+		printf("# %s: %.3lf ms\n", test, ms);
+	if (t->save != NULL) {
+		fprintf(t->save, "%s %.3lf\n", test, ms);
+		/* The tests can fork and exit any moment. */
+		fflush(t->save);
+	}
+	if (t->baseline == NULL)
+		return;
+	double base = unit_baseline_find(t->baseline, test);
+	if (base < t->min_ms)
+		return;
+	double slowdown = (ms - base) * 100 / base;
+	if (slowdown > t->slowdown) {
+		printf("Test failed, %s is %.0lf%% slower than the baseline, "
+		       "%.3lf ms vs %.3lf ms\n", test, slowdown, ms, base);
+		exit(-1);
+	}
+}
+
+#define unit_test_start() do {						\
+	printf("\t-------- %s started --------\n", __func__);		\
+	unit_timer_start();						\
+} while (0)
+
+#define unit_test_finish() do {						\
+	unit_timer_finish(__func__);					\
+	printf("\t-------- %s done --------\n", __func__);		\
+} while (0)
 
 #define unit_fail_if(cond) do {						\
 	if (cond) {							\